@@ -0,0 +1,19 @@
+#!/usr/bin/env bash
+
+set -e
+
+HERE="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+CMAKE=$(which cmake)
+if [ -z "$CMAKE" ]; then
+  echo "[ERROR] Please, install cmake"
+  exit 1
+fi
+
+# Usage: bench.sh [filter] [duration_millis] [max_threads]
+# The results are written as JSON lines to stdout and to build_bench/results.json
+TARGET=${HERE}/build_bench
+cd ${HERE}/src/bench
+cmake -DCMAKE_BUILD_TYPE=Release -Wno-dev -S . -B ${TARGET}
+cmake --build ${TARGET}
+${TARGET}/ddprof-lib-bench "$@" | tee ${TARGET}/results.json
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Multi-threaded microbenchmarks of the data structures on the sampling hot path.
+// Every result is printed as one JSON object per line:
+//   {"benchmark":"...","threads":N,"ops":N,"ns_per_op":N}
+// Usage: ddprof-lib-bench [filter] [duration_millis] [max_threads]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "buffers.h"
+#include "callTraceStorage.h"
+#include "dictionary.h"
+#include "threadFilter.h"
+
+static const int TRACE_POOL_SIZE = 16384;
+static const int KEY_POOL_SIZE = 65536;
+static const int MAX_DEPTH = 256;
+
+static long _duration_millis = 1000;
+
+static inline u64 nanoTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, cheap enough not to dominate the measured operations
+static inline u64 nextRandom(u64& state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+// Skewed index in [0, size): a few entries are hit most of the time, as with hot stacks and classes
+static inline int skewedIndex(u64& state, int size) {
+    u64 r = nextRandom(state);
+    u64 a = r % size;
+    u64 b = (r >> 32) % size;
+    return (int)((a * b) / size);
+}
+
+struct Workload {
+    std::vector<std::vector<ASGCT_CallFrame> > traces;
+    std::vector<std::string> keys;
+    ThreadFilter* thread_filter;
+    CallTraceStorage* storage;
+    Dictionary* dictionary;
+};
+
+static Workload _workload;
+
+static void prepareTraces() {
+    u64 state = 0x9E3779B97F4A7C15ULL;
+    // stacks share common roots; depths are spread between a few and a couple of hundred frames
+    std::vector<ASGCT_CallFrame> root(MAX_DEPTH);
+    for (int i = 0; i < MAX_DEPTH; i++) {
+        root[i].bci = i;
+        root[i].method_id = (jmethodID)(0x10000 + (nextRandom(state) & 0xfff) * 8);
+    }
+    _workload.traces.resize(TRACE_POOL_SIZE);
+    for (int i = 0; i < TRACE_POOL_SIZE; i++) {
+        int depth = 4 + skewedIndex(state, MAX_DEPTH - 4);
+        int shared = depth / 2 + (int)(nextRandom(state) % (depth / 2 + 1));
+        std::vector<ASGCT_CallFrame>& trace = _workload.traces[i];
+        trace.resize(depth);
+        for (int j = 0; j < depth; j++) {
+            if (depth - j <= shared) {
+                trace[j] = root[MAX_DEPTH - (depth - j)];
+            } else {
+                trace[j].bci = (jint)(nextRandom(state) % 512);
+                trace[j].method_id = (jmethodID)(0x100000 + (nextRandom(state) & 0xffff) * 8);
+            }
+        }
+    }
+}
+
+static void prepareKeys() {
+    static const char* const packages[] = {"java/lang/", "java/util/concurrent/", "com/datadoghq/profiler/",
+                                           "org/springframework/web/servlet/mvc/method/annotation/", "io/netty/"};
+    u64 state = 0xD1B54A32D192ED03ULL;
+    _workload.keys.resize(KEY_POOL_SIZE);
+    char name[64];
+    for (int i = 0; i < KEY_POOL_SIZE; i++) {
+        std::string& key = _workload.keys[i];
+        key = packages[nextRandom(state) % (sizeof(packages) / sizeof(packages[0]))];
+        int segments = 1 + skewedIndex(state, 6);
+        for (int j = 0; j < segments; j++) {
+            snprintf(name, sizeof(name), "%sComponent%llx", j == 0 ? "" : "$", (unsigned long long)(nextRandom(state) & 0xfffff));
+            key += name;
+        }
+    }
+}
+
+// Performs a batch of operations and returns the number of operations done
+typedef long (*BenchFunc)(int thread_index, u64& state, long iterations);
+
+struct ThreadArgs {
+    BenchFunc func;
+    int index;
+    long iterations;
+    volatile bool* stop;
+    long ops;
+};
+
+struct Benchmark {
+    const char* name;
+    BenchFunc func;
+    void (*setup)();
+    void (*teardown)();
+};
+
+static void* runThread(void* arg) {
+    ThreadArgs* args = (ThreadArgs*)arg;
+    u64 state = 0x2545F4914F6CDD1DULL * (args->index + 1);
+    long ops = 0;
+    while (!*args->stop) {
+        ops += args->func(args->index, state, args->iterations);
+    }
+    args->ops = ops;
+    return NULL;
+}
+
+static void run(const Benchmark& bench, int threads) {
+    if (bench.setup != NULL) {
+        bench.setup();
+    }
+
+    volatile bool stop = false;
+    std::vector<pthread_t> ids(threads);
+    std::vector<ThreadArgs> args(threads);
+    u64 start = nanoTime();
+    for (int i = 0; i < threads; i++) {
+        args[i].func = bench.func;
+        args[i].index = i;
+        args[i].iterations = 256;
+        args[i].stop = &stop;
+        args[i].ops = 0;
+        pthread_create(&ids[i], NULL, runThread, &args[i]);
+    }
+
+    struct timespec sleep_time = {_duration_millis / 1000, (_duration_millis % 1000) * 1000000};
+    nanosleep(&sleep_time, NULL);
+    stop = true;
+
+    long ops = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        ops += args[i].ops;
+    }
+    u64 elapsed = nanoTime() - start;
+
+    // ns_per_op is the wall time of a single operation on one thread
+    printf("{\"benchmark\":\"%s\",\"threads\":%d,\"ops\":%ld,\"ns_per_op\":%.2f}\n",
+           bench.name, threads, ops, ops == 0 ? 0.0 : (double)elapsed * threads / ops);
+    fflush(stdout);
+
+    if (bench.teardown != NULL) {
+        bench.teardown();
+    }
+}
+
+static void setupStorage() {
+    _workload.storage = new CallTraceStorage();
+}
+
+static void teardownStorage() {
+    delete _workload.storage;
+    _workload.storage = NULL;
+}
+
+static long benchStoragePut(int thread_index, u64& state, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        std::vector<ASGCT_CallFrame>& trace = _workload.traces[skewedIndex(state, TRACE_POOL_SIZE)];
+        _workload.storage->put((int)trace.size(), &trace[0], false, 1);
+    }
+    return iterations;
+}
+
+static void setupDictionary() {
+    _workload.dictionary = new Dictionary();
+}
+
+static void teardownDictionary() {
+    delete _workload.dictionary;
+    _workload.dictionary = NULL;
+}
+
+static long benchDictionaryLookup(int thread_index, u64& state, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        const std::string& key = _workload.keys[skewedIndex(state, KEY_POOL_SIZE)];
+        _workload.dictionary->lookup(key.c_str(), key.length());
+    }
+    return iterations;
+}
+
+static long benchBufferPutVar64(int thread_index, u64& state, long iterations) {
+    static __thread RecordingBuffer* buf = NULL;
+    if (buf == NULL) {
+        buf = new RecordingBuffer();
+    }
+    for (long i = 0; i < iterations; i++) {
+        if (buf->offset() >= RECORDING_BUFFER_LIMIT) {
+            buf->reset();
+        }
+        // mix of small ids and full width timestamps
+        u64 r = nextRandom(state);
+        buf->putVar64((r & 1) ? (r >> 48) : r);
+    }
+    return iterations;
+}
+
+static void setupThreadFilter() {
+    _workload.thread_filter = new ThreadFilter();
+    _workload.thread_filter->init("");
+    for (int tid = 1; tid < 32768; tid += 3) {
+        _workload.thread_filter->add(tid);
+    }
+}
+
+static void teardownThreadFilter() {
+    delete _workload.thread_filter;
+    _workload.thread_filter = NULL;
+}
+
+static long benchThreadFilterAccept(int thread_index, u64& state, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        _workload.thread_filter->accept(1 + (int)(nextRandom(state) % 32768));
+    }
+    return iterations;
+}
+
+static long benchThreadFilterCollect(int thread_index, u64& state, long iterations) {
+    std::vector<int> tids;
+    tids.reserve(16384);
+    // collect is expensive; a single call per batch keeps the stop flag responsive
+    _workload.thread_filter->collect(tids);
+    return 1;
+}
+
+static const Benchmark BENCHMARKS[] = {
+    {"CallTraceStorage::put", benchStoragePut, setupStorage, teardownStorage},
+    {"Dictionary::lookup", benchDictionaryLookup, setupDictionary, teardownDictionary},
+    {"Buffer::putVar64", benchBufferPutVar64, NULL, NULL},
+    {"ThreadFilter::accept", benchThreadFilterAccept, setupThreadFilter, teardownThreadFilter},
+    {"ThreadFilter::collect", benchThreadFilterCollect, setupThreadFilter, teardownThreadFilter},
+};
+
+int main(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : NULL;
+    if (argc > 2) {
+        _duration_millis = atol(argv[2]);
+    }
+    int max_threads = argc > 3 ? atoi(argv[3]) : 64;
+
+    prepareTraces();
+    prepareKeys();
+
+    for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+        const Benchmark& bench = BENCHMARKS[i];
+        if (filter != NULL && strstr(bench.name, filter) == NULL) {
+            continue;
+        }
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            run(bench, threads);
+        }
+    }
+    return 0;
+}
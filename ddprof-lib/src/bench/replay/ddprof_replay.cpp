@@ -0,0 +1,318 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays the snapshots of a capture file (see the capture=PATH option) through the JFR writer,
+// without a JVM: JVMTI answers the method lookups from the capture, so the serialization of the
+// constant pools can be profiled and compared between builds on the same input.
+// Every snapshot is replayed as one chunk per iteration, then one JSON object per snapshot is printed:
+//   {"snapshot":N,"traces":N,"methods":N,"iterations":N,"first_dump_ns":N,"min_dump_ns":N,"mean_dump_ns":N,
+//    "cpool_write_ns":N,"bytes":N}
+// where bytes is the size of the last chunk written to the output, unknown for the default /dev/null.
+// Usage: ddprof-lib-replay CAPTURE [iterations] [output]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "counters.h"
+#include "os.h"
+#include "profiler.h"
+#include "sampleCapture.h"
+#include "vmEntry.h"
+
+// A fake jmethodID points to one of these; the first word stands for the Method* the jmethodID check loads
+struct ReplayMethod {
+    const void* vm_method;
+    const CapturedMethod* captured;
+};
+
+static inline u64 nanoTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char* copyString(const std::string& s) {
+    char* result = (char*)malloc(s.size() + 1);
+    memcpy(result, s.c_str(), s.size() + 1);
+    return result;
+}
+
+// Whatever the replay does not implement fails; the profiler copes with that as it does on any JVM.
+// The fillers are installed in every slot of the function tables, whatever the signature of the slot,
+// which works on the supported ABIs since they only return a value and ignore their arguments.
+static jvmtiError JNICALL unsupportedJvmti() {
+    return JVMTI_ERROR_NOT_AVAILABLE;
+}
+
+static void* JNICALL unsupportedJni() {
+    return NULL;
+}
+
+static jvmtiError JNICALL GetPhase(jvmtiEnv* jvmti, jvmtiPhase* phase) {
+    *phase = JVMTI_PHASE_LIVE;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL GetAvailableProcessors(jvmtiEnv* jvmti, jint* processors) {
+    *processors = (jint)sysconf(_SC_NPROCESSORS_ONLN);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL Deallocate(jvmtiEnv* jvmti, unsigned char* mem) {
+    free(mem);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL GetMethodDeclaringClass(jvmtiEnv* jvmti, jmethodID method, jclass* declaring_class) {
+    // the method doubles as its class, which only has to be handed back to GetClassSignature
+    *declaring_class = (jclass)method;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL GetClassSignature(jvmtiEnv* jvmti, jclass klass, char** signature, char** generic) {
+    const CapturedMethod* captured = ((ReplayMethod*)klass)->captured;
+    if (captured->class_signature.empty()) {
+        return JVMTI_ERROR_INVALID_CLASS;
+    }
+    *signature = copyString(captured->class_signature);
+    if (generic != NULL) {
+        *generic = NULL;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL GetMethodName(jvmtiEnv* jvmti, jmethodID method, char** name, char** signature, char** generic) {
+    const CapturedMethod* captured = ((ReplayMethod*)method)->captured;
+    if (captured->name.empty()) {
+        return JVMTI_ERROR_INVALID_METHODID;
+    }
+    *name = copyString(captured->name);
+    *signature = copyString(captured->signature);
+    if (generic != NULL) {
+        *generic = NULL;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL GetLineNumberTable(jvmtiEnv* jvmti, jmethodID method, jint* count, jvmtiLineNumberEntry** table) {
+    const CapturedMethod* captured = ((ReplayMethod*)method)->captured;
+    if (captured->line_numbers.empty()) {
+        return JVMTI_ERROR_ABSENT_INFORMATION;
+    }
+    *count = captured->line_numbers.size();
+    *table = (jvmtiLineNumberEntry*)malloc(*count * sizeof(jvmtiLineNumberEntry));
+    for (jint i = 0; i < *count; i++) {
+        (*table)[i].start_location = captured->line_numbers[i].first;
+        (*table)[i].line_number = captured->line_numbers[i].second;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static JNINativeInterface_ _jni_functions;
+static JNIEnv _jni;
+static JNIInvokeInterface_ _vm_functions;
+static JavaVM _vm;
+static jvmtiInterface_1_ _jvmti_functions;
+static jvmtiEnv _jvmti;
+
+static jint JNICALL GetEnv(JavaVM* vm, void** penv, jint version) {
+    *penv = &_jni;
+    return JNI_OK;
+}
+
+template <typename T, typename F>
+static void fill(T& table, F filler) {
+    void** slots = (void**)&table;
+    for (size_t i = 0; i < sizeof(T) / sizeof(void*); i++) {
+        slots[i] = (void*)filler;
+    }
+}
+
+static void installMockVM() {
+    fill(_jni_functions, unsupportedJni);
+    _jni.functions = &_jni_functions;
+
+    fill(_vm_functions, unsupportedJni);
+    _vm_functions.GetEnv = GetEnv;
+    _vm.functions = &_vm_functions;
+
+    fill(_jvmti_functions, unsupportedJvmti);
+    _jvmti_functions.GetPhase = GetPhase;
+    _jvmti_functions.GetAvailableProcessors = GetAvailableProcessors;
+    _jvmti_functions.Deallocate = Deallocate;
+    _jvmti_functions.GetMethodDeclaringClass = GetMethodDeclaringClass;
+    _jvmti_functions.GetClassSignature = GetClassSignature;
+    _jvmti_functions.GetMethodName = GetMethodName;
+    _jvmti_functions.GetLineNumberTable = GetLineNumberTable;
+    _jvmti.functions = &_jvmti_functions;
+
+    VM::initReplay(&_vm, &_jvmti);
+}
+
+struct ReplaySnapshot {
+    const CaptureSnapshot* snapshot;
+    std::vector<ReplayMethod> methods;
+    std::vector<std::vector<ASGCT_CallFrame> > traces;
+};
+
+static void prepare(const CaptureSnapshot& snapshot, ReplaySnapshot& replay) {
+    static const char VALID_METHOD = 0;
+    replay.snapshot = &snapshot;
+    replay.methods.resize(snapshot.methods.size());
+    for (size_t i = 0; i < snapshot.methods.size(); i++) {
+        const CapturedMethod& method = snapshot.methods[i];
+        // a method captured without a name had been unloaded, which a NULL Method* tells the jmethodID check
+        replay.methods[method.id].vm_method = method.name.empty() ? NULL : &VALID_METHOD;
+        replay.methods[method.id].captured = &method;
+    }
+
+    replay.traces.resize(snapshot.traces.size());
+    for (size_t i = 0; i < snapshot.traces.size(); i++) {
+        const CapturedTrace& trace = snapshot.traces[i];
+        std::vector<ASGCT_CallFrame>& frames = replay.traces[i];
+        frames.resize(trace.frames.size());
+        for (size_t j = 0; j < trace.frames.size(); j++) {
+            jint bci = trace.frames[j].bci;
+            u64 value = trace.frames[j].value;
+            frames[j].bci = bci;
+            if (value == (u64)-1) {
+                frames[j].method_id = NULL;
+            } else if (bci == BCI_NATIVE_FRAME || bci == BCI_ERROR) {
+                frames[j].method_id = (jmethodID)snapshot.names[value].c_str();
+            } else {
+                frames[j].method_id = (jmethodID)&replay.methods[value];
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s CAPTURE [iterations] [output]\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    const char* output = argc > 3 ? argv[3] : "/dev/null";
+
+    std::vector<CaptureSnapshot> snapshots;
+    if (!SampleCapture::read(argv[1], snapshots) || snapshots.empty()) {
+        fprintf(stderr, "%s is not a valid capture file\n", argv[1]);
+        return 1;
+    }
+
+    installMockVM();
+
+    // the working file of the recording; every dump moves its chunk to the output
+    char recording[] = "/tmp/ddprof-replay-XXXXXX";
+    int recording_fd = mkstemp(recording);
+    if (recording_fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(recording_fd);
+
+    Arguments args;
+    std::string options = std::string("file=") + recording;
+    Error error = args.parse(options.c_str());
+    if (!error) {
+        args._context_attributes = snapshots[0].attributes;
+        error = Profiler::instance()->startReplay(args);
+    }
+    if (error) {
+        fprintf(stderr, "%s\n", error.message());
+        unlink(recording);
+        return 1;
+    }
+
+    std::vector<ReplaySnapshot> replays(snapshots.size());
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        prepare(snapshots[i], replays[i]);
+        // the attribute values are written from the dictionary whatever the samples refer to
+        for (std::map<u32, std::string>::const_iterator it = snapshots[i].context_values.begin();
+             it != snapshots[i].context_values.end(); ++it) {
+            Profiler::instance()->contextValueMap()->lookup(it->second.c_str());
+        }
+    }
+
+    Profiler* profiler = Profiler::instance();
+    int tid = OS::threadId();
+    int status = 0;
+    for (size_t i = 0; i < replays.size(); i++) {
+        ReplaySnapshot& replay = replays[i];
+        u64 first_ns = 0;
+        u64 min_ns = (u64)-1;
+        u64 total_ns = 0;
+        long long bytes = 0;
+        long long cpool_start = Counters::getCounter(CPOOL_WRITE_TOTAL_NS);
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            for (size_t t = 0; t < replay.traces.size(); t++) {
+                ExecutionEvent event;
+                std::vector<ASGCT_CallFrame>& frames = replay.traces[t];
+                profiler->recordExternalSample(1, tid, frames.size(), frames.data(),
+                                               replay.snapshot->traces[t].truncated, BCI_CPU, &event);
+            }
+
+            int fd = open(output, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+            if (fd == -1) {
+                perror(output);
+                status = 1;
+                break;
+            }
+            u64 start = nanoTime();
+            error = profiler->dump(fd);
+            u64 elapsed = nanoTime() - start;
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                bytes = st.st_size;
+            }
+            close(fd);
+            if (error) {
+                fprintf(stderr, "%s\n", error.message());
+                status = 1;
+                break;
+            }
+
+            if (iteration == 0) {
+                first_ns = elapsed;
+            }
+            if (elapsed < min_ns) {
+                min_ns = elapsed;
+            }
+            total_ns += elapsed;
+        }
+        if (status != 0) {
+            break;
+        }
+        printf("{\"snapshot\":%d,\"traces\":%d,\"methods\":%d,\"iterations\":%d,\"first_dump_ns\":%llu,"
+               "\"min_dump_ns\":%llu,\"mean_dump_ns\":%llu,\"cpool_write_ns\":%lld,\"bytes\":%lld}\n",
+               (int)i, (int)replay.traces.size(), (int)replay.methods.size(), iterations,
+               (unsigned long long)first_ns, (unsigned long long)min_ns,
+               (unsigned long long)(iterations > 0 ? total_ns / iterations : 0),
+               (Counters::getCounter(CPOOL_WRITE_TOTAL_NS) - cpool_start) / (iterations > 0 ? iterations : 1), bytes);
+        fflush(stdout);
+    }
+
+    // stopping would unhook dlopen, which the replay never hooked; the recording is discarded anyway,
+    // whether the replay succeeded or not
+    unlink(recording);
+    return status;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "allocHistogram.h"
+#include "counters.h"
+#include "os.h"
+#include "profiler.h"
+#include "vmEntry.h"
+
+AllocHistogram* const AllocHistogram::_instance = new AllocHistogram();
+
+Error AllocHistogram::start(Arguments& args) {
+    _enabled = false;
+    if (!args._alloc_histogram) {
+        return Error::OK;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (_tables[i].entries == NULL &&
+            (_tables[i].entries = (AllocHistogramEntry*)calloc(TABLE_SIZE, sizeof(AllocHistogramEntry))) == NULL) {
+            return Error("Could not allocate the allocation histogram");
+        }
+        // the keys of the previous session refer to the call traces and classes which have been dropped since
+        memset(_tables[i].entries, 0, TABLE_SIZE * sizeof(AllocHistogramEntry));
+    }
+    _by_context = args._alloc_histogram_context;
+    _enabled = true;
+    return Error::OK;
+}
+
+void AllocHistogram::stop() {
+    _enabled = false;
+}
+
+bool AllocHistogram::record(int tid, u32 call_trace_id, u32 trace_generation, AllocEvent* event) {
+    AllocHistogramTable* table = &_tables[loadAcquire(_active)];
+    if (!table->lock.tryLockShared()) {
+        // being drained by flush
+        return false;
+    }
+
+    Context ctx = _by_context ? Contexts::get(tid) : Contexts::empty();
+    u64 hash = ((u64)call_trace_id << 32 | event->_id) * 0x9E3779B97F4A7C15ULL ^ trace_generation;
+    if (_by_context) {
+        hash = (hash ^ (hash >> 29)) * 0xBF58476D1CE4E5B9ULL ^ ctx.spanId;
+        hash = (hash ^ (hash >> 32)) * 0x94D049BB133111EBULL ^ ctx.rootSpanId;
+        for (size_t i = 0; i < Profiler::instance()->numContextAttributes(); i++) {
+            hash = (hash ^ (hash >> 32)) * 0x94D049BB133111EBULL ^ ctx.get_tag(i).value;
+        }
+    }
+    hash |= 1;
+
+    AllocHistogramEntry* entries = table->entries;
+    u32 slot = (u32)(hash >> 32) % TABLE_SIZE;
+    for (int probe = 0; probe < MAX_PROBES; probe++, slot = (slot + 1) % TABLE_SIZE) {
+        AllocHistogramEntry* entry = &entries[slot];
+        u64 entry_hash = loadAcquire(entry->hash);
+        if (entry_hash == 0) {
+            if (!__sync_bool_compare_and_swap(&entry->hash, 0, hash)) {
+                entry_hash = loadAcquire(entry->hash);
+            } else {
+                entry->call_trace_id = call_trace_id;
+                entry->trace_generation = trace_generation;
+                entry->class_id = event->_id;
+                entry->ctx = ctx;
+                __atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+                entry_hash = hash;
+            }
+        }
+        if (entry_hash != hash) {
+            continue;
+        }
+        while (loadAcquire(entry->ready) == 0) {
+            spinPause();
+        }
+        if (entry->call_trace_id != call_trace_id || entry->trace_generation != trace_generation ||
+            entry->class_id != event->_id || (_by_context && memcmp(&entry->ctx, &ctx, sizeof(Context)) != 0)) {
+            continue;
+        }
+        atomicInc(entry->samples);
+        atomicInc(entry->size, (u64)(event->_size * event->_weight));
+        atomicInc(entry->weight, (u64)(event->_weight * (1 << WEIGHT_SHIFT)));
+        table->lock.unlockShared();
+        return true;
+    }
+
+    table->lock.unlockShared();
+    Counters::increment(ALLOC_HISTOGRAM_OVERFLOWS);
+    return false;
+}
+
+void AllocHistogram::flush() {
+    if (!_enabled) {
+        return;
+    }
+
+    // new samples go to the other table while this one is written out
+    int active = loadAcquire(_active);
+    __atomic_store_n(&_active, active ^ 1, __ATOMIC_RELEASE);
+    AllocHistogramTable* table = &_tables[active];
+    table->lock.lock();
+
+    int tid = OS::threadId();
+    AllocHistogramEntry* entries = table->entries;
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        AllocHistogramEntry* entry = &entries[i];
+        if (entry->ready == 0) {
+            continue;
+        }
+        AllocSummaryEvent event;
+        event._id = entry->class_id;
+        event._samples = entry->samples;
+        event._size = entry->size;
+        event._weight = (float)entry->weight / (1 << WEIGHT_SHIFT);
+        event._ctx = entry->ctx;
+        // a key recorded between the switch above and the end of the previous dump refers to a dropped call trace
+        if (!Profiler::instance()->recordCachedSample(entry->samples, tid, entry->call_trace_id, entry->trace_generation,
+                                                      BCI_ALLOC_SUMMARY, &event)) {
+            Counters::increment(ALLOC_HISTOGRAM_DROPPED, entry->samples);
+        }
+    }
+    memset(entries, 0, TABLE_SIZE * sizeof(AllocHistogramEntry));
+
+    table->lock.unlock();
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ALLOCHISTOGRAM_H
+#define _ALLOCHISTOGRAM_H
+
+#include "arch.h"
+#include "arguments.h"
+#include "context.h"
+#include "event.h"
+#include "spinLock.h"
+
+// One (trace, class[, context]) key of the histogram; the key is written once by the thread
+// which claims the slot, the sums are updated atomically by all the threads hitting the same key
+typedef struct AllocHistogramEntry {
+    // 0 while the slot is free
+    volatile u64 hash;
+    // set once the key below has been published
+    volatile int ready;
+    u32 call_trace_id;
+    u32 trace_generation;
+    u32 class_id;
+    Context ctx;
+    volatile u64 samples;
+    volatile u64 size;
+    // the sum of the sample weights in 48.16 fixed point, so that it can be updated with a single atomic add
+    volatile u64 weight;
+} AllocHistogramEntry;
+
+// The samplers update the active table under the shared lock; flush switches the tables
+// and drains the inactive one under the exclusive lock
+typedef struct AllocHistogramTable {
+    SpinLock lock;
+    AllocHistogramEntry* entries;
+} AllocHistogramTable;
+
+// Aggregates the allocation samples of a chunk in native memory and writes them out as
+// one summary event per key instead of one event per sample
+class AllocHistogram {
+  private:
+    const static int TABLE_SIZE = 8192;
+    const static int MAX_PROBES = 16;
+    const static int WEIGHT_SHIFT = 16;
+
+    static AllocHistogram* const _instance;
+
+    AllocHistogramTable _tables[2];
+    volatile int _active;
+    bool _enabled;
+    bool _by_context;
+
+  public:
+    static AllocHistogram* instance() {
+        return _instance;
+    }
+
+    AllocHistogram() : _active(0), _enabled(false), _by_context(false) {
+        _tables[0].entries = NULL;
+        _tables[1].entries = NULL;
+    }
+
+    bool enabled() {
+        return _enabled;
+    }
+
+    Error start(Arguments& args);
+    void stop();
+
+    // Returns false if the sample could not be aggregated and has to be recorded as a separate event
+    bool record(int tid, u32 call_trace_id, u32 trace_generation, AllocEvent* event);
+    void flush();
+};
+
+#endif // _ALLOCHISTOGRAM_H
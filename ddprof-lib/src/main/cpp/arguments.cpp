@@ -61,18 +61,39 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     status           - print profiling status (inactive / running for X seconds)
 //     list             - show the list of available profiling events
 //     version[=full]   - display the agent version
+//     reconfigure      - apply cpu, wall, walltpt, memory and jstackdepth to the running engines
+//                        without restarting them; the other options are ignored
+//     subscribe        - record the samples of the running profiler to another JFR file as well;
+//                        cpu, wall, memory, nativemem and lock select the events and downsample them
+//                        to their interval, duration=TIME ends the recording on its own
+//     unsubscribe      - end the recording subscribed with the same file
 //     event=EVENT      - which event to trace (cpu, wall, cache-misses, etc.)
 //     alloc[=BYTES]    - profile allocations with BYTES interval
-//     jfr              - dump events in Java Flight Recorder format
+//     memory=BYTES[:FLAGS] - sample heap allocations every BYTES; FLAGS: a - allocations, l - liveness,
+//                        L - liveness and heap usage, h - aggregate the allocations per trace and class,
+//                        H - aggregate them per trace, class and context, o - one event per live object
+//                        instead of a summary per trace, class and age
+//     nativemem[=BYTES] - sample native allocations every BYTES on average (default: 2 MB) and track the live ones
+//     lock[=DURATION]  - sample contended monitors and parked locks every DURATION of contention on average (default: 10us)
+//     vmtimeline[=INTERVAL] - record the safepoints, polled every INTERVAL (default: 1ms), the GC pauses and the
+//                        compiled method loads
+//     jfr[=OPTIONS]    - dump events in Java Flight Recorder format; OPTIONS is a bitmask of JfrOption,
+//                        e.g. 0x20 writes the dumped chunks as LZ4 frames, 0x40 enables compact samples,
+//                        0x80 coalesces the identical consecutive samples of a thread
+//     collapsed        - dump the call traces as folded stacks with their counts instead of JFR events;
+//                        no events are recorded then
 //     traces[=N]       - dump top N call traces
 //     samples          - count the number of samples (default)
 //     total            - count the total value (time, bytes, etc.) instead of samples
-//     chunksize=N      - approximate size of JFR chunk in bytes (default: 100 MB)
-//     chunktime=N      - duration of JFR chunk in seconds (default: 1 hour)
+//     chunksize=N      - approximate size of JFR chunk in bytes (default: 100 MB), 0 - no limit
+//     chunktime=N      - duration of JFR chunk in seconds (default: 1 hour), 0 - no limit;
+//                        a chunk past either limit is sealed in the working file without waiting for a dump
+//     jfrsize=BYTES    - keep the continuous JFR file in a memory-mapped ring of BYTES, overwriting the oldest chunks
 //     timeout=TIME     - automatically stop profiler at TIME (absolute or relative)
 //     loop=TIME        - run profiler in a loop (continuous profiling)
 //     interval=N       - sampling interval in ns (default: 10'000'000, i.e. 10 ms)
 //     jstackdepth=N    - maximum Java stack depth (default: 2048)
+//     jstacktail=N     - stitch up to N more frames to the truncated Java stacks from occasional deeper walks
 //     safemode=BITS    - disable stack recovery techniques (default: 0, i.e. everything enabled)
 //     file=FILENAME    - output file name for dumping
 //     log=FILENAME     - log warnings and errors to the given dedicated stream
@@ -81,6 +102,25 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     filter=FILTER    - thread filter
 //     threads          - profile different threads separately
 //     sched            - group threads by scheduling policy
+//     pmucounters      - attach cycles, instructions, cache and branch misses to every perf_events sample
+//     perfcpu          - open one perf_events ring per CPU for the process' cgroup instead of one per thread
+//     perfpages=N      - data pages of every per-thread perf_events ring, a power of 2 (default: 1)
+//     perfdrain        - record every kernel stack pending in the perf_events ring, not only the latest one
+//     wallswitch[=T]   - measure the exact off-CPU time of every thread with context switch events (Linux 5.13+),
+//                        walking the stack only of the episodes of at least T (default: 0)
+//     memaccess        - sample memory loads with their data address and latency (Intel PEBS)
+//     cpubudget=PCT    - stretch the CPU interval while sampling costs more than PCT% of the process CPU time
+//     membudget=BYTES  - degrade the profiling step by step while its native data structures exceed BYTES
+//     symcache=DIR     - share parsed symbol tables and DWARF records between processes through DIR
+//     capture=PATH     - append the call traces and method metadata of every chunk to PATH for offline replay
+//     pprof=PATH       - also write every chunk as a gzipped pprof profile to PATH, replacing the previous one
+//     shmring=NAME     - publish every finished chunk to the shared memory ring /dev/shm/NAME for a local collector
+//     shmringsize=BYTES - data capacity of the shared memory ring, rounded down to a power of 2 (default: 64M)
+//     hotstacks        - keep the recent samples of every lock stripe for the hot stacks breakdowns and windows
+//     deferredsym      - record native frames as PCs and resolve their symbols when the chunk is written
+//     scopeframes      - record the top compiled Java frame as its PC and decode its inlined frames when the chunk is written
+//     vmstacks[=BOOL]  - walk the interpreted and compiled Java frames through VMStructs, without calling into the JVM;
+//                        the stacks it can not walk are left to AsyncGetCallTrace
 //     cstack=MODE      - how to collect C stack frames in addition to Java stack
 //                        MODE is 'fp' (Frame Pointer), 'dwarf', 'lbr' (Last Branch Record) or 'no'
 //     allkernel        - include only kernel-mode events
@@ -98,6 +138,22 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     title=TITLE      - FlameGraph title
 //     minwidth=PCT     - FlameGraph minimum frame width in percent
 //     reverse          - generate stack-reversed FlameGraph / Call tree
+//     frametrie[=BOOL] - store call traces as paths in a shared frame trie to save memory on deep stacks
+//     prefault[=BOOL]  - fault in the call trace arenas kept across dumps before the next chunk samples into them
+//     arenahuge[=BOOL] - back the call trace arenas with transparent huge pages
+//     hugepages[=MODE] - map the call trace tables and context pages on transparent huge pages,
+//                        or on explicit ones first with MODE=explicit
+//     siglatency       - time signal delivery and handlers into histograms and a periodic JFR summary
+//     selfoverhead     - write the CPU time and native memory spent by the profiler itself with every chunk
+//     spansummary      - sum the CPU and wall samples per span and write one summary event per span
+//                        when its local root span ends or the chunk is dumped
+//     lightweight[=BOOL] - record the CPU and wall samples without stack traces, summed up into one event
+//                        per context and thread state for every chunk, attributed to the first thread sampled
+//     unsampled[=MODE] - skip the stack walk for the CPU and wall samples of the spans the tracer does not keep:
+//                        count them per context without a stack trace (the default), or drop them with MODE=drop
+//     qtmin=TIME       - record only the queue times lasting at least TIME (default: 0, i.e. all of them)
+//     qtsample=N       - keep one in N of the queue times shorter than qtmin, weighted by N (default: 0, i.e. none)
+//     vthreads[=BOOL]  - carry the context of virtual threads from carrier to carrier on JDK 21+ (default: true)
 //
 // It is possible to specify multiple dump options at the same time
 
@@ -145,16 +201,35 @@ Error Arguments::parse(const char* args) {
             CASE("version")
                 _action = ACTION_VERSION;
 
+            CASE("reconfigure")
+                _action = ACTION_RECONFIGURE;
+
+            CASE("subscribe")
+                _action = ACTION_SUBSCRIBE;
+
+            CASE("unsubscribe")
+                _action = ACTION_UNSUBSCRIBE;
+
             CASE("jfr")
                 if (value != NULL) {
                     _jfr_options = (int)strtol(value, NULL, 0);
                 }
 
+            CASE("collapsed")
+                _output = OUTPUT_COLLAPSED;
+
+            CASE("samples")
+                _total = false;
+
+            CASE("total")
+                _total = true;
+
             CASE("cpu")
                 _cpu = value == NULL ? 0 : parseUnits(value, NANOS);
                 if (_cpu < 0) {
                     msg = "cpu must be >= 0";
                 }
+                _tuned |= TUNE_CPU_INTERVAL;
 
             CASE("wall")
                 if (value == NULL) {
@@ -170,11 +245,46 @@ Error Arguments::parse(const char* args) {
                 if (_wall < 0) {
                     msg = "wall must be >= 0";
                 }
+                _tuned |= TUNE_WALL_INTERVAL;
 
             CASE("walltpt")
                 if (value == NULL || (_wall_threads_per_tick = atoi(value)) <= 0) {
                     msg = "walltpt must be > 0";
                 }
+                _tuned |= TUNE_WALL_THREADS;
+
+            CASE("wallbudget")
+                if (value == NULL || (_wall_budget = parseUnits(value, NANOS)) <= 0) {
+                    msg = "wallbudget must be > 0";
+                }
+
+            CASE("wallpriority")
+                if (value == NULL || (_wall_context_priority = atoi(value)) <= 0) {
+                    msg = "wallpriority must be > 0";
+                }
+
+            CASE("wallswitch")
+                if (value == NULL) {
+                    _wall_switch = 0;
+                } else if ((_wall_switch = parseUnits(value, NANOS)) < 0) {
+                    msg = "wallswitch must be >= 0";
+                }
+                if (_wall < 0) {
+                    _wall = 0;
+                }
+
+            CASE("wallidle")
+                _wall_reuse_idle = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("wallshards")
+                if (value == NULL || (_wall_shards = atoi(value)) <= 0 || _wall_shards > MAX_WALL_SHARDS) {
+                    msg = "wallshards must be between 1 and 16";
+                }
+
+            CASE("wallsenders")
+                if (value == NULL || (_wall_senders = atoi(value)) <= 0 || _wall_senders > MAX_WALL_SENDERS) {
+                    msg = "wallsenders must be between 1 and 16";
+                }
 
             CASE("event")
                 if (value == NULL || value[0] == 0) {
@@ -193,17 +303,29 @@ Error Arguments::parse(const char* args) {
                     *(config++) = 0; // terminate the 'value' string and update the pointer to the 'config' section
                 }
                 _memory = value == NULL ? 0 : parseUnits(value, BYTES);
+                _tuned |= TUNE_ALLOC_INTERVAL;
                 if (_memory >= 0) {
                     if (config) {
                         if (strchr(config, 'a')) {
                             _record_allocations = true;
                         }
+                        if (strchr(config, 'h')) {
+                            _record_allocations = true;
+                            _alloc_histogram = true;
+                        } else if (strchr(config, 'H')) {
+                            _record_allocations = true;
+                            _alloc_histogram = true;
+                            _alloc_histogram_context = true;
+                        }
                         if (strchr(config, 'l')) {
                             _record_liveness = true;
                         } else if (strchr(config, 'L')) {
                             _record_liveness = true;
                             _record_heap_usage = true;
                         }
+                        if (strchr(config, 'o')) {
+                            _record_live_objects = true;
+                        }
                     } else {
                         // enable both allocations and liveness tracking
                         _record_allocations = true;
@@ -213,15 +335,59 @@ Error Arguments::parse(const char* args) {
                     msg = "memory sampling interval must be >= 0";
                 }
 
+            CASE("nativemem")
+                _nativemem = value == NULL ? DEFAULT_NATIVEMEM_INTERVAL : parseUnits(value, BYTES);
+                if (_nativemem < 0) {
+                    msg = "nativemem sampling interval must be >= 0";
+                }
+
+            CASE("lock")
+                _lock = value == NULL ? DEFAULT_LOCK_INTERVAL : parseUnits(value, NANOS);
+                if (_lock < 0) {
+                    msg = "lock sampling interval must be >= 0";
+                }
+
+            CASE("vmtimeline")
+                _vm_timeline = value == NULL ? DEFAULT_VM_TIMELINE_INTERVAL : parseUnits(value, NANOS);
+                if (_vm_timeline <= 0) {
+                    msg = "vmtimeline polling interval must be > 0";
+                }
+
             CASE("interval")
                 if (value == NULL || (_interval = parseUnits(value, UNIVERSAL)) <= 0) {
                     msg = "Invalid interval";
                 }
 
+            CASE("chunksize")
+                if (value == NULL || (_chunk_size = parseUnits(value, BYTES)) < 0) {
+                    msg = "chunksize must be >= 0";
+                }
+
+            CASE("chunktime")
+                if (value == NULL || (_chunk_time = parseUnits(value, SECONDS)) < 0) {
+                    msg = "chunktime must be >= 0";
+                }
+
+            CASE("duration")
+                if (value == NULL || (_duration = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "duration must be > 0";
+                }
+
+            CASE("jfrsize")
+                if (value == NULL || (_jfr_size = parseUnits(value, BYTES)) <= 0) {
+                    msg = "jfrsize must be > 0";
+                }
+
             CASE("jstackdepth")
                 if (value == NULL || (_jstackdepth = atoi(value)) <= 0) {
                     msg = "jstackdepth must be > 0";
                 }
+                _tuned |= TUNE_STACK_DEPTH;
+
+            CASE("jstacktail")
+                if (value == NULL || (_jstacktail = atoi(value)) < 0) {
+                    msg = "jstacktail must be >= 0";
+                }
 
             CASE("safemode")
                 _safe_mode = value == NULL ? INT_MAX : (int)strtol(value, NULL, 0);
@@ -288,6 +454,123 @@ Error Arguments::parse(const char* args) {
                     }
                 }
 
+            CASE("frametrie")
+                _frame_trie = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("prefault")
+                _prefault = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("arenahuge")
+                _arena_huge_pages = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("hugepages")
+                if (value == NULL || value[0] == 'y' || value[0] == 't') {
+                    _huge_pages = HUGE_PAGES_TRANSPARENT;
+                } else if (value[0] == 'e') {
+                    _huge_pages = HUGE_PAGES_EXPLICIT;
+                } else {
+                    _huge_pages = HUGE_PAGES_NO;
+                }
+
+            CASE("unsampled")
+                if (value == NULL || value[0] == 'c') {
+                    _unsampled = UNSAMPLED_COUNT;
+                } else if (value[0] == 'd') {
+                    _unsampled = UNSAMPLED_DROP;
+                } else {
+                    _unsampled = UNSAMPLED_KEEP;
+                }
+
+            CASE("pmucounters")
+                _pmu_counters = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("perfcpu")
+                _perf_per_cpu = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("perfpages")
+                if (value == NULL || (_perf_ring_pages = atoi(value)) <= 0 || (_perf_ring_pages & (_perf_ring_pages - 1)) != 0) {
+                    msg = "perfpages must be a power of 2";
+                }
+
+            CASE("perfdrain")
+                _perf_drain = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("memaccess")
+                _mem_access = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("cpubudget")
+                if (value == NULL || (_cpu_budget = atof(value)) <= 0) {
+                    msg = "cpubudget must be > 0";
+                }
+
+            CASE("membudget")
+                if (value == NULL || (_memory_budget = parseUnits(value, BYTES)) <= 0) {
+                    msg = "membudget must be > 0";
+                }
+
+            CASE("symcache")
+                if (value == NULL || value[0] == 0) {
+                    msg = "symcache must not be empty";
+                }
+                _symbol_cache = value;
+
+            CASE("capture")
+                if (value == NULL || value[0] == 0) {
+                    msg = "capture must not be empty";
+                }
+                _capture = value;
+
+            CASE("hotstacks")
+                _hot_stacks = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("pprof")
+                if (value == NULL || value[0] == 0) {
+                    msg = "pprof must not be empty";
+                }
+                _pprof = value;
+
+            CASE("shmring")
+                if (value == NULL || value[0] == 0 || strchr(value, '/') != NULL) {
+                    msg = "shmring must be a file name";
+                }
+                _shm_ring = value;
+
+            CASE("shmringsize")
+                if (value == NULL || (_shm_ring_size = parseUnits(value, BYTES)) <= 0) {
+                    msg = "shmringsize must be > 0";
+                }
+
+            CASE("deferredsym")
+                _deferred_symbols = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("scopeframes")
+                _scope_frames = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("vmstacks")
+                _vm_stacks = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("siglatency")
+                _signal_latency = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("selfoverhead")
+                _self_overhead = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("spansummary")
+                _span_summary = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("vthreads")
+                _virtual_threads = value == NULL || value[0] == 'y' || value[0] == 't';
+
+            CASE("qtmin")
+                if (value == NULL || (_queue_time_min = parseUnits(value, NANOS)) < 0) {
+                    msg = "qtmin must be >= 0";
+                }
+
+            CASE("qtsample")
+                if (value == NULL || (_queue_time_sample = atoi(value)) < 0) {
+                    msg = "qtsample must be >= 0";
+                }
+
             DEFAULT()
                 if (_unknown_arg == NULL) _unknown_arg = arg;
         }
@@ -298,7 +581,7 @@ Error Arguments::parse(const char* args) {
         return Error(msg);
     }
 
-    if (_event == NULL && _cpu < 0 && _wall < 0 && _memory < 0) {
+    if (_event == NULL && _cpu < 0 && _wall < 0 && _memory < 0 && _nativemem < 0 && _lock < 0) {
         _event = EVENT_CPU;
     }
 
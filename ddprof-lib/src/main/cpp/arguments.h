@@ -25,7 +25,14 @@
 const long DEFAULT_CPU_INTERVAL  = 10 * 1000 * 1000; // 10 ms
 const long DEFAULT_WALL_INTERVAL = 50 * 1000 * 1000; // 50 ms
 const long DEFAULT_ALLOC_INTERVAL = 524287;  // 512 KiB
+const long DEFAULT_NATIVEMEM_INTERVAL = 2 * 1024 * 1024;  // 2 MiB
+const long DEFAULT_LOCK_INTERVAL = 10 * 1000;  // 10 us
+const long DEFAULT_VM_TIMELINE_INTERVAL = 1000 * 1000;  // 1 ms
 const int DEFAULT_WALL_THREADS_PER_TICK = 16;
+const long DEFAULT_CHUNK_SIZE = 100 * 1024 * 1024;  // 100 MiB
+const long DEFAULT_CHUNK_TIME = 3600;  // 1 hour
+const int MAX_WALL_SENDERS = 16;
+const int MAX_WALL_SHARDS = 16;
 const int DEFAULT_JSTACKDEPTH = 2048;
 
 const char* const EVENT_NOOP   = "noop";
@@ -33,6 +40,7 @@ const char* const EVENT_CPU    = "cpu";
 const char* const EVENT_ALLOC  = "alloc";
 const char* const EVENT_WALL   = "wall";
 const char* const EVENT_ITIMER = "itimer";
+const char* const EVENT_CTIMER = "ctimer";
 
 enum Action {
     ACTION_NONE,
@@ -42,7 +50,10 @@ enum Action {
     ACTION_CHECK,
     ACTION_STATUS,
     ACTION_LIST,
-    ACTION_VERSION
+    ACTION_VERSION,
+    ACTION_RECONFIGURE,
+    ACTION_SUBSCRIBE,
+    ACTION_UNSUBSCRIBE
 };
 
 enum Ring {
@@ -67,6 +78,20 @@ enum CStack {
     CSTACK_LBR
 };
 
+enum HugePages {
+    HUGE_PAGES_NO,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+};
+
+// What becomes of the CPU and wall samples of a thread whose context is marked as unsampled by the tracer
+enum UnsampledPolicy {
+    UNSAMPLED_KEEP,
+    // recorded without a stack trace, and summed up per context like the samples of a lightweight recording
+    UNSAMPLED_COUNT,
+    UNSAMPLED_DROP
+};
+
 enum Output {
     OUTPUT_NONE,
     OUTPUT_COLLAPSED,
@@ -78,10 +103,27 @@ enum JfrOption {
     NO_SYSTEM_PROPS = 0x2,
     NO_NATIVE_LIBS  = 0x4,
     NO_CPU_LOAD     = 0x8,
+    // constant pools of consecutive chunks in the same file contain only entries not written before
+    INCREMENTAL_CPOOL = 0x10,
+    // chunks exported from the working file are written as LZ4 frames
+    COMPRESS_LZ4    = 0x20,
+    // CPU and wall samples use delta timestamps and write the context only when it changes
+    COMPACT_SAMPLES = 0x40,
+    // consecutive identical CPU and allocation samples of a thread are written as one event with their summed weight
+    COALESCE_SAMPLES = 0x80,
 
     JFR_SYNC_OPTS   = NO_SYSTEM_INFO | NO_SYSTEM_PROPS | NO_NATIVE_LIBS | NO_CPU_LOAD
 };
 
+// The options a reconfigure command can change on the running engines, flagged as they are parsed
+enum TunableOption {
+    TUNE_CPU_INTERVAL   = 0x1,
+    TUNE_WALL_INTERVAL  = 0x2,
+    TUNE_WALL_THREADS   = 0x4,
+    TUNE_ALLOC_INTERVAL = 0x8,
+    TUNE_STACK_DEPTH    = 0x10
+};
+
 
 struct Multiplier {
     char symbol;
@@ -127,11 +169,46 @@ class Arguments {
     long _wall;
     bool _wall_collapsing;
     int _wall_threads_per_tick;
+    int _wall_senders;
+    int _wall_shards;
+    long _wall_budget;
+    bool _wall_reuse_idle;
+    int _wall_context_priority;
+    long _wall_switch;
+    bool _signal_latency;
+    bool _self_overhead;
+    bool _span_summary;
+    long _queue_time_min;
+    int _queue_time_sample;
+    bool _virtual_threads;
+    bool _pmu_counters;
+    bool _perf_per_cpu;
+    int _perf_ring_pages;
+    bool _perf_drain;
+    bool _mem_access;
+    double _cpu_budget;
+    long _memory_budget;
+    const char* _symbol_cache;
+    const char* _capture;
+    const char* _pprof;
+    const char* _shm_ring;
+    long _shm_ring_size;
+    bool _hot_stacks;
+    bool _deferred_symbols;
+    bool _scope_frames;
+    bool _vm_stacks;
     long _memory;
     bool _record_allocations;
     bool _record_liveness;
     bool _record_heap_usage;
+    bool _record_live_objects;
+    bool _alloc_histogram;
+    bool _alloc_histogram_context;
+    long _nativemem;
+    long _lock;
+    long _vm_timeline;
     int  _jstackdepth;
+    int _jstacktail;
     int _safe_mode;
     const char* _file;
     const char* _log;
@@ -139,9 +216,22 @@ class Arguments {
     const char* _unknown_arg;
     const char* _filter;
     CStack _cstack;
+    Output _output;
+    // the collapsed output counts the total value of the samples rather than their number
+    bool _total;
     int _jfr_options;
+    int _tuned;
+    long _jfr_size;
+    long _chunk_size;
+    long _chunk_time;
+    long _duration;
     std::vector<std::string> _context_attributes;
     bool _lightweight;
+    bool _frame_trie;
+    bool _prefault;
+    bool _arena_huge_pages;
+    HugePages _huge_pages;
+    UnsampledPolicy _unsampled;
 
     Arguments(bool persistent = false) :
         _buf(NULL),
@@ -155,11 +245,46 @@ class Arguments {
         _wall(-1),
         _wall_collapsing(false),
         _wall_threads_per_tick(DEFAULT_WALL_THREADS_PER_TICK),
+        _wall_senders(1),
+        _wall_shards(1),
+        _wall_budget(0),
+        _wall_reuse_idle(false),
+        _wall_context_priority(1),
+        _wall_switch(-1),
+        _signal_latency(false),
+        _self_overhead(false),
+        _span_summary(false),
+        _queue_time_min(0),
+        _queue_time_sample(0),
+        _virtual_threads(true),
+        _pmu_counters(false),
+        _perf_per_cpu(false),
+        _perf_ring_pages(1),
+        _perf_drain(false),
+        _mem_access(false),
+        _cpu_budget(0),
+        _memory_budget(0),
+        _symbol_cache(NULL),
+        _capture(NULL),
+        _pprof(NULL),
+        _shm_ring(NULL),
+        _shm_ring_size(64 * 1024 * 1024),
+        _hot_stacks(false),
+        _deferred_symbols(false),
+        _scope_frames(false),
+        _vm_stacks(false),
         _memory(-1),
         _record_allocations(false),
         _record_liveness(false),
         _record_heap_usage(false),
+        _record_live_objects(false),
+        _alloc_histogram(false),
+        _alloc_histogram_context(false),
+        _nativemem(-1),
+        _lock(-1),
+        _vm_timeline(-1),
         _jstackdepth(DEFAULT_JSTACKDEPTH),
+        _jstacktail(0),
         _safe_mode(0),
         _file(NULL),
         _log(NULL),
@@ -167,9 +292,21 @@ class Arguments {
         _unknown_arg(NULL),
         _filter(NULL),
         _cstack(CSTACK_DEFAULT),
+        _output(OUTPUT_JFR),
+        _total(false),
         _jfr_options(0),
+        _tuned(0),
+        _jfr_size(0),
+        _chunk_size(DEFAULT_CHUNK_SIZE),
+        _chunk_time(DEFAULT_CHUNK_TIME),
+        _duration(0),
         _context_attributes({}),
-        _lightweight(false) {
+        _lightweight(false),
+        _frame_trie(false),
+        _prefault(false),
+        _arena_huge_pages(false),
+        _huge_pages(HUGE_PAGES_NO),
+        _unsampled(UNSAMPLED_KEEP) {
     }
 
     ~Arguments();
@@ -184,6 +321,10 @@ class Arguments {
         return (_jfr_options & option) != 0;
     }
 
+    bool isTuned(TunableOption option) const {
+        return (_tuned & option) != 0;
+    }
+
     friend class FrameName;
     friend class Recording;
 };
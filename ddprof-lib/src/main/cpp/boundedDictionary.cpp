@@ -0,0 +1,340 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <climits>
+#include <stdlib.h>
+#include <string.h>
+#include "boundedDictionary.h"
+#include "counters.h"
+
+static const u32 MIN_CAPACITY = 64;
+static const u32 MAX_CAPACITY = 1 << 20;
+// number of chunks an evicted key is still reported in
+static const u32 RETIRED_EPOCHS = 2;
+
+static u32 nextPowerOf2(u32 v) {
+    v--;
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    return v + 1;
+}
+
+BoundedDictionary::BoundedDictionary(int id) : _lock(), _id(id) {
+    _entries = NULL;
+    _capacity = _size = _hand = 0;
+    _index = NULL;
+    _index_mask = 0;
+    _sketch = NULL;
+    _sketch_mask = 0;
+    _doorkeeper = NULL;
+    _next_id = 1;
+    _epoch = 0;
+}
+
+BoundedDictionary::~BoundedDictionary() {
+    release();
+}
+
+void BoundedDictionary::release() {
+    for (u32 i = 0; i < _size; i++) {
+        free(_entries[i].key);
+    }
+    for (size_t i = 0; i < _retired.size(); i++) {
+        free(_retired[i].key);
+    }
+    _retired.clear();
+    free(_entries);
+    free(_index);
+    free(_sketch);
+    free(_doorkeeper);
+    _entries = NULL;
+    _index = NULL;
+    _sketch = NULL;
+    _doorkeeper = NULL;
+    _capacity = _size = _hand = 0;
+    _index_mask = _sketch_mask = 0;
+    Counters::set(DICTIONARY_KEYS, 0, _id);
+    Counters::set(DICTIONARY_KEYS_BYTES, 0, _id);
+    Counters::set(DICTIONARY_BYTES, 0, _id);
+    Counters::set(DICTIONARY_PAGES, 0, _id);
+}
+
+void BoundedDictionary::clear() {
+    _lock.lock();
+    release();
+    _next_id = 1;
+    _lock.unlock();
+}
+
+// FNV-1a, same as Dictionary
+u32 BoundedDictionary::hash(const char* key, size_t length) {
+    u32 h = 2166136261U;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ key[i]) * 16777619;
+    }
+    return h;
+}
+
+// Sets the doorkeeper bits of h; false if they were all set already
+bool BoundedDictionary::admitted(u32 h) {
+    bool seen = true;
+    for (int probe = 0; probe < 2; probe++) {
+        u32 bit = doorkeeperBit(h, probe);
+        u64 mask = 1ULL << (bit & 63);
+        if ((__atomic_fetch_or(&_doorkeeper[bit >> 6], mask, __ATOMIC_RELAXED) & mask) == 0) {
+            seen = false;
+        }
+    }
+    return seen;
+}
+
+void BoundedDictionary::touch(u32 h) {
+    if (!admitted(h)) {
+        return;
+    }
+    // Conservative update: only the smallest counters are raised, which keeps collisions
+    // from inflating the estimate. Lossy under contention, which is fine for an estimate.
+    u32 current = 255;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        u8 value = __atomic_load_n(&_sketch[row * (_sketch_mask + 1) + sketchSlot(h, row)], __ATOMIC_RELAXED);
+        if (value < current) {
+            current = value;
+        }
+    }
+    if (current == 255) {
+        return;
+    }
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        u8* counter = &_sketch[row * (_sketch_mask + 1) + sketchSlot(h, row)];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) == current) {
+            __atomic_store_n(counter, current + 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+u32 BoundedDictionary::estimate(u32 h) {
+    u32 result = 255;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        u8 value = __atomic_load_n(&_sketch[row * (_sketch_mask + 1) + sketchSlot(h, row)], __ATOMIC_RELAXED);
+        if (value < result) {
+            result = value;
+        }
+    }
+    for (int probe = 0; probe < 2; probe++) {
+        u32 bit = doorkeeperBit(h, probe);
+        if ((__atomic_load_n(&_doorkeeper[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))) == 0) {
+            return result;
+        }
+    }
+    return result + 1;
+}
+
+int BoundedDictionary::find(const char* key, size_t length, u32 h) {
+    if (_index == NULL) {
+        return -1;
+    }
+    for (u32 slot = h & _index_mask; _index[slot] != 0; slot = (slot + 1) & _index_mask) {
+        BoundedEntry* entry = &_entries[_index[slot] - 1];
+        if (entry->hash == h && entry->length == length && memcmp(entry->key, key, length) == 0) {
+            return _index[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+void BoundedDictionary::indexInsert(u32 h, u32 entry) {
+    u32 slot = h & _index_mask;
+    while (_index[slot] != 0) {
+        slot = (slot + 1) & _index_mask;
+    }
+    _index[slot] = entry + 1;
+}
+
+void BoundedDictionary::indexRemove(u32 entry) {
+    u32 slot = _entries[entry].hash & _index_mask;
+    while (_index[slot] != entry + 1) {
+        slot = (slot + 1) & _index_mask;
+    }
+    // backward shift deletion keeps every probe sequence free of holes
+    u32 hole = slot;
+    for (slot = (slot + 1) & _index_mask; _index[slot] != 0; slot = (slot + 1) & _index_mask) {
+        u32 home = _entries[_index[slot] - 1].hash & _index_mask;
+        if (((slot - home) & _index_mask) >= ((slot - hole) & _index_mask)) {
+            _index[hole] = _index[slot];
+            hole = slot;
+        }
+    }
+    _index[hole] = 0;
+}
+
+void BoundedDictionary::sizeSketch(u32 limit) {
+    // four counters per key in each row keep collisions rare at the size limit
+    u32 width = nextPowerOf2(limit * 4);
+    if (_sketch != NULL && width <= _sketch_mask + 1) {
+        return;
+    }
+    long long old_bytes = _sketch != NULL ? SKETCH_ROWS * (_sketch_mask + 1) + doorkeeperWords() * sizeof(u64) : 0;
+    // the estimates start over when the limit is raised
+    free(_sketch);
+    free(_doorkeeper);
+    _sketch = (u8*)calloc(SKETCH_ROWS, width);
+    _sketch_mask = width - 1;
+    _doorkeeper = (u64*)calloc(doorkeeperWords(), sizeof(u64));
+    Counters::increment(DICTIONARY_BYTES, (long long)(SKETCH_ROWS * width + doorkeeperWords() * sizeof(u64)) - old_bytes, _id);
+}
+
+void BoundedDictionary::grow(u32 capacity) {
+    long long old_bytes = _capacity > 0 ? _capacity * sizeof(BoundedEntry) + (_index_mask + 1) * sizeof(u32) : 0;
+    _entries = (BoundedEntry*)realloc(_entries, capacity * sizeof(BoundedEntry));
+    _capacity = capacity;
+
+    u32 index_size = nextPowerOf2(capacity * 2);
+    free(_index);
+    _index = (u32*)calloc(index_size, sizeof(u32));
+    _index_mask = index_size - 1;
+    for (u32 i = 0; i < _size; i++) {
+        indexInsert(_entries[i].hash, i);
+    }
+
+    long long new_bytes = _capacity * sizeof(BoundedEntry) + index_size * sizeof(u32);
+    Counters::set(DICTIONARY_PAGES, 1, _id);
+    Counters::increment(DICTIONARY_BYTES, new_bytes - old_bytes, _id);
+}
+
+u32 BoundedDictionary::victim() {
+    // every entry is passed over at most once before its reference bit is found clear
+    while (true) {
+        if (_hand >= _size) {
+            _hand = 0;
+        }
+        BoundedEntry* entry = &_entries[_hand];
+        if (!entry->referenced) {
+            return _hand;
+        }
+        entry->referenced = 0;
+        _hand++;
+    }
+}
+
+unsigned int BoundedDictionary::lookup(const char* key, size_t length, int size_limit) {
+    u32 h = hash(key, length);
+
+    _lock.lockShared();
+    if (_sketch != NULL) {
+        touch(h);
+    }
+    int found = find(key, length, h);
+    if (found >= 0) {
+        _entries[found].referenced = 1;
+        u32 id = _entries[found].id;
+        _lock.unlockShared();
+        return id;
+    }
+    _lock.unlockShared();
+
+    if (size_limit <= 0) {
+        return INT_MAX;
+    }
+
+    _lock.lock();
+    found = find(key, length, h);
+    if (found >= 0) {
+        u32 id = _entries[found].id;
+        _lock.unlock();
+        return id;
+    }
+
+    u32 limit = (u32)size_limit < MAX_CAPACITY ? (u32)size_limit : MAX_CAPACITY;
+    if (_sketch == NULL || limit * 4 > _sketch_mask + 1) {
+        sizeSketch(limit);
+        touch(h);
+    }
+    if (_size == _capacity && _capacity < limit) {
+        u32 capacity = _capacity < MIN_CAPACITY ? MIN_CAPACITY : _capacity * 2;
+        grow(capacity < limit ? capacity : limit);
+    }
+
+    u32 slot;
+    if (_size < limit && _size < _capacity) {
+        slot = _size++;
+    } else {
+        slot = victim();
+        BoundedEntry* evicted = &_entries[slot];
+        if (estimate(h) <= estimate(evicted->hash)) {
+            // give the resident entry another round before it is considered again
+            evicted->referenced = 1;
+            _lock.unlock();
+            Counters::increment(ENDPOINT_REJECTIONS);
+            return INT_MAX;
+        }
+        indexRemove(slot);
+        RetiredKey retired = {evicted->id, _epoch, evicted->key};
+        _retired.push_back(retired);
+        Counters::increment(ENDPOINT_EVICTIONS);
+        Counters::decrement(DICTIONARY_KEYS, 1, _id);
+        Counters::decrement(DICTIONARY_KEYS_BYTES, evicted->length + 1, _id);
+    }
+
+    BoundedEntry* entry = &_entries[slot];
+    entry->key = (char*)malloc(length + 1);
+    memcpy(entry->key, key, length);
+    entry->key[length] = 0;
+    entry->length = length;
+    entry->hash = h;
+    entry->id = _next_id++;
+    entry->referenced = 0;
+    indexInsert(h, slot);
+    u32 id = entry->id;
+    _lock.unlock();
+
+    Counters::increment(DICTIONARY_KEYS, 1, _id);
+    Counters::increment(DICTIONARY_KEYS_BYTES, length + 1, _id);
+    return id;
+}
+
+void BoundedDictionary::collect(std::map<unsigned int, const char*>& map) {
+    _lock.lock();
+    for (u32 i = 0; i < _size; i++) {
+        map[_entries[i].id] = _entries[i].key;
+    }
+
+    // An id handed out just before its eviction may only reach the next chunk,
+    // so the key outlives the chunk it was evicted in by one more
+    size_t kept = 0;
+    for (size_t i = 0; i < _retired.size(); i++) {
+        RetiredKey& retired = _retired[i];
+        if (_epoch - retired.epoch >= RETIRED_EPOCHS) {
+            free(retired.key);
+        } else {
+            map[retired.id] = retired.key;
+            _retired[kept++] = retired;
+        }
+    }
+    _retired.resize(kept);
+    _epoch++;
+
+    // age the frequencies so that popularity is judged per chunk
+    if (_sketch != NULL) {
+        for (u32 i = 0; i < SKETCH_ROWS * (_sketch_mask + 1); i++) {
+            _sketch[i] >>= 1;
+        }
+        memset(_doorkeeper, 0, doorkeeperWords() * sizeof(u64));
+    }
+    _lock.unlock();
+}
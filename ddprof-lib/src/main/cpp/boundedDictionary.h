@@ -0,0 +1,120 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BOUNDEDDICTIONARY_H
+#define _BOUNDEDDICTIONARY_H
+
+#include <map>
+#include <vector>
+#include <stddef.h>
+#include "arch.h"
+#include "spinLock.h"
+
+
+struct BoundedEntry {
+    char* key;
+    u32 length;
+    u32 hash;
+    u32 id;
+    // CLOCK reference bit, set on every hit
+    volatile u8 referenced;
+};
+
+struct RetiredKey {
+    u32 id;
+    u32 epoch;
+    char* key;
+};
+
+// Fixed size string dictionary for high cardinality labels such as endpoints.
+// When it is full, a new key replaces the entry picked by a CLOCK sweep, but only if a frequency
+// sketch estimates it to be used more often than that entry (TinyLFU admission), so that one-off
+// keys do not flush out the popular ones. As in TinyLFU, a doorkeeper bitmap absorbs the first
+// sighting of every key, so that keys seen once never reach the sketch. Ids are never reused: an evicted key keeps being reported
+// by collect() until two chunks later, so events written before the eviction still resolve.
+class BoundedDictionary {
+  private:
+    static const int SKETCH_ROWS = 4;
+
+    SpinLock _lock;
+    const int _id;
+
+    BoundedEntry* _entries;
+    u32 _capacity;
+    u32 _size;
+    u32 _hand;
+    // entry index + 1 per slot, 0 if free
+    u32* _index;
+    u32 _index_mask;
+    u8* _sketch;
+    u32 _sketch_mask;
+    u64* _doorkeeper;
+
+    u32 _next_id;
+    u32 _epoch;
+    std::vector<RetiredKey> _retired;
+
+    static u32 hash(const char* key, size_t length);
+
+    // rows need independent positions, so each is a full 64-bit mix of the hash
+    static u64 mix(u32 h, int row) {
+        static const u64 SEEDS[SKETCH_ROWS] = {0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL,
+                                               0x94D049BB133111EBULL, 0xD6E8FEB86659FD93ULL};
+        u64 x = (h + SEEDS[row]) * SEEDS[(row + 1) % SKETCH_ROWS];
+        return x ^ x >> 31;
+    }
+
+    u32 sketchSlot(u32 h, int row) {
+        return (u32)(mix(h, row) >> 32) & _sketch_mask;
+    }
+
+    // the doorkeeper takes as many bytes as a sketch row, 32 bits per key at the size limit
+    u32 doorkeeperBit(u32 h, int probe) {
+        return (u32)mix(h, probe) & (_sketch_mask * 8 + 7);
+    }
+
+    u32 doorkeeperWords() {
+        return (_sketch_mask + 8) / 8;
+    }
+
+    bool admitted(u32 h);
+
+    void touch(u32 h);
+    u32 estimate(u32 h);
+
+    int find(const char* key, size_t length, u32 h);
+    void indexInsert(u32 h, u32 entry);
+    void indexRemove(u32 entry);
+    void sizeSketch(u32 limit);
+    void grow(u32 capacity);
+    u32 victim();
+    void release();
+
+  public:
+    BoundedDictionary(int id);
+    ~BoundedDictionary();
+
+    void clear();
+
+    // Returns the id of key, admitting it while fewer than size_limit keys are held or when it
+    // is more popular than the entry it would replace; INT_MAX if the key is rejected.
+    unsigned int lookup(const char* key, size_t length, int size_limit);
+
+    // The held keys plus those evicted during the last two chunks; starts a new chunk
+    void collect(std::map<unsigned int, const char*>& map);
+};
+
+#endif // _BOUNDEDDICTIONARY_H
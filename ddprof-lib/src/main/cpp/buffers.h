@@ -28,14 +28,54 @@ typedef ssize_t (*FlushCallback)(char* data, int len);
 class Buffer {
   private:
     int _offset;
+    // ticks the compact samples in this buffer are relative to, 0 if not written yet
+    u64 _base_ticks;
     static const int _limit = BUFFER_SIZE - sizeof(int);
-    char _data[_limit];
+    // varints are stored as a single 8 byte word which may extend past the limit
+    static const int VARINT_SLACK = 8;
+    char _data[_limit + VARINT_SLACK];
+
+    // Number of bytes the JFR varint encoding of v takes, at most 9
+    static inline int varLength(u64 v) {
+        int len = (70 - __builtin_clzll(v | 1)) / 7;
+        return len < 9 ? len : 9;
+    }
+
+    // Moves each of the low 8 groups of 7 bits into its own byte
+    static inline u64 spread7(u64 v) {
+        return (v & 0x7f) | (v << 1 & 0x7f00ULL) | (v << 2 & 0x7f0000ULL) | (v << 3 & 0x7f000000ULL) |
+               (v << 4 & 0x7f00000000ULL) | (v << 5 & 0x7f0000000000ULL) | (v << 6 & 0x7f000000000000ULL) |
+               (v << 7 & 0x7f00000000000000ULL);
+    }
+
+    inline void putVarWord(u64 word, int len) {
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        memcpy(_data + _offset, &word, sizeof(word));
+        _offset += len;
+    }
+
+    inline void putVar(u64 v) {
+        int len = varLength(v);
+        if (len <= 8) {
+            // continuation bits for all but the last byte
+            u64 continuation = 0x8080808080808080ULL & ((1ULL << (8 * (len - 1))) - 1);
+            putVarWord(spread7(v) | continuation, len);
+        } else {
+            // the 9th byte carries the remaining 8 bits as they are
+            putVarWord(spread7(v) | 0x8080808080808080ULL, 8);
+            _data[_offset++] = (char)(v >> 56);
+        }
+    }
 
   public:
-    Buffer() : _offset(0) {
-        memset(_data, 0, _limit);
+    Buffer() : _offset(0), _base_ticks(0) {
+        memset(_data, 0, _limit + VARINT_SLACK);
     }
 
+    virtual ~Buffer() {}
+
     virtual int limit() const {
         return _limit;
     }
@@ -68,6 +108,15 @@ class Buffer {
 
     void reset() {
         _offset = 0;
+        _base_ticks = 0;
+    }
+
+    u64 baseTicks() const {
+        return _base_ticks;
+    }
+
+    void setBaseTicks(u64 ticks) {
+        _base_ticks = ticks;
     }
 
     void put(const char* v, u32 len) {
@@ -111,27 +160,29 @@ class Buffer {
 
     void putVar32(u32 v) {
         assert(_offset + 5 < limit());
-        while (v > 0x7f) {
-            _data[_offset++] = (char)v | 0x80;
-            v >>= 7;
-        }
-        _data[_offset++] = (char)v;
+        putVar(v);
     }
 
     void putVar64(u64 v) {
         assert(_offset + 9 < limit());
-        int iter = 0;
-        while (v > 0x1fffff) {
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            if (++iter == 3) return;
+        putVar(v);
+    }
+
+    // Encodes a fixed number of values with a single bounds check, fully unrolled by the compiler
+    template <int N>
+    void putVar32Array(const u32* values) {
+        assert(_offset + 5 * N < limit());
+        for (int i = 0; i < N; i++) {
+            putVar(values[i]);
         }
-        while (v > 0x7f) {
-            _data[_offset++] = (char)v | 0x80;
-            v >>= 7;
+    }
+
+    // Encodes several values in a row, e.g. all the fields of a stack frame
+    void putVar64Array(const u64* values, int count) {
+        assert(_offset + 9 * count < limit());
+        for (int i = 0; i < count; i++) {
+            putVar(values[i]);
         }
-        _data[_offset++] = (char)v;
     }
 
     void putUtf8(const char* v) {
@@ -14,15 +14,24 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "callTraceStorage.h"
 #include "os.h"
 #include "counters.h"
+#include "methodIndex.h"
+#include "stackTails.h"
 
 
 static const u32 INITIAL_CAPACITY = 65536;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
-static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+static const u32 FRAME_TRIE_CAPACITY = 1 << 20;
+// Slots of the previous table copied over with every new trace; a table is twice as large as its
+// previous one and grows at a 3/4 load, so the migration ends long before the next table is needed
+static const u32 MIGRATION_STEP = 16;
+static const u32 METHOD_INDEX_CAPACITY = 1 << 17;
 
 
 class LongHashTable {
@@ -30,9 +39,14 @@ class LongHashTable {
     LongHashTable* _prev;
     void* _padding0;
     u32 _capacity;
-    u32 _padding1[15];
+    // Consecutive resets after which a half as large table would have done
+    u32 _idle_resets;
+    u32 _padding1[14];
     volatile u32 _size;
-    u32 _padding2[15];
+    // The slots of the previous table claimed and then copied over by the samplers, see CallTraceStorage::migrate
+    volatile u32 _migration_claimed;
+    volatile u32 _migration_done;
+    u32 _padding2[13];
 
     static size_t getSize(u32 capacity) {
         size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
@@ -40,24 +54,29 @@ class LongHashTable {
     }
 
   public:
-    LongHashTable() : _prev(NULL), _padding0(NULL), _capacity(0), _size(0) {
+    LongHashTable() : _prev(NULL), _padding0(NULL), _capacity(0), _idle_resets(0), _size(0),
+                      _migration_claimed(0), _migration_done(0) {
         memset(_padding1, 0, sizeof(_padding1));
         memset(_padding2, 0, sizeof(_padding2));
     }
 
     static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
-        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
+        // Every lookup probes a random slot, so a large table spends less on TLB misses on huge pages
+        LongHashTable* table = (LongHashTable*)OS::safeAllocHuge(getSize(capacity));
         if (table != NULL) {
             table->_prev = prev;
             table->_capacity = capacity;
+            table->_idle_resets = 0;
             table->_size = 0;
+            table->_migration_claimed = 0;
+            table->_migration_done = 0;
         }
         return table;
     }
 
     LongHashTable* destroy() {
         LongHashTable* prev = _prev;
-        OS::safeFree(this, getSize(_capacity));
+        OS::safeFreeHuge(this, getSize(_capacity));
         return prev;
     }
 
@@ -65,6 +84,18 @@ class LongHashTable {
         return _prev;
     }
 
+    void setPrev(LongHashTable* prev) {
+        _prev = prev;
+    }
+
+    u32 idleResets() {
+        return _idle_resets;
+    }
+
+    void setIdleResets(u32 idle_resets) {
+        _idle_resets = idle_resets;
+    }
+
     u32 capacity() {
         return _capacity;
     }
@@ -77,6 +108,26 @@ class LongHashTable {
         return __sync_add_and_fetch(&_size, 1);
     }
 
+    // The first of the given number of slots of the previous table to copy over, or its capacity if none are left
+    u32 claimMigration(u32 slots) {
+        u32 prev_capacity = _prev->_capacity;
+        if (__atomic_load_n(&_migration_claimed, __ATOMIC_RELAXED) >= prev_capacity) {
+            return prev_capacity;
+        }
+        u32 start = __sync_fetch_and_add(&_migration_claimed, slots);
+        return start < prev_capacity ? start : prev_capacity;
+    }
+
+    void completeMigration(u32 slots) {
+        __sync_add_and_fetch(&_migration_done, slots);
+    }
+
+    // Whether all the traces of the previous table have been copied over; the table itself is kept
+    // until the generation is reset, since the trace ids handed out for its slots remain valid
+    bool migrated() {
+        return _prev == NULL || __atomic_load_n(&_migration_done, __ATOMIC_ACQUIRE) >= _prev->_capacity;
+    }
+
     u64* keys() {
         return (u64*)(this + 1);
     }
@@ -88,38 +139,341 @@ class LongHashTable {
     void clear() {
         memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity);
         _size = 0;
+        _migration_claimed = 0;
+        _migration_done = 0;
+    }
+};
+
+
+// The flat representation of a stored trace. A frame whose method is in the MethodIndex takes a single word
+// of its index in the high half and its bci, frame type included, in the low half; any other frame takes
+// the PACKED_ESCAPE word with its bci, followed by its method_id.
+struct PackedCallTrace {
+    bool truncated;
+    int num_frames;
+    u64 words[1];
+};
+
+struct FrameTrieNode {
+    FrameTrieNode* parent;
+    ASGCT_CallFrame frame;
+};
+
+// Header-compatible with CallTrace; the negated num_frames tells the two apart
+struct TrieCallTrace {
+    bool truncated;
+    int num_frames;
+    FrameTrieNode* leaf;
+};
+
+// Fixed size open-addressing table of trie nodes keyed by (parent, frame).
+// Nodes live in the LinearAllocator of the owning generation.
+class FrameTrie {
+  private:
+    u32 _capacity;
+    volatile u32 _size;
+
+    static size_t getSize(u32 capacity) {
+        size_t size = sizeof(FrameTrie) + (sizeof(u64) + sizeof(FrameTrieNode*)) * capacity;
+        return (size + OS::page_mask) & ~OS::page_mask;
+    }
+
+    static u64 calcKey(FrameTrieNode* parent, const ASGCT_CallFrame& frame) {
+        const u64 M = 0xc6a4a7935bd1e995ULL;
+        u64 h = ((u64)(uintptr_t)parent * M) ^ ((u64)(uintptr_t)frame.method_id + ((u64)(u32)frame.bci << 48));
+        h ^= h >> 47;
+        h *= M;
+        h ^= h >> 47;
+        // 0 marks an empty slot
+        return h == 0 ? 1 : h;
+    }
+
+    u64* keys() {
+        return (u64*)(this + 1);
+    }
+
+    FrameTrieNode** nodes() {
+        return (FrameTrieNode**)(keys() + _capacity);
+    }
+
+  public:
+    static FrameTrie* allocate(u32 capacity) {
+        FrameTrie* trie = (FrameTrie*)OS::safeAllocHuge(getSize(capacity));
+        if (trie != NULL) {
+            trie->_capacity = capacity;
+            trie->_size = 0;
+        }
+        return trie;
+    }
+
+    void destroy() {
+        OS::safeFreeHuge(this, getSize(_capacity));
+    }
+
+    void clear() {
+        memset(keys(), 0, (sizeof(u64) + sizeof(FrameTrieNode*)) * _capacity);
+        _size = 0;
+    }
+
+    // Returns NULL when the trie is full or the node is still being published by another thread;
+    // the caller falls back to the flat representation then
+    FrameTrieNode* insert(FrameTrieNode* parent, const ASGCT_CallFrame& frame, LinearAllocator* allocator) {
+        u64 key = calcKey(parent, frame);
+        u64* keys = this->keys();
+        u32 slot = key & (_capacity - 1);
+        u32 step = 0;
+
+        while (true) {
+            u64 k = keys[slot];
+            if (k == key) {
+                FrameTrieNode* node = __atomic_load_n(&nodes()[slot], __ATOMIC_ACQUIRE);
+                if (node == NULL) {
+                    return NULL;
+                }
+                // the key keeps only the low bits of the bci, so distinct frames may share it
+                if (node->parent == parent && node->frame.method_id == frame.method_id && node->frame.bci == frame.bci) {
+                    return node;
+                }
+            } else if (k == 0) {
+                if (_size >= _capacity * 3 / 4) {
+                    return NULL;
+                }
+                if (!__sync_bool_compare_and_swap(&keys[slot], 0, key)) {
+                    continue;
+                }
+                __sync_add_and_fetch(&_size, 1);
+
+                FrameTrieNode* node = (FrameTrieNode*)allocator->alloc(sizeof(FrameTrieNode));
+                if (node != NULL) {
+                    node->parent = parent;
+                    node->frame = frame;
+                    Counters::increment(CALLTRACE_STORAGE_BYTES, sizeof(FrameTrieNode));
+                    __atomic_store_n(&nodes()[slot], node, __ATOMIC_RELEASE);
+                }
+                return node;
+            }
+            if (++step >= _capacity) {
+                return NULL;
+            }
+            slot = (slot + step) & (_capacity - 1);
+        }
     }
 };
 
 
 CallTrace CallTraceStorage::_overflow_trace = {false, 1, {BCI_ERROR, (jmethodID)"storage_overflow"}};
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK), _lock(0) {
+CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK), _standby_allocator(CALL_TRACE_CHUNK),
+                                       _expanded_traces(CALL_TRACE_CHUNK), _lock(0) {
+    _active_allocator = &_allocator;
     _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+    _standby_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+    _frame_trie = NULL;
+    _standby_frame_trie = NULL;
+    _method_index = MethodIndex::allocate(METHOD_INDEX_CAPACITY);
+    _use_frame_trie = false;
+    _stack_tails = NULL;
+    _frame_decoder = NULL;
     _overflow = 0;
+    _standby_overflow = 0;
+    _saturated = false;
+    _generation = 0;
 }
 
 CallTraceStorage::~CallTraceStorage() {
     while (_current_table != NULL) {
         _current_table = _current_table->destroy();
     }
+    while (_standby_table != NULL) {
+        _standby_table = _standby_table->destroy();
+    }
+    if (_frame_trie != NULL) {
+        _frame_trie->destroy();
+        _standby_frame_trie->destroy();
+    }
+    if (_method_index != NULL) {
+        _method_index->destroy();
+    }
+}
+
+void CallTraceStorage::configureArenas(bool prefault, bool huge_pages) {
+    _lock.lock();
+    _allocator.configure(prefault, huge_pages);
+    _standby_allocator.configure(prefault, huge_pages);
+    _lock.unlock();
+}
+
+void CallTraceStorage::enableFrameTrie(bool enabled) {
+    // Flat and trie traces can coexist, so the mode can be switched on a non-empty storage
+    _lock.lock();
+    if (enabled && _frame_trie == NULL) {
+        _frame_trie = FrameTrie::allocate(FRAME_TRIE_CAPACITY);
+        _standby_frame_trie = FrameTrie::allocate(FRAME_TRIE_CAPACITY);
+        if (_frame_trie == NULL || _standby_frame_trie == NULL) {
+            if (_frame_trie != NULL) _frame_trie->destroy();
+            if (_standby_frame_trie != NULL) _standby_frame_trie->destroy();
+            _frame_trie = _standby_frame_trie = NULL;
+        }
+    }
+    _use_frame_trie = enabled && _frame_trie != NULL;
+    _lock.unlock();
+}
+
+void CallTraceStorage::enableScopeFrames(FrameDecoder decoder) {
+    _lock.lock();
+    _frame_decoder = decoder;
+    _lock.unlock();
+}
+
+void CallTraceStorage::enableStackTails(StackTails* tails) {
+    _lock.lock();
+    _stack_tails = tails;
+    _lock.unlock();
+}
+
+// Keeps the largest table of the generation, which is the newest one, rather than the initial one:
+// the next generation then does not have to grow into fresh pages from signal handlers again.
+// The table is halved only after ARENA_RELEASE_GENERATIONS consecutive generations that would have fit.
+LongHashTable* CallTraceStorage::resetTable(LongHashTable* table) {
+    u32 traces = 0;
+    for (LongHashTable* t = table; t != NULL; t = t->prev()) {
+        traces += t->size();
+    }
+    while (table->prev() != NULL) {
+        table->setPrev(table->prev()->destroy());
+    }
+
+    u32 capacity = table->capacity();
+    if (capacity > INITIAL_CAPACITY && traces < capacity / 4) {
+        table->setIdleResets(table->idleResets() + 1);
+        if (table->idleResets() >= ARENA_RELEASE_GENERATIONS) {
+            LongHashTable* smaller = LongHashTable::allocate(NULL, capacity / 2);
+            if (smaller != NULL) {
+                table->destroy();
+                table = smaller;
+            }
+        }
+    } else {
+        table->setIdleResets(0);
+    }
+    // Also faults in the pages of a freshly mapped table
+    table->clear();
+    return table;
 }
 
 void CallTraceStorage::clear() {
     _lock.lock();
-    while (_current_table->prev() != NULL) {
-        _current_table = _current_table->destroy();
+    _current_table = resetTable(_current_table);
+    _standby_table = resetTable(_standby_table);
+    if (_frame_trie != NULL) {
+        _frame_trie->clear();
+        _standby_frame_trie->clear();
     }
-    _current_table->clear();
     _allocator.clear();
+    _standby_allocator.clear();
     _overflow = 0;
+    _standby_overflow = 0;
+    if (_stack_tails != NULL) {
+        _stack_tails->clear();
+    }
+    __atomic_add_fetch(&_generation, 1, __ATOMIC_RELEASE);
     Counters::set(CALLTRACE_STORAGE_BYTES, 0);
     Counters::set(CALLTRACE_STORAGE_TRACES, 0);
     _lock.unlock();
 }
 
-void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+void CallTraceStorage::rotate() {
+    _lock.lock();
+    LongHashTable* retired_table = _current_table;
+    _current_table = _standby_table;
+    _standby_table = retired_table;
+    _active_allocator = _active_allocator == &_allocator ? &_standby_allocator : &_allocator;
+    if (_frame_trie != NULL) {
+        FrameTrie* retired_trie = _frame_trie;
+        _frame_trie = _standby_frame_trie;
+        _standby_frame_trie = retired_trie;
+    }
+    _standby_overflow = __atomic_exchange_n(&_overflow, 0, __ATOMIC_ACQ_REL);
+    if (_stack_tails != NULL) {
+        _stack_tails->rotate();
+    }
+    __atomic_add_fetch(&_generation, 1, __ATOMIC_RELEASE);
+    _lock.unlock();
+
+    Counters::set(CALLTRACE_STORAGE_BYTES, 0);
+    Counters::set(CALLTRACE_STORAGE_TRACES, 0);
+}
+
+void CallTraceStorage::recycle() {
+    // Samplers never see the standby generation, so it can be cleaned up without the lock
+    _standby_table = resetTable(_standby_table);
+    if (_standby_frame_trie != NULL) {
+        _standby_frame_trie->clear();
+    }
+    if (_active_allocator == &_allocator) {
+        _standby_allocator.clear();
+    } else {
+        _allocator.clear();
+    }
+    if (_stack_tails != NULL) {
+        _stack_tails->recycle();
+    }
+}
+
+void CallTraceStorage::resolveFrames(CallTrace* trace, std::vector<ASGCT_CallFrame>& frames, bool* truncated, bool retired) {
+    *truncated = trace->truncated;
+    if (trace->num_frames < 0) {
+        // The leaf node holds the top frame; the path to the root is the rest of the stack
+        frames.resize(-trace->num_frames);
+        FrameTrieNode* node = ((TrieCallTrace*)trace)->leaf;
+        for (size_t i = 0; i < frames.size(); i++, node = node->parent) {
+            frames[i] = node->frame;
+        }
+    } else {
+        frames.resize(trace->num_frames);
+        const u64* word = ((PackedCallTrace*)trace)->words;
+        for (size_t i = 0; i < frames.size(); i++) {
+            u32 index = (u32)(*word >> 32);
+            frames[i].bci = (jint)(u32)*word++;
+            frames[i].method_id = (jmethodID)(index == PACKED_ESCAPE ? *word++ : _method_index->method(index));
+        }
+    }
+    if (_frame_decoder != NULL) {
+        _frame_decoder(frames);
+    }
+    if (_stack_tails != NULL && !frames.empty() && frames.back().bci == BCI_STACK_TAIL) {
+        CallTrace* tail = _stack_tails->find((u64)frames.back().method_id, retired);
+        frames.pop_back();
+        // without its tail, the trace is left as truncated as it was sampled
+        *truncated = tail != NULL ? tail->truncated : true;
+        if (tail != NULL) {
+            frames.insert(frames.end(), tail->frames, tail->frames + tail->num_frames);
+        }
+    }
+}
+
+// The trace as the dump sees it, as a plain frame array
+CallTrace* CallTraceStorage::collectCallTrace(CallTrace* trace, std::vector<ASGCT_CallFrame>& frames, bool retired) {
+    bool truncated;
+    resolveFrames(trace, frames, &truncated, retired);
+    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+    CallTrace* resolved = (CallTrace*)_expanded_traces.alloc(header_size + frames.size() * sizeof(ASGCT_CallFrame));
+    if (resolved == NULL) {
+        return &_overflow_trace;
+    }
+    resolved->truncated = truncated;
+    resolved->num_frames = (int)frames.size();
+    if (!frames.empty()) {
+        memcpy(resolved->frames, frames.data(), frames.size() * sizeof(ASGCT_CallFrame));
+    }
+    return resolved;
+}
+
+void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map, bool retired) {
+    std::vector<ASGCT_CallFrame> frames;
+    // Traces expanded for the previous chunk are no longer referenced
+    _expanded_traces.clear();
+    for (LongHashTable* table = retired ? _standby_table : _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
@@ -130,39 +484,209 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
                 values[slot].samples = 0;
                 CallTrace* trace = values[slot].acquireTrace();
                 if (trace != NULL) {
-                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = trace;
+                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = collectCallTrace(trace, frames, retired);
                 }
             }
         }
     }
-    if (_overflow > 0) {
+    if ((retired ? _standby_overflow : _overflow) > 0) {
         map[OVERFLOW_TRACE_ID] = &_overflow_trace;
     }
 }
 
-// Adaptation of MurmurHash64A by Austin Appleby
-u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames, bool truncated) {
+void CallTraceStorage::releaseTraces() {
+    _expanded_traces.release();
+}
+
+void CallTraceStorage::collectSamples(std::vector<CallTraceSample>& samples) {
+    std::vector<ASGCT_CallFrame> frames;
+    _expanded_traces.clear();
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u64* keys = table->keys();
+        CallTraceSample* values = table->values();
+        u32 capacity = table->capacity();
+
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (keys[slot] != 0 && loadAcquire(values[slot].samples) != 0) {
+                CallTrace* trace = values[slot].acquireTrace();
+                if (trace != NULL) {
+                    CallTraceSample sample;
+                    sample.samples = __atomic_exchange_n(&values[slot].samples, 0, __ATOMIC_ACQ_REL);
+                    sample.counter = __atomic_exchange_n(&values[slot].counter, 0, __ATOMIC_ACQ_REL);
+                    sample.trace = collectCallTrace(trace, frames);
+                    samples.push_back(sample);
+                }
+            }
+        }
+    }
+    if (_overflow > 0) {
+        CallTraceSample sample;
+        sample.trace = &_overflow_trace;
+        sample.samples = __atomic_exchange_n(&_overflow, 0, __ATOMIC_ACQ_REL);
+        sample.counter = 0;
+        samples.push_back(sample);
+    }
+}
+
+CallTrace* CallTraceStorage::copyCallTrace(CallTrace* trace) {
+    std::vector<ASGCT_CallFrame> frames;
+    bool truncated;
+    if (trace == &_overflow_trace) {
+        // the only trace which is not stored packed
+        truncated = trace->truncated;
+        frames.assign(trace->frames, trace->frames + trace->num_frames);
+    } else {
+        resolveFrames(trace, frames, &truncated);
+    }
+    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+    CallTrace* copy = (CallTrace*)malloc(header_size + (frames.empty() ? 1 : frames.size()) * sizeof(ASGCT_CallFrame));
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->truncated = truncated;
+    copy->num_frames = (int)frames.size();
+    if (!frames.empty()) {
+        memcpy(copy->frames, frames.data(), frames.size() * sizeof(ASGCT_CallFrame));
+    }
+    return copy;
+}
+
+bool CallTraceStorage::topTraces(size_t n, std::vector<CallTraceSample>& top) {
+    // the shared side keeps the tables of the active generation alive without excluding the samplers
+    if (!_lock.tryLockShared()) {
+        return false;
+    }
+    // a heap of the n largest counters so far, the smallest one on top
+    top.clear();
+    for (LongHashTable* table = _current_table; table != NULL && n > 0; table = table->prev()) {
+        u64* keys = table->keys();
+        CallTraceSample* values = table->values();
+        u32 capacity = table->capacity();
+
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (loadAcquire(keys[slot]) == 0) {
+                continue;
+            }
+            CallTraceSample sample;
+            sample.trace = values[slot].acquireTrace();
+            sample.samples = loadAcquire(values[slot].samples);
+            sample.counter = loadAcquire(values[slot].counter);
+            // the samples, but not the counters, are reset by every chunk
+            if (sample.trace == NULL || (sample.samples == 0 && sample.counter == 0)) {
+                continue;
+            }
+            if (top.size() < n) {
+                top.push_back(sample);
+                std::push_heap(top.begin(), top.end());
+            } else if (sample.counter > top.front().counter) {
+                std::pop_heap(top.begin(), top.end());
+                top.back() = sample;
+                std::push_heap(top.begin(), top.end());
+            }
+        }
+    }
+    std::sort(top.begin(), top.end());
+    size_t copied = 0;
+    for (size_t i = 0; i < top.size(); i++) {
+        CallTrace* copy = copyCallTrace(top[i].trace);
+        if (copy != NULL) {
+            top[i].trace = copy;
+            top[copied++] = top[i];
+        }
+    }
+    top.resize(copied);
+    _lock.unlockShared();
+    return true;
+}
+
+bool CallTraceStorage::copyTraces(u32 generation, const std::vector<u32>& ids, std::vector<CallTrace*>& traces) {
+    if (!_lock.tryLockShared()) {
+        return false;
+    }
+    if (this->generation() != generation) {
+        _lock.unlockShared();
+        return false;
+    }
+    traces.assign(ids.size(), NULL);
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i] == OVERFLOW_TRACE_ID) {
+            traces[i] = copyCallTrace(&_overflow_trace);
+            continue;
+        }
+        // the ids of a table of capacity c are c - (INITIAL_CAPACITY - 1) + slot
+        u64 base = (u64)ids[i] + INITIAL_CAPACITY - 1;
+        for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+            u32 capacity = table->capacity();
+            if (base >= capacity && base < 2 * (u64)capacity) {
+                u32 slot = (u32)(base - capacity);
+                CallTrace* trace = table->values()[slot].acquireTrace();
+                if (trace != NULL) {
+                    traces[i] = copyCallTrace(trace);
+                }
+                break;
+            }
+        }
+    }
+    _lock.unlockShared();
+    return true;
+}
+
+// Only the Java and native frames are packed: the PCs, tails and the like are too many to be indexed
+int CallTraceStorage::packFrame(const ASGCT_CallFrame& frame, u64* words) {
+    u64 method = (u64)(uintptr_t)frame.method_id;
+    bool indexed = (frame.bci > BCI_WALL || frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ERROR)
+                   && method != 0 && _method_index != NULL;
+    u32 index = indexed ? _method_index->lookup(method) : PACKED_ESCAPE;
+    words[0] = (u64)index << 32 | (u32)frame.bci;
+    if (index != PACKED_ESCAPE) {
+        return 1;
+    }
+    words[1] = method;
+    return 2;
+}
+
+static inline u64 mixHash(u64 h, u64 k) {
     const u64 M = 0xc6a4a7935bd1e995ULL;
     const int R = 47;
+    k *= M;
+    k ^= k >> R;
+    k *= M;
+    h ^= k;
+    h *= M;
+    return h;
+}
+
+// Adaptation of MurmurHash64A by Austin Appleby. The bci and method of two frames at a time go to
+// four independent lanes, so that deep stacks are not hashed at the latency of one multiply chain.
+// The raw frames are hashed rather than the packed ones: indexing every method would cost more than
+// it saves, and a trace must hash the same whether or not its methods have been indexed yet.
+// The method_id of a frame as far as the hash is concerned, see COMPILED_PC_SHIFT
+static inline u64 hashedMethod(const ASGCT_CallFrame& frame) {
+    u64 method = (u64)(uintptr_t)frame.method_id;
+    return frame.bci == BCI_COMPILED_PC ? method & (((u64)1 << COMPILED_PC_SHIFT) - 1) : method;
+}
 
-    int len = num_frames * sizeof(ASGCT_CallFrame);
-    u64 h = len * M * (truncated ? 1 : 2);
+u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames, bool truncated) {
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    const int R = 47;
 
-    const u64* data = (const u64*)frames;
-    const u64* end = data + len / sizeof(u64);
+    u64 h = num_frames * M * (truncated ? 1 : 2);
+    u64 lanes[4] = {h, h ^ 0x9e3779b97f4a7c15ULL, h ^ 0xbf58476d1ce4e5b9ULL, h ^ 0x94d049bb133111ebULL};
 
-    while (data != end) {
-        u64 k = *data++;
-        k *= M;
-        k ^= k >> R;
-        k *= M;
-        h ^= k;
-        h *= M;
+    int i = 0;
+    for (; i + 1 < num_frames; i += 2) {
+        lanes[0] = mixHash(lanes[0], (u32)frames[i].bci);
+        lanes[1] = mixHash(lanes[1], hashedMethod(frames[i]));
+        lanes[2] = mixHash(lanes[2], (u32)frames[i + 1].bci);
+        lanes[3] = mixHash(lanes[3], hashedMethod(frames[i + 1]));
+    }
+    if (i < num_frames) {
+        lanes[0] = mixHash(lanes[0], (u32)frames[i].bci);
+        lanes[1] = mixHash(lanes[1], hashedMethod(frames[i]));
     }
 
-    if (len & 4) {
-        h ^= *(u32*)data;
-        h *= M;
+    for (int j = 0; j < 4; j++) {
+        h = mixHash(h, lanes[j]);
     }
 
     h ^= h >> R;
@@ -172,21 +696,56 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames, bool tru
     return h;
 }
 
+CallTrace* CallTraceStorage::storeTrieCallTrace(int num_frames, ASGCT_CallFrame* frames, bool truncated) {
+    FrameTrie* trie = _frame_trie;
+    FrameTrieNode* node = NULL;
+    // Walk from the outermost frame so that common stack prefixes map to the same nodes
+    for (int i = num_frames - 1; i >= 0; i--) {
+        node = trie->insert(node, frames[i], _active_allocator);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    TrieCallTrace* buf = (TrieCallTrace*)_active_allocator->alloc(sizeof(TrieCallTrace));
+    if (buf != NULL) {
+        buf->truncated = truncated;
+        buf->num_frames = -num_frames;
+        buf->leaf = node;
+        Counters::increment(CALLTRACE_STORAGE_BYTES, sizeof(TrieCallTrace));
+        Counters::increment(CALLTRACE_STORAGE_TRACES);
+    }
+    return (CallTrace*)buf;
+}
+
 CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames, bool truncated) {
-    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    const size_t total_size = header_size + num_frames * sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(total_size);
+    if (_use_frame_trie && num_frames > 0) {
+        CallTrace* trace = storeTrieCallTrace(num_frames, frames, truncated);
+        if (trace != NULL) {
+            return trace;
+        }
+        // The trie is full; store the trace as a plain array
+    }
+    int words = 0;
+    for (int i = 0; i < num_frames; i++) {
+        u64 packed[2];
+        words += packFrame(frames[i], packed);
+    }
+    // A method may have been indexed since the words were counted, which only makes the trace shorter
+    const size_t header_size = sizeof(PackedCallTrace) - sizeof(u64);
+    const size_t total_size = header_size + words * sizeof(u64);
+    PackedCallTrace* buf = (PackedCallTrace*)_active_allocator->alloc(total_size);
     if (buf != NULL) {
         buf->num_frames = num_frames;
-        // Do not use memcpy inside signal handler
+        u64* word = buf->words;
         for (int i = 0; i < num_frames; i++) {
-            buf->frames[i] = frames[i];
+            word += packFrame(frames[i], word);
         }
         buf->truncated = truncated;
         Counters::increment(CALLTRACE_STORAGE_BYTES, total_size);
         Counters::increment(CALLTRACE_STORAGE_TRACES);
     }
-    return buf;
+    return (CallTrace*)buf;
 }
 
 CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
@@ -208,6 +767,60 @@ CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
     return table->values()[slot].trace;
 }
 
+// Increments the table size, and if the load factor exceeds 0.75, reserves a new table
+void CallTraceStorage::grow(LongHashTable* table) {
+    u32 capacity = table->capacity();
+    if (table->incSize() == capacity * 3 / 4) {
+        LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
+        if (new_table != NULL) {
+            __sync_bool_compare_and_swap(&_current_table, table, new_table);
+        }
+    }
+}
+
+// Copies the next MIGRATION_STEP slots of the previous table over, so that the misses stop probing it
+// before long. Their slots in the previous table are left as they are: the samples already counted
+// there are collected under the ids handed out for them.
+void CallTraceStorage::migrate(LongHashTable* table) {
+    LongHashTable* prev_table = table->prev();
+    u32 prev_capacity = prev_table->capacity();
+    u32 start = table->claimMigration(MIGRATION_STEP);
+    if (start >= prev_capacity) {
+        return;
+    }
+    u32 end = start + MIGRATION_STEP < prev_capacity ? start + MIGRATION_STEP : prev_capacity;
+
+    u64* prev_keys = prev_table->keys();
+    CallTraceSample* prev_values = prev_table->values();
+    u64* keys = table->keys();
+    u32 capacity = table->capacity();
+    for (u32 i = start; i < end; i++) {
+        u64 hash = loadAcquire(prev_keys[i]);
+        CallTrace* trace = hash == 0 ? NULL : prev_values[i].acquireTrace();
+        if (trace == NULL) {
+            continue;
+        }
+        u32 slot = hash & (capacity - 1);
+        u32 step = 0;
+        u64 key;
+        while ((key = loadAcquire(keys[slot])) != hash) {
+            if (key == 0) {
+                if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
+                    continue;
+                }
+                table->values()[slot].setTrace(trace);
+                grow(table);
+                break;
+            }
+            if (++step >= capacity) {
+                break;
+            }
+            slot = (slot + step) & (capacity - 1);
+        }
+    }
+    table->completeMigration(end - start);
+}
+
 u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, bool truncated, u64 counter) {
     // Currently, CallTraceStorage is a singleton used globally in Profiler and therefore
     // start-stop operation requires data structures cleanup.
@@ -229,29 +842,27 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, bool truncate
 
     while (keys[slot] != hash) {
         if (keys[slot] == 0) {
+            if (_saturated) {
+                atomicInc(_overflow);
+                _lock.unlockShared();
+                return OVERFLOW_TRACE_ID;
+            }
             if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
                 continue;
             }
 
-            // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
-            if (table->incSize() == capacity * 3 / 4) {
-                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
-                if (new_table != NULL) {
-                    __sync_bool_compare_and_swap(&_current_table, table, new_table);
-                }
-            }
+            grow(table);
 
-            // Migrate from a previous table to save space
-            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
+            // Only a table still being migrated may hold the trace already
+            LongHashTable* prev_table = table->prev();
+            CallTrace* trace = table->migrated() ? NULL : findCallTrace(prev_table, hash);
             if (trace == NULL) {
                 trace = storeCallTrace(num_frames, frames, truncated);
             }
             table->values()[slot].setTrace(trace);
 
-            // clear the slot in the prev table such it is not written out to constant pool multiple times
-            LongHashTable* prev_table = table->prev();
             if (prev_table != NULL) {
-                prev_table->keys()[slot] = 0;
+                migrate(table);
             }
             break;
         }
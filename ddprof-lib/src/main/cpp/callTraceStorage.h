@@ -26,7 +26,17 @@
 
 
 class LongHashTable;
+class FrameTrie;
+class MethodIndex;
+class StackTails;
 
+// Decodes the BCI_COMPILED_PC frames of a collected trace in place
+typedef void (*FrameDecoder)(std::vector<ASGCT_CallFrame>& frames);
+
+// The id returned by put() once the storage is full; all such samples share one "storage_overflow" trace
+const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+
+// A trace as collected from the storage; the stored traces are packed, see PackedCallTrace
 struct CallTrace {
     bool truncated;
     int num_frames;
@@ -62,24 +72,94 @@ class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
 
+    // Two generations of traces: the active one is filled by samplers,
+    // the standby one is either clean or waits to be recycled after a dump
     LinearAllocator _allocator;
+    LinearAllocator _standby_allocator;
+    LinearAllocator* _active_allocator;
     LongHashTable* _current_table;
+    LongHashTable* _standby_table;
+    // Optional shared-prefix representation of call traces, see enableFrameTrie()
+    FrameTrie* _frame_trie;
+    FrameTrie* _standby_frame_trie;
+    // The methods the packed frames refer to by index; shared by all generations
+    MethodIndex* _method_index;
+    LinearAllocator _expanded_traces;
+    bool _use_frame_trie;
+    // Replaces the BCI_STACK_TAIL frames of truncated traces when they are collected
+    StackTails* _stack_tails;
+    // Set if the traces may hold BCI_COMPILED_PC frames to decode when they are collected
+    FrameDecoder _frame_decoder;
     u64 _overflow;
+    // the overflowed samples of the generation retired by rotate()
+    u64 _standby_overflow;
+    // Set by MemoryGovernor: only the already known traces are stored
+    volatile bool _saturated;
+    // Incremented whenever the trace ids handed out so far become invalid
+    volatile u32 _generation;
 
     SpinLock _lock;
 
+    int packFrame(const ASGCT_CallFrame& frame, u64* words);
     u64 calcHash(int num_frames, ASGCT_CallFrame* frames, bool truncated);
     CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames, bool truncated);
+    CallTrace* storeTrieCallTrace(int num_frames, ASGCT_CallFrame* frames, bool truncated);
+    void resolveFrames(CallTrace* trace, std::vector<ASGCT_CallFrame>& frames, bool* truncated, bool retired = false);
+    CallTrace* collectCallTrace(CallTrace* trace, std::vector<ASGCT_CallFrame>& frames, bool retired = false);
+    CallTrace* copyCallTrace(CallTrace* trace);
     CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    void grow(LongHashTable* table);
+    void migrate(LongHashTable* table);
+    LongHashTable* resetTable(LongHashTable* table);
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
     void clear();
-    void collectTraces(std::map<u32, CallTrace*>& map);
+    // How the trace arenas retained across dumps are mapped, see LinearAllocator::configure()
+    void configureArenas(bool prefault, bool huge_pages);
+    // Stores new traces as paths in a frame trie, so that common stack prefixes are kept only once.
+    // collectTraces() expands such traces back to frame arrays.
+    void enableFrameTrie(bool enabled);
+    // Collected traces get their BCI_COMPILED_PC frames replaced with the frames inlined at that PC,
+    // decoded from the scope data of its nmethod by the decoder, which keeps the storage free of VMStructs.
+    // Stays on, as the traces sampled so far may hold such frames.
+    void enableScopeFrames(FrameDecoder decoder);
+    // The tails which collected traces ending with a BCI_STACK_TAIL frame are stitched to, see StackTails;
+    // their generations are rotated, recycled and cleared along with those of the storage
+    void enableStackTails(StackTails* tails);
+    // Collects the traces sampled since the previous call, of the active generation or of the one
+    // retired by rotate(), which the samplers no longer touch
+    void collectTraces(std::map<u32, CallTrace*>& map, bool retired = false);
+    // Collects the traces sampled since the previous call along with their sample counts and counters,
+    // resetting both; the overflowed samples are attributed to the "storage_overflow" trace
+    void collectSamples(std::vector<CallTraceSample>& samples);
+    // Frees the frame arrays of the traces collected by the calls above, which must no longer be used
+    void releaseTraces();
+    // Copies the n traces with the highest counters since the last rotate(), by decreasing counter, without
+    // resetting anything. Samplers are not held off, a concurrent rotate() waits for the copies to be made.
+    // The copies are malloc'ed; false if the storage is being cleared.
+    bool topTraces(size_t n, std::vector<CallTraceSample>& top);
+    // Copies the traces of the given ids, NULL where an id is unknown, as long as the storage is still
+    // at the given generation; the copies are malloc'ed like the ones of topTraces()
+    bool copyTraces(u32 generation, const std::vector<u32>& ids, std::vector<CallTrace*>& traces);
+
+    // Atomically makes the standby generation active. Samplers are held off only for the pointer swap.
+    void rotate();
+    // Recycles the memory of the generation retired by rotate(), keeping as much of it as the recent
+    // generations needed. Must not race with another rotate().
+    void recycle();
 
     u32 put(int num_frames, ASGCT_CallFrame* frames, bool truncated, u64 counter);
+
+    void setSaturated(bool saturated) {
+        _saturated = saturated;
+    }
+
+    u32 generation() {
+        return __atomic_load_n(&_generation, __ATOMIC_ACQUIRE);
+    }
 };
 
 #endif // _CALLTRACESTORAGE
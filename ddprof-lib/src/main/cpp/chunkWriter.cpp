@@ -0,0 +1,107 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chunkWriter.h"
+#include "counters.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+#include "vmEntry.h"
+
+// Upper bound of a single wait, so that lost wakeups are never fatal
+static const u64 MAX_WAIT_MICROS = 1000000;
+
+
+u64 ChunkWriter::enqueue(const char* path, int length, Kind kind) {
+    MutexLocker ml(_lock);
+    if (!_started) {
+        if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+            Log::warn("Unable to create chunk writer thread");
+            return 0;
+        }
+        pthread_detach(_thread);
+        _started = true;
+    }
+
+    Request request = {++_last_submitted, std::string(path, length), kind};
+    _requests.push_back(request);
+    _lock.notifyAll();
+    return request.id;
+}
+
+bool ChunkWriter::await(u64 id, long timeout_millis, const char** error) {
+    MutexLocker ml(_lock);
+    u64 deadline = timeout_millis < 0 ? (u64)-1 : OS::micros() + (u64)timeout_millis * 1000;
+    while (_last_completed < id) {
+        u64 now = OS::micros();
+        if (now >= deadline) {
+            return false;
+        }
+        u64 wait = deadline - now;
+        _lock.waitUntil(now + (wait < MAX_WAIT_MICROS ? wait : MAX_WAIT_MICROS));
+    }
+
+    std::map<u64, const char*>::iterator it = _errors.find(id);
+    if (it != _errors.end()) {
+        *error = it->second;
+        _errors.erase(it);
+    }
+    return true;
+}
+
+void ChunkWriter::writerLoop() {
+    // Resolving methods while writing the constant pool requires a JNI environment
+    VM::attachThread("java-profiler Chunk Writer");
+
+    while (true) {
+        Request request;
+        {
+            MutexLocker ml(_lock);
+            while (_requests.empty()) {
+                _lock.waitUntil(OS::micros() + MAX_WAIT_MICROS);
+            }
+            request = _requests.front();
+            _requests.pop_front();
+        }
+
+        Error error = Error::OK;
+        switch (request.kind) {
+            case DUMP:
+                error = Profiler::instance()->dump(request.path.c_str(), request.path.length());
+                break;
+            case ROTATE:
+                error = Profiler::instance()->flushJfr();
+                break;
+            case UNSUBSCRIBE:
+                error = Profiler::instance()->unsubscribe(request.path.c_str());
+                break;
+        }
+
+        MutexLocker ml(_lock);
+        if (error) {
+            if (request.kind != DUMP) {
+                // nobody awaits these; the recording is most likely being stopped
+                Log::debug("Chunk writer request failed: %s", error.message());
+            } else {
+                _errors[request.id] = error.message();
+            }
+        } else if (request.kind == ROTATE) {
+            Counters::increment(CHUNK_ROTATIONS);
+        }
+        _last_completed = request.id;
+        _lock.notifyAll();
+    }
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CHUNKWRITER_H
+#define _CHUNKWRITER_H
+
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <string.h>
+#include "arch.h"
+#include "mutex.h"
+
+
+// Background thread serializing recording dumps requested through dumpAsync,
+// sealing the chunks that outgrow chunksize or chunktime in the working file,
+// and closing the subscribed recordings whose duration is over.
+// Requests are processed in the order they were submitted.
+class ChunkWriter {
+  private:
+    enum Kind {
+        DUMP,
+        // seals the current chunk, leaving it in the working file for the next dump
+        ROTATE,
+        // closes the subscribed recording of the path once its duration is over
+        UNSUBSCRIBE
+    };
+
+    struct Request {
+        u64 id;
+        std::string path;
+        Kind kind;
+    };
+
+    WaitableMutex _lock;
+    std::deque<Request> _requests;
+    // error messages of failed requests, removed once reported
+    std::map<u64, const char*> _errors;
+    u64 _last_submitted;
+    u64 _last_completed;
+    bool _started;
+    pthread_t _thread;
+
+    static void* threadEntry(void* writer) {
+        ((ChunkWriter*)writer)->writerLoop();
+        return NULL;
+    }
+
+    u64 enqueue(const char* path, int length, Kind kind);
+
+    void writerLoop();
+
+  public:
+    ChunkWriter() : _lock(), _requests(), _errors(), _last_submitted(0), _last_completed(0), _started(false) {
+    }
+
+    // Enqueues a dump of the current recording to the given path.
+    // Returns the request id, or 0 if the writer thread could not be started.
+    u64 submit(const char* path, int length) {
+        return enqueue(path, length, DUMP);
+    }
+
+    // Enqueues sealing the current chunk of the recording; returns false if the writer thread could not be started
+    bool rotate() {
+        return enqueue("", 0, ROTATE) != 0;
+    }
+
+    // Enqueues closing the recording subscribed with the given path
+    bool unsubscribe(const char* path) {
+        return enqueue(path, strlen(path), UNSUBSCRIBE) != 0;
+    }
+
+    // Waits up to timeout_millis for the request to complete; a negative timeout waits indefinitely.
+    // Returns false on timeout. The error of a failed request is reported once through 'error'.
+    bool await(u64 id, long timeout_millis, const char** error);
+};
+
+#endif // _CHUNKWRITER_H
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <map>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,12 +24,19 @@
 #include "os.h"
 
 
-char* NativeFunc::create(const char* name, short lib_index) {
-    NativeFunc* f = (NativeFunc*)malloc(sizeof(NativeFunc) + 1 + strlen(name));
+char* NativeFunc::init(void* memory, const char* name, size_t length, short lib_index) {
+    NativeFunc* f = (NativeFunc*)memory;
     f->_lib_index = lib_index;
     f->_mark = 0;
+    memcpy(f->_name, name, length);
+    f->_name[length] = 0;
+    return f->_name;
+}
+
+char* NativeFunc::create(const char* name, short lib_index) {
+    size_t length = strlen(name);
     // cppcheck-suppress memleak
-    return strcpy(f->_name, name);
+    return init(malloc(size(length)), name, length, lib_index);
 }
 
 void NativeFunc::destroy(char* name) {
@@ -46,13 +54,24 @@ CodeCache::CodeCache(const char* name, short lib_index, const void* min_address,
     _got_start = NULL;
     _got_end = NULL;
     _got_patchable = false;
-
-    _dwarf_table = NULL;
+    _has_marks = false;
+    memset(_imports, 0, sizeof(_imports));
+    _build_id[0] = 0;
+
+    _dwarf_state = DWARF_NONE;
+    _dwarf_source = NULL;
+    _dwarf_block = NULL;
+    _dwarf_block_size = 0;
     _dwarf_table_length = 0;
+    _dwarf_rule_count = 0;
+    _dwarf_pages = 0;
+    layoutDwarfBlock(false);
 
     _capacity = INITIAL_CODE_CACHE_CAPACITY;
     _count = 0;
+    _sorted = false;
     _blobs = new CodeBlob[_capacity];
+    initNames();
 }
 
 CodeCache::CodeCache(const CodeCache& other) {
@@ -64,24 +83,47 @@ CodeCache::CodeCache(const CodeCache& other) {
 
     _got_start = NULL;
     _got_end = NULL;
-
-    _dwarf_table_length = other._dwarf_table_length;
-    _dwarf_table = new FrameDesc[_dwarf_table_length];
-    memcpy(_dwarf_table, other._dwarf_table, _dwarf_table_length * sizeof(FrameDesc));
+    _has_marks = other._has_marks;
+    memset(_imports, 0, sizeof(_imports));
+    memcpy(_build_id, other._build_id, sizeof(_build_id));
+
+    _dwarf_block_size = other._dwarf_block_size;
+    _dwarf_block = _dwarf_block_size > 0 ? (char*)malloc(_dwarf_block_size) : NULL;
+    if (_dwarf_block != NULL) {
+        memcpy(_dwarf_block, other._dwarf_block, _dwarf_block_size);
+    }
+    _dwarf_table_length = _dwarf_block != NULL ? other._dwarf_table_length : 0;
+    _dwarf_rule_count = other._dwarf_rule_count;
+    _dwarf_pages = other._dwarf_pages;
+    layoutDwarfBlock(other._dwarf_rule_ids != NULL);
+    _dwarf_source = other._dwarf_source;
+    // a copy does not inherit a pending request, it is parsed on its own first use
+    _dwarf_state = _dwarf_block != NULL ? DWARF_READY : _dwarf_source != NULL && other._dwarf_state != DWARF_NONE ? DWARF_PENDING : DWARF_NONE;
 
     _capacity = other._capacity;
     _count = other._count;
+    _sorted = other._sorted;
     _blobs = new CodeBlob[_capacity];
     memcpy(_blobs, other._blobs, _count * sizeof(CodeBlob));
+    // the names belong to the chunks of the other cache
+    initNames();
+    for (int i = 0; i < _count; i++) {
+        const char* name = other._blobs[i]._name;
+        _blobs[i]._name = internName(name, NativeFunc::libIndex(name));
+        if (NativeFunc::isMarked(name)) {
+            NativeFunc::mark(_blobs[i]._name);
+        }
+    }
 }
 
 CodeCache& CodeCache::operator=(const CodeCache& other) {
     if (&other == this) {
         return *this;
     } else {
-        delete _name;
-        delete _dwarf_table;
-        delete _blobs;
+        NativeFunc::destroy(_name);
+        free(_dwarf_block);
+        delete[] _blobs;
+        freeNames();
 
         _name = NativeFunc::create(other._name, -1);
         _lib_index = other._lib_index;
@@ -91,44 +133,161 @@ CodeCache& CodeCache::operator=(const CodeCache& other) {
 
         _got_start = other._got_start;
         _got_end = other._got_end;
-
-        _dwarf_table = NULL;
+        _has_marks = other._has_marks;
+        memcpy(_imports, other._imports, sizeof(_imports));
+        memcpy(_build_id, other._build_id, sizeof(_build_id));
+
+        _dwarf_state = DWARF_NONE;
+        _dwarf_source = NULL;
+        _dwarf_block = NULL;
+        _dwarf_block_size = 0;
         _dwarf_table_length = 0;
+        _dwarf_rule_count = 0;
+        _dwarf_pages = 0;
+        layoutDwarfBlock(false);
 
         _capacity = INITIAL_CODE_CACHE_CAPACITY;
         _count = 0;
+        _sorted = false;
         _blobs = new CodeBlob[_capacity];
+        initNames();
 
         return *this;
     }
 }
 
 CodeCache::~CodeCache() {
-    for (int i = 0; i < _count; i++) {
-        NativeFunc::destroy(_blobs[i]._name);
-    }
     NativeFunc::destroy(_name);
     delete[] _blobs;
-    free(_dwarf_table);
+    free(_dwarf_block);
+    freeNames();
 }
 
 void CodeCache::expand() {
+    reserve(_capacity);
+}
+
+void CodeCache::reserve(int count) {
+    if (_count + count <= _capacity) {
+        return;
+    }
+    int capacity = _capacity * 2 > _count + count ? _capacity * 2 : _count + count;
     CodeBlob* old_blobs = _blobs;
-    CodeBlob* new_blobs = new CodeBlob[_capacity * 2];
+    CodeBlob* new_blobs = new CodeBlob[capacity];
 
     memcpy(new_blobs, old_blobs, _count * sizeof(CodeBlob));
 
-    _capacity *= 2;
+    _capacity = capacity;
     _blobs = new_blobs;
     delete[] old_blobs;
 }
 
-void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
-    char* name_copy = NativeFunc::create(name, _lib_index);
-    // Replace non-printable characters
-    for (char* s = name_copy; *s != 0; s++) {
-        if (*s < ' ') *s = '?';
+void CodeCache::initNames() {
+    _name_chunk = NULL;
+    _name_pos = NULL;
+    _name_end = NULL;
+    _name_bytes = 0;
+    _name_table = NULL;
+    _name_table_size = 0;
+    _name_count = 0;
+}
+
+void CodeCache::freeNames() {
+    for (char* chunk = _name_chunk; chunk != NULL; ) {
+        char* prev = *(char**)chunk;
+        free(chunk);
+        chunk = prev;
     }
+    free(_name_table);
+    initNames();
+}
+
+char* CodeCache::allocateName(size_t size) {
+    // NativeFunc is aligned like its short field
+    size = (size + alignof(NativeFunc) - 1) & ~(alignof(NativeFunc) - 1);
+    if (size > (size_t)(_name_end - _name_pos)) {
+        bool own_chunk = size > NAME_CHUNK_SIZE / 4;
+        size_t chunk_size = sizeof(char*) + (own_chunk ? size : NAME_CHUNK_SIZE);
+        char* chunk = (char*)malloc(chunk_size);
+        _name_bytes += chunk_size;
+        if (own_chunk && _name_chunk != NULL) {
+            // linked behind the current chunk, whose free space is still of use
+            *(char**)chunk = *(char**)_name_chunk;
+            *(char**)_name_chunk = chunk;
+            return chunk + sizeof(char*);
+        }
+        *(char**)chunk = _name_chunk;
+        _name_chunk = chunk;
+        _name_pos = chunk + sizeof(char*);
+        _name_end = chunk + chunk_size;
+    }
+    char* memory = _name_pos;
+    _name_pos += size;
+    return memory;
+}
+
+// Non-printable characters are replaced in the stored names, and so when they are compared
+static inline char printable(char c) {
+    return c < ' ' ? '?' : c;
+}
+
+static u32 hashName(const char* name, size_t* length) {
+    u32 h = 2166136261U;
+    const char* s = name;
+    for (; *s != 0; s++) {
+        h = (h ^ (u8)printable(*s)) * 16777619U;
+    }
+    *length = s - name;
+    return h;
+}
+
+static bool sameName(const char* interned, const char* name, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (interned[i] != printable(name[i])) {
+            return false;
+        }
+    }
+    return interned[length] == 0;
+}
+
+char* CodeCache::internName(const char* name, short lib_index) {
+    if (_name_count >= _name_table_size / 4 * 3) {
+        u32 old_size = _name_table_size;
+        char** old_table = _name_table;
+        _name_table_size = old_size == 0 ? INITIAL_NAME_TABLE_SIZE : old_size * 2;
+        _name_table = (char**)calloc(_name_table_size, sizeof(char*));
+        for (u32 i = 0; i < old_size; i++) {
+            if (old_table[i] != NULL) {
+                size_t length;
+                u32 slot = hashName(old_table[i], &length) & (_name_table_size - 1);
+                while (_name_table[slot] != NULL) {
+                    slot = (slot + 1) & (_name_table_size - 1);
+                }
+                _name_table[slot] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+    size_t length;
+    u32 slot = hashName(name, &length) & (_name_table_size - 1);
+    for (char* interned; (interned = _name_table[slot]) != NULL; slot = (slot + 1) & (_name_table_size - 1)) {
+        if (NativeFunc::libIndex(interned) == lib_index && sameName(interned, name, length)) {
+            return interned;
+        }
+    }
+
+    char* interned = NativeFunc::init(allocateName(NativeFunc::size(length)), name, length, lib_index);
+    for (char* s = interned; *s != 0; s++) {
+        *s = printable(*s);
+    }
+    _name_table[slot] = interned;
+    _name_count++;
+    return interned;
+}
+
+void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
+    char* name_copy = internName(name, _lib_index);
 
     if (_count >= _capacity) {
         expand();
@@ -139,6 +298,7 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
     _blobs[_count]._end = end;
     _blobs[_count]._name = name_copy;
     _count++;
+    _sorted = false;
 
     if (update_bounds) {
         updateBounds(start, end);
@@ -154,6 +314,13 @@ void CodeCache::sort() {
     if (_count == 0) return;
 
     qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
+    _sorted = true;
+
+    // the names added from now on are interned among themselves only
+    free(_name_table);
+    _name_table = NULL;
+    _name_table_size = 0;
+    _name_count = 0;
 
     if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
     if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
@@ -164,14 +331,31 @@ void CodeCache::mark(NamePredicate predicate) {
         const char* blob_name = _blobs[i]._name;
         if (blob_name != NULL && predicate(blob_name)) {
             NativeFunc::mark(blob_name);
+            _has_marks = true;
         }
     }
 }
 
 CodeBlob* CodeCache::find(const void* address) {
-    for (int i = 0; i < _count; i++) {
-        if (address >= _blobs[i]._start && address < _blobs[i]._end) {
-            return &_blobs[i];
+    if (!_sorted) {
+        for (int i = 0; i < _count; i++) {
+            if (address >= _blobs[i]._start && address < _blobs[i]._end) {
+                return &_blobs[i];
+            }
+        }
+        return NULL;
+    }
+
+    int low = 0;
+    int high = _count - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (_blobs[mid]._end <= address) {
+            low = mid + 1;
+        } else if (_blobs[mid]._start > address) {
+            high = mid - 1;
+        } else {
+            return &_blobs[mid];
         }
     }
     return NULL;
@@ -268,6 +452,37 @@ void** CodeCache::findGlobalOffsetEntry(void* address) {
     return NULL;
 }
 
+void CodeCache::addImport(void** entry, const char* name, ImportType type) {
+    static const char* const names[NUM_IMPORTS] = {"malloc", "calloc", "realloc", "free", "posix_memalign"};
+    for (int id = 0; id < NUM_IMPORTS; id++) {
+        if (strcmp(name, names[id]) == 0) {
+            _imports[id][type] = entry;
+            return;
+        }
+    }
+}
+
+bool CodeCache::patchImport(ImportId id, void* impl) {
+    bool patched = false;
+    for (int type = 0; type < NUM_IMPORT_TYPES; type++) {
+        void** entry = _imports[id][type];
+        if (entry == NULL) {
+            continue;
+        }
+        if (__atomic_load_n(entry, __ATOMIC_ACQUIRE) != impl) {
+            // the slot may be in the RELRO part of .got, which is read-only after relocation
+            uintptr_t page = (uintptr_t)entry & ~OS::page_mask;
+            if (mprotect((void*)page, OS::page_mask + 1, PROT_READ | PROT_WRITE) != 0) {
+                // writing to the slot would crash; the import is left unpatched
+                continue;
+            }
+            __atomic_store_n(entry, impl, __ATOMIC_RELEASE);
+        }
+        patched = true;
+    }
+    return patched;
+}
+
 void CodeCache::makeGotPatchable() {
     if (!_got_patchable) {
         uintptr_t got_start = (uintptr_t)_got_start & ~OS::page_mask;
@@ -277,26 +492,187 @@ void CodeCache::makeGotPatchable() {
     }
 }
 
+// Block layout: locs, page index, rules, and the rule ids last, as they need the least alignment
+void CodeCache::layoutDwarfBlock(bool packed) {
+    if (_dwarf_block == NULL) {
+        _dwarf_locs = NULL;
+        _dwarf_rule_ids = NULL;
+        _dwarf_rules = NULL;
+        _dwarf_page_index = NULL;
+        return;
+    }
+    _dwarf_locs = (u32*)_dwarf_block;
+    _dwarf_page_index = _dwarf_locs + _dwarf_table_length;
+    _dwarf_rules = (FrameDesc*)(_dwarf_page_index + _dwarf_pages + 1);
+    _dwarf_rule_ids = packed ? (u16*)(_dwarf_rules + _dwarf_rule_count) : NULL;
+}
+
 void CodeCache::setDwarfTable(FrameDesc* table, int length) {
-    _dwarf_table = table;
+    free(_dwarf_block);
+    _dwarf_block = NULL;
+    _dwarf_block_size = 0;
+    _dwarf_table_length = 0;
+    _dwarf_rule_count = 0;
+    _dwarf_pages = 0;
+    layoutDwarfBlock(false);
+    if (length <= 0) {
+        free(table);
+        __atomic_store_n(&_dwarf_state, DWARF_NONE, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Most records share one of a few hundred rules, which leaves 6 bytes per record instead of 12
+    std::map<u64, u16> rule_ids;
+    for (int i = 0; i < length && rule_ids.size() <= 0xffff; i++) {
+        u64 key = (u64)(u32)table[i].cfa << 32 | (u32)table[i].fp_off;
+        if (rule_ids.find(key) == rule_ids.end()) {
+            rule_ids.insert(std::make_pair(key, (u16)rule_ids.size()));
+        }
+    }
+    bool packed = rule_ids.size() <= 0xffff;
+    int rule_count = packed ? rule_ids.size() : length;
+    u32 pages = (table[length - 1].loc >> DWARF_PAGE_SHIFT) + 1;
+
+    size_t size = length * sizeof(u32) + (pages + 1) * sizeof(u32) + rule_count * sizeof(FrameDesc)
+            + (packed ? length * sizeof(u16) : 0);
+    char* block = (char*)malloc(size);
+    if (block == NULL) {
+        free(table);
+        __atomic_store_n(&_dwarf_state, DWARF_NONE, __ATOMIC_RELEASE);
+        return;
+    }
+    _dwarf_block = block;
+    _dwarf_block_size = size;
     _dwarf_table_length = length;
+    _dwarf_rule_count = rule_count;
+    _dwarf_pages = pages;
+    layoutDwarfBlock(packed);
+
+    u32 page = 0;
+    for (int i = 0; i < length; i++) {
+        _dwarf_locs[i] = table[i].loc;
+        while (page <= (table[i].loc >> DWARF_PAGE_SHIFT)) {
+            _dwarf_page_index[page++] = i;
+        }
+        if (packed) {
+            u64 key = (u64)(u32)table[i].cfa << 32 | (u32)table[i].fp_off;
+            u16 id = rule_ids[key];
+            _dwarf_rule_ids[i] = id;
+            _dwarf_rules[id] = table[i];
+        } else {
+            _dwarf_rules[i] = table[i];
+        }
+    }
+    while (page <= pages) {
+        _dwarf_page_index[page++] = length;
+    }
+    free(table);
+    __atomic_store_n(&_dwarf_state, DWARF_READY, __ATOMIC_RELEASE);
 }
 
 FrameDesc* CodeCache::findFrameDesc(const void* pc) {
+    if (__atomic_load_n(&_dwarf_state, __ATOMIC_ACQUIRE) != DWARF_READY) {
+        return NULL;
+    }
     u32 target_loc = (const char*)pc - _text_base;
-    int low = 0;
+    int low = _dwarf_table_length;
     int high = _dwarf_table_length - 1;
+    u32 page = target_loc >> DWARF_PAGE_SHIFT;
+    if (page < _dwarf_pages) {
+        // only the records starting on the page need a search, otherwise it is the last one before the page
+        low = _dwarf_page_index[page];
+        high = _dwarf_page_index[page + 1] - 1;
+    }
 
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_dwarf_table[mid].loc < target_loc) {
+        if (_dwarf_locs[mid] < target_loc) {
             low = mid + 1;
-        } else if (_dwarf_table[mid].loc > target_loc) {
+        } else if (_dwarf_locs[mid] > target_loc) {
             high = mid - 1;
         } else {
-            return &_dwarf_table[mid];
+            low = mid + 1;
+            break;
+        }
+    }
+
+    if (low == 0) {
+        return NULL;
+    }
+    return _dwarf_rule_ids != NULL ? &_dwarf_rules[_dwarf_rule_ids[low - 1]] : &_dwarf_rules[low - 1];
+}
+
+void CodeCacheArray::updateIndex() {
+    // Libraries are published by the parser and the symbol workers, never from a signal handler
+    while (!__sync_bool_compare_and_swap(&_index_lock, 0, 1)) {
+        spinPause();
+    }
+
+    int next = 1 - __atomic_load_n(&_generation, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&_readers[next], __ATOMIC_SEQ_CST) > 0) {
+        spinPause();
+    }
+
+    CodeCacheRange* ranges = _ranges[next];
+    int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    int range_count = 0;
+    for (int i = 0; i < count; i++) {
+        CodeCache* lib = __atomic_load_n(&_libs[i], __ATOMIC_ACQUIRE);
+        if (lib != NULL && lib->minAddress() < lib->maxAddress()) {
+            ranges[range_count].start = lib->minAddress();
+            ranges[range_count].end = lib->maxAddress();
+            ranges[range_count].lib = lib;
+            range_count++;
+        }
+    }
+    qsort(ranges, range_count, sizeof(CodeCacheRange), CodeCacheRange::comparator);
+
+    const void* max_end = NULL;
+    for (int i = 0; i < range_count; i++) {
+        if (ranges[i].end > max_end) max_end = ranges[i].end;
+        ranges[i].max_end = max_end;
+    }
+    _range_count[next] = range_count;
+
+    __atomic_store_n(&_generation, next, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&_version, 1, __ATOMIC_RELEASE);
+    __sync_lock_release(&_index_lock);
+}
+
+CodeCache* CodeCacheArray::findByAddress(const void* address) {
+    int generation;
+    while (true) {
+        generation = __atomic_load_n(&_generation, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&_readers[generation], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&_generation, __ATOMIC_SEQ_CST) == generation) {
+            break;
+        }
+        // The writer has flipped the generations meanwhile and may be rebuilding this one
+        __atomic_fetch_sub(&_readers[generation], 1, __ATOMIC_SEQ_CST);
+    }
+
+    const CodeCacheRange* ranges = _ranges[generation];
+    int low = 0;
+    int high = _range_count[generation] - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (ranges[mid].start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    // ranges[high] is the last one starting at or below the address; earlier ones may still
+    // cover it if the libraries overlap, which max_end bounds
+    CodeCache* result = NULL;
+    for (int i = high; i >= 0 && ranges[i].max_end > address; i--) {
+        if (address < ranges[i].end) {
+            result = ranges[i].lib;
+            break;
         }
     }
 
-    return low > 0 ? &_dwarf_table[low - 1] : NULL;
+    __atomic_fetch_sub(&_readers[generation], 1, __ATOMIC_SEQ_CST);
+    return result;
 }
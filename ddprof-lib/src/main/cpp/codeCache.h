@@ -17,9 +17,10 @@
 #ifndef _CODECACHE_H
 #define _CODECACHE_H
 
-#include <jvmti.h>
 #include <string.h>
 #include <vector>
+#include "arch.h"
+#include "symbolCache.h"
 
 
 #define NO_MIN_ADDRESS  ((const void*)-1)
@@ -29,6 +30,9 @@ typedef bool (*NamePredicate)(const char* name);
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
 const int MAX_NATIVE_LIBS = 2048;
+// Symbol names are interned in chunks of this size; a longer one gets a chunk of its own
+const size_t NAME_CHUNK_SIZE = 64 * 1024;
+const u32 INITIAL_NAME_TABLE_SIZE = 1024;
 
 
 class NativeFunc {
@@ -43,6 +47,13 @@ class NativeFunc {
     }
 
   public:
+    static size_t size(size_t name_length) {
+        return sizeof(NativeFunc) + name_length + 1;
+    }
+
+    // Sets up a NativeFunc in memory of size(length) bytes, aligned like a short
+    static char* init(void* memory, const char* name, size_t length, short lib_index);
+
     static char* create(const char* name, short lib_index);
     static void destroy(char* name);
 
@@ -84,6 +95,34 @@ class CodeBlob {
 
 class FrameDesc;
 
+// Granularity of the page index over the DWARF records of a library
+const int DWARF_PAGE_SHIFT = 12;
+
+// DWARF records are parsed on the first stack walk that needs them, not when the library is loaded
+enum DwarfState {
+    DWARF_NONE,       // nothing to parse
+    DWARF_PENDING,    // .eh_frame_hdr is known but has not been needed yet
+    DWARF_REQUESTED,  // a stack walk hit the library, the parser thread is to pick it up
+    DWARF_READY
+};
+
+// Imported functions whose GOT slots can be redirected
+enum ImportId {
+    IM_MALLOC,
+    IM_CALLOC,
+    IM_REALLOC,
+    IM_FREE,
+    IM_POSIX_MEMALIGN,
+    NUM_IMPORTS
+};
+
+// A library may reach an import through the PLT and through a pointer of its own
+enum ImportType {
+    IMPORT_PLT,
+    IMPORT_DATA,
+    NUM_IMPORT_TYPES
+};
+
 class CodeCache {
   protected:
     char* _name;
@@ -95,16 +134,48 @@ class CodeCache {
     void** _got_start;
     void** _got_end;
     bool _got_patchable;
-
-    FrameDesc* _dwarf_table;
+    bool _has_marks;
+    void** _imports[NUM_IMPORTS][NUM_IMPORT_TYPES];
+
+    char _build_id[MAX_BUILD_ID_LENGTH];
+
+    volatile int _dwarf_state;
+    const char* _dwarf_source;
+    // DWARF records in a single block: the sorted start offsets, the index of the unwinding rule of each
+    // record among the distinct ones (unless there are too many to pack), the rules, and the first record
+    // of every page of text so that a lookup only searches the records of one page
+    char* _dwarf_block;
+    size_t _dwarf_block_size;
     int _dwarf_table_length;
+    int _dwarf_rule_count;
+    u32 _dwarf_pages;
+    u32* _dwarf_locs;
+    u16* _dwarf_rule_ids;
+    FrameDesc* _dwarf_rules;
+    u32* _dwarf_page_index;
 
     int _capacity;
     int _count;
+    bool _sorted;
     CodeBlob* _blobs;
 
+    // The NativeFunc of every distinct name is carved out of chunks which start with a link to
+    // the previous one. The open addressing table which interns the names lives until the next sort()
+    char* _name_chunk;
+    char* _name_pos;
+    char* _name_end;
+    size_t _name_bytes;
+    char** _name_table;
+    u32 _name_table_size;
+    u32 _name_count;
+
     void expand();
+    void initNames();
+    void freeNames();
+    char* allocateName(size_t size);
+    char* internName(const char* name, short lib_index);
     void makeGotPatchable();
+    void layoutDwarfBlock(bool packed);
 
   public:
     explicit CodeCache(const char* name,
@@ -140,6 +211,35 @@ class CodeCache {
         _text_base = text_base;
     }
 
+    short libIndex() const {
+        return _lib_index;
+    }
+
+    // Whether mark() has hit any symbol of this library
+    bool hasMarks() const {
+        return _has_marks;
+    }
+
+    // Hex string; NULL when the library has no build-id
+    const char* buildId() const {
+        return _build_id[0] != 0 ? _build_id : NULL;
+    }
+
+    void setBuildId(const char* build_id) {
+        strncpy(_build_id, build_id, MAX_BUILD_ID_LENGTH - 1);
+        _build_id[MAX_BUILD_ID_LENGTH - 1] = 0;
+    }
+
+    int count() const {
+        return _count;
+    }
+
+    CodeBlob* blob(int index) {
+        return &_blobs[index];
+    }
+
+    // Makes room for count more blobs at once, e.g. for the entries of a symbol table
+    void reserve(int count);
     void add(const void* start, int length, const char* name, bool update_bounds = false);
     void updateBounds(const void* start, const void* end);
     void sort();
@@ -155,27 +255,87 @@ class CodeCache {
     void setGlobalOffsetTable(void** start, void** end, bool patchable);
     void** findGlobalOffsetEntry(void* address);
 
+    // Remembers the GOT slot of a relocation against one of the ImportId functions
+    void addImport(void** entry, const char* name, ImportType type);
+    void** findImport(ImportId id, ImportType type) const {
+        return _imports[id][type];
+    }
+    // Points every slot of the import to the given function; false if the library does not import it
+    bool patchImport(ImportId id, void* impl);
+
+    void setDwarfSource(const char* eh_frame_hdr) {
+        _dwarf_source = eh_frame_hdr;
+        __atomic_store_n(&_dwarf_state, DWARF_PENDING, __ATOMIC_RELEASE);
+    }
+
+    const char* dwarfSource() const {
+        return _dwarf_source;
+    }
+
+    const char* textBase() const {
+        return _text_base;
+    }
+
+    // Async signal safe; true for the one caller which has to wake up the parser thread
+    bool requestDwarf() {
+        return _dwarf_state == DWARF_PENDING && __sync_bool_compare_and_swap(&_dwarf_state, DWARF_PENDING, DWARF_REQUESTED);
+    }
+
+    bool dwarfRequested() const {
+        return _dwarf_state == DWARF_REQUESTED;
+    }
+
+    // Publishes the records to concurrent findFrameDesc() calls; may be called only once
     void setDwarfTable(FrameDesc* table, int length);
+    // NULL until the records have been parsed
     FrameDesc* findFrameDesc(const void* pc);
 
     long long memoryUsage() {
-        return _capacity * sizeof(CodeBlob*) + _count * sizeof(NativeFunc);
+        return _capacity * sizeof(CodeBlob) + _name_bytes + _name_table_size * sizeof(char*);
     }
 };
 
 
+// Address range of a published library; max_end is the highest end among this and all lower ranges
+struct CodeCacheRange {
+    const void* start;
+    const void* end;
+    const void* max_end;
+    CodeCache* lib;
+
+    static int comparator(const void* r1, const void* r2) {
+        const void* s1 = ((const CodeCacheRange*)r1)->start;
+        const void* s2 = ((const CodeCacheRange*)r2)->start;
+        return s1 < s2 ? -1 : s1 > s2 ? 1 : 0;
+    }
+};
+
 class CodeCacheArray {
   private:
     CodeCache* _libs[MAX_NATIVE_LIBS];
     int _count;
 
+    // Two generations of the address index sorted by start address. A reader pins the current one
+    // with its counter; a writer rebuilds the other one once its last reader is gone, then flips them
+    CodeCacheRange _ranges[2][MAX_NATIVE_LIBS];
+    int _range_count[2];
+    volatile int _generation;
+    volatile u32 _version;
+    volatile int _readers[2];
+    volatile int _index_lock;
+
+    void updateIndex();
+
   public:
-    CodeCacheArray() : _count(0) {
+    CodeCacheArray() : _count(0), _generation(0), _version(0), _index_lock(0) {
         memset(_libs, 0, MAX_NATIVE_LIBS * sizeof(CodeCache*));
+        _range_count[0] = _range_count[1] = 0;
+        _readers[0] = _readers[1] = 0;
     }
 
+    // NULL for a slot which has been reserved, but whose library is not published yet
     CodeCache* operator[](int index) {
-        return _libs[index];
+        return __atomic_load_n(&_libs[index], __ATOMIC_ACQUIRE);
     }
 
     int count() {
@@ -186,13 +346,37 @@ class CodeCacheArray {
         int index = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
         _libs[index] = lib;
         __atomic_store_n(&_count, index + 1, __ATOMIC_RELEASE);
+        updateIndex();
+    }
+
+    // The slot fixes the library index while its symbols are loaded in background
+    int reserve() {
+        int index = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&_count, index + 1, __ATOMIC_RELEASE);
+        return index;
+    }
+
+    void publish(int index, CodeCache* lib) {
+        __atomic_store_n(&_libs[index], lib, __ATOMIC_RELEASE);
+        updateIndex();
+    }
+
+    // Async signal safe, O(log n) in the number of published libraries
+    CodeCache* findByAddress(const void* address);
+
+    // Changes whenever the set of published libraries does
+    u32 version() {
+        return __atomic_load_n(&_version, __ATOMIC_ACQUIRE);
     }
 
     long long memoryUsage() {
         int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
         long long totalUsage = 0;
         for (int i = 0; i < count; i++) {
-            totalUsage += _libs[i]->memoryUsage();
+            CodeCache* lib = __atomic_load_n(&_libs[i], __ATOMIC_ACQUIRE);
+            if (lib != NULL) {
+                totalUsage += lib->memoryUsage();
+            }
         }
         return totalUsage;
     }
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+#include "collapsedWriter.h"
+#include "profiler.h"
+
+const size_t COLLAPSED_FLUSH_THRESHOLD = 64 * 1024;
+
+bool CollapsedWriter::writeFully(int fd, const std::string& data) {
+    for (size_t offset = 0; offset < data.size();) {
+        ssize_t written = ::write(fd, data.data() + offset, data.size() - offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += written;
+    }
+    return true;
+}
+
+Error CollapsedWriter::write(int fd, std::vector<CallTraceSample>& samples, bool total) {
+    // the ids of the class map and of the symbols are only valid for this dump
+    _method_map.clearMarks();
+    Lookup lookup(NULL, &_method_map, Profiler::instance()->classMap());
+
+    std::map<u32, CallTrace*> traces;
+    for (size_t i = 0; i < samples.size(); i++) {
+        traces[(u32)i] = samples[i].trace;
+    }
+    lookup.resolveNativePCs(traces);
+
+    // traces which differ only in the bci or the frame types fold into the same stack
+    std::unordered_map<std::string, u64> stacks;
+    std::string stack;
+    for (size_t i = 0; i < samples.size(); i++) {
+        u64 count = total ? samples[i].counter : samples[i].samples;
+        CallTrace* trace = samples[i].trace;
+        if (count == 0 || trace->num_frames <= 0) {
+            continue;
+        }
+        stack.clear();
+        for (int j = trace->num_frames - 1; j >= 0; j--) {
+            lookup.appendFrameName(trace->frames[j], stack);
+            if (j > 0) {
+                stack += ';';
+            }
+        }
+        stacks[stack] += count;
+    }
+
+    std::string out;
+    for (std::unordered_map<std::string, u64>::const_iterator it = stacks.begin(); it != stacks.end(); ++it) {
+        out += it->first;
+        out += ' ';
+        out += std::to_string(it->second);
+        out += '\n';
+        if (out.size() >= COLLAPSED_FLUSH_THRESHOLD) {
+            if (!writeFully(fd, out)) {
+                return Error("Could not write the collapsed stacks");
+            }
+            out.clear();
+        }
+    }
+    if (!writeFully(fd, out)) {
+        return Error("Could not write the collapsed stacks");
+    }
+    return Error::OK;
+}
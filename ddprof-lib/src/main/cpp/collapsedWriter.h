@@ -0,0 +1,40 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COLLAPSEDWRITER_H
+#define _COLLAPSEDWRITER_H
+
+#include <vector>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "flightRecorder.h"
+
+// Writes the call traces of a dump as folded stacks, one "frame;frame;frame count" line per distinct stack
+// with the root frame first, for the flame graph tools which need nothing else from the profile.
+class CollapsedWriter {
+  private:
+    // survives the dumps, so that the methods are resolved through JVMTI only once
+    MethodMap _method_map;
+
+    static bool writeFully(int fd, const std::string& data);
+
+  public:
+    // Counts the samples of every stack, or their total value (time, bytes, etc.) if total is set.
+    // Must not race with the recycling of the generation the samples come from.
+    Error write(int fd, std::vector<CallTraceSample>& samples, bool total);
+};
+
+#endif // _COLLAPSEDWRITER_H
@@ -14,27 +14,61 @@
  * limitations under the License.
  */
 
+#include <cstddef>
 #include <cstring>
 #include "context.h"
 #include "counters.h"
 #include "os.h"
 
 
+static u32 slotSizeFor(u32 tags) {
+    u32 size = offsetof(Context, tags) + tags * sizeof(Tag);
+    return (size + DD_CONTEXT_SLOT_ALIGNMENT - 1) & ~(DD_CONTEXT_SLOT_ALIGNMENT - 1);
+}
+
 int Contexts::_max_pages = Contexts::getMaxPages();
-Context** Contexts::_pages = new Context *[_max_pages]();
+char** Contexts::_pages = new char *[_max_pages]();
+u32 Contexts::_capacity = DD_TAGS_CAPACITY;
+u32 Contexts::_slot_size = slotSizeFor(DD_TAGS_CAPACITY);
+volatile int Contexts::_allocated_pages = 0;
+// every chunk holds at least one page
+char** Contexts::_chunks = new char *[_max_pages]();
+int Contexts::_chunk_count = 0;
+size_t Contexts::_chunk_used = 0;
+SpinLock Contexts::_chunk_lock;
 
 static Context DD_EMPTY_CONTEXT = {};
 
-Context& Contexts::get(int tid) {
+static const int MAX_READ_ATTEMPTS = 3;
+
+Context Contexts::get(int tid) {
     int pageIndex = tid >> DD_CONTEXT_PAGE_SHIFT;
     // extreme edge case: pageIndex >= _max_pages if pid_max was increased during the process's runtime
     if (pageIndex < _max_pages) {
-        Context *page = _pages[pageIndex];
+        char* page = __atomic_load_n(&_pages[pageIndex], __ATOMIC_ACQUIRE);
         if (page != NULL) {
-            Context &context = page[tid & DD_CONTEXT_PAGE_MASK];
-            if ((context.spanId ^ context.rootSpanId) == context.checksum) {
-                return context;
+            const Context* slot = (const Context*)(page + (tid & DD_CONTEXT_PAGE_MASK) * _slot_size);
+            u32 capacity = _capacity;
+            Context snapshot = {};
+            for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+                u64 version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+                if ((version & 1) == 0) {
+                    snapshot.spanId = __atomic_load_n(&slot->spanId, __ATOMIC_RELAXED);
+                    snapshot.rootSpanId = __atomic_load_n(&slot->rootSpanId, __ATOMIC_RELAXED);
+                    for (u32 i = 0; i < capacity; i++) {
+                        snapshot.tags[i].value = __atomic_load_n(&slot->tags[i].value, __ATOMIC_RELAXED);
+                    }
+                    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                    if (__atomic_load_n(&slot->version, __ATOMIC_RELAXED) == version) {
+                        // only the flags of the version are of interest to the readers
+                        snapshot.version = version & DD_CONTEXT_UNSAMPLED;
+                        return snapshot;
+                    }
+                }
+                spinPause();
             }
+            // the owner was interrupted half way through an update; the partial context is never reported
+            Counters::increment(CounterId::CONTEXT_TORN_READS);
         }
     } else {
         Counters::increment(CounterId::CONTEXT_BOUNDS_MISS_GETS);
@@ -46,6 +80,64 @@ Context& Contexts::empty() {
     return DD_EMPTY_CONTEXT;
 }
 
+bool Contexts::isEmpty(const Context& context) {
+    if (context.spanId != 0 || context.rootSpanId != 0) {
+        return false;
+    }
+    for (u32 i = 0; i < _capacity; i++) {
+        if (context.tags[i].value != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Contexts::set(int tid, const Context& context) {
+    int pageIndex = tid >> DD_CONTEXT_PAGE_SHIFT;
+    if (pageIndex >= _max_pages) {
+        Counters::increment(CounterId::CONTEXT_BOUNDS_MISS_INITS);
+        return;
+    }
+    char* page = __atomic_load_n(&_pages[pageIndex], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        if (isEmpty(context)) {
+            return;
+        }
+        initialize(pageIndex);
+        page = __atomic_load_n(&_pages[pageIndex], __ATOMIC_ACQUIRE);
+        if (page == NULL) {
+            return;
+        }
+    }
+    // the same seqlock protocol as the Java writers
+    Context* slot = (Context*)(page + (tid & DD_CONTEXT_PAGE_MASK) * _slot_size);
+    u64 version = __atomic_load_n(&slot->version, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&slot->version, version, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->spanId, context.spanId, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->rootSpanId, context.rootSpanId, __ATOMIC_RELAXED);
+    for (u32 i = 0; i < _capacity; i++) {
+        __atomic_store_n(&slot->tags[i].value, context.tags[i].value, __ATOMIC_RELAXED);
+    }
+    // the flags are carried over along with the rest of the context
+    __atomic_store_n(&slot->version, ((version + 1) & ~DD_CONTEXT_UNSAMPLED) | (context.version & DD_CONTEXT_UNSAMPLED),
+                     __ATOMIC_RELEASE);
+}
+
+u32 Contexts::setCapacity(u32 tags) {
+    if (tags < DD_TAGS_CAPACITY) {
+        tags = DD_TAGS_CAPACITY;
+    } else if (tags > DD_MAX_TAGS_CAPACITY) {
+        tags = DD_MAX_TAGS_CAPACITY;
+    }
+    // Java callers have already been handed pages with the current stride
+    if (_allocated_pages == 0) {
+        _slot_size = slotSizeFor(tags);
+        _capacity = tags;
+    }
+    return _capacity;
+}
+
 void Contexts::initialize(int pageIndex) {
     if (pageIndex >= _max_pages) {
         Counters::increment(CounterId::CONTEXT_BOUNDS_MISS_INITS);
@@ -53,30 +145,57 @@ void Contexts::initialize(int pageIndex) {
         return;
     }
     if (__atomic_load_n(&_pages[pageIndex], __ATOMIC_ACQUIRE) == NULL) {
-        u32 capacity = DD_CONTEXT_PAGE_SIZE * sizeof(Context);
-        Context *page = (Context*) aligned_alloc(sizeof(Context), capacity);
-        // need to zero the storage because there is no aligned_calloc
-        memset(page, 0, capacity);
-        if (!__sync_bool_compare_and_swap(&_pages[pageIndex], NULL, page)) {
-            free(page);
-        } else {
-            Counters::increment(CONTEXT_STORAGE_BYTES, capacity);
-            Counters::increment(CONTEXT_STORAGE_PAGES);
+        u32 capacity = DD_CONTEXT_PAGE_SIZE * _slot_size;
+        _chunk_lock.lock();
+        if (_pages[pageIndex] == NULL) {
+            char* page = allocatePage(capacity);
+            if (page != NULL) {
+                __atomic_store_n(&_pages[pageIndex], page, __ATOMIC_RELEASE);
+                atomicInc(_allocated_pages);
+                Counters::increment(CONTEXT_STORAGE_BYTES, capacity);
+                Counters::increment(CONTEXT_STORAGE_PAGES);
+            }
         }
+        _chunk_lock.unlock();
     }
 }
 
+// Pages are carved in the order they are first used, so that the threads with a context share
+// a few huge pages wherever their ids lie; the chunks are freshly mapped and hence zeroed
+char* Contexts::allocatePage(size_t capacity) {
+    if (_chunk_count == 0 || _chunk_used + capacity > DD_CONTEXT_CHUNK_SIZE) {
+        if (_chunk_count == _max_pages) {
+            return NULL;
+        }
+        char* chunk = (char*)OS::safeAllocHuge(DD_CONTEXT_CHUNK_SIZE);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        _chunks[_chunk_count++] = chunk;
+        _chunk_used = 0;
+    }
+    char* page = _chunks[_chunk_count - 1] + _chunk_used;
+    _chunk_used += capacity;
+    return page;
+}
+
 void Contexts::reset() {
     for (int i = 0; i < _max_pages; i++) {
-        Context* page = (Context*)__atomic_exchange_n(&_pages[i], NULL, __ATOMIC_SEQ_CST);
-        free(page);
+        __atomic_store_n(&_pages[i], NULL, __ATOMIC_SEQ_CST);
+    }
+    for (int i = 0; i < _chunk_count; i++) {
+        OS::safeFreeHuge(_chunks[i], DD_CONTEXT_CHUNK_SIZE);
+        _chunks[i] = NULL;
     }
+    _chunk_count = 0;
+    _chunk_used = 0;
+    _allocated_pages = 0;
 }
 
 ContextPage Contexts::getPage(int tid) {
     int pageIndex = tid >> DD_CONTEXT_PAGE_SHIFT;
     initialize(pageIndex);
-    return {.capacity = DD_CONTEXT_PAGE_SIZE * sizeof(Context), .storage = _pages[pageIndex]};
+    return {.capacity = (int)(DD_CONTEXT_PAGE_SIZE * _slot_size), .storage = _pages[pageIndex]};
 }
 
 // The number of pages that can cover all allowed thread IDs
@@ -20,50 +20,91 @@
 #include "arch.h"
 #include "arguments.h"
 #include "os.h"
+#include "spinLock.h"
 
+// default number of tags per thread; the slot can be widened up to DD_MAX_TAGS_CAPACITY at start
 static const u32 DD_TAGS_CAPACITY = 10;
+// 24 bytes of header plus 26 tags fill exactly two cache lines
+static const u32 DD_MAX_TAGS_CAPACITY = 26;
 
 typedef struct {
     u32 value;
 } Tag;
 
+// must be kept in sync with UNSAMPLED in JavaProfiler.java
+const u64 DD_CONTEXT_UNSAMPLED = 1ULL << 63;
+
+// Layout of a per-thread context slot, shared with JavaProfiler.java.
+// The slot is published with a seqlock: the owning thread bumps `version` to an odd value,
+// writes the fields and then bumps it to the next even value. Readers only accept a copy
+// taken while the version was even and unchanged.
+// The top bit of `version` is not part of the counter: it is set while the trace of the current
+// span is not kept by the tracer, see UnsampledPolicy.
 class Context {
   public:
     u64 spanId;
     u64 rootSpanId;
-    u64 checksum;
-    Tag tags[DD_TAGS_CAPACITY];
+    u64 version;
+    Tag tags[DD_MAX_TAGS_CAPACITY];
 
-    Tag get_tag(int i) {
+    Tag get_tag(int i) const {
         return tags[i];
     }
+
+    bool isUnsampled() const {
+        return (version & DD_CONTEXT_UNSAMPLED) != 0;
+    }
 };
 
 // must be kept in sync with PAGE_SIZE in JavaProfiler.java
 const int DD_CONTEXT_PAGE_SIZE = 1024;
 const int DD_CONTEXT_PAGE_MASK = DD_CONTEXT_PAGE_SIZE - 1;
 const int DD_CONTEXT_PAGE_SHIFT = __builtin_popcount(DD_CONTEXT_PAGE_MASK);
+// slots are padded to whole cache lines so that threads never share one
+const u32 DD_CONTEXT_SLOT_ALIGNMENT = 64;
+// pages are carved from mappings of one huge page, which hold a whole number of them
+const size_t DD_CONTEXT_CHUNK_SIZE = OS::HUGE_PAGE_SIZE;
 
 typedef struct {
     const int capacity;
-    const Context* storage;
+    const char* storage;
 } ContextPage;
 
 class Contexts {
 
   private:
     static int _max_pages;
-    static Context** _pages;
+    static char** _pages;
+    static u32 _capacity;
+    static u32 _slot_size;
+    static volatile int _allocated_pages;
+    static char** _chunks;
+    static int _chunk_count;
+    static size_t _chunk_used;
+    static SpinLock _chunk_lock;
     static void initialize(int pageIndex);
+    static char* allocatePage(size_t capacity);
 
   public:
-    // get must not allocate
-    static Context& get(int tid);
+    // get must not allocate; returns a consistent copy of the thread's context or the empty context
+    static Context get(int tid);
     static Context& empty();
+    // only the thread owning the slot may write it, outside of signal handlers since the page may be allocated
+    static void set(int tid, const Context& context);
+    static bool isEmpty(const Context& context);
     // not to be called except to share with Java callers as a DirectByteBuffer
     static ContextPage getPage(int tid);
     static int getMaxPages(int maxTid = OS::getMaxThreadId());
 
+    // the slot width can only change while no page has been handed out; returns the effective capacity
+    static u32 setCapacity(u32 tags);
+    static u32 capacity() {
+        return _capacity;
+    }
+    static u32 slotSize() {
+        return _slot_size;
+    }
+
     // this *MUST* be called only when the profiler is completely stopped
     static void reset();
 };
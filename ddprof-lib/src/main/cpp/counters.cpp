@@ -17,8 +17,8 @@
 #include <stdlib.h>
 
 long long* Counters::init() {
-    u32 alignment = sizeof(long long) * ALIGNMENT;
-    long long* counters = (long long*) aligned_alloc(alignment, DD_NUM_COUNTERS * alignment);
-    memset(counters, 0, DD_NUM_COUNTERS * alignment);
+    size_t size = SHARDS * SHARD_STRIDE * sizeof(long long);
+    long long* counters = (long long*) aligned_alloc(64, size);
+    memset(counters, 0, size);
     return counters;
 }
@@ -17,9 +17,47 @@
 #define JAVA_PROFILER_LIBRARY_COUNTERS_H
 
 #include "arch.h"
+#include "os.h"
 #include <cstring>
+#include <stdint.h>
 #include <vector>
 
+// A latency histogram is a run of LATENCY_BUCKETS counters, addressed as an offset from the first one
+#define DD_LATENCY_HISTOGRAM(X, ID, name) \
+    X(ID##_LT_1US, name "_lt_1us") \
+    X(ID##_LT_4US, name "_lt_4us") \
+    X(ID##_LT_16US, name "_lt_16us") \
+    X(ID##_LT_64US, name "_lt_64us") \
+    X(ID##_LT_256US, name "_lt_256us") \
+    X(ID##_LT_1MS, name "_lt_1ms") \
+    X(ID##_LT_4MS, name "_lt_4ms") \
+    X(ID##_GE_4MS, name "_ge_4ms")
+
+// A duration histogram is a run of DURATION_BUCKETS counters following a 1-2-5 series from below 1us
+// up to 1s and above, and one more counter holding the total of the recorded nanoseconds
+#define DD_DURATION_HISTOGRAM(X, ID, name) \
+    X(ID##_LT_1US, name "_lt_1us") \
+    X(ID##_LT_2US, name "_lt_2us") \
+    X(ID##_LT_5US, name "_lt_5us") \
+    X(ID##_LT_10US, name "_lt_10us") \
+    X(ID##_LT_20US, name "_lt_20us") \
+    X(ID##_LT_50US, name "_lt_50us") \
+    X(ID##_LT_100US, name "_lt_100us") \
+    X(ID##_LT_200US, name "_lt_200us") \
+    X(ID##_LT_500US, name "_lt_500us") \
+    X(ID##_LT_1MS, name "_lt_1ms") \
+    X(ID##_LT_2MS, name "_lt_2ms") \
+    X(ID##_LT_5MS, name "_lt_5ms") \
+    X(ID##_LT_10MS, name "_lt_10ms") \
+    X(ID##_LT_20MS, name "_lt_20ms") \
+    X(ID##_LT_50MS, name "_lt_50ms") \
+    X(ID##_LT_100MS, name "_lt_100ms") \
+    X(ID##_LT_200MS, name "_lt_200ms") \
+    X(ID##_LT_500MS, name "_lt_500ms") \
+    X(ID##_LT_1S, name "_lt_1s") \
+    X(ID##_GE_1S, name "_ge_1s") \
+    X(ID##_TOTAL_NS, name "_total_ns")
+
 #define DD_COUNTER_TABLE(X) \
     X(DICTIONARY_BYTES, "dictionary_bytes") \
     X(DICTIONARY_CLASSES_BYTES, "dictionary_classes_bytes") \
@@ -41,6 +79,7 @@
     X(CONTEXT_STORAGE_PAGES, "context_storage_pages")       \
     X(CONTEXT_BOUNDS_MISS_INITS, "context_bounds_miss_inits")   \
     X(CONTEXT_BOUNDS_MISS_GETS, "context_bounds_miss_gets") \
+    X(CONTEXT_TORN_READS, "context_torn_reads") \
     X(CALLTRACE_STORAGE_BYTES, "calltrace_storage_bytes") \
     X(CALLTRACE_STORAGE_TRACES, "calltrace_storage_traces") \
     X(LINEAR_ALLOCATOR_BYTES, "linear_allocator_bytes") \
@@ -55,16 +94,66 @@
     X(CODECACHE_RUNTIME_STUBS_SIZE_BYTES, "codecache_runtime_stubs_size_bytes") \
     X(AGCT_NOT_REGISTERED_IN_TLS, "agct_not_registered_in_tls") \
     X(AGCT_NOT_JAVA, "agct_not_java") \
-    X(AGCT_NATIVE_NO_JAVA_CONTEXT, "agct_native_no_java_context")
+    X(AGCT_NATIVE_NO_JAVA_CONTEXT, "agct_native_no_java_context") \
+    X(SAMPLES_SKIPPED, "samples_skipped") \
+    X(SAMPLES_STORAGE_OVERFLOW, "samples_storage_overflow") \
+    X(SAMPLES_UNWIND_BUSY, "samples_unwind_busy") \
+    X(SAMPLES_UNWIND_FAILED, "samples_unwind_failed") \
+    X(WALL_SIGNALS_FAILED, "wall_signals_failed") \
+    X(LIVENESS_TABLE_OVERFLOW, "liveness_table_overflow") \
+    X(JFR_BUFFER_SYNC_FLUSHES, "jfr_buffer_sync_flushes") \
+    X(JFR_MAPPED_BYTES_DROPPED, "jfr_mapped_bytes_dropped") \
+    X(WALL_STACKS_REUSED, "wall_stacks_reused") \
+    X(PERF_DRAINED_SAMPLES, "perf_drained_samples") \
+    X(ENDPOINT_EVICTIONS, "endpoint_evictions") \
+    X(ENDPOINT_REJECTIONS, "endpoint_rejections") \
+    X(ALLOC_HISTOGRAM_OVERFLOWS, "alloc_histogram_overflows") \
+    X(ALLOC_HISTOGRAM_DROPPED, "alloc_histogram_dropped") \
+    X(SPAN_AGGREGATE_OVERFLOWS, "span_aggregate_overflows") \
+    X(SPAN_SUMMARIES_DROPPED, "span_summaries_dropped") \
+    X(VIRTUAL_THREAD_UNMOUNT_SAVES, "vthread_unmount_saves") \
+    X(LIVENESS_TABLE_BYTES, "liveness_table_bytes") \
+    X(NATIVEMEM_SAMPLES, "nativemem_samples") \
+    X(NATIVEMEM_LIVE_DROPPED, "nativemem_live_dropped") \
+    X(SHM_RING_CHUNKS_DROPPED, "shm_ring_chunks_dropped") \
+    X(LOCK_SAMPLES, "lock_samples") \
+    X(COALESCED_SAMPLES, "coalesced_samples") \
+    X(CONTEXT_AGGREGATED_SAMPLES, "context_aggregated_samples") \
+    X(UNSAMPLED_SPAN_SAMPLES, "unsampled_span_samples") \
+    X(VM_WALK_FALLBACKS, "vm_walk_fallbacks") \
+    X(CHUNK_ROTATIONS, "chunk_rotations") \
+    X(LOG_MESSAGES_HELD_BACK, "log_messages_held_back") \
+    X(SWITCH_EPISODES_SKIPPED, "switch_episodes_skipped") \
+    X(JFR_SEALING_DISCARDED_BYTES, "jfr_sealing_discarded_bytes") \
+    DD_LATENCY_HISTOGRAM(X, ITIMER_HANDLER, "itimer_handler") \
+    DD_LATENCY_HISTOGRAM(X, PERF_HANDLER, "perf_handler") \
+    DD_LATENCY_HISTOGRAM(X, CTIMER_HANDLER, "ctimer_handler") \
+    DD_LATENCY_HISTOGRAM(X, WALL_HANDLER, "wall_handler") \
+    DD_LATENCY_HISTOGRAM(X, WALL_DELIVERY, "wall_delivery") \
+    DD_DURATION_HISTOGRAM(X, DUMP_DURATION, "dump_duration") \
+    DD_DURATION_HISTOGRAM(X, CPOOL_WRITE, "cpool_write") \
+    DD_DURATION_HISTOGRAM(X, LOCK_ALL_WAIT, "lock_all_wait") \
+    DD_DURATION_HISTOGRAM(X, LIVENESS_CLEANUP, "liveness_cleanup") \
+    DD_DURATION_HISTOGRAM(X, STACK_WALK, "stack_walk")
 #define X_ENUM(a, b) a,
 typedef enum CounterId : int {
     DD_COUNTER_TABLE(X_ENUM) DD_NUM_COUNTERS
 } CounterId;
 #undef X_ENUM
 
+const int DURATION_BUCKETS = 20;
+
+// The counters are sharded by CPU: every shard holds a copy of the whole table, with each counter
+// on a cache line of its own, so that the threads sharing a shard (CPUs beyond SHARDS, or the stack
+// based fallback) do not contend on the neighbouring counters either.
+// The shards are only folded together when the counters are read.
 class Counters {
 private:
-    static const u32 ALIGNMENT = 16;
+    // a power of 2; CPUs beyond it share shards
+    static const u32 SHARDS = 32;
+    // the distance between two counters, one cache line
+    static const u32 SLOT_STRIDE = 64 / sizeof(long long);
+    static const u32 SHARD_STRIDE = DD_NUM_COUNTERS * SLOT_STRIDE;
     volatile long long* _counters;
     static long long* init();
     Counters() : _counters() {
@@ -72,6 +161,21 @@ private:
         _counters = Counters::init();
         #endif // COUNTERS
     }
+
+    static inline u32 currentShard() {
+        int cpu = OS::currentCpu();
+        if (cpu < 0) {
+            // no cheap way to tell the CPU; the stacks of different threads are far enough apart to tell them
+            uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+            cpu = (int)((sp >> 16) ^ (sp >> 24));
+        }
+        return (u32)cpu & (SHARDS - 1);
+    }
+
+    static volatile long long& slot(u32 shard, int index) {
+        return Counters::instance()._counters[shard * SHARD_STRIDE + index * SLOT_STRIDE];
+    }
+
 public:
     static Counters& instance() {
         static Counters instance;
@@ -81,39 +185,34 @@ public:
     Counters(Counters const&) = delete;
     void operator=(Counters const&) = delete;
 
-    static constexpr int address(int index) {
-        return index * ALIGNMENT;
-    }
-
-    static constexpr int size() {
-        return address(DD_NUM_COUNTERS * sizeof(long long));
-    }
-
-    static long long* getCounters() {
-        #ifdef COUNTERS
-        return const_cast<long long*>(Counters::instance()._counters);
-        #else
-        return nullptr;
-        #endif // COUNTERS
-    }
-
+    // the sum over all the shards
     static long long getCounter(CounterId counter, int offset = 0) {
         #ifdef COUNTERS
-        return Counters::instance()._counters[address(static_cast<int>(counter) + offset)];
+        int index = static_cast<int>(counter) + offset;
+        long long value = 0;
+        for (u32 shard = 0; shard < SHARDS; shard++) {
+            value += __atomic_load_n(&slot(shard, index), __ATOMIC_RELAXED);
+        }
+        return value;
         #else
         return 0;
         #endif // COUNTERS
     }
 
+    // meant for gauges; a concurrent increment may be lost
     static void set(CounterId counter, long long value, int offset = 0) {
         #ifdef COUNTERS
-        storeRelease(Counters::instance()._counters[address(static_cast<int>(counter) + offset)], value);
+        int index = static_cast<int>(counter) + offset;
+        for (u32 shard = 1; shard < SHARDS; shard++) {
+            storeRelease(slot(shard, index), 0LL);
+        }
+        storeRelease(slot(0, index), value);
         #endif // COUNTERS
     }
 
     static void increment(CounterId counter, long long delta = 1, int offset = 0) {
         #ifdef COUNTERS
-        atomicInc(Counters::instance()._counters[address(static_cast<int>(counter) + offset)], delta);
+        atomicInc(slot(currentShard(), static_cast<int>(counter) + offset), delta);
         #endif // COUNTERS
     }
 
@@ -123,6 +222,32 @@ public:
         #endif // COUNTERS
     }
 
+    // the bucket of a duration histogram which the given duration falls into
+    static int durationBucket(u64 nanos) {
+        static const u64 bounds[DURATION_BUCKETS - 1] = {
+            1000, 2000, 5000,
+            10000, 20000, 50000,
+            100000, 200000, 500000,
+            1000000, 2000000, 5000000,
+            10000000, 20000000, 50000000,
+            100000000, 200000000, 500000000,
+            1000000000
+        };
+        int index = 0;
+        while (index < DURATION_BUCKETS - 1 && nanos >= bounds[index]) {
+            index++;
+        }
+        return index;
+    }
+
+    // adds a duration to the histogram starting at the given counter; async signal safe
+    static void recordDuration(CounterId histogram, u64 nanos) {
+        #ifdef COUNTERS
+        increment(histogram, 1, durationBucket(nanos));
+        increment(histogram, (long long)nanos, DURATION_BUCKETS);
+        #endif // COUNTERS
+    }
+
     static std::vector<const char*> describeCounters() {
         #ifdef COUNTERS
         #define X_NAME(a, b) b,
@@ -135,13 +260,44 @@ public:
         #endif // COUNTERS
     }
 
+    // the folded values in the order of describeCounters()
+    static std::vector<long long> values() {
+        std::vector<long long> result;
+        #ifdef COUNTERS
+        result.reserve(DD_NUM_COUNTERS);
+        for (int i = 0; i < DD_NUM_COUNTERS; i++) {
+            result.push_back(getCounter(static_cast<CounterId>(i)));
+        }
+        #endif // COUNTERS
+        return result;
+    }
+
     static void reset() {
         #ifdef COUNTERS
-        memset((void*) Counters::instance()._counters, 0, size());
+        memset((void*) Counters::instance()._counters, 0, SHARDS * SHARD_STRIDE * sizeof(long long));
         #endif // COUNTERS
     }
 
 };
 
+// Records the lifetime of the scope into a duration histogram
+class DurationTimer {
+private:
+    CounterId _histogram;
+    u64 _start;
+
+public:
+    explicit DurationTimer(CounterId histogram) : _histogram(histogram), _start(0) {
+        #ifdef COUNTERS
+        _start = OS::nanotime();
+        #endif // COUNTERS
+    }
+
+    ~DurationTimer() {
+        #ifdef COUNTERS
+        Counters::recordDuration(_histogram, OS::nanotime() - _start);
+        #endif // COUNTERS
+    }
+};
 
 #endif //JAVA_PROFILER_LIBRARY_COUNTERS_H
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CTIMER_H
+#define _CTIMER_H
+
+#include <signal.h>
+#include "engine.h"
+
+
+// Samples every thread on its own CPU time clock: a POSIX timer per thread on
+// CLOCK_THREAD_CPUTIME_ID delivers SIGPROF to that very thread, without perf_events access
+class CTimer : public Engine {
+  private:
+    static volatile bool _enabled;
+    static volatile bool _running;
+    static long _interval;
+    static int _max_timers;
+    // Kernel timer id + 1 indexed by tid, 0 is an empty slot
+    static int* _timers;
+    static CStack _cstack;
+
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+
+  public:
+    const char* units() {
+        return "ns";
+    }
+
+    const char* name() {
+        return "CTimer";
+    }
+
+    long interval() const {
+        return _interval;
+    }
+
+    bool setInterval(long interval);
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    int registerThread(int tid);
+    void unregisterThread(int tid);
+
+    inline void enableEvents(bool enabled) {
+        _enabled = enabled;
+    }
+};
+
+#endif // _CTIMER_H
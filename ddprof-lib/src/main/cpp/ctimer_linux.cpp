@@ -0,0 +1,188 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef __linux__
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ctimer.h"
+#include "debugSupport.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+#include "signalLatency.h"
+#include "thread.h"
+#include "vmStructs.h"
+
+volatile bool CTimer::_enabled = false;
+volatile bool CTimer::_running = false;
+long CTimer::_interval;
+int CTimer::_max_timers = 0;
+int* CTimer::_timers = NULL;
+CStack CTimer::_cstack;
+
+// The CPU time clock of an arbitrary thread, see CPUCLOCK_* in linux/posix-timers.h;
+// the libc wrappers accept the clock of the calling thread only
+static clockid_t threadCpuClock(int tid) {
+    return ((~(unsigned int)tid) << 3) | 6;  // CPUCLOCK_PERTHREAD_MASK | CPUCLOCK_SCHED
+}
+
+static int createTimer(int tid) {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_value.sival_ptr = NULL;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    // sigev_notify_thread_id is missing from older glibc headers; the tid follows sigev_notify
+    ((int*)&sev.sigev_notify)[1] = tid;
+
+    int timerid;
+    if (syscall(__NR_timer_create, threadCpuClock(tid), &sev, &timerid) < 0) {
+        return -1;
+    }
+    return timerid;
+}
+
+void CTimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    // only the expiration of our own timers counts, kill() and the like do not
+    if (!_enabled || siginfo->si_code != SI_TIMER) return;
+    u64 entry = SignalLatency::enter();
+    int tid = 0;
+    ProfiledThread* current = ProfiledThread::current();
+    if (current != NULL) {
+        current->noteCPUSample();
+        tid = current->tid();
+    } else {
+        tid = OS::threadId();
+    }
+    Shims::instance().setSighandlerTid(tid);
+
+    ExecutionEvent event;
+    VMThread* vm_thread = VMThread::current();
+    if (vm_thread) {
+        event._execution_mode = VM::jni() != NULL
+                ? convertJvmExecutionState(vm_thread->state())
+                : ExecutionMode::JVM;
+    }
+    // expirations coalesced while the signal was pending still account for CPU time
+    event._weight = 1 + (siginfo->si_overrun > 0 ? siginfo->si_overrun : 0);
+    Profiler::instance()->recordSample(ucontext, _interval * event._weight, tid, BCI_CPU, &event);
+    Shims::instance().setSighandlerTid(-1);
+    SignalLatency::exit(SIGNAL_ENGINE_CTIMER, entry);
+}
+
+Error CTimer::check(Arguments& args) {
+    int timerid = createTimer(OS::threadId());
+    if (timerid < 0) {
+        return Error("Thread CPU time timers are not supported on this system");
+    }
+    syscall(__NR_timer_delete, timerid);
+    return Error::OK;
+}
+
+Error CTimer::start(Arguments& args) {
+    _interval = args._cpu > 0 ? args._cpu : DEFAULT_CPU_INTERVAL;
+    _cstack = args._cstack;
+
+    int max_timers = OS::getMaxThreadId();
+    if (max_timers != _max_timers) {
+        free(_timers);
+        _timers = (int*)calloc(max_timers, sizeof(int));
+        _max_timers = max_timers;
+    }
+
+    OS::installSignalHandler(SIGPROF, signalHandler);
+
+    // new threads are registered through the JVMTI thread callbacks, the existing ones right here
+    _running = true;
+    ThreadList* thread_list = OS::listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        registerThread(tid);
+    }
+    delete thread_list;
+
+    return Error::OK;
+}
+
+void CTimer::stop() {
+    // unlike perf events, timers are cheap enough to recreate on the next start
+    _running = false;
+    for (int tid = 0; tid < _max_timers; tid++) {
+        unregisterThread(tid);
+    }
+}
+
+bool CTimer::setInterval(long interval) {
+    _interval = interval;
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = (time_t)(interval / 1000000000);
+    ts.it_interval.tv_nsec = interval % 1000000000;
+    ts.it_value = ts.it_interval;
+    for (int tid = 0; tid < _max_timers; tid++) {
+        int timerid = _timers[tid];
+        if (timerid != 0) {
+            // fails harmlessly if the thread has just deleted the timer
+            syscall(__NR_timer_settime, timerid - 1, 0, &ts, NULL);
+        }
+    }
+    return true;
+}
+
+int CTimer::registerThread(int tid) {
+    if (!_running) {
+        return 0;
+    }
+    if (tid >= _max_timers) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
+        return -1;
+    }
+
+    int timerid = createTimer(tid);
+    if (timerid < 0) {
+        // the thread may have exited in the meantime
+        return -1;
+    }
+
+    // kernel timer ids may start with zero, which marks an empty slot
+    if (!__sync_bool_compare_and_swap(&_timers[tid], 0, timerid + 1)) {
+        // already registered, e.g. both by start() and the thread start callback
+        syscall(__NR_timer_delete, timerid);
+        return 0;
+    }
+
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = (time_t)(_interval / 1000000000);
+    ts.it_interval.tv_nsec = _interval % 1000000000;
+    ts.it_value = ts.it_interval;
+    syscall(__NR_timer_settime, timerid, 0, &ts, NULL);
+    return 0;
+}
+
+void CTimer::unregisterThread(int tid) {
+    if (tid >= _max_timers) {
+        return;
+    }
+
+    int timerid = _timers[tid];
+    if (timerid != 0 && __sync_bool_compare_and_swap(&_timers[tid], timerid, 0)) {
+        syscall(__NR_timer_delete, timerid - 1);
+    }
+}
+
+#endif // __linux__
@@ -21,52 +21,118 @@
 #include "arch.h"
 #include "counters.h"
 
-static inline char* allocateKey(const char* key, size_t length) {
-    char* result = (char*)malloc(length + 1);
-    memcpy(result, key, length);
-    result[length] = 0;
-    return result;
+static const size_t KEY_CHUNK_SIZE = 8192;
+
+static inline u64 makeTag(unsigned int h, size_t length) {
+    // the low bit of the hash is sacrificed so that a tag is never zero
+    return (u64)(h | 1) << 32 | (u32)length;
 }
 
 static inline bool keyEquals(const char* candidate, const char* key, size_t length) {
-    return strncmp(candidate, key, length) == 0 && candidate[length] == 0;
+    // lengths already matched as part of the tag
+    return memcmp(candidate, key, length) == 0;
+}
+
+Dictionary::Dictionary(int id) : _id(id) {
+    _keys = NULL;
+    _size = 0;
+    _segment = allocateSegment(1, DICT_INITIAL_SLOTS);
 }
 
 Dictionary::~Dictionary() {
-    clear(_table, _id);
-    free(_table);
+    releaseSegments(_segment);
+    releaseKeys();
     Counters::set(DICTIONARY_BYTES, 0, _id);
     Counters::set(DICTIONARY_PAGES, 0, _id);
 }
 
 void Dictionary::clear() {
-    clear(_table, _id);
-    memset(_table, 0, sizeof(DictTable));
-    _table->base_index = _base_index = 1;
+    releaseSegments(_segment->next);
+    _segment->next = NULL;
+    memset(_segment->slots, 0, _segment->capacity * sizeof(DictSlot));
+    releaseKeys();
     Counters::set(DICTIONARY_KEYS, 0, _id);
     Counters::set(DICTIONARY_KEYS_BYTES, 0, _id);
-    Counters::set(DICTIONARY_BYTES, sizeof(DictTable), _id);
+    Counters::set(DICTIONARY_BYTES, sizeof(DictSegment) + _segment->capacity * sizeof(DictSlot), _id);
     Counters::set(DICTIONARY_PAGES, 1, _id);
     _size = 0;
 }
 
-void Dictionary::clear(DictTable* table, int id) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            if (row->keys[j]) {
-                free(row->keys[j]); // content is zeroed en-mass in the clear() function
+DictSegment* Dictionary::allocateSegment(unsigned int base_index, unsigned int capacity) {
+    size_t bytes = sizeof(DictSegment) + capacity * sizeof(DictSlot);
+    DictSegment* segment = (DictSegment*)calloc(1, bytes);
+    segment->base_index = base_index;
+    segment->capacity = capacity;
+    Counters::increment(DICTIONARY_PAGES, 1, _id);
+    Counters::increment(DICTIONARY_BYTES, bytes, _id);
+    return segment;
+}
+
+DictSegment* Dictionary::nextSegment(DictSegment* segment) {
+    DictSegment* next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        unsigned int capacity = segment->capacity < DICT_MAX_SLOTS ? segment->capacity * 2 : DICT_MAX_SLOTS;
+        // ids stay dense: every segment starts where the previous one ends
+        DictSegment* new_segment = allocateSegment(segment->base_index + segment->capacity, capacity);
+        next = __sync_val_compare_and_swap(&segment->next, NULL, new_segment);
+        if (next == NULL) {
+            next = new_segment;
+        } else {
+            size_t bytes = sizeof(DictSegment) + capacity * sizeof(DictSlot);
+            free(new_segment);
+            Counters::decrement(DICTIONARY_PAGES, 1, _id);
+            Counters::decrement(DICTIONARY_BYTES, bytes, _id);
+        }
+    }
+    return next;
+}
+
+void Dictionary::releaseSegments(DictSegment* segment) {
+    while (segment != NULL) {
+        DictSegment* next = segment->next;
+        free(segment);
+        segment = next;
+    }
+}
+
+const char* Dictionary::allocateKey(const char* key, size_t length) {
+    size_t size = length + 1;
+    while (true) {
+        DictKeyChunk* chunk = __atomic_load_n(&_keys, __ATOMIC_ACQUIRE);
+        if (chunk != NULL) {
+            for (size_t used = chunk->used; used + size <= chunk->size; used = chunk->used) {
+                if (__sync_bool_compare_and_swap(&chunk->used, used, used + size)) {
+                    char* result = (char*)chunk + used;
+                    memcpy(result, key, length);
+                    result[length] = 0;
+                    return result;
+                }
             }
         }
-        if (row->next != NULL) {
-            clear(row->next, id);
-            DictTable* tmp = row->next;
-            row->next = NULL;
-            free(tmp);
+        // oversized keys get a chunk of their own
+        size_t chunk_size = sizeof(DictKeyChunk) + size > KEY_CHUNK_SIZE ? sizeof(DictKeyChunk) + size : KEY_CHUNK_SIZE;
+        DictKeyChunk* new_chunk = (DictKeyChunk*)malloc(chunk_size);
+        new_chunk->prev = chunk;
+        new_chunk->size = chunk_size;
+        new_chunk->used = sizeof(DictKeyChunk);
+        if (__sync_bool_compare_and_swap(&_keys, chunk, new_chunk)) {
+            Counters::increment(DICTIONARY_BYTES, chunk_size, _id);
+        } else {
+            free(new_chunk);
         }
     }
 }
 
+void Dictionary::releaseKeys() {
+    DictKeyChunk* chunk = _keys;
+    _keys = NULL;
+    while (chunk != NULL) {
+        DictKeyChunk* prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+}
+
 // Many popular symbols are quite short, e.g. "[B", "()V" etc.
 // FNV-1a is reasonably fast and sufficiently random.
 unsigned int Dictionary::hash(const char* key, size_t length) {
@@ -86,44 +152,50 @@ unsigned int Dictionary::lookup(const char* key, size_t length) {
 }
 
 unsigned int Dictionary::lookup(const char* key, size_t length, bool for_insert, unsigned int sentinel) {
-    DictTable* table = _table;
     unsigned int h = hash(key, length);
+    u64 tag = makeTag(h, length);
+    const char* new_key = NULL;
 
-    while (true) {
-        DictRow* row = &table->rows[h % ROWS];
-        for (int c = 0; c < CELLS; c++) {
-            if (for_insert && row->keys[c] == NULL) {
-                char* new_key = allocateKey(key, length);
-                if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
+    for (DictSegment* segment = _segment; ; ) {
+        unsigned int mask = segment->capacity - 1;
+        unsigned int slot = h & mask;
+        for (int probe = 0; probe < DICT_MAX_PROBES; probe++, slot = (slot + 1) & mask) {
+            DictSlot* s = &segment->slots[slot];
+            u64 slot_tag = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
+            if (slot_tag == 0) {
+                if (!for_insert) {
+                    return sentinel;
+                }
+                // copy the key before claiming the slot, so that the claim is published without delay
+                if (new_key == NULL) {
+                    new_key = allocateKey(key, length);
+                }
+                if (__sync_bool_compare_and_swap(&s->tag, 0, tag)) {
+                    __atomic_store_n(&s->key, new_key, __ATOMIC_RELEASE);
                     Counters::increment(DICTIONARY_KEYS, 1, _id);
                     Counters::increment(DICTIONARY_KEYS_BYTES, length + 1, _id);
                     atomicInc(_size);
-                    return table->index(h % ROWS, c);
+                    return segment->index(slot);
                 }
-                free(new_key);
+                slot_tag = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
             }
-            if (row->keys[c] && keyEquals(row->keys[c], key, length)) {
-                return table->index(h % ROWS, c);
-            }
-        }
-
-        if (row->next == NULL) {
-            if (for_insert) {
-                DictTable *new_table = (DictTable *) calloc(1, sizeof(DictTable));
-                new_table->base_index = __sync_add_and_fetch(&_base_index, TABLE_CAPACITY);
-                if (!__sync_bool_compare_and_swap(&row->next, NULL, new_table)) {
-                    free(new_table);
-                } else {
-                    Counters::increment(DICTIONARY_PAGES, 1, _id);
-                    Counters::increment(DICTIONARY_BYTES, sizeof(DictTable), _id);
+            if (slot_tag == tag) {
+                const char* candidate;
+                // the slot has been claimed, but the inserting thread may not have stored the key yet
+                while ((candidate = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE)) == NULL) {
+                    spinPause();
+                }
+                if (keyEquals(candidate, key, length)) {
+                    return segment->index(slot);
                 }
-            } else {
-                return sentinel;
             }
         }
 
-        table = row->next;
-        h = (h >> ROW_BITS) | (h << (32 - ROW_BITS));
+        if (!for_insert && __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE) == NULL) {
+            return sentinel;
+        }
+        segment = nextSegment(segment);
+        h = (h >> 7) | (h << 25);
     }
 }
 
@@ -133,20 +205,92 @@ unsigned int Dictionary::bounded_lookup(const char *key, size_t length, int size
     return lookup(key, length, _size < size_limit, INT_MAX);
 }
 
-void Dictionary::collect(std::map<unsigned int, const char*>& map) {
-    collect(map, _table);
+const char* Dictionary::key(unsigned int id, size_t* length) {
+    for (DictSegment* segment = _segment; segment != NULL; segment = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE)) {
+        if (id >= segment->base_index && id - segment->base_index < segment->capacity) {
+            DictSlot* s = &segment->slots[id - segment->base_index];
+            const char* key = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+            if (key != NULL) {
+                *length = (u32)s->tag;
+            }
+            return key;
+        }
+    }
+    return NULL;
 }
 
-void Dictionary::collect(std::map<unsigned int, const char*>& map, DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            if (row->keys[j] != NULL) {
-                map[table->index(i, j)] = row->keys[j];
+void Dictionary::collect(std::map<unsigned int, const char*>& map) {
+    for (DictSegment* segment = _segment; segment != NULL; segment = segment->next) {
+        for (unsigned int i = 0; i < segment->capacity; i++) {
+            const char* key = segment->slots[i].key;
+            if (key != NULL) {
+                map[segment->index(i)] = key;
             }
         }
-        if (row->next != NULL) {
-            collect(map, row->next);
+    }
+}
+
+DictionaryMarks::DictionaryMarks() : _generation(1) {
+    memset((void*)_pages, 0, sizeof(_pages));
+}
+
+DictionaryMarks::~DictionaryMarks() {
+    for (int i = 0; i < DICT_MARK_PAGES; i++) {
+        free(_pages[i]);
+    }
+}
+
+void DictionaryMarks::clear() {
+    for (int i = 0; i < DICT_MARK_PAGES; i++) {
+        u8* page = __atomic_load_n(&_pages[i], __ATOMIC_ACQUIRE);
+        if (page != NULL) {
+            memset(page, 0, 1 << DICT_MARK_PAGE_BITS);
+        }
+    }
+    _generation = 1;
+}
+
+void DictionaryMarks::reserve(unsigned int id) {
+    if (id >= (DICT_MARK_PAGES << DICT_MARK_PAGE_BITS)) {
+        return;
+    }
+    u8* volatile* slot = &_pages[id >> DICT_MARK_PAGE_BITS];
+    if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) == NULL) {
+        u8* page = (u8*)calloc(1, 1 << DICT_MARK_PAGE_BITS);
+        if (page != NULL && !__sync_bool_compare_and_swap(slot, (u8*)NULL, page)) {
+            free(page);
+        }
+    }
+}
+
+static inline u8 nextGeneration(u8 generation) {
+    // zero is left to the ids never marked
+    return generation == 255 ? 1 : generation + 1;
+}
+
+u8 DictionaryMarks::advance() {
+    u8 generation = _generation;
+    __atomic_store_n(&_generation, nextGeneration(generation), __ATOMIC_RELEASE);
+    return generation;
+}
+
+void DictionaryMarks::collect(Dictionary* dictionary, std::map<unsigned int, const char*>& map, u8 generation) {
+    u8 next = nextGeneration(generation);
+    for (int i = 0; i < DICT_MARK_PAGES; i++) {
+        u8* page = __atomic_load_n(&_pages[i], __ATOMIC_ACQUIRE);
+        if (page == NULL) {
+            continue;
+        }
+        for (unsigned int j = 0; j < (1 << DICT_MARK_PAGE_BITS); j++) {
+            u8 mark = __atomic_load_n(&page[j], __ATOMIC_RELAXED);
+            if (mark == generation || mark == next) {
+                unsigned int id = (unsigned int)i << DICT_MARK_PAGE_BITS | j;
+                size_t length;
+                const char* key = dictionary->key(id, &length);
+                if (key != NULL) {
+                    map[id] = key;
+                }
+            }
         }
     }
 }
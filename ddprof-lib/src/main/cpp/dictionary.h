@@ -17,67 +17,128 @@
 #ifndef _DICTIONARY_H
 #define _DICTIONARY_H
 
+#include "arch.h"
 #include "counters.h"
 #include <map>
 #include <stddef.h>
 
 
-#define ROW_BITS        7
-#define ROWS            (1 << ROW_BITS)
-#define CELLS           3
-#define TABLE_CAPACITY  (ROWS * CELLS)
+// Slots in the first segment; every further segment doubles up to DICT_MAX_SLOTS
+#define DICT_INITIAL_SLOTS      256
+#define DICT_MAX_SLOTS          65536
+// Linear probing never looks further than this before moving on to the next segment
+#define DICT_MAX_PROBES         16
 
 
-struct DictTable;
-
-struct DictRow {
-    char* keys[CELLS];
-    DictTable* next;
+// The tag packs the key hash with its length, so that a probe compares both in one word
+// and only touches the key itself on a likely match. A zero tag marks a free slot.
+struct DictSlot {
+    volatile u64 tag;
+    const char* volatile key;
 };
 
-struct DictTable {
-    DictRow rows[ROWS];
+struct DictSegment {
+    DictSegment* volatile next;
     unsigned int base_index;
+    unsigned int capacity;
+    DictSlot slots[0];
 
-    unsigned int index(int row, int col) {
-        return base_index + (col << ROW_BITS) + row;
+    unsigned int index(unsigned int slot) {
+        return base_index + slot;
     }
 };
 
-// Append-only concurrent hash table based on multi-level arrays
+// Ids per page of DictionaryMarks, and the most pages it keeps
+#define DICT_MARK_PAGE_BITS     12
+#define DICT_MARK_PAGES         1024
+
+
+// Keys are copied into chunks that are only released when the dictionary is cleared
+struct DictKeyChunk {
+    DictKeyChunk* prev;
+    size_t size;
+    volatile size_t used;
+};
+
+// Append-only concurrent hash table: open addressing over a chain of growing flat segments.
+// A key lives in a later segment only if the probe window for it in every earlier segment was full,
+// which keeps lookups of missing keys short since slots are never freed.
 class Dictionary {
   private:
-    DictTable* _table;
+    DictSegment* _segment;
+    DictKeyChunk* volatile _keys;
     const int _id;
-    volatile unsigned int _base_index;
     volatile int _size;
 
-    static void clear(DictTable* table, int id);
-
     static unsigned int hash(const char* key, size_t length);
 
-    static void collect(std::map<unsigned int, const char*>& map, DictTable* table);
+    DictSegment* allocateSegment(unsigned int base_index, unsigned int capacity);
+    DictSegment* nextSegment(DictSegment* segment);
+    const char* allocateKey(const char* key, size_t length);
+    void releaseSegments(DictSegment* segment);
+    void releaseKeys();
 
     unsigned int lookup(const char* key, size_t length, bool for_insert, unsigned int sentinel);
 
   public:
     Dictionary() : Dictionary(0) {}
-    Dictionary(int id) : _id(id) {
-        _table = (DictTable*)calloc(1, sizeof(DictTable));
-        Counters::set(DICTIONARY_PAGES, 1, id);
-        Counters::set(DICTIONARY_BYTES, sizeof(DictTable), id);
-        _table->base_index = _base_index = 1;
-        _size = 0;
-    }
+    Dictionary(int id);
     ~Dictionary();
 
     void clear();
 
+    int size() {
+        return _size;
+    }
+
     unsigned int lookup(const char* key);
     unsigned int lookup(const char* key, size_t length);
     unsigned int bounded_lookup(const char* key, size_t length, int size_limit);
 
     void collect(std::map<unsigned int, const char*>& map);
+
+    // The key registered under id, NULL if there is none
+    const char* key(unsigned int id, size_t* length);
+};
+
+// Generational marks over the ids of a Dictionary whose entries outlive a chunk: the pool writer finds
+// the keys referenced since its last turn, instead of all of them. A mark is the generation as one byte,
+// so that an id marked 255 generations ago passes for a fresh one; it only costs a redundant pool entry.
+class DictionaryMarks {
+  private:
+    u8* volatile _pages[DICT_MARK_PAGES];
+    volatile u8 _generation;
+
+  public:
+    DictionaryMarks();
+    ~DictionaryMarks();
+
+    // Unmarks every id; the pages are kept for concurrent mark() calls
+    void clear();
+
+    // Makes room for the mark of id; not async signal safe
+    void reserve(unsigned int id);
+
+    // Async signal safe; an id without room is left unmarked
+    void mark(unsigned int id) {
+        u8* page = id < (DICT_MARK_PAGES << DICT_MARK_PAGE_BITS)
+                ? __atomic_load_n(&_pages[id >> DICT_MARK_PAGE_BITS], __ATOMIC_ACQUIRE) : NULL;
+        if (page != NULL) {
+            __atomic_store_n(&page[id & ((1 << DICT_MARK_PAGE_BITS) - 1)], _generation, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Ends the current generation, which is returned; the marks made from now on belong to the next one
+    u8 advance();
+
+    // The keys of the ids marked in the given generation or in the one following it: the ids marked
+    // again while an ended generation is collected are not missed, at the cost of a redundant pool entry
+    void collect(Dictionary* dictionary, std::map<unsigned int, const char*>& map, u8 generation);
+
+    // The keys of the ids marked in the current generation, which ends here
+    void collect(Dictionary* dictionary, std::map<unsigned int, const char*>& map) {
+        collect(dictionary, map, advance());
+    }
 };
 
 #endif // _DICTIONARY_H
@@ -17,6 +17,7 @@
 #ifndef _ENGINE_H
 #define _ENGINE_H
 
+#include "arch.h"
 #include "arguments.h"
 
 
@@ -55,6 +56,14 @@ class Engine {
         return 0L;
     }
 
+    // Changes the sampling interval of a running engine; false if it can not be changed on the fly
+    virtual bool setInterval(long interval) {
+        return false;
+    }
+
+    // The CPU time of the threads the engine runs itself to take its samples
+    virtual u64 samplerCpuTime() { return 0; }
+
     virtual int registerThread(int tid) { return -1; }
     virtual void unregisterThread(int tid) {}
 
@@ -35,13 +35,32 @@ class Event {
     Event() : _id(0) {}
 };
 
+// the delta of a hardware counter which is not counted for the thread, recorded as -1
+const u64 PMU_NOT_COUNTED = (u64)-1;
+
 class ExecutionEvent : public Event {
   public:
     ThreadState _thread_state;
     ExecutionMode _execution_mode;
     u64 _weight;
+    // Hardware counter deltas since the previous sample of the thread, set only with pmucounters;
+    // PMU_NOT_COUNTED for a counter unavailable to the thread
+    bool _has_pmu_counters;
+    u64 _cycles;
+    u64 _instructions;
+    u64 _cache_misses;
+    u64 _branch_misses;
+    // The sampled load, set only with memaccess; the latency is in core cycles
+    bool _has_mem_access;
+    u64 _data_address;
+    u64 _access_latency;
+    u64 _data_source;
+    // The exact time the thread has just spent off CPU, set only with wallswitch
+    u64 _off_cpu_nanos;
 
-    ExecutionEvent() : Event(), _thread_state(ThreadState::RUNNABLE), _weight(1), _execution_mode(ExecutionMode::UNKNOWN) {}
+    ExecutionEvent() : Event(), _thread_state(ThreadState::RUNNABLE), _weight(1), _execution_mode(ExecutionMode::UNKNOWN),
+        _has_pmu_counters(false), _cycles(0), _instructions(0), _cache_misses(0), _branch_misses(0),
+        _has_mem_access(false), _data_address(0), _access_latency(0), _data_source(0), _off_cpu_nanos(0) {}
 };
 
 class AllocEvent : public Event {
@@ -50,12 +69,44 @@ class AllocEvent : public Event {
     float _weight;
 };
 
+class AllocSummaryEvent : public Event {
+  public:
+    u64 _samples;
+    u64 _size;
+    float _weight;
+    Context _ctx;
+};
+
+class LiveSetSummaryEvent : public Event {
+  public:
+    u64 _start_time;
+    u64 _age;
+    u64 _samples;
+    u64 _size;
+    float _weight;
+};
+
+class MallocEvent : public Event {
+  public:
+    uintptr_t _address;
+    u64 _size;
+    float _weight;
+};
+
+class NativeLivenessEvent : public Event {
+  public:
+    MallocEvent _alloc;
+    u64 _start_time;
+    Context _ctx;
+};
+
 class LockEvent : public Event {
   public:
     u64 _start_time;
     u64 _end_time;
     uintptr_t _address;
     long long _timeout;
+    float _weight;
 };
 
 class ObjectLivenessEvent : public Event {
@@ -69,6 +120,7 @@ class ObjectLivenessEvent : public Event {
 class WallClockEpochEvent {
   public:
     bool _dirty;
+    u32 _shard;
     u64 _start_time;
     u64 _duration_millis;
     u32 _num_samplable_threads;
@@ -76,16 +128,27 @@ class WallClockEpochEvent {
     u32 _num_failed_samples;
     u32 _num_exited_threads;
     u32 _num_permission_denied;
+    // the worst lateness of a tick against its schedule and the longest signal delivery of a tick
+    u64 _max_tick_lag;
+    u64 _max_signal_duration;
+    // the effective sampling configuration, which the adaptive sampler may change between epochs
+    u32 _reservoir_size;
+    u64 _interval;
 
     WallClockEpochEvent(u64 start_time) :
         _dirty(false),
+        _shard(0),
         _start_time(start_time),
         _duration_millis(0),
         _num_samplable_threads(0),
         _num_successful_samples(0),
         _num_failed_samples(0),
         _num_exited_threads(0),
-        _num_permission_denied(0) {}
+        _num_permission_denied(0),
+        _max_tick_lag(0),
+        _max_signal_duration(0),
+        _reservoir_size(0),
+        _interval(0) {}
 
     bool hasChanged() {
         return _dirty;
@@ -126,6 +189,24 @@ class WallClockEpochEvent {
         }
     }
 
+    void updateSamplingConfig(u32 reservoir_size, u64 interval) {
+        if (_reservoir_size != reservoir_size || _interval != interval) {
+            _dirty = true;
+            _reservoir_size = reservoir_size;
+            _interval = interval;
+        }
+    }
+
+    // timing changes every tick, so it does not end the epoch on its own
+    void updateTickTiming(u64 lag_nanos, u64 signal_nanos) {
+        if (lag_nanos > _max_tick_lag) {
+            _max_tick_lag = lag_nanos;
+        }
+        if (signal_nanos > _max_signal_duration) {
+            _max_signal_duration = signal_nanos;
+        }
+    }
+
     void endEpoch(u64 millis) {
         _duration_millis = millis;
     }
@@ -137,6 +218,8 @@ class WallClockEpochEvent {
     void newEpoch(u64 start_time) {
         _dirty = false;
         _start_time = start_time;
+        _max_tick_lag = 0;
+        _max_signal_duration = 0;
     }
 };
 
@@ -149,12 +232,56 @@ class TraceRootEvent {
         _local_root_span_id(local_root_span_id), _label(label) {};
 };
 
+class SpanSummaryEvent : public Event {
+  public:
+    u64 _span_id;
+    u64 _root_span_id;
+    u64 _cpu_samples;
+    u64 _cpu_time;
+    u64 _wall_samples;
+    u64 _wall_time;
+};
+
 typedef struct QueueTimeEvent {
     u64 _start;
     u64 _end;
     u32 _task;
     u32 _scheduler;
     u32 _origin;
+    u32 _weight;
 } QueueTimeEvent;
 
+// A window in which the VM was busy with something the samples may be blind to, see VMTimeline
+class VMActivityEvent {
+  public:
+    // T_SAFEPOINT, T_GC_PAUSE or T_COMPILATION
+    int _type;
+    u64 _start_time;
+    u64 _end_time;
+    // the compiled method and the size of its code, for the compilations only
+    const char* _method;
+    u32 _code_size;
+};
+
+enum BatchedEventType {
+    BATCHED_TRACE_ROOT = 1,
+    BATCHED_QUEUE_TIME = 2,
+    BATCHED_SETTING = 3
+};
+
+// One record of a batch submitted from Java, with its strings already resolved
+typedef struct BatchedEvent {
+    BatchedEventType _type;
+    int _tid;
+    // trace root: the local root span and its endpoint label
+    // queue time: the span ids active when the task was dequeued
+    u64 _span_id;
+    u64 _root_span_id;
+    u32 _label;
+    QueueTimeEvent _queue_time;
+    // setting: name, value and unit
+    const char* _strings[3];
+    int _length;
+} BatchedEvent;
+
 #endif // _EVENT_H
@@ -15,6 +15,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <assert.h>
 
 #include <map>
@@ -27,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include "buffers.h"
@@ -36,10 +38,17 @@
 #include "incbin.h"
 #include "jfrMetadata.h"
 #include "jvm.h"
+#include "lz4Writer.h"
 #include "dictionary.h"
 #include "os.h"
+#include "memoryGovernor.h"
+#include "overheadGovernor.h"
+#include "pprofWriter.h"
+#include "shmRing.h"
 #include "profiler.h"
+#include "sampleCapture.h"
 #include "spinLock.h"
+#include "stackTraceWriter.h"
 #include "symbols.h"
 #include "threadFilter.h"
 #include "threadState.h"
@@ -53,14 +62,42 @@ static SpinLock _rec_lock(1);
 static const char* const SETTING_RING[] = {NULL, "kernel", "user", "any"};
 static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "dwarf", "lbr"};
 
+// The class ids written by an event are referenced by the constant pool of its chunk
+static inline void markClass(u32 id) {
+    Profiler::instance()->classMarks()->mark(id);
+}
+
+// Past this many symbols or packages, the ones of a recording are started over; the ids stay below the _base_id bits
+static const int MAX_SYMBOLS_SIZE = 1 << 20;
+
 static void deallocateLineNumberTable(void* ptr) {
 
 }
 
+static bool byStartLocation(const jvmtiLineNumberEntry& a, const jvmtiLineNumberEntry& b) {
+    return a.start_location < b.start_location;
+}
+
+SharedLineNumberTable::SharedLineNumberTable(int size, void* ptr) : _size(size), _ptr(ptr), _last_bci(-1), _last_line(0) {
+    jvmtiLineNumberEntry* table = (jvmtiLineNumberEntry*)_ptr;
+    // the table is usually in bytecode order already; stable so that the last of equal locations still wins
+    if (!std::is_sorted(table, table + _size, byStartLocation)) {
+        std::stable_sort(table, table + _size, byStartLocation);
+    }
+}
+
 SharedLineNumberTable::~SharedLineNumberTable() {
     VM::jvmti()->Deallocate((unsigned char*)_ptr);
 }
 
+Lookup::Lookup(Recording* rec, MethodMap* method_map, Dictionary* classes) :
+    _rec(rec), _method_map(method_map), _classes(classes),
+    _packages(rec != NULL ? &rec->_packages : &_own_packages),
+    _symbols(rec != NULL ? &rec->_symbols : &_own_symbols),
+    _own_packages(), _own_symbols(), _own_class_packages(),
+    _class_packages(rec != NULL ? &rec->_class_packages : &_own_class_packages) {
+}
+
 void Lookup::fillNativeMethodInfo(MethodInfo* mi, const char* name, const char* lib_name) {
     mi->_class = _classes->lookup("");
     // TODO return the library name once we figured out how to cooperate with the backend
@@ -80,8 +117,8 @@ void Lookup::fillNativeMethodInfo(MethodInfo* mi, const char* name, const char*
         char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
         if (demangled != NULL) {
             cutArguments(demangled);
-            mi->_name = _symbols.lookup(demangled);
-            mi->_sig = _symbols.lookup("()L;");
+            mi->_name = getSymbol(demangled);
+            mi->_sig = getSymbol("()L;");
             mi->_type = FRAME_CPP;
             free(demangled);
             return;
@@ -90,12 +127,12 @@ void Lookup::fillNativeMethodInfo(MethodInfo* mi, const char* name, const char*
 
     size_t len = strlen(name);
     if (len >= 4 && strcmp(name + len - 4, "_[k]") == 0) {
-        mi->_name = _symbols.lookup(name, len - 4);
-        mi->_sig = _symbols.lookup("(Lk;)L;");
+        mi->_name = getSymbol(name, len - 4);
+        mi->_sig = getSymbol("(Lk;)L;");
         mi->_type = FRAME_KERNEL;
     } else {
-        mi->_name = _symbols.lookup(name);
-        mi->_sig = _symbols.lookup("()L;");
+        mi->_name = getSymbol(name);
+        mi->_sig = getSymbol("()L;");
         mi->_type = FRAME_NATIVE;
     }
 }
@@ -115,7 +152,46 @@ void Lookup::cutArguments(char* func) {
     }
 }
 
+// Keeps every loaded class from being unloaded while in scope, at the cost of a local ref per class.
+// Only needed where the JVM does not validate the jmethodIDs passed to JVMTI: on HotSpot a stale id
+// is rejected, and the declaring class of a method stays loaded while fillJavaMethodInfo holds it.
+class LoadedClassesPin {
+  private:
+    jclass* _classes;
+    jint _count;
+
+  public:
+    explicit LoadedClassesPin(bool enabled) : _classes(NULL), _count(0) {
+        if (enabled && VM::jvmti()->GetLoadedClasses(&_count, &_classes) != 0) {
+            _classes = NULL;
+            _count = 0;
+        }
+    }
+
+    ~LoadedClassesPin() {
+        if (_classes != NULL) {
+            JNIEnv* env = VM::jni();
+            for (int i = 0; i < _count; i++) {
+                env->DeleteLocalRef((jobject)_classes[i]);
+            }
+            VM::jvmti()->Deallocate((unsigned char*)_classes);
+        }
+    }
+};
+
 void Lookup::fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_time) {
+    if (mi->_class_name != NULL) {
+        if (VMMethod::check_jmethodID(method)) {
+            // resolved in an earlier chunk; only the ids in the dictionaries of this chunk are needed
+            mi->_class = _classes->lookup(mi->_class_name->c_str(), mi->_class_name->length());
+            mi->_name = getSymbol(mi->_method_name->c_str());
+            mi->_sig = getSymbol(mi->_method_sig->c_str());
+            return;
+        }
+        // the class has been unloaded
+        mi->_class_name = mi->_method_name = mi->_method_sig = NULL;
+    }
+
     JNIEnv* jni = VM::jni();
     if (jni->PushLocalFrame(64) != 0) {
         return;
@@ -139,6 +215,7 @@ void Lookup::fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_tim
     jvmti->GetPhase(&phase);
     if ((phase & (JVMTI_PHASE_START | JVMTI_PHASE_LIVE)) != 0) {
         bool entry = false;
+        // the local ref to the declaring class keeps it from unloading until the frame is popped
         if (VMMethod::check_jmethodID(method) && jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
             jvmti->GetClassSignature(method_class, &class_name, NULL) == 0 &&
             jvmti->GetMethodName(method, &method_name, &method_sig, NULL) == 0) {
@@ -149,64 +226,52 @@ void Lookup::fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_tim
 
             // Check if the frame is Thread.run or inherits from it
             if (strncmp(method_name, "run", 4) == 0 && strncmp(method_sig, "()V", 3) == 0) {
-                jclass Thread_class = jni->FindClass("java/lang/Thread");
-                jmethodID equals =
-                        jni->GetMethodID(jni->FindClass("java/lang/Class"), "equals", "(Ljava/lang/Object;)Z");
-                jclass klass = method_class;
-                do {
-                    entry = jni->CallBooleanMethod(Thread_class, equals, klass);
-                    jniExceptionCheck(jni);
-                    if (entry) {
-                        break;
-                    }
-                } while ((klass = jni->GetSuperclass(klass)) != NULL);
+                entry = isThreadSubclass(jni, method_class, class_name);
             } else if (strncmp(method_name, "main", 5) == 0 && strncmp(method_sig, "(Ljava/lang/String;)V", 21)) {
                 // public static void main(String[] args) - 'public static' translates to modifier bits 0 and 3, hence check for '9'
                 entry = true;
             }
 
-            // maybe we should store the lookups below in initialisation-time constants...
+            const char* normalised_name = method_name;
             if (has_prefix(class_name, "Ljdk/internal/reflect/GeneratedConstructorAccessor")) {
-                class_name_id = _classes->lookup("jdk/internal/reflect/GeneratedConstructorAccessor");
-                method_name_id = _symbols.lookup("Object jdk.internal.reflect.GeneratedConstructorAccessor.newInstance(Object[])");
-                method_sig_id = _symbols.lookup(method_sig);
+                mi->_class_name = _method_map->intern("jdk/internal/reflect/GeneratedConstructorAccessor");
+                normalised_name = "Object jdk.internal.reflect.GeneratedConstructorAccessor.newInstance(Object[])";
             } else if (has_prefix(class_name, "Lsun/reflect/GeneratedConstructorAccessor")) {
-                class_name_id = _classes->lookup("sun/reflect/GeneratedConstructorAccessor");
-                method_name_id = _symbols.lookup("Object sun.reflect.GeneratedConstructorAccessor.newInstance(Object[])");
-                method_sig_id = _symbols.lookup(method_sig);
+                mi->_class_name = _method_map->intern("sun/reflect/GeneratedConstructorAccessor");
+                normalised_name = "Object sun.reflect.GeneratedConstructorAccessor.newInstance(Object[])";
             } else if (has_prefix(class_name, "Ljdk/internal/reflect/GeneratedMethodAccessor")) {
-                class_name_id = _classes->lookup("jdk/internal/reflect.GeneratedMethodAccessor");
-                method_name_id = _symbols.lookup("Object jdk.internal.reflect.GeneratedMethodAccessor.invoke(Object, Object[])");
-                method_sig_id = _symbols.lookup(method_sig);
+                mi->_class_name = _method_map->intern("jdk/internal/reflect.GeneratedMethodAccessor");
+                normalised_name = "Object jdk.internal.reflect.GeneratedMethodAccessor.invoke(Object, Object[])";
             } else if (has_prefix(class_name, "Lsun/reflect/GeneratedMethodAccessor")) {
-                class_name_id = _classes->lookup("sun/reflect/GeneratedMethodAccessor");
-                method_name_id = _symbols.lookup("Object sun.reflect.GeneratedMethodAccessor.invoke(Object, Object[])");
-                method_sig_id = _symbols.lookup(method_sig);
+                mi->_class_name = _method_map->intern("sun/reflect/GeneratedMethodAccessor");
+                normalised_name = "Object sun.reflect.GeneratedMethodAccessor.invoke(Object, Object[])";
             } else if (has_prefix(class_name, "Ljava/lang/invoke/LambdaForm$")) {
                 const int lambdaFormPrefixLength = strlen("Ljava/lang/invoke/LambdaForm$");
                 // we want to normalise to java/lang/invoke/LambdaForm$MH, java/lang/invoke/LambdaForm$DMH, java/lang/invoke/LambdaForm$BMH,
                 if (has_prefix(class_name + lambdaFormPrefixLength, "MH")) {
-                    class_name_id = _classes->lookup("java/lang/invoke/LambdaForm$MH");
+                    mi->_class_name = _method_map->intern("java/lang/invoke/LambdaForm$MH");
                 } else if (has_prefix(class_name + lambdaFormPrefixLength, "BMH")) {
-                    class_name_id = _classes->lookup("java/lang/invoke/LambdaForm$BMH");
+                    mi->_class_name = _method_map->intern("java/lang/invoke/LambdaForm$BMH");
                 } else if (has_prefix(class_name + lambdaFormPrefixLength, "DMH")) {
-                    class_name_id = _classes->lookup("java/lang/invoke/LambdaForm$DMH");
+                    mi->_class_name = _method_map->intern("java/lang/invoke/LambdaForm$DMH");
                 } else {
                     // don't recognise the suffix, so don't normalise
-                    class_name_id = _classes->lookup(class_name + 1, strlen(class_name) - 2);
+                    mi->_class_name = _method_map->intern(class_name + 1, strlen(class_name) - 2);
                 }
-                method_name_id = _symbols.lookup(method_name);
-                method_sig_id = _symbols.lookup(method_sig);
             } else {
-                class_name_id = _classes->lookup(class_name + 1, strlen(class_name) - 2);
-                method_name_id = _symbols.lookup(method_name);
-                method_sig_id = _symbols.lookup(method_sig);
+                mi->_class_name = _method_map->intern(class_name + 1, strlen(class_name) - 2);
             }
+            mi->_method_name = _method_map->intern(normalised_name);
+            mi->_method_sig = _method_map->intern(method_sig);
+
+            class_name_id = _classes->lookup(mi->_class_name->c_str(), mi->_class_name->length());
+            method_name_id = getSymbol(mi->_method_name->c_str());
+            method_sig_id = getSymbol(mi->_method_sig->c_str());
         } else {
             Counters::increment(JMETHODID_SKIPPED);
             class_name_id = _classes->lookup("");
-            method_name_id = _symbols.lookup("jvmtiError");
-            method_sig_id = _symbols.lookup("()L;");
+            method_name_id = getSymbol("jvmtiError");
+            method_sig_id = getSymbol("()L;");
         }
 
         mi->_class = class_name_id;
@@ -232,12 +297,138 @@ void Lookup::fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_tim
     jni->PopLocalFrame(NULL);
 }
 
+bool Lookup::isThreadSubclass(JNIEnv* jni, jclass method_class, const char* class_name) {
+    std::unordered_map<std::string, bool>& thread_classes = _method_map->threadClasses();
+    std::unordered_map<std::string, bool>::const_iterator it = thread_classes.find(class_name);
+    if (it != thread_classes.end()) {
+        return it->second;
+    }
+
+    bool result = false;
+    jclass Thread_class = jni->FindClass("java/lang/Thread");
+    jmethodID equals =
+            jni->GetMethodID(jni->FindClass("java/lang/Class"), "equals", "(Ljava/lang/Object;)Z");
+    jclass klass = method_class;
+    do {
+        result = jni->CallBooleanMethod(Thread_class, equals, klass);
+        jniExceptionCheck(jni);
+        if (result) {
+            break;
+        }
+    } while ((klass = jni->GetSuperclass(klass)) != NULL);
+
+    thread_classes[class_name] = result;
+    return result;
+}
+
+MethodMap::MethodMap() : _capacity(INITIAL_CAPACITY), _size(0), _null_entry(NULL), _mark_epoch(1) {
+    _keys = (jmethodID*)calloc(_capacity, sizeof(jmethodID));
+    _values = (MethodInfo**)calloc(_capacity, sizeof(MethodInfo*));
+}
+
+MethodMap::~MethodMap() {
+    for (size_t i = 0; i < _arena.size(); i++) {
+        delete[] _arena[i];
+    }
+    free(_keys);
+    free(_values);
+}
+
+MethodInfo* MethodMap::allocate() {
+    u32 index = _size % ARENA_CHUNK_SIZE;
+    if (index == 0) {
+        _arena.push_back(new MethodInfo[ARENA_CHUNK_SIZE]);
+    }
+    _size++;
+    return &_arena.back()[index];
+}
+
+void MethodMap::grow() {
+    u32 old_capacity = _capacity;
+    jmethodID* old_keys = _keys;
+    MethodInfo** old_values = _values;
+
+    _capacity = old_capacity * 2;
+    _keys = (jmethodID*)calloc(_capacity, sizeof(jmethodID));
+    _values = (MethodInfo**)calloc(_capacity, sizeof(MethodInfo*));
+    for (u32 i = 0; i < old_capacity; i++) {
+        if (old_keys[i] != NULL) {
+            u32 slot = hash(old_keys[i]) & (_capacity - 1);
+            while (_keys[slot] != NULL) {
+                slot = (slot + 1) & (_capacity - 1);
+            }
+            _keys[slot] = old_keys[i];
+            _values[slot] = old_values[i];
+        }
+    }
+    free(old_keys);
+    free(old_values);
+}
+
+MethodInfo* MethodMap::get(jmethodID method) {
+    if (method == NULL) {
+        if (_null_entry == NULL) {
+            _null_entry = allocate();
+        }
+        return _null_entry;
+    }
+
+    u32 slot = hash(method) & (_capacity - 1);
+    while (_keys[slot] != method) {
+        if (_keys[slot] == NULL) {
+            if (_size >= _capacity * 3 / 4) {
+                grow();
+                return get(method);
+            }
+            _keys[slot] = method;
+            return _values[slot] = allocate();
+        }
+        slot = (slot + 1) & (_capacity - 1);
+    }
+    return _values[slot];
+}
+
+void Lookup::resolveNativePCs(std::map<u32, CallTrace*>& traces) {
+    std::vector<jmethodID> pcs;
+    for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+        CallTrace* trace = it->second;
+        for (int i = 0; i < trace->num_frames; i++) {
+            if (trace->frames[i].bci == BCI_NATIVE_PC) {
+                pcs.push_back(trace->frames[i].method_id);
+            }
+        }
+    }
+    if (pcs.empty()) {
+        return;
+    }
+
+    // Sorted by library, then by address: one pass over the symbols of each library
+    std::sort(pcs.begin(), pcs.end());
+    pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+    Profiler* profiler = Profiler::instance();
+    _native_pcs.reserve(pcs.size());
+    for (size_t i = 0; i < pcs.size(); i++) {
+        _native_pcs.push_back(std::make_pair(pcs[i], profiler->resolveNativePC(pcs[i])));
+    }
+}
+
 MethodInfo* Lookup::resolveMethod(ASGCT_CallFrame& frame) {
+    if (frame.bci == BCI_NATIVE_PC) {
+        // Frames of the same function share a method no matter the PC
+        std::vector<std::pair<jmethodID, const char*> >::const_iterator it = std::lower_bound(
+            _native_pcs.begin(), _native_pcs.end(), std::make_pair(frame.method_id, (const char*)NULL));
+        ASGCT_CallFrame resolved;
+        resolved.bci = BCI_NATIVE_FRAME;
+        resolved.method_id = it != _native_pcs.end() && it->first == frame.method_id ? (jmethodID)it->second : NULL;
+        return resolveMethod(resolved);
+    }
+
     jmethodID method = frame.method_id;
-    MethodInfo* mi = &(*_method_map)[method];
+    MethodInfo* mi = _method_map->get(method);
 
-    if (!mi->_mark) {
-        mi->_mark = true;
+    // a method already written to this file is neither resolved nor written again
+    if (!_method_map->isMarked(mi) && !isWritten(mi)) {
+        _method_map->mark(mi);
         bool first_time = mi->_key == 0;
         if (first_time) {
             mi->_key = _method_map->size();
@@ -257,47 +448,176 @@ MethodInfo* Lookup::resolveMethod(ASGCT_CallFrame& frame) {
     return mi;
 }
 
-u32 Lookup::getPackage(const char* class_name) {
-    const char* package = strrchr(class_name, '/');
-    if (package == NULL) {
-        return 0;
+static const u32 NO_PACKAGE = (u32)-1;
+
+u32 Lookup::getPackage(u32 class_id, const char* class_name) {
+    std::unordered_map<u32, u32>::iterator it = _class_packages->find(class_id);
+    if (it == _class_packages->end()) {
+        u32 id = NO_PACKAGE;
+        const char* package = strrchr(class_name, '/');
+        if (package != NULL && package[1] >= '0' && package[1] <= '9') {
+            // Seems like a hidden or anonymous class, e.g. com/example/Foo/0x012345
+            do {
+                if (package == class_name) {
+                    package = NULL;
+                    break;
+                }
+            } while (*--package != '/');
+        }
+        if (package != NULL) {
+            if (class_name[0] == '[') {
+                class_name = strchr(class_name, 'L') + 1;
+            }
+            id = _packages->lookup(class_name, package - class_name);
+        }
+        it = _class_packages->insert(std::make_pair(class_id, id)).first;
     }
-    if (package[1] >= '0' && package[1] <= '9') {
-        // Seems like a hidden or anonymous class, e.g. com/example/Foo/0x012345
-        do {
-            if (package == class_name) return 0;
-        } while (*--package != '/');
+    if (it->second == NO_PACKAGE) {
+        return 0;
     }
-    if (class_name[0] == '[') {
-        class_name = strchr(class_name, 'L') + 1;
+    if (_rec != NULL) {
+        _rec->_package_marks.reserve(it->second);
+        _rec->_package_marks.mark(it->second);
     }
-    return _packages.lookup(class_name, package - class_name);
+    return it->second;
 }
 
 u32 Lookup::getSymbol(const char* name) {
-    return _symbols.lookup(name);
+    return getSymbol(name, strlen(name));
+}
+
+u32 Lookup::getSymbol(const char* name, size_t length) {
+    u32 id = _symbols->lookup(name, length);
+    if (_rec != NULL) {
+        _rec->_symbol_marks.reserve(id);
+        _rec->_symbol_marks.mark(id);
+    }
+    return id;
+}
+
+void Lookup::appendKey(Dictionary* dictionary, u32 id, std::string& name) {
+    size_t length = 0;
+    const char* key = dictionary->key(id, &length);
+    if (key != NULL) {
+        name.append(key, length);
+    }
+}
+
+void Lookup::appendFrameName(ASGCT_CallFrame& frame, std::string& name) {
+    if (frame.bci <= BCI_ALLOC && frame.bci >= BCI_PARK) {
+        // the class of the allocated object or of the lock; such frames are made only without a JFR recording
+        appendKey(_classes, (u32)(uintptr_t)frame.method_id, name);
+        if (frame.bci == BCI_ALLOC || frame.bci == BCI_LIVENESS) {
+            name += "_[i]";
+        } else if (frame.bci == BCI_ALLOC_OUTSIDE_TLAB) {
+            name += "_[k]";
+        }
+        return;
+    }
+
+    MethodInfo* mi = resolveMethod(frame);
+    if (mi->_type < FRAME_NATIVE) {
+        appendKey(_classes, mi->_class, name);
+        name += '.';
+    }
+    appendKey(_symbols, mi->_name, name);
+    if (mi->_type == FRAME_KERNEL) {
+        name += "_[k]";
+    }
+}
+
+template <int N>
+static void writeContextTags(Buffer* buf, const Context& context) {
+    buf->putVar64(context.spanId);
+    buf->putVar64(context.rootSpanId);
+    buf->putVar32Array<N>(reinterpret_cast<const u32*>(context.tags));
 }
 
+// Fills table[0..N] with the context writer for each attribute count
+template <int N>
+struct ContextWriterTable {
+    static void fill(ContextWriter* table) {
+        table[N] = writeContextTags<N>;
+        ContextWriterTable<N - 1>::fill(table);
+    }
+};
+
+template <>
+struct ContextWriterTable<-1> {
+    static void fill(ContextWriter* table) {
+    }
+};
+
+static ContextWriter selectContextWriter(u32 attributes) {
+    static ContextWriter table[DD_MAX_TAGS_CAPACITY + 1];
+    if (table[0] == NULL) {
+        ContextWriterTable<DD_MAX_TAGS_CAPACITY>::fill(table);
+    }
+    return table[attributes < DD_MAX_TAGS_CAPACITY ? attributes : DD_MAX_TAGS_CAPACITY];
+}
 
 char* Recording::_agent_properties = NULL;
 char* Recording::_jvm_args = NULL;
 char* Recording::_jvm_flags = NULL;
 char* Recording::_java_command = NULL;
 
-Recording::Recording(int fd, Arguments& args) : _fd(fd), _thread_set(), _method_map() {
+Recording::Recording(int fd, Arguments& args, Subscription* subscription) : _fd(fd), _thread_set(), _method_map() {
         
     args.save(_args);
-    _chunk_start = lseek(_fd, 0, SEEK_END);
+    _subscription = subscription;
+    _cpu_seen = 0;
+    _wall_seen = 0;
+    _alloc_seen = 0;
+    _expired = false;
+    _context_writer = selectContextWriter(Profiler::instance()->numContextAttributes());
+    _mapped = NULL;
+    if (args._jfr_size > 0) {
+        _mapped = new MappedFile(_fd, args._jfr_size);
+        if (!_mapped->valid()) {
+            Log::warn("Unable to map the JFR recording file: %s", strerror(errno));
+            delete _mapped;
+            _mapped = NULL;
+        }
+    }
+    // the mapped ring always starts over, a regular file may be appended to
+    _chunk_start = _mapped != NULL ? 0 : lseek(_fd, 0, SEEK_END);
     _start_time = OS::micros();
     _start_ticks = TSC::ticks();
     _recording_start_time = _start_time;
     _recording_start_ticks = _start_ticks;
     _base_id = 0;
     _bytes_written = 0;
+    _rotation_requested = false;
+    _sealing = false;
+    _writer_held = false;
+    _retired_traces = false;
+    _class_generation = 0;
+    // chunks in the ring are overwritten, so each of them must carry complete constant pools
+    _incremental_cpool = args.hasOption(INCREMENTAL_CPOOL) && _mapped == NULL;
+    _file_epoch = 1;
+    _class_map_epoch = Profiler::instance()->classMapEpoch();
+    _compact_samples = args.hasOption(COMPACT_SAMPLES);
+    memset(_last_context, 0, sizeof(_last_context));
+    _coalesced = args.hasOption(COALESCE_SAMPLES)
+        ? (CoalescedSample*)calloc(CONCURRENCY_LEVEL * COALESCE_SLOTS, sizeof(CoalescedSample)) : NULL;
+    _context_aggregates = args._lightweight || args._unsampled == UNSAMPLED_COUNT
+        ? (ContextAggregate*)calloc(CONCURRENCY_LEVEL * CONTEXT_AGGREGATE_SLOTS, sizeof(ContextAggregate)) : NULL;
+    _off_cpu_aggregates = args._wall_switch >= 0
+        ? (OffCpuAggregate*)calloc(CONCURRENCY_LEVEL * OFF_CPU_AGGREGATE_SLOTS, sizeof(OffCpuAggregate)) : NULL;
 
     _tid = OS::threadId();
     VM::jvmti()->GetAvailableProcessors(&_available_processors);
 
+    Profiler* profiler = Profiler::instance();
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        _active_buf[i] = &_buf[i];
+        _retired_buf[i] = NULL;
+        _full_buf[i] = NULL;
+        // the buffers were first touched by this thread; move them to the node of the samplers using them
+        OS::bindToNode(&_buf[i], sizeof(RecordingBuffer), profiler->lockNode(i));
+        OS::bindToNode(&_spare_buf[i], sizeof(RecordingBuffer), profiler->lockNode(i));
+    }
+
     writeHeader(_buf);
     writeMetadata(_buf);
     writeSettings(_buf, args);
@@ -316,20 +636,300 @@ Recording::Recording(int fd, Arguments& args) : _fd(fd), _thread_set(), _method_
     }
     flush(_buf);
 
+    _self_overhead = args._self_overhead;
+    memset(&_overhead, 0, sizeof(_overhead));
+    memset(&_last_overhead, 0, sizeof(_last_overhead));
+    _capture = args._capture != NULL ? args._capture : "";
+    _pprof = args._pprof != NULL ? new PprofWriter(args) : NULL;
+    _shm_ring = args._shm_ring != NULL ? new ShmRing(args._shm_ring, args._shm_ring_size) : NULL;
+    if (_shm_ring != NULL && !_shm_ring->valid()) {
+        Log::warn("Unable to create the shared memory ring %s: %s", args._shm_ring, strerror(errno));
+        delete _shm_ring;
+        _shm_ring = NULL;
+    }
+
     _cpu_monitor_enabled = !args.hasOption(NO_CPU_LOAD);
     if (_cpu_monitor_enabled) {
         _last_times.proc.real = OS::getProcessCpuTime(&_last_times.proc.user, &_last_times.proc.system);
         _last_times.total.real = OS::getTotalCpuTime(&_last_times.total.user, &_last_times.total.system);
     }
+
+    // without the writer thread the full buffers are written synchronously as before
+    _writer_running = true;
+    if (pthread_create(&_writer_thread, NULL, writerEntry, this) != 0) {
+        Log::warn("Unable to create the JFR writer thread");
+        _writer_running = false;
+    }
 }
 
 Recording::~Recording() {
+    if (_writer_running) {
+        _writer_running = false;
+        pthread_join(_writer_thread, NULL);
+    }
     finishChunk(true);
+    free(_coalesced);
+    free(_context_aggregates);
+    free(_off_cpu_aggregates);
+    delete _subscription;
+    delete _pprof;
+    delete _shm_ring;
+    if (_mapped != NULL) {
+        _mapped->close();
+        delete _mapped;
+    }
     close(_fd);
 }
 
+void Recording::writerLoop() {
+    struct timespec interval = {0, JFR_WRITER_INTERVAL_NANOS};
+    u64 latency_time = OS::nanotime();
+    u64 governor_time = latency_time;
+    u64 memory_time = latency_time;
+    u64 rotation_time = latency_time;
+    // the governed engines are shared, so only the continuous recording cycles the governors
+    bool continuous = _subscription == NULL;
+    while (_writer_running) {
+        nanosleep(&interval, NULL);
+        _writer_lock.lock();
+        writeFullBuffers();
+        if (continuous && SignalLatency::reporting() && OS::nanotime() - latency_time >= JFR_SIGNAL_LATENCY_PERIOD_NANOS) {
+            signalLatencyCycle();
+            latency_time = OS::nanotime();
+        }
+        if (continuous && OverheadGovernor::enabled() && OS::nanotime() - governor_time >= JFR_OVERHEAD_GOVERNOR_PERIOD_NANOS) {
+            long cpu_interval = OverheadGovernor::cycle();
+            if (cpu_interval > 0) {
+                writeCpuInterval(cpu_interval);
+            }
+            governor_time = OS::nanotime();
+        }
+        if (continuous && MemoryGovernor::enabled() && OS::nanotime() - memory_time >= JFR_MEMORY_GOVERNOR_PERIOD_NANOS) {
+            u64 footprint;
+            long cpu_interval;
+            if (MemoryGovernor::cycle(&footprint, &cpu_interval)) {
+                recordMemoryGovernorAction(&_cpu_monitor_buf, MemoryGovernor::level(), footprint);
+                flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+                if (cpu_interval > 0) {
+                    writeCpuInterval(cpu_interval);
+                }
+            }
+            memory_time = OS::nanotime();
+        }
+        if (OS::nanotime() - rotation_time >= JFR_ROTATION_CHECK_PERIOD_NANOS) {
+            checkRotation();
+            rotation_time = OS::nanotime();
+        }
+        _writer_lock.unlock();
+    }
+}
+
+void Recording::checkRotation() {
+    if (_rotation_requested) {
+        return;
+    }
+    if (_subscription != NULL) {
+        // a subscriber is sealed along with the dumps of the continuous recording, and closed once it expires
+        if (_subscription->end_time != 0 && OS::micros() >= _subscription->end_time) {
+            _expired = true;
+            _rotation_requested = Profiler::instance()->chunkWriter()->unsubscribe(_subscription->path.c_str());
+        }
+        return;
+    }
+    bool oversized = _args._chunk_size > 0 && _bytes_written >= (u64)_args._chunk_size;
+    bool expired = _args._chunk_time > 0 && OS::micros() - _start_time >= (u64)_args._chunk_time * 1000000;
+    if (oversized || expired) {
+        // the chunk is sealed under the profiler locks, which the writer thread must never wait for
+        _rotation_requested = Profiler::instance()->chunkWriter()->rotate();
+    }
+}
+
+bool Recording::accepts(int event_type) {
+    if (_subscription == NULL) {
+        return true;
+    }
+    int event_mask;
+    u32 stride = 1;
+    volatile u64* seen = NULL;
+    switch (event_type) {
+        case BCI_CPU:
+            event_mask = EM_CPU;
+            stride = _subscription->cpu_stride;
+            seen = &_cpu_seen;
+            break;
+        case BCI_WALL:
+            event_mask = EM_WALL;
+            stride = _subscription->wall_stride;
+            seen = &_wall_seen;
+            break;
+        case BCI_ALLOC:
+            event_mask = EM_ALLOC;
+            stride = _subscription->alloc_stride;
+            seen = &_alloc_seen;
+            break;
+        case BCI_LIVENESS:
+        case BCI_ALLOC_SUMMARY:
+        case BCI_LIVENESS_SUMMARY:
+            event_mask = EM_ALLOC;
+            break;
+        case BCI_NATIVE_MALLOC:
+        case BCI_NATIVE_LIVE:
+            event_mask = EM_NATIVEMEM;
+            break;
+        case BCI_LOCK:
+        case BCI_PARK:
+            event_mask = EM_LOCK;
+            break;
+        default:
+            return false;
+    }
+    if (_expired || (_subscription->event_mask & event_mask) == 0) {
+        return false;
+    }
+    return stride <= 1 || __sync_fetch_and_add(seen, 1) % stride == 0;
+}
+
+void Recording::writeCpuInterval(long cpu_interval) {
+    // samples before and after this event are weighted with different intervals
+    char value[32];
+    snprintf(value, sizeof(value), "%ld", cpu_interval);
+    flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT - 64);
+    writeDatadogSetting(&_cpu_monitor_buf, 64, "cpuInterval", value, "ns", TSC::ticks());
+    flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+}
+
+// Copies the options changed by a reconfigure command
+static void applyTuning(Arguments& target, Arguments& tuned) {
+    if (tuned.isTuned(TUNE_CPU_INTERVAL)) {
+        target._cpu = tuned._cpu;
+        if (target._event != NULL) {
+            target._interval = tuned._cpu;
+        }
+    }
+    if (tuned.isTuned(TUNE_WALL_INTERVAL)) {
+        target._wall = tuned._wall;
+    }
+    if (tuned.isTuned(TUNE_WALL_THREADS)) {
+        target._wall_threads_per_tick = tuned._wall_threads_per_tick;
+    }
+    if (tuned.isTuned(TUNE_ALLOC_INTERVAL)) {
+        target._memory = tuned._memory;
+    }
+    if (tuned.isTuned(TUNE_STACK_DEPTH)) {
+        target._jstackdepth = tuned._jstackdepth;
+    }
+}
+
+void Recording::writeReconfiguration(Arguments& args, long cpu_interval) {
+    // the next chunks list the new values with the other settings
+    applyTuning(_args, args);
+    if (args.isTuned(TUNE_CPU_INTERVAL)) {
+        writeCpuInterval(cpu_interval);
+    }
+    u64 ticks = TSC::ticks();
+    char value[32];
+    flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT - 4 * 64);
+    if (args.isTuned(TUNE_WALL_INTERVAL)) {
+        snprintf(value, sizeof(value), "%ld", args._wall);
+        writeDatadogSetting(&_cpu_monitor_buf, 64, "wallInterval", value, "ns", ticks);
+    }
+    if (args.isTuned(TUNE_WALL_THREADS)) {
+        snprintf(value, sizeof(value), "%d", args._wall_threads_per_tick);
+        writeDatadogSetting(&_cpu_monitor_buf, 64, "wallThreadsPerTick", value, "threads", ticks);
+    }
+    if (args.isTuned(TUNE_ALLOC_INTERVAL)) {
+        snprintf(value, sizeof(value), "%ld", args._memory);
+        writeDatadogSetting(&_cpu_monitor_buf, 64, "allocationInterval", value, "bytes", ticks);
+    }
+    if (args.isTuned(TUNE_STACK_DEPTH)) {
+        snprintf(value, sizeof(value), "%d", args._jstackdepth);
+        writeDatadogSetting(&_cpu_monitor_buf, 64, "jstackdepth", value, "frames", ticks);
+    }
+    flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+}
+
+void Recording::signalLatencyCycle() {
+    SignalLatencySummary summary;
+    for (int i = 0; i < SIGNAL_ENGINES; i++) {
+        if (SignalLatency::drain((SignalEngine)i, &summary)) {
+            recordSignalLatency(&_cpu_monitor_buf, (SignalEngine)i, &summary);
+            flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+        }
+    }
+}
+
+void Recording::writeFullBuffers() {
+    struct iovec iov[CONCURRENCY_LEVEL];
+    int stripes[CONCURRENCY_LEVEL];
+    int count = 0;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        RecordingBuffer* buf = __atomic_load_n(&_full_buf[i], __ATOMIC_ACQUIRE);
+        if (buf != NULL) {
+            iov[count].iov_base = (void*)buf->data();
+            iov[count].iov_len = buf->offset();
+            stripes[count++] = i;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    ssize_t result;
+    if (_mapped != NULL) {
+        _mapped_lock.lock();
+        result = _mapped->writev(iov, count);
+        _mapped_lock.unlock();
+    } else {
+        result = writev(_fd, iov, count);
+    }
+    if (result > 0) {
+        atomicInc(_bytes_written, result);
+    }
+    for (int i = 0; i < count; i++) {
+        _full_buf[stripes[i]]->reset();
+        // the buffer may be reused by the sampler only after it has been reset
+        __atomic_store_n(&_full_buf[stripes[i]], (RecordingBuffer*)NULL, __ATOMIC_RELEASE);
+    }
+}
+
 void Recording::copyTo(int target_fd) {
-    OS::copyFile(_fd, target_fd, 0, finishChunk(true));
+    exportChunk(target_fd, finishChunk(true));
+}
+
+void Recording::exportChunk(int target_fd, size_t size) {
+    if (_mapped != NULL) {
+        // the ring lists the retained chunks in recording order; the mapping is coherent with the file
+        for (size_t i = 0; i < _mapped->chunkCount(); i++) {
+            exportRange(target_fd, _mapped->chunkStart(i), _mapped->chunkSize(i));
+        }
+    } else {
+        exportRange(target_fd, 0, size);
+    }
+}
+
+void Recording::exportRange(int target_fd, off_t offset, size_t size) {
+    if (_args.hasOption(COMPRESS_LZ4)) {
+        // the working file stays uncompressed so that the chunk headers can still be patched in place
+        Lz4Writer writer(target_fd);
+        if (!writer.compress(_fd, offset, size)) {
+            Log::warn("Failed to write compressed JFR chunk: %s", strerror(errno));
+        }
+    } else {
+        OS::copyFile(_fd, target_fd, offset, size);
+    }
+}
+
+off_t Recording::chunkOffset() {
+    return _mapped != NULL ? _mapped->chunkOffset() : lseek(_fd, 0, SEEK_CUR) - _chunk_start;
+}
+
+void Recording::patchChunk(const void* data, size_t size, off_t chunk_offset) {
+    if (_mapped != NULL) {
+        _mapped->patch(data, size, chunk_offset);
+    } else {
+        ssize_t result = pwrite(_fd, data, size, _chunk_start + chunk_offset);
+        (void)result;
+    }
 }
 
 off_t Recording::finishChunk() {
@@ -337,42 +937,102 @@ off_t Recording::finishChunk() {
 }
 
 off_t Recording::finishChunk(bool end_recording) {
-    jvmtiEnv* jvmti = VM::jvmti();
-    JNIEnv* env = VM::jni();
+    off_t chunk_end = sealChunk(end_recording);
+    resumeChunk();
+    return chunk_end;
+}
+
+void Recording::holdWriter() {
+    // keep the writer thread off the file until the chunk is complete - it must not write into the constant pool
+    _writer_lock.lock();
+    writeFullBuffers();
+    _writer_held = true;
+}
+
+void Recording::retireChunk(bool retired_traces) {
+    // handed off since the writer was held
+    writeFullBuffers();
+    // their call traces are in the constant pool of this chunk
+    flushCoalescedSamples();
+    flushContextAggregates();
+    flushOffCpuAggregates();
+
+    // every chunk must be readable on its own
+    memset(_last_context, 0, sizeof(_last_context));
+
+    addThread(_tid);
+    _retired_threads.clear();
+    _retired_threads.reserve(_thread_set.size());
+    _thread_set.collect(_retired_threads);
+    _thread_set.clear();
+    if (_subscription == NULL) {
+        _class_generation = Profiler::instance()->classMarks()->advance();
+    }
+    if (_pprof != NULL) {
+        _pprof->retire();
+    }
+    _retired_traces = retired_traces;
+
+    _stop_time = OS::micros();
+    _stop_ticks = TSC::ticks();
+
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        // the full buffers were written out above, so the other buffer of the stripe is empty
+        _retired_buf[i] = _active_buf[i];
+        _active_buf[i] = _active_buf[i] == &_buf[i] ? &_spare_buf[i] : &_buf[i];
+    }
+    __atomic_store_n(&_sealing, true, __ATOMIC_RELEASE);
+}
 
-    jclass* classes;
-    jint count = 0;
-    // obtaining the class list will create local refs to all loaded classes, effectively preventing them from being unloaded while flushing
-    jvmtiError err = jvmti->GetLoadedClasses(&count, &classes);
+off_t Recording::sealChunk(bool end_recording) {
+    LoadedClassesPin pin(VM::isOpenJ9());
+
+    if (!_writer_held) {
+        // the writer thread is gone, or the chunk is finished with all the locks held
+        holdWriter();
+    }
+    if (!_sealing) {
+        retireChunk(false);
+    }
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        flush(_retired_buf[i]);
+        // the samplers of the stripe may now hand off the other buffer, to be written after the next header
+        __atomic_store_n(&_retired_buf[i], (RecordingBuffer*)NULL, __ATOMIC_RELEASE);
+    }
+    RecordingBuffer* buf = &_chunk_buf;
 
     flush(&_cpu_monitor_buf);
 
-    writeNativeLibraries(_buf);
+    writeNativeLibraries(buf);
 
     const ObjectSampler* oSampler = ObjectSampler::instance();
     // write the engine dependent setting
     if (oSampler->_record_allocations) {
-        writeIntSetting(_buf, T_ALLOC, "interval", oSampler->_interval);
+        writeIntSetting(buf, T_ALLOC, "interval", oSampler->_interval);
     }
     if (oSampler->_record_liveness) {
-        writeIntSetting(_buf, T_HEAP_LIVE_OBJECT, "interval", oSampler->_interval);
-        writeIntSetting(_buf, T_HEAP_LIVE_OBJECT, "capacity", LivenessTracker::instance()->_table_cap);
-        writeIntSetting(_buf, T_HEAP_LIVE_OBJECT, "maximum capacity", LivenessTracker::instance()->_table_max_cap);
-    }
-    writeDatadogProfilerConfig(_buf,
-                                Profiler::instance()->cpuEngine()->interval() / 1000000,
-                                Profiler::instance()->wallEngine()->interval() / 1000000,
-                                oSampler->_record_allocations ? oSampler->_interval : 0L,
+        writeIntSetting(buf, T_HEAP_LIVE_OBJECT, "interval", oSampler->_interval);
+        writeIntSetting(buf, T_HEAP_LIVE_OBJECT, "capacity", LivenessTracker::instance()->_table_cap);
+        writeIntSetting(buf, T_HEAP_LIVE_OBJECT, "maximum capacity", LivenessTracker::instance()->_table_max_cap);
+        char rate[32];
+        snprintf(rate, sizeof(rate), "%.6f", LivenessTracker::instance()->_retention_rate);
+        writeStringSetting(buf, T_HEAP_LIVE_OBJECT, "retention rate", rate);
+    }
+    // a subscriber gets its samples at the intervals of the engines times its strides
+    long cpu_stride = _subscription != NULL ? _subscription->cpu_stride : 1;
+    long wall_stride = _subscription != NULL ? _subscription->wall_stride : 1;
+    long alloc_stride = _subscription != NULL ? _subscription->alloc_stride : 1;
+    writeDatadogProfilerConfig(buf,
+                                Profiler::instance()->cpuEngine()->interval() * cpu_stride / 1000000,
+                                Profiler::instance()->wallEngine()->interval() * wall_stride / 1000000,
+                                oSampler->_record_allocations ? oSampler->_interval * alloc_stride : 0L,
                                 oSampler->_record_liveness ? oSampler->_interval : 0L,
                                 oSampler->_record_liveness ? LivenessTracker::instance()->_table_cap : 0L,
-                                Profiler::instance()->eventMask(),
+                                _subscription != NULL ? _subscription->event_mask : Profiler::instance()->eventMask(),
                                 Profiler::instance()->cpuEngine()->name());
 
-    _stop_time = OS::micros();
-    _stop_ticks = TSC::ticks();
-
     if (end_recording) {
-        writeRecordingInfo(_buf);
+        writeRecordingInfo(buf);
     }
 
     // this will not report correct counts for any counters updated during writing the constant pool
@@ -381,24 +1041,32 @@ off_t Recording::finishChunk(bool end_recording) {
     // dictionaries) will be reported as positive, others (e.g. the classes dictionary) will reflect the
     // previous serialization. That is, some level of familiarity with the code base will be required to
     // use this diagnostic information for now.
-    writeCounters(_buf);
-
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-        flush(&_buf[i]);
+    // Likewise the serialization phases of the overhead event are those of the previous chunk.
+    writeCounters(buf);
+    if (_self_overhead) {
+        writeProfilerOverhead(buf);
+    }
+    if (_subscription == NULL) {
+        // draining the losses is left to the continuous recording
+        writeSampleLoss(buf);
+    }
+    flush(buf);
+
+    // offsets are relative to the chunk start, which moves when the mapped ring wraps around
+    off_t cpool_offset = chunkOffset();
+    {
+        DurationTimer timer(CPOOL_WRITE_LT_1US);
+        writeCpool(buf);
+        flush(buf);
     }
 
-    off_t cpool_offset = lseek(_fd, 0, SEEK_CUR);
-    writeCpool(_buf);
-    flush(_buf);
-
-    off_t cpool_end = lseek(_fd, 0, SEEK_CUR);
+    off_t cpool_end = chunkOffset();
 
     // Patch cpool size field
-    _buf->putVar32(0, cpool_end - cpool_offset);
-    ssize_t result = pwrite(_fd, _buf->data(), 5, cpool_offset);
-    (void)result;
+    buf->putVar32(0, cpool_end - cpool_offset);
+    patchChunk(buf->data(), 5, cpool_offset);
 
-    off_t chunk_end = lseek(_fd, 0, SEEK_CUR);
+    off_t chunk_size = chunkOffset();
 
     // // Workaround for JDK-8191415: compute actual TSC frequency, in case JFR is wrong
     u64 tsc_frequency = TSC::frequency();
@@ -407,68 +1075,105 @@ off_t Recording::finishChunk(bool end_recording) {
     // }
 
     // Patch chunk header
-    _buf->put64(chunk_end - _chunk_start);
-    _buf->put64(cpool_offset - _chunk_start);
-    _buf->put64(68);
-    _buf->put64(_start_time * 1000);
-    _buf->put64((_stop_time - _start_time) * 1000);
-    _buf->put64(_start_ticks);
-    _buf->put64(tsc_frequency);
-    result = pwrite(_fd, _buf->data(), 56, _chunk_start + 8);
-    (void)result;
+    buf->put64(chunk_size);
+    buf->put64(cpool_offset);
+    buf->put64(68);
+    buf->put64(_start_time * 1000);
+    buf->put64((_stop_time - _start_time) * 1000);
+    buf->put64(_start_ticks);
+    buf->put64(tsc_frequency);
+    patchChunk(buf->data(), 56, 8);
+
+    if (_mapped != NULL) {
+        // nothing is listed for a chunk the ring had no room for, which leaves nothing to publish
+        if (_mapped->finishChunk() && _shm_ring != NULL && _mapped->chunkCount() > 0) {
+            size_t last = _mapped->chunkCount() - 1;
+            _shm_ring->publish(SHM_RECORD_JFR_CHUNK, _fd, _mapped->chunkStart(last), _mapped->chunkSize(last));
+        }
+    } else {
+        // copied out before the pages are dropped from the cache
+        if (_shm_ring != NULL) {
+            _shm_ring->publish(SHM_RECORD_JFR_CHUNK, _fd, _chunk_start, chunk_size);
+        }
+        OS::freePageCache(_fd, _chunk_start);
+    }
 
-    OS::freePageCache(_fd, _chunk_start);
+    buf->reset();
 
-    _buf->reset();
+    return _chunk_start + chunk_size;
+}
 
-     if (!err) {
-        // delete all local references
-        for (int i = 0; i < count; i++) {
-            env->DeleteLocalRef((jobject)classes[i]);
-        }
-        // deallocate the class array
-        jvmti->Deallocate((unsigned char*)classes);
-    }
-    return chunk_end;
+void Recording::resumeChunk() {
+    writeFullBuffers();
+    __atomic_store_n(&_sealing, false, __ATOMIC_RELEASE);
+    _writer_held = false;
+    _writer_lock.unlock();
 }
 
 void Recording::switchChunk(int fd) {
-    _chunk_start = finishChunk(fd > -1);
+    _chunk_start = sealChunk(fd > -1);
     _start_time = _stop_time;
     _start_ticks = _stop_ticks;
     _bytes_written = 0;
+    _rotation_requested = false;
     if (fd > -1) {
         // move the chunk to external file and reset the continuous recording file
-        OS::copyFile(_fd, fd, 0, _chunk_start);
-        OS::truncateFile(_fd);
+        exportChunk(fd, _chunk_start);
+        if (_mapped != NULL) {
+            _mapped->reset();
+        } else {
+            OS::truncateFile(_fd);
+        }
         // need to reset the file offset here
         _chunk_start = 0;
         _base_id = 0;
+        // the new file starts with full constant pools
+        resetWrittenConstants();
     } else {
         // same file, different logical chunk
         _base_id += 0x1000000;
     }
 
-    writeHeader(_buf);
-    writeMetadata(_buf);
+    // the events recorded while sealing are handed off or in the active buffers, to be written after the new header
+    RecordingBuffer* buf = &_chunk_buf;
+    writeHeader(buf);
+    writeMetadata(buf);
     if (fd > -1) {
         // if the recording file is to be restarted write out all the info events again
-        writeSettings(_buf, _args);
+        writeSettings(buf, _args);
         if (!_args.hasOption(NO_SYSTEM_INFO)) {
-            writeOsCpuInfo(_buf);
-            writeJvmInfo(_buf);
+            writeOsCpuInfo(buf);
+            writeJvmInfo(buf);
         }
         if (!_args.hasOption(NO_SYSTEM_PROPS)) {
-            writeSystemProperties(_buf);
+            writeSystemProperties(buf);
         }
         if (!_args.hasOption(NO_NATIVE_LIBS)) {
             _recorded_lib_count = 0;
-            writeNativeLibraries(_buf);
+            writeNativeLibraries(buf);
         } else {
             _recorded_lib_count = -1;
         }
     }
-    flush(_buf);
+    flush(buf);
+    resumeChunk();
+}
+
+void Recording::resetSymbols() {
+    // the methods resolved so far look up their symbols again when next written
+    _symbols.clear();
+    _packages.clear();
+    _symbol_marks.clear();
+    _package_marks.clear();
+    _class_packages.clear();
+}
+
+void Recording::resetWrittenConstants() {
+    _file_epoch++;
+    _written_traces.clear();
+    _written_classes.clear();
+    _written_strings.clear();
+    _written_attribute_values.clear();
 }
 
 void Recording::cpuMonitorCycle() {
@@ -513,18 +1218,47 @@ void Recording::appendRecording(const char* target_file, size_t size) {
 }
 
 RecordingBuffer* Recording::buffer(int lock_index) {
-    return &_buf[lock_index];
+    return _active_buf[lock_index];
 }
 
-bool Recording::parseAgentProperties() {
-    JNIEnv* env = VM::jni();
-    jclass vm_support = env->FindClass("jdk/internal/vm/VMSupport");
-    if (vm_support == NULL) {
-        env->ExceptionClear();
-        vm_support = env->FindClass("sun/misc/VMSupport");
+void Recording::handoffIfNeeded(int lock_index) {
+    RecordingBuffer* buf = _active_buf[lock_index];
+    if (buf->offset() < JFR_EVENT_HANDOFF_THRESHOLD) {
+        return;
     }
-    if (vm_support != NULL) {
-        jmethodID get_agent_props = env->GetStaticMethodID(vm_support, "getAgentProperties", "()Ljava/util/Properties;");
+    if (_sealing) {
+        // the events must follow the header of the next chunk, so the buffer is kept for resumeChunk(),
+        // once the other buffer of the stripe has been written out by the dump; until then it fills up
+        if (__atomic_load_n(&_retired_buf[lock_index], __ATOMIC_ACQUIRE) == NULL &&
+            __atomic_load_n(&_full_buf[lock_index], __ATOMIC_ACQUIRE) == NULL) {
+            _active_buf[lock_index] = buf == &_buf[lock_index] ? &_spare_buf[lock_index] : &_buf[lock_index];
+            __atomic_store_n(&_full_buf[lock_index], buf, __ATOMIC_RELEASE);
+        }
+        return;
+    }
+    if (_writer_running && __atomic_load_n(&_full_buf[lock_index], __ATOMIC_ACQUIRE) == NULL) {
+        // the other buffer of the stripe has been written out already
+        _active_buf[lock_index] = buf == &_buf[lock_index] ? &_spare_buf[lock_index] : &_buf[lock_index];
+        __atomic_store_n(&_full_buf[lock_index], buf, __ATOMIC_RELEASE);
+    } else if (_mapped != NULL && _writer_running) {
+        // the buffer is appended to the ring once it reaches the flush threshold, or handed off before
+        return;
+    } else {
+        // the writer has not caught up yet
+        Counters::increment(JFR_BUFFER_SYNC_FLUSHES);
+        flush(buf);
+    }
+}
+
+bool Recording::parseAgentProperties() {
+    JNIEnv* env = VM::jni();
+    jclass vm_support = env->FindClass("jdk/internal/vm/VMSupport");
+    if (vm_support == NULL) {
+        env->ExceptionClear();
+        vm_support = env->FindClass("sun/misc/VMSupport");
+    }
+    if (vm_support != NULL) {
+        jmethodID get_agent_props = env->GetStaticMethodID(vm_support, "getAgentProperties", "()Ljava/util/Properties;");
         jmethodID to_string = env->GetMethodID(env->FindClass("java/lang/Object"), "toString", "()Ljava/lang/String;");
         if (get_agent_props != NULL && to_string != NULL) {
             jobject props = env->CallStaticObjectMethod(vm_support, get_agent_props);
@@ -567,17 +1301,63 @@ bool Recording::parseAgentProperties() {
     return true;
 }
 
-void Recording::flush(Buffer* buf) {
-    ssize_t result = write(_fd, buf->data(), buf->offset());
+bool Recording::isActive(const Buffer* buf) {
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        if (buf == _active_buf[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Recording::flush(Buffer* buf, int headroom) {
+    if (_sealing && isActive(buf)) {
+        // the events would precede the header of their chunk; both buffers of the stripe filled up while sealing
+        Counters::increment(JFR_SEALING_DISCARDED_BYTES, buf->offset());
+        buf->reset();
+        return;
+    }
+    if (_mapped != NULL && isActive(buf)) {
+        // written by a sampler, possibly in a signal handler; the writer thread makes room in the ring
+        ssize_t result = -1;
+        if (_mapped_lock.tryLock()) {
+            result = _mapped->append(buf->data(), buf->offset());
+            _mapped_lock.unlock();
+        }
+        if (result > 0) {
+            atomicInc(_bytes_written, result);
+        } else if (buf->offset() + headroom <= buf->limit()) {
+            // kept until handoffIfNeeded() passes it to the writer thread, which makes room in the ring
+            return;
+        } else {
+            // the buffer holds complete events, so it can be dropped as a whole
+            Counters::increment(JFR_MAPPED_BYTES_DROPPED, buf->offset());
+        }
+        buf->reset();
+        return;
+    }
+    flush(buf->data(), buf->offset());
+    buf->reset();
+}
+
+void Recording::flush(const char* data, size_t size) {
+    ssize_t result;
+    if (_mapped != NULL) {
+        _mapped_lock.lock();
+        result = _mapped->write(data, size);
+        _mapped_lock.unlock();
+    } else {
+        result = write(_fd, data, size);
+    }
     if (result > 0) {
         atomicInc(_bytes_written, result);
     }
-    buf->reset();
 }
 
 void Recording::flushIfNeeded(Buffer* buf, int limit) {
     if (buf->offset() >= limit) {
-        flush(buf);
+        // the limit leaves room for the next event below the flush threshold
+        flush(buf, JFR_EVENT_FLUSH_THRESHOLD - limit + MAX_JFR_EVENT_SIZE);
     }
 }
 
@@ -687,6 +1467,12 @@ void Recording::writeSettings(Buffer* buf, Arguments& args) {
 
     writeBoolSetting(buf, T_ALLOC, "enabled", args._record_allocations);
     writeBoolSetting(buf, T_HEAP_LIVE_OBJECT, "enabled", args._record_liveness);
+    writeBoolSetting(buf, T_MONITOR_ENTER, "enabled", args._lock >= 0);
+    writeBoolSetting(buf, T_THREAD_PARK, "enabled", args._lock >= 0);
+    if (args._lock >= 0) {
+        writeIntSetting(buf, T_MONITOR_ENTER, "interval", args._lock);
+        writeIntSetting(buf, T_THREAD_PARK, "interval", args._lock);
+    }
 
     writeBoolSetting(buf, T_ACTIVE_RECORDING, "debugSymbols", VMStructs::hasDebugSymbols());
     writeBoolSetting(buf, T_ACTIVE_RECORDING, "kernelSymbols", Symbols::haveKernelSymbols());
@@ -729,10 +1515,14 @@ void Recording::writeListSetting(Buffer* buf, int category, const char* key, con
 }
 
 void Recording::writeDatadogSetting(Buffer* buf, int length, const char* name, const char* value, const char* unit) {
+    writeDatadogSetting(buf, length, name, value, unit, _start_ticks);
+}
+
+void Recording::writeDatadogSetting(Buffer* buf, int length, const char* name, const char* value, const char* unit, u64 start_time) {
     flushIfNeeded(buf, RECORDING_BUFFER_LIMIT - length);
     int start = buf->skip(MAX_VAR32_LENGTH);
     buf->putVar64(T_DATADOG_SETTING);
-    buf->putVar64(_start_ticks);
+    buf->putVar64(start_time);
     buf->put8(0); // no duration, but required for compatibility with equivalent Java event
     buf->putVar32(_tid);
     buf->put8(0); // no stacktrace, but required for compatibility with equivalent Java event
@@ -875,19 +1665,25 @@ void Recording::writeNativeLibraries(Buffer* buf) {
     CodeCacheArray& native_libs = profiler->_native_libs;
     int native_lib_count = native_libs.count();
 
-    for (int i = _recorded_lib_count; i < native_lib_count; i++) {
+    int i = _recorded_lib_count;
+    for (; i < native_lib_count; i++) {
+        CodeCache* lib = native_libs[i];
+        if (lib == NULL) {
+            // Symbols are still being loaded; the rest is recorded with the next chunk
+            break;
+        }
         flushIfNeeded(buf, RECORDING_BUFFER_LIMIT - MAX_STRING_LENGTH);
         int start = buf->skip(5);
         buf->putVar64(T_NATIVE_LIBRARY);
         buf->putVar64(_start_ticks);
-        buf->putUtf8(native_libs[i]->name());
-        buf->putVar64((uintptr_t) native_libs[i]->minAddress());
-        buf->putVar64((uintptr_t) native_libs[i]->maxAddress());
+        buf->putUtf8(lib->name());
+        buf->putVar64((uintptr_t) lib->minAddress());
+        buf->putVar64((uintptr_t) lib->maxAddress());
         buf->putVar32(start, buf->offset() - start);
         flushIfNeeded(buf);
     }
 
-    _recorded_lib_count = native_lib_count;
+    _recorded_lib_count = i;
 }
 
 void Recording::writeCpool(Buffer* buf) {
@@ -901,20 +1697,50 @@ void Recording::writeCpool(Buffer* buf) {
     buf->put8(12);
 
     // Profiler::instance()->classMap() provides access to non-locked _class_map instance
-    // The non-locked access is ok here as this code will never run concurrently to _class_map.clear()
+    // The non-locked access is ok here as this code will never run concurrently to Profiler::resetClassMap()
+    u32 class_map_epoch = Profiler::instance()->classMapEpoch();
+    if (class_map_epoch != _class_map_epoch) {
+        _class_packages.clear();
+        if (_incremental_cpool) {
+            // the ids already written to this file may name other classes now
+            resetWrittenConstants();
+        }
+    }
+    _class_map_epoch = class_map_epoch;
+    if (_symbols.size() > MAX_SYMBOLS_SIZE || _packages.size() > MAX_SYMBOLS_SIZE) {
+        resetSymbols();
+    }
     Lookup lookup(this, &_method_map, Profiler::instance()->classMap());
+    u64 cpool_start = OS::cputime();
     writeFrameTypes(buf);
     writeThreadStates(buf);
     writeExecutionModes(buf);
+    u64 phase_start = OS::cputime();
     writeThreads(buf);
+    u64 phase_end = OS::cputime();
+    _overhead.cpool[CPOOL_THREADS] += phase_end - phase_start;
     writeStackTraces(buf, &lookup);
+    phase_start = phase_end;
+    phase_end = OS::cputime();
+    _overhead.cpool[CPOOL_STACK_TRACES] += phase_end - phase_start;
     writeMethods(buf, &lookup);
+    phase_start = phase_end;
+    phase_end = OS::cputime();
+    _overhead.cpool[CPOOL_METHODS] += phase_end - phase_start;
     writeClasses(buf, &lookup);
     writePackages(buf, &lookup);
-    writeConstantPoolSection(buf, T_SYMBOL, &lookup._symbols);
-    writeConstantPoolSection(buf, T_STRING, Profiler::instance()->stringLabelMap());
-    writeConstantPoolSection(buf, T_ATTRIBUTE_VALUE, Profiler::instance()->contextValueMap());
+    phase_start = phase_end;
+    phase_end = OS::cputime();
+    _overhead.cpool[CPOOL_CLASSES] += phase_end - phase_start;
+    std::map<u32, const char*> symbols;
+    _symbol_marks.collect(&_symbols, symbols);
+    writeConstantPoolSection(buf, T_SYMBOL, symbols);
+    writeConstantPoolSection(buf, T_STRING, Profiler::instance()->stringLabelMap(),
+                             _incremental_cpool ? &_written_strings : NULL);
+    writeConstantPoolSection(buf, T_ATTRIBUTE_VALUE, Profiler::instance()->contextValueMap(),
+                             _incremental_cpool ? &_written_attribute_values : NULL);
     writeLogLevels(buf);
+    _overhead.cpool[CPOOL_TOTAL] += OS::cputime() - cpool_start;
     flushIfNeeded(buf);
 }
 
@@ -976,28 +1802,18 @@ void Recording::writeExecutionModes(Buffer* buf) {
 }
 
 void Recording::writeThreads(Buffer* buf) {
-    addThread(_tid);
-    std::vector<int> threads;
-    threads.reserve(_thread_set.size());
-    _thread_set.collect(threads);
-    _thread_set.clear();
+    // collected when the chunk was retired
+    std::vector<int>& threads = _retired_threads;
 
-    Profiler* profiler = Profiler::instance();
-    MutexLocker ml(profiler->_thread_names_lock);
-    std::map<int, std::string>& thread_names = profiler->_thread_names;
-    std::map<int, jlong>& thread_ids = profiler->_thread_ids;
+    ThreadTable& thread_table = Profiler::instance()->_thread_table;
     char name_buf[32];
 
     buf->putVar64(T_THREAD);
     buf->putVar64(threads.size());
     for (int i = 0; i < threads.size(); i++) {
-        const char* thread_name;
-        jlong thread_id;
-        std::map<int, std::string>::const_iterator it = thread_names.find(threads[i]);
-        if (it != thread_names.end()) {
-            thread_name = it->second.c_str();
-            thread_id = thread_ids[threads[i]];
-        } else {
+        jlong thread_id = 0;
+        const char* thread_name = thread_table.name(threads[i], &thread_id);
+        if (thread_name == NULL) {
             snprintf(name_buf, sizeof(name_buf), "[tid=%d]", threads[i]);
             thread_name = name_buf;
             thread_id = 0;
@@ -1021,76 +1837,117 @@ void Recording::writeThreads(Buffer* buf) {
     }
 }
 
+// Writes the stack trace pool straight to the chunk of the recording
+class RecordingStackTraceWriter : public StackTraceWriter {
+  private:
+    Recording* _rec;
+
+  protected:
+    void flush(Buffer* buf) {
+        _rec->flush(buf);
+    }
+
+    void flush(const char* data, size_t size) {
+        _rec->flush(data, size);
+    }
+
+  public:
+    RecordingStackTraceWriter(Recording* rec) : _rec(rec) {}
+};
+
 void Recording::writeStackTraces(Buffer* buf, Lookup* lookup) {
     std::map<u32, CallTrace*> traces;
-    Profiler::instance()->collectCallTraces(traces);
+    Profiler::instance()->collectCallTraces(traces, _retired_traces);
+    if (!_capture.empty()) {
+        SampleCapture::capture(_capture.c_str(), traces, _args._context_attributes, Profiler::instance()->contextValueMap());
+    }
+    if (_pprof != NULL) {
+        // before the traces already written to the file are dropped below
+        Error error = _pprof->write(traces, _start_time, _stop_time);
+        if (error) {
+            Log::warn("%s", error.message());
+        }
+    }
 
-    buf->putVar64(T_STACK_TRACE);
-    buf->putVar64(traces.size());
-    for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
-        CallTrace* trace = it->second;
-        buf->putVar64(it->first);
-        if (trace->num_frames > 0) {
-            MethodInfo* mi = lookup->resolveMethod(trace->frames[trace->num_frames - 1]);
-            if (mi->_type < FRAME_NATIVE) {
-                buf->put8(mi->_is_entry ? 0 : 1);
+    if (_incremental_cpool) {
+        for (std::map<u32, CallTrace*>::iterator it = traces.begin(); it != traces.end();) {
+            if (!_written_traces.insert(it->first).second) {
+                it = traces.erase(it);
             } else {
-                buf->put8(trace->truncated);
+                ++it;
             }
         }
-        buf->putVar64(trace->num_frames);
-        for (int i = 0; i < trace->num_frames; i++) {
-            MethodInfo* mi = lookup->resolveMethod(trace->frames[i]);
-            buf->putVar64(mi->_key);
-            jint bci = trace->frames[i].bci;
-            if (mi->_type < FRAME_NATIVE) {
-                FrameTypeId type = FrameType::decode(bci);
-                bci = (bci & 0x10000) ? 0 : (bci & 0xffff);
-                buf->putVar32(mi->getLineNumber(bci));
-                buf->putVar32(bci);
-                buf->put8(type);
-            } else {
-                buf->putVar32(0);
-                buf->putVar32(bci);
-                buf->put8(mi->_type);
-            }
-            flushIfNeeded(buf);
+    }
+
+    lookup->resolveNativePCs(traces);
+
+    // Method resolution goes through JVMTI and the method map, which only this thread may touch;
+    // the frames are resolved up front so that the encoding can be split across workers
+    std::vector<std::pair<u32, CallTrace*> > entries(traces.begin(), traces.end());
+    std::vector<MethodInfo*> methods;
+    for (size_t i = 0; i < entries.size(); i++) {
+        CallTrace* trace = entries[i].second;
+        for (int j = 0; j < trace->num_frames; j++) {
+            methods.push_back(lookup->resolveMethod(trace->frames[j]));
         }
-        flushIfNeeded(buf);
     }
+
+    buf->putVar64(T_STACK_TRACE);
+    buf->putVar64(entries.size());
+
+    int workers = 1;
+    if (entries.size() >= PARALLEL_CPOOL_TRACES) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus < MAX_CPOOL_WORKERS ? (cpus > 1 ? (int)cpus : 1) : MAX_CPOOL_WORKERS;
+    }
+    RecordingStackTraceWriter writer(this);
+    // the CPU time of the workers is part of the stack trace phase of the cpool overhead
+    _overhead.cpool[CPOOL_STACK_TRACES] += writer.write(buf, entries, methods, workers);
+    Profiler::instance()->releaseCallTraces();
 }
 
 void Recording::writeMethods(Buffer* buf, Lookup* lookup) {
     MethodMap* method_map = lookup->_method_map;
-
-    u32 marked_count = 0;
-    for (MethodMap::const_iterator it = method_map->begin(); it != method_map->end(); ++it) {
-        if (it->second._mark) {
-            marked_count++;
-        }
-    }
+    const std::vector<MethodInfo*>& marked = method_map->marked();
+    DictionaryMarks* class_marks = Profiler::instance()->classMarks();
 
     buf->putVar64(T_METHOD);
-    buf->putVar64(marked_count);
-    for (MethodMap::iterator it = method_map->begin(); it != method_map->end(); ++it) {
-        MethodInfo& mi = it->second;
-        if (mi._mark) {
-            mi._mark = false;
-            buf->putVar64(mi._key);
-            buf->putVar64(mi._class);
-            buf->putVar64(mi._name | _base_id);
-            buf->putVar64(mi._sig | _base_id);
-            buf->putVar64(mi._modifiers);
-            buf->putVar64(mi.isHidden());
-            flushIfNeeded(buf);
-        }
+    buf->putVar64(marked.size());
+    for (size_t i = 0; i < marked.size(); i++) {
+        MethodInfo& mi = *marked[i];
+        mi._written_epoch = _file_epoch;
+        class_marks->reserve(mi._class);
+        class_marks->mark(mi._class);
+        buf->putVar64(mi._key);
+        buf->putVar64(mi._class);
+        buf->putVar64(mi._name | _base_id);
+        buf->putVar64(mi._sig | _base_id);
+        buf->putVar64(mi._modifiers);
+        buf->putVar64(mi.isHidden());
+        flushIfNeeded(buf);
     }
+    method_map->clearMarks();
 }
 
 void Recording::writeClasses(Buffer* buf, Lookup* lookup) {
     std::map<u32, const char*> classes;
-    // no need to lock _classes as this code will never run concurrently with resetting that dictionary
-    lookup->_classes->collect(classes);
+    // no need to lock _classes as this code will never run concurrently with resetting that dictionary;
+    // only the classes referenced by the methods and the events of this chunk are written. The marks
+    // follow the chunks of the continuous recording, so a subscriber writes all the classes.
+    if (_subscription == NULL) {
+        Profiler::instance()->classMarks()->collect(lookup->_classes, classes, _class_generation);
+    } else {
+        lookup->_classes->collect(classes);
+    }
+    if (_incremental_cpool) {
+        for (std::map<u32, const char*>::iterator it = classes.begin(); it != classes.end();) {
+            if (!_written_classes.insert(it->first).second) {
+                it = classes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
 
     buf->putVar64(T_CLASS);
     buf->putVar64(classes.size());
@@ -1099,7 +1956,7 @@ void Recording::writeClasses(Buffer* buf, Lookup* lookup) {
         buf->putVar64(it->first);
         buf->putVar64(0);  // classLoader
         buf->putVar64(lookup->getSymbol(name) | _base_id);
-        buf->putVar64(lookup->getPackage(name) | _base_id);
+        buf->putVar64(lookup->getPackage(it->first, name) | _base_id);
         buf->putVar64(0);  // access flags
         flushIfNeeded(buf);
     }
@@ -1107,7 +1964,7 @@ void Recording::writeClasses(Buffer* buf, Lookup* lookup) {
 
 void Recording::writePackages(Buffer* buf, Lookup* lookup) {
     std::map<u32, const char*> packages;
-    lookup->_packages.collect(packages);
+    _package_marks.collect(&_packages, packages);
 
     buf->putVar32(T_PACKAGE);
     buf->putVar32(packages.size());
@@ -1131,9 +1988,28 @@ void Recording::writeConstantPoolSection(Buffer* buf, JfrType type, std::map<u32
     }
 }
 
-void Recording::writeConstantPoolSection(Buffer* buf, JfrType type, Dictionary* dictionary) {
+void Recording::writeConstantPoolSection(Buffer* buf, JfrType type, Dictionary* dictionary, std::unordered_set<u32>* written) {
+    std::map<u32, const char*> constants;
+    dictionary->collect(constants);
+    writeConstantPoolSection(buf, type, constants, written);
+}
+
+void Recording::writeConstantPoolSection(Buffer* buf, JfrType type, BoundedDictionary* dictionary, std::unordered_set<u32>* written) {
     std::map<u32, const char*> constants;
     dictionary->collect(constants);
+    writeConstantPoolSection(buf, type, constants, written);
+}
+
+void Recording::writeConstantPoolSection(Buffer* buf, JfrType type, std::map<u32, const char*>& constants, std::unordered_set<u32>* written) {
+    if (written != NULL) {
+        for (std::map<u32, const char*>::iterator it = constants.begin(); it != constants.end();) {
+            if (!written->insert(it->first).second) {
+                it = constants.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
     writeConstantPoolSection(buf, type, constants);
 }
 
@@ -1148,26 +2024,74 @@ void Recording::writeLogLevels(Buffer* buf) {
 }
 
 void Recording::writeCounters(Buffer* buf) {
-    long long* counters = Counters::getCounters();
-    if (counters) {
+    std::vector<long long> values = Counters::values();
+    if (!values.empty()) {
         std::vector<const char*> names = Counters::describeCounters();
         for (int i = 0; i < names.size(); i++) {
             int start = buf->skip(1);
             buf->putVar64(T_DATADOG_COUNTER);
             buf->putUtf8(names[i]);
-            buf->putVar64(counters[Counters::address(i)]);
+            buf->putVar64(values[i]);
             writeEventSizePrefix(buf, start);
             flushIfNeeded(buf);
         }
     }
 }
 
-void Recording::writeContext(Buffer* buf, Context& context) {
-    buf->putVar64(context.spanId);
-    buf->putVar64(context.rootSpanId);
-    for (size_t i = 0; i < Profiler::instance()->numContextAttributes(); i++) {
-        Tag tag = context.get_tag(i);
-        buf->putVar32(tag.value);
+static u64 overheadDelta(u64 total, u64 last) {
+    // a restarted sampler thread starts over from zero
+    return total > last ? total - last : 0;
+}
+
+void Recording::writeProfilerOverhead(Buffer* buf) {
+    for (int i = 0; i < SIGNAL_ENGINES; i++) {
+        _overhead.handler[i] = SignalLatency::handlerNanos((SignalEngine)i);
+    }
+    Engine* wall_engine = Profiler::instance()->wallEngine();
+    _overhead.sampler = wall_engine != NULL ? wall_engine->samplerCpuTime() : 0;
+
+    int start = buf->skip(1);
+    buf->putVar64(T_PROFILER_OVERHEAD);
+    buf->putVar64(TSC::ticks());
+    for (int i = 0; i < SIGNAL_ENGINES; i++) {
+        buf->putVar64(overheadDelta(_overhead.handler[i], _last_overhead.handler[i]));
+    }
+    buf->putVar64(overheadDelta(_overhead.sampler, _last_overhead.sampler));
+    for (int i = 0; i < CPOOL_PHASES; i++) {
+        buf->putVar64(overheadDelta(_overhead.cpool[i], _last_overhead.cpool[i]));
+    }
+    buf->putVar64(MemoryGovernor::footprint());
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+
+    _last_overhead = _overhead;
+}
+
+void Recording::writeSampleLoss(Buffer* buf) {
+    int event_mask = Profiler::instance()->eventMask();
+    bool active[LOSS_ENGINES] = {
+        (event_mask & EM_CPU) != 0,
+        (event_mask & EM_WALL) != 0,
+        (event_mask & EM_ALLOC) != 0 && ObjectSampler::instance()->_record_allocations,
+        (event_mask & EM_ALLOC) != 0 && ObjectSampler::instance()->_record_liveness,
+        (event_mask & EM_NATIVEMEM) != 0,
+        false
+    };
+    // the engines in use report even without any loss, so that a chunk without the event is distinguishable
+    for (int i = 0; i < LOSS_ENGINES; i++) {
+        u64 lost[LOSS_REASONS];
+        if (!SampleLoss::drain((LossEngine)i, lost) && !active[i]) {
+            continue;
+        }
+        int start = buf->skip(1);
+        buf->putVar64(T_SAMPLE_LOSS);
+        buf->putVar64(TSC::ticks());
+        buf->putUtf8(SampleLoss::engineName((LossEngine)i));
+        for (int j = 0; j < LOSS_REASONS; j++) {
+            buf->putVar64(lost[j]);
+        }
+        writeEventSizePrefix(buf, start);
+        flushIfNeeded(buf);
     }
 }
 
@@ -1177,30 +2101,353 @@ void Recording::writeEventSizePrefix(Buffer* buf, int start) {
     buf->put8(start, size);
 }
 
+void Recording::writeContextIfChanged(Buffer* buf, int tid, u64 ticks) {
+    Context context = Contexts::get(tid);
+    // the context can only be changed by the thread itself, so it is stable while the thread is being sampled
+    u64 hash = (u64)tid * 0x9E3779B97F4A7C15ULL ^ context.spanId;
+    hash = (hash ^ (hash >> 29)) * 0xBF58476D1CE4E5B9ULL ^ context.rootSpanId;
+    for (size_t i = 0; i < Profiler::instance()->numContextAttributes(); i++) {
+        hash = (hash ^ (hash >> 32)) * 0x94D049BB133111EBULL ^ context.get_tag(i).value;
+    }
+    hash |= 1;
+
+    u64& last = _last_context[tid & (CONTEXT_CACHE_SIZE - 1)];
+    if (last == hash) {
+        return;
+    }
+    last = hash;
+
+    int start = buf->skip(1);
+    buf->putVar64(T_CONTEXT_CHANGE);
+    buf->putVar64(ticks);
+    buf->putVar64(tid);
+    writeContext(buf, context);
+    writeEventSizePrefix(buf, start);
+}
+
+void Recording::recordCompactSample(Buffer* buf, int type, int tid, u32 call_trace_id, ExecutionEvent* event) {
+    u64 ticks = TSC::ticks();
+    writeContextIfChanged(buf, tid, ticks);
+
+    u64 base = buf->baseTicks();
+    if (base == 0 || ticks < base || ticks - base > MAX_COMPACT_TICKS_DELTA) {
+        int start = buf->skip(1);
+        buf->putVar64(T_SAMPLE_TIME_BASE);
+        buf->putVar64(ticks);
+        writeEventSizePrefix(buf, start);
+        buf->setBaseTicks(ticks);
+        base = ticks;
+    }
+
+    int start = buf->skip(1);
+    buf->putVar64(type);
+    buf->putVar64(ticks - base);
+    buf->putVar64(tid);
+    buf->putVar64(call_trace_id);
+    buf->put8(static_cast<int>(event->_thread_state));
+    buf->put8(static_cast<int>(event->_execution_mode));
+    buf->putVar64(event->_weight);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordPprofSample(int lock_index, int tid, u32 call_trace_id, int event_type, Event* event) {
+    if (_pprof != NULL) {
+        _pprof->record(lock_index, tid, call_trace_id, event_type, event);
+    }
+}
+
 void Recording::recordExecutionSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
+    if (event->_has_pmu_counters) {
+        recordPmuSample(buf, tid, call_trace_id, event);
+    }
+    if (event->_has_mem_access) {
+        recordMemoryAccessSample(buf, tid, call_trace_id, event);
+    }
+    if (_compact_samples) {
+        recordCompactSample(buf, T_COMPACT_EXECUTION_SAMPLE, tid, call_trace_id, event);
+        return;
+    }
+    writeExecutionSample(buf, TSC::ticks(), tid, call_trace_id, event, Contexts::get(tid));
+}
+
+void Recording::writeExecutionSample(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, ExecutionEvent* event,
+                                     const Context& context) {
     int start = buf->skip(1);
     buf->putVar64(T_EXECUTION_SAMPLE);
-    buf->putVar64(TSC::ticks());
+    buf->putVar64(ticks);
     buf->putVar64(tid);
     buf->putVar64(call_trace_id);
     buf->put8(static_cast<int>(event->_thread_state));
     buf->put8(static_cast<int>(event->_execution_mode));
     buf->putVar64(event->_weight);
-    writeContext(buf, Contexts::get(tid));
+    writeContext(buf, context);
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
 }
 
+bool Recording::coalesceSample(int lock_index, int tid, u32 call_trace_id, int event_type, Event* event) {
+    if (_coalesced == NULL) {
+        return false;
+    }
+    ExecutionEvent* execution = (ExecutionEvent*)event;
+    AllocEvent* alloc = (AllocEvent*)event;
+    // the hardware counters and the sampled loads are only recorded along with their own sample
+    if (event_type == BCI_CPU && (execution->_has_pmu_counters || execution->_has_mem_access)) {
+        return false;
+    }
+
+    // the context can only be changed by the thread itself, and unset tags read as zero
+    Context context = Contexts::get(tid);
+    CoalescedSample* pending = &_coalesced[lock_index * COALESCE_SLOTS + (tid & (COALESCE_SLOTS - 1))];
+    if (pending->tid == tid && pending->event_type == event_type && pending->call_trace_id == call_trace_id
+            && memcmp(&pending->context, &context, sizeof(Context)) == 0) {
+        if (event_type == BCI_CPU) {
+            if (pending->thread_state == execution->_thread_state
+                    && pending->execution_mode == execution->_execution_mode) {
+                pending->samples += execution->_weight;
+                Counters::increment(COALESCED_SAMPLES);
+                return true;
+            }
+        } else if (pending->class_id == alloc->_id && pending->size == alloc->_size) {
+            pending->weight += alloc->_weight;
+            Counters::increment(COALESCED_SAMPLES);
+            return true;
+        }
+    }
+
+    if (pending->tid != 0) {
+        writeCoalescedSample(buffer(lock_index), pending);
+    }
+    pending->tid = tid;
+    pending->event_type = event_type;
+    pending->call_trace_id = call_trace_id;
+    pending->ticks = TSC::ticks();
+    pending->context = context;
+    if (event_type == BCI_CPU) {
+        pending->thread_state = execution->_thread_state;
+        pending->execution_mode = execution->_execution_mode;
+        pending->samples = execution->_weight;
+    } else {
+        pending->class_id = alloc->_id;
+        pending->size = alloc->_size;
+        pending->weight = alloc->_weight;
+    }
+    return true;
+}
+
+void Recording::writeCoalescedSample(Buffer* buf, const CoalescedSample* sample) {
+    if (sample->event_type == BCI_CPU) {
+        ExecutionEvent event;
+        event._thread_state = sample->thread_state;
+        event._execution_mode = sample->execution_mode;
+        event._weight = sample->samples;
+        writeExecutionSample(buf, sample->ticks, sample->tid, sample->call_trace_id, &event, sample->context);
+    } else {
+        AllocEvent event;
+        event._id = sample->class_id;
+        event._size = sample->size;
+        event._weight = (float)sample->weight;
+        writeAllocation(buf, sample->ticks, sample->tid, sample->call_trace_id, &event, sample->context);
+    }
+}
+
+void Recording::flushCoalescedSamples() {
+    if (_coalesced == NULL) {
+        return;
+    }
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int j = 0; j < COALESCE_SLOTS; j++) {
+            CoalescedSample* pending = &_coalesced[i * COALESCE_SLOTS + j];
+            if (pending->tid != 0) {
+                writeCoalescedSample(_active_buf[i], pending);
+                pending->tid = 0;
+            }
+        }
+    }
+}
+
+// Mixes the context and the thread state of a sample into the hash of the rest of its aggregation key
+static u64 hashContext(u64 h, const Context& context, const ExecutionEvent* event) {
+    h = (h ^ context.spanId ^ context.rootSpanId * 0x9e3779b97f4a7c15ULL) * 0xc6a4a7935bd1e995ULL;
+    for (u32 i = 0; i < DD_MAX_TAGS_CAPACITY; i++) {
+        h = (h ^ context.tags[i].value) * 0xc6a4a7935bd1e995ULL;
+    }
+    h = (h ^ ((u64)event->_thread_state << 8 | (u64)event->_execution_mode)) * 0xc6a4a7935bd1e995ULL;
+    return h ^ (h >> 47);
+}
+
+bool Recording::aggregateContextSample(int lock_index, int tid, u32 call_trace_id, int event_type, ExecutionEvent* event) {
+    if (_context_aggregates == NULL || call_trace_id != 0 || event->_has_pmu_counters || event->_has_mem_access) {
+        return false;
+    }
+
+    Context context = Contexts::get(tid);
+    context.version = 0;
+    u64 h = hashContext((u64)event_type * 0x9e3779b97f4a7c15ULL, context, event);
+
+    ContextAggregate* slots = &_context_aggregates[lock_index * CONTEXT_AGGREGATE_SLOTS];
+    for (int probe = 0; probe < CONTEXT_AGGREGATE_PROBES; probe++) {
+        ContextAggregate* aggregate = &slots[(h + probe) & (CONTEXT_AGGREGATE_SLOTS - 1)];
+        if (aggregate->tid == 0) {
+            aggregate->tid = tid;
+            aggregate->event_type = event_type;
+            aggregate->ticks = TSC::ticks();
+            aggregate->context = context;
+            aggregate->thread_state = event->_thread_state;
+            aggregate->execution_mode = event->_execution_mode;
+            aggregate->samples = event->_weight;
+            return true;
+        }
+        if (aggregate->event_type == event_type && aggregate->thread_state == event->_thread_state
+                && aggregate->execution_mode == event->_execution_mode
+                && memcmp(&aggregate->context, &context, sizeof(Context)) == 0) {
+            aggregate->samples += event->_weight;
+            Counters::increment(CONTEXT_AGGREGATED_SAMPLES);
+            return true;
+        }
+    }
+    // too many contexts in this stripe's part of the table
+    return false;
+}
+
+void Recording::flushContextAggregates() {
+    if (_context_aggregates == NULL) {
+        return;
+    }
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int j = 0; j < CONTEXT_AGGREGATE_SLOTS; j++) {
+            ContextAggregate* aggregate = &_context_aggregates[i * CONTEXT_AGGREGATE_SLOTS + j];
+            if (aggregate->tid == 0) {
+                continue;
+            }
+            ExecutionEvent event;
+            event._thread_state = aggregate->thread_state;
+            event._execution_mode = aggregate->execution_mode;
+            event._weight = aggregate->samples;
+            if (aggregate->event_type == BCI_CPU) {
+                writeExecutionSample(_active_buf[i], aggregate->ticks, aggregate->tid, 0, &event, aggregate->context);
+            } else {
+                writeMethodSample(_active_buf[i], aggregate->ticks, aggregate->tid, 0, &event, aggregate->context);
+            }
+            aggregate->tid = 0;
+        }
+    }
+}
+
+bool Recording::aggregateOffCpuSample(int lock_index, int tid, u32 call_trace_id, ExecutionEvent* event) {
+    if (_off_cpu_aggregates == NULL) {
+        return false;
+    }
+
+    Context context = Contexts::get(tid);
+    context.version = 0;
+    u64 h = hashContext(((u64)tid << 32 | call_trace_id) * 0x9e3779b97f4a7c15ULL, context, event);
+
+    OffCpuAggregate* slots = &_off_cpu_aggregates[lock_index * OFF_CPU_AGGREGATE_SLOTS];
+    for (int probe = 0; probe < OFF_CPU_AGGREGATE_PROBES; probe++) {
+        OffCpuAggregate* aggregate = &slots[(h + probe) & (OFF_CPU_AGGREGATE_SLOTS - 1)];
+        if (aggregate->tid == 0) {
+            aggregate->tid = tid;
+            aggregate->call_trace_id = call_trace_id;
+            aggregate->ticks = TSC::ticks();
+            aggregate->context = context;
+            aggregate->thread_state = event->_thread_state;
+            aggregate->execution_mode = event->_execution_mode;
+            aggregate->episodes = 1;
+            aggregate->duration = event->_off_cpu_nanos;
+            return true;
+        }
+        if (aggregate->tid == tid && aggregate->call_trace_id == call_trace_id
+                && aggregate->thread_state == event->_thread_state
+                && aggregate->execution_mode == event->_execution_mode
+                && memcmp(&aggregate->context, &context, sizeof(Context)) == 0) {
+            aggregate->episodes++;
+            aggregate->duration += event->_off_cpu_nanos;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Recording::flushOffCpuAggregates() {
+    if (_off_cpu_aggregates == NULL) {
+        return;
+    }
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int j = 0; j < OFF_CPU_AGGREGATE_SLOTS; j++) {
+            OffCpuAggregate* aggregate = &_off_cpu_aggregates[i * OFF_CPU_AGGREGATE_SLOTS + j];
+            if (aggregate->tid == 0) {
+                continue;
+            }
+            writeOffCpuSample(_active_buf[i], aggregate->ticks, aggregate->tid, aggregate->call_trace_id,
+                              aggregate->thread_state, aggregate->execution_mode, aggregate->episodes,
+                              aggregate->duration, aggregate->context);
+            aggregate->tid = 0;
+        }
+    }
+}
+
+void Recording::writeOffCpuSample(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, ThreadState thread_state,
+                                  ExecutionMode execution_mode, u64 episodes, u64 duration, const Context& context) {
+    int start = buf->skip(1);
+    buf->putVar64(T_OFF_CPU_SAMPLE);
+    buf->putVar64(ticks);
+    buf->putVar64(tid);
+    buf->putVar64(call_trace_id);
+    buf->put8(static_cast<int>(thread_state));
+    buf->put8(static_cast<int>(execution_mode));
+    buf->putVar64(episodes);
+    buf->putVar64(duration);
+    writeContext(buf, context);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordPmuSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_PMU_SAMPLE);
+    buf->putVar64(TSC::ticks());
+    buf->putVar64(tid);
+    buf->putVar64(call_trace_id);
+    buf->putVar64(event->_cycles);
+    buf->putVar64(event->_instructions);
+    buf->putVar64(event->_cache_misses);
+    buf->putVar64(event->_branch_misses);
+    writeEventSizePrefix(buf, start);
+}
+
+void Recording::recordMemoryAccessSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_MEMORY_ACCESS_SAMPLE);
+    buf->putVar64(TSC::ticks());
+    buf->putVar64(tid);
+    buf->putVar64(call_trace_id);
+    buf->putVar64(event->_data_address);
+    buf->putVar64(event->_access_latency);
+    buf->putVar64(event->_data_source);
+    writeEventSizePrefix(buf, start);
+}
+
 void Recording::recordMethodSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
+    if (_compact_samples) {
+        recordCompactSample(buf, T_COMPACT_METHOD_SAMPLE, tid, call_trace_id, event);
+        return;
+    }
+    writeMethodSample(buf, TSC::ticks(), tid, call_trace_id, event, Contexts::get(tid));
+}
+
+void Recording::writeMethodSample(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, ExecutionEvent* event,
+                                  const Context& context) {
     int start = buf->skip(1);
     buf->putVar64(T_METHOD_SAMPLE);
-    buf->putVar64(TSC::ticks());
+    buf->putVar64(ticks);
     buf->putVar64(tid);
     buf->putVar64(call_trace_id);
     buf->put8(static_cast<int>(event->_thread_state));
     buf->put8(static_cast<int>(event->_execution_mode));
     buf->putVar64(event->_weight);
-    writeContext(buf, Contexts::get(tid));
+    writeContext(buf, context);
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
 }
@@ -1215,6 +2462,11 @@ void Recording::recordWallClockEpoch(Buffer* buf, WallClockEpochEvent* event) {
     buf->putVar64(event->_num_failed_samples);
     buf->putVar64(event->_num_exited_threads);
     buf->putVar64(event->_num_permission_denied);
+    buf->putVar64(event->_max_tick_lag);
+    buf->putVar64(event->_max_signal_duration);
+    buf->putVar64(event->_reservoir_size);
+    buf->putVar64(event->_interval);
+    buf->putVar64(event->_shard);
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
 }
@@ -1233,30 +2485,110 @@ void Recording::recordTraceRoot(Buffer* buf, int tid, TraceRootEvent* event) {
     flushIfNeeded(buf);
 }
 
-void Recording::recordQueueTime(Buffer* buf, int tid, QueueTimeEvent* event) {
+void Recording::recordQueueTime(Buffer* buf, int tid, QueueTimeEvent* event, const Context& context) {
     int start = buf->skip(1);
     buf->putVar64(T_QUEUE_TIME);
     buf->putVar64(event->_start);
     buf->putVar64(event->_end - event->_start);
     buf->putVar64(tid);
     buf->putVar64(event->_origin);
+    markClass(event->_task);
+    markClass(event->_scheduler);
     buf->putVar64(event->_task);
     buf->putVar64(event->_scheduler);
-    writeContext(buf, Contexts::get(tid));
+    buf->putFloat(event->_weight);
+    writeContext(buf, context);
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
 }
 
+void Recording::recordSpanSummary(Buffer* buf, SpanSummaryEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_SPAN_SUMMARY);
+    buf->putVar64(TSC::ticks());
+    buf->putVar64(event->_span_id);
+    buf->putVar64(event->_root_span_id);
+    buf->putVar64(event->_cpu_samples);
+    buf->putVar64(event->_cpu_time);
+    buf->putVar64(event->_wall_samples);
+    buf->putVar64(event->_wall_time);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordLog(Buffer* buf, LogLevel level, const char* message, size_t len) {
+    if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
+    // below the handoff threshold, the overflow of the buffer has room for the longest message
+    int start = buf->skip(MAX_VAR32_LENGTH);
+    buf->putVar64(T_LOG);
+    buf->putVar64(TSC::ticks());
+    buf->putVar64(level);
+    buf->putUtf8(message, len);
+    buf->putVar32(start, buf->offset() - start);
+}
+
+void Recording::recordVMActivity(Buffer* buf, int tid, VMActivityEvent* event) {
+    // the method name of a compilation may not fit the one byte size prefix
+    flushIfNeeded(buf, RECORDING_BUFFER_LIMIT - (MAX_STRING_LENGTH + MAX_JFR_EVENT_SIZE));
+    int start = buf->skip(MAX_VAR32_LENGTH);
+    buf->putVar64(event->_type);
+    buf->putVar64(event->_start_time);
+    buf->putVar64(event->_end_time - event->_start_time);
+    if (event->_type == T_COMPILATION) {
+        buf->putVar64(tid);
+        buf->putUtf8(event->_method != NULL ? event->_method : "");
+        buf->putVar64(event->_code_size);
+    }
+    buf->putVar32(start, buf->offset() - start);
+    flushIfNeeded(buf);
+}
+
 void Recording::recordAllocation(RecordingBuffer* buf, int tid, u32 call_trace_id, AllocEvent* event) {
+    writeAllocation(buf, TSC::ticks(), tid, call_trace_id, event, Contexts::get(tid));
+}
+
+void Recording::writeAllocation(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, AllocEvent* event,
+                                const Context& context) {
     int start = buf->skip(1);
     buf->putVar64(T_ALLOC);
-    buf->putVar64(TSC::ticks());
+    buf->putVar64(ticks);
     buf->putVar64(tid);
     buf->putVar64(call_trace_id);
+    markClass(event->_id);
     buf->putVar64(event->_id);
     buf->putVar64(event->_size);
     buf->putFloat(event->_weight);
-    writeContext(buf, Contexts::get(tid));
+    writeContext(buf, context);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordAllocationSummary(Buffer* buf, u32 call_trace_id, AllocSummaryEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_ALLOC_SUMMARY);
+    buf->putVar64(TSC::ticks());
+    buf->putVar32(call_trace_id);
+    markClass(event->_id);
+    buf->putVar32(event->_id);
+    buf->putVar64(event->_samples);
+    buf->putVar64(event->_size);
+    buf->putFloat(event->_weight);
+    writeContext(buf, event->_ctx);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordLiveSetSummary(Buffer* buf, u32 call_trace_id, LiveSetSummaryEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_HEAP_LIVE_SUMMARY);
+    buf->putVar64(event->_start_time);
+    buf->putVar32(call_trace_id);
+    markClass(event->_id);
+    buf->putVar32(event->_id);
+    buf->putVar64(event->_age);
+    buf->putVar64(event->_samples);
+    buf->putVar64(event->_size);
+    buf->putFloat(event->_weight);
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
 }
@@ -1267,6 +2599,7 @@ void Recording::recordHeapLiveObject(Buffer* buf, int tid, u32 call_trace_id, Ob
     buf->putVar64(event->_start_time);
     buf->putVar32(tid);
     buf->putVar32(call_trace_id);
+    markClass(event->_id);
     buf->putVar32(event->_id);
     buf->putVar64(event->_age);
     buf->putVar64(event->_alloc._size);
@@ -1276,6 +2609,34 @@ void Recording::recordHeapLiveObject(Buffer* buf, int tid, u32 call_trace_id, Ob
     flushIfNeeded(buf);
 }
 
+void Recording::recordNativeAllocation(Buffer* buf, int tid, u32 call_trace_id, MallocEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_MALLOC);
+    buf->putVar64(TSC::ticks());
+    buf->putVar64(tid);
+    buf->putVar64(call_trace_id);
+    buf->putVar64(event->_address);
+    buf->putVar64(event->_size);
+    buf->putFloat(event->_weight);
+    writeContext(buf, Contexts::get(tid));
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordNativeLiveObject(Buffer* buf, int tid, u32 call_trace_id, NativeLivenessEvent* event) {
+    int start = buf->skip(1);
+    buf->putVar64(T_NATIVE_LIVE_OBJECT);
+    buf->putVar64(event->_start_time);
+    buf->putVar64(tid);
+    buf->putVar64(call_trace_id);
+    buf->putVar64(event->_alloc._address);
+    buf->putVar64(event->_alloc._size);
+    buf->putFloat(event->_alloc._weight);
+    writeContext(buf, event->_ctx);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
 void Recording::recordMonitorBlocked(Buffer* buf, int tid, u32 call_trace_id, LockEvent* event) {
     int start = buf->skip(1);
     buf->putVar64(T_MONITOR_ENTER);
@@ -1283,9 +2644,11 @@ void Recording::recordMonitorBlocked(Buffer* buf, int tid, u32 call_trace_id, Lo
     buf->putVar64(event->_end_time - event->_start_time);
     buf->putVar64(tid);
     buf->putVar64(call_trace_id);
+    markClass(event->_id);
     buf->putVar64(event->_id);
     buf->put8(0);
     buf->putVar64(event->_address);
+    buf->putFloat(event->_weight);
     writeContext(buf, Contexts::get(tid));
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
@@ -1298,10 +2661,13 @@ void Recording::recordThreadPark(Buffer* buf, int tid, u32 call_trace_id, LockEv
     buf->putVar64(event->_end_time - event->_start_time);
     buf->putVar64(tid);
     buf->putVar64(call_trace_id);
+    markClass(event->_id);
     buf->putVar64(event->_id);
     buf->putVar64(event->_timeout);
     buf->putVar64(MIN_JLONG);
     buf->putVar64(event->_address);
+    buf->putFloat(event->_weight);
+    writeContext(buf, Contexts::get(tid));
     writeEventSizePrefix(buf, start);
     flushIfNeeded(buf);
 }
@@ -1317,6 +2683,33 @@ void Recording::recordCpuLoad(Buffer* buf, float proc_user, float proc_system, f
     flushIfNeeded(buf);
 }
 
+void Recording::recordSignalLatency(Buffer* buf, SignalEngine engine, SignalLatencySummary* summary) {
+    int start = buf->skip(1);
+    buf->putVar64(T_SIGNAL_LATENCY);
+    buf->putVar64(TSC::ticks());
+    buf->putUtf8(SignalLatency::engineName(engine));
+    buf->putVar64(summary->samples);
+    buf->putVar64(summary->handler_nanos);
+    buf->putVar64(summary->max_handler_nanos);
+    buf->putVar64(summary->delivered);
+    buf->putVar64(summary->delivery_nanos);
+    buf->putVar64(summary->max_delivery_nanos);
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
+void Recording::recordMemoryGovernorAction(Buffer* buf, int level, u64 footprint) {
+    int start = buf->skip(1);
+    buf->putVar64(T_MEMORY_GOVERNOR);
+    buf->putVar64(TSC::ticks());
+    buf->putVar32(level);
+    buf->putUtf8(MemoryGovernor::levelName(level));
+    buf->putVar64(footprint);
+    buf->putVar64(MemoryGovernor::budget());
+    writeEventSizePrefix(buf, start);
+    flushIfNeeded(buf);
+}
+
 void Recording::addThread(int tid) {
     if (!_thread_set.accept(tid)) {
         _thread_set.add(tid);
@@ -1352,6 +2745,13 @@ Error FlightRecorder::newRecording(bool reset) {
 }
 
 void FlightRecorder::stop() {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Recording* rec = _subscribers[i];
+        if (rec != NULL) {
+            _subscribers[i] = NULL;
+            delete rec;
+        }
+    }
     if (_rec != NULL) {
         _rec_lock.lock();
 
@@ -1362,16 +2762,50 @@ void FlightRecorder::stop() {
     }
 }
 
+void FlightRecorder::holdWriters(bool with_subscribers) {
+    if (_rec != NULL) {
+        if (with_subscribers) {
+            for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+                Recording* rec = _subscribers[i];
+                if (rec != NULL) {
+                    rec->holdWriter();
+                }
+            }
+        }
+        _rec->holdWriter();
+    }
+}
+
+void FlightRecorder::retireChunks(bool retired_traces) {
+    if (_rec != NULL) {
+        _rec_lock.lock();
+        for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+            Recording* rec = _subscribers[i];
+            if (rec != NULL) {
+                rec->retireChunk(retired_traces);
+            }
+        }
+        _rec->retireChunk(retired_traces);
+        _rec_lock.unlock();
+    }
+}
+
 Error FlightRecorder::dump(const char* filename, const int length) {
     if (_rec != NULL) {
         _rec_lock.lock();
         if (_filename.length() != length || strncmp(filename, _filename.c_str(), length) != 0) {
             // if the filename to dump the recording to is specified move the current working file there
             int copy_fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
+            flushSubscribers();
             _rec->switchChunk(copy_fd);
             close(copy_fd);
             _rec_lock.unlock();
         } else {
+            if (_rec->sealing()) {
+                // the retired chunk is finished in the working file all the same
+                flushSubscribers();
+                _rec->switchChunk(-1);
+            }
             _rec_lock.unlock();
             return Error("Can not dump recording to itself. Provide a different file name!");
         }
@@ -1382,29 +2816,101 @@ Error FlightRecorder::dump(const char* filename, const int length) {
     }
 }
 
-void FlightRecorder::flush() {
+Error FlightRecorder::dump(int fd) {
     if (_rec != NULL) {
         _rec_lock.lock();
+        if (fd < 0) {
+            if (_rec->sealing()) {
+                // the retired chunk is finished in the working file all the same
+                flushSubscribers();
+                _rec->switchChunk(-1);
+            }
+            _rec_lock.unlock();
+            return Error("Invalid file descriptor");
+        }
+        // the finished chunks are streamed directly to the target which may also be a socket or a pipe
+        flushSubscribers();
+        _rec->switchChunk(fd);
+        _rec_lock.unlock();
+        return Error::OK;
+    } else {
+        return Error("No active recording");
+    }
+}
 
-        jvmtiEnv* jvmti = VM::jvmti();
-        JNIEnv* env = VM::jni();
+void FlightRecorder::flushSubscribers() {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Recording* rec = _subscribers[i];
+        if (rec != NULL) {
+            rec->switchChunk(-1);
+        }
+    }
+}
 
-        jclass** classes = NULL;
-        jint count = 0;
-        // obtaining the class list will create local refs to all loaded classes, effectively preventing them from being unloaded while flushing
-        jvmtiError err = jvmti->GetLoadedClasses(&count, classes);
-        _rec->switchChunk(-1);
-        if (!err) {
-            // deallocate all loaded classes
-            for (int i = 0; i < count; i++) {
-                env->DeleteLocalRef((jobject)classes[i]);
-                jvmti->Deallocate((unsigned char*)classes[i]);
+Error FlightRecorder::subscribe(Arguments& args, Subscription* subscription) {
+    if (_rec == NULL) {
+        delete subscription;
+        return Error("No active recording");
+    }
+    int slot = -1;
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Recording* rec = _subscribers[i];
+        if (rec == NULL) {
+            if (slot < 0) {
+                slot = i;
             }
+        } else if (rec->subscription()->path == subscription->path) {
+            delete subscription;
+            return Error("The file is already subscribed to");
+        }
+    }
+    if (subscription->path == _filename) {
+        delete subscription;
+        return Error("Can not subscribe the recording to itself");
+    }
+    if (slot < 0) {
+        delete subscription;
+        return Error("Too many subscribed recordings");
+    }
+
+    int fd = open(subscription->path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1) {
+        delete subscription;
+        return Error("Could not open the subscribed recording file");
+    }
+    // fully constructed before the samplers can see it
+    __atomic_store_n(&_subscribers[slot], new Recording(fd, args, subscription), __ATOMIC_RELEASE);
+    return Error::OK;
+}
+
+Error FlightRecorder::unsubscribe(const char* path) {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Recording* rec = _subscribers[i];
+        if (rec != NULL && rec->subscription()->path == path) {
+            _subscribers[i] = NULL;
+            // finishes the last chunk, whose call traces are still in the storage
+            delete rec;
+            return Error::OK;
         }
+    }
+    return Error("No recording is subscribed with this file");
+}
+
+void FlightRecorder::flush() {
+    if (_rec != NULL) {
+        _rec_lock.lock();
+        // finishChunk takes care of the class unloading
+        _rec->switchChunk(-1);
         _rec_lock.unlock();
     }
 }
 
+void FlightRecorder::cancelRotation() {
+    if (_rec != NULL) {
+        _rec->cancelRotation();
+    }
+}
+
 void FlightRecorder::wallClockEpoch(int lock_index, WallClockEpochEvent* event) {
     if (_rec != NULL) {
         Buffer* buf = _rec->buffer(lock_index);
@@ -1419,10 +2925,27 @@ void FlightRecorder::recordTraceRoot(int lock_index, int tid, TraceRootEvent* ev
     }
 }
 
-void FlightRecorder::recordQueueTime(int lock_index, int tid, QueueTimeEvent* event) {
+void FlightRecorder::recordQueueTime(int lock_index, int tid, QueueTimeEvent* event, const Context* context) {
     if (_rec != NULL) {
         Buffer* buf = _rec->buffer(lock_index);
-        _rec->recordQueueTime(buf, tid, event);
+        _rec->recordQueueTime(buf, tid, event, context != NULL ? *context : Contexts::get(tid));
+    }
+}
+
+void FlightRecorder::recordSpanSummary(int lock_index, SpanSummaryEvent* event) {
+    if (_rec != NULL) {
+        Buffer* buf = _rec->buffer(lock_index);
+        _rec->recordSpanSummary(buf, event);
+    }
+}
+
+void FlightRecorder::recordVMActivity(int lock_index, int tid, VMActivityEvent* event) {
+    if (_rec != NULL) {
+        Buffer* buf = _rec->buffer(lock_index);
+        _rec->recordVMActivity(buf, tid, event);
+        if (event->_type == T_COMPILATION) {
+            _rec->addThread(tid);
+        }
     }
 }
 
@@ -1434,6 +2957,32 @@ void FlightRecorder::recordDatadogSetting(int lock_index, int length,
     }
 }
 
+void FlightRecorder::collectThreads(std::vector<int>& tids) {
+    if (_rec != NULL) {
+        _rec->collectThreads(tids);
+    }
+}
+
+void FlightRecorder::lockWriter() {
+    if (_rec != NULL) {
+        _rec->lockWriter();
+    }
+}
+
+void FlightRecorder::unlockWriter() {
+    if (_rec != NULL) {
+        _rec->unlockWriter();
+    }
+}
+
+void FlightRecorder::recordReconfiguration(Arguments& args, long cpu_interval) {
+    // a recording started after this one, e.g. by a dump to another file, carries on with the new values
+    applyTuning(_args, args);
+    if (_rec != NULL) {
+        _rec->writeReconfiguration(args, cpu_interval);
+    }
+}
+
 void FlightRecorder::recordHeapUsage(int lock_index, long value, bool live) {
     if (_rec != NULL) {
         Buffer *buf = _rec->buffer(lock_index);
@@ -1444,51 +2993,76 @@ void FlightRecorder::recordHeapUsage(int lock_index, long value, bool live) {
 void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                                  int event_type, Event* event, u64 counter) {
     if (_rec != NULL) {
-        RecordingBuffer* buf = _rec->buffer(lock_index);
-        switch (event_type) {
-            case 0:
-                _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
-                break;
-            case BCI_WALL:
-                _rec->recordMethodSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
-                break;
-            case BCI_ALLOC:
-                _rec->recordAllocation(buf, tid, call_trace_id, (AllocEvent*)event);
-                break;
-            case BCI_LIVENESS:
-                _rec->recordHeapLiveObject(buf, tid, call_trace_id, (ObjectLivenessEvent*)event);
-                break;
-            case BCI_LOCK:
-                _rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
-                break;
-            case BCI_PARK:
-                _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
-                break;
-        }
-        _rec->flushIfNeeded(buf);
-        _rec->addThread(tid);
-    }
-}
-
-void FlightRecorder::recordLog(LogLevel level, const char* message, size_t len) {
-    if (!_rec_lock.tryLockShared()) {
-        // No active recording
-        return;
+        recordSample(_rec, lock_index, tid, call_trace_id, event_type, event);
+        // the stack trace is walked once and shared by all the recordings
+        for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+            Recording* rec = __atomic_load_n(&_subscribers[i], __ATOMIC_ACQUIRE);
+            if (rec != NULL && rec->accepts(event_type)) {
+                recordSample(rec, lock_index, tid, call_trace_id, event_type, event);
+            }
+        }
     }
+}
 
-    if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
-    // cppcheck-suppress obsoleteFunctions
-    Buffer* buf = (Buffer*)alloca(len + 40);
-    buf->reset();
-
-    int start = buf->skip(5);
-    buf->putVar64(T_LOG);
-    buf->putVar64(TSC::ticks());
-    buf->putVar64(level);
-    buf->putUtf8(message, len);
-    buf->putVar32(start, buf->offset() - start);
-    _rec->flush(buf);
+void FlightRecorder::recordSample(Recording* rec, int lock_index, int tid, u32 call_trace_id,
+                                  int event_type, Event* event) {
+    RecordingBuffer* buf = rec->buffer(lock_index);
+    switch (event_type) {
+        case 0:
+            if (!rec->aggregateContextSample(lock_index, tid, call_trace_id, event_type, (ExecutionEvent*)event)
+                    && !rec->coalesceSample(lock_index, tid, call_trace_id, event_type, event)) {
+                rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+            }
+            break;
+        case BCI_WALL:
+            if (((ExecutionEvent*)event)->_off_cpu_nanos > 0) {
+                if (!rec->aggregateOffCpuSample(lock_index, tid, call_trace_id, (ExecutionEvent*)event)) {
+                    ExecutionEvent* off_cpu = (ExecutionEvent*)event;
+                    rec->writeOffCpuSample(buf, TSC::ticks(), tid, call_trace_id, off_cpu->_thread_state,
+                                           off_cpu->_execution_mode, 1, off_cpu->_off_cpu_nanos, Contexts::get(tid));
+                }
+            } else if (!rec->aggregateContextSample(lock_index, tid, call_trace_id, event_type, (ExecutionEvent*)event)) {
+                rec->recordMethodSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+            }
+            break;
+        case BCI_ALLOC:
+            if (!rec->coalesceSample(lock_index, tid, call_trace_id, event_type, event)) {
+                rec->recordAllocation(buf, tid, call_trace_id, (AllocEvent*)event);
+            }
+            break;
+        case BCI_LIVENESS:
+            rec->recordHeapLiveObject(buf, tid, call_trace_id, (ObjectLivenessEvent*)event);
+            break;
+        case BCI_ALLOC_SUMMARY:
+            rec->recordAllocationSummary(buf, call_trace_id, (AllocSummaryEvent*)event);
+            break;
+        case BCI_LIVENESS_SUMMARY:
+            rec->recordLiveSetSummary(buf, call_trace_id, (LiveSetSummaryEvent*)event);
+            break;
+        case BCI_NATIVE_MALLOC:
+            rec->recordNativeAllocation(buf, tid, call_trace_id, (MallocEvent*)event);
+            break;
+        case BCI_NATIVE_LIVE:
+            rec->recordNativeLiveObject(buf, tid, call_trace_id, (NativeLivenessEvent*)event);
+            break;
+        case BCI_LOCK:
+            rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
+            break;
+        case BCI_PARK:
+            rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
+            break;
+    }
+    rec->recordPprofSample(lock_index, tid, call_trace_id, event_type, event);
+    rec->handoffIfNeeded(lock_index);
+    rec->addThread(tid);
+}
 
-    _rec_lock.unlockShared();
+void FlightRecorder::recordLog(int lock_index, LogLevel level, const char* message, size_t len) {
+    if (_rec != NULL) {
+        Buffer* buf = _rec->buffer(lock_index);
+        _rec->recordLog(buf, level, message, len);
+        // the full buffer is written by the writer thread, as the one of the samples
+        _rec->handoffIfNeeded(lock_index);
+    }
 }
 
@@ -18,12 +18,19 @@
 #define _FLIGHTRECORDER_H
 
 #include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "arch.h"
 #include "arguments.h"
+#include "boundedDictionary.h"
 #include "buffers.h"
 #include "counters.h"
 #include "dictionary.h"
@@ -31,8 +38,12 @@
 #include "frame.h"
 #include "log.h"
 #include "jfrMetadata.h"
+#include "mappedFile.h"
 #include "mutex.h"
+#include "sampleLoss.h"
 #include "objectSampler.h"
+#include "signalLatency.h"
+#include "spinLock.h"
 #include "threadFilter.h"
 #include "vmEntry.h"
 
@@ -40,16 +51,46 @@ const u64 MAX_JLONG = 0x7fffffffffffffffULL;
 const u64 MIN_JLONG = 0x8000000000000000ULL;
 const int MAX_JFR_EVENT_SIZE = 256;
 const int JFR_EVENT_FLUSH_THRESHOLD = RECORDING_BUFFER_LIMIT;
+// sample buffers are handed off before any event could push them over the flush threshold
+const int JFR_EVENT_HANDOFF_THRESHOLD = RECORDING_BUFFER_LIMIT - MAX_JFR_EVENT_SIZE;
+// how often the writer thread drains the handed off buffers
+const long JFR_WRITER_INTERVAL_NANOS = 10 * 1000 * 1000;
+// how often the writer thread records the signal latency summaries
+const u64 JFR_SIGNAL_LATENCY_PERIOD_NANOS = 1000 * 1000 * 1000;
+// how often the writer thread lets the overhead governor adjust the CPU interval
+const u64 JFR_OVERHEAD_GOVERNOR_PERIOD_NANOS = 1000 * 1000 * 1000;
+const u64 JFR_MEMORY_GOVERNOR_PERIOD_NANOS = 1000 * 1000 * 1000;
+// how often the writer thread checks the current chunk against chunksize and chunktime
+const u64 JFR_ROTATION_CHECK_PERIOD_NANOS = 1000 * 1000 * 1000;
+// keeps the time deltas of compact samples within 4 bytes
+const u64 MAX_COMPACT_TICKS_DELTA = 0xfffffff;
+const int CONTEXT_CACHE_SIZE = 4096;
 const int MAX_VAR64_LENGTH = 10;
 const int MAX_VAR32_LENGTH = 5;
 
 const int CONCURRENCY_LEVEL = 16;
+// the stack trace pool is split across worker threads from this many traces on
+const size_t PARALLEL_CPOOL_TRACES = 16384;
+const int MAX_CPOOL_WORKERS = 4;
+// samples held back by every lock stripe with COALESCE_SAMPLES, in slots indexed by tid
+const int COALESCE_SLOTS = 64;
+// distinct contexts summed up by every lock stripe in lightweight mode, and the slots probed for one
+const int CONTEXT_AGGREGATE_SLOTS = 256;
+const int CONTEXT_AGGREGATE_PROBES = 16;
+// Per lock stripe, a power of 2
+const int OFF_CPU_AGGREGATE_SLOTS = 512;
+const int OFF_CPU_AGGREGATE_PROBES = 16;
 const u16 ACC_SYNTHETIC = 0x1000;
 const u16 ACC_BRIDGE = 0x0040;
 const u16 ACC_HIDDEN = ACC_SYNTHETIC | ACC_BRIDGE;
 
 class Profiler;
 class Lookup;
+class MethodInfo;
+class Recording;
+class PprofWriter;
+class ShmRing;
+struct CallTrace;
 
 struct CpuTime {
     u64 real;
@@ -62,41 +103,91 @@ struct CpuTimes {
     CpuTime total;
 };
 
+// The phases of the constant pool serialization timed for the overhead event; CPOOL_TOTAL spans all of them
+enum CpoolPhase {
+    CPOOL_STACK_TRACES,
+    CPOOL_METHODS,
+    CPOOL_CLASSES,
+    CPOOL_THREADS,
+    CPOOL_TOTAL,
+    CPOOL_PHASES
+};
+
+// Running totals of the CPU time spent by the profiler, in nanoseconds
+struct OverheadTotals {
+    u64 handler[SIGNAL_ENGINES];
+    u64 sampler;
+    u64 cpool[CPOOL_PHASES];
+};
+
 class SharedLineNumberTable {
   public:
     int _size;
     void* _ptr;
+    // the last resolved bci; hot frames tend to be written with the same bci over and over
+    jint _last_bci;
+    jint _last_line;
 
-    SharedLineNumberTable(int size, void* ptr) : _size(size), _ptr(ptr) {}
+    // sorts the entries by start_location so that they can be binary searched
+    SharedLineNumberTable(int size, void* ptr);
     ~SharedLineNumberTable();
+
+    jint lineNumber(jint bci) {
+        if (bci != _last_bci) {
+            _last_line = findLineNumber(bci);
+            _last_bci = bci;
+        }
+        return _last_line;
+    }
+
+    // the same lookup without the cache, for concurrent callers
+    jint findLineNumber(jint bci) const {
+        jvmtiLineNumberEntry* table = (jvmtiLineNumberEntry*)_ptr;
+        // the last entry starting at or before bci; the first entry covers everything before it
+        int low = 1;
+        int high = _size;
+        while (low < high) {
+            int mid = (low + high) >> 1;
+            if (table[mid].start_location <= bci) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return table[low - 1].line_number;
+    }
 };
 
 class MethodInfo {
   public:
-    MethodInfo() : _mark(false), _is_entry(false), _key(0), _modifiers(0),
-     _class(0), _name(0), _sig(0), _line_number_table(nullptr), _type() {}
+    MethodInfo() : _mark_epoch(0), _is_entry(false), _key(0), _written_epoch(0),
+     _class(0), _name(0), _sig(0), _modifiers(0), _class_name(NULL), _method_name(NULL), _method_sig(NULL),
+     _line_number_table(nullptr), _type() {}
 
-    bool _mark;
+    // marked when the mark epoch of the owning MethodMap matches
+    u32 _mark_epoch;
     bool _is_entry;
     u32 _key;
+    // file epoch in which the method was last written to the constant pool
+    u32 _written_epoch;
     u32 _class;
     u32 _name;
     u32 _sig;
     jint _modifiers;
+    // normalised names of a resolved Java method, interned in the MethodMap; NULL until resolved
+    const std::string* _class_name;
+    const std::string* _method_name;
+    const std::string* _method_sig;
     std::shared_ptr<SharedLineNumberTable> _line_number_table;
     FrameTypeId _type;
 
-    jint getLineNumber(jint bci) {
+    jint getLineNumber(jint bci, bool cached = true) {
         // if the shared pointer is not pointing to the line number table, consider size 0
         if (!_line_number_table || _line_number_table->_size == 0) {
             return 0;
         }
 
-        int i = 1;
-        while (i < _line_number_table->_size && bci >= ((jvmtiLineNumberEntry*)_line_number_table->_ptr)[i].start_location) {
-            i++;
-        }
-        return ((jvmtiLineNumberEntry*)_line_number_table->_ptr)[i - 1].line_number;
+        return cached ? _line_number_table->lineNumber(bci) : _line_number_table->findLineNumber(bci);
     }
 
     bool isHidden() {
@@ -105,16 +196,152 @@ class MethodInfo {
     }
 };
 
-class MethodMap : public std::map<jmethodID, MethodInfo> {
+// Open-addressing hash table of jmethodID -> MethodInfo.
+// MethodInfo entries are allocated from an arena and never move, so the pointers are stable.
+class MethodMap {
+  private:
+    static const u32 INITIAL_CAPACITY = 4096;
+    static const u32 ARENA_CHUNK_SIZE = 1024;
+
+    jmethodID* _keys;
+    MethodInfo** _values;
+    u32 _capacity;
+    u32 _size;
+    // entry for the NULL jmethodID which can not be stored in the table
+    MethodInfo* _null_entry;
+    std::vector<MethodInfo*> _arena;
+    std::vector<MethodInfo*> _marked;
+    u32 _mark_epoch;
+    // names of resolved methods and whether a class signature denotes a Thread subclass;
+    // both survive the chunk so that methods need not be resolved through JVMTI again
+    std::unordered_set<std::string> _strings;
+    std::unordered_map<std::string, bool> _thread_classes;
+
+    static u32 hash(jmethodID method) {
+        u64 h = (u64)(uintptr_t)method * 0x9e3779b97f4a7c15ULL;
+        return (u32)(h >> 32);
+    }
+
+    MethodInfo* allocate();
+    void grow();
+
   public:
-    MethodMap() {
+    MethodMap();
+    ~MethodMap();
+
+    // Returns the existing entry for the method or creates a new one
+    MethodInfo* get(jmethodID method);
+
+    u32 size() const {
+        return _size;
+    }
+
+    bool isMarked(const MethodInfo* mi) const {
+        return mi->_mark_epoch == _mark_epoch;
     }
+
+    void mark(MethodInfo* mi) {
+        mi->_mark_epoch = _mark_epoch;
+        _marked.push_back(mi);
+    }
+
+    // Marked entries in the order they were marked
+    const std::vector<MethodInfo*>& marked() const {
+        return _marked;
+    }
+
+    const std::string* intern(const char* str, size_t length) {
+        return &*_strings.insert(std::string(str, length)).first;
+    }
+
+    const std::string* intern(const char* str) {
+        return intern(str, strlen(str));
+    }
+
+    std::unordered_map<std::string, bool>& threadClasses() {
+        return _thread_classes;
+    }
+
+    void clearMarks() {
+        _marked.clear();
+        _mark_epoch++;
+    }
+};
+
+// The last sample of a thread, held back as long as its next ones are identical to it, see COALESCE_SAMPLES
+struct CoalescedSample {
+    // 0 if the slot is free
+    int tid;
+    int event_type;
+    u32 call_trace_id;
+    // of the first sample folded in
+    u64 ticks;
+    Context context;
+    // BCI_CPU
+    ThreadState thread_state;
+    ExecutionMode execution_mode;
+    u64 samples;
+    // BCI_ALLOC
+    u32 class_id;
+    u64 size;
+    double weight;
+};
+
+// The CPU or wall samples of one context and thread state summed up over a chunk when they have no
+// stack trace to tell them apart: in lightweight mode, or when counting the samples of unsampled spans.
+// The thread is not part of the key: the sum is written as a sample of the first thread sampled in the
+// context, so that the threads of a span add up to one event rather than one each.
+struct ContextAggregate {
+    // the first thread sampled, 0 if the slot is free
+    int tid;
+    int event_type;
+    u64 ticks;
+    // with a zero version, so that the whole context can be compared
+    Context context;
+    ThreadState thread_state;
+    ExecutionMode execution_mode;
+    u64 samples;
+};
+
+// The off-CPU episodes of one thread with the same stack trace, context and state, summed up over a chunk
+struct OffCpuAggregate {
+    // 0 if the slot is free
+    int tid;
+    u32 call_trace_id;
+    // of the first episode
+    u64 ticks;
+    // with a zero version, so that the whole context can be compared
+    Context context;
+    ThreadState thread_state;
+    ExecutionMode execution_mode;
+    u64 episodes;
+    u64 duration;
+};
+
+// Writes the span ids and the configured number of tags of a context
+typedef void (*ContextWriter)(Buffer* buf, const Context& context);
+
+// How many recordings may subscribe to the samples of the continuous one
+const int MAX_SUBSCRIBERS = 4;
+
+// What a subscribed recording takes from the samples of the continuous recording
+struct Subscription {
+    std::string path;
+    // the EM_* events, a subset of the profiled ones
+    int event_mask;
+    // every n-th sample of an engine is recorded, so that the subscriber gets its own interval
+    u32 cpu_stride;
+    u32 wall_stride;
+    u32 alloc_stride;
+    // OS::micros() at which the recording ends on its own, 0 if it lasts until unsubscribed
+    u64 end_time;
 };
 
 class Recording {
   friend ObjectSampler;
   friend Profiler;
   friend Lookup;
+  friend class RecordingStackTraceWriter;
 
   private:
     static char* _agent_properties;
@@ -123,8 +350,34 @@ class Recording {
     static char* _java_command;
 
     RecordingBuffer _buf[CONCURRENCY_LEVEL];
+    // Every lock stripe has a second buffer; a full buffer is handed off to the writer thread,
+    // which drains it with writev, so that samplers never call write() in the signal handler.
+    RecordingBuffer _spare_buf[CONCURRENCY_LEVEL];
+    RecordingBuffer* _active_buf[CONCURRENCY_LEVEL];
+    RecordingBuffer* volatile _full_buf[CONCURRENCY_LEVEL];
+    // The buffers of the chunk being sealed, see retireChunk(), each set to NULL once written out. While sealing,
+    // the samplers keep their events in the other buffers and hand them off once their stripe is written out.
+    RecordingBuffer* volatile _retired_buf[CONCURRENCY_LEVEL];
+    // takes the chunk settings, the constant pool and the header of the next chunk
+    RecordingBuffer _chunk_buf;
+    volatile bool _sealing;
+    // the call traces of the chunk being sealed are the generation retired by CallTraceStorage::rotate()
+    bool _retired_traces;
+    std::vector<int> _retired_threads;
+    // the generation of the class marks of the chunk being sealed
+    u8 _class_generation;
+    Mutex _writer_lock;
+    // the writer lock is held by a dump, see holdWriter()
+    volatile bool _writer_held;
+    pthread_t _writer_thread;
+    volatile bool _writer_running;
     int _fd;
     off_t _chunk_start;
+    // NULL unless the recording file is a bounded memory-mapped ring (jfrsize)
+    MappedFile* _mapped;
+    // Serializes the writes into the mapping. The samplers of the different stripes only try it and append,
+    // so a wrap around of the ring and the discarding of the oldest chunks never run in a signal handler.
+    SpinLock _mapped_lock;
     ThreadFilter _thread_set;
     MethodMap _method_map;
 
@@ -139,6 +392,46 @@ class Recording {
     u64 _base_id;
     u64 _bytes_written;
 
+    Subscription* _subscription;
+    // the samples seen by a subscriber per engine, of which every stride-th is recorded
+    volatile u64 _cpu_seen;
+    volatile u64 _wall_seen;
+    volatile u64 _alloc_seen;
+    volatile bool _expired;
+    // the chunk past chunksize or chunktime has been handed to the chunk writer to be sealed
+    volatile bool _rotation_requested;
+
+    // Incremental constant pools: ids already written to the current file
+    bool _incremental_cpool;
+    u32 _file_epoch;
+    u32 _class_map_epoch;
+    std::unordered_set<u32> _written_traces;
+    std::unordered_set<u32> _written_classes;
+    std::unordered_set<u32> _written_strings;
+    std::unordered_set<u32> _written_attribute_values;
+
+    // The symbols and the packages outlive the chunks, so that a chunk only interns what is new to it;
+    // the marks tell the ones it references. Started over once they outgrow MAX_SYMBOLS_SIZE.
+    Dictionary _symbols;
+    Dictionary _packages;
+    DictionaryMarks _symbol_marks;
+    DictionaryMarks _package_marks;
+    // package id by class id, valid for the class map epoch _class_map_epoch
+    std::unordered_map<u32, u32> _class_packages;
+
+    // Compact samples: hash of the context last written per thread, indexed by tid
+    bool _compact_samples;
+    u64 _last_context[CONTEXT_CACHE_SIZE];
+    // NULL unless COALESCE_SAMPLES; COALESCE_SLOTS per lock stripe, only touched with the lock of the stripe held
+    CoalescedSample* _coalesced;
+    // NULL unless samples may be recorded without stack traces
+    ContextAggregate* _context_aggregates;
+    // NULL unless the off-CPU time is measured (wallswitch); OFF_CPU_AGGREGATE_SLOTS per lock stripe
+    OffCpuAggregate* _off_cpu_aggregates;
+
+    // specialized for the number of context attributes of this recording
+    ContextWriter _context_writer;
+
     int _tid;
     int _available_processors;
     int _recorded_lib_count;
@@ -147,28 +440,92 @@ class Recording {
     Buffer _cpu_monitor_buf;
     CpuTimes _last_times;
 
+    // The overhead event reports the totals accumulated since the previous one
+    bool _self_overhead;
+    OverheadTotals _overhead;
+    OverheadTotals _last_overhead;
+
+    // Every chunk's call traces are appended to this file when it is set, see SampleCapture
+    std::string _capture;
+    // NULL unless the chunks are also written as pprof profiles
+    PprofWriter* _pprof;
+    // NULL unless the finished chunks are published to a shared memory ring
+    ShmRing* _shm_ring;
+
     static float ratio(float value) {
         return value < 0 ? 0 : value > 1 ? 1 : value;
     }
 
+    static void* writerEntry(void* recording) {
+        ((Recording*)recording)->writerLoop();
+        return NULL;
+    }
+
+    void writerLoop();
+    void checkRotation();
+    void signalLatencyCycle();
+    void writeFullBuffers();
+    // Writes out the retired chunk; retires it first unless the caller has, with all the locks held then.
+    // Holds the writer first unless the caller has. Returns with the writer still held and the samplers
+    // still kept off the file, see resumeChunk().
+    off_t sealChunk(bool end_recording);
+    // Writes out the buffers handed off while sealing, now that the header of the next chunk precedes
+    // their events, and lets the samplers and the writer thread write to the file again
+    void resumeChunk();
+    bool isActive(const Buffer* buf);
+
+    off_t chunkOffset();
+    void patchChunk(const void* data, size_t size, off_t chunk_offset);
+    void exportRange(int target_fd, off_t offset, size_t size);
+
   public:
-    Recording(int fd, Arguments& args);
+    // A subscriber takes the samples selected by its subscription, which it owns, and leaves
+    // the governors, the chunk rotation and the sample loss accounting to the continuous recording
+    Recording(int fd, Arguments& args, Subscription* subscription = NULL);
     ~Recording();
+
+    const Subscription* subscription() const {
+        return _subscription;
+    }
+
+    // Downsamples the samples of the subscribers; the continuous recording takes all of them
+    bool accepts(int event_type);
+
+    // Lets the writer thread request the rotation again, after the chunk writer failed to rotate the chunk
+    void cancelRotation() {
+        _rotation_requested = false;
+    }
     
     void copyTo(int target_fd);
+    void exportChunk(int target_fd, size_t size);
     off_t finishChunk();
 
     off_t finishChunk(bool end_recording);
     void switchChunk(int fd);
 
+    // Keeps the writer thread off the file until the next chunk is resumed; taken before all the locks are,
+    // since the writer thread may be writing a buffer out
+    void holdWriter();
+    // Called with all the locks held and the writer held: the events recorded so far, with the samples summed up or held back,
+    // the threads and the classes they reference, belong to the chunk to be finished, which can then be
+    // written out without the locks. The samplers carry on with the other buffer of their stripe.
+    // retired_traces tells that the call traces of the chunk have just been retired by a rotation.
+    void retireChunk(bool retired_traces);
+    bool sealing() const {
+        return _sealing;
+    }
+
     void cpuMonitorCycle();
     void appendRecording(const char* target_file, size_t size);
 
     RecordingBuffer* buffer(int lock_index);
+    void handoffIfNeeded(int lock_index);
 
     bool parseAgentProperties();
 
-    void flush(Buffer* buf);
+    // headroom is the space the next event takes, which a buffer kept back by a sampler must still have
+    void flush(Buffer* buf, int headroom = MAX_JFR_EVENT_SIZE);
+    void flush(const char* data, size_t size);
     void flushIfNeeded(Buffer* buf, int limit = JFR_EVENT_FLUSH_THRESHOLD);
     void writeHeader(Buffer* buf);
 
@@ -190,6 +547,7 @@ class Recording {
     void writeListSetting(Buffer* buf, int category, const char* key, const char* base, int offset);
 
     void writeDatadogSetting(Buffer* buf, int length, const char* name, const char* value, const char* unit);
+    void writeDatadogSetting(Buffer* buf, int length, const char* name, const char* value, const char* unit, u64 start_time);
 
     void writeDatadogProfilerConfig(Buffer* buf,
                                     long cpuInterval,
@@ -216,6 +574,8 @@ class Recording {
 
     void writeStackTraces(Buffer* buf, Lookup* lookup);
 
+    // Encodes the traces whose frames resolve to the given methods; full buffers go to the file,
+    // or are appended to spill when it is not NULL, so that this can run on a worker thread
     void writeMethods(Buffer* buf, Lookup* lookup);
 
     void writeClasses(Buffer* buf, Lookup* lookup);
@@ -224,25 +584,91 @@ class Recording {
 
     void writeConstantPoolSection(Buffer* buf, JfrType type, std::map<u32, const char*>& constants);
 
-    void writeConstantPoolSection(Buffer* buf, JfrType type, Dictionary* dictionary);
+    void writeConstantPoolSection(Buffer* buf, JfrType type, Dictionary* dictionary, std::unordered_set<u32>* written = NULL);
+
+    void writeConstantPoolSection(Buffer* buf, JfrType type, BoundedDictionary* dictionary, std::unordered_set<u32>* written);
+
+    void writeConstantPoolSection(Buffer* buf, JfrType type, std::map<u32, const char*>& constants, std::unordered_set<u32>* written);
+
+    void resetWrittenConstants();
+    void resetSymbols();
 
     void writeLogLevels(Buffer* buf);
 
     void writeCounters(Buffer* buf);
 
-    void writeContext(Buffer* buf, Context& context);
+    void writeProfilerOverhead(Buffer* buf);
+    void writeSampleLoss(Buffer* buf);
+
+    void writeContext(Buffer* buf, const Context& context) {
+        _context_writer(buf, context);
+    }
+    void writeContextIfChanged(Buffer* buf, int tid, u64 ticks);
+    void recordCompactSample(Buffer* buf, int type, int tid, u32 call_trace_id, ExecutionEvent* event);
 
     void recordExecutionSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event);
+    void writeExecutionSample(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, ExecutionEvent* event,
+                              const Context& context);
+    // Folds the sample into the one held back for its thread if they are identical, or holds it back in its
+    // place, writing that one out; false if the sample can not be coalesced and must be written as it is
+    bool coalesceSample(int lock_index, int tid, u32 call_trace_id, int event_type, Event* event);
+    void writeCoalescedSample(Buffer* buf, const CoalescedSample* sample);
+    // Writes out the samples still held back; called with all the locks held, before the chunk is finished
+    void flushCoalescedSamples();
+    // Adds a CPU or wall sample without a stack trace to the sum of its context; false if it has
+    // to be written as it is
+    bool aggregateContextSample(int lock_index, int tid, u32 call_trace_id, int event_type, ExecutionEvent* event);
+    // Writes out the sums of the chunk; called with all the locks held, before the chunk is finished
+    void flushContextAggregates();
+    // Adds the off-CPU episode to the sum of its thread, stack trace, context and state; false if it has
+    // to be written as it is
+    bool aggregateOffCpuSample(int lock_index, int tid, u32 call_trace_id, ExecutionEvent* event);
+    // Writes out the sums of the chunk; called with all the locks held, before the chunk is finished
+    void flushOffCpuAggregates();
+    void writeOffCpuSample(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, ThreadState thread_state,
+                           ExecutionMode execution_mode, u64 episodes, u64 duration, const Context& context);
+    // Adds the event to the pprof profile of the chunk, if there is one; called with the lock of the stripe held
+    void recordPprofSample(int lock_index, int tid, u32 call_trace_id, int event_type, Event* event);
     void recordMethodSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event);
+    void writeMethodSample(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, ExecutionEvent* event,
+                           const Context& context);
     void recordWallClockEpoch(Buffer* buf, WallClockEpochEvent* event);
     void recordTraceRoot(Buffer* buf, int tid, TraceRootEvent* event);
-    void recordQueueTime(Buffer* buf, int tid, QueueTimeEvent* event);
+    void recordQueueTime(Buffer* buf, int tid, QueueTimeEvent* event, const Context& context);
+    void recordSpanSummary(Buffer* buf, SpanSummaryEvent* event);
+    void recordVMActivity(Buffer* buf, int tid, VMActivityEvent* event);
+    void recordLog(Buffer* buf, LogLevel level, const char* message, size_t len);
     void recordAllocation(RecordingBuffer* buf, int tid, u32 call_trace_id, AllocEvent* event);
+    void writeAllocation(Buffer* buf, u64 ticks, int tid, u32 call_trace_id, AllocEvent* event, const Context& context);
     void recordHeapLiveObject(Buffer* buf, int tid, u32 call_trace_id, ObjectLivenessEvent* event);
+    void recordAllocationSummary(Buffer* buf, u32 call_trace_id, AllocSummaryEvent* event);
+    void recordLiveSetSummary(Buffer* buf, u32 call_trace_id, LiveSetSummaryEvent* event);
+    void recordNativeAllocation(Buffer* buf, int tid, u32 call_trace_id, MallocEvent* event);
+    void recordNativeLiveObject(Buffer* buf, int tid, u32 call_trace_id, NativeLivenessEvent* event);
     void recordMonitorBlocked(Buffer* buf, int tid, u32 call_trace_id, LockEvent* event);
     void recordThreadPark(Buffer* buf, int tid, u32 call_trace_id, LockEvent* event);
+    void recordPmuSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event);
+    void recordMemoryAccessSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event);
     void recordCpuLoad(Buffer* buf, float proc_user, float proc_system, float machine_total);
+    void recordSignalLatency(Buffer* buf, SignalEngine engine, SignalLatencySummary* summary);
+    void recordMemoryGovernorAction(Buffer* buf, int level, u64 footprint);
+    void writeCpuInterval(long cpu_interval);
+    void writeReconfiguration(Arguments& args, long cpu_interval);
     void addThread(int tid);
+
+    // The threads with events in the current chunk, including the one writing it
+    void collectThreads(std::vector<int>& tids) {
+        addThread(_tid);
+        _thread_set.collect(tids);
+    }
+
+    void lockWriter() {
+        _writer_lock.lock();
+    }
+
+    void unlockWriter() {
+        _writer_lock.unlock();
+    }
 };
 
 class Lookup {
@@ -250,24 +676,43 @@ class Lookup {
     Recording* _rec;
     MethodMap* _method_map;
     Dictionary* _classes;
-    Dictionary _packages;
-    Dictionary _symbols;
+    // those of the recording, or of the Lookup itself without one
+    Dictionary* _packages;
+    Dictionary* _symbols;
+    // BCI_NATIVE_PC frames of the written traces with their symbols, sorted by method_id
+    std::vector<std::pair<jmethodID, const char*> > _native_pcs;
 
   private:
+    Dictionary _own_packages;
+    Dictionary _own_symbols;
+    std::unordered_map<u32, u32> _own_class_packages;
+    std::unordered_map<u32, u32>* _class_packages;
+
+    bool isWritten(MethodInfo* mi) const {
+        return _rec != NULL && _rec->_incremental_cpool && mi->_written_epoch == _rec->_file_epoch;
+    }
+    void appendKey(Dictionary* dictionary, u32 id, std::string& name);
     void fillNativeMethodInfo(MethodInfo* mi, const char* name, const char* lib_name);
     void cutArguments(char* func);
     void fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_time);
+    bool isThreadSubclass(JNIEnv* jni, jclass method_class, const char* class_name);
     bool has_prefix(const char* str, const char* prefix) const {
         return strncmp(str, prefix, strlen(prefix)) == 0;
     }
 
   public:
-    Lookup(Recording* rec, MethodMap* method_map, Dictionary* classes) :
-        _rec(rec), _method_map(method_map), _classes(classes), _packages(), _symbols() {}
+    // rec is NULL when the frames are resolved for an output other than a JFR recording
+    Lookup(Recording* rec, MethodMap* method_map, Dictionary* classes);
 
     MethodInfo* resolveMethod(ASGCT_CallFrame& frame);
-    u32 getPackage(const char* class_name);
+    void resolveNativePCs(std::map<u32, CallTrace*>& traces);
+    // The package of the class, memoized by class id
+    u32 getPackage(u32 class_id, const char* class_name);
     u32 getSymbol(const char* name);
+    u32 getSymbol(const char* name, size_t length);
+    // Appends the human readable name of the frame, e.g. java/lang/Thread.run; resolveNativePCs() must have
+    // been called with the trace of a BCI_NATIVE_PC frame
+    void appendFrameName(ASGCT_CallFrame& frame, std::string& name);
 };
 
 class FlightRecorder {
@@ -277,17 +722,38 @@ class FlightRecorder {
     Arguments _args;
     Recording* _rec;
 
+    // published with a release store, so that the samplers fan out to them under their own lock;
+    // removed only while all the locks are held
+    Recording* volatile _subscribers[MAX_SUBSCRIBERS];
+
     Error newRecording(bool reset);
+    void recordSample(Recording* rec, int lock_index, int tid, u32 call_trace_id, int event_type, Event* event);
+    // their chunks reference the call traces of the generation about to be rotated
+    void flushSubscribers();
 
   public:
-    FlightRecorder() : _rec(NULL) {}
+    FlightRecorder() : _rec(NULL) {
+        memset((void*)_subscribers, 0, sizeof(_subscribers));
+    }
     Error start(Arguments& args, bool reset);
     void stop();
+    Error subscribe(Arguments& args, Subscription* subscription);
+    // called with all the profiler locks held
+    Error unsubscribe(const char* path);
+    // called before all the profiler locks are taken to retire the chunks, see Recording::holdWriter()
+    void holdWriters(bool with_subscribers);
+    // called with all the profiler locks held; the next dump writes the retired chunks out without them
+    void retireChunks(bool retired_traces);
     Error dump(const char* filename, const int length);
+    Error dump(int fd);
     void flush();
+    void cancelRotation();
     void wallClockEpoch(int lock_index, WallClockEpochEvent* event);
     void recordTraceRoot(int lock_index, int tid, TraceRootEvent* event);
-    void recordQueueTime(int lock_index, int tid, QueueTimeEvent* event);
+    // the context defaults to the one currently set on the thread
+    void recordQueueTime(int lock_index, int tid, QueueTimeEvent* event, const Context* context = NULL);
+    void recordSpanSummary(int lock_index, SpanSummaryEvent* event);
+    void recordVMActivity(int lock_index, int tid, VMActivityEvent* event);
 
     bool active() const {
         return _rec != NULL;
@@ -296,10 +762,18 @@ class FlightRecorder {
     void recordEvent(int lock_index, int tid, u32 call_trace_id,
                      int event_type, Event* event, u64 counter);
 
-    void recordLog(LogLevel level, const char* message, size_t len);
+    void recordLog(int lock_index, LogLevel level, const char* message, size_t len);
 
     void recordDatadogSetting(int lock_index, int length, const char* name, const char* value, const char* unit);
 
+    void collectThreads(std::vector<int>& tids);
+
+    // The writer thread, and with it the governors it cycles, is held off between the two calls
+    void lockWriter();
+    void unlockWriter();
+    // Records the options changed by a reconfigure command as settings taking effect now; called with the writer locked
+    void recordReconfiguration(Arguments& args, long cpu_interval);
+
     void recordHeapUsage(int lock_index, long value, bool live);
 };
 
@@ -0,0 +1,214 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gzipWriter.h"
+
+
+static const size_t MIN_MATCH = 3;
+static const size_t MAX_MATCH = 258;
+static const size_t MAX_DISTANCE = 32768;
+
+static const u16 LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const u8 LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const u16 DISTANCE_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const u8 DISTANCE_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+struct Crc32Table {
+    u32 entries[256];
+
+    Crc32Table() {
+        for (u32 i = 0; i < 256; i++) {
+            u32 c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+static u32 crc32(const u8* data, size_t size) {
+    static const Crc32Table table;
+    u32 crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+static inline u32 hash3(const u8* p, int bits) {
+    return ((p[0] | p[1] << 8 | p[2] << 16) * 2654435761U) >> (32 - bits);
+}
+
+GzipWriter::GzipWriter(int dst_fd) : _dst_fd(dst_fd), _out_used(0), _bits(0), _bit_count(0), _failed(false) {
+    _out = (u8*)malloc(OUT_SIZE);
+    _table = (int*)malloc(sizeof(int) << HASH_BITS);
+}
+
+GzipWriter::~GzipWriter() {
+    free(_out);
+    free(_table);
+}
+
+bool GzipWriter::writeFully(const u8* data, size_t size) {
+    while (size > 0) {
+        ssize_t bytes = ::write(_dst_fd, data, size);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+void GzipWriter::flushOut() {
+    if (!_failed && !writeFully(_out, _out_used)) {
+        _failed = true;
+    }
+    _out_used = 0;
+}
+
+void GzipWriter::putByte(u8 value) {
+    if (_out_used == OUT_SIZE) {
+        flushOut();
+    }
+    _out[_out_used++] = value;
+}
+
+// Deflate packs the bits starting from the least significant one
+void GzipWriter::putBits(u32 value, int count) {
+    _bits |= (u64)value << _bit_count;
+    _bit_count += count;
+    while (_bit_count >= 8) {
+        putByte((u8)_bits);
+        _bits >>= 8;
+        _bit_count -= 8;
+    }
+}
+
+// Huffman codes are the exception, they are packed starting from the most significant bit
+void GzipWriter::putCode(u32 code, int length) {
+    u32 reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = reversed << 1 | ((code >> i) & 1);
+    }
+    putBits(reversed, length);
+}
+
+void GzipWriter::putLiteral(int symbol) {
+    if (symbol < 144) {
+        putCode(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        putCode(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        putCode(symbol - 256, 7);
+    } else {
+        putCode(0xc0 + symbol - 280, 8);
+    }
+}
+
+void GzipWriter::putMatch(size_t length, size_t distance) {
+    int code = 28;
+    while (LENGTH_BASE[code] > length) {
+        code--;
+    }
+    putLiteral(257 + code);
+    putBits(length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+    code = 29;
+    while (DISTANCE_BASE[code] > distance) {
+        code--;
+    }
+    putCode(code, 5);
+    putBits(distance - DISTANCE_BASE[code], DISTANCE_EXTRA[code]);
+}
+
+bool GzipWriter::write(const u8* data, size_t size) {
+    if (_out == NULL || _table == NULL) {
+        return false;
+    }
+    _failed = false;
+    _out_used = 0;
+    _bits = 0;
+    _bit_count = 0;
+
+    // no file name, no modification time, unknown OS
+    static const u8 header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+    for (size_t i = 0; i < sizeof(header); i++) {
+        putByte(header[i]);
+    }
+
+    // BFINAL and the fixed Huffman block type
+    putBits(1, 1);
+    putBits(1, 2);
+    memset(_table, 0xff, sizeof(int) << HASH_BITS);
+    size_t ip = 0;
+    while (ip + MIN_MATCH <= size) {
+        u32 h = hash3(data + ip, HASH_BITS);
+        int ref = _table[h];
+        _table[h] = (int)ip;
+
+        if (ref < 0 || ip - ref > MAX_DISTANCE || memcmp(data + ref, data + ip, MIN_MATCH) != 0) {
+            putLiteral(data[ip++]);
+            continue;
+        }
+
+        size_t limit = size - ip < MAX_MATCH ? size - ip : MAX_MATCH;
+        size_t len = MIN_MATCH;
+        while (len < limit && data[ref + len] == data[ip + len]) {
+            len++;
+        }
+        putMatch(len, ip - ref);
+        // only the start of a match gets into the table, which keeps the encoder close to LZ4 speed
+        ip += len;
+    }
+    while (ip < size) {
+        putLiteral(data[ip++]);
+    }
+    putLiteral(256);
+    if (_bit_count > 0) {
+        putBits(0, 8 - _bit_count);
+    }
+
+    u32 crc = crc32(data, size);
+    u32 isize = (u32)size;
+    for (int i = 0; i < 32; i += 8) {
+        putByte((u8)(crc >> i));
+    }
+    for (int i = 0; i < 32; i += 8) {
+        putByte((u8)(isize >> i));
+    }
+    flushOut();
+    return !_failed;
+}
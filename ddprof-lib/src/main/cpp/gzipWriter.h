@@ -0,0 +1,56 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GZIPWRITER_H
+#define _GZIPWRITER_H
+
+#include <sys/types.h>
+#include "arch.h"
+
+
+// Minimal gzip encoder: a single deflate block with the fixed Huffman codes over greedy LZ77 matches.
+// It compresses profiles several times over without pulling in zlib; every call produces one complete
+// gzip member, which the standard tools decode.
+class GzipWriter {
+  private:
+    static const size_t OUT_SIZE = 64 * 1024;
+    static const int HASH_BITS = 15;
+
+    int _dst_fd;
+    u8* _out;
+    size_t _out_used;
+    int* _table;
+    u64 _bits;
+    int _bit_count;
+    bool _failed;
+
+    bool writeFully(const u8* data, size_t size);
+    void flushOut();
+    void putByte(u8 value);
+    void putBits(u32 value, int count);
+    void putCode(u32 code, int length);
+    void putLiteral(int symbol);
+    void putMatch(size_t length, size_t distance);
+
+  public:
+    GzipWriter(int dst_fd);
+    ~GzipWriter();
+
+    // Compresses 'size' bytes of data into a single gzip member
+    bool write(const u8* data, size_t size);
+};
+
+#endif // _GZIPWRITER_H
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+#include "context.h"
+#include "hotStacks.h"
+#include "log.h"
+#include "tsc.h"
+
+
+// The samples of one stack under one breakdown key
+struct HotStack {
+    u64 key;
+    u32 call_trace_id;
+    u64 samples;
+    u64 counter;
+
+    // as with CallTraceSample, the heap keeps the smallest counter on top
+    bool operator<(const HotStack& other) const {
+        return counter > other.counter;
+    }
+};
+
+struct HotStackKeyHash {
+    size_t operator()(const std::pair<u64, u32>& key) const {
+        return (size_t)((key.first * 0x9e3779b97f4a7c15ULL) ^ key.second);
+    }
+};
+
+void HotStacks::start(Arguments& args) {
+    if (args._hot_stacks && _rings == NULL) {
+        _rings = (Ring*)calloc(CONCURRENCY_LEVEL, sizeof(Ring));
+        if (_rings == NULL) {
+            Log::warn("Unable to allocate the recent sample rings, the hot stacks have no breakdowns");
+        }
+    }
+    _enabled = args._hot_stacks && _rings != NULL;
+}
+
+void HotStacks::stop() {
+    _enabled = false;
+}
+
+void HotStacks::record(int lock_index, int tid, u32 call_trace_id, u32 generation, LossEngine engine, u64 counter) {
+    Ring* ring = &_rings[lock_index];
+    u64 head = ring->head;
+    // the readers must see the previous head, which tells them that this entry may change, before the entry does
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    RecentSample* sample = &ring->samples[head & (RING_SIZE - 1)];
+    sample->ticks = TSC::ticks();
+    sample->counter = counter;
+    sample->root_span_id = Contexts::get(tid).rootSpanId;
+    sample->call_trace_id = call_trace_id;
+    sample->generation = generation;
+    sample->tid = tid;
+    sample->engine = engine;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void HotStacks::snapshot(u32 generation, u64 since_ticks, std::vector<RecentSample>& samples) {
+    std::vector<RecentSample> copy(RING_SIZE);
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        Ring* ring = &_rings[i];
+        u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        u64 start = head > RING_SIZE ? head - RING_SIZE : 0;
+        for (u64 pos = start; pos < head; pos++) {
+            copy[pos - start] = ring->samples[pos & (RING_SIZE - 1)];
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // the writer may have overwritten the entries up to the one at its current head
+        u64 current = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        u64 valid = current >= RING_SIZE && current - RING_SIZE + 1 > start ? current - RING_SIZE + 1 : start;
+        for (u64 pos = valid; pos < head; pos++) {
+            const RecentSample& sample = copy[pos - start];
+            if (sample.generation == generation && sample.call_trace_id != 0 && sample.ticks >= since_ticks) {
+                samples.push_back(sample);
+            }
+        }
+    }
+}
+
+void HotStacks::appendKey(int breakdown, u64 key, std::string& line) {
+    switch (breakdown) {
+        case BREAKDOWN_ENGINE:
+            line += SampleLoss::engineName((LossEngine)key);
+            break;
+        case BREAKDOWN_THREAD:
+            line += "tid=";
+            line += std::to_string(key);
+            break;
+        case BREAKDOWN_CONTEXT:
+            line += "rootspan=";
+            line += std::to_string(key);
+            break;
+    }
+}
+
+Error HotStacks::query(CallTraceStorage* storage, Dictionary* classes, int limit, int breakdown, u64 window_millis,
+                       std::vector<std::string>& lines) {
+    if (limit <= 0) {
+        return Error("The number of hot stacks must be positive");
+    }
+    if (breakdown < BREAKDOWN_NONE || breakdown >= BREAKDOWNS) {
+        return Error("Unknown hot stacks breakdown");
+    }
+    bool from_rings = breakdown != BREAKDOWN_NONE || window_millis > 0;
+    if (from_rings && !_enabled) {
+        return Error("Breakdowns and windows of the hot stacks require the hotstacks option");
+    }
+
+    MutexLocker ml(_query_lock);
+    std::vector<HotStack> top;
+    std::vector<CallTrace*> traces;
+    if (!from_rings) {
+        std::vector<CallTraceSample> samples;
+        if (!storage->topTraces(limit, samples)) {
+            return Error("The call trace storage is being cleared");
+        }
+        for (size_t i = 0; i < samples.size(); i++) {
+            HotStack stack = {0, 0, samples[i].samples, samples[i].counter};
+            top.push_back(stack);
+            traces.push_back(samples[i].trace);
+        }
+    } else {
+        u32 generation = storage->generation();
+        u64 since_ticks = 0;
+        if (window_millis > 0) {
+            u64 now = TSC::ticks();
+            u64 window_ticks = (u64)((double)window_millis * TSC::frequency() / 1000);
+            since_ticks = now > window_ticks ? now - window_ticks : 0;
+        }
+        std::vector<RecentSample> samples;
+        snapshot(generation, since_ticks, samples);
+
+        std::unordered_map<std::pair<u64, u32>, HotStack, HotStackKeyHash> stacks;
+        for (size_t i = 0; i < samples.size(); i++) {
+            const RecentSample& sample = samples[i];
+            u64 key = breakdown == BREAKDOWN_ENGINE ? (u64)sample.engine
+                    : breakdown == BREAKDOWN_THREAD ? (u64)sample.tid
+                    : breakdown == BREAKDOWN_CONTEXT ? sample.root_span_id : 0;
+            HotStack& stack = stacks[std::make_pair(key, sample.call_trace_id)];
+            stack.key = key;
+            stack.call_trace_id = sample.call_trace_id;
+            stack.samples++;
+            stack.counter += sample.counter;
+        }
+
+        for (std::unordered_map<std::pair<u64, u32>, HotStack, HotStackKeyHash>::const_iterator it = stacks.begin();
+             it != stacks.end(); ++it) {
+            if (top.size() < (size_t)limit) {
+                top.push_back(it->second);
+                std::push_heap(top.begin(), top.end());
+            } else if (it->second.counter > top.front().counter) {
+                std::pop_heap(top.begin(), top.end());
+                top.back() = it->second;
+                std::push_heap(top.begin(), top.end());
+            }
+        }
+        std::sort(top.begin(), top.end());
+
+        std::vector<u32> ids;
+        for (size_t i = 0; i < top.size(); i++) {
+            ids.push_back(top[i].call_trace_id);
+        }
+        if (!storage->copyTraces(generation, ids, traces)) {
+            // the traces have just been dumped, the next query starts over with the new generation
+            return Error::OK;
+        }
+    }
+
+    std::map<u32, CallTrace*> resolved;
+    for (size_t i = 0; i < traces.size(); i++) {
+        if (traces[i] != NULL) {
+            resolved[(u32)i] = traces[i];
+        }
+    }
+    // the ids of the class map and of the symbols are only valid for this query
+    _method_map.clearMarks();
+    Lookup lookup(NULL, &_method_map, classes);
+    lookup.resolveNativePCs(resolved);
+
+    std::string line;
+    for (std::map<u32, CallTrace*>::const_iterator it = resolved.begin(); it != resolved.end(); ++it) {
+        const HotStack& stack = top[it->first];
+        CallTrace* trace = it->second;
+        line.clear();
+        appendKey(breakdown, stack.key, line);
+        line += '\t';
+        line += std::to_string(stack.samples);
+        line += '\t';
+        line += std::to_string(stack.counter);
+        line += '\t';
+        for (int j = trace->num_frames - 1; j >= 0; j--) {
+            lookup.appendFrameName(trace->frames[j], line);
+            if (j > 0) {
+                line += ';';
+            }
+        }
+        lines.push_back(line);
+    }
+    for (size_t i = 0; i < traces.size(); i++) {
+        free(traces[i]);
+    }
+    return Error::OK;
+}
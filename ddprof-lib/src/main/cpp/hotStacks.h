@@ -0,0 +1,97 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTACKS_H
+#define _HOTSTACKS_H
+
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "arguments.h"
+#include "callTraceStorage.h"
+#include "dictionary.h"
+#include "flightRecorder.h"
+#include "mutex.h"
+#include "sampleLoss.h"
+
+// How the hottest stacks are keyed, must be kept in sync with JavaProfiler.HotStacksBreakdown
+enum HotStacksBreakdown {
+    BREAKDOWN_NONE,
+    BREAKDOWN_ENGINE,
+    BREAKDOWN_THREAD,
+    BREAKDOWN_CONTEXT,
+    BREAKDOWNS
+};
+
+struct RecentSample {
+    u64 ticks;
+    u64 counter;
+    u64 root_span_id;
+    u32 call_trace_id;
+    u32 generation;
+    int tid;
+    int engine;
+};
+
+// Serves the hottest stacks of a running profiler without waiting for the next dump.
+// The plain top N comes from the counters of the call trace storage, which add up since the last dump.
+// With the hotstacks option, every lock stripe also keeps its most recent samples in a ring, which
+// the breakdowns by engine, thread or local root span and the time windows are computed from.
+// A ring has a single writer, the holder of the stripe lock; the queries read it without any lock
+// and drop the entries which might have been overwritten while they were copied.
+class HotStacks {
+  public:
+    static const u32 RING_SIZE = 4096;
+
+  private:
+    struct Ring {
+        volatile u64 head;
+        RecentSample samples[RING_SIZE];
+    };
+
+    // CONCURRENCY_LEVEL rings, allocated by the first start with the hotstacks option and kept until exit,
+    // so that a query never races with their release
+    Ring* _rings;
+    volatile bool _enabled;
+    // the method map and the lookups are not safe for concurrent queries
+    Mutex _query_lock;
+    MethodMap _method_map;
+
+    void snapshot(u32 generation, u64 since_ticks, std::vector<RecentSample>& samples);
+    static void appendKey(int breakdown, u64 key, std::string& line);
+
+  public:
+    HotStacks() : _rings(NULL), _enabled(false), _query_lock(), _method_map() {
+    }
+
+    bool enabled() {
+        return _enabled;
+    }
+
+    void start(Arguments& args);
+    void stop();
+
+    // Called with the lock of the stripe held
+    void record(int lock_index, int tid, u32 call_trace_id, u32 generation, LossEngine engine, u64 counter);
+
+    // One line per stack, by decreasing counter: the breakdown key, the sample count, the counter
+    // and the frames from the root to the leaf, separated by tabs.
+    // The class map must be held shared, so that it is not cleared while the frames are resolved.
+    Error query(CallTraceStorage* storage, Dictionary* classes, int limit, int breakdown, u64 window_millis,
+                std::vector<std::string>& lines);
+};
+
+#endif // _HOTSTACKS_H
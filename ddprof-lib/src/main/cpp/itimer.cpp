@@ -19,6 +19,7 @@
 #include "itimer.h"
 #include "os.h"
 #include "profiler.h"
+#include "signalLatency.h"
 #include "stackWalker.h"
 #include "thread.h"
 #include "vmStructs.h"
@@ -29,6 +30,7 @@ CStack ITimer::_cstack;
 
 void ITimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (!_enabled) return;
+    u64 entry = SignalLatency::enter();
     int tid = 0;
     ProfiledThread* current = ProfiledThread::current();
     if (current != NULL) {
@@ -48,6 +50,7 @@ void ITimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     }
     Profiler::instance()->recordSample(ucontext, _interval, tid, BCI_CPU, &event);
     Shims::instance().setSighandlerTid(-1);
+    SignalLatency::exit(SIGNAL_ENGINE_ITIMER, entry);
 }
 
 Error ITimer::check(Arguments& args) {
@@ -81,6 +84,17 @@ Error ITimer::start(Arguments& args) {
     return Error::OK;
 }
 
+bool ITimer::setInterval(long interval) {
+    time_t sec = interval / 1000000000;
+    suseconds_t usec = (interval % 1000000000) / 1000;
+    struct itimerval tv = {{sec, usec}, {sec, usec}};
+    if (setitimer(ITIMER_PROF, &tv, NULL) != 0) {
+        return false;
+    }
+    _interval = interval;
+    return true;
+}
+
 void ITimer::stop() {
     struct itimerval tv = {{0, 0}, {0, 0}};
     setitimer(ITIMER_PROF, &tv, NULL);
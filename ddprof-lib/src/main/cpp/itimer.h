@@ -43,6 +43,8 @@ class ITimer : public Engine {
         return _interval;
     }
 
+    bool setInterval(long interval);
+
     Error check(Arguments& args);
     Error start(Arguments& args);
     void stop();
@@ -14,8 +14,11 @@
  * limitations under the License.
  */
 
+#include <math.h>
+#include <random>
 #include <stdlib.h>
 #include "j9WallClock.h"
+#include "counters.h"
 #include "j9Ext.h"
 #include "profiler.h"
 #include "threadState.h"
@@ -39,8 +42,11 @@ Error J9WallClock::start(Arguments& args) {
         return Error("interval must be non-negative");
     }
     _max_stack_depth = args._jstackdepth;
+    _reservoir_size = args._wall_threads_per_tick ? args._wall_threads_per_tick : DEFAULT_WALL_THREADS_PER_TICK;
+    _stacks.clear();
 
     _running = true;
+    _thread_cpu = 0;
 
     if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
         return Error("Unable to create timer thread");
@@ -55,14 +61,27 @@ void J9WallClock::stop() {
     pthread_join(_thread, NULL);
 }
 
+// Walks only the stacks of a random subset of the threads, one by one, rather than all of them at once
+// with GetAllStackTracesExtended, which stops the world for as long as all of them take
 void J9WallClock::timerLoop() {
     JNIEnv* jni = VM::attachThread("java-profiler Sampler");
     jvmtiEnv* jvmti = VM::jvmti();
+    int self = OS::threadId();
 
     int max_frames = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
     ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
 
+    std::mt19937 generator(std::random_device{}());
+    std::uniform_real_distribution<double> uniform(1e-16, 1.0);
+    std::uniform_int_distribution<int> random_index(0, _reservoir_size - 1);
+    std::vector<int> reservoir;
+    reservoir.reserve(_reservoir_size);
+
+    u64 start_time = TSC::ticks();
+    WallClockEpochEvent epoch(start_time);
+
     while (_running) {
+        _thread_cpu = OS::cputime();
         if (!_enabled) {
             OS::sleep(_interval);
             continue;
@@ -70,45 +89,58 @@ void J9WallClock::timerLoop() {
 
         jni->PushLocalFrame(64);
 
-        jvmtiStackInfoExtended* stack_infos;
+        jthread* threads;
         jint thread_count;
-        if (J9Ext::GetAllStackTracesExtended(_max_stack_depth, (void**)&stack_infos, &thread_count) == 0) {
-            for (int i = 0; i < thread_count; i++) {
-                jvmtiStackInfoExtended* si = &stack_infos[i];
-                if (si->frame_count <= 0) {
-                    // no frames recorded
-                    continue;
-                }
-                ThreadState ts = (si->state & JVMTI_THREAD_STATE_RUNNABLE) ? ThreadState::RUNNABLE : ThreadState::SLEEPING;
-                if (!_sample_idle_threads && ts != ThreadState::RUNNABLE) {
-                    // in execution profiler mode the non-running threads are skipped
-                    continue;
-                }
-                for (int j = 0; j < si->frame_count; j++) {
-                    jvmtiFrameInfoExtended* fi = &si->frame_buffer[j];
-                    frames[j].method_id = fi->method;
-                    frames[j].bci = FrameType::encode(fi->type, fi->location);
-                }
+        if (jvmti->GetAllThreads(&thread_count, &threads) == 0) {
+            // the same reservoir sampling as WallClock::timerLoop, over the indices of the threads
+            for (int i = 0; i < _reservoir_size && i < thread_count; i++) {
+                reservoir.push_back(i);
+            }
+            double weight = exp(log(uniform(generator)) / _reservoir_size);
+            int target = _reservoir_size + (int) (log(uniform(generator)) / log(1 - weight));
+            while (target < thread_count) {
+                reservoir[random_index(generator)] = target;
+                weight *= exp(log(uniform(generator)) / _reservoir_size);
+                target += (int) (log(uniform(generator)) / log(1 - weight));
+            }
 
-                int tid = J9Ext::GetOSThreadID(si->thread);
-                if (tid == -1) {
-                    // clearly an invalid TID; skip the thread
-                    continue;
-                }
-                ExecutionEvent event;
-                event._thread_state = ts;
-                if (ts == ThreadState::RUNNABLE) {
-                    Profiler::instance()->recordExternalSample(_interval, tid, si->frame_count, frames, /*truncated=*/false, BCI_CPU, &event);
-                }
-                if (_sample_idle_threads) {
-                    Profiler::instance()->recordExternalSample(_interval, tid, si->frame_count, frames, /*truncated=*/false, BCI_WALL, &event);
+            // the CPU samples of the walked threads stand for the ones of all the threads;
+            // the wall samples are scaled by the epochs instead, as the ones of WallClock
+            u64 cpu_weight = thread_count > _reservoir_size ? (thread_count + _reservoir_size / 2) / _reservoir_size : 1;
+            int failures = 0;
+            for (int index : reservoir) {
+                if (!sampleThread(jvmti, threads[index], self, cpu_weight, frames)) {
+                    failures++;
                 }
             }
-            jvmti->Deallocate((unsigned char*)stack_infos);
+            epoch.updateNumSamplableThreads(thread_count);
+            epoch.updateNumFailedSamples(failures);
+            epoch.updateNumSuccessfulSamples(reservoir.size() - failures);
+            epoch.updateSamplingConfig(_reservoir_size, _interval);
+            reservoir.clear();
+            jvmti->Deallocate((unsigned char*)threads);
+
+            if (_stacks.size() > 2 * (size_t)thread_count + _reservoir_size) {
+                // most of the cached stacks are of threads which have ended since
+                _stacks.clear();
+            }
         }
 
         jni->PopLocalFrame(NULL);
 
+        if (_sample_idle_threads) {
+            u64 end_time = TSC::ticks();
+            u64 duration = TSC::ticks_to_millis(end_time - start_time);
+            if (epoch.hasChanged() || duration >= 1000) {
+                epoch.endEpoch(duration);
+                Profiler::instance()->recordWallClockEpoch(self, &epoch);
+                epoch.newEpoch(end_time);
+                start_time = end_time;
+            } else {
+                epoch.clean();
+            }
+        }
+
         OS::sleep(_interval);
     }
 
@@ -116,3 +148,65 @@ void J9WallClock::timerLoop() {
 
     VM::detachThread();
 }
+
+bool J9WallClock::sampleThread(jvmtiEnv* jvmti, jthread thread, int self, u64 cpu_weight, ASGCT_CallFrame* frames) {
+    jint state;
+    if (jvmti->GetThreadState(thread, &state) != 0 || (state & JVMTI_THREAD_STATE_ALIVE) == 0) {
+        return false;
+    }
+    ThreadState ts = (state & JVMTI_THREAD_STATE_RUNNABLE) ? ThreadState::RUNNABLE : ThreadState::SLEEPING;
+    if (!_sample_idle_threads && ts != ThreadState::RUNNABLE) {
+        // in execution profiler mode the non-running threads are skipped
+        return true;
+    }
+    int tid = J9Ext::GetOSThreadID(thread);
+    if (tid == -1) {
+        // clearly an invalid TID; skip the thread
+        return false;
+    }
+    if (tid == self) {
+        return true;
+    }
+    jint num_frames;
+    if (J9Ext::GetStackTrace(thread, 0, _max_stack_depth, frames, &num_frames) != 0) {
+        return false;
+    }
+    if (num_frames <= 0) {
+        // no frames recorded
+        return true;
+    }
+
+    J9CachedStack& cached = _stacks[tid];
+    bool unchanged = cached.call_trace_id != 0 && cached.frames.size() == (size_t)num_frames;
+    for (int i = 0; unchanged && i < num_frames; i++) {
+        unchanged = cached.frames[i].method_id == frames[i].method_id && cached.frames[i].bci == frames[i].bci;
+    }
+
+    Profiler* profiler = Profiler::instance();
+    ExecutionEvent event;
+    event._thread_state = ts;
+    for (int i = 0; i < 2; i++) {
+        jint event_type = i == 0 ? BCI_CPU : BCI_WALL;
+        if (event_type == BCI_CPU ? ts != ThreadState::RUNNABLE : !_sample_idle_threads) {
+            continue;
+        }
+        event._weight = event_type == BCI_CPU ? cpu_weight : 1;
+        u64 counter = _interval * event._weight;
+        // an unchanged stack is not hashed and looked up again, as long as its id is still valid
+        if (unchanged && profiler->recordCachedSample(counter, tid, cached.call_trace_id, cached.generation, event_type, &event)) {
+            if (event_type == BCI_WALL) {
+                Counters::increment(WALL_STACKS_REUSED);
+            }
+            continue;
+        }
+        u32 generation;
+        u32 call_trace_id = profiler->recordExternalSample(counter, tid, num_frames, frames, /*truncated=*/false, event_type, &event, &generation);
+        if (call_trace_id != 0) {
+            cached.call_trace_id = call_trace_id;
+            cached.generation = generation;
+            cached.frames.assign(frames, frames + num_frames);
+            unchanged = true;
+        }
+    }
+    return true;
+}
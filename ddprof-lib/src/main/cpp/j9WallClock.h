@@ -18,9 +18,19 @@
 #define _J9WALLCLOCK_H
 
 #include <pthread.h>
+#include <unordered_map>
+#include <vector>
 #include "engine.h"
+#include "vmEntry.h"
 
 
+// The last stack recorded for a thread, which is not stored again while it stays the same
+struct J9CachedStack {
+    u32 call_trace_id;
+    u32 generation;
+    std::vector<ASGCT_CallFrame> frames;
+};
+
 class J9WallClock : public Engine {
   private:
     static volatile bool _enabled;
@@ -28,8 +38,13 @@ class J9WallClock : public Engine {
 
     bool _sample_idle_threads;
     int _max_stack_depth;
+    // threads walked per interval, picked at random like the ones signalled by WallClock
+    int _reservoir_size;
+    // by tid, only touched by the timer thread
+    std::unordered_map<int, J9CachedStack> _stacks;
     volatile bool _running;
     pthread_t _thread;
+    volatile u64 _thread_cpu;
 
     static void* threadEntry(void* wall_clock) {
         ((J9WallClock*)wall_clock)->timerLoop();
@@ -37,6 +52,8 @@ class J9WallClock : public Engine {
     }
 
     void timerLoop();
+    // false if the thread has ended or could not be walked
+    bool sampleThread(jvmtiEnv* jvmti, jthread thread, int self, u64 weight, ASGCT_CallFrame* frames);
 
   public:
 
@@ -52,6 +69,12 @@ class J9WallClock : public Engine {
         return _interval;
     }
 
+    bool setInterval(long interval) {
+        // picked up by the sampling loop on its next sleep
+        _interval = interval;
+        return true;
+    }
+
     inline void sampleIdleThreads() {
       _sample_idle_threads = true;
     }
@@ -59,6 +82,10 @@ class J9WallClock : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    u64 samplerCpuTime() {
+        return _thread_cpu;
+    }
+
     inline void enableEvents(bool enabled) {
       _enabled = enabled;
     }
@@ -23,6 +23,7 @@
 #include "incbin.h"
 #include "os.h"
 #include "profiler.h"
+#include "queueTimeFilter.h"
 #include "vmStructs.h"
 #include "context.h"
 #include "engine.h"
@@ -135,6 +136,16 @@ Java_com_datadoghq_profiler_JavaProfiler_getContextPageOffset0(JNIEnv* env, jobj
     return (jlong) page.storage;
 }
 
+extern "C" DLLEXPORT jint JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_getContextSlotSize0(JNIEnv* env, jobject unused) {
+    return (jint) Contexts::slotSize();
+}
+
+extern "C" DLLEXPORT jint JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_getContextCapacity0(JNIEnv* env, jobject unused) {
+    return (jint) Contexts::capacity();
+}
+
 extern "C" DLLEXPORT jint JNICALL
 Java_com_datadoghq_profiler_JavaProfiler_getMaxContextPages0(JNIEnv* env, jobject unused) {
     return (jint) Contexts::getMaxPages();
@@ -144,7 +155,7 @@ extern "C" DLLEXPORT jboolean JNICALL
 Java_com_datadoghq_profiler_JavaProfiler_recordTrace0(JNIEnv* env, jobject unused, jlong rootSpanId, jstring endpoint,
                                                       jint sizeLimit) {
     JniString endpoint_str(env, endpoint);
-    u32 label = Profiler::instance()->stringLabelMap()->bounded_lookup(endpoint_str.c_str(), endpoint_str.length(), sizeLimit);
+    u32 label = Profiler::instance()->stringLabelMap()->lookup(endpoint_str.c_str(), endpoint_str.length(), sizeLimit);
     bool acceptValue = label != INT_MAX;
     if (acceptValue) {
         TraceRootEvent event(rootSpanId, label);
@@ -167,13 +178,90 @@ Java_com_datadoghq_profiler_JavaProfiler_dump0(JNIEnv* env, jobject unused, jstr
     Profiler::instance()->dump(path_str.c_str(), path_str.length());
 }
 
+extern "C" DLLEXPORT void JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_dumpFd0(JNIEnv* env, jobject unused, jobject fd_object) {
+    jclass fd_class = env->GetObjectClass(fd_object);
+    jfieldID fd_field = env->GetFieldID(fd_class, "fd", "I");
+    if (fd_field == NULL) {
+        // the pending NoSuchFieldError is propagated to the caller
+        return;
+    }
+    Error error = Profiler::instance()->dump(env->GetIntField(fd_object, fd_field));
+    if (error) {
+        throwNew(env, "java/lang/IllegalStateException", error.message());
+    }
+}
+
 extern "C" DLLEXPORT jobject JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_dumpMemory0(JNIEnv* env, jobject unused) {
+    void* data = NULL;
+    size_t size = 0;
+    Error error = Profiler::instance()->dumpToMemory(&data, &size);
+    if (error) {
+        throwNew(env, "java/lang/IllegalStateException", error.message());
+        return NULL;
+    }
+    jobject buffer = env->NewDirectByteBuffer(data, size);
+    if (buffer == NULL) {
+        Profiler::instance()->releaseDump(data, size);
+    }
+    return buffer;
+}
+
+extern "C" DLLEXPORT void JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_releaseDump0(JNIEnv* env, jobject unused, jobject buffer) {
+    void* data = env->GetDirectBufferAddress(buffer);
+    if (data != NULL) {
+        Profiler::instance()->releaseDump(data, env->GetDirectBufferCapacity(buffer));
+    }
+}
+
+extern "C" DLLEXPORT jobjectArray JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_getHotStacks0(JNIEnv* env, jobject unused, jint limit, jint breakdown, jlong window_millis) {
+    std::vector<std::string> lines;
+    Error error = Profiler::instance()->hotStacks(limit, breakdown, window_millis > 0 ? (u64)window_millis : 0, lines);
+    if (error) {
+        throwNew(env, "java/lang/IllegalStateException", error.message());
+        return NULL;
+    }
+    jobjectArray array = env->NewObjectArray(lines.size(), env->FindClass("java/lang/String"), NULL);
+    for (size_t i = 0; array != NULL && i < lines.size(); i++) {
+        jstring line = env->NewStringUTF(lines[i].c_str());
+        env->SetObjectArrayElement(array, i, line);
+        env->DeleteLocalRef(line);
+    }
+    return array;
+}
+
+extern "C" DLLEXPORT jlong JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_dumpAsync0(JNIEnv* env, jobject unused, jstring path) {
+    JniString path_str(env, path);
+    u64 id = Profiler::instance()->chunkWriter()->submit(path_str.c_str(), path_str.length());
+    if (id == 0) {
+        throwNew(env, "java/lang/IllegalStateException", "Unable to start the chunk writer");
+    }
+    return (jlong)id;
+}
+
+extern "C" DLLEXPORT jboolean JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_awaitDump0(JNIEnv* env, jobject unused, jlong id, jlong timeout_millis) {
+    const char* error = NULL;
+    bool done = Profiler::instance()->chunkWriter()->await((u64)id, (long)timeout_millis, &error);
+    if (error != NULL) {
+        throwNew(env, "java/lang/IllegalStateException", error);
+    }
+    return done;
+}
+
+extern "C" DLLEXPORT jlongArray JNICALL
 Java_com_datadoghq_profiler_JavaProfiler_getDebugCounters0(JNIEnv* env, jobject unused) {
-    #ifdef COUNTERS
-    return env->NewDirectByteBuffer((void*) Counters::getCounters(), (jlong) Counters::size());
-    #else
-    return env->NewDirectByteBuffer(nullptr, 0);
-    #endif // COUNTERS
+    // the shards are folded here, so the values can not be exposed as a view over the native memory
+    std::vector<long long> values = Counters::values();
+    jlongArray array = env->NewLongArray(values.size());
+    if (array != NULL && !values.empty()) {
+        env->SetLongArrayRegion(array, 0, values.size(), (const jlong*) values.data());
+    }
+    return array;
 }
 
 extern "C" DLLEXPORT jobjectArray JNICALL
@@ -215,6 +303,10 @@ Java_com_datadoghq_profiler_JavaProfiler_recordQueueEnd0(JNIEnv* env, jobject un
     if (tid < 0) {
         return;
     }
+    u32 weight = QueueTimeFilter::weight(startTime, endTime);
+    if (weight == 0) {
+        return;
+    }
     int origin_tid = VMThread::nativeThreadId(env, origin);
     if (origin_tid < 0) {
         return;
@@ -229,15 +321,124 @@ Java_com_datadoghq_profiler_JavaProfiler_recordQueueEnd0(JNIEnv* env, jobject un
     event._task = task_offset;
     event._scheduler = scheduler_offset;
     event._origin = origin_tid;
+    event._weight = weight;
     Profiler::instance()->recordQueueTime(tid, &event);
 }
 
+// Layout of a batch record, must be kept in sync with EventBatch.java
+static const int BATCH_RECORD_SIZE = 56;
+// records are resolved and recorded this many at a time
+static const int BATCH_CHUNK = 64;
+
+static inline u32 batchU32(const char* record, int offset) {
+    u32 value;
+    memcpy(&value, record + offset, sizeof(value));
+    return value;
+}
+
+static inline u64 batchU64(const char* record, int offset) {
+    u64 value;
+    memcpy(&value, record + offset, sizeof(value));
+    return value;
+}
+
+// Resolves a string registered with registerConstant0
+static inline const char* batchString(u32 id, size_t* length) {
+    const char* key = Profiler::instance()->contextValueMap()->key(id, length);
+    if (key == NULL) {
+        *length = 0;
+        return "";
+    }
+    return key;
+}
+
+extern "C" DLLEXPORT jint JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_recordBatch0(JNIEnv* env, jobject unused, jobject buffer, jint count) {
+    int tid = ProfiledThread::currentTid();
+    const char* data = (const char*) env->GetDirectBufferAddress(buffer);
+    if (tid < 0 || data == NULL || count <= 0) {
+        return 0;
+    }
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if ((jlong) count * BATCH_RECORD_SIZE > capacity) {
+        count = (jint) (capacity / BATCH_RECORD_SIZE);
+    }
+
+    Profiler* profiler = Profiler::instance();
+    BatchedEvent events[BATCH_CHUNK];
+    int recorded = 0;
+    for (int i = 0; i < count; ) {
+        // strings are resolved before the batch takes the recording lock
+        int n = 0;
+        for (; i < count && n < BATCH_CHUNK; i++) {
+            const char* record = data + (size_t) i * BATCH_RECORD_SIZE;
+            BatchedEvent* event = &events[n];
+            event->_type = (BatchedEventType) batchU32(record, 0);
+            event->_tid = (int) batchU32(record, 4);
+            size_t length;
+            switch (event->_type) {
+                case BATCHED_TRACE_ROOT: {
+                    const char* endpoint = batchString(batchU32(record, 16), &length);
+                    event->_root_span_id = batchU64(record, 8);
+                    event->_label = profiler->stringLabelMap()->lookup(endpoint, length, (int) batchU32(record, 20));
+                    if (event->_label == INT_MAX) {
+                        continue;
+                    }
+                    break;
+                }
+                case BATCHED_QUEUE_TIME: {
+                    event->_queue_time._start = batchU64(record, 8);
+                    event->_queue_time._end = batchU64(record, 16);
+                    event->_queue_time._weight = QueueTimeFilter::weight(event->_queue_time._start,
+                                                                         event->_queue_time._end);
+                    if (event->_queue_time._weight == 0) {
+                        continue;
+                    }
+                    event->_span_id = batchU64(record, 24);
+                    event->_root_span_id = batchU64(record, 32);
+                    const char* task = batchString(batchU32(record, 40), &length);
+                    event->_queue_time._task = profiler->lookupClass(task, length);
+                    const char* scheduler = batchString(batchU32(record, 44), &length);
+                    event->_queue_time._scheduler = profiler->lookupClass(scheduler, length);
+                    event->_queue_time._origin = batchU32(record, 48);
+                    break;
+                }
+                case BATCHED_SETTING: {
+                    event->_length = 0;
+                    for (int s = 0; s < 3; s++) {
+                        event->_strings[s] = batchString(batchU32(record, 8 + s * 4), &length);
+                        event->_length += length;
+                    }
+                    break;
+                }
+                default:
+                    continue;
+            }
+            n++;
+        }
+        recorded += profiler->recordBatch(tid, events, n);
+    }
+    return recorded;
+}
+
 extern "C" DLLEXPORT jlong JNICALL
 Java_com_datadoghq_profiler_JavaProfiler_currentTicks0(JNIEnv* env, jobject unused) {
     return TSC::ticks();
 }
 
+extern "C" DLLEXPORT jobject JNICALL
+Java_com_datadoghq_profiler_JavaProfiler_tscPage0(JNIEnv* env, jobject unused) {
+    return env->NewDirectByteBuffer((void*) TSC::page(), (jlong) sizeof(TSCPage));
+}
+
+// Critical natives: JDKs with -XX:+CriticalJNINatives (up to 17) call these from compiled code
+// without the JNIEnv and class arguments and without a full thread state transition.
+extern "C" DLLEXPORT jint JNICALL
+JavaCritical_com_datadoghq_profiler_JavaProfiler_getTid0() {
+    return OS::threadId();
+}
+
 extern "C" DLLEXPORT jlong JNICALL
-Java_com_datadoghq_profiler_JavaProfiler_tscFrequency0(JNIEnv* env, jobject unused) {
-    return TSC::frequency();
+JavaCritical_com_datadoghq_profiler_JavaProfiler_currentTicks0() {
+    return TSC::ticks();
 }
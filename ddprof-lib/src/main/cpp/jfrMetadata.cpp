@@ -116,6 +116,27 @@ void JfrMetadata::initialize(const std::vector<std::string>& contextAttributes)
                 << field("localRootSpanId", T_LONG, "Local Root Span ID")
                 || contextAttributes)
 
+            // Follows the ExecutionSample of the same thread and stack trace in the pmucounters mode;
+            // a counter unavailable to the thread, e.g. in a virtual machine, is -1
+            << (type("datadog.PmuSample", T_PMU_SAMPLE, "Hardware Counters Sample")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("cycles", T_LONG, "CPU Cycles")
+                << field("instructions", T_LONG, "Instructions")
+                << field("cacheMisses", T_LONG, "Cache Misses")
+                << field("branchMisses", T_LONG, "Branch Misses"))
+
+            << (type("datadog.MemoryAccessSample", T_MEMORY_ACCESS_SAMPLE, "Memory Access Sample")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("address", T_LONG, "Data Address", F_ADDRESS)
+                << field("latency", T_LONG, "Access Latency in Cycles")
+                << field("dataSource", T_LONG, "Data Source"))
+
             << (type("datadog.MethodSample", T_METHOD_SAMPLE, "Method Wall Profiling Sample")
                 << category("Datadog", "Profiling")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -128,6 +149,38 @@ void JfrMetadata::initialize(const std::vector<std::string>& contextAttributes)
                 << field("localRootSpanId", T_LONG, "Local Root Span ID")
                 || contextAttributes)
 
+            // Compact samples (jfr option COMPACT_SAMPLES) carry the time as a delta to the closest preceding
+            // SampleTimeBase in the chunk and have the context of the last ContextChange of their thread
+            << (type("datadog.SampleTimeBase", T_SAMPLE_TIME_BASE, "Sample Time Base")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS))
+
+            << (type("datadog.CompactExecutionSample", T_COMPACT_EXECUTION_SAMPLE, "Compact Method CPU Profiling Sample")
+                << category("Datadog", "Profiling")
+                << field("startTimeDelta", T_LONG, "Start Time Delta", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
+                << field("mode", T_EXECUTION_MODE, "Execution Mode", F_CPOOL)
+                << field("weight", T_LONG, "Sample weight"))
+
+            << (type("datadog.CompactMethodSample", T_COMPACT_METHOD_SAMPLE, "Compact Method Wall Profiling Sample")
+                << category("Datadog", "Profiling")
+                << field("startTimeDelta", T_LONG, "Start Time Delta", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
+                << field("mode", T_EXECUTION_MODE, "Execution Mode", F_CPOOL)
+                << field("weight", T_LONG, "Sample weight"))
+
+            << (type("datadog.ContextChange", T_CONTEXT_CHANGE, "Context Change")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Thread", F_CPOOL)
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
             << (type("datadog.WallClockSamplingEpoch", T_WALLCLOCK_SAMPLE_EPOCH, "WallClock Sampling Epoch")
                 << category("Datadog", "Profiling")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -136,7 +189,31 @@ void JfrMetadata::initialize(const std::vector<std::string>& contextAttributes)
                 << field("numSuccessfulSamples", T_INT, "Number of Successful Samples")
                 << field("numFailedSamples", T_INT, "Number of Failed Samples")
                 << field("numExitedThreads", T_INT, "Number of Exited Threads Before Handling Signal")
-                << field("numPermissionDenied", T_INT, "Number of Permission Denied Errors"))
+                << field("numPermissionDenied", T_INT, "Number of Permission Denied Errors")
+                << field("maxTickLag", T_LONG, "Maximum Tick Lag", F_DURATION_NANOS)
+                << field("maxSignalDuration", T_LONG, "Maximum Signal Delivery Duration", F_DURATION_NANOS)
+                << field("reservoirSize", T_INT, "Threads Sampled per Tick of the Shard")
+                << field("samplingInterval", T_LONG, "Sampling Interval", F_DURATION_NANOS)
+                << field("shard", T_INT, "Sampler Shard"))
+
+            << (type("datadog.MemoryGovernorAction", T_MEMORY_GOVERNOR, "Profiler Memory Governor Action")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("level", T_INT, "Degradation Level")
+                << field("action", T_STRING, "Action")
+                << field("footprint", T_LONG, "Native Footprint", F_BYTES)
+                << field("budget", T_LONG, "Memory Budget", F_BYTES))
+
+            << (type("datadog.SignalLatency", T_SIGNAL_LATENCY, "Profiling Signal Latency")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("engine", T_STRING, "Engine")
+                << field("samples", T_LONG, "Handled Signals")
+                << field("handlerTime", T_LONG, "Total Handler Time", F_DURATION_NANOS)
+                << field("maxHandlerTime", T_LONG, "Maximum Handler Time", F_DURATION_NANOS)
+                << field("delivered", T_LONG, "Timed Deliveries")
+                << field("deliveryTime", T_LONG, "Total Delivery Latency", F_DURATION_NANOS)
+                << field("maxDeliveryTime", T_LONG, "Maximum Delivery Latency", F_DURATION_NANOS))
 
             << (type("datadog.ObjectSample", T_ALLOC, "Allocation sample")
                 << category("Datadog", "Profiling")
@@ -150,6 +227,18 @@ void JfrMetadata::initialize(const std::vector<std::string>& contextAttributes)
                 << field("localRootSpanId", T_LONG, "Local Root Span ID")
                 || contextAttributes)
 
+            << (type("datadog.ObjectAllocationSummary", T_ALLOC_SUMMARY, "Allocation Summary")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
+                << field("samples", T_LONG, "Samples", F_UNSIGNED)
+                << field("size", T_LONG, "Estimated Size", F_BYTES)
+                << field("weight", T_FLOAT, "Estimated Count")
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
             << (type("datadog.HeapLiveObject", T_HEAP_LIVE_OBJECT, "Heap Live Object")
                 << category("Datadog", "Profiling")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -163,6 +252,69 @@ void JfrMetadata::initialize(const std::vector<std::string>& contextAttributes)
                 << field("localRootSpanId", T_LONG, "Local Root Span ID")
                 || contextAttributes)
 
+            << (type("datadog.HeapLiveObjectSummary", T_HEAP_LIVE_SUMMARY, "Heap Live Object Summary")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
+                << field("age", T_LONG, "Minimum Age", F_UNSIGNED)
+                << field("samples", T_LONG, "Samples", F_UNSIGNED)
+                << field("size", T_LONG, "Estimated Size", F_BYTES)
+                << field("weight", T_FLOAT, "Estimated Count"))
+
+            << (type("datadog.JavaMonitorEnter", T_MONITOR_ENTER, "Java Monitor Blocked")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("monitorClass", T_CLASS, "Monitor Class", F_CPOOL)
+                << field("previousOwner", T_THREAD, "Previous Monitor Owner", F_CPOOL)
+                << field("address", T_LONG, "Monitor Address", F_ADDRESS)
+                << field("weight", T_FLOAT, "Sample weight")
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
+            << (type("datadog.ThreadPark", T_THREAD_PARK, "Java Thread Park")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("parkedClass", T_CLASS, "Class Parked On", F_CPOOL)
+                << field("timeout", T_LONG, "Park Timeout", F_DURATION_NANOS)
+                << field("until", T_LONG, "Park Until", F_TIME_MILLIS)
+                << field("address", T_LONG, "Address of Object Parked", F_ADDRESS)
+                << field("weight", T_FLOAT, "Sample weight")
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
+            << (type("datadog.NativeAllocationSample", T_MALLOC, "Native Allocation Sample")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("address", T_LONG, "Address", F_ADDRESS)
+                << field("size", T_LONG, "Size", F_BYTES)
+                << field("weight", T_FLOAT, "Sample weight")
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
+            << (type("datadog.NativeLiveObject", T_NATIVE_LIVE_OBJECT, "Native Live Object")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("address", T_LONG, "Address", F_ADDRESS)
+                << field("size", T_LONG, "Size", F_BYTES)
+                << field("weight", T_FLOAT, "Sample weight")
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
             << (type("datadog.Endpoint", T_ENDPOINT, "Endpoint")
                 << category("Datadog")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -180,6 +332,75 @@ void JfrMetadata::initialize(const std::vector<std::string>& contextAttributes)
                 << field("origin", T_THREAD, "Origin Thread", F_CPOOL)
                 << field("task", T_CLASS, "Task", F_CPOOL)
                 << field("scheduler", T_CLASS, "Scheduler", F_CPOOL)
+                << field("weight", T_FLOAT, "Sample weight")
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                || contextAttributes)
+
+            << (type("datadog.SpanSummary", T_SPAN_SUMMARY, "Span Summary")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("spanId", T_LONG, "Span ID")
+                << field("localRootSpanId", T_LONG, "Local Root Span ID")
+                << field("cpuSamples", T_LONG, "CPU Samples", F_UNSIGNED)
+                << field("cpuTime", T_LONG, "CPU Time", F_DURATION_NANOS)
+                << field("wallSamples", T_LONG, "Wall Samples", F_UNSIGNED)
+                << field("wallTime", T_LONG, "Wall Time", F_DURATION_NANOS))
+
+            << (type("datadog.ProfilerOverhead", T_PROFILER_OVERHEAD, "Profiler Overhead")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("itimerHandlerTime", T_LONG, "itimer Handler Time", F_DURATION_NANOS)
+                << field("perfHandlerTime", T_LONG, "perf_events Handler Time", F_DURATION_NANOS)
+                << field("ctimerHandlerTime", T_LONG, "ctimer Handler Time", F_DURATION_NANOS)
+                << field("wallHandlerTime", T_LONG, "Wall Clock Handler Time", F_DURATION_NANOS)
+                << field("samplerCpuTime", T_LONG, "Sampler Thread CPU Time", F_DURATION_NANOS)
+                << field("stackTracesCpuTime", T_LONG, "Stack Trace Serialization CPU Time", F_DURATION_NANOS)
+                << field("methodsCpuTime", T_LONG, "Method Serialization CPU Time", F_DURATION_NANOS)
+                << field("classesCpuTime", T_LONG, "Class Serialization CPU Time", F_DURATION_NANOS)
+                << field("threadsCpuTime", T_LONG, "Thread Serialization CPU Time", F_DURATION_NANOS)
+                << field("constantPoolCpuTime", T_LONG, "Constant Pool CPU Time", F_DURATION_NANOS)
+                << field("nativeMemory", T_LONG, "Native Memory", F_BYTES))
+
+            << (type("datadog.SampleLoss", T_SAMPLE_LOSS, "Sample Loss")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("engine", T_STRING, "Engine")
+                << field("lockContention", T_LONG, "Dropped On Lock Contention")
+                << field("storageOverflow", T_LONG, "Stacks Lost To Storage Overflow")
+                << field("unwindBusy", T_LONG, "Java Stacks Lost To Reentrant Unwinding")
+                << field("unwindFailed", T_LONG, "Java Stacks Lost To Unwinding Failures")
+                << field("signalFailed", T_LONG, "Undelivered Signals")
+                << field("tableOverflow", T_LONG, "Dropped On Tracking Table Overflow"))
+
+            << (type("datadog.Safepoint", T_SAFEPOINT, "Safepoint")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS))
+
+            << (type("datadog.GCPause", T_GC_PAUSE, "GC Pause")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS))
+
+            << (type("datadog.Compilation", T_COMPILATION, "Compiled Method Load")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("method", T_STRING, "Compiled Method")
+                << field("codeSize", T_LONG, "Code Size", F_BYTES))
+
+            // The episodes a thread spent off CPU with one stack trace, context and state, summed up over a chunk
+            << (type("datadog.OffCpuSample", T_OFF_CPU_SAMPLE, "Off-CPU Sample")
+                << category("Datadog", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
+                << field("mode", T_EXECUTION_MODE, "Execution Mode", F_CPOOL)
+                << field("count", T_LONG, "Episodes", F_UNSIGNED)
+                << field("duration", T_LONG, "Off-CPU Time", F_DURATION_NANOS)
                 << field("spanId", T_LONG, "Span ID")
                 << field("localRootSpanId", T_LONG, "Local Root Span ID")
                 || contextAttributes)
@@ -78,6 +78,25 @@ enum JfrType {
     T_QUEUE_TIME = 123,
     T_DATADOG_CLASSREF_CACHE = 124,
     T_DATADOG_COUNTER = 125,
+    T_COMPACT_EXECUTION_SAMPLE = 126,
+    T_COMPACT_METHOD_SAMPLE = 127,
+    T_SAMPLE_TIME_BASE = 128,
+    T_CONTEXT_CHANGE = 129,
+    T_SIGNAL_LATENCY = 130,
+    T_PMU_SAMPLE = 131,
+    T_MEMORY_ACCESS_SAMPLE = 132,
+    T_MALLOC = 133,
+    T_NATIVE_LIVE_OBJECT = 134,
+    T_ALLOC_SUMMARY = 135,
+    T_HEAP_LIVE_SUMMARY = 136,
+    T_MEMORY_GOVERNOR = 137,
+    T_SPAN_SUMMARY = 138,
+    T_PROFILER_OVERHEAD = 139,
+    T_SAMPLE_LOSS = 140,
+    T_SAFEPOINT = 141,
+    T_GC_PAUSE = 142,
+    T_COMPILATION = 143,
+    T_OFF_CPU_SAMPLE = 144,
     T_ANNOTATION = 200,
     T_LABEL = 201,
     T_CATEGORY = 202,
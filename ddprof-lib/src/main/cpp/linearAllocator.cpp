@@ -21,25 +21,105 @@
 
 LinearAllocator::LinearAllocator(size_t chunk_size) {
     _chunk_size = chunk_size;
+    _spare = NULL;
+    _orphans = NULL;
+    _retained = 1;
+    _recent_peak = 0;
+    _low_generations = 0;
+    _prefault = false;
+    _huge_pages = false;
     _reserve = _tail = allocateChunk(NULL);
 }
 
 LinearAllocator::~LinearAllocator() {
-    clear();
+    release();
     freeChunk(_tail);
 }
 
+void LinearAllocator::configure(bool prefault, bool huge_pages) {
+    _prefault = prefault;
+    _huge_pages = huge_pages;
+}
+
 void LinearAllocator::clear() {
+    // Unlink all the chunks of this generation but the first one
+    Chunk* unlinked = _orphans;
+    int used = 1;
+    _orphans = NULL;
     if (_reserve->prev == _tail) {
-        freeChunk(_reserve);
+        _reserve->prev = unlinked;
+        unlinked = _reserve;
+        used++;
     }
     while (_tail->prev != NULL) {
         Chunk* current = _tail;
         _tail = _tail->prev;
-        freeChunk(current);
+        current->prev = unlinked;
+        unlinked = current;
+        used++;
     }
     _reserve = _tail;
     _tail->offs = sizeof(Chunk);
+    retainChunks(unlinked, used);
+}
+
+void LinearAllocator::release() {
+    clear();
+    while (_spare != NULL) {
+        freeChunk(takeSpareChunk());
+    }
+    _retained = 1;
+    _recent_peak = 0;
+    _low_generations = 0;
+}
+
+// Keeps as many chunks mapped as the busiest of the recent generations needed, so that the next one
+// does not have to map and fault in fresh memory from signal handlers.
+// The pool shrinks only after ARENA_RELEASE_GENERATIONS consecutive generations that used less.
+void LinearAllocator::retainChunks(Chunk* chunks, int used) {
+    if (used >= _retained) {
+        _retained = used;
+        _recent_peak = 0;
+        _low_generations = 0;
+    } else {
+        if (used > _recent_peak) {
+            _recent_peak = used;
+        }
+        if (++_low_generations >= ARENA_RELEASE_GENERATIONS) {
+            _retained = _recent_peak;
+            _recent_peak = 0;
+            _low_generations = 0;
+        }
+    }
+
+    Chunk* spare = _spare;
+    while (chunks != NULL) {
+        Chunk* current = chunks;
+        chunks = chunks->prev;
+        current->prev = spare;
+        spare = current;
+    }
+
+    // The first chunk counts towards the retained ones
+    Chunk* kept = NULL;
+    for (int count = 1; spare != NULL; count++) {
+        Chunk* current = spare;
+        spare = spare->prev;
+        if (count < _retained) {
+            current->prev = kept;
+            kept = current;
+        } else {
+            freeChunk(current);
+        }
+    }
+    _spare = kept;
+
+    if (_prefault) {
+        OS::prefault(_tail, _chunk_size);
+        for (Chunk* current = kept; current != NULL; current = current->prev) {
+            OS::prefault(current, _chunk_size);
+        }
+    }
 }
 
 void* LinearAllocator::alloc(size_t size) {
@@ -62,16 +142,45 @@ void* LinearAllocator::alloc(size_t size) {
 }
 
 Chunk* LinearAllocator::allocateChunk(Chunk* current) {
-    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size);
-    if (chunk != NULL) {
-        chunk->prev = current;
-        chunk->offs = sizeof(Chunk);
+    Chunk* chunk = takeSpareChunk();
+    if (chunk == NULL) {
+        chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        if (_huge_pages) {
+            OS::adviseHugePages(chunk, _chunk_size);
+        }
         Counters::increment(LINEAR_ALLOCATOR_BYTES, _chunk_size);
         Counters::increment(LINEAR_ALLOCATOR_CHUNKS);
     }
+    chunk->prev = current;
+    chunk->offs = sizeof(Chunk);
+    return chunk;
+}
+
+Chunk* LinearAllocator::takeSpareChunk() {
+    // No ABA here: spare chunks are neither freed nor given back while allocating
+    Chunk* chunk;
+    do {
+        chunk = _spare;
+        if (chunk == NULL) {
+            return NULL;
+        }
+    } while (!__sync_bool_compare_and_swap(&_spare, chunk, chunk->prev));
     return chunk;
 }
 
+void LinearAllocator::orphanChunk(Chunk* current) {
+    // Another thread may still be reading its prev link if it came from the spare list,
+    // so it stays mapped until the next clear()
+    Chunk* orphans;
+    do {
+        orphans = _orphans;
+        current->prev = orphans;
+    } while (!__sync_bool_compare_and_swap(&_orphans, orphans, current));
+}
+
 void LinearAllocator::freeChunk(Chunk* current) {
     OS::safeFree(current, _chunk_size);
     Counters::decrement(LINEAR_ALLOCATOR_BYTES, _chunk_size);
@@ -82,7 +191,7 @@ void LinearAllocator::reserveChunk(Chunk* current) {
     Chunk* reserve = allocateChunk(current);
     if (reserve != NULL && !__sync_bool_compare_and_swap(&_reserve, current, reserve)) {
         // Unlikely case that we are too late
-        freeChunk(reserve);
+        orphanChunk(reserve);
     }
 }
 
@@ -100,7 +209,7 @@ Chunk* LinearAllocator::getNextChunk(Chunk* current) {
 
         Chunk* prev_reserve = __sync_val_compare_and_swap(&_reserve, current, reserve);
         if (prev_reserve != current) {
-            freeChunk(reserve);
+            orphanChunk(reserve);
             reserve = prev_reserve;
         }
     }
@@ -19,6 +19,8 @@
 
 #include <stddef.h>
 
+// Memory retained across clear() calls is given back only after this many consecutive generations needed less of it
+const int ARENA_RELEASE_GENERATIONS = 3;
 
 struct Chunk {
     Chunk* prev;
@@ -32,9 +34,22 @@ class LinearAllocator {
     size_t _chunk_size;
     Chunk* _tail;
     Chunk* _reserve;
+    // Chunks kept mapped by clear() for the next generation; only popped while allocating
+    Chunk* volatile _spare;
+    // Reserved chunks that lost a race; only pushed while allocating
+    Chunk* volatile _orphans;
+    // The number of chunks to keep mapped: the high-water mark of the recent generations
+    int _retained;
+    int _recent_peak;
+    int _low_generations;
+    bool _prefault;
+    bool _huge_pages;
 
     Chunk* allocateChunk(Chunk* current);
+    Chunk* takeSpareChunk();
+    void orphanChunk(Chunk* current);
     void freeChunk(Chunk* current);
+    void retainChunks(Chunk* chunks, int used);
     void reserveChunk(Chunk* current);
     Chunk* getNextChunk(Chunk* current);
 
@@ -42,7 +57,15 @@ class LinearAllocator {
     explicit LinearAllocator(size_t chunk_size);
     ~LinearAllocator();
 
+    // prefault: clear() faults in every page of the chunks it keeps for the next generation;
+    // huge_pages: the chunks mapped from now on are backed by transparent huge pages where possible
+    void configure(bool prefault, bool huge_pages);
+
+    // Rewinds to the first chunk. Must not race with alloc().
     void clear();
+    // Rewinds to the first chunk and frees all the others, the retained ones included; for allocators
+    // that signal handlers do not allocate from. Must not race with alloc().
+    void release();
 
     void* alloc(size_t size);
 };
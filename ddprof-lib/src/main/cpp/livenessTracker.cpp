@@ -20,58 +20,168 @@
 #include <string.h>
 #include "arch.h"
 #include "context.h"
+#include "counters.h"
 #include "incbin.h"
 #include "livenessTracker.h"
 #include "os.h"
 #include "profiler.h"
+#include "sampleLoss.h"
 #include "log.h"
 #include "thread.h"
 #include "tsc.h"
 #include "vmStructs.h"
-#include "jniHelper.h"
 
 LivenessTracker* const LivenessTracker::_instance = new LivenessTracker();
 
 void LivenessTracker::cleanup_table(bool forced) {
-    u64 current = loadAcquire(_last_gc_epoch);
     u64 target_gc_epoch = loadAcquire(_gc_epoch);
+    u64 start = OS::nanotime(), end;
 
-    if ((target_gc_epoch == _last_gc_epoch || !__sync_bool_compare_and_swap(&_last_gc_epoch, current, target_gc_epoch)) && !forced) {
-        // if the last processed GC epoch hasn't changed, or if we failed to update it, there's nothing to do
-        return;
+    // one segment at a time, so that the allocation samplers only ever lose one segment to the compaction
+    int count = loadAcquire(_segment_count);
+    int freed = 0;
+    for (int i = 0; i < count; i++) {
+        freed += cleanup_segment(_segments[i], target_gc_epoch, forced);
     }
 
-    JNIEnv* env = VM::jni();
-    jvmtiEnv* jvmti = VM::jvmti();
+    end = OS::nanotime();
+    Counters::recordDuration(LIVENESS_CLEANUP_LT_1US, end - start);
+    Log::debug("Liveness tracker cleanup took %.2fms, freed %d entries in %d segments",
+                1.0f * (end - start) / 1000 / 1000, freed, count);
+}
 
-    u64 start = OS::nanotime(), end;
+int LivenessTracker::cleanup_segment(TrackingSegment* segment, u64 target_gc_epoch, bool forced) {
+    if (segment->gc_epoch == target_gc_epoch && !forced) {
+        // no GC since the last compaction, all the objects are still alive
+        return 0;
+    }
+
+    JNIEnv* env = VM::jni();
 
-    _table_lock.lock();
-    int epoch_diff = (int) (target_gc_epoch - current);
-    u32 sz, newsz = 0;
-    std::set<jclass> kept_classes;
-    for (u32 i = 0; i < (sz = _table_size); i++) {
-        if (_table[i].ref != NULL && !env->IsSameObject(_table[i].ref, NULL)) {
-            // it survived one more GarbageCollectionFinish event
-            u32 target = newsz++;
+    segment->lock.lock();
+    TrackingEntry* entries = segment->entries;
+    int sz = segment->size, newsz = 0;
+    for (int i = 0; i < sz; i++) {
+        if (entries[i].ref != NULL && !env->IsSameObject(entries[i].ref, NULL)) {
+            int target = newsz++;
             if (target != i) {
-                _table[target] = _table[i];
-                _table[i].ref = NULL;
+                entries[target] = entries[i];
+                entries[i].ref = NULL;
             }
-            _table[target].age += epoch_diff;
         } else {
-            env->DeleteWeakGlobalRef(_table[i].ref);
-            _table[i].ref = NULL;
-            delete[] _table[i].frames;
+            env->DeleteWeakGlobalRef(entries[i].ref);
+            entries[i].ref = NULL;
+            releaseTrace(entries[i].trace);
+            releaseClass(entries[i].klass);
         }
     }
+    segment->size = newsz;
+    segment->gc_epoch = target_gc_epoch;
+    segment->lock.unlock();
 
-    _table_size = newsz;
+    return sz - newsz;
+}
 
-    _table_lock.unlock();
-    end = OS::nanotime();
-    Log::debug("Liveness tracker cleanup took %.2fms (%.2fus/element)",
-                1.0f * (end - start) / 1000 / 1000, 1.0f * (end - start) / 1000 / sz);
+bool LivenessTracker::add_segment() {
+    _grow_lock.lock();
+    int count = _segment_count;
+    int capacity = __min(SEGMENT_SIZE, _table_max_cap - _table_cap);
+    TrackingSegment* segment = NULL;
+    if (count < MAX_SEGMENTS && capacity > 0 && !_frozen) {
+        segment = (TrackingSegment*)malloc(sizeof(TrackingSegment));
+        TrackingEntry* entries = segment != NULL ? (TrackingEntry*)malloc(sizeof(TrackingEntry) * capacity) : NULL;
+        if (entries != NULL) {
+            segment->lock.reset();
+            segment->size = 0;
+            segment->capacity = capacity;
+            segment->gc_epoch = loadAcquire(_gc_epoch);
+            segment->entries = entries;
+            _segments[count] = segment;
+            _table_cap += capacity;
+            Counters::increment(LIVENESS_TABLE_BYTES, sizeof(TrackingSegment) + sizeof(TrackingEntry) * capacity);
+            __atomic_store_n(&_segment_count, count + 1, __ATOMIC_RELEASE);
+            Log::debug("Increased size of Liveness tracking table to %d entries", _table_cap);
+        } else {
+            free(segment);
+            segment = NULL;
+        }
+    }
+    _grow_lock.unlock();
+    return segment != NULL;
+}
+
+bool LivenessTracker::insert(TrackingEntry& entry) {
+    int count = loadAcquire(_segment_count);
+    u32 start = (u32)atomicInc(_insert_cursor);
+    for (int k = 0; k < count; k++) {
+        TrackingSegment* segment = _segments[(start + k) % count];
+        if (!segment->lock.tryLockShared()) {
+            // the segment is being compacted
+            continue;
+        }
+        // Increment the segment size in a thread-safe manner (CAS); bail out if it would overflow the capacity
+        int idx;
+        do {
+            idx = segment->size;
+        } while (idx < segment->capacity &&
+                    !__sync_bool_compare_and_swap(&segment->size, idx, idx + 1));
+        if (idx < segment->capacity) {
+            // flush() may already see the slot; it skips it until the reference is stored
+            TrackingEntry* slot = &segment->entries[idx];
+            slot->ref = NULL;
+            jweak ref = entry.ref;
+            entry.ref = NULL;
+            *slot = entry;
+            entry.ref = ref;
+            __atomic_store_n(&slot->ref, entry.ref, __ATOMIC_RELEASE);
+            segment->lock.unlockShared();
+            return true;
+        }
+        segment->lock.unlockShared();
+    }
+    return false;
+}
+
+bool LivenessTracker::replace(JNIEnv* env, TrackingEntry& entry) {
+    u64 seen = atomicInc(_reservoir_seen) + 1;
+    // racy on purpose, the concurrent samplers only make the sequence more random
+    u64 r = _random != 0 ? _random : (u64)entry.time * 0x9E3779B97F4A7C15ULL | 1;
+    r ^= r << 13;
+    r ^= r >> 7;
+    r ^= r << 17;
+    _random = r;
+
+    u64 capacity = (u64)_table_cap;
+    u64 pick = r % (capacity + seen);
+    if (pick >= capacity) {
+        return false;
+    }
+
+    int count = loadAcquire(_segment_count);
+    if (count == 0) {
+        return false;
+    }
+    TrackingSegment* segment = _segments[(pick / SEGMENT_SIZE) % count];
+    if (!segment->lock.tryLock()) {
+        // being compacted or flushed, the sample is dropped as if it had not been picked
+        return false;
+    }
+    int size = segment->size;
+    if (size == 0) {
+        segment->lock.unlock();
+        return false;
+    }
+    TrackingEntry* slot = &segment->entries[(pick % SEGMENT_SIZE) % size];
+    TrackingEntry victim = *slot;
+    *slot = entry;
+    segment->lock.unlock();
+
+    if (victim.ref != NULL) {
+        env->DeleteWeakGlobalRef(victim.ref);
+        releaseTrace(victim.trace);
+        releaseClass(victim.klass);
+    }
+    return true;
 }
 
 void LivenessTracker::flush(std::set<int> &tracked_thread_ids) {
@@ -86,34 +196,88 @@ void LivenessTracker::flush_table(std::set<int> *tracked_thread_ids) {
     // this is to make sure we are including as few false 'live' objects as possible
     cleanup_table();
 
-    _table_lock.lockShared();
-
-    u32 sz;
-    for (int i = 0; i < (sz = _table_size); i++) {
-        jobject ref = env->NewLocalRef(_table[i].ref);
-        if (ref != NULL) {
+    u64 gc_epoch = loadAcquire(_gc_epoch);
+    u32 flush_epoch = ++_flush_epoch;
+    int count = loadAcquire(_segment_count);
+
+    // every entry stands for 1 / rate of the tracked objects when the table has been overflowing
+    u64 seen = loadAcquire(_reservoir_seen);
+    _retention_rate = seen > 0 ? (double)_table_cap / (_table_cap + seen) : 1.0;
+    float weight_scale = (float)(1.0 / _retention_rate);
+
+    std::map<LiveSetKey, LiveSetBucket> live_set;
+    u32 sz = 0;
+    for (int s = 0; s < count; s++) {
+        TrackingSegment* segment = _segments[s];
+        segment->lock.lockShared();
+        TrackingEntry* entries = segment->entries;
+        int size = segment->size;
+        sz += size;
+        for (int i = 0; i < size; i++) {
+            // the compaction above has dropped the objects collected before this flush
+            if (entries[i].ref == NULL || env->IsSameObject(entries[i].ref, NULL)) {
+                continue;
+            }
             if (tracked_thread_ids != NULL) {
-                tracked_thread_ids->insert(_table[i].tid);
+                tracked_thread_ids->insert(entries[i].tid);
+            }
+            TrackedClass* klass = entries[i].klass;
+            if (klass->flush_epoch != flush_epoch) {
+                klass->class_id = Profiler::instance()->lookupClass(klass->name, klass->length);
+                klass->flush_epoch = flush_epoch;
+            }
+            u64 age = gc_epoch - entries[i].gc_epoch;
+            float weight = entries[i].alloc._weight * weight_scale;
+
+            if (_record_live_objects) {
+                ObjectLivenessEvent event;
+                event._id = klass->class_id;
+                event._start_time = entries[i].time;
+                event._age = age;
+                event._alloc = entries[i].alloc;
+                event._alloc._weight = weight;
+                event._ctx = entries[i].ctx;
+                recordLiveSample(entries[i].tid, entries[i].trace, BCI_LIVENESS, &event);
+                continue;
+            }
+
+            // power of 2 age buckets: 0, 1, 2-3, 4-7, ...
+            LiveSetKey key = {entries[i].trace, klass->class_id, age == 0 ? 0 : 64 - (u32)__builtin_clzll(age)};
+            std::map<LiveSetKey, LiveSetBucket>::iterator it = live_set.find(key);
+            if (it == live_set.end()) {
+                // the compaction on the track() path may release the trace before the summary is recorded
+                retainTrace(key.trace);
+                LiveSetBucket bucket = {entries[i].tid, (u64)entries[i].time, 0, 0, 0};
+                it = live_set.insert(std::make_pair(key, bucket)).first;
+            }
+            LiveSetBucket& bucket = it->second;
+            bucket.samples++;
+            bucket.size += (double)entries[i].alloc._size * weight;
+            bucket.weight += weight;
+            if ((u64)entries[i].time < bucket.start_time) {
+                bucket.start_time = entries[i].time;
             }
-            ObjectLivenessEvent event;
-            event._start_time = _table[i].time;
-            event._age = _table[i].age;
-            event._alloc = _table[i].alloc;
-            event._ctx = _table[i].ctx;
-
-            jstring name_str = (jstring)env->CallObjectMethod(env->GetObjectClass(ref), _Class_getName);
-            jniExceptionCheck(env);
-            const char *name = env->GetStringUTFChars(name_str, NULL);
-            event._id = name != NULL ? Profiler::instance()->lookupClass(name, strlen(name)) : 0;
-            env->ReleaseStringUTFChars(name_str, name);
-
-            Profiler::instance()->recordExternalSample(1, _table[i].tid, _table[i].frames, _table[i].frames_size, /*truncated=*/false, BCI_LIVENESS, &event);
         }
+        segment->lock.unlockShared();
+    }
 
-        env->DeleteLocalRef(ref);
+    for (std::map<LiveSetKey, LiveSetBucket>::iterator it = live_set.begin(); it != live_set.end(); ++it) {
+        LiveSetSummaryEvent event;
+        event._id = it->first.class_id;
+        event._start_time = it->second.start_time;
+        event._age = it->first.age_bucket == 0 ? 0 : 1ULL << (it->first.age_bucket - 1);
+        event._samples = it->second.samples;
+        event._size = (u64)it->second.size;
+        event._weight = (float)it->second.weight;
+        recordLiveSample(it->second.tid, it->first.trace, BCI_LIVENESS_SUMMARY, &event);
+        releaseTrace(it->first.trace);
     }
 
-    _table_lock.unlockShared();
+    if (seen > 0 && sz == 0) {
+        // no entry of the reservoir has survived, the table starts over and so does the reservoir;
+        // while any entry is left it still stands for 1 / rate of the objects, even if there is room again
+        __atomic_store_n(&_reservoir_seen, 0, __ATOMIC_RELEASE);
+    }
 
     if (_record_heap_usage) {
         bool isLastGc = HeapUsage::isLastGCUsageSupported();
@@ -192,33 +356,22 @@ Error LivenessTracker::initialize(Arguments& args) {
         _table_max_cap = 0;
         return _stored_error = Error::OK;
     }
-    if (!(_Class = env->FindClass("java/lang/Class"))) {
-        jniExceptionCheck(env, true);
-        err = Error("Unable to find java/lang/Class");
-    } else if (!(_Class_getName = env->GetMethodID(_Class, "getName", "()Ljava/lang/String;"))) {
-        jniExceptionCheck(env, true);
-        err = Error("Unable to find java/lang/Class.getName");
-    }
-    if (err) {
-        Log::warn("Liveness tracking requires access to java.lang.Class#getName()");
-        // disable liveness tracking
-        _table_max_cap = 0;
-        return _stored_error = Error::OK;
-    }
-
-    _table_size = 0;
-    _table_cap = __min(2048, _table_max_cap); // with default 512k sampling interval, it's enough for 1G of heap
-    _table = (TrackingEntry*)malloc(sizeof(TrackingEntry) * _table_cap);
+    _gc_epoch = 0;
+    _table_cap = 0;
+    _reservoir_seen = 0;
+    // a single segment is enough for 1G of heap with the default 512k sampling interval
+    add_segment();
+    _traces = (TrackedTrace**)calloc(TRACE_BUCKETS, sizeof(TrackedTrace*));
+    _classes = (TrackedClass**)calloc(CLASS_BUCKETS, sizeof(TrackedClass*));
 
     _record_heap_usage = args._record_heap_usage;
-
-    _gc_epoch = 0;
-    _last_gc_epoch = 0;
+    _record_live_objects = args._record_live_objects;
 
     return _stored_error = Error::OK;
 }
 
-void LivenessTracker::track(JNIEnv* env, AllocEvent &event, jint tid, jobject object, int num_frames, jvmtiFrameInfo* frames) {
+void LivenessTracker::track(JNIEnv* env, AllocEvent &event, jint tid, jobject object, int num_frames, jvmtiFrameInfo* frames,
+                            const char* class_name, size_t class_name_len) {
     if (_table_max_cap == 0) {
         // we are not to store any objects
         return;
@@ -229,75 +382,149 @@ void LivenessTracker::track(JNIEnv* env, AllocEvent &event, jint tid, jobject ob
         return;
     }
 
-    bool retried = false;
-
-retry:
-    if (!_table_lock.tryLockShared()) {
-        // we failed to add the weak reference to the table so it won't get cleaned up otherwise
+    TrackedTrace* trace = internTrace(num_frames, frames);
+    TrackedClass* klass = trace != NULL ? internClass(class_name, class_name_len) : NULL;
+    if (klass == NULL) {
         env->DeleteWeakGlobalRef(ref);
+        if (trace != NULL) {
+            releaseTrace(trace);
+        }
         return;
     }
 
-    // Increment _table_size in a thread-safe manner (CAS) and store the new value in idx
-    // It bails out if _table_size would overflow _table_cap
-    int idx;
-    do {
-        idx = _table_size;
-    } while (idx < _table_cap &&
-                !__sync_bool_compare_and_swap(&_table_size, idx, idx + 1));
-
-    if (idx < _table_cap) {
-        _table[idx].tid = tid;
-        _table[idx].time = TSC::ticks();
-        _table[idx].ref = ref;
-        _table[idx].alloc = event;
-        _table[idx].age = 0;
-        _table[idx].frames_size = num_frames;
-        _table[idx].frames = new jvmtiFrameInfo[_table[idx].frames_size];
-        memcpy(_table[idx].frames, frames, sizeof(jvmtiFrameInfo) * _table[idx].frames_size);
-        _table[idx].ctx = Contexts::get(tid);
-    }
-
-    _table_lock.unlockShared();
-
-    if (idx == _table_cap) {
-        if (!retried) {
-            // guarantees we don't busy loop until memory exhaustion
-            retried = true;
-
-            // try cleanup before resizing - there is a good chance it will free some space
-            cleanup_table(true);
-
-            if (_table_cap < _table_max_cap) {
-
-                // Let's increase the size of the table
-                // This should only ever happen when sampling interval * size of table
-                // is smaller than maximum heap size. So we only support increasing
-                // the size of the table, not decreasing it.
-                _table_lock.lock();
-
-                // Only increase the size of the table to _table_max_cap elements
-                int newcap = __min(_table_cap * 2, _table_max_cap);
-                if (_table_cap != newcap) {
-                    TrackingEntry* tmp = (TrackingEntry*)realloc(_table, sizeof(TrackingEntry) * (_table_cap = newcap));
-                    if (tmp != NULL) {
-                        _table = tmp;
-                        Log::debug("Increased size of Liveness tracking table to %d entries", _table_cap);
-                    } else {
-                        Log::debug("Cannot add sampled object to Liveness tracking table, resize attempt failed, the table is overflowing");
-                    }
-                }
-
-                _table_lock.unlock();
-
-                goto retry;
-            } else {
-                Log::debug("Cannot add sampled object to Liveness tracking table, it's overflowing");
+    TrackingEntry entry;
+    entry.tid = tid;
+    entry.time = TSC::ticks();
+    entry.ref = ref;
+    entry.alloc = event;
+    entry.gc_epoch = loadAcquire(_gc_epoch);
+    entry.trace = trace;
+    entry.klass = klass;
+    entry.ctx = Contexts::get(tid);
+
+    if (!insert(entry)) {
+        // compact one segment before growing the table - there is a good chance it will free some space;
+        // the other segments stay available to the concurrent samplers meanwhile
+        int count = loadAcquire(_segment_count);
+        bool freed = count > 0 && cleanup_segment(_segments[(u32)atomicInc(_cleanup_cursor) % count], loadAcquire(_gc_epoch), true) > 0;
+        if (!(freed || add_segment()) || !insert(entry)) {
+            if (replace(env, entry)) {
+                return;
             }
+            SampleLoss::record(LOSS_LIVENESS, LOSS_TABLE_OVERFLOW);
+            env->DeleteWeakGlobalRef(ref);
+            releaseTrace(trace);
+            releaseClass(klass);
+        }
+    }
+}
+
+TrackedTrace* LivenessTracker::internTrace(int num_frames, jvmtiFrameInfo* frames) {
+    u64 hash = (u64)num_frames * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < num_frames; i++) {
+        hash = (hash ^ (u64)frames[i].method) * 0xBF58476D1CE4E5B9ULL ^ (u64)frames[i].location;
+        hash ^= hash >> 31;
+    }
+
+    _intern_lock.lock();
+    TrackedTrace** bucket = &_traces[hash % TRACE_BUCKETS];
+    for (TrackedTrace* trace = *bucket; trace != NULL; trace = trace->next) {
+        if (trace->hash == hash && trace->num_frames == num_frames &&
+            memcmp(trace->frames, frames, num_frames * sizeof(jvmtiFrameInfo)) == 0) {
+            trace->refs++;
+            _intern_lock.unlock();
+            return trace;
         }
     }
 
-    delete[] frames;
+    TrackedTrace* trace = (TrackedTrace*)malloc(sizeof(TrackedTrace) + (num_frames - 1) * sizeof(jvmtiFrameInfo));
+    if (trace != NULL) {
+        trace->hash = hash;
+        trace->refs = 1;
+        trace->call_trace_id = 0;
+        trace->generation = 0;
+        trace->num_frames = num_frames;
+        memcpy(trace->frames, frames, num_frames * sizeof(jvmtiFrameInfo));
+        trace->next = *bucket;
+        *bucket = trace;
+        _trace_count++;
+    }
+    _intern_lock.unlock();
+    return trace;
+}
+
+void LivenessTracker::recordLiveSample(int tid, TrackedTrace* trace, jint event_type, Event* event) {
+    // the trace is stored once per dump, the other objects of the same site reuse its id
+    if (trace->call_trace_id == 0 ||
+        !Profiler::instance()->recordCachedSample(1, tid, trace->call_trace_id, trace->generation, event_type, event)) {
+        trace->call_trace_id = Profiler::instance()->recordExternalSample(1, tid, trace->frames, trace->num_frames,
+                                                                          /*truncated=*/false, event_type, event, &trace->generation);
+    }
+}
+
+void LivenessTracker::retainTrace(TrackedTrace* trace) {
+    _intern_lock.lock();
+    trace->refs++;
+    _intern_lock.unlock();
+}
+
+void LivenessTracker::releaseTrace(TrackedTrace* trace) {
+    _intern_lock.lock();
+    if (--trace->refs == 0) {
+        TrackedTrace** link = &_traces[trace->hash % TRACE_BUCKETS];
+        while (*link != trace) {
+            link = &(*link)->next;
+        }
+        *link = trace->next;
+        _trace_count--;
+        free(trace);
+    }
+    _intern_lock.unlock();
+}
+
+TrackedClass* LivenessTracker::internClass(const char* name, size_t length) {
+    u64 hash = length * 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001B3ULL;
+    }
+
+    _intern_lock.lock();
+    TrackedClass** bucket = &_classes[hash % CLASS_BUCKETS];
+    for (TrackedClass* klass = *bucket; klass != NULL; klass = klass->next) {
+        if (klass->hash == hash && klass->length == length && memcmp(klass->name, name, length) == 0) {
+            klass->refs++;
+            _intern_lock.unlock();
+            return klass;
+        }
+    }
+
+    TrackedClass* klass = (TrackedClass*)malloc(sizeof(TrackedClass) + length);
+    if (klass != NULL) {
+        klass->hash = hash;
+        klass->refs = 1;
+        klass->flush_epoch = 0;
+        klass->class_id = 0;
+        klass->length = length;
+        memcpy(klass->name, name, length);
+        klass->name[length] = 0;
+        klass->next = *bucket;
+        *bucket = klass;
+    }
+    _intern_lock.unlock();
+    return klass;
+}
+
+void LivenessTracker::releaseClass(TrackedClass* klass) {
+    _intern_lock.lock();
+    if (--klass->refs == 0) {
+        TrackedClass** link = &_classes[klass->hash % CLASS_BUCKETS];
+        while (*link != klass) {
+            link = &(*link)->next;
+        }
+        *link = klass->next;
+        free(klass);
+    }
+    _intern_lock.unlock();
 }
 
 void JNICALL LivenessTracker::GarbageCollectionFinish(jvmtiEnv *jvmti_env) {
@@ -24,44 +24,120 @@
 #include "engine.h"
 #include "event.h"
 #include "spinLock.h"
+#include <map>
 #include <set>
 
 class Recording;
 
+// The stack shared by the tracked objects of one allocation site. Unlike the call trace storage it
+// survives the dumps; it remembers the id it was last stored under so that a flush stores it only once.
+typedef struct TrackedTrace {
+    TrackedTrace* next;
+    u64 hash;
+    int refs;
+    u32 call_trace_id;
+    u32 generation;
+    jint num_frames;
+    jvmtiFrameInfo frames[1];
+} TrackedTrace;
+
+// The class of tracked objects; its id in the class map is looked up once per flush, as the map is cleared on every dump
+typedef struct TrackedClass {
+    TrackedClass* next;
+    u64 hash;
+    int refs;
+    u32 flush_epoch;
+    u32 class_id;
+    size_t length;
+    char name[1];
+} TrackedClass;
+
 typedef struct TrackingEntry {
     jweak ref;
     AllocEvent alloc;
-    jint frames_size;
-    jvmtiFrameInfo *frames;
+    TrackedTrace* trace;
+    TrackedClass* klass;
     jint tid;
     jlong time;
-    jlong age;
+    // the GC epoch of the allocation, the age is the number of GCs since then
+    u64 gc_epoch;
     Context ctx;
 } TrackingEntry;
 
+// The table is split into segments which are compacted one at a time; track() skips a segment
+// which is being compacted and inserts into another one
+typedef struct TrackingSegment {
+    SpinLock lock;
+    volatile int size;
+    int capacity;
+    // the GC epoch of the last compaction
+    u64 gc_epoch;
+    TrackingEntry* entries;
+} TrackingSegment;
+
+// The live objects of one allocation site, class and age bucket, summed up by flush
+typedef struct LiveSetKey {
+    TrackedTrace* trace;
+    u32 class_id;
+    u32 age_bucket;
+
+    bool operator<(const LiveSetKey& other) const {
+        if (trace != other.trace) return trace < other.trace;
+        if (class_id != other.class_id) return class_id < other.class_id;
+        return age_bucket < other.age_bucket;
+    }
+} LiveSetKey;
+
+typedef struct LiveSetBucket {
+    int tid;
+    u64 start_time;
+    u64 samples;
+    double size;
+    double weight;
+} LiveSetBucket;
+
 class LivenessTracker  {
   friend Recording;
 
   private:
     const static int MAX_TRACKING_TABLE_SIZE = 262144;
     const static int MIN_SAMPLING_INTERVAL = 524288; // 512kiB
+    const static int TRACE_BUCKETS = 16384;
+    const static int CLASS_BUCKETS = 1024;
+    const static int SEGMENT_SIZE = 2048;
+    const static int MAX_SEGMENTS = MAX_TRACKING_TABLE_SIZE / SEGMENT_SIZE;
 
     bool _initialized;
     Error _stored_error;
 
-    SpinLock _table_lock;
-    volatile int _table_size;
+    SpinLock _grow_lock;
+    TrackingSegment* _segments[MAX_SEGMENTS];
+    volatile int _segment_count;
+    volatile int _insert_cursor;
+    volatile int _cleanup_cursor;
     int _table_cap;
     int _table_max_cap;
-    TrackingEntry *_table;
+    // Set by MemoryGovernor: no more segments are added
+    volatile bool _frozen;
+
+    SpinLock _intern_lock;
+    TrackedTrace** _traces;
+    int _trace_count;
+    TrackedClass** _classes;
+    u32 _flush_epoch;
 
     bool _record_heap_usage;
+    bool _record_live_objects;
 
-    jclass _Class;
-    jmethodID _Class_getName;
+    // Once the table is full, the n-th further object replaces a random entry with the probability
+    // capacity / (capacity + n), so that the table stays a uniform sample of all the objects (reservoir sampling);
+    // the count is reset only together with the table, once none of its entries is left
+    volatile u64 _reservoir_seen;
+    u64 _random;
+    // the fraction of the tracked objects which made it to the table, as of the last flush
+    double _retention_rate;
 
     volatile u64 _gc_epoch;
-    volatile u64 _last_gc_epoch;
 
     size_t _used_after_last_gc;
 
@@ -69,6 +145,18 @@ class LivenessTracker  {
     Error initialize_table(JNIEnv* jni, int sampling_interval);
 
     void cleanup_table(bool force = false);
+    // compacts a single segment; returns the number of freed entries
+    int cleanup_segment(TrackingSegment* segment, u64 target_gc_epoch, bool force);
+    bool add_segment();
+    bool insert(TrackingEntry& entry);
+    bool replace(JNIEnv* env, TrackingEntry& entry);
+
+    TrackedTrace* internTrace(int num_frames, jvmtiFrameInfo* frames);
+    void retainTrace(TrackedTrace* trace);
+    void releaseTrace(TrackedTrace* trace);
+    void recordLiveSample(int tid, TrackedTrace* trace, jint event_type, Event* event);
+    TrackedClass* internClass(const char* name, size_t length);
+    void releaseClass(TrackedClass* klass);
 
     void flush_table(std::set<int> *tracked_thread_ids);
 
@@ -84,13 +172,18 @@ class LivenessTracker  {
         return _instance;
     }
 
-    LivenessTracker() : _initialized(false), _stored_error(Error::OK), _table_size(0), _table_cap(0), _table(NULL), _table_max_cap(0), _record_heap_usage(false), _Class(NULL), _Class_getName(0), _gc_epoch(0), _last_gc_epoch(0), _used_after_last_gc(0) {}
+    LivenessTracker() : _initialized(false), _stored_error(Error::OK), _segment_count(0), _insert_cursor(0), _cleanup_cursor(0), _table_cap(0), _table_max_cap(0), _frozen(false), _traces(NULL), _trace_count(0), _classes(NULL), _flush_epoch(0), _record_heap_usage(false), _record_live_objects(false), _reservoir_seen(0), _random(0), _retention_rate(1.0), _gc_epoch(0), _used_after_last_gc(0) {}
 
     Error start(Arguments& args);
     void stop();
-    void track(JNIEnv* env, AllocEvent &event, jint tid, jobject object, int num_frames, jvmtiFrameInfo* frames);
+    void track(JNIEnv* env, AllocEvent &event, jint tid, jobject object, int num_frames, jvmtiFrameInfo* frames,
+               const char* class_name, size_t class_name_len);
     void flush(std::set<int> &tracked_thread_ids);
 
+    void setFrozen(bool frozen) {
+        _frozen = frozen;
+    }
+
     static void JNICALL GarbageCollectionFinish(jvmtiEnv *jvmti_env);
 };
 
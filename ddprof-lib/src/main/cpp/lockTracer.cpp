@@ -0,0 +1,278 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "lockTracer.h"
+#include "codeCache.h"
+#include "counters.h"
+#include "log.h"
+#include "memoryGovernor.h"
+#include "profiler.h"
+#include "thread.h"
+#include "tsc.h"
+#include "vmStructs.h"
+
+volatile bool LockTracer::_running = false;
+long LockTracer::_interval = 0;
+volatile unsigned long long LockTracer::_contended = 0;
+u64 LockTracer::_start_ticks = 0;
+int LockTracer::_max_stack_depth = 0;
+bool LockTracer::_initialized = false;
+jclass LockTracer::_unsafe_class = NULL;
+jclass LockTracer::_lock_support_class = NULL;
+jmethodID LockTracer::_get_blocker = NULL;
+UnsafeParkFunc LockTracer::_orig_unsafe_park = NULL;
+
+static u64 ticksToNanos(u64 ticks) {
+    return (u64)((double)ticks * 1e9 / TSC::frequency());
+}
+
+Error LockTracer::check(Arguments& args) {
+    if (args._lock < 0) {
+        return Error("lock sampling interval must be >= 0");
+    }
+    return Error::OK;
+}
+
+Error LockTracer::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    _interval = args._lock;
+    _contended = 0;
+    _max_stack_depth = Profiler::instance()->max_stack_depth();
+    // the monitor enters pending since before now are not timed
+    _start_ticks = TSC::ticks();
+    _running = true;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, NULL);
+
+    JNIEnv* jni = VM::jni();
+    if (!_initialized) {
+        _initialized = true;
+        if (!initializeParkHook(jni)) {
+            Log::debug("Unsafe.park can not be hooked, only the contended monitors are sampled");
+        }
+    }
+    if (_orig_unsafe_park != NULL) {
+        bindUnsafePark(jni, UnsafeParkHook);
+    }
+    return Error::OK;
+}
+
+void LockTracer::stop() {
+    _running = false;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, NULL);
+    // the hook stays in place for the threads which are still parked in it
+    if (_orig_unsafe_park != NULL) {
+        bindUnsafePark(VM::jni(), _orig_unsafe_park);
+    }
+}
+
+bool LockTracer::initializeParkHook(JNIEnv* jni) {
+    CodeCache* libjvm = VMStructs::libjvm();
+    if (libjvm == NULL) {
+        return false;
+    }
+    const void* unsafe_park = libjvm->findSymbol("Unsafe_Park");
+    if (unsafe_park == NULL) {
+        // some builds keep the C++ decorated name of the static function
+        unsafe_park = libjvm->findSymbol("_ZL11Unsafe_ParkP7JNIEnv_P8_jobjecthl");
+    }
+    if (unsafe_park == NULL) {
+        return false;
+    }
+
+    jclass unsafe = jni->FindClass(VM::java_version() >= 9 ? "jdk/internal/misc/Unsafe" : "sun/misc/Unsafe");
+    jclass lock_support = unsafe != NULL ? jni->FindClass("java/util/concurrent/locks/LockSupport") : NULL;
+    jmethodID get_blocker = lock_support != NULL
+            ? jni->GetStaticMethodID(lock_support, "getBlocker", "(Ljava/lang/Thread;)Ljava/lang/Object;")
+            : NULL;
+    if (get_blocker == NULL) {
+        jni->ExceptionClear();
+        return false;
+    }
+
+    _unsafe_class = (jclass)jni->NewGlobalRef(unsafe);
+    _lock_support_class = (jclass)jni->NewGlobalRef(lock_support);
+    _get_blocker = get_blocker;
+    _orig_unsafe_park = (UnsafeParkFunc)unsafe_park;
+    return true;
+}
+
+void LockTracer::bindUnsafePark(JNIEnv* jni, UnsafeParkFunc entry) {
+    JNINativeMethod park = {(char*)"park", (char*)"(ZJ)V", (void*)entry};
+    if (jni->RegisterNatives(_unsafe_class, &park, 1) != 0) {
+        jni->ExceptionClear();
+        Log::warn("Unable to bind Unsafe.park");
+    }
+}
+
+bool LockTracer::isConcurrentLock(const char* class_signature) {
+    // the conditions of the executors and queues are parked on as well, but those are idle waits
+    return strncmp(class_signature, "Ljava/util/concurrent/locks/ReentrantLock", 41) == 0 ||
+           strncmp(class_signature, "Ljava/util/concurrent/locks/ReentrantReadWriteLock", 50) == 0 ||
+           strncmp(class_signature, "Ljava/util/concurrent/Semaphore", 31) == 0;
+}
+
+char* LockTracer::lockClassSignature(jvmtiEnv* jvmti, JNIEnv* jni, jobject lock) {
+    jclass lock_class = jni->GetObjectClass(lock);
+    char* class_signature = NULL;
+    if (lock_class == NULL || jvmti->GetClassSignature(lock_class, &class_signature, NULL) != 0) {
+        class_signature = NULL;
+    }
+    jni->DeleteLocalRef(lock_class);
+    return class_signature;
+}
+
+u64 LockTracer::nextInterval(ProfiledThread* thrd) {
+    // uniform in (0, 1]
+    double u = ((thrd->nextRandom() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    u64 interval = (u64)(-log(u) * _interval);
+    return interval > 0 ? interval : 1;
+}
+
+bool LockTracer::shouldSample(ProfiledThread* thrd, u64 duration) {
+    if (_interval <= 1) {
+        return true;
+    }
+    if (thrd == NULL) {
+        // threads unknown to the profiler share a plain duration counter
+        return updateCounter(_contended, duration, _interval);
+    }
+
+    u64& countdown = thrd->lockCountdown();
+    if (countdown == 0) {
+        countdown = nextInterval(thrd);
+    }
+    if (duration < countdown) {
+        countdown -= duration;
+        return false;
+    }
+    // a wait spanning several intervals is still a single sample, its weight accounts for the duration
+    countdown = nextInterval(thrd);
+    return true;
+}
+
+void LockTracer::recordContendedLock(jvmtiEnv* jvmti, int event_type, u64 start_ticks, u64 end_ticks, u64 duration,
+                                     const char* class_signature, jobject lock, long long timeout) {
+    LockEvent event;
+    event._id = 0;
+    event._start_time = start_ticks;
+    event._end_time = end_ticks;
+    // the JNI handle points to the object
+    event._address = *(uintptr_t*)lock;
+    event._timeout = timeout;
+    event._weight = (float)((duration == 0 || _interval <= 1) ? 1 : 1 / (1 - exp(-(double)duration / _interval)));
+
+    if (class_signature != NULL) {
+        const char* class_name = class_signature;
+        size_t class_name_len = strlen(class_signature);
+        if (class_signature[0] == 'L') {
+            class_name++;
+            class_name_len -= 2;
+        }
+        int id = Profiler::instance()->lookupClass(class_name, class_name_len);
+        if (id != -1) {
+            event._id = id;
+        }
+    }
+
+    jint frames_size = 0;
+    jvmtiFrameInfo* frames = ProfiledThread::captureStackTrace(jvmti, NULL, MemoryGovernor::stackDepth(_max_stack_depth), &frames_size);
+    if (frames == NULL) {
+        return;
+    }
+    Profiler::instance()->recordExternalSample(duration, ProfiledThread::currentTid(), frames, frames_size,
+                                               /*truncated=*/false, event_type, &event);
+    Counters::increment(LOCK_SAMPLES);
+}
+
+void JNICALL LockTracer::MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jobject object) {
+    if (!_running) {
+        return;
+    }
+    ProfiledThread* current = ProfiledThread::attachCurrent();
+    if (current != NULL) {
+        current->monitorEnterTicks() = TSC::ticks();
+    }
+}
+
+void JNICALL LockTracer::MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jobject object) {
+    ProfiledThread* current = ProfiledThread::current();
+    if (current == NULL) {
+        return;
+    }
+    u64 enter_ticks = current->monitorEnterTicks();
+    current->monitorEnterTicks() = 0;
+    if (!_running || enter_ticks < _start_ticks) {
+        return;
+    }
+
+    u64 entered_ticks = TSC::ticks();
+    u64 duration = ticksToNanos(entered_ticks - enter_ticks);
+    if (shouldSample(current, duration)) {
+        char* class_signature = lockClassSignature(jvmti, jni, object);
+        recordContendedLock(jvmti, BCI_LOCK, enter_ticks, entered_ticks, duration, class_signature, object, 0);
+        jvmti->Deallocate((unsigned char*)class_signature);
+    }
+}
+
+void JNICALL LockTracer::UnsafeParkHook(JNIEnv* jni, jobject instance, jboolean is_absolute, jlong time) {
+    if (!_running) {
+        _orig_unsafe_park(jni, instance, is_absolute, time);
+        return;
+    }
+
+    u64 park_ticks = TSC::ticks();
+    _orig_unsafe_park(jni, instance, is_absolute, time);
+    u64 unpark_ticks = TSC::ticks();
+    if (!_running || jni->ExceptionCheck()) {
+        return;
+    }
+
+    // LockSupport clears the blocker only once the thread is back from Unsafe.park
+    jvmtiEnv* jvmti = VM::jvmti();
+    jthread thread;
+    if (jvmti->GetCurrentThread(&thread) != 0) {
+        return;
+    }
+    jobject blocker = jni->CallStaticObjectMethod(_lock_support_class, _get_blocker, thread);
+    jni->DeleteLocalRef(thread);
+    if (blocker == NULL) {
+        jni->ExceptionClear();
+        return;
+    }
+
+    char* class_signature = lockClassSignature(jvmti, jni, blocker);
+    if (class_signature != NULL && isConcurrentLock(class_signature)) {
+        u64 duration = ticksToNanos(unpark_ticks - park_ticks);
+        if (shouldSample(ProfiledThread::attachCurrent(), duration)) {
+            recordContendedLock(jvmti, BCI_PARK, park_ticks, unpark_ticks, duration, class_signature, blocker,
+                                is_absolute ? (long long)MIN_JLONG : time);
+        }
+    }
+    jvmti->Deallocate((unsigned char*)class_signature);
+    jni->DeleteLocalRef(blocker);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOCKTRACER_H
+#define _LOCKTRACER_H
+
+#include <jvmti.h>
+#include "arch.h"
+#include "engine.h"
+
+class ProfiledThread;
+
+typedef void (JNICALL *UnsafeParkFunc)(JNIEnv*, jobject, jboolean, jlong);
+
+// Samples the contended monitor enters, from the JVMTI MonitorContendedEnter/Entered events, and the parks on
+// the java.util.concurrent locks, by binding Unsafe.park to a hook which times the original. Every thread counts
+// its contended nanoseconds down from an exponentially distributed interval, like the native allocations are
+// sampled by bytes, so a sample stands for 1 / (1 - exp(-duration / interval)) such waits.
+// The parks are only hooked on HotSpot, where the original Unsafe_Park can be found in libjvm.
+class LockTracer : public Engine {
+  private:
+    static volatile bool _running;
+    static long _interval;
+    static volatile unsigned long long _contended;
+    static u64 _start_ticks;
+    static int _max_stack_depth;
+
+    static bool _initialized;
+    static jclass _unsafe_class;
+    static jclass _lock_support_class;
+    static jmethodID _get_blocker;
+    static UnsafeParkFunc _orig_unsafe_park;
+
+    static bool initializeParkHook(JNIEnv* jni);
+    static void bindUnsafePark(JNIEnv* jni, UnsafeParkFunc entry);
+    static bool isConcurrentLock(const char* class_signature);
+    static char* lockClassSignature(jvmtiEnv* jvmti, JNIEnv* jni, jobject lock);
+
+    static u64 nextInterval(ProfiledThread* thrd);
+    static bool shouldSample(ProfiledThread* thrd, u64 duration);
+    static void recordContendedLock(jvmtiEnv* jvmti, int event_type, u64 start_ticks, u64 end_ticks, u64 duration,
+                                    const char* class_signature, jobject lock, long long timeout);
+
+    static void JNICALL UnsafeParkHook(JNIEnv* jni, jobject instance, jboolean is_absolute, jlong time);
+
+  public:
+    const char* name() {
+        return "LockTracer";
+    }
+
+    long interval() const {
+        return _interval;
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    static void JNICALL MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jobject object);
+    static void JNICALL MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jobject object);
+};
+
+#endif // _LOCKTRACER_H
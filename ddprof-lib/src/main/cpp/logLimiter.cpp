@@ -0,0 +1,119 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "counters.h"
+#include "logLimiter.h"
+
+
+static u64 hashMessage(LogLevel level, const char* message, size_t len) {
+    u64 hash = 14695981039346656037ULL ^ level;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)message[i]) * 1099511628211ULL;
+    }
+    // zero marks a free slot
+    return hash != 0 ? hash : 1;
+}
+
+LogLimiter::LogLimiter() : _lock(), _window_start(0), _admitted(0), _dropped(0), _next_slot(0) {
+    memset(_slots, 0, sizeof(_slots));
+}
+
+void LogLimiter::summarize(const Slot& slot, LogSummary* summary) {
+    summary->level = slot.level;
+    summary->count = slot.repeats;
+    memcpy(summary->message, slot.message, sizeof(summary->message));
+}
+
+int LogLimiter::endWindow(LogSummary* summaries) {
+    int count = 0;
+    for (int i = 0; i < LOG_DEDUP_SLOTS; i++) {
+        if (_slots[i].hash != 0 && _slots[i].repeats > 0) {
+            summarize(_slots[i], &summaries[count++]);
+        }
+    }
+    if (_dropped > 0) {
+        LogSummary* summary = &summaries[count++];
+        summary->level = LOG_WARN;
+        summary->count = _dropped;
+        summary->message[0] = 0;
+    }
+    memset(_slots, 0, sizeof(_slots));
+    _next_slot = 0;
+    _admitted = 0;
+    _dropped = 0;
+    return count;
+}
+
+bool LogLimiter::admit(LogLevel level, const char* message, size_t len, u64 now,
+                       LogSummary* summaries, int* summary_count) {
+    u64 hash = hashMessage(level, message, len);
+    _lock.lock();
+    int count = 0;
+    if (now - _window_start >= LOG_LIMIT_WINDOW_NANOS) {
+        count = endWindow(summaries);
+        _window_start = now;
+    }
+
+    bool admitted = false;
+    Slot* free_slot = NULL;
+    Slot* slot = NULL;
+    for (int i = 0; i < LOG_DEDUP_SLOTS; i++) {
+        if (_slots[i].hash == hash) {
+            slot = &_slots[i];
+            break;
+        } else if (_slots[i].hash == 0 && free_slot == NULL) {
+            free_slot = &_slots[i];
+        }
+    }
+    if (slot != NULL) {
+        slot->repeats++;
+    } else if (_admitted >= LOG_RATE_LIMIT) {
+        _dropped++;
+    } else {
+        if (free_slot == NULL) {
+            // the oldest remembered message gives way, with its count reported right away
+            free_slot = &_slots[_next_slot];
+            _next_slot = (_next_slot + 1) % LOG_DEDUP_SLOTS;
+            if (free_slot->repeats > 0) {
+                summarize(*free_slot, &summaries[count++]);
+            }
+        }
+        free_slot->hash = hash;
+        free_slot->repeats = 0;
+        free_slot->level = level;
+        size_t copied = len < LOG_SUMMARY_LENGTH - 1 ? len : LOG_SUMMARY_LENGTH - 1;
+        memcpy(free_slot->message, message, copied);
+        free_slot->message[copied] = 0;
+        _admitted++;
+        admitted = true;
+    }
+    _lock.unlock();
+
+    if (!admitted) {
+        Counters::increment(LOG_MESSAGES_HELD_BACK);
+    }
+    *summary_count = count;
+    return admitted;
+}
+
+int LogLimiter::flush(u64 now, LogSummary* summaries) {
+    _lock.lock();
+    int count = endWindow(summaries);
+    _window_start = now;
+    _lock.unlock();
+    return count;
+}
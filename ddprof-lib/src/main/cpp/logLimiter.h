@@ -0,0 +1,75 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGLIMITER_H
+#define _LOGLIMITER_H
+
+#include <stddef.h>
+#include "arch.h"
+#include "log.h"
+#include "spinLock.h"
+
+// Distinct messages remembered within a window; a repeated one is only counted
+const int LOG_DEDUP_SLOTS = 16;
+// Distinct messages recorded within a window, the others are only counted
+const int LOG_RATE_LIMIT = 100;
+const u64 LOG_LIMIT_WINDOW_NANOS = 1000 * 1000 * 1000;
+const int LOG_SUMMARY_LENGTH = 128;
+// The most summaries returned at once: one per remembered message and one for those over the rate limit
+const int MAX_LOG_SUMMARIES = LOG_DEDUP_SLOTS + 1;
+
+// What was held back of the messages of an ended window
+struct LogSummary {
+    LogLevel level;
+    u32 count;
+    // the start of the repeated message, empty for the messages over the rate limit
+    char message[LOG_SUMMARY_LENGTH];
+};
+
+// Deduplicates and rate limits the log messages recorded to JFR, so that a warning repeated
+// by every thread start does not flood the recording
+class LogLimiter {
+  private:
+    struct Slot {
+        u64 hash;
+        u32 repeats;
+        LogLevel level;
+        char message[LOG_SUMMARY_LENGTH];
+    };
+
+    SpinLock _lock;
+    u64 _window_start;
+    int _admitted;
+    u32 _dropped;
+    int _next_slot;
+    Slot _slots[LOG_DEDUP_SLOTS];
+
+    static void summarize(const Slot& slot, LogSummary* summary);
+    int endWindow(LogSummary* summaries);
+
+  public:
+    LogLimiter();
+
+    // Tells whether the message is to be recorded. The counts of the messages held back so far are
+    // returned as summaries once their window has ended or their slot is taken by another message.
+    bool admit(LogLevel level, const char* message, size_t len, u64 now, LogSummary* summaries, int* summary_count);
+
+    // Ends the window early, so that its held back messages are reported with the chunk being dumped.
+    // Returns the number of summaries.
+    int flush(u64 now, LogSummary* summaries);
+};
+
+#endif // _LOGLIMITER_H
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lz4Writer.h"
+
+
+static const u32 LZ4_MAGIC = 0x184D2204;
+static const u32 UNCOMPRESSED_BLOCK = 0x80000000;
+static const size_t MIN_MATCH = 4;
+// the last match must start at least 12 bytes before the end of block
+static const size_t MF_LIMIT = 12;
+// the last 5 bytes of a block are always literals
+static const size_t LAST_LITERALS = 5;
+static const size_t MAX_DISTANCE = 65535;
+
+static inline u32 read32(const u8* p) {
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void write32LE(u8* p, u32 v) {
+    p[0] = (u8)v;
+    p[1] = (u8)(v >> 8);
+    p[2] = (u8)(v >> 16);
+    p[3] = (u8)(v >> 24);
+}
+
+static inline u8* writeLength(u8* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (u8)len;
+    return op;
+}
+
+static inline u32 rotl32(u32 v, int bits) {
+    return (v << bits) | (v >> (32 - bits));
+}
+
+// XXH32 with seed 0 restricted to inputs shorter than 16 bytes, which is all the frame descriptor needs
+static u32 descriptorChecksum(const u8* p, size_t len) {
+    const u32 PRIME1 = 2654435761U;
+    const u32 PRIME2 = 2246822519U;
+    const u32 PRIME3 = 3266489917U;
+    const u32 PRIME4 = 668265263U;
+    const u32 PRIME5 = 374761393U;
+
+    u32 h = PRIME5 + (u32)len;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        h += read32(p + i) * PRIME3;
+        h = rotl32(h, 17) * PRIME4;
+    }
+    for (; i < len; i++) {
+        h += p[i] * PRIME5;
+        h = rotl32(h, 11) * PRIME1;
+    }
+    h ^= h >> 15;
+    h *= PRIME2;
+    h ^= h >> 13;
+    h *= PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+Lz4Writer::Lz4Writer(int dst_fd) : _dst_fd(dst_fd) {
+    _src = (u8*)malloc(BLOCK_SIZE);
+    // worst case expansion of incompressible input
+    _dst = (u8*)malloc(BLOCK_SIZE + BLOCK_SIZE / 255 + 16);
+    _table = (int*)malloc(sizeof(int) << HASH_BITS);
+}
+
+Lz4Writer::~Lz4Writer() {
+    free(_src);
+    free(_dst);
+    free(_table);
+}
+
+bool Lz4Writer::writeFully(const u8* data, size_t size) {
+    while (size > 0) {
+        ssize_t bytes = write(_dst_fd, data, size);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+size_t Lz4Writer::compressBlock(const u8* src, size_t size, u8* dst) {
+    u8* op = dst;
+    size_t anchor = 0;
+
+    if (size > MF_LIMIT) {
+        memset(_table, 0xff, sizeof(int) << HASH_BITS);
+        size_t limit = size - MF_LIMIT;
+        size_t match_limit = size - LAST_LITERALS;
+        size_t ip = 0;
+
+        while (ip < limit) {
+            u32 seq = read32(src + ip);
+            u32 h = (seq * 2654435761U) >> (32 - HASH_BITS);
+            int ref = _table[h];
+            _table[h] = (int)ip;
+
+            if (ref < 0 || ip - ref > MAX_DISTANCE || read32(src + ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            size_t len = MIN_MATCH;
+            while (ip + len < match_limit && src[ref + len] == src[ip + len]) {
+                len++;
+            }
+
+            size_t literals = ip - anchor;
+            size_t match_len = len - MIN_MATCH;
+            u8* token = op++;
+            *token = (u8)((literals < 15 ? literals : 15) << 4 | (match_len < 15 ? match_len : 15));
+            if (literals >= 15) {
+                op = writeLength(op, literals - 15);
+            }
+            memcpy(op, src + anchor, literals);
+            op += literals;
+            size_t distance = ip - ref;
+            *op++ = (u8)distance;
+            *op++ = (u8)(distance >> 8);
+            if (match_len >= 15) {
+                op = writeLength(op, match_len - 15);
+            }
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    size_t literals = size - anchor;
+    *op++ = (u8)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = writeLength(op, literals - 15);
+    }
+    memcpy(op, src + anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+bool Lz4Writer::compress(int src_fd, off_t offset, size_t size) {
+    if (_src == NULL || _dst == NULL || _table == NULL) {
+        return false;
+    }
+
+    // FLG: version 01, independent blocks; BD: 64 KiB maximum block size
+    u8 header[7];
+    write32LE(header, LZ4_MAGIC);
+    header[4] = 0x60;
+    header[5] = 0x40;
+    header[6] = (u8)(descriptorChecksum(header + 4, 2) >> 8);
+    if (!writeFully(header, sizeof(header))) {
+        return false;
+    }
+
+    while (size > 0) {
+        size_t chunk = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+        ssize_t bytes = pread(src_fd, _src, chunk, offset);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes <= 0) {
+            return false;
+        }
+
+        u8 block_header[4];
+        size_t compressed = compressBlock(_src, bytes, _dst);
+        bool ok;
+        if (compressed < (size_t)bytes) {
+            write32LE(block_header, (u32)compressed);
+            ok = writeFully(block_header, 4) && writeFully(_dst, compressed);
+        } else {
+            write32LE(block_header, (u32)bytes | UNCOMPRESSED_BLOCK);
+            ok = writeFully(block_header, 4) && writeFully(_src, bytes);
+        }
+        if (!ok) {
+            return false;
+        }
+
+        offset += bytes;
+        size -= bytes;
+    }
+
+    u8 end_mark[4] = {0, 0, 0, 0};
+    return writeFully(end_mark, sizeof(end_mark));
+}
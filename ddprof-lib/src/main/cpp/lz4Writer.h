@@ -0,0 +1,49 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LZ4WRITER_H
+#define _LZ4WRITER_H
+
+#include <sys/types.h>
+#include "arch.h"
+
+
+// Minimal LZ4 frame encoder used to compress exported JFR chunks.
+// Data is compressed in independent 64 KiB blocks, so the memory footprint is bounded
+// regardless of the chunk size. Every call produces one complete frame; concatenated
+// frames are a valid LZ4 stream and are decoded by the standard lz4 tools.
+class Lz4Writer {
+  private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    static const int HASH_BITS = 12;
+
+    int _dst_fd;
+    u8* _src;
+    u8* _dst;
+    int* _table;
+
+    bool writeFully(const u8* data, size_t size);
+    size_t compressBlock(const u8* src, size_t size, u8* dst);
+
+  public:
+    Lz4Writer(int dst_fd);
+    ~Lz4Writer();
+
+    // Compresses 'size' bytes of src_fd starting at 'offset' into a single frame
+    bool compress(int src_fd, off_t offset, size_t size);
+};
+
+#endif // _LZ4WRITER_H
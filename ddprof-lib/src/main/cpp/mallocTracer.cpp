@@ -0,0 +1,334 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mallocTracer.h"
+#include "codeCache.h"
+#include "counters.h"
+#include "os.h"
+#include "profiler.h"
+#include "thread.h"
+#include "tsc.h"
+
+volatile bool MallocTracer::_running = false;
+long MallocTracer::_interval = 0;
+volatile unsigned long long MallocTracer::_allocated = 0;
+MallocTracer::LiveEntry* MallocTracer::_live = NULL;
+ASGCT_CallFrame* MallocTracer::_live_frames = NULL;
+volatile int MallocTracer::_live_count = 0;
+
+// The hooks call the allocator through the profiler's own GOT, which is never patched
+
+static void* malloc_hook(size_t size) {
+    void* result = malloc(size);
+    if (result != NULL && MallocTracer::running()) {
+        MallocTracer::recordMalloc(result, size);
+    }
+    return result;
+}
+
+static void* calloc_hook(size_t num, size_t size) {
+    void* result = calloc(num, size);
+    if (result != NULL && MallocTracer::running()) {
+        MallocTracer::recordMalloc(result, num * size);
+    }
+    return result;
+}
+
+static void* realloc_hook(void* addr, size_t size) {
+    if (addr != NULL && MallocTracer::running()) {
+        return MallocTracer::recordRealloc(addr, size);
+    }
+    void* result = realloc(addr, size);
+    if (result != NULL && size > 0 && MallocTracer::running()) {
+        MallocTracer::recordMalloc(result, size);
+    }
+    return result;
+}
+
+static void free_hook(void* addr) {
+    if (addr != NULL && MallocTracer::running()) {
+        MallocTracer::recordFree(addr);
+    }
+    free(addr);
+}
+
+static int posix_memalign_hook(void** memptr, size_t alignment, size_t size) {
+    int result = posix_memalign(memptr, alignment, size);
+    if (result == 0 && MallocTracer::running()) {
+        MallocTracer::recordMalloc(*memptr, size);
+    }
+    return result;
+}
+
+// Indexed by ImportId
+static void* const HOOKS[NUM_IMPORTS] = {
+    (void*)malloc_hook, (void*)calloc_hook, (void*)realloc_hook, (void*)free_hook, (void*)posix_memalign_hook
+};
+static void* const ORIGINALS[NUM_IMPORTS] = {
+    (void*)malloc, (void*)calloc, (void*)realloc, (void*)free, (void*)posix_memalign
+};
+
+u64 MallocTracer::nextInterval(ProfiledThread* thrd) {
+    // uniform in (0, 1]
+    double u = ((thrd->nextRandom() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    u64 interval = (u64)(-log(u) * _interval);
+    return interval > 0 ? interval : 1;
+}
+
+bool MallocTracer::shouldSample(ProfiledThread* thrd, size_t size) {
+    if (_interval <= 1) {
+        return true;
+    }
+    if (thrd == NULL) {
+        // threads unknown to the profiler share a plain byte counter
+        return updateCounter(_allocated, size, _interval);
+    }
+
+    u64& countdown = thrd->mallocCountdown();
+    if (countdown == 0) {
+        countdown = nextInterval(thrd);
+    }
+    if (size < countdown) {
+        countdown -= size;
+        return false;
+    }
+    // an allocation spanning several intervals is still a single sample, its weight accounts for the size
+    countdown = nextInterval(thrd);
+    return true;
+}
+
+MallocTracer::LiveEntry* MallocTracer::bucket(uintptr_t address) {
+    u64 hash = (u64)(address >> 4) * 0x9E3779B97F4A7C15ULL;
+    return _live + (hash >> 32) % (MALLOC_LIVE_CAPACITY / MALLOC_BUCKET_SIZE) * MALLOC_BUCKET_SIZE;
+}
+
+MallocTracer::LiveEntry* MallocTracer::reserve(uintptr_t address) {
+    LiveEntry* entries = bucket(address);
+    for (int i = 0; i < MALLOC_BUCKET_SIZE; i++) {
+        if (entries[i].address == 0 && __sync_bool_compare_and_swap(&entries[i].address, 0, ENTRY_BUSY)) {
+            return &entries[i];
+        }
+    }
+    Counters::increment(NATIVEMEM_LIVE_DROPPED);
+    return NULL;
+}
+
+void MallocTracer::recordMalloc(void* address, size_t size) {
+    ProfiledThread* thrd = ProfiledThread::current();
+    if (thrd != NULL && !thrd->enterMallocHook()) {
+        return;
+    }
+
+    if (shouldSample(thrd, size)) {
+        int tid = thrd != NULL ? thrd->tid() : OS::threadId();
+        MallocEvent event;
+        event._address = (uintptr_t)address;
+        event._size = size;
+        event._weight = (float)((size == 0 || _interval <= 1) ? 1 : 1 / (1 - exp(-size / (double)_interval)));
+
+        // the trace is copied straight into the slot, which stays invisible until the address is stored
+        LiveEntry* entry = reserve((uintptr_t)address);
+        TraceCopy copy = {NULL, 0, 0, false};
+        if (entry != NULL) {
+            copy.frames = _live_frames + (entry - _live) * MAX_MALLOC_FRAMES;
+            copy.capacity = MAX_MALLOC_FRAMES;
+        }
+        Profiler::instance()->recordSample(NULL, size, tid, BCI_NATIVE_MALLOC, &event, NULL, entry != NULL ? &copy : NULL);
+        Counters::increment(NATIVEMEM_SAMPLES);
+
+        if (entry != NULL) {
+            entry->size = size;
+            entry->start_time = TSC::ticks();
+            entry->weight = event._weight;
+            entry->tid = tid;
+            entry->num_frames = copy.num_frames;
+            entry->truncated = copy.truncated;
+            entry->ctx = Contexts::get(tid);
+            atomicInc(_live_count);
+            __atomic_store_n(&entry->address, (uintptr_t)address, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (thrd != NULL) {
+        thrd->exitMallocHook();
+    }
+}
+
+void MallocTracer::recordFree(void* address) {
+    if (_live_count == 0) {
+        return;
+    }
+    LiveEntry* entries = bucket((uintptr_t)address);
+    for (int i = 0; i < MALLOC_BUCKET_SIZE; i++) {
+        uintptr_t current;
+        while (((current = __atomic_load_n(&entries[i].address, __ATOMIC_ACQUIRE)) & ~(uintptr_t)1) == (uintptr_t)address) {
+            if (current == (uintptr_t)address && __sync_bool_compare_and_swap(&entries[i].address, current, 0)) {
+                atomicInc(_live_count, -1);
+                return;
+            }
+            // flush() is copying the entry out
+            spinPause();
+        }
+    }
+}
+
+MallocTracer::LiveEntry* MallocTracer::holdEntry(uintptr_t address) {
+    if (_live_count == 0) {
+        return NULL;
+    }
+    LiveEntry* entries = bucket(address);
+    for (int i = 0; i < MALLOC_BUCKET_SIZE; i++) {
+        uintptr_t current;
+        while (((current = __atomic_load_n(&entries[i].address, __ATOMIC_ACQUIRE)) & ~(uintptr_t)1) == address) {
+            if (current == address && __sync_bool_compare_and_swap(&entries[i].address, current, address | 1)) {
+                return &entries[i];
+            }
+            // flush() is copying the entry out
+            spinPause();
+        }
+    }
+    return NULL;
+}
+
+void* MallocTracer::recordRealloc(void* address, size_t size) {
+    // The entry of the old block is held as if it were being read: a free() of the same address by another
+    // thread, once the allocator has handed the block out again, waits until the entry has been released
+    LiveEntry* entry = holdEntry((uintptr_t)address);
+    void* result = realloc(address, size);
+    // glibc frees the block when reallocating it to no size; otherwise a failure leaves it as it was
+    bool moved = result != NULL || size == 0;
+    if (entry != NULL) {
+        if (moved) {
+            __atomic_store_n(&entry->address, (uintptr_t)0, __ATOMIC_RELEASE);
+            atomicInc(_live_count, -1);
+        } else {
+            __atomic_store_n(&entry->address, (uintptr_t)address, __ATOMIC_RELEASE);
+        }
+    }
+    if (result != NULL && size > 0) {
+        recordMalloc(result, size);
+    }
+    return result;
+}
+
+void MallocTracer::flush(std::set<int>& tracked_thread_ids) {
+    if (_live == NULL) {
+        return;
+    }
+    ASGCT_CallFrame frames[MAX_MALLOC_FRAMES];
+    for (int i = 0; i < MALLOC_LIVE_CAPACITY; i++) {
+        LiveEntry* entry = &_live[i];
+        uintptr_t address = entry->address;
+        if (address <= ENTRY_BUSY || (address & 1) != 0
+            || !__sync_bool_compare_and_swap(&entry->address, address, address | 1)) {
+            continue;
+        }
+        // the low bit makes free() wait until the entry has been copied
+        NativeLivenessEvent event;
+        event._alloc._address = address;
+        event._alloc._size = entry->size;
+        event._alloc._weight = entry->weight;
+        event._start_time = entry->start_time;
+        event._ctx = entry->ctx;
+        int tid = entry->tid;
+        int num_frames = entry->num_frames;
+        bool truncated = entry->truncated;
+        memcpy(frames, _live_frames + i * MAX_MALLOC_FRAMES, num_frames * sizeof(ASGCT_CallFrame));
+        __atomic_store_n(&entry->address, address, __ATOMIC_RELEASE);
+
+        tracked_thread_ids.insert(tid);
+        Profiler::instance()->recordExternalSample(event._alloc._size, tid, num_frames, frames, truncated, BCI_NATIVE_LIVE, &event);
+    }
+}
+
+void MallocTracer::patchLibrary(CodeCache* lib, bool enable) {
+    for (int id = 0; id < NUM_IMPORTS; id++) {
+        if (enable) {
+            lib->patchImport((ImportId)id, HOOKS[id]);
+            continue;
+        }
+        for (int type = 0; type < NUM_IMPORT_TYPES; type++) {
+            void** entry = lib->findImport((ImportId)id, (ImportType)type);
+            if (entry != NULL && __atomic_load_n(entry, __ATOMIC_ACQUIRE) == HOOKS[id]) {
+                __atomic_store_n(entry, ORIGINALS[id], __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+void MallocTracer::patchLibraries(bool enable) {
+    Profiler* profiler = Profiler::instance();
+    CodeCacheArray& native_libs = profiler->_native_libs;
+    CodeCache* self = profiler->findLibraryByAddress((const void*)malloc_hook);
+    int count = native_libs.count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* lib = native_libs[i];
+        if (lib != NULL && lib != self) {
+            patchLibrary(lib, enable);
+        }
+    }
+}
+
+void MallocTracer::installHooks() {
+    if (_running) {
+        patchLibraries(true);
+    }
+}
+
+Error MallocTracer::check(Arguments& args) {
+    if (args._nativemem < 0) {
+        return Error("nativemem sampling interval must be >= 0");
+    }
+    return Error::OK;
+}
+
+Error MallocTracer::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    if (_live == NULL) {
+        // the frames are committed lazily, only the slots which have ever been used take memory
+        _live = (LiveEntry*)OS::safeAlloc(MALLOC_LIVE_CAPACITY * sizeof(LiveEntry));
+        _live_frames = (ASGCT_CallFrame*)OS::safeAlloc((size_t)MALLOC_LIVE_CAPACITY * MAX_MALLOC_FRAMES * sizeof(ASGCT_CallFrame));
+        if (_live == NULL || _live_frames == NULL) {
+            if (_live != NULL) {
+                OS::safeFree(_live, MALLOC_LIVE_CAPACITY * sizeof(LiveEntry));
+                _live = NULL;
+            }
+            return Error("Not enough memory for the native allocation table");
+        }
+    } else {
+        memset((void*)_live, 0, MALLOC_LIVE_CAPACITY * sizeof(LiveEntry));
+    }
+    _live_count = 0;
+    _allocated = 0;
+    _interval = args._nativemem;
+
+    _running = true;
+    patchLibraries(true);
+    return Error::OK;
+}
+
+void MallocTracer::stop() {
+    _running = false;
+    // the hooks themselves are never unloaded, a thread may still be inside one
+    patchLibraries(false);
+}
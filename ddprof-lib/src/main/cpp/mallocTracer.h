@@ -0,0 +1,100 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MALLOCTRACER_H
+#define _MALLOCTRACER_H
+
+#include <set>
+#include <stddef.h>
+#include "arch.h"
+#include "context.h"
+#include "engine.h"
+#include "vmEntry.h"
+
+// The live allocations are kept in buckets of slots, a lookup probes only the bucket of the address
+const int MALLOC_LIVE_CAPACITY = 16384;
+const int MALLOC_BUCKET_SIZE = 16;
+const int MAX_MALLOC_FRAMES = 64;
+
+class CodeCache;
+class ProfiledThread;
+
+// Samples malloc, calloc, realloc and posix_memalign of the native libraries by redirecting their
+// GOT slots. Every thread counts its allocated bytes down from an exponentially distributed interval,
+// so that the samples are a Poisson process over the allocated bytes. Sampled allocations stay in
+// a lock-free table until they are freed and are reported as live native memory on every dump.
+class MallocTracer : public Engine {
+  private:
+    struct LiveEntry {
+        // 0 if the slot is free, ENTRY_BUSY while it is being filled, the low bit is set while it is being read
+        volatile uintptr_t address;
+        u64 size;
+        u64 start_time;
+        float weight;
+        int tid;
+        int num_frames;
+        bool truncated;
+        Context ctx;
+    };
+
+    static const uintptr_t ENTRY_BUSY = 1;
+
+    static volatile bool _running;
+    static long _interval;
+    static volatile unsigned long long _allocated;
+    static LiveEntry* _live;
+    static ASGCT_CallFrame* _live_frames;
+    static volatile int _live_count;
+
+    static bool shouldSample(ProfiledThread* thrd, size_t size);
+    static u64 nextInterval(ProfiledThread* thrd);
+    static LiveEntry* bucket(uintptr_t address);
+    static LiveEntry* reserve(uintptr_t address);
+    // The entry of the address, kept from being freed or read until its address is stored back
+    static LiveEntry* holdEntry(uintptr_t address);
+    static void patchLibrary(CodeCache* lib, bool enable);
+    static void patchLibraries(bool enable);
+
+  public:
+    const char* name() {
+        return "MallocTracer";
+    }
+
+    long interval() const {
+        return _interval;
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    static bool running() {
+        return _running;
+    }
+
+    // Patches the libraries loaded since the tracer has started
+    static void installHooks();
+
+    static void recordMalloc(void* address, size_t size);
+    static void recordFree(void* address);
+    // Reallocates the block; it stays tracked if the allocator fails to
+    static void* recordRealloc(void* address, size_t size);
+
+    // Records the live allocations and notes the threads which made them
+    static void flush(std::set<int>& tracked_thread_ids);
+};
+
+#endif // _MALLOCTRACER_H
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "mappedFile.h"
+#include "counters.h"
+
+
+MappedFile::MappedFile(int fd, size_t capacity) :
+    _fd(fd), _map(NULL), _capacity(capacity), _chunk_start(0), _position(0), _limit(capacity), _chunks() {
+    if (ftruncate(fd, capacity) != 0) {
+        return;
+    }
+#ifdef __linux__
+    // reserve the blocks upfront - running out of disk space on a sparse mapping would raise SIGBUS
+    if (posix_fallocate(fd, 0, capacity) != 0) {
+        return;
+    }
+#endif
+    // shared with the page cache, so that the copied events end up in the file without a write()
+    void* map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+        _map = (char*)map;
+    }
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+void MappedFile::reclaim(size_t end) {
+    // only the chunks ahead of the open one can be overwritten, and those are the oldest ones
+    while (!_chunks.empty() && _chunks.front().first >= _chunk_start && _chunks.front().first < end) {
+        _chunks.pop_front();
+    }
+    updateLimit();
+}
+
+void MappedFile::updateLimit() {
+    // the chunks ahead of the open one are the oldest, so the first of them is the nearest
+    _limit = !_chunks.empty() && _chunks.front().first >= _chunk_start ? _chunks.front().first : _capacity;
+}
+
+bool MappedFile::wrap(size_t size) {
+    size_t length = _position - _chunk_start;
+    if (_chunk_start == 0 || length + size > _capacity) {
+        return false;
+    }
+
+    // the chunks behind the open one predate everything before it and would break the ring order
+    while (!_chunks.empty() && _chunks.front().first >= _chunk_start) {
+        _chunks.pop_front();
+    }
+    _chunk_start = 0;
+    reclaim(length);
+    memmove(_map, _map + _position - length, length);
+    _position = length;
+    return true;
+}
+
+ssize_t MappedFile::write(const void* data, size_t size) {
+    if (_position + size > _capacity && !wrap(size)) {
+        // the open chunk alone exceeds the capacity; the buffer holds complete events, so it can be dropped as a whole
+        Counters::increment(JFR_MAPPED_BYTES_DROPPED, size);
+        return -1;
+    }
+    reclaim(_position + size);
+    memcpy(_map + _position, data, size);
+    _position += size;
+    return size;
+}
+
+ssize_t MappedFile::append(const void* data, size_t size) {
+    if (_position + size > _limit) {
+        return -1;
+    }
+    memcpy(_map + _position, data, size);
+    _position += size;
+    return size;
+}
+
+ssize_t MappedFile::writev(const struct iovec* iov, int count) {
+    ssize_t total = 0;
+    for (int i = 0; i < count; i++) {
+        ssize_t result = write(iov[i].iov_base, iov[i].iov_len);
+        if (result > 0) {
+            total += result;
+        }
+    }
+    return total;
+}
+
+void MappedFile::patch(const void* data, size_t size, size_t chunk_offset) {
+    if (chunk_offset + size <= chunkOffset()) {
+        memcpy(_map + _chunk_start + chunk_offset, data, size);
+    }
+}
+
+bool MappedFile::finishChunk() {
+    bool listed = _position > _chunk_start;
+    if (listed) {
+        _chunks.push_back(std::make_pair(_chunk_start, _position - _chunk_start));
+    }
+    _chunk_start = _position;
+    updateLimit();
+    return listed;
+}
+
+void MappedFile::reset() {
+    _chunks.clear();
+    _chunk_start = 0;
+    _position = 0;
+    _limit = _capacity;
+}
+
+void MappedFile::close() {
+    if (_map == NULL) {
+        return;
+    }
+
+    size_t total = 0;
+    if (!_chunks.empty()) {
+        // after a wrap the ring holds the older chunks at the end of the file and the newer ones from offset 0
+        size_t split = 1;
+        while (split < _chunks.size() && _chunks[split].first > _chunks[split - 1].first) {
+            split++;
+        }
+        size_t older_start = _chunks[0].first;
+        size_t older_end = _chunks[split - 1].first + _chunks[split - 1].second;
+        if (split < _chunks.size()) {
+            std::rotate(_map, _map + older_start, _map + older_end);
+        } else if (older_start > 0) {
+            memmove(_map, _map + older_start, older_end - older_start);
+        }
+        for (size_t i = 0; i < _chunks.size(); i++) {
+            total += _chunks[i].second;
+        }
+    }
+
+    munmap(_map, _capacity);
+    _map = NULL;
+    int result = ftruncate(_fd, total);
+    (void)result;
+    reset();
+}
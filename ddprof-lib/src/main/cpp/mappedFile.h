@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MAPPEDFILE_H
+#define _MAPPEDFILE_H
+
+#include <deque>
+#include <utility>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+// Preallocated, memory-mapped working file of a continuous recording.
+// Event buffers are copied into the mapping instead of being written with a syscall each,
+// and the disk footprint never grows beyond the configured capacity.
+// The file is used as a ring of JFR chunks: when the open chunk reaches the end of the mapping
+// it is moved to the start of the file, and the oldest finished chunks it overlaps are discarded.
+// The finished chunks are only listed in memory, not in a committed header of the file: the file
+// is a readable recording once closed, but the one left behind by a crashed process is not.
+class MappedFile {
+  private:
+    int _fd;
+    char* _map;
+    size_t _capacity;
+    size_t _chunk_start;
+    size_t _position;
+    // the write position may advance up to here without discarding a chunk or wrapping around
+    size_t _limit;
+    // finished chunks as (offset, size) in recording order, the oldest first
+    std::deque<std::pair<size_t, size_t> > _chunks;
+
+    void reclaim(size_t end);
+    bool wrap(size_t size);
+    void updateLimit();
+
+  public:
+    // Sizes the file to the capacity and maps it; callers must check valid() before anything else
+    MappedFile(int fd, size_t capacity);
+    ~MappedFile();
+
+    bool valid() const {
+        return _map != NULL;
+    }
+
+    // offset of the write position relative to the open chunk
+    size_t chunkOffset() const {
+        return _position - _chunk_start;
+    }
+
+    size_t chunkCount() const {
+        return _chunks.size();
+    }
+
+    size_t chunkStart(size_t index) const {
+        return _chunks[index].first;
+    }
+
+    size_t chunkSize(size_t index) const {
+        return _chunks[index].second;
+    }
+
+    // Not async signal safe: may discard the oldest chunks and move the open one to the start of the file
+    ssize_t write(const void* data, size_t size);
+    // Async signal safe: fails instead of discarding a chunk or wrapping around, which is left to write()
+    ssize_t append(const void* data, size_t size);
+    ssize_t writev(const struct iovec* iov, int count);
+    void patch(const void* data, size_t size, size_t chunk_offset);
+
+    // Lists the chunk written since the previous call; false if there is none, e.g. as it did not fit the ring
+    bool finishChunk();
+    void reset();
+
+    // Lays the finished chunks out in recording order and truncates the file to their total size
+    void close();
+};
+
+#endif // _MAPPEDFILE_H
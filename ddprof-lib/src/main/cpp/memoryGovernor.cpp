@@ -0,0 +1,142 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "counters.h"
+#include "engine.h"
+#include "livenessTracker.h"
+#include "log.h"
+#include "memoryGovernor.h"
+#include "overheadGovernor.h"
+#include "profiler.h"
+
+volatile bool MemoryGovernor::_enabled = false;
+long MemoryGovernor::_budget = 0;
+volatile int MemoryGovernor::_level = MEMORY_WITHIN_BUDGET;
+Engine* MemoryGovernor::_cpu_engine = NULL;
+Engine* MemoryGovernor::_wall_engine = NULL;
+long MemoryGovernor::_cpu_interval = 0;
+long MemoryGovernor::_wall_interval = 0;
+
+static const char* const LEVEL_NAMES[MEMORY_LEVELS] = {
+    "within budget",
+    "cap stack depth",
+    "saturate call traces",
+    "freeze liveness table",
+    "throttle sampling"
+};
+
+const char* MemoryGovernor::levelName(int level) {
+    return level >= 0 && level < MEMORY_LEVELS ? LEVEL_NAMES[level] : "unknown";
+}
+
+void MemoryGovernor::enable(long budget, Engine* cpu_engine, Engine* wall_engine) {
+    disable();
+    if (budget <= 0) {
+        return;
+    }
+    _budget = budget;
+    _cpu_engine = cpu_engine != NULL && !OverheadGovernor::enabled() && cpu_engine->interval() > 0 ? cpu_engine : NULL;
+    _wall_engine = wall_engine != NULL && wall_engine->interval() > 0 ? wall_engine : NULL;
+    _cpu_interval = _cpu_engine != NULL ? _cpu_engine->interval() : 0;
+    _wall_interval = _wall_engine != NULL ? _wall_engine->interval() : 0;
+    _enabled = true;
+}
+
+void MemoryGovernor::disable() {
+    _enabled = false;
+    long cpu_interval;
+    while (_level > MEMORY_WITHIN_BUDGET) {
+        apply(_level--, false, &cpu_interval);
+    }
+    _cpu_engine = NULL;
+    _wall_engine = NULL;
+}
+
+void MemoryGovernor::rebase(long* cpu_interval, long* wall_interval) {
+    if (!_enabled) {
+        return;
+    }
+    bool throttled = _level >= MEMORY_THROTTLE;
+    if (_cpu_engine != NULL && *cpu_interval > 0) {
+        _cpu_interval = *cpu_interval;
+        *cpu_interval = throttled ? _cpu_interval * MEMORY_THROTTLE_FACTOR : _cpu_interval;
+    }
+    if (_wall_engine != NULL && *wall_interval > 0) {
+        _wall_interval = *wall_interval;
+        *wall_interval = throttled ? _wall_interval * MEMORY_THROTTLE_FACTOR : _wall_interval;
+    }
+}
+
+u64 MemoryGovernor::footprint() {
+    long long total = Counters::getCounter(LINEAR_ALLOCATOR_BYTES)
+                      + Counters::getCounter(CONTEXT_STORAGE_BYTES)
+                      + Counters::getCounter(THREAD_FILTER_BYTES)
+                      + Counters::getCounter(CODECACHE_NATIVE_SIZE_BYTES)
+                      + Counters::getCounter(LIVENESS_TABLE_BYTES);
+    // the generic dictionary and the classes, endpoints and context ones
+    for (int id = 0; id < 4; id++) {
+        total += Counters::getCounter(DICTIONARY_BYTES, id) + Counters::getCounter(DICTIONARY_KEYS_BYTES, id);
+    }
+    return total > 0 ? (u64)total : 0;
+}
+
+void MemoryGovernor::apply(int level, bool on, long* cpu_interval) {
+    switch (level) {
+        case MEMORY_CAP_DEPTH:
+            // read by the samplers through stackDepth()
+            break;
+        case MEMORY_SATURATE_TRACES:
+            Profiler::instance()->_call_trace_storage.setSaturated(on);
+            break;
+        case MEMORY_FREEZE_LIVENESS:
+            LivenessTracker::instance()->setFrozen(on);
+            break;
+        case MEMORY_THROTTLE:
+            if (_cpu_engine != NULL) {
+                long interval = on ? _cpu_interval * MEMORY_THROTTLE_FACTOR : _cpu_interval;
+                if (_cpu_engine->setInterval(interval)) {
+                    *cpu_interval = interval;
+                }
+            }
+            if (_wall_engine != NULL) {
+                _wall_engine->setInterval(on ? _wall_interval * MEMORY_THROTTLE_FACTOR : _wall_interval);
+            }
+            break;
+    }
+}
+
+bool MemoryGovernor::cycle(u64* footprint, long* cpu_interval) {
+    *footprint = MemoryGovernor::footprint();
+    *cpu_interval = 0;
+    if (!_enabled) {
+        return false;
+    }
+
+    int level = _level;
+    if (*footprint > (u64)_budget && level < MEMORY_LEVELS - 1) {
+        level++;
+        apply(level, true, cpu_interval);
+    } else if (*footprint < (u64)_budget / 4 * 3 && level > MEMORY_WITHIN_BUDGET) {
+        apply(level, false, cpu_interval);
+        level--;
+    } else {
+        return false;
+    }
+    __atomic_store_n(&_level, level, __ATOMIC_RELEASE);
+    Log::info("Profiler memory footprint %llu bytes, budget %ld bytes: %s",
+              (unsigned long long)*footprint, _budget, levelName(level));
+    return true;
+}
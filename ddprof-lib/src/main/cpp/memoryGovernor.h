@@ -0,0 +1,86 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORYGOVERNOR_H
+#define _MEMORYGOVERNOR_H
+
+#include "arch.h"
+
+class Engine;
+
+// The degradation steps, taken one at a time in this order while the footprint stays over the budget
+// and undone in the reverse order once it is back well below
+enum MemoryGovernorLevel {
+    MEMORY_WITHIN_BUDGET,
+    MEMORY_CAP_DEPTH,           // Java stacks are truncated to MEMORY_CAPPED_STACK_DEPTH frames
+    MEMORY_SATURATE_TRACES,     // new call traces are recorded as the storage overflow trace
+    MEMORY_FREEZE_LIVENESS,     // the liveness tracking table does not grow any more
+    MEMORY_THROTTLE,            // the CPU and wall sampling intervals are stretched
+    MEMORY_LEVELS
+};
+
+const int MEMORY_CAPPED_STACK_DEPTH = 128;
+const int MEMORY_THROTTLE_FACTOR = 4;
+
+// Keeps the native footprint of the profiler data structures within a configured budget.
+// The footprint is the sum of the size counters of the call trace storage, the dictionaries,
+// the context storage, the thread filter, the native code caches and the liveness table.
+class MemoryGovernor {
+  private:
+    static volatile bool _enabled;
+    static long _budget;
+    static volatile int _level;
+    static Engine* _cpu_engine;
+    static Engine* _wall_engine;
+    static long _cpu_interval;
+    static long _wall_interval;
+
+    static void apply(int level, bool on, long* cpu_interval);
+
+  public:
+    // a budget <= 0 disables the governor; the CPU engine is only throttled if it is not governed by OverheadGovernor
+    static void enable(long budget, Engine* cpu_engine, Engine* wall_engine);
+    static void disable();
+    // The sampling intervals have been reconfigured; an interval <= 0 is left alone, the others are
+    // taken as the new unthrottled ones and scaled to what the engines should use at the current level
+    static void rebase(long* cpu_interval, long* wall_interval);
+
+    static bool enabled() {
+        return _enabled;
+    }
+
+    static long budget() {
+        return _budget;
+    }
+
+    static int level() {
+        return _level;
+    }
+
+    static const char* levelName(int level);
+
+    static u64 footprint();
+
+    static int stackDepth(int max_depth) {
+        return _level >= MEMORY_CAP_DEPTH && max_depth > MEMORY_CAPPED_STACK_DEPTH ? MEMORY_CAPPED_STACK_DEPTH : max_depth;
+    }
+
+    // Moves at most one level up or down; returns true if the level has changed.
+    // cpu_interval is set to the new CPU interval if the step has changed it, to 0 otherwise
+    static bool cycle(u64* footprint, long* cpu_interval);
+};
+
+#endif // _MEMORYGOVERNOR_H
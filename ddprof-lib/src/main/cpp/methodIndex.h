@@ -0,0 +1,109 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METHODINDEX_H
+#define _METHODINDEX_H
+
+#include <stddef.h>
+#include "arch.h"
+#include "os.h"
+
+// The method index of a packed frame whose method_id follows in the next word
+const u32 PACKED_ESCAPE = 0xffffffff;
+
+// Assigns the methods of the stored frames a dense 32-bit index. Entries are never removed, as the packed
+// traces of any generation may refer to them; once the index is full, further methods are not packed.
+class MethodIndex {
+  private:
+    u32 _capacity;
+    volatile u32 _size;
+
+    static size_t getSize(u32 capacity) {
+        size_t size = sizeof(MethodIndex) + (sizeof(u64) + sizeof(u32)) * capacity + sizeof(u64) * limit(capacity);
+        return (size + OS::page_mask) & ~OS::page_mask;
+    }
+
+    static u32 limit(u32 capacity) {
+        return capacity * 3 / 4;
+    }
+
+    u64* keys() {
+        return (u64*)(this + 1);
+    }
+
+    // index + 1 of the method in the slot, 0 while it is being published
+    u32* indices() {
+        return (u32*)(keys() + _capacity);
+    }
+
+    u64* methods() {
+        return (u64*)(indices() + _capacity);
+    }
+
+  public:
+    static MethodIndex* allocate(u32 capacity) {
+        MethodIndex* index = (MethodIndex*)OS::safeAllocHuge(getSize(capacity));
+        if (index != NULL) {
+            index->_capacity = capacity;
+            index->_size = 0;
+        }
+        return index;
+    }
+
+    void destroy() {
+        OS::safeFreeHuge(this, getSize(_capacity));
+    }
+
+    // The index of the method, or PACKED_ESCAPE if it has none yet; async signal safe
+    u32 lookup(u64 method) {
+        u64* keys = this->keys();
+        u64 h = method * 0x9e3779b97f4a7c15ULL;
+        u32 slot = (u32)(h >> 32) & (_capacity - 1);
+        u32 step = 0;
+        u64 key;
+
+        while ((key = loadAcquire(keys[slot])) != method) {
+            if (key == 0) {
+                if (_size >= limit(_capacity)) {
+                    return PACKED_ESCAPE;
+                }
+                if (!__sync_bool_compare_and_swap(&keys[slot], 0, method)) {
+                    continue;
+                }
+                u32 index = __sync_fetch_and_add(&_size, 1);
+                if (index >= limit(_capacity)) {
+                    // lost the race for the last index; the method stays unpacked
+                    return PACKED_ESCAPE;
+                }
+                methods()[index] = method;
+                __atomic_store_n(&indices()[slot], index + 1, __ATOMIC_RELEASE);
+                return index;
+            }
+            if (++step >= _capacity) {
+                return PACKED_ESCAPE;
+            }
+            slot = (slot + step) & (_capacity - 1);
+        }
+        // PACKED_ESCAPE while the method is being published, or if it lost the race for the last index
+        return __atomic_load_n(&indices()[slot], __ATOMIC_ACQUIRE) - 1;
+    }
+
+    u64 method(u32 index) {
+        return methods()[index];
+    }
+};
+
+#endif // _METHODINDEX_H
@@ -44,3 +44,7 @@ bool WaitableMutex::waitUntil(u64 wall_time) {
 void WaitableMutex::notify() {
     pthread_cond_signal(&_cond);
 }
+
+void WaitableMutex::notifyAll() {
+    pthread_cond_broadcast(&_cond);
+}
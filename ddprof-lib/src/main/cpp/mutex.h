@@ -41,6 +41,7 @@ class WaitableMutex : public Mutex {
 
     bool waitUntil(u64 wall_time);
     void notify();
+    void notifyAll();
 };
 
 class MutexLocker {
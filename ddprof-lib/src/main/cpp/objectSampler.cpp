@@ -16,11 +16,12 @@
  */
 
 #include <cmath>
-#include <set>
 
 #include <jni.h>
 #include <string.h>
 #include "objectSampler.h"
+#include "allocHistogram.h"
+#include "memoryGovernor.h"
 #include "pidController.h"
 #include "profiler.h"
 #include "context.h"
@@ -49,43 +50,44 @@ void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, jthread threa
     event._size = size;
     event._weight =  (float)((size == 0 || _interval == 0) ? 1 : 1 / (1 - exp(-size / (double)_interval)));
 
-    char* class_name;
-    if (jvmti->GetClassSignature(object_klass, &class_name, NULL) == 0) {
-        int id = -1;
-        if (class_name[0] == 'L') {
-            id = Profiler::instance()->lookupClass(class_name + 1, strlen(class_name) - 2);
-        } else {
-            id = Profiler::instance()->lookupClass(class_name, strlen(class_name));
-        }
-        jvmti->Deallocate((unsigned char*)class_name);
-        if (id == -1) {
-            return;
-        }
-        event._id = id;
+    char* class_signature;
+    if (jvmti->GetClassSignature(object_klass, &class_signature, NULL) != 0) {
+        return;
+    }
+    // the liveness tracker keeps the name to resolve the class id again in the later chunks
+    const char* class_name = class_signature;
+    size_t class_name_len = strlen(class_signature);
+    if (class_signature[0] == 'L') {
+        class_name++;
+        class_name_len -= 2;
     }
+    int id = Profiler::instance()->lookupClass(class_name, class_name_len);
+    if (id == -1) {
+        jvmti->Deallocate((unsigned char*)class_signature);
+        return;
+    }
+    event._id = id;
 
-    jvmtiFrameInfo *frames = new jvmtiFrameInfo[_max_stack_depth];
     jint frames_size = 0;
-    if (jvmti->GetStackTrace(thread, 0, _max_stack_depth,
-                                frames, &frames_size) != JVMTI_ERROR_NONE || frames_size <= 0) {
-        delete[] frames;
+    jvmtiFrameInfo* frames = ProfiledThread::captureStackTrace(jvmti, thread, MemoryGovernor::stackDepth(_max_stack_depth), &frames_size);
+    if (frames == NULL) {
+        jvmti->Deallocate((unsigned char*)class_signature);
         return;
     }
 
-    if (_record_allocations || _record_liveness) {
-        std::set<jclass> classes;
-        jclass method_class;
-        for (int i = 0; i < frames_size; i++) {
-            if (jvmti->GetMethodDeclaringClass(frames[i].method, &method_class) == 0) {
-                classes.insert(method_class);
+    if (_record_allocations) {
+        Profiler* profiler = Profiler::instance();
+        if (AllocHistogram::instance()->enabled()) {
+            u32 call_trace_id, trace_generation;
+            if (profiler->storeExternalTrace(size, tid, frames, frames_size, /*truncated=*/false, BCI_ALLOC, &call_trace_id, &trace_generation) &&
+                !AllocHistogram::instance()->record(tid, call_trace_id, trace_generation, &event)) {
+                // the histogram is full or being flushed, keep the sample as a separate event
+                profiler->recordCachedSample(size, tid, call_trace_id, trace_generation, BCI_ALLOC, &event);
             }
+        } else {
+            profiler->recordExternalSample(size, tid, frames, frames_size, /*truncated=*/false, BCI_ALLOC, &event);
         }
-    }
-
 
-    if (_record_allocations) {
-        Profiler::instance()->recordExternalSample(size, tid, frames, frames_size, /*truncated=*/false, BCI_ALLOC, &event);
-        
         u64 current_samples = __sync_add_and_fetch(&_alloc_event_count, 1);
         // in order to lower the number of atomic reads from the timestamp variable the check will be performed only each 1024 samples
         // the number 1024 is chosen arbitrarily to +- match the expected number of samples per sampling window (1000)
@@ -106,12 +108,10 @@ void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, jthread threa
     }
 
     if (_record_liveness) {
-        // 'frames' will be released by the tracker
-        LivenessTracker::instance()->track(jni, event, tid, object, frames_size, frames);
-    } else {
-        // otherwise the 'frames' need to be deleted here
-        delete[] frames;
+        // the tracker copies the frames only if it keeps the object
+        LivenessTracker::instance()->track(jni, event, tid, object, frames_size, frames, class_name, class_name_len);
     }
+    jvmti->Deallocate((unsigned char*)class_signature);
 }
 
 Error ObjectSampler::check(Arguments& args) {
@@ -143,7 +143,11 @@ Error ObjectSampler::start(Arguments& args) {
                 return error;
             }
         }
-        
+        error = AllocHistogram::instance()->start(args);
+        if (error) {
+            return error;
+        }
+
         jvmtiEnv* jvmti = VM::jvmti();
         // JVMTI Object Sampler is a 'solo' feature, meaning that it can only be used by one JVMTI environment.
         // Therefore, we can rely on the fact that if this agent gets hold of the sample it will be its exclusive owner.
@@ -166,6 +170,18 @@ void ObjectSampler::stop() {
     }
 }
 
+bool ObjectSampler::setInterval(long interval) {
+    if (_interval <= 0) {
+        // the sampling has not been enabled at start
+        return false;
+    }
+    // the rate limiter adapts from the new floor on
+    _configured_interval = interval;
+    _interval = interval;
+    VM::jvmti()->SetHeapSamplingInterval(_interval);
+    return true;
+}
+
 Error ObjectSampler::updateConfiguration(u64 events, double time_coefficient) {
     static PidController pid_controller(
         1000, // target 60k events per minute or 1k per second
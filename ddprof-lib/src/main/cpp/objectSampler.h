@@ -64,6 +64,12 @@ class ObjectSampler : public Engine {
         return _interval;
     }
 
+    bool setInterval(long interval);
+
+    void setMaxStackDepth(int depth) {
+        _max_stack_depth = depth;
+    }
+
     static void JNICALL SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                            jobject object, jclass object_klass, jlong size);
 };
@@ -55,6 +55,7 @@ class OS {
   public:
     static const size_t page_size;
     static const size_t page_mask;
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 
     static u64 nanotime();
     static u64 cputime();
@@ -72,8 +73,18 @@ class OS {
     }
     static int processId();
     static int threadId();
+    static int currentCpu();
+    // The number of NUMA nodes, reading the topology on the first call; 1 where it is unknown
+    static int numaNodes();
+    // The NUMA node of a CPU as of numaNodes(); async signal safe
+    static int cpuNode(int cpu);
+    // Prefers the node for the whole pages within the range and migrates the ones already faulted in
+    static void bindToNode(void* addr, size_t size, int node);
     static const char* schedPolicy(int thread_id);
     static bool threadName(int thread_id, char* name_buf, size_t name_len);
+    // Reads the names of many threads at once into name_len bytes each, leaving the unknown ones empty;
+    // returns how many were found
+    static int threadNames(const int* thread_ids, int count, char* names, size_t name_len);
     static ThreadList* listThreads();
 
     static bool isLinux();
@@ -81,9 +92,21 @@ class OS {
     static SigAction installSignalHandler(int signo, SigAction action, SigHandler handler = NULL);
     static SigAction replaceCrashHandler(SigAction action);
     static bool sendSignalToThread(int thread_id, int signo);
+    static bool sendSignalToThread(int thread_id, int signo, u64 value);
 
     static void* safeAlloc(size_t size);
     static void safeFree(void* addr, size_t size);
+    // Faults in all the pages of a writable mapping, so that the first writes to it do not trap
+    static void prefault(void* addr, size_t size);
+    // Backs a mapping with transparent huge pages where the platform supports it
+    static void adviseHugePages(void* addr, size_t size);
+    // What safeAllocHuge maps on: transparent huge pages, and explicit ones (MAP_HUGETLB) first if any are reserved
+    static void setHugePages(bool transparent, bool explicit_pages);
+    // Like safeAlloc, for the large structures that are accessed at random. A size of HUGE_PAGE_SIZE or more is
+    // rounded up to it and mapped aligned, on huge pages if they are enabled and available or on normal pages
+    // otherwise; the same size must be passed to safeFreeHuge
+    static void* safeAllocHuge(size_t size);
+    static void safeFreeHuge(void* addr, size_t size);
 
     static bool getCpuDescription(char* buf, size_t size);
     static u64 getProcessCpuTime(u64* utime, u64* stime);
@@ -92,6 +115,7 @@ class OS {
     static void copyFile(int src_fd, int dst_fd, off_t offset, size_t size);
     static int fileSize(int fd);
     static int truncateFile(int fd);
+    static int createMemoryFile(const char* name);
     static void freePageCache(int fd, off_t start_offset);
 };
 
@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <sched.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -193,6 +194,82 @@ int OS::threadId() {
     return syscall(__NR_gettid);
 }
 
+int OS::currentCpu() {
+    // sched_getcpu() goes through vDSO and is cheap enough for signal handlers
+    return sched_getcpu();
+}
+
+static const int MAX_NUMA_CPUS = 4096;
+static unsigned char cpu_nodes[MAX_NUMA_CPUS];
+
+// Parses a cpulist such as "0-23,48-71"
+static void assignCpuNode(const char* cpulist, int node) {
+    const char* p = cpulist;
+    while (*p >= '0' && *p <= '9') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+        for (long cpu = first; cpu <= last && cpu < MAX_NUMA_CPUS; cpu++) {
+            cpu_nodes[cpu] = node;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+int OS::numaNodes() {
+    static volatile int nodes = 0;
+    if (__atomic_load_n(&nodes, __ATOMIC_ACQUIRE) == 0) {
+        int count = 1;
+        DIR* dir = opendir("/sys/devices/system/node");
+        if (dir != NULL) {
+            struct dirent* entry;
+            while ((entry = readdir(dir)) != NULL) {
+                int node;
+                char path[64];
+                char cpulist[1024];
+                // cpu_nodes holds a byte per CPU
+                if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0 || node > 255) {
+                    continue;
+                }
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+                int fd = open(path, O_RDONLY);
+                if (fd == -1) {
+                    continue;
+                }
+                ssize_t r = read(fd, cpulist, sizeof(cpulist) - 1);
+                close(fd);
+                if (r > 0) {
+                    cpulist[r] = 0;
+                    assignCpuNode(cpulist, node);
+                    if (node >= count) {
+                        count = node + 1;
+                    }
+                }
+            }
+            closedir(dir);
+        }
+        __atomic_store_n(&nodes, count, __ATOMIC_RELEASE);
+    }
+    return nodes;
+}
+
+int OS::cpuNode(int cpu) {
+    return cpu >= 0 && cpu < MAX_NUMA_CPUS ? cpu_nodes[cpu] : 0;
+}
+
+void OS::bindToNode(void* addr, size_t size, int node) {
+    const int MPOL_PREFERRED = 1;
+    const int MPOL_MF_MOVE = 2;
+    uintptr_t start = ((uintptr_t)addr + page_mask) & ~page_mask;
+    uintptr_t end = ((uintptr_t)addr + size) & ~page_mask;
+    if (end <= start || node < 0 || node >= 64) {
+        return;
+    }
+    unsigned long nodemask = 1UL << node;
+    // Best effort: the pages stay where they are if the kernel has no NUMA support
+    syscall(__NR_mbind, start, end - start, MPOL_PREFERRED, &nodemask, 64 + 1, MPOL_MF_MOVE);
+}
+
 const char* OS::schedPolicy(int thread_id) {
     int sched_policy = sched_getscheduler(thread_id);
     if (sched_policy >= SCHED_BATCH) {
@@ -219,6 +296,36 @@ bool OS::threadName(int thread_id, char* name_buf, size_t name_len) {
     return false;
 }
 
+int OS::threadNames(const int* thread_ids, int count, char* names, size_t name_len) {
+    // the task directory is looked up once rather than for every thread
+    int task_dir = open("/proc/self/task", O_RDONLY | O_DIRECTORY);
+    if (task_dir == -1) {
+        return 0;
+    }
+
+    int found = 0;
+    char path[32];
+    for (int i = 0; i < count; i++) {
+        char* name_buf = names + i * name_len;
+        name_buf[0] = 0;
+        snprintf(path, sizeof(path), "%d/comm", thread_ids[i]);
+        int fd = openat(task_dir, path, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        ssize_t r = read(fd, name_buf, name_len);
+        close(fd);
+        if (r > 0) {
+            name_buf[r - 1] = 0;
+            found++;
+        } else {
+            name_buf[0] = 0;
+        }
+    }
+    close(task_dir);
+    return found;
+}
+
 ThreadList* OS::listThreads() {
     return new LinuxThreadList();
 }
@@ -257,6 +364,19 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
     return syscall(__NR_tgkill, processId(), thread_id, signo) == 0;
 }
 
+bool OS::sendSignalToThread(int thread_id, int signo, u64 value) {
+    // the value reaches the handler as siginfo->si_value with si_code == SI_QUEUE
+    siginfo_t si;
+    memset(&si, 0, sizeof(si));
+    si.si_signo = signo;
+    si.si_code = SI_QUEUE;
+    si.si_pid = processId();
+    si.si_uid = getuid();
+    // only the low 32 bits survive on 32-bit platforms
+    si.si_value.sival_ptr = (void*)(uintptr_t)value;
+    return syscall(__NR_rt_tgsigqueueinfo, processId(), thread_id, signo, &si) == 0;
+}
+
 void* OS::safeAlloc(size_t size) {
     // Naked syscall can be used inside a signal handler.
     // Also, we don't want to catch our own calls when profiling mmap.
@@ -271,6 +391,72 @@ void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+void OS::prefault(void* addr, size_t size) {
+    // MADV_POPULATE_WRITE needs Linux 5.14; touch every page on older kernels
+    if (madvise(addr, size, MADV_POPULATE_WRITE) != 0) {
+        for (size_t offs = 0; offs < size; offs += page_size) {
+            volatile char* p = (volatile char*)addr + offs;
+            *p = *p;
+        }
+    }
+}
+
+void OS::adviseHugePages(void* addr, size_t size) {
+    // Naked syscall, since chunks may be mapped inside a signal handler
+    syscall(__NR_madvise, addr, size, MADV_HUGEPAGE);
+}
+
+static bool _transparent_huge_pages = false;
+static bool _explicit_huge_pages = false;
+
+void OS::setHugePages(bool transparent, bool explicit_pages) {
+    _transparent_huge_pages = transparent || explicit_pages;
+    _explicit_huge_pages = explicit_pages;
+}
+
+static size_t hugeAllocSize(size_t size) {
+    return size < OS::HUGE_PAGE_SIZE ? size : (size + OS::HUGE_PAGE_SIZE - 1) & ~(OS::HUGE_PAGE_SIZE - 1);
+}
+
+void* OS::safeAllocHuge(size_t size) {
+    if (size < HUGE_PAGE_SIZE) {
+        return safeAlloc(size);
+    }
+    size = hugeAllocSize(size);
+    if (_explicit_huge_pages) {
+        // Fails right away unless enough huge pages are reserved in /proc/sys/vm/nr_hugepages
+        intptr_t result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (result >= 0 || result <= -4096) {
+            return (void*)result;
+        }
+    }
+    if (!_transparent_huge_pages) {
+        return safeAlloc(size);
+    }
+
+    // Only an aligned range can be backed by a huge page: map one more and trim both ends
+    char* base = (char*)safeAlloc(size + HUGE_PAGE_SIZE);
+    if (base == NULL) {
+        return NULL;
+    }
+    char* start = (char*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (start > base) {
+        safeFree(base, start - base);
+    }
+    safeFree(start + size, base + HUGE_PAGE_SIZE - start);
+    adviseHugePages(start, size);
+    return start;
+}
+
+void OS::safeFreeHuge(void* addr, size_t size) {
+    safeFree(addr, hugeAllocSize(size));
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     int fd = open("/proc/cpuinfo", O_RDONLY);
     if (fd == -1) {
@@ -323,7 +509,20 @@ u64 OS::getTotalCpuTime(u64* utime, u64* stime) {
 }
 
 void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
-    // copy_file_range() is probably better, but not supported on all kernels
+#ifdef __NR_copy_file_range
+    // copy_file_range() lets the filesystem share extents (reflink) or copy server-side,
+    // but it is not supported on all kernels and works only between regular files
+    while (size > 0) {
+        loff_t src_offset = offset;
+        ssize_t bytes = syscall(__NR_copy_file_range, src_fd, &src_offset, dst_fd, NULL, size, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        offset += bytes;
+        size -= (size_t)bytes;
+    }
+#endif
+    // sendfile() also handles sockets and pipes as the destination
     while (size > 0) {
         ssize_t bytes = sendfile(dst_fd, src_fd, &offset, size);
         if (bytes <= 0) {
@@ -347,6 +546,11 @@ int OS::fileSize(int fd) {
     return fileinfo.st_size;
 }
 
+int OS::createMemoryFile(const char* name) {
+    // memfd_create may be missing from older libc headers
+    return syscall(__NR_memfd_create, name, 1 /* MFD_CLOEXEC */);
+}
+
 void OS::freePageCache(int fd, off_t start_offset) {
     posix_fadvise(fd, start_offset & ~page_mask, 0, POSIX_FADV_DONTNEED);
 }
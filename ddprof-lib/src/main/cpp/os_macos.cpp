@@ -179,6 +179,23 @@ int OS::threadId() {
     return (int)port;
 }
 
+int OS::currentCpu() {
+    // No cheap way to query the current CPU on macOS
+    return -1;
+}
+
+int OS::numaNodes() {
+    return 1;
+}
+
+int OS::cpuNode(int cpu) {
+    return 0;
+}
+
+void OS::bindToNode(void* addr, size_t size, int node) {
+    // No NUMA policies on macOS
+}
+
 const char* OS::schedPolicy(int thread_id) {
     // Not used on macOS
     return "SCHED_OTHER";
@@ -189,6 +206,19 @@ bool OS::threadName(int thread_id, char* name_buf, size_t name_len) {
     return thread && pthread_getname_np(thread, name_buf, name_len) == 0 && name_buf[0] != 0;
 }
 
+int OS::threadNames(const int* thread_ids, int count, char* names, size_t name_len) {
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        char* name_buf = names + i * name_len;
+        if (threadName(thread_ids[i], name_buf, name_len)) {
+            found++;
+        } else {
+            name_buf[0] = 0;
+        }
+    }
+    return found;
+}
+
 ThreadList* OS::listThreads() {
     return new MacThreadList();
 }
@@ -243,6 +273,11 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
 #endif
 }
 
+bool OS::sendSignalToThread(int thread_id, int signo, u64 value) {
+    // there is no way to queue a value to a single thread
+    return sendSignalToThread(thread_id, signo);
+}
+
 void* OS::safeAlloc(size_t size) {
     // mmap() is not guaranteed to be async signal safe, but in practice, it is.
     // There is no a reasonable alternative anyway.
@@ -257,6 +292,29 @@ void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
 
+void OS::prefault(void* addr, size_t size) {
+    for (size_t offs = 0; offs < size; offs += page_size) {
+        volatile char* p = (volatile char*)addr + offs;
+        *p = *p;
+    }
+}
+
+void OS::adviseHugePages(void* addr, size_t size) {
+    // No transparent huge pages on macOS
+}
+
+void OS::setHugePages(bool transparent, bool explicit_pages) {
+    // Neither kind of huge pages can back anonymous memory on macOS
+}
+
+void* OS::safeAllocHuge(size_t size) {
+    return safeAlloc(size);
+}
+
+void OS::safeFreeHuge(void* addr, size_t size) {
+    safeFree(addr, size);
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     return sysctlbyname("machdep.cpu.brand_string", buf, &size, NULL, 0) == 0;
 }
@@ -315,6 +373,11 @@ void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
     munmap(buf, offset);
 }
 
+int OS::createMemoryFile(const char* name) {
+    // anonymous memory files are not available on macOS
+    return -1;
+}
+
 int OS::truncateFile(int fd) {
     int rslt = ftruncate(fd, 0);
     if (rslt == 0) {
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "engine.h"
+#include "overheadGovernor.h"
+
+volatile bool OverheadGovernor::_enabled = false;
+Engine* OverheadGovernor::_engine = NULL;
+double OverheadGovernor::_budget = 0;
+long OverheadGovernor::_base_interval = 0;
+long OverheadGovernor::_interval = 0;
+volatile u64 OverheadGovernor::_spent_ticks = 0;
+u64 OverheadGovernor::_last_cpu_nanos = 0;
+int OverheadGovernor::_window = 0;
+u64 OverheadGovernor::_window_spent[GOVERNOR_WINDOWS];
+u64 OverheadGovernor::_window_cpu[GOVERNOR_WINDOWS];
+
+u64 OverheadGovernor::processCpuNanos() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void OverheadGovernor::resetWindow() {
+    memset(_window_spent, 0, sizeof(_window_spent));
+    memset(_window_cpu, 0, sizeof(_window_cpu));
+    _window = 0;
+    _spent_ticks = 0;
+    _last_cpu_nanos = processCpuNanos();
+}
+
+void OverheadGovernor::enable(Engine* engine, double budget) {
+    _enabled = false;
+    _engine = engine;
+    _budget = budget;
+    if (engine == NULL || budget <= 0 || engine->interval() <= 0) {
+        return;
+    }
+    _base_interval = _interval = engine->interval();
+    resetWindow();
+    _enabled = true;
+}
+
+void OverheadGovernor::disable() {
+    _enabled = false;
+    _engine = NULL;
+}
+
+void OverheadGovernor::rebase(long interval) {
+    if (!_enabled) {
+        return;
+    }
+    _base_interval = _interval = interval;
+    resetWindow();
+}
+
+long OverheadGovernor::cycle() {
+    if (!_enabled) {
+        return 0;
+    }
+
+    u64 cpu_nanos = processCpuNanos();
+    u64 spent_ticks = __atomic_exchange_n(&_spent_ticks, 0, __ATOMIC_ACQ_REL);
+    int slot = _window++ % GOVERNOR_WINDOWS;
+    _window_spent[slot] = (u64)((double)spent_ticks * 1e9 / TSC::frequency());
+    _window_cpu[slot] = cpu_nanos - _last_cpu_nanos;
+    _last_cpu_nanos = cpu_nanos;
+    if (_window < GOVERNOR_WINDOWS) {
+        return 0;
+    }
+
+    u64 spent = 0;
+    u64 cpu = 0;
+    for (int i = 0; i < GOVERNOR_WINDOWS; i++) {
+        spent += _window_spent[i];
+        cpu += _window_cpu[i];
+    }
+    if (cpu == 0) {
+        return 0;
+    }
+
+    double share = (double)spent / cpu;
+    long interval = _interval;
+    if (share > _budget && interval < _base_interval * GOVERNOR_MAX_STRETCH) {
+        interval *= 2;
+    } else if (share < _budget / 4 && interval > _base_interval) {
+        interval = interval / 2 > _base_interval ? interval / 2 : _base_interval;
+    }
+    if (interval == _interval || !_engine->setInterval(interval)) {
+        return 0;
+    }
+
+    _interval = interval;
+    // the samples taken at the previous interval say nothing about the cost at the new one
+    resetWindow();
+    return interval;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OVERHEADGOVERNOR_H
+#define _OVERHEADGOVERNOR_H
+
+#include "arch.h"
+#include "tsc.h"
+
+class Engine;
+
+// Sliding window of the governor, in periods of OverheadGovernor::cycle()
+const int GOVERNOR_WINDOWS = 5;
+// How far the CPU sampling interval may be stretched beyond the configured one
+const int GOVERNOR_MAX_STRETCH = 64;
+
+// Keeps the time spent recording CPU samples within a share of the process CPU time.
+// The samples are timed lock-free from the signal handlers; cycle() runs periodically on the
+// JFR writer thread, doubles the interval of the CPU engine while the budget is exceeded over
+// the window and halves it back towards the configured interval once the cost drops well below.
+class OverheadGovernor {
+  private:
+    static volatile bool _enabled;
+    static Engine* _engine;
+    static double _budget;
+    static long _base_interval;
+    static long _interval;
+    static volatile u64 _spent_ticks;
+    static u64 _last_cpu_nanos;
+    static int _window;
+    static u64 _window_spent[GOVERNOR_WINDOWS];
+    static u64 _window_cpu[GOVERNOR_WINDOWS];
+
+    static u64 processCpuNanos();
+    static void resetWindow();
+
+  public:
+    // budget is a fraction of the process CPU time; a NULL engine or no budget disables the governor
+    static void enable(Engine* engine, double budget);
+    static void disable();
+    // The CPU interval has been reconfigured: it is the new floor, and the window starts over
+    static void rebase(long interval);
+
+    static bool enabled() {
+        return _enabled;
+    }
+
+    static u64 enter() {
+        return _enabled ? TSC::ticks() : 0;
+    }
+
+    static void exit(u64 entry_ticks) {
+        if (entry_ticks != 0) {
+            atomicInc(_spent_ticks, TSC::ticks() - entry_ticks);
+        }
+    }
+
+    // Returns the new interval of the CPU engine if it has been changed, 0 otherwise
+    static long cycle();
+};
+
+#endif // _OVERHEADGOVERNOR_H
@@ -22,6 +22,7 @@
 #include "engine.h"
 
 
+class ExecutionEvent;
 class PerfEvent;
 class PerfEventType;
 class StackContext;
@@ -36,6 +37,32 @@ class PerfEvents : public Engine {
     static Ring _ring;
     static CStack _cstack;
     static bool _use_mmap_page;
+    static bool _pmu_group;
+    // Data pages of every per-thread ring, and whether samples left in it are drained instead of discarded
+    static int _ring_pages;
+    static bool _drain;
+    // Samples carry the data address, latency and source of a load
+    static bool _mem_access;
+    // One event per CPU with a shared ring; a reader thread forwards every sample to its thread as a signal
+    static bool _per_cpu;
+    static volatile bool _reader_running;
+
+    static Error startPerCpu();
+    static void stopPerCpu();
+    static void readerLoop();
+    static void drainCpuRing(struct perf_event_mmap_page* page, int reader_tid);
+    static int walkForwardedKernel(int tid, const void** callchain, int max_depth, StackContext* java_ctx);
+
+    static void* readerEntry(void* unused) {
+        readerLoop();
+        return NULL;
+    }
+
+    static void discardBuffer(int tid);
+    static void readMemAccess(PerfEvent* event, ExecutionEvent* sample);
+
+    static void openGroupSiblings(PerfEvent* event, int tid, struct perf_event_attr* leader);
+    static u64 readGroup(PerfEvent* event, siginfo_t* siginfo, void* ucontext, ExecutionEvent* sample);
 
     // cppcheck-suppress unusedPrivateFunction
     static u64 readCounter(siginfo_t* siginfo, void* ucontext);
@@ -54,12 +81,16 @@ class PerfEvents : public Engine {
         return _interval;
     }
 
+    bool setInterval(long interval);
+
     const char* name() {
       return "PerfEvents";
     }
 
     static int walkKernel(int tid, const void** callchain, int max_depth, StackContext *java_ctx);
 
+    static int walkBacklog(int tid, const void** callchain, int max_depth, int* sample_tid);
+
     static void resetBuffer(int tid);
 
     static const char* getEventName(int event_id);
@@ -69,4 +100,46 @@ class PerfEvents : public Engine {
     }
 };
 
+class SwitchEvent;
+
+// The time every thread spends off CPU, measured with a context switch event per thread instead of sampled.
+// The event raises a synchronous SIGTRAP (perf sigtrap), which the kernel does not deliver to a sleeping
+// thread: the handler runs when the thread returns to user space, with the stack it blocked in, and takes
+// the time of the switch out recorded in the ring of the event.
+class SwitchEvents : public Engine {
+  private:
+    static volatile bool _enabled;
+    static volatile bool _running;
+    static int _max_events;
+    static SwitchEvent* _events;
+    // shorter episodes are only counted
+    static long _threshold;
+
+    static u64 takeSwitchOut(SwitchEvent* event);
+    static void enableEvent(SwitchEvent* event, int fd, bool enabled);
+
+  public:
+    const char* name() {
+        return "SwitchEvents";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    virtual int registerThread(int tid);
+    virtual void unregisterThread(int tid);
+
+    inline void enableEvents(bool enabled) {
+        _enabled = enabled;
+    }
+
+    // Takes the SIGTRAP of an off-CPU episode; false if the signal is not one
+    static bool trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
+};
+
 #endif // _PERFEVENTS_H
@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -37,6 +38,7 @@
 #include "os.h"
 #include "perfEvents.h"
 #include "profiler.h"
+#include "signalLatency.h"
 #include "spinLock.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
@@ -44,6 +46,7 @@
 #include "thread.h"
 #include "threadState.h"
 #include "vmStructs.h"
+#include "wallClock.h"
 #include "context.h"
 
 // Ancient fcntl.h does not define F_SETOWN_EX constants and structures
@@ -489,6 +492,22 @@ PerfEventType PerfEventType::AVAILABLE_EVENTS[] = {
     {"uprobe:path",                 1, 0, 0}, /* IDX_UPROBE */
 };
 
+// The load latency event of the core PMU, which samples through PEBS with the data address and latency.
+// ARM SPE writes its samples to the AUX area instead of PERF_RECORD_SAMPLE, so it has no counterpart here.
+#if defined(__x86_64__) || defined(__i386__)
+static const char* MEM_ACCESS_EVENT = "cpu/mem-loads/";
+#else
+static const char* MEM_ACCESS_EVENT = NULL;
+#endif
+
+static const char* eventName(Arguments& args) {
+    const char* name = args._event == NULL ? EVENT_CPU : args._event;
+    if (args._mem_access && MEM_ACCESS_EVENT != NULL && strcmp(name, EVENT_CPU) == 0) {
+        return MEM_ACCESS_EVENT;
+    }
+    return name;
+}
+
 FunctionWithCounter PerfEventType::KNOWN_FUNCTIONS[] = {
     {"malloc",   1},
     {"mmap",     2},
@@ -509,33 +528,75 @@ class RingBuffer {
   private:
     const char* _start;
     unsigned long _offset;
+    unsigned long _mask;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, unsigned long mask = OS::page_mask) {
         _start = (const char*)page + OS::page_size;
+        _mask = mask;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
 };
 
+// Data pages of the ring shared by all threads running on one CPU in the perfcpu mode; a power of 2
+const int PER_CPU_RING_PAGES = 64;
+// Kernel stacks forwarded from the reader thread to the signal handler, hashed by tid
+const int FORWARDED_STACK_SLOTS = 1024;
+const int FORWARDED_STACK_DEPTH = 64;
+// Marks SIGPROF sent by the reader thread, as opposed to an overflow signal of a per-thread event
+const u64 FORWARDED_SAMPLE_VALUE = 0x70657266;
+
+struct ForwardedStack : SpinLock {
+    int tid;
+    int depth;
+    const void* frames[FORWARDED_STACK_DEPTH];
+};
+
+static int _cpu_count = 0;
+static int* _cpu_fds = NULL;
+static struct perf_event_mmap_page** _cpu_pages = NULL;
+static ForwardedStack* _forwarded_stacks = NULL;
+static pthread_t _reader_thread;
+
+
+// Counters read along with every sample in the pmucounters mode, in the order of the group read
+static const struct {
+    u32 type;
+    u64 config;
+} PMU_GROUP_SIBLINGS[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+const int PMU_GROUP_SIZE = sizeof(PMU_GROUP_SIBLINGS) / sizeof(PMU_GROUP_SIBLINGS[0]);
 
 class PerfEvent : public SpinLock {
   private:
     int _fd;
     struct perf_event_mmap_page* _page;
+    // With PERF_FORMAT_GROUP the sampling event is the leader of these counters; 0 marks a missing one
+    bool _group;
+    int _siblings[PMU_GROUP_SIZE];
+    // Set by walkKernel() in the perfdrain mode: the records before _drain_head that walkBacklog()
+    // has yet to visit, except the one already returned for the current signal
+    u64 _drain_next;
+    u64 _drain_skip;
+    u64 _drain_head;
 
     friend class PerfEvents;
 };
@@ -548,12 +609,22 @@ long PerfEvents::_interval;
 Ring PerfEvents::_ring;
 CStack PerfEvents::_cstack;
 bool PerfEvents::_use_mmap_page;
+bool PerfEvents::_pmu_group = false;
+int PerfEvents::_ring_pages = 1;
+bool PerfEvents::_drain = false;
+bool PerfEvents::_mem_access = false;
+bool PerfEvents::_per_cpu = false;
+volatile bool PerfEvents::_reader_running = false;
 
 static int __intsort(const void *a, const void *b) {
     return *(const int*)a > *(const int*)b;
 }
 
 int PerfEvents::registerThread(int tid) {
+    if (_per_cpu) {
+        // the CPU events already cover every thread of the process
+        return 0;
+    }
     if (_max_events == -1) {
         // It hasn't been started
         return 0;
@@ -598,9 +669,20 @@ int PerfEvents::registerThread(int tid) {
 
     attr.sample_period = _interval;
     attr.sample_type = PERF_SAMPLE_CALLCHAIN;
+    if (_mem_access) {
+        attr.sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+        attr.precise_ip = 1;
+    }
+    if (_drain) {
+        // attributes a pending record to its thread and tells the newest one apart
+        attr.sample_type |= PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+    }
     attr.disabled = 1;
     attr.wakeup_events = 1;
     attr.exclude_callchain_user = 1;
+    if (_pmu_group) {
+        attr.read_format = PERF_FORMAT_GROUP;
+    }
 
     if (!(_ring & RING_KERNEL)) {
         attr.exclude_kernel = 1;
@@ -639,8 +721,8 @@ int PerfEvents::registerThread(int tid) {
     }
 
     void* page = NULL;
-    if ((_ring & RING_KERNEL)) {
-        page = _use_mmap_page ? mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+    if ((_ring & RING_KERNEL) || _mem_access) {
+        page = _use_mmap_page || _mem_access ? mmap(NULL, (1 + _ring_pages) * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
         if (page == MAP_FAILED) {
             Log::info("perf_event mmap failed: %s", strerror(errno));
             page = NULL;
@@ -650,6 +732,9 @@ int PerfEvents::registerThread(int tid) {
     _events[tid].reset();
     _events[tid]._fd = fd;
     _events[tid]._page = (struct perf_event_mmap_page*)page;
+    if (_pmu_group) {
+        openGroupSiblings(&_events[tid], tid, &attr);
+    }
 
     struct f_owner_ex ex;
     ex.type = F_OWNER_TID;
@@ -659,14 +744,35 @@ int PerfEvents::registerThread(int tid) {
     fcntl(fd, F_SETSIG, SIGPROF);
     fcntl(fd, F_SETOWN_EX, &ex);
 
-    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_RESET, _pmu_group ? PERF_IOC_FLAG_GROUP : 0);
     ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
 
     return 0;
 }
 
+void PerfEvents::openGroupSiblings(PerfEvent* event, int tid, struct perf_event_attr* leader) {
+    event->_group = true;
+    for (int i = 0; i < PMU_GROUP_SIZE; i++) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = PMU_GROUP_SIBLINGS[i].type;
+        attr.config = PMU_GROUP_SIBLINGS[i].config;
+        attr.exclude_kernel = leader->exclude_kernel;
+        attr.exclude_user = leader->exclude_user;
+        // siblings count whenever the leader does and never sample on their own
+        int fd = syscall(__NR_perf_event_open, &attr, tid, -1, event->_fd, 0);
+        if (fd == -1) {
+            // typically a virtualized PMU; the group read leaves the missing counters out
+            Log::debug("perf_event_open of PMU counter %d for TID %d failed: %s", i, tid, strerror(errno));
+            event->_siblings[i] = 0;
+        } else {
+            event->_siblings[i] = fd;
+        }
+    }
+}
+
 void PerfEvents::unregisterThread(int tid) {
-    if (tid >= _max_events) {
+    if (_per_cpu || tid >= _max_events) {
         return;
     }
 
@@ -675,11 +781,21 @@ void PerfEvents::unregisterThread(int tid) {
     if (fd > 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
         ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
         close(fd);
+        if (event->_group) {
+            for (int i = 0; i < PMU_GROUP_SIZE; i++) {
+                if (event->_siblings[i] > 0) {
+                    close(event->_siblings[i]);
+                    event->_siblings[i] = 0;
+                }
+            }
+            event->_group = false;
+        }
     }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        munmap(event->_page, (1 + _ring_pages) * OS::page_size);
         event->_page = NULL;
+        event->_drain_head = 0;
         event->unlock();
     }
 }
@@ -697,22 +813,55 @@ u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     }
 }
 
+u64 PerfEvents::readGroup(PerfEvent* event, siginfo_t* siginfo, void* ucontext, ExecutionEvent* sample) {
+    // PERF_FORMAT_GROUP: the number of counters, then the value of the leader and of every opened sibling
+    u64 values[2 + PMU_GROUP_SIZE];
+    ssize_t bytes = read(siginfo->si_fd, values, sizeof(values));
+    if (bytes < (ssize_t)(2 * sizeof(u64))) {
+        return _event_type->counter_arg > 0 ? readCounter(siginfo, ucontext) : 1;
+    }
+    // the leader and the siblings which have been read
+    u64 count = values[0] < (u64)bytes / sizeof(u64) - 1 ? values[0] : (u64)bytes / sizeof(u64) - 1;
+    u64 deltas[PMU_GROUP_SIZE];
+    // the group is reset after every sample, so the values are deltas already
+    u64 next = 2;
+    for (int i = 0; i < PMU_GROUP_SIZE; i++) {
+        // a counter which could not be opened or read is left out rather than reported as none counted
+        deltas[i] = event->_siblings[i] > 0 && next <= count ? values[next++] : PMU_NOT_COUNTED;
+    }
+    sample->_has_pmu_counters = true;
+    sample->_cycles = deltas[0];
+    sample->_instructions = deltas[1];
+    sample->_cache_misses = deltas[2];
+    sample->_branch_misses = deltas[3];
+    return _event_type->counter_arg > 0 ? readCounter(siginfo, ucontext) : values[1];
+}
+
 void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
-    if (siginfo->si_code <= 0) {
+    bool forwarded = siginfo->si_code == SI_QUEUE && siginfo->si_pid == OS::processId()
+            && (u64)(uintptr_t)siginfo->si_value.sival_ptr == FORWARDED_SAMPLE_VALUE;
+    if (siginfo->si_code <= 0 && !forwarded) {
         // Looks like an external signal; don't treat as a profiling event
         return;
     }
 
+    u64 entry = SignalLatency::enter();
     ProfiledThread* current = ProfiledThread::current();
     if (current != NULL) {
         current->noteCPUSample();
     }
     int tid = current != NULL ? current->tid() : OS::threadId();
+    PerfEvent* perf_event = !forwarded && tid < _max_events ? &_events[tid] : NULL;
+    bool group = perf_event != NULL && perf_event->_group && perf_event->_fd == siginfo->si_fd;
     if (_enabled) {
         Shims::instance().setSighandlerTid(tid);
 
-        u64 counter = readCounter(siginfo, ucontext);
         ExecutionEvent event;
+        // a forwarded sample has no fd to read; it was taken after one period
+        u64 counter = forwarded ? _interval : group ? readGroup(perf_event, siginfo, ucontext, &event) : readCounter(siginfo, ucontext);
+        if (_mem_access && perf_event != NULL) {
+            readMemAccess(perf_event, &event);
+        }
         VMThread* vm_thread = VMThread::current();
         if (vm_thread) {
             event._execution_mode = VM::jni() != NULL
@@ -720,13 +869,23 @@ void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
                 : ExecutionMode::JVM;
         }
         Profiler::instance()->recordSample(ucontext, counter, tid, BCI_CPU, &event);
+        if (_mem_access && !_drain) {
+            // the ring is mapped for the load even when no kernel stack is walked out of it
+            discardBuffer(tid);
+        }
         Shims::instance().setSighandlerTid(-1);
     } else {
-        resetBuffer(tid);
+        discardBuffer(tid);
     }
 
-    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
+    if (forwarded) {
+        SignalLatency::exit(SIGNAL_ENGINE_PERF, entry);
+        return;
+    }
+    // resetting the whole group turns the next group read into deltas
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, group ? PERF_IOC_FLAG_GROUP : 0);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+    SignalLatency::exit(SIGNAL_ENGINE_PERF, entry);
 }
 
 Error PerfEvents::check(Arguments& args) {
@@ -737,11 +896,13 @@ Error PerfEvents::check(Arguments& args) {
         return Error("/proc/sys/kernel/perf_event_paranoid doesn't exist");
     }
 
-    PerfEventType* event_type = PerfEventType::forName(args._event == NULL ? EVENT_CPU : args._event);
+    PerfEventType* event_type = PerfEventType::forName(eventName(args));
     if (event_type == NULL) {
         return Error("Unsupported event type");
     } else if (event_type->counter_arg > 4) {
         return Error("Only arguments 1-4 can be counted");
+    } else if (args._mem_access && event_type->type == PERF_TYPE_SOFTWARE) {
+        return Error("memaccess needs a precise PMU event");
     }
 
     if (_pthread_entry == NULL && (_pthread_entry = lookupThreadEntry()) == NULL) {
@@ -762,6 +923,10 @@ Error PerfEvents::check(Arguments& args) {
 
     attr.sample_period = event_type->default_interval;
     attr.sample_type = PERF_SAMPLE_CALLCHAIN;
+    if (args._mem_access) {
+        attr.sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+        attr.precise_ip = 1;
+    }
     attr.disabled = 1;
 
     if (!(_ring & RING_KERNEL)) {
@@ -801,11 +966,13 @@ Error PerfEvents::check(Arguments& args) {
 }
 
 Error PerfEvents::start(Arguments& args) {
-    _event_type = PerfEventType::forName(args._event == NULL ? EVENT_CPU : args._event);;
+    _event_type = PerfEventType::forName(eventName(args));
     if (_event_type == NULL) {
         return Error("Unsupported event type");
     } else if (_event_type->counter_arg > 4) {
         return Error("Only arguments 1-4 can be counted");
+    } else if (args._mem_access && _event_type->type == PERF_TYPE_SOFTWARE) {
+        return Error("memaccess needs a precise PMU event");
     }
 
     if (_pthread_entry == NULL && (_pthread_entry = lookupThreadEntry()) == NULL) {
@@ -833,11 +1000,40 @@ Error PerfEvents::start(Arguments& args) {
     _use_mmap_page = _cstack != CSTACK_NO && (_ring != RING_USER || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR);
 
     int max_events = OS::getMaxThreadId();
+    // LBR records carry the branch stack in between, the drained ones would need a user stack to be useful
+    bool drain = args._perf_drain && _cstack != CSTACK_LBR;
+    bool mem_access = args._mem_access && _cstack != CSTACK_LBR;
     if (max_events != _max_events) {
         free(_events);
         _events = (PerfEvent*)calloc(max_events, sizeof(PerfEvent));
         _max_events = max_events;
+    } else if (_pmu_group != args._pmu_counters || _ring_pages != args._perf_ring_pages || _drain != drain || _mem_access != mem_access) {
+        // the events kept registered since the last stop() read in the other format or map another ring size
+        for (int tid = 0; tid < _max_events; tid++) {
+            unregisterThread(tid);
+        }
+    }
+    _pmu_group = args._pmu_counters;
+    _ring_pages = args._perf_ring_pages;
+    _drain = drain;
+    _mem_access = mem_access;
+
+    if (args._perf_per_cpu && _cstack != CSTACK_LBR && !_pmu_group && !_mem_access) {
+        // per-thread events kept registered since the last stop() would sample the threads twice
+        _per_cpu = false;
+        for (int tid = 0; tid < _max_events; tid++) {
+            unregisterThread(tid);
+        }
+        OS::installSignalHandler(SIGPROF, signalHandler);
+        Error error = startPerCpu();
+        if (!error) {
+            // the hook still sets up ProfiledThread for new threads, registering them is a no-op
+            __atomic_store_n(_pthread_entry, (void*)pthread_setspecific_hook, __ATOMIC_RELEASE);
+            return Error::OK;
+        }
+        Log::warn("%s, falling back to per-thread perf events", error.message());
     }
+    _per_cpu = false;
 
     OS::installSignalHandler(SIGPROF, signalHandler);
 
@@ -909,6 +1105,294 @@ void PerfEvents::stop() {
     // Instead, since we know we are continuously profiling and we know the interval
     // doesn't change, simply don't unregister threads on stop, and check whether the
     // thread has been registered already on start.
+    // The CPU events are few and cheap to reopen, unlike them.
+    if (_per_cpu) {
+        stopPerCpu();
+    }
+}
+
+bool PerfEvents::setInterval(long interval) {
+    u64 period = interval;
+    _interval = interval;
+    if (_per_cpu) {
+        for (int cpu = 0; cpu < _cpu_count; cpu++) {
+            if (_cpu_fds[cpu] >= 0) {
+                ioctl(_cpu_fds[cpu], PERF_EVENT_IOC_PERIOD, &period);
+            }
+        }
+        return true;
+    }
+    // threads registered from now on pick up the new interval themselves
+    for (int tid = 0; tid < _max_events; tid++) {
+        int fd = _events[tid]._fd;
+        if (fd > 0) {
+            ioctl(fd, PERF_EVENT_IOC_PERIOD, &period);
+        }
+    }
+    return true;
+}
+
+// The cgroup of the process, so that CPU events do not sample unrelated processes; -1 if unavailable
+static int openOwnCgroup() {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    int fd = -1;
+    char line[PATH_MAX];
+    while (fd == -1 && fgets(line, sizeof(line), file) != NULL) {
+        // hierarchy-id:controllers:path, the controllers are empty for the cgroup v2 hierarchy
+        char* controllers = strchr(line, ':');
+        char* cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+        if (cgroup == NULL) {
+            continue;
+        }
+        *cgroup++ = 0;
+        cgroup[strcspn(cgroup, "\n")] = 0;
+        const char* mount = controllers[1] == 0 ? "/sys/fs/cgroup" : strstr(controllers + 1, "perf_event") != NULL ? "/sys/fs/cgroup/perf_event" : NULL;
+        if (mount != NULL && (size_t)snprintf(path, sizeof(path), "%s%s", mount, cgroup) < sizeof(path)) {
+            fd = open(path, O_RDONLY);
+        }
+    }
+    fclose(file);
+    return fd;
+}
+
+Error PerfEvents::startPerCpu() {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = _event_type->type;
+
+    if (attr.type == PERF_TYPE_BREAKPOINT) {
+        attr.bp_type = _event_type->config;
+    } else {
+        attr.config = _event_type->config;
+    }
+    attr.config1 = _event_type->config1;
+    attr.config2 = _event_type->config2;
+
+    if (attr.type == PERF_TYPE_SOFTWARE) {
+        attr.precise_ip = 2;
+    }
+
+    attr.sample_period = _interval;
+    // the tid routes a sample to its thread; only the kernel part of the chain is of use,
+    // the rest is walked by the signal handler on the thread
+    attr.sample_type = PERF_SAMPLE_TID | ((_ring & RING_KERNEL) ? PERF_SAMPLE_CALLCHAIN : 0);
+    attr.exclude_callchain_user = 1;
+    attr.disabled = 1;
+    attr.wakeup_events = 1;
+    if (!(_ring & RING_KERNEL)) {
+        attr.exclude_kernel = 1;
+    }
+    if (!(_ring & RING_USER)) {
+        attr.exclude_user = 1;
+    }
+
+    int cgroup_fd = openOwnCgroup();
+    _cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    _cpu_fds = (int*)calloc(_cpu_count, sizeof(int));
+    _cpu_pages = (struct perf_event_mmap_page**)calloc(_cpu_count, sizeof(struct perf_event_mmap_page*));
+    size_t ring_size = (1 + PER_CPU_RING_PAGES) * OS::page_size;
+
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        _cpu_fds[cpu] = -1;
+    }
+
+    int err = 0;
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        int fd = syscall(__NR_perf_event_open, &attr, cgroup_fd, cpu, -1, cgroup_fd >= 0 ? PERF_FLAG_PID_CGROUP : 0);
+        if (fd == -1) {
+            if (errno == ENODEV) {
+                continue;  // offline CPU
+            }
+            err = errno;
+            break;
+        }
+        void* page = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (page == MAP_FAILED) {
+            err = errno;
+            close(fd);
+            break;
+        }
+        _cpu_fds[cpu] = fd;
+        _cpu_pages[cpu] = (struct perf_event_mmap_page*)page;
+    }
+    if (cgroup_fd >= 0) {
+        close(cgroup_fd);
+    }
+
+    if (err == 0) {
+        if (_forwarded_stacks == NULL) {
+            // never freed: a forwarded signal may still be in flight after stop()
+            _forwarded_stacks = (ForwardedStack*)calloc(FORWARDED_STACK_SLOTS, sizeof(ForwardedStack));
+        }
+        _per_cpu = true;
+        _reader_running = true;
+        if (pthread_create(&_reader_thread, NULL, readerEntry, NULL) != 0) {
+            _reader_running = false;
+            err = EAGAIN;
+        }
+    }
+    if (err != 0) {
+        stopPerCpu();
+        _per_cpu = false;
+        return Error(err == EACCES || err == EPERM ? "No access to per-CPU perf events. Try 'sysctl kernel.perf_event_paranoid=0'"
+                                                   : "Per-CPU perf events unavailable");
+    }
+
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        if (_cpu_fds[cpu] >= 0) {
+            ioctl(_cpu_fds[cpu], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    return Error::OK;
+}
+
+void PerfEvents::stopPerCpu() {
+    if (_reader_running) {
+        _reader_running = false;
+        pthread_join(_reader_thread, NULL);
+    }
+    size_t ring_size = (1 + PER_CPU_RING_PAGES) * OS::page_size;
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        if (_cpu_fds[cpu] >= 0) {
+            ioctl(_cpu_fds[cpu], PERF_EVENT_IOC_DISABLE, 0);
+            munmap(_cpu_pages[cpu], ring_size);
+            close(_cpu_fds[cpu]);
+        }
+    }
+    free(_cpu_fds);
+    free(_cpu_pages);
+    _cpu_fds = NULL;
+    _cpu_pages = NULL;
+    _cpu_count = 0;
+}
+
+void PerfEvents::readerLoop() {
+    int self = OS::threadId();
+    struct pollfd* fds = (struct pollfd*)calloc(_cpu_count, sizeof(struct pollfd));
+    struct perf_event_mmap_page** pages = (struct perf_event_mmap_page**)calloc(_cpu_count, sizeof(struct perf_event_mmap_page*));
+    int count = 0;
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        if (_cpu_fds[cpu] >= 0) {
+            fds[count].fd = _cpu_fds[cpu];
+            fds[count].events = POLLIN;
+            pages[count++] = _cpu_pages[cpu];
+        }
+    }
+
+    while (_reader_running) {
+        // the timeout only bounds how long stopPerCpu() waits for the reader to notice
+        if (poll(fds, count, 100) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (fds[i].revents & POLLIN) {
+                drainCpuRing(pages[i], self);
+            }
+        }
+    }
+
+    free(fds);
+    free(pages);
+}
+
+void PerfEvents::drainCpuRing(struct perf_event_mmap_page* page, int reader_tid) {
+    u64 tail = page->data_tail;
+    u64 head = page->data_head;
+    rmb();
+
+    RingBuffer ring(page, PER_CPU_RING_PAGES * OS::page_size - 1);
+    int pid = OS::processId();
+    while (tail < head) {
+        struct perf_event_header* hdr = ring.seek(tail);
+        if (hdr->type == PERF_RECORD_SAMPLE) {
+            u64 pid_tid_word = ring.next();
+            u32 pid_tid[2];
+            memcpy(pid_tid, &pid_tid_word, sizeof(pid_tid));
+            int tid = (int)pid_tid[1];
+            if ((int)pid_tid[0] == pid && tid != reader_tid) {
+                ForwardedStack* stack = &_forwarded_stacks[(u32)tid % FORWARDED_STACK_SLOTS];
+                if ((_ring & RING_KERNEL) && stack->tryLock()) {
+                    u64 nr = ring.next();
+                    int depth = 0;
+                    while (nr-- > 0 && depth < FORWARDED_STACK_DEPTH) {
+                        u64 ip = ring.next();
+                        if (ip < PERF_CONTEXT_MAX) {
+                            stack->frames[depth++] = (const void*)ip;
+                        }
+                    }
+                    stack->depth = depth;
+                    stack->tid = tid;
+                    stack->unlock();
+                }
+                OS::sendSignalToThread(tid, SIGPROF, FORWARDED_SAMPLE_VALUE);
+            }
+        }
+        tail += hdr->size;
+    }
+
+    __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+}
+
+void PerfEvents::readMemAccess(PerfEvent* event, ExecutionEvent* sample) {
+    if (!event->tryLock()) {
+        return;  // the event is being destroyed
+    }
+
+    struct perf_event_mmap_page* page = event->_page;
+    if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page, _ring_pages * OS::page_size - 1);
+        u64 newest = head;
+        for (u64 offset = tail; offset < head; ) {
+            struct perf_event_header* hdr = ring.seek(offset);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                newest = offset;
+            }
+            offset += hdr->size;
+        }
+
+        if (newest != head) {
+            // ADDR precedes the callchain, WEIGHT and DATA_SRC follow it
+            ring.seek(newest);
+            if (_drain) {
+                ring.next();
+                ring.next();
+            }
+            sample->_data_address = ring.next();
+            u64 nr = ring.next();
+            sample->_access_latency = ring.peek(nr + 1);
+            sample->_data_source = ring.peek(nr + 2);
+            sample->_has_mem_access = true;
+        }
+    }
+
+    event->unlock();
+}
+
+// Copies the PERF_SAMPLE_CALLCHAIN the ring is positioned before, up to the first Java frame
+static int readCallchain(RingBuffer& ring, const void** callchain, int max_depth, StackContext* java_ctx) {
+    int depth = 0;
+    u64 nr = ring.next();
+    while (nr-- > 0) {
+        u64 ip = ring.next();
+        if (ip < PERF_CONTEXT_MAX) {
+            const void* iptr = (const void*)ip;
+            if (CodeHeap::contains(iptr) || depth >= max_depth) {
+                java_ctx->pc = iptr;
+                break;
+            }
+            callchain[depth++] = iptr;
+        }
+    }
+    return depth;
 }
 
 int PerfEvents::walkKernel(int tid, const void** callchain, int max_depth, StackContext *java_ctx) {
@@ -916,6 +1400,9 @@ int PerfEvents::walkKernel(int tid, const void** callchain, int max_depth, Stack
         // we are not capturing kernel stacktraces
         return 0;
     }
+    if (_per_cpu) {
+        return walkForwardedKernel(tid, callchain, max_depth, java_ctx);
+    }
 
     PerfEvent* event = &_events[tid];
     if (!event->tryLock()) {
@@ -925,16 +1412,55 @@ int PerfEvents::walkKernel(int tid, const void** callchain, int max_depth, Stack
     int depth = 0;
 
     struct perf_event_mmap_page* page = event->_page;
-    if (page != NULL) {
+    if (page != NULL && _drain) {
         u64 tail = page->data_tail;
         u64 head = page->data_head;
         rmb();
 
-        RingBuffer ring(page);
+        RingBuffer ring(page, _ring_pages * OS::page_size - 1);
+
+        // The newest sample belongs to this signal; the older ones stay in the ring for walkBacklog()
+        u64 newest = head;
+        u64 newest_time = 0;
+        for (u64 offset = tail; offset < head; ) {
+            struct perf_event_header* hdr = ring.seek(offset);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                ring.next();
+                u64 time = ring.next();
+                if (newest == head || time >= newest_time) {
+                    newest = offset;
+                    newest_time = time;
+                }
+            }
+            offset += hdr->size;
+        }
+
+        if (newest != head) {
+            ring.seek(newest);
+            ring.next();
+            ring.next();
+            if (_mem_access) {
+                ring.next();
+            }
+            depth = readCallchain(ring, callchain, max_depth, java_ctx);
+        }
+        event->_drain_next = tail;
+        event->_drain_skip = newest;
+        event->_drain_head = head;
+    } else if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page, _ring_pages * OS::page_size - 1);
 
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
             if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (_mem_access) {
+                    // PERF_SAMPLE_ADDR
+                    ring.next();
+                }
                 u64 nr = ring.next();
                 while (nr-- > 0) {
                     u64 ip = ring.next();
@@ -993,7 +1519,101 @@ stack_complete:
     return depth;
 }
 
+int PerfEvents::walkBacklog(int tid, const void** callchain, int max_depth, int* sample_tid) {
+    if (!_drain || _per_cpu) {
+        return -1;
+    }
+
+    PerfEvent* event = &_events[tid];
+    if (!event->tryLock()) {
+        return -1;  // the event is being destroyed
+    }
+
+    int depth = -1;
+    struct perf_event_mmap_page* page = event->_page;
+    if (page != NULL && event->_drain_head == 0) {
+        // walkKernel() did not run for this signal, e.g. without stack traces: nothing to attribute
+        u64 head = page->data_head;
+        rmb();
+        page->data_tail = head;
+    } else if (page != NULL) {
+        RingBuffer ring(page, _ring_pages * OS::page_size - 1);
+        while (depth < 0 && event->_drain_next < event->_drain_head) {
+            u64 offset = event->_drain_next;
+            struct perf_event_header* hdr = ring.seek(offset);
+            event->_drain_next += hdr->size;
+            if (hdr->type == PERF_RECORD_SAMPLE && offset != event->_drain_skip) {
+                u64 pid_tid_word = ring.next();
+                u32 pid_tid[2];
+                memcpy(pid_tid, &pid_tid_word, sizeof(pid_tid));
+                *sample_tid = (int)pid_tid[1];
+                ring.next();
+                if (_mem_access) {
+                    ring.next();
+                }
+                StackContext java_ctx = {0};
+                depth = readCallchain(ring, callchain, max_depth, &java_ctx);
+            }
+        }
+        if (depth < 0) {
+            // every pending record has been visited
+            page->data_tail = event->_drain_head;
+            event->_drain_head = 0;
+        }
+    }
+
+    event->unlock();
+    return depth;
+}
+
+int PerfEvents::walkForwardedKernel(int tid, const void** callchain, int max_depth, StackContext* java_ctx) {
+    ForwardedStack* stack = &_forwarded_stacks[(u32)tid % FORWARDED_STACK_SLOTS];
+    if (!stack->tryLock()) {
+        return 0;  // the reader thread is overwriting the slot
+    }
+
+    int depth = 0;
+    if (stack->tid == tid) {
+        for (int i = 0; i < stack->depth; i++) {
+            const void* iptr = stack->frames[i];
+            if (CodeHeap::contains(iptr) || depth >= max_depth) {
+                // Stop at the first Java frame
+                java_ctx->pc = iptr;
+                break;
+            }
+            callchain[depth++] = iptr;
+        }
+        stack->tid = 0;
+    }
+
+    stack->unlock();
+    return depth;
+}
+
 void PerfEvents::resetBuffer(int tid) {
+    if (_per_cpu) {
+        ForwardedStack* stack = &_forwarded_stacks[(u32)tid % FORWARDED_STACK_SLOTS];
+        if (stack->tryLock()) {
+            if (stack->tid == tid) {
+                stack->tid = 0;
+            }
+            stack->unlock();
+        }
+        return;
+    }
+
+    if (!_drain) {
+        discardBuffer(tid);
+    }
+    // otherwise the records of a skipped sample are recorded by the next walkBacklog()
+}
+
+void PerfEvents::discardBuffer(int tid) {
+    if (_per_cpu) {
+        resetBuffer(tid);
+        return;
+    }
+
     PerfEvent* event = &_events[tid];
     if (!event->tryLock()) {
         return;  // the event is being destroyed
@@ -1004,11 +1624,244 @@ void PerfEvents::resetBuffer(int tid) {
         u64 head = page->data_head;
         rmb();
         page->data_tail = head;
+        event->_drain_head = 0;
     }
 
     event->unlock();
 }
 
+// perf sigtrap came with Linux 5.13, along with the si_code telling its SIGTRAP apart
+#ifndef TRAP_PERF
+#define TRAP_PERF 6
+#endif
+
+class SwitchEvent : public SpinLock {
+  private:
+    int _fd;
+    struct perf_event_mmap_page* _page;
+
+    friend class SwitchEvents;
+};
+
+volatile bool SwitchEvents::_enabled = false;
+volatile bool SwitchEvents::_running = false;
+int SwitchEvents::_max_events = 0;
+SwitchEvent* SwitchEvents::_events = NULL;
+long SwitchEvents::_threshold = 0;
+
+static bool openSwitchEvent(struct perf_event_attr* attr) {
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_SOFTWARE;
+    attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+    attr->sample_period = 1;
+    // the time of the switch out, on the clock of OS::nanotime()
+    attr->sample_type = PERF_SAMPLE_TIME;
+    attr->use_clockid = 1;
+    attr->clockid = CLOCK_MONOTONIC;
+    // the switches happen in the kernel, they are not counted with exclude_kernel
+    attr->disabled = 1;
+#ifdef PERF_ATTR_SIZE_VER7
+    attr->sigtrap = 1;
+    attr->remove_on_exec = 1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+Error SwitchEvents::check(Arguments& args) {
+    struct perf_event_attr attr;
+    if (!openSwitchEvent(&attr)) {
+        return Error("wallswitch needs kernel headers 5.13+");
+    }
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd == -1) {
+        int err = errno;
+        if (err == EACCES || err == EPERM) {
+            return Error("No access to perf events. Try 'sysctl kernel.perf_event_paranoid=1'");
+        }
+        return Error(err == EINVAL ? "Context switch events with sigtrap need Linux 5.13+" : strerror(err));
+    }
+    close(fd);
+    return Error::OK;
+}
+
+Error SwitchEvents::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+    _threshold = args._wall_switch;
+
+    int max_events = OS::getMaxThreadId();
+    if (max_events != _max_events) {
+        free(_events);
+        _events = (SwitchEvent*)calloc(max_events, sizeof(SwitchEvent));
+        _max_events = max_events;
+    }
+    _running = true;
+
+    // the threads started from now on are registered by the thread start callbacks
+    ThreadList* thread_list = OS::listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        int err = registerThread(tid);
+        if (err == EACCES || err == EPERM) {
+            delete thread_list;
+            stop();
+            return Error("No access to perf events. Try 'sysctl kernel.perf_event_paranoid=1'");
+        }
+    }
+    delete thread_list;
+    return Error::OK;
+}
+
+void SwitchEvents::stop() {
+    // unlike the sampling events, these signal every thread on every switch, so they are not kept
+    _running = false;
+    for (int tid = 0; tid < _max_events; tid++) {
+        unregisterThread(tid);
+    }
+}
+
+int SwitchEvents::registerThread(int tid) {
+    if (!_running || tid >= _max_events) {
+        return 0;
+    }
+    SwitchEvent* event = &_events[tid];
+    // mark the slot early, the thread may be registered by start() and its own callback at once
+    if (!__sync_bool_compare_and_swap(&event->_fd, 0, -1)) {
+        return 0;
+    }
+
+    struct perf_event_attr attr;
+    openSwitchEvent(&attr);
+    int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd == -1) {
+        int err = errno;
+        Log::debug("perf_event_open of context switches for TID %d failed: %s", tid, strerror(err));
+        event->_fd = 0;
+        return err;
+    }
+    void* page = mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        Log::debug("perf_event mmap failed: %s", strerror(errno));
+        close(fd);
+        event->_fd = 0;
+        return 0;
+    }
+
+    event->lock();
+    event->_page = (struct perf_event_mmap_page*)page;
+    event->unlock();
+    __atomic_store_n(&event->_fd, fd, __ATOMIC_RELEASE);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return 0;
+}
+
+void SwitchEvents::unregisterThread(int tid) {
+    if (tid >= _max_events) {
+        return;
+    }
+    SwitchEvent* event = &_events[tid];
+    int fd = event->_fd;
+    if (fd > 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
+        // closed under the lock, so that the trap handler never toggles a descriptor reused meanwhile
+        event->lock();
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        close(fd);
+        munmap(event->_page, 2 * OS::page_size);
+        event->_page = NULL;
+        event->unlock();
+    }
+}
+
+u64 SwitchEvents::takeSwitchOut(SwitchEvent* event) {
+    if (!event->tryLock()) {
+        return 0;  // the event is being destroyed
+    }
+    u64 switch_out = 0;
+    struct perf_event_mmap_page* page = event->_page;
+    if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+        // switches within the kernel may precede the return to user space; the episode starts with the first
+        RingBuffer ring(page);
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE && switch_out == 0) {
+                switch_out = ring.next();
+            }
+            tail += hdr->size;
+        }
+        __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+    }
+    event->unlock();
+    return switch_out;
+}
+
+void SwitchEvents::enableEvent(SwitchEvent* event, int fd, bool enabled) {
+    if (event->tryLock()) {
+        if (event->_fd == fd) {
+            ioctl(fd, enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+        }
+        event->unlock();
+    }
+}
+
+bool SwitchEvents::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    if (siginfo->si_code != TRAP_PERF || _events == NULL) {
+        return false;
+    }
+    u64 now = OS::nanotime();
+    ProfiledThread* current = ProfiledThread::current();
+    int tid = current != NULL ? current->tid() : OS::threadId();
+    u64 switch_out = tid < _max_events ? takeSwitchOut(&_events[tid]) : 0;
+    if (switch_out == 0 || switch_out >= now || !_enabled) {
+        return true;
+    }
+    u64 duration = now - switch_out;
+    if (duration < (u64)_threshold) {
+        Counters::increment(SWITCH_EPISODES_SKIPPED);
+        return true;
+    }
+
+    // The stack walk may fault and block: the switches within the handler must not raise traps of their own,
+    // which the thread would take as soon as the handler returns
+    SwitchEvent* switch_event = &_events[tid];
+    int fd = __atomic_load_n(&switch_event->_fd, __ATOMIC_ACQUIRE);
+    if (fd > 0) {
+        enableEvent(switch_event, fd, false);
+    }
+
+    Shims::instance().setSighandlerTid(tid);
+    ExecutionEvent event;
+    event._off_cpu_nanos = duration;
+    // the thread returns from the syscall it blocked in, or to the code it was preempted in
+    bool in_syscall = WallClock::inSyscall(ucontext);
+    ThreadState state = in_syscall ? ThreadState::SYSCALL : ThreadState::RUNNABLE;
+    ExecutionMode mode = in_syscall ? ExecutionMode::SYSCALL : ExecutionMode::UNKNOWN;
+    VMThread* vm_thread = VMThread::current();
+    if (vm_thread) {
+        // a thread parked or waiting by the JVM has yet to move out of its wait state
+        ThreadState os_state = vm_thread->osThreadState();
+        if (os_state != ThreadState::UNKNOWN && os_state != ThreadState::RUNNABLE) {
+            state = os_state;
+        }
+        mode = VM::jni() != NULL ? convertJvmExecutionState(vm_thread->state()) : ExecutionMode::JVM;
+    }
+    event._thread_state = state;
+    event._execution_mode = mode;
+    Profiler::instance()->recordSample(ucontext, duration, tid, BCI_WALL, &event);
+    Shims::instance().setSighandlerTid(-1);
+
+    if (fd > 0) {
+        enableEvent(switch_event, fd, true);
+    }
+    return true;
+}
+
 const char* PerfEvents::getEventName(int event_id) {
     if (event_id >= 0 && (size_t)event_id < sizeof(PerfEventType::AVAILABLE_EVENTS) / sizeof(PerfEventType)) {
         return PerfEventType::AVAILABLE_EVENTS[event_id].name;
@@ -46,10 +46,18 @@ Error PerfEvents::start(Arguments& args) {
 void PerfEvents::stop() {
 }
 
+bool PerfEvents::setInterval(long interval) {
+    return false;
+}
+
 int PerfEvents::walkKernel(int tid, const void** callchain, int max_depth, StackContext *java_ctx) {
     return 0;
 }
 
+int PerfEvents::walkBacklog(int tid, const void** callchain, int max_depth, int* sample_tid) {
+    return -1;
+}
+
 void PerfEvents::resetBuffer(int tid) {
 }
 
@@ -64,4 +72,33 @@ int PerfEvents::registerThread(int tid) {
 void PerfEvents::unregisterThread(int tid) {
 }
 
+
+volatile bool SwitchEvents::_enabled = false;
+volatile bool SwitchEvents::_running = false;
+int SwitchEvents::_max_events = 0;
+SwitchEvent* SwitchEvents::_events = NULL;
+long SwitchEvents::_threshold = 0;
+
+Error SwitchEvents::check(Arguments& args) {
+    return Error("SwitchEvents are unsupported on macOS");
+}
+
+Error SwitchEvents::start(Arguments& args) {
+    return Error("SwitchEvents are unsupported on macOS");
+}
+
+void SwitchEvents::stop() {
+}
+
+int SwitchEvents::registerThread(int tid) {
+    return -1;
+}
+
+void SwitchEvents::unregisterThread(int tid) {
+}
+
+bool SwitchEvents::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    return false;
+}
+
 #endif // __APPLE__
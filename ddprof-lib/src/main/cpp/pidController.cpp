@@ -29,6 +29,13 @@ double PidController::compute(u64 input, double time_delta_coefficient) {
     double signal = _proportional_gain * absolute_error + _integral_gain * _integral_value + _derivative_gain * derivative;
 
     _integral_value += absolute_error;
+    if (_integral_limit > 0) {
+        if (_integral_value > _integral_limit) {
+            _integral_value = (long long)_integral_limit;
+        } else if (_integral_value < -_integral_limit) {
+            _integral_value = -(long long)_integral_limit;
+        }
+    }
     _avg_error = avg_error;
 
     return signal;
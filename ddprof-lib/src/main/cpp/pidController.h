@@ -34,6 +34,8 @@ class PidController {
 
         double _avg_error;
         long long _integral_value;
+        // the bound of the integral value, 0 if unbounded
+        double _integral_limit;
 
         inline static double computeAlpha(float cutoff) {
             if (cutoff <= 0)
@@ -44,14 +46,18 @@ class PidController {
         }
 
     public:
-        PidController(u64 target_per_second, double proportional_gain, double integral_gain, double derivative_gain, int sampling_window, double cutoff_secs) : 
+        // A non-zero max_integral_signal is an anti-windup: the integral term of the signal stays within it,
+        // so that the error summed up while the output saturates is not paid back with an overshoot
+        PidController(u64 target_per_second, double proportional_gain, double integral_gain, double derivative_gain, int sampling_window, double cutoff_secs,
+                      double max_integral_signal = 0) :
             _target(target_per_second * sampling_window), 
             _proportional_gain(proportional_gain), 
-            _integral_gain(integral_gain * sampling_window), 
             _derivative_gain(derivative_gain / sampling_window),
+            _integral_gain(integral_gain * sampling_window), 
             _alpha(computeAlpha(sampling_window / cutoff_secs)),
             _avg_error(0),
-            _integral_value(0) {}
+            _integral_value(0),
+            _integral_limit(max_integral_signal > 0 && integral_gain > 0 ? max_integral_signal / (integral_gain * sampling_window) : 0) {}
         
         double compute(u64 input, double time_delta_seconds);
 };
@@ -0,0 +1,434 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#include "gzipWriter.h"
+#include "pprofWriter.h"
+#include "profiler.h"
+#include "tsc.h"
+
+
+static const char* const PPROF_SAMPLE_TYPES[PPROF_KINDS][4] = {
+    {"cpu-samples", "count", "cpu-time", "nanoseconds"},
+    {"wall-samples", "count", "wall-time", "nanoseconds"},
+    {"alloc-samples", "count", "alloc-space", "bytes"},
+    {"lock-count", "count", "lock-time", "nanoseconds"},
+    {"malloc-samples", "count", "malloc-space", "bytes"}
+};
+
+// Field numbers of profile.proto
+enum {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10,
+    PROFILE_PERIOD_TYPE = 11,
+    PROFILE_PERIOD = 12,
+    PROFILE_COMMENT = 13,
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+    SAMPLE_LABEL = 3,
+    LABEL_KEY = 1,
+    LABEL_STR = 2,
+    LABEL_NUM = 3,
+    LOCATION_ID = 1,
+    LOCATION_LINE = 4,
+    LINE_FUNCTION_ID = 1,
+    LINE_LINE = 2,
+    FUNCTION_ID = 1,
+    FUNCTION_NAME = 2,
+    FUNCTION_SYSTEM_NAME = 3
+};
+
+// Appends protobuf fields to a string
+class ProtoBuffer {
+  private:
+    std::string _data;
+
+    void tag(int field, int wire_type) {
+        varint((u64)field << 3 | wire_type);
+    }
+
+  public:
+    const std::string& data() const {
+        return _data;
+    }
+
+    void clear() {
+        _data.clear();
+    }
+
+    void varint(u64 value) {
+        while (value >= 0x80) {
+            _data += (char)(value | 0x80);
+            value >>= 7;
+        }
+        _data += (char)value;
+    }
+
+    void field(int field, u64 value) {
+        tag(field, 0);
+        varint(value);
+    }
+
+    void bytes(int field, const char* data, size_t size) {
+        tag(field, 2);
+        varint(size);
+        _data.append(data, size);
+    }
+
+    void message(int field, const ProtoBuffer& message) {
+        bytes(field, message._data.data(), message._data.size());
+    }
+
+    void packed(int field, const std::vector<u64>& values) {
+        ProtoBuffer buf;
+        for (size_t i = 0; i < values.size(); i++) {
+            buf.varint(values[i]);
+        }
+        message(field, buf);
+    }
+};
+
+// Maps the symbols of a Lookup to the indexes of the pprof string table, in the order of their first use
+class PprofStrings {
+  private:
+    Lookup* _lookup;
+    std::unordered_map<u32, u64> _indexes;
+    std::vector<u32> _symbols;
+
+  public:
+    PprofStrings(Lookup* lookup) : _lookup(lookup) {
+    }
+
+    u64 index(const char* str) {
+        if (str == NULL || str[0] == 0) {
+            return 0;
+        }
+        u32 symbol = _lookup->getSymbol(str);
+        std::pair<std::unordered_map<u32, u64>::iterator, bool> it = _indexes.insert(
+            std::make_pair(symbol, (u64)_symbols.size() + 1));
+        if (it.second) {
+            _symbols.push_back(symbol);
+        }
+        return it.first->second;
+    }
+
+    void write(ProtoBuffer& profile) {
+        profile.bytes(PROFILE_STRING_TABLE, "", 0);
+        for (size_t i = 0; i < _symbols.size(); i++) {
+            size_t length = 0;
+            const char* key = _lookup->_symbols->key(_symbols[i], &length);
+            profile.bytes(PROFILE_STRING_TABLE, key != NULL ? key : "", key != NULL ? length : 0);
+        }
+    }
+};
+
+PprofWriter::PprofWriter(Arguments& args) : _path(args._pprof), _method_map() {
+    for (size_t i = 0; i < args._context_attributes.size() && i < DD_TAGS_CAPACITY; i++) {
+        _attributes.push_back(args._context_attributes[i]);
+    }
+    _entries = (PprofEntry*)calloc((size_t)CONCURRENCY_LEVEL * TABLE_SIZE, sizeof(PprofEntry));
+    _retired_entries = (PprofEntry*)calloc((size_t)CONCURRENCY_LEVEL * TABLE_SIZE, sizeof(PprofEntry));
+    memset(_dropped, 0, sizeof(_dropped));
+    memset(_retired_dropped, 0, sizeof(_retired_dropped));
+}
+
+PprofWriter::~PprofWriter() {
+    free(_entries);
+    free(_retired_entries);
+}
+
+void PprofWriter::retire() {
+    // the retired tables have been cleared by the previous write()
+    PprofEntry* entries = _entries;
+    _entries = _retired_entries;
+    _retired_entries = entries;
+    memcpy(_retired_dropped, _dropped, sizeof(_dropped));
+    memset(_dropped, 0, sizeof(_dropped));
+}
+
+u64 PprofWriter::hash(const PprofEntry& key, int tags) {
+    u64 h = ((u64)key.call_trace_id << 3 | key.kind) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ key.span_id) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ key.root_span_id) * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < tags; i++) {
+        h = (h ^ key.tags[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+    h ^= h >> 29;
+    return h != 0 ? h : 1;
+}
+
+bool PprofWriter::add(PprofEntry* table, PprofEntry& key, u64 total) {
+    int tags = (int)_attributes.size();
+    key.hash = hash(key, tags);
+    u32 slot = (u32)key.hash & (TABLE_SIZE - 1);
+    for (int probe = 0; probe < MAX_PROBES; probe++, slot = (slot + 1) & (TABLE_SIZE - 1)) {
+        PprofEntry* entry = &table[slot];
+        if (entry->hash == 0) {
+            *entry = key;
+            entry->total = total;
+            return true;
+        } else if (entry->hash != key.hash || entry->call_trace_id != key.call_trace_id || entry->kind != key.kind
+                   || entry->span_id != key.span_id || entry->root_span_id != key.root_span_id
+                   || memcmp(entry->tags, key.tags, tags * sizeof(u32)) != 0) {
+            continue;
+        }
+        entry->count += key.count;
+        entry->total += total;
+        return true;
+    }
+    return false;
+}
+
+void PprofWriter::record(int lock_index, int tid, u32 call_trace_id, int event_type, Event* event) {
+    if (_entries == NULL) {
+        return;
+    }
+
+    PprofEntry key;
+    memset(&key, 0, sizeof(key));
+    key.call_trace_id = call_trace_id;
+    key.count = 1;
+    u64 total;
+    switch (event_type) {
+        case BCI_CPU:
+            key.kind = PPROF_CPU;
+            key.count = ((ExecutionEvent*)event)->_weight;
+            total = key.count * Profiler::instance()->cpuEngine()->interval();
+            break;
+        case BCI_WALL:
+            key.kind = PPROF_WALL;
+            key.count = ((ExecutionEvent*)event)->_weight;
+            // the measured off-CPU time rather than the sampling interval with wallswitch
+            total = ((ExecutionEvent*)event)->_off_cpu_nanos > 0 ? ((ExecutionEvent*)event)->_off_cpu_nanos
+                  : key.count * Profiler::instance()->wallEngine()->interval();
+            break;
+        case BCI_ALLOC:
+            key.kind = PPROF_ALLOC;
+            total = (u64)(((AllocEvent*)event)->_size * ((AllocEvent*)event)->_weight);
+            break;
+        case BCI_LOCK:
+        case BCI_PARK: {
+            LockEvent* lock = (LockEvent*)event;
+            key.kind = PPROF_LOCK;
+            total = (u64)((double)(lock->_end_time - lock->_start_time) * 1e9 / TSC::frequency() * lock->_weight);
+            break;
+        }
+        case BCI_NATIVE_MALLOC:
+            key.kind = PPROF_MALLOC;
+            total = (u64)(((MallocEvent*)event)->_size * ((MallocEvent*)event)->_weight);
+            break;
+        default:
+            // the liveness and the summary events are snapshots rather than samples of the chunk
+            return;
+    }
+
+    Context context = Contexts::get(tid);
+    key.span_id = context.spanId;
+    key.root_span_id = context.rootSpanId;
+    memcpy(key.tags, context.tags, _attributes.size() * sizeof(u32));
+
+    PprofEntry* table = _entries + (size_t)lock_index * TABLE_SIZE;
+    if (add(table, key, total)) {
+        return;
+    }
+    // the sample still counts for its stack, without the labels
+    key.span_id = 0;
+    key.root_span_id = 0;
+    memset(key.tags, 0, sizeof(key.tags));
+    if (!add(table, key, total)) {
+        _dropped[lock_index] += key.count;
+    }
+}
+
+Error PprofWriter::write(std::map<u32, CallTrace*>& traces, u64 start_micros, u64 stop_micros) {
+    if (_entries == NULL || _retired_entries == NULL) {
+        return Error("Could not allocate the pprof sample tables");
+    }
+
+    // the ids of the class map and of the symbols are only valid for this chunk
+    _method_map.clearMarks();
+    Lookup lookup(NULL, &_method_map, Profiler::instance()->classMap());
+    lookup.resolveNativePCs(traces);
+    PprofStrings strings(&lookup);
+    Dictionary* context_values = Profiler::instance()->contextValueMap();
+
+    size_t entry_count = (size_t)CONCURRENCY_LEVEL * TABLE_SIZE;
+    int columns[PPROF_KINDS];
+    int column_count = 0;
+    for (int kind = 0; kind < PPROF_KINDS; kind++) {
+        columns[kind] = -1;
+    }
+    for (size_t i = 0; i < entry_count; i++) {
+        if (_retired_entries[i].hash != 0 && columns[_retired_entries[i].kind] < 0) {
+            columns[_retired_entries[i].kind] = 0;
+        }
+    }
+
+    ProtoBuffer profile;
+    ProtoBuffer message;
+    for (int kind = 0; kind < PPROF_KINDS; kind++) {
+        if (columns[kind] < 0) {
+            continue;
+        }
+        columns[kind] = column_count;
+        column_count += 2;
+        for (int i = 0; i < 4; i += 2) {
+            message.clear();
+            message.field(VALUE_TYPE_TYPE, strings.index(PPROF_SAMPLE_TYPES[kind][i]));
+            message.field(VALUE_TYPE_UNIT, strings.index(PPROF_SAMPLE_TYPES[kind][i + 1]));
+            profile.message(PROFILE_SAMPLE_TYPE, message);
+        }
+    }
+
+    u64 span_id_key = strings.index("span id");
+    u64 root_span_id_key = strings.index("local root span id");
+    std::vector<u64> attribute_keys;
+    for (size_t i = 0; i < _attributes.size(); i++) {
+        attribute_keys.push_back(strings.index(_attributes[i].c_str()));
+    }
+
+    // the same method and line map to the same location in all the stacks
+    std::unordered_map<MethodInfo*, u64> functions;
+    std::map<std::pair<u64, jint>, u64> locations;
+    std::unordered_map<u32, std::vector<u64> > stacks;
+    ProtoBuffer line;
+    std::string name;
+    std::vector<u64> values(column_count);
+    ProtoBuffer label;
+    for (size_t i = 0; i < entry_count; i++) {
+        PprofEntry& entry = _retired_entries[i];
+        if (entry.hash == 0) {
+            continue;
+        }
+        std::map<u32, CallTrace*>::const_iterator trace = traces.find(entry.call_trace_id);
+        if (trace == traces.end()) {
+            continue;
+        }
+
+        std::pair<std::unordered_map<u32, std::vector<u64> >::iterator, bool> stack = stacks.insert(
+            std::make_pair(entry.call_trace_id, std::vector<u64>()));
+        if (stack.second) {
+            CallTrace* call_trace = trace->second;
+            for (int j = 0; j < call_trace->num_frames; j++) {
+                ASGCT_CallFrame& frame = call_trace->frames[j];
+                MethodInfo* mi = lookup.resolveMethod(frame);
+                std::pair<std::unordered_map<MethodInfo*, u64>::iterator, bool> function = functions.insert(
+                    std::make_pair(mi, (u64)functions.size() + 1));
+                if (function.second) {
+                    name.clear();
+                    lookup.appendFrameName(frame, name);
+                    message.clear();
+                    message.field(FUNCTION_ID, function.first->second);
+                    message.field(FUNCTION_NAME, strings.index(name.c_str()));
+                    message.field(FUNCTION_SYSTEM_NAME, strings.index(name.c_str()));
+                    profile.message(PROFILE_FUNCTION, message);
+                }
+                jint line_number = mi->_type < FRAME_NATIVE ? mi->getLineNumber(frame.bci) : 0;
+                std::pair<std::map<std::pair<u64, jint>, u64>::iterator, bool> location = locations.insert(
+                    std::make_pair(std::make_pair(function.first->second, line_number), (u64)locations.size() + 1));
+                if (location.second) {
+                    line.clear();
+                    line.field(LINE_FUNCTION_ID, function.first->second);
+                    line.field(LINE_LINE, line_number);
+                    message.clear();
+                    message.field(LOCATION_ID, location.first->second);
+                    message.message(LOCATION_LINE, line);
+                    profile.message(PROFILE_LOCATION, message);
+                }
+                // the leaf comes first in both
+                stack.first->second.push_back(location.first->second);
+            }
+        }
+
+        message.clear();
+        message.packed(SAMPLE_LOCATION_ID, stack.first->second);
+        std::fill(values.begin(), values.end(), 0);
+        values[columns[entry.kind]] = entry.count;
+        values[columns[entry.kind] + 1] = entry.total;
+        message.packed(SAMPLE_VALUE, values);
+        if (entry.span_id != 0) {
+            label.clear();
+            label.field(LABEL_KEY, span_id_key);
+            label.field(LABEL_NUM, entry.span_id);
+            message.message(SAMPLE_LABEL, label);
+        }
+        if (entry.root_span_id != 0) {
+            label.clear();
+            label.field(LABEL_KEY, root_span_id_key);
+            label.field(LABEL_NUM, entry.root_span_id);
+            message.message(SAMPLE_LABEL, label);
+        }
+        for (size_t j = 0; j < _attributes.size(); j++) {
+            size_t length = 0;
+            const char* value = entry.tags[j] != 0 ? context_values->key(entry.tags[j], &length) : NULL;
+            if (value != NULL) {
+                label.clear();
+                label.field(LABEL_KEY, attribute_keys[j]);
+                label.field(LABEL_STR, strings.index(std::string(value, length).c_str()));
+                message.message(SAMPLE_LABEL, label);
+            }
+        }
+        profile.message(PROFILE_SAMPLE, message);
+    }
+
+    profile.field(PROFILE_TIME_NANOS, start_micros * 1000);
+    profile.field(PROFILE_DURATION_NANOS, (stop_micros - start_micros) * 1000);
+    if (columns[PPROF_CPU] >= 0) {
+        message.clear();
+        message.field(VALUE_TYPE_TYPE, strings.index(PPROF_SAMPLE_TYPES[PPROF_CPU][2]));
+        message.field(VALUE_TYPE_UNIT, strings.index(PPROF_SAMPLE_TYPES[PPROF_CPU][3]));
+        profile.message(PROFILE_PERIOD_TYPE, message);
+        profile.field(PROFILE_PERIOD, Profiler::instance()->cpuEngine()->interval());
+    }
+    u64 dropped = 0;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        dropped += _retired_dropped[i];
+    }
+    if (dropped > 0) {
+        profile.field(PROFILE_COMMENT, strings.index(
+            (std::to_string(dropped) + " samples did not fit into the pprof tables").c_str()));
+    }
+    strings.write(profile);
+
+    memset(_retired_entries, 0, entry_count * sizeof(PprofEntry));
+    memset(_retired_dropped, 0, sizeof(_retired_dropped));
+
+    // readers never see a partially written profile
+    std::string tmp_path = _path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        return Error("Could not open the pprof output file");
+    }
+    bool written = GzipWriter(fd).write((const u8*)profile.data().data(), profile.data().size());
+    close(fd);
+    if (!written || rename(tmp_path.c_str(), _path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return Error("Could not write the pprof profile");
+    }
+    return Error::OK;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PPROFWRITER_H
+#define _PPROFWRITER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "arguments.h"
+#include "context.h"
+#include "event.h"
+#include "flightRecorder.h"
+
+// The pprof sample types, each a pair of values: the number of samples and their total
+enum PprofKind {
+    PPROF_CPU,
+    PPROF_WALL,
+    PPROF_ALLOC,
+    PPROF_LOCK,
+    PPROF_MALLOC,
+    PPROF_KINDS
+};
+
+// The samples of one (call trace, kind, context) within a chunk; a slot is free while its hash is 0
+struct PprofEntry {
+    u64 hash;
+    u32 call_trace_id;
+    u32 kind;
+    u64 span_id;
+    u64 root_span_id;
+    u32 tags[DD_TAGS_CAPACITY];
+    u64 count;
+    u64 total;
+};
+
+// Writes every chunk of the recording as a gzipped pprof profile as well. The events are summed up
+// per call trace and context as they are recorded, in one table per lock stripe which only its lock
+// holder touches, and serialized in the same pass as the constant pool of the chunk: the call traces
+// become locations and functions, the sums the sample values and the context their labels.
+// All the strings go through the Lookup symbols, which the pprof string table is made of.
+class PprofWriter {
+  private:
+    static const u32 TABLE_SIZE = 2048;
+    static const int MAX_PROBES = 16;
+
+    std::string _path;
+    std::vector<std::string> _attributes;
+    // CONCURRENCY_LEVEL tables of TABLE_SIZE entries, filled by the samplers
+    PprofEntry* _entries;
+    // the tables of the chunk being written, swapped with the ones of the samplers by retire()
+    PprofEntry* _retired_entries;
+    // the samples which found no free slot, even without their context
+    u64 _dropped[CONCURRENCY_LEVEL];
+    u64 _retired_dropped[CONCURRENCY_LEVEL];
+    // survives the chunks, so that the methods are resolved through JVMTI only once
+    MethodMap _method_map;
+
+    static u64 hash(const PprofEntry& key, int tags);
+    bool add(PprofEntry* table, PprofEntry& key, u64 total);
+
+  public:
+    PprofWriter(Arguments& args);
+    ~PprofWriter();
+
+    // Called with the lock of the stripe held
+    void record(int lock_index, int tid, u32 call_trace_id, int event_type, Event* event);
+
+    // Called with all the locks held: the sums recorded so far belong to the chunk to be written
+    void retire();
+
+    // Writes the retired sums, which it clears; traces are the call traces of the chunk.
+    // The samplers carry on with the other tables meanwhile.
+    Error write(std::map<u32, CallTrace*>& traces, u64 start_micros, u64 stop_micros);
+};
+
+#endif // _PPROFWRITER_H
@@ -18,13 +18,16 @@
 #include <fstream>
 #include <set>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include "profiler.h"
+#include "allocHistogram.h"
 #include "perfEvents.h"
 #include "objectSampler.h"
 #include "wallClock.h"
@@ -32,12 +35,22 @@
 #include "j9ObjectSampler.h"
 #include "j9WallClock.h"
 #include "itimer.h"
+#include "lockTracer.h"
+#include "mallocTracer.h"
+#include "memoryGovernor.h"
+#include "ctimer.h"
 #include "dwarf.h"
 #include "flightRecorder.h"
 #include "os.h"
 #include "safeAccess.h"
+#include "overheadGovernor.h"
+#include "signalLatency.h"
+#include "queueTimeFilter.h"
+#include "spanAggregator.h"
+#include "virtualThreads.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
+#include "symbolCache.h"
 #include "symbols.h"
 #include "thread.h"
 #include "vmStructs.h"
@@ -52,13 +65,23 @@ Profiler* const Profiler::_instance = new Profiler();
 static void (*orig_trapHandler)(int signo, siginfo_t* siginfo, void* ucontext);
 static void (*orig_segvHandler)(int signo, siginfo_t* siginfo, void* ucontext);
 
+// Past this many classes, most of them unloaded generated ones, the class ids are started over at the next dump
+static const int MAX_CLASS_MAP_SIZE = 1 << 18;
+
+// The room for the name of a native thread, which the kernel limits to 16 bytes
+static const size_t THREAD_NAME_LENGTH = 64;
+
 static Engine noop_engine;
 static PerfEvents perf_events;
 // static AllocTracer alloc_tracer;
 // static J9ObjectSampler j9_object_sampler;
 static WallClock wall_engine;
+static SwitchEvents switch_events;
 static J9WallClock j9_engine;
 static ITimer itimer;
+static CTimer ctimer;
+static MallocTracer malloc_tracer;
+static LockTracer lock_tracer;
 
 
 // Stack recovery techniques used to workaround AsyncGetCallTrace flaws.
@@ -112,7 +135,8 @@ void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     if (_thread_filter.enabled()) {
         _thread_filter.remove(tid);
     }
-    updateThreadName(jvmti, jni, thread);
+    // the name is resolved at the next dump, and only if the thread has events by then
+    deferThreadName(jni, tid, thread);
 
     _cpu_engine->registerThread(tid);
     _wall_engine->registerThread(tid);
@@ -123,7 +147,12 @@ void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     if (_thread_filter.enabled()) {
         _thread_filter.remove(tid);
     }
+    // the thread will not be around at the next dump
     updateThreadName(jvmti, jni, thread);
+    jobject deferred = _thread_table.undefer(tid);
+    if (deferred != NULL) {
+        jni->DeleteWeakGlobalRef(deferred);
+    }
 
     _cpu_engine->unregisterThread(tid);
     // unregister here because JNI callers generally don't know about thread exits
@@ -173,16 +202,57 @@ const char* Profiler::asgctError(int code) {
 }
 
 inline u32 Profiler::getLockIndex(int tid) {
+    // Prefer the current CPU: only threads that share a CPU can contend for the slot,
+    // which happens only when one of them got preempted while recording a sample
+    int cpu = OS::currentCpu();
+    if (cpu >= 0) {
+        if (_numa_nodes > 1) {
+            // Stay within the slots of the node, whose buffers live in its memory
+            int node = OS::cpuNode(cpu);
+            u32 first = node * CONCURRENCY_LEVEL / _numa_nodes;
+            u32 slots = (node + 1) * CONCURRENCY_LEVEL / _numa_nodes - first;
+            return first + (u32)cpu % slots;
+        }
+        return (u32)cpu % CONCURRENCY_LEVEL;
+    }
     u32 lock_index = tid;
     lock_index ^= lock_index >> 8;
     lock_index ^= lock_index >> 4;
     return lock_index % CONCURRENCY_LEVEL;
 }
 
+// Returns the index of an acquired recording slot, or -1 if all slots are busy.
+// All slots are probed before giving up, so a sample is dropped only
+// when CONCURRENCY_LEVEL handlers run at once or while the locks are held by dump().
+int Profiler::tryLock(int tid) {
+    u32 lock_index = getLockIndex(tid);
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        if (_locks[lock_index].tryLock()) {
+            return lock_index;
+        }
+        lock_index = (lock_index + 1) % CONCURRENCY_LEVEL;
+    }
+    return -1;
+}
+
 void Profiler::updateSymbols(bool kernel_symbols) {
     Symbols::parseLibraries(&_native_libs, kernel_symbols);
 }
 
+void Profiler::awaitSymbols() {
+    Symbols::awaitLibraries();
+}
+
+void Profiler::awaitSymbols(const void* address) {
+    Symbols::awaitLibrary(address);
+}
+
+static void* awaitNativeFrames(void* arg) {
+    Symbols::awaitLibraries();
+    __atomic_store_n((volatile bool*)arg, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
 void Profiler::mangle(const char* name, char* buf, size_t size) {
     char* buf_end = buf + size;
     strcpy(buf, "_ZN");
@@ -221,14 +291,16 @@ const void* Profiler::resolveSymbol(const char* name) {
     int native_lib_count = _native_libs.count();
     if (len > 0 && name[len - 1] == '*') {
         for (int i = 0; i < native_lib_count; i++) {
-            const void* address = _native_libs[i]->findSymbolByPrefix(name, len - 1);
+            CodeCache* lib = _native_libs[i];
+            const void* address = lib == NULL ? NULL : lib->findSymbolByPrefix(name, len - 1);
             if (address != NULL) {
                 return address;
             }
         }
     } else {
         for (int i = 0; i < native_lib_count; i++) {
-            const void* address = _native_libs[i]->findSymbol(name);
+            CodeCache* lib = _native_libs[i];
+            const void* address = lib == NULL ? NULL : lib->findSymbol(name);
             if (address != NULL) {
                 return address;
             }
@@ -241,8 +313,9 @@ const void* Profiler::resolveSymbol(const char* name) {
 // For BCI_NATIVE_FRAME, library index is encoded ahead of the symbol name
 const char* Profiler::getLibraryName(const char* native_symbol) {
     short lib_index = NativeFunc::libIndex(native_symbol);
-    if (lib_index >= 0 && lib_index < _native_libs.count()) {
-        const char* s = _native_libs[lib_index]->name();
+    CodeCache* lib;
+    if (lib_index >= 0 && lib_index < _native_libs.count() && (lib = _native_libs[lib_index]) != NULL) {
+        const char* s = lib->name();
         if (s != NULL) {
             const char* p = strrchr(s, '/');
             return p != NULL ? p + 1 : s;
@@ -259,11 +332,12 @@ CodeCache* Profiler::findLibraryByName(const char* lib_name) {
     const size_t lib_name_len = strlen(lib_name);
     const int native_lib_count = _native_libs.count();
     for (int i = 0; i < native_lib_count; i++) {
-        const char* s = _native_libs[i]->name();
+        CodeCache* lib = _native_libs[i];
+        const char* s = lib == NULL ? NULL : lib->name();
         if (s != NULL) {
             const char* p = strrchr(s, '/');
             if (p != NULL && strncmp(p + 1, lib_name, lib_name_len) == 0) {
-                return _native_libs[i];
+                return lib;
             }
         }
     }
@@ -271,13 +345,7 @@ CodeCache* Profiler::findLibraryByName(const char* lib_name) {
 }
 
 CodeCache* Profiler::findLibraryByAddress(const void* address) {
-    const int native_lib_count = _native_libs.count();
-    for (int i = 0; i < native_lib_count; i++) {
-        if (_native_libs[i]->contains(address)) {
-            return _native_libs[i];
-        }
-    }
-    return NULL;
+    return _native_libs.findByAddress(address);
 }
 
 const char* Profiler::findNativeMethod(const void* address) {
@@ -296,8 +364,9 @@ bool Profiler::isAddressInCode(uintptr_t addr) {
 
 int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, StackContext* java_ctx, bool *truncated) {
     if (_cstack == CSTACK_NO
+        || !__atomic_load_n(&_native_frames_ready, __ATOMIC_ACQUIRE)
         || (event_type == BCI_ALLOC || event_type == BCI_ALLOC_OUTSIDE_TLAB)
-        || (event_type != BCI_CPU && event_type != BCI_WALL && _cstack == CSTACK_DEFAULT)) {
+        || (event_type != BCI_CPU && event_type != BCI_WALL && event_type != BCI_NATIVE_MALLOC && _cstack == CSTACK_DEFAULT)) {
         return 0;
     }
     const void* callchain[MAX_NATIVE_FRAMES];
@@ -305,6 +374,9 @@ int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_
 
     if (event_type == BCI_CPU && _cpu_engine == &perf_events) {
         native_frames += PerfEvents::walkKernel(tid, callchain + native_frames, MAX_NATIVE_FRAMES - native_frames, java_ctx);
+        if (native_frames > 0) {
+            Symbols::requestKernelSymbols();
+        }
     }
     if (_cstack == CSTACK_DWARF) {
         native_frames += StackWalker::walkDwarf(ucontext, callchain + native_frames, MAX_NATIVE_FRAMES - native_frames, java_ctx, truncated);
@@ -312,15 +384,95 @@ int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_
         native_frames += StackWalker::walkFP(ucontext, callchain + native_frames, MAX_NATIVE_FRAMES - native_frames, java_ctx, truncated);
     }
 
+    if (event_type == BCI_NATIVE_MALLOC) {
+        // the walk starts inside the allocation hook; the profiler's own frames are of no interest
+        CodeCache* self = findLibraryByAddress((const void*)dlopen_hook);
+        int skip = 0;
+        while (skip < native_frames && self != NULL && self->contains(callchain[skip])) {
+            skip++;
+        }
+        return convertNativeTrace(native_frames - skip, callchain + skip, frames);
+    }
     return convertNativeTrace(native_frames, callchain, frames);
 }
 
+// Inlining deeper than MaxInlineLevel (15 by default) is not expected
+static const int MAX_INLINED_SCOPES = 64;
+
+// Replaces the BCI_COMPILED_PC frame, if any, and the Java frames sampled at its PC with the frames decoded
+// from the scope data of the nmethod, or just gives these Java frames their types. The frames are left
+// as they were walked if the nmethod has been flushed since, or its address has been taken by another one.
+static void decodeCompiledPC(std::vector<ASGCT_CallFrame>& frames) {
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (frames[i].bci != BCI_COMPILED_PC) {
+            continue;
+        }
+        uintptr_t value = (uintptr_t)frames[i].method_id;
+        const void* entry = (const void*)(value & (((uintptr_t)1 << COMPILED_PC_SHIFT) - 1));
+        frames.erase(frames.begin() + i);
+        NMethod* nmethod = CodeHeap::findNMethod(entry);
+        if (nmethod == NULL || !nmethod->isNMethod() || nmethod->entry() != entry) {
+            return;
+        }
+        const void* pc = nmethod->codeBegin() + (value >> COMPILED_PC_SHIFT);
+        ASGCT_CallFrame scopes[MAX_INLINED_SCOPES];
+        int num_scopes = nmethod->decodeScopes(pc, scopes, MAX_INLINED_SCOPES);
+        if (num_scopes > 0) {
+            // the walk reported the same compiled method, below its own view of the inlined frames
+            for (size_t j = i; j < frames.size() && frames[j].bci > BCI_NATIVE_FRAME; j++) {
+                if (frames[j].method_id == scopes[num_scopes - 1].method_id) {
+                    frames.erase(frames.begin() + i, frames.begin() + j + 1);
+                    frames.insert(frames.begin() + i, scopes, scopes + num_scopes);
+                    return;
+                }
+            }
+        }
+        nmethod->fillFrameTypes(&frames[i], (int)(frames.size() - i));
+        return;
+    }
+}
+
+// The BCI_COMPILED_PC frame of a PC in an nmethod, see COMPILED_PC_SHIFT; false if it cannot be encoded
+static inline bool encodeCompiledPC(NMethod* nmethod, const void* pc, jmethodID* method_id) {
+    uintptr_t entry = (uintptr_t)nmethod->entry();
+    uintptr_t offset = (uintptr_t)((const char*)pc - nmethod->codeBegin());
+    if ((entry >> COMPILED_PC_SHIFT) != 0 || (offset >> (64 - COMPILED_PC_SHIFT)) != 0) {
+        return false;
+    }
+    *method_id = (jmethodID)(entry | offset << COMPILED_PC_SHIFT);
+    return true;
+}
+
+// A BCI_NATIVE_PC frame keeps the PC in the low bits of method_id and the library index above
+static const int NATIVE_PC_SHIFT = 48;
+
+static inline jmethodID encodeNativePC(const void* pc, short lib_index) {
+    return (jmethodID)((uintptr_t)pc | (uintptr_t)(lib_index + 1) << NATIVE_PC_SHIFT);
+}
+
+const char* Profiler::resolveNativePC(jmethodID method_id) {
+    int lib_index = (int)((uintptr_t)method_id >> NATIVE_PC_SHIFT) - 1;
+    const void* pc = (const void*)((uintptr_t)method_id & (((uintptr_t)1 << NATIVE_PC_SHIFT) - 1));
+    CodeCache* lib = lib_index >= 0 && lib_index < _native_libs.count() ? _native_libs[lib_index] : NULL;
+    return lib == NULL ? NULL : lib->binarySearch(pc);
+}
+
 int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames) {
     int depth = 0;
     jmethodID prev_method = NULL;
 
     for (int i = 0; i < native_frames; i++) {
-        const char* current_method_name = findNativeMethod(callchain[i]);
+        const void* pc = callchain[i];
+        CodeCache* lib = findLibraryByAddress(pc);
+        if (_deferred_symbols && lib != NULL && !lib->hasMarks() && ((uintptr_t)pc >> NATIVE_PC_SHIFT) == 0) {
+            // Libraries with marked symbols are still resolved here to find the interpreter frames
+            frames[depth].bci = BCI_NATIVE_PC;
+            frames[depth].method_id = encodeNativePC(pc, lib->libIndex());
+            depth++;
+            continue;
+        }
+
+        const char* current_method_name = lib == NULL ? NULL : lib->binarySearch(pc);
         if (current_method_name != NULL && NativeFunc::isMarked(current_method_name)) {
             // This is C++ interpreter frame, this and later frames should be reported
             // as Java frames returned by AGCT. Terminate the scan here.
@@ -341,7 +493,7 @@ int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGC
     return depth;
 }
 
-int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated) {
+int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated, jint event_type) {
     // Workaround for JDK-8132510: it's not safe to call GetEnv() inside a signal handler
     // since JDK 9, so we do it only for threads already registered in ThreadLocalStorage
     VMThread* vm_thread = VMThread::current();
@@ -530,14 +682,46 @@ int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max
     }
 
     atomicInc(_failures[-trace.num_frames]);
+    SampleLoss::record(lossEngine(event_type), LOSS_UNWIND_FAILED);
     trace.frames->bci = BCI_ERROR;
     trace.frames->method_id = (jmethodID)err_string;
     return trace.frames - frames + 1;
 }
 
+// Called for a Java stack walk which reached max_depth: appends the stack tail marker of the thread, while the
+// occasional deeper walk over the same stack refreshes the tail the marker stands for
+int Profiler::appendStackTail(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, jint event_type, int lock_index) {
+    ProfiledThread* thread = ProfiledThread::current();
+    if (thread == NULL) {
+        return 0;
+    }
+    // the tail of the thread may have been retired with its generation at a dump, in which case it is captured again
+    if (thread->noteTruncatedSample(StackTails::TAIL_CAPTURE_INTERVAL) ||
+        (thread->stackTail() != 0 && _stack_tails.find(thread->stackTail()) == NULL)) {
+        int capacity;
+        ASGCT_CallFrame* buffer = _stack_tails.buffer(lock_index, &capacity);
+        bool truncated = false;
+        int num_frames = 0;
+        if (capacity > max_depth) {
+            num_frames = _vm_stacks ? StackWalker::walkVM(ucontext, buffer, capacity, java_ctx, &truncated) : -1;
+            if (num_frames < 0) {
+                num_frames = getJavaTraceAsync(ucontext, buffer, capacity, java_ctx, &truncated, event_type);
+            }
+        }
+        // the stack did not go any deeper after all, or it could not be walked again
+        thread->stackTail() = num_frames > max_depth
+                ? _stack_tails.store(num_frames - max_depth, buffer + max_depth, num_frames >= capacity)
+                : 0;
+    }
+    if (thread->stackTail() == 0) {
+        return 0;
+    }
+    return makeFrame(frames, BCI_STACK_TAIL, (jmethodID)thread->stackTail());
+}
+
 int Profiler::getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth) {
     int num_frames;
-    if (VM::jvmti()->GetStackTrace(NULL, start_depth, _max_stack_depth, jvmti_frames, &num_frames) == 0 && num_frames > 0) {
+    if (VM::jvmti()->GetStackTrace(NULL, start_depth, MemoryGovernor::stackDepth(_max_stack_depth), jvmti_frames, &num_frames) == 0 && num_frames > 0) {
         return convertFrames(jvmti_frames, frames, num_frames);
     }
     return 0;
@@ -572,59 +756,21 @@ inline int Profiler::convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame
     return num_frames;
 }
 
-void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod) {
-    if (nmethod->isNMethod() && nmethod->isAlive()) {
-        VMMethod* method = nmethod->method();
-        if (method == NULL) {
-            return;
-        }
-
-        jmethodID current_method_id = method->id();
-        if (current_method_id == NULL) {
-            return;
-        }
-
-        // Mark current_method as COMPILED and frames above current_method as INLINED
-        for (int i = 0; i < num_frames; i++) {
-            if (frames[i].method_id == NULL || frames[i].bci <= BCI_NATIVE_FRAME) {
-                break;
-            }
-            if (frames[i].method_id == current_method_id) {
-                int level = nmethod->level();
-                frames[i].bci = FrameType::encode(level >= 1 && level <= 3 ? FRAME_C1_COMPILED : FRAME_JIT_COMPILED, frames[i].bci);
-                for (int j = 0; j < i; j++) {
-                    frames[j].bci = FrameType::encode(FRAME_INLINED, frames[j].bci);
-                }
-                break;
-            }
-        }
-    } else if (nmethod->isInterpreter()) {
-        // Mark the first Java frame as INTERPRETED
-        for (int i = 0; i < num_frames; i++) {
-            if (frames[i].bci > BCI_NATIVE_FRAME) {
-                frames[i].bci = FrameType::encode(FRAME_INTERPRETED, frames[i].bci);
-                break;
-            }
-        }
-    }
-}
-
-void Profiler::recordExternalSample(u64 counter, int tid, jvmtiFrameInfo *jvmti_frames, jint num_jvmti_frames, bool truncated, jint event_type, Event* event) {
+u32 Profiler::recordExternalSample(u64 counter, int tid, jvmtiFrameInfo *jvmti_frames, jint num_jvmti_frames, bool truncated, jint event_type, Event* event, u32* trace_generation) {
     atomicInc(_total_samples);
 
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+    int lock_index = tryLock(tid);
+    if (lock_index < 0)
     {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
+        SampleLoss::record(lossEngine(event_type), LOSS_LOCK_CONTENTION);
 
         if (event_type == BCI_CPU && _cpu_engine == &perf_events) {
             // Need to reset PerfEvents ring buffer, even though we discard the collected trace
             PerfEvents::resetBuffer(tid);
         }
-        return;
+        return 0;
     }
     u32 call_trace_id = 0;
     if (!_omit_stacktraces) {
@@ -637,79 +783,215 @@ void Profiler::recordExternalSample(u64 counter, int tid, jvmtiFrameInfo *jvmti_
 
         num_frames += convertFrames(jvmti_frames, frames + num_frames, num_jvmti_frames);
 
-        call_trace_id = _call_trace_storage.put(num_frames, frames, truncated, counter);
+        call_trace_id = putTrace(num_frames, frames, truncated, counter, event_type);
+        if (trace_generation != NULL) {
+            *trace_generation = _call_trace_storage.generation();
+        }
     }
-    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
 
     _locks[lock_index].unlock();
+    return call_trace_id;
+}
+
+void Profiler::aggregateSpanSample(int tid, jint event_type, Event* event, u64 counter) {
+    SpanAggregator* aggregator = SpanAggregator::instance();
+    if (!aggregator->enabled() || (event_type != BCI_CPU && event_type != BCI_WALL)) {
+        return;
+    }
+    u64 samples = ((ExecutionEvent*)event)->_weight;
+    if (event_type == BCI_CPU) {
+        // the CPU counter is already weighted; it is a count of events rather than time with hardware counters
+        aggregator->record(tid, false, samples, counter);
+    } else {
+        u64 off_cpu = ((ExecutionEvent*)event)->_off_cpu_nanos;
+        aggregator->record(tid, true, samples, off_cpu > 0 ? off_cpu : samples * _wall_engine->interval());
+    }
 }
 
-void Profiler::recordSample(void* ucontext, u64 counter, int tid, jint event_type, Event* event) {
+u32 Profiler::recordSample(void* ucontext, u64 counter, int tid, jint event_type, Event* event, u32* trace_generation, TraceCopy* copy) {
     atomicInc(_total_samples);
+    u64 governor_entry = event_type == BCI_CPU ? OverheadGovernor::enter() : 0;
+    // counted even if the sample itself is skipped below, the span summaries do not need its stack
+    aggregateSpanSample(tid, event_type, event, counter);
+
+    // the stack of a span the tracer does not keep would be dropped by the backend anyway
+    bool unsampled = _unsampled != UNSAMPLED_KEEP && (event_type == BCI_CPU || event_type == BCI_WALL)
+                     && Contexts::get(tid).isUnsampled();
+    if (unsampled) {
+        Counters::increment(UNSAMPLED_SPAN_SAMPLES);
+        if (event_type == BCI_CPU && _cpu_engine == &perf_events) {
+            // the ring buffer would otherwise be read by the skipped stack walk
+            PerfEvents::resetBuffer(tid);
+        }
+        if (_unsampled == UNSAMPLED_DROP) {
+            OverheadGovernor::exit(governor_entry);
+            return 0;
+        }
+    }
 
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+    int lock_index = tryLock(tid);
+    if (lock_index < 0)
     {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
+        SampleLoss::record(lossEngine(event_type), LOSS_LOCK_CONTENTION);
 
         if (event_type == BCI_CPU && _cpu_engine == &perf_events) {
             // Need to reset PerfEvents ring buffer, even though we discard the collected trace
             PerfEvents::resetBuffer(tid);
         }
-        return;
+        return 0;
     }
 
     bool truncated = false;
     // in lightweight mode we're just sampling the the context associated with the passage of CPU or wall time,
     // we use the same event definitions but we record a null stacktrace
     u32 call_trace_id = 0;
-    if (!_omit_stacktraces) {
+    if (!_omit_stacktraces && !unsampled) {
         ASGCT_CallFrame *frames = _calltrace_buffer[lock_index]->_asgct_frames;
 
         int num_frames = 0;
 
+        u64 walk_start = OS::nanotime();
         StackContext java_ctx = {0};
         ASGCT_CallFrame *native_stop = frames + num_frames;
         num_frames += getNativeTrace(ucontext, native_stop, event_type, tid, &java_ctx, &truncated);
 
-        if (event_type == BCI_CPU || event_type == BCI_WALL) {
+        if (event_type == BCI_CPU || event_type == BCI_WALL || event_type == BCI_NATIVE_MALLOC) {
             int java_frames = 0;
+            bool vm_walked = false;
+            // with scopeframes, the PC of the top Java frame goes first and the frame types are left to the dump
+            int pc_frames = _scope_frames && java_ctx.pc != NULL ? 1 : 0;
+            ASGCT_CallFrame* java_start = frames + num_frames + pc_frames;
             {
                 // Async events
                 AsyncSampleMutex mutex;
                 if (mutex.acquired()) {
-                    java_frames = getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx,
-                                                    &truncated);
+                    int java_depth = MemoryGovernor::stackDepth(_max_stack_depth);
+                    java_frames = _vm_stacks ? StackWalker::walkVM(ucontext, java_start, java_depth, &java_ctx, &truncated) : -1;
+                    vm_walked = java_frames >= 0;
+                    if (!vm_walked) {
+                        if (_vm_stacks) {
+                            Counters::increment(VM_WALK_FALLBACKS);
+                        }
+                        java_frames = getJavaTraceAsync(ucontext, java_start, java_depth, &java_ctx, &truncated, event_type);
+                    }
+                    if (java_frames >= java_depth && _stack_tails.enabled()) {
+                        java_frames += appendStackTail(ucontext, java_start + java_frames, java_depth, &java_ctx, event_type, lock_index);
+                    }
+                } else {
+                    SampleLoss::record(lossEngine(event_type), LOSS_UNWIND_BUSY);
                 }
             }
-            if (java_frames > 0 && java_ctx.pc != NULL) {
-                NMethod *nmethod = CodeHeap::findNMethod(java_ctx.pc);
-                if (nmethod != NULL) {
-                    fillFrameTypes(frames + num_frames, java_frames, nmethod);
+            if (java_frames > 0) {
+                NMethod* nmethod = java_ctx.pc != NULL && (pc_frames > 0 || !vm_walked) ? CodeHeap::findNMethod(java_ctx.pc) : NULL;
+                jmethodID compiled_pc;
+                if (pc_frames > 0 && nmethod != NULL && nmethod->isNMethod() && encodeCompiledPC(nmethod, java_ctx.pc, &compiled_pc)) {
+                    num_frames += makeFrame(frames + num_frames, BCI_COMPILED_PC, compiled_pc);
+                } else {
+                    if (pc_frames > 0) {
+                        // only a compiled PC is decoded at dump time, the walked frames move into its slot
+                        memmove(frames + num_frames, java_start, java_frames * sizeof(ASGCT_CallFrame));
+                    }
+                    if (nmethod != NULL && !vm_walked) {
+                        nmethod->fillFrameTypes(frames + num_frames, java_frames);
+                    }
                 }
             }
             num_frames += java_frames;
         }
+        Counters::recordDuration(STACK_WALK_LT_1US, OS::nanotime() - walk_start);
 
         if (num_frames == 0) {
             num_frames += makeFrame(frames + num_frames, BCI_ERROR, "no_Java_frame");
         }
 
-        call_trace_id = _call_trace_storage.put(num_frames, frames, truncated, counter);
+        call_trace_id = putTrace(num_frames, frames, truncated, counter, event_type);
+        if (trace_generation != NULL) {
+            // the storage can not rotate while the lock is held
+            *trace_generation = _call_trace_storage.generation();
+        }
+        if (copy != NULL) {
+            copy->num_frames = num_frames < copy->capacity ? num_frames : copy->capacity;
+            copy->truncated = truncated || num_frames > copy->capacity;
+            memcpy(copy->frames, frames, copy->num_frames * sizeof(ASGCT_CallFrame));
+        }
+    }
+    recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    if (event_type == BCI_CPU && _cpu_engine == &perf_events) {
+        recordKernelBacklog(lock_index, tid, counter);
+    }
+
+    _locks[lock_index].unlock();
+    OverheadGovernor::exit(governor_entry);
+    return call_trace_id;
+}
+
+void Profiler::recordKernelBacklog(int lock_index, int tid, u64 counter) {
+    // Samples of the perfdrain mode whose own signal was skipped or coalesced; only their kernel part is known
+    const void* callchain[MAX_NATIVE_FRAMES];
+    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
+    int sample_tid = tid;
+    int depth;
+    while ((depth = PerfEvents::walkBacklog(tid, callchain, MAX_NATIVE_FRAMES, &sample_tid)) >= 0) {
+        int num_frames = convertNativeTrace(depth, callchain, frames);
+        if (num_frames == 0) {
+            // a user mode sample, there is no stack left to attribute it to
+            continue;
+        }
+        atomicInc(_total_samples);
+        u32 call_trace_id = putTrace(num_frames, frames, true, counter, BCI_CPU);
+        ExecutionEvent event;
+        recordEvent(lock_index, sample_tid, call_trace_id, BCI_CPU, &event, counter);
+        Counters::increment(PERF_DRAINED_SAMPLES);
+    }
+}
+
+bool Profiler::storeExternalTrace(u64 counter, int tid, jvmtiFrameInfo *jvmti_frames, jint num_jvmti_frames, bool truncated, jint event_type,
+                                  u32* call_trace_id, u32* trace_generation) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
+        atomicInc(_total_samples);
+        atomicInc(_failures[-ticks_skipped]);
+        SampleLoss::record(lossEngine(event_type), LOSS_LOCK_CONTENTION);
+        return false;
     }
-    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    *call_trace_id = 0;
+    if (!_omit_stacktraces) {
+        ASGCT_CallFrame *frames = _calltrace_buffer[lock_index]->_asgct_frames;
+        int num_frames = convertFrames(jvmti_frames, frames, num_jvmti_frames);
+        *call_trace_id = putTrace(num_frames, frames, truncated, counter, event_type);
+    }
+    *trace_generation = _call_trace_storage.generation();
+    _locks[lock_index].unlock();
+    return true;
+}
 
+bool Profiler::recordCachedSample(u64 counter, int tid, u32 call_trace_id, u32 trace_generation, jint event_type, Event* event) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
+        atomicInc(_total_samples);
+        atomicInc(_failures[-ticks_skipped]);
+        SampleLoss::record(lossEngine(event_type), LOSS_LOCK_CONTENTION);
+        aggregateSpanSample(tid, event_type, event, counter);
+        return true;
+    }
+    if (_call_trace_storage.generation() != trace_generation) {
+        // the trace belongs to an already dumped generation, the stack has to be walked again
+        _locks[lock_index].unlock();
+        return false;
+    }
+    atomicInc(_total_samples);
+    aggregateSpanSample(tid, event_type, event, counter);
+    recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
     _locks[lock_index].unlock();
+    return true;
 }
 
 void Profiler::recordWallClockEpoch(int tid, WallClockEpochEvent *event) {
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock()) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
         return;
     }
     _jfr.wallClockEpoch(lock_index, event);
@@ -717,60 +999,167 @@ void Profiler::recordWallClockEpoch(int tid, WallClockEpochEvent *event) {
 }
 
 void Profiler::recordTraceRoot(int tid, TraceRootEvent *event) {
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock()) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
         return;
     }
     _jfr.recordTraceRoot(lock_index, tid, event);
+    // the local root span has ended, and so have all of its spans
+    SpanSummaryEvent summaries[SpanAggregator::MAX_PROBES];
+    int count = SpanAggregator::instance()->drain(event->_local_root_span_id, summaries);
+    for (int i = 0; i < count; i++) {
+        _jfr.recordSpanSummary(lock_index, &summaries[i]);
+    }
+    _locks[lock_index].unlock();
+}
+
+void Profiler::recordSpanSummaries(int tid, SpanSummaryEvent* events, int count) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
+        Counters::increment(SPAN_SUMMARIES_DROPPED, count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        _jfr.recordSpanSummary(lock_index, &events[i]);
+    }
     _locks[lock_index].unlock();
 }
 
 void Profiler::recordQueueTime(int tid, QueueTimeEvent *event) {
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock()) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
         return;
     }
     _jfr.recordQueueTime(lock_index, tid, event);
     _locks[lock_index].unlock();
 }
 
-void Profiler::recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, bool truncated, jint event_type, Event* event) {
+void Profiler::recordVMActivity(int tid, VMActivityEvent* event) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
+        return;
+    }
+    _jfr.recordVMActivity(lock_index, tid, event);
+    _locks[lock_index].unlock();
+}
+
+// Records all the events of a batch under a single lock acquisition; returns the number recorded
+int Profiler::recordBatch(int tid, BatchedEvent* events, int count) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        BatchedEvent* event = &events[i];
+        switch (event->_type) {
+            case BATCHED_TRACE_ROOT: {
+                TraceRootEvent trace_root(event->_root_span_id, event->_label);
+                _jfr.recordTraceRoot(lock_index, event->_tid, &trace_root);
+                SpanSummaryEvent summaries[SpanAggregator::MAX_PROBES];
+                int summary_count = SpanAggregator::instance()->drain(event->_root_span_id, summaries);
+                for (int j = 0; j < summary_count; j++) {
+                    _jfr.recordSpanSummary(lock_index, &summaries[j]);
+                }
+                break;
+            }
+            case BATCHED_QUEUE_TIME: {
+                Context context = {};
+                context.spanId = event->_span_id;
+                context.rootSpanId = event->_root_span_id;
+                _jfr.recordQueueTime(lock_index, event->_tid, &event->_queue_time, &context);
+                break;
+            }
+            case BATCHED_SETTING:
+                _jfr.recordDatadogSetting(lock_index, event->_length, event->_strings[0], event->_strings[1], event->_strings[2]);
+                break;
+        }
+    }
+    _locks[lock_index].unlock();
+    return count;
+}
+
+u32 Profiler::recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, bool truncated, jint event_type, Event* event,
+                                   u32* trace_generation) {
     atomicInc(_total_samples);
+    u64 governor_entry = event_type == BCI_CPU ? OverheadGovernor::enter() : 0;
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, truncated, counter);
+    // read before the trace is stored, so that a rotation in between makes the id look stale rather than current
+    u32 generation = _call_trace_storage.generation();
+    u32 call_trace_id = putTrace(num_frames, frames, truncated, counter, event_type);
 
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+    int lock_index = tryLock(tid);
+    if (lock_index < 0)
     {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
-        return;
+        SampleLoss::record(lossEngine(event_type), LOSS_LOCK_CONTENTION);
+        return 0;
     }
 
-    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    if (trace_generation != NULL) {
+        *trace_generation = generation;
+    }
 
     _locks[lock_index].unlock();
+    OverheadGovernor::exit(governor_entry);
+    return call_trace_id;
+}
+
+void Profiler::recordLog(int lock_index, const LogSummary& summary) {
+    char message[LOG_SUMMARY_LENGTH + 64];
+    int len = summary.message[0] != 0
+        ? snprintf(message, sizeof(message), "%s (repeated %u more times)", summary.message, summary.count)
+        : snprintf(message, sizeof(message), "%u log messages over the rate limit were dropped", summary.count);
+    _jfr.recordLog(lock_index, summary.level, message, len < (int)sizeof(message) ? len : sizeof(message) - 1);
 }
 
 void Profiler::writeLog(LogLevel level, const char* message) {
-    _jfr.recordLog(level, message, strlen(message));
+    writeLog(level, message, strlen(message));
 }
 
 void Profiler::writeLog(LogLevel level, const char* message, size_t len) {
-    _jfr.recordLog(level, message, len);
+    LogSummary summaries[MAX_LOG_SUMMARIES];
+    int summary_count;
+    bool admitted = _log_limiter.admit(level, message, len, OS::nanotime(), summaries, &summary_count);
+    recordLogs(level, admitted ? message : NULL, len, summaries, summary_count);
+}
+
+void Profiler::flushLogSummaries() {
+    LogSummary summaries[MAX_LOG_SUMMARIES];
+    int summary_count = _log_limiter.flush(OS::nanotime(), summaries);
+    recordLogs(LOG_INFO, NULL, 0, summaries, summary_count);
+}
+
+// Records the summaries, then the message unless it is NULL
+void Profiler::recordLogs(LogLevel level, const char* message, size_t len, const LogSummary* summaries, int summary_count) {
+    if (message == NULL && summary_count == 0) {
+        return;
+    }
+
+    // the message goes to the recording buffer like any event, the io is left to the writer thread
+    int lock_index = tryLock(OS::threadId());
+    if (lock_index < 0) {
+        // the messages the summaries stand for are held back for good, as is the message
+        u64 lost = message != NULL ? 1 : 0;
+        for (int i = 0; i < summary_count; i++) {
+            lost += summaries[i].count;
+        }
+        Counters::increment(LOG_MESSAGES_HELD_BACK, lost);
+        return;
+    }
+    for (int i = 0; i < summary_count; i++) {
+        recordLog(lock_index, summaries[i]);
+    }
+    if (message != NULL) {
+        _jfr.recordLog(lock_index, level, message, len);
+    }
+    _locks[lock_index].unlock();
 }
 
 void Profiler::writeDatadogProfilerSetting(int tid, int length, const char* name, const char* value, const char* unit) {
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock()) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
         return;
     }
     _jfr.recordDatadogSetting(lock_index, length, name, value, unit);
@@ -782,10 +1171,8 @@ void Profiler::writeHeapUsage(long value, bool live) {
     if (tid < 0) {
         return;
     }
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock()) {
+    int lock_index = tryLock(tid);
+    if (lock_index < 0) {
         return;
     }
     _jfr.recordHeapUsage(lock_index, value, live);
@@ -796,6 +1183,11 @@ void* Profiler::dlopen_hook(const char* filename, int flags) {
     void* result = dlopen(filename, flags);
     if (result != NULL) {
         instance()->updateSymbols(false);
+        if (MallocTracer::running()) {
+            // the imports of the new libraries are known only once their symbols have been published
+            instance()->awaitSymbols();
+            MallocTracer::installHooks();
+        }
     }
     return result;
 }
@@ -820,6 +1212,9 @@ void Profiler::trapHandlerEntry(int signo, siginfo_t* siginfo, void* ucontext) {
 }
 
 void Profiler::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    if (SwitchEvents::trapHandler(signo, siginfo, ucontext)) {
+        return;
+    }
     if (orig_trapHandler != NULL) {
         orig_trapHandler(signo, siginfo, ucontext);
     }
@@ -855,9 +1250,7 @@ void Profiler::setupSignalHandlers() {
 }
 
 void Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
-    MutexLocker ml(_thread_names_lock);
-    _thread_names[tid] = name;
-    _thread_ids[tid] = java_thread_id;
+    _thread_table.set(tid, name, java_thread_id);
 }
 
 void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
@@ -871,7 +1264,17 @@ void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     }
 }
 
-void Profiler::updateJavaThreadNames() {
+void Profiler::deferThreadName(JNIEnv* jni, int tid, jthread thread) {
+    if (tid < 0) {
+        return;
+    }
+    jobject previous = _thread_table.defer(tid, jni->NewWeakGlobalRef(thread));
+    if (previous != NULL) {
+        jni->DeleteWeakGlobalRef(previous);
+    }
+}
+
+void Profiler::deferExistingThreadNames() {
     jvmtiEnv* jvmti = VM::jvmti();
     jint thread_count;
     jthread* thread_objects;
@@ -881,38 +1284,70 @@ void Profiler::updateJavaThreadNames() {
 
     JNIEnv* jni = VM::jni();
     for (int i = 0; i < thread_count; i++) {
-        updateThreadName(jvmti, jni, thread_objects[i]);
+        deferThreadName(jni, VMThread::nativeThreadId(jni, thread_objects[i]), thread_objects[i]);
+        jni->DeleteLocalRef(thread_objects[i]);
     }
 
     jvmti->Deallocate((unsigned char*)thread_objects);
 }
 
-void Profiler::updateNativeThreadNames() {
-    ThreadList* thread_list = OS::listThreads();
-    char name_buf[64];
+void Profiler::releaseDeferredThreadNames() {
+    std::vector<jobject> threads;
+    _thread_table.undeferAll(threads);
+    JNIEnv* jni = VM::jni();
+    for (size_t i = 0; i < threads.size(); i++) {
+        jni->DeleteWeakGlobalRef(threads[i]);
+    }
+}
 
-    for (int tid; (tid = thread_list->next()) != -1; ) {
-        MutexLocker ml(_thread_names_lock);
-        std::map<int, std::string>::iterator it = _thread_names.lower_bound(tid);
-        if (it == _thread_names.end() || it->first != tid) {
-            if (OS::threadName(tid, name_buf, sizeof(name_buf))) {
-                _thread_names.insert(it, std::map<int, std::string>::value_type(tid, name_buf));
-            }
+void Profiler::resolveThreadNames() {
+    std::vector<int> tids;
+    _jfr.collectThreads(tids);
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    JNIEnv* jni = VM::jni();
+    std::vector<int> native_tids;
+    _thread_table.lockDeferred();
+    for (size_t i = 0; i < tids.size(); i++) {
+        int tid = tids[i];
+        if (_thread_table.contains(tid)) {
+            // e.g. it has ended since its events were recorded
+            continue;
+        }
+        jobject weak = _thread_table.deferred(tid);
+        jthread thread = weak != NULL ? jni->NewLocalRef(weak) : NULL;
+        if (thread != NULL) {
+            updateThreadName(jvmti, jni, thread);
+            jni->DeleteLocalRef(thread);
+        }
+        // not a Java thread, or one the JVMTI callbacks have not reported
+        if (!_thread_table.contains(tid)) {
+            native_tids.push_back(tid);
         }
     }
+    _thread_table.unlockDeferred();
 
-    delete thread_list;
+    if (!native_tids.empty()) {
+        std::vector<char> names(native_tids.size() * THREAD_NAME_LENGTH);
+        if (OS::threadNames(native_tids.data(), native_tids.size(), names.data(), THREAD_NAME_LENGTH) > 0) {
+            _thread_table.setNames(native_tids.data(), native_tids.size(), names.data(), THREAD_NAME_LENGTH);
+        }
+    }
 }
 
 Engine* Profiler::selectCpuEngine(Arguments& args) {
     if (args._cpu < 0 && (args._event == NULL || strcmp(args._event, EVENT_NOOP) == 0)) {
         return &noop_engine;
+    } else if (args._event != NULL && strcmp(args._event, EVENT_CTIMER) == 0) {
+        // an explicitly requested timer engine takes precedence over the cpu interval defaults
+        return &ctimer;
     } else if (args._cpu >= 0 || strcmp(args._event, EVENT_CPU) == 0) {
         if (VM::isOpenJ9() && !J9Ext::can_use_ASGCT()) {
             // signal based samplers are unstable on J9 before 8.0.362, 11.0.18 and 17.0.6
             return (Engine*)&j9_engine;
         }
-        return !perf_events.check(args) ? (Engine*)&perf_events : &itimer;
+        // thread CPU timers keep the samples on the threads which burn the CPU, unlike the process-wide itimer
+        return !perf_events.check(args) ? (Engine*)&perf_events : !ctimer.check(args) ? (Engine*)&ctimer : &itimer;
     } else if (strcmp(args._event, EVENT_WALL) == 0) {
         return (Engine*)&noop_engine;
     } else if (strcmp(args._event, EVENT_ITIMER) == 0) {
@@ -930,6 +1365,9 @@ Engine* Profiler::selectWallEngine(Arguments& args) {
         j9_engine.sampleIdleThreads();
         return (Engine*)&j9_engine;
     }
+    if (args._wall_switch >= 0) {
+        return (Engine*)&switch_events;
+    }
     return (Engine*)&wall_engine;
 }
 
@@ -982,10 +1420,26 @@ Error Profiler::start(Arguments& args, bool reset) {
 
     ProfiledThread::initExistingThreads();
     _omit_stacktraces = args._lightweight;
+    _unsampled = args._unsampled;
+    // before the frame trie and the grown tables are mapped
+    OS::setHugePages(args._huge_pages != HUGE_PAGES_NO, args._huge_pages == HUGE_PAGES_EXPLICIT);
+    _call_trace_storage.enableFrameTrie(args._frame_trie);
+    _call_trace_storage.configureArenas(args._prefault, args._arena_huge_pages);
+    _call_trace_storage.enableStackTails(&_stack_tails);
+    _scope_frames = args._scope_frames && VMStructs::hasScopeData();
+    _vm_stacks = args._vm_stacks && VMStructs::hasFrameStructs();
+    if (args._vm_stacks && !_vm_stacks) {
+        Log::warn("vmstacks is not supported on this JVM, Java stacks are walked by AsyncGetCallTrace");
+    }
+    if (_scope_frames) {
+        _call_trace_storage.enableScopeFrames(decodeCompiledPC);
+    }
     _event_mask = ((args._event != NULL && strcmp(args._event, EVENT_NOOP) != 0) ? EM_CPU : 0) |
                   (args._cpu >= 0 ? EM_CPU : 0) |
                   (args._wall >= 0 ? EM_WALL : 0) |
-                  (args._memory >= 0 ? EM_ALLOC : 0);
+                  (args._memory >= 0 ? EM_ALLOC : 0) |
+                  (args._nativemem >= 0 ? EM_NATIVEMEM : 0) |
+                  (args._lock >= 0 ? EM_LOCK : 0);
     if (_event_mask == 0) {
         return Error("No profiling events specified");
     }
@@ -997,9 +1451,7 @@ Error Profiler::start(Arguments& args, bool reset) {
 
         // Reset dictionaries and bitmaps
         // Reset class map under lock because ObjectSampler may try to use it while it is being cleaned up
-        _class_map_lock.lock();
-        _class_map.clear();
-        _class_map_lock.unlock();
+        resetClassMap();
 
         // Reset call trace storage
         if (!_omit_stacktraces) {
@@ -1008,13 +1460,16 @@ Error Profiler::start(Arguments& args, bool reset) {
             unlockAll();
         }
         Counters::reset();
+        SampleLoss::reset();
 
         // Reset thread names and IDs
-        MutexLocker ml(_thread_names_lock);
-        _thread_names.clear();
-        _thread_ids.clear();
+        _thread_table.clear();
     }
 
+    // Beyond one node per lock slot, the slots are shared as if there was a single node
+    int numa_nodes = OS::numaNodes();
+    _numa_nodes = numa_nodes <= CONCURRENCY_LEVEL ? numa_nodes : 1;
+
     // (Re-)allocate calltrace buffers
     if (_max_stack_depth != args._jstackdepth) {
         _max_stack_depth = args._jstackdepth;
@@ -1027,8 +1482,13 @@ Error Profiler::start(Arguments& args, bool reset) {
                 _max_stack_depth = 0;
                 return Error("Not enough memory to allocate stack trace buffers (try smaller jstackdepth)");
             }
+            OS::bindToNode(_calltrace_buffer[i], buffer_size, lockNode(i));
         }
     }
+    error = _stack_tails.start(args, _max_stack_depth);
+    if (error) {
+        return error;
+    }
 
     _safe_mode = args._safe_mode;
     if (VM::java_version() < 8 || VM::isZing()) {
@@ -1047,23 +1507,64 @@ Error Profiler::start(Arguments& args, bool reset) {
         _cstack = CSTACK_NO;
         Log::warn("Branch stack is supported only with PMU events");
     }
+    // LBR stacks are deduplicated by symbol; 32-bit PCs leave no room for the library index
+    _deferred_symbols = args._deferred_symbols && _cstack != CSTACK_LBR && sizeof(void*) == 8;
 
+    SymbolCache::setDirectory(args._symbol_cache);
     // Kernel symbols are useful only for perf_events without --all-user
     updateSymbols(_cpu_engine == &perf_events && (args._ring & RING_KERNEL));
+    // The malloc hooks and perf probes resolve symbols when they are set up, and only HotSpot has its
+    // JVM library awaited by VM::init. Otherwise the engines start right away and the samples go without
+    // native frames until the libraries have been parsed in background.
+    bool perf_probe = _cpu_engine == &perf_events && args._cpu < 0 && args._event != NULL && strcmp(args._event, EVENT_CPU) != 0;
+    pthread_t symbols_thread;
+    __atomic_store_n(&_native_frames_ready, false, __ATOMIC_RELEASE);
+    if ((_event_mask & EM_NATIVEMEM) || perf_probe || !VM::isHotspot()
+        || pthread_create(&symbols_thread, NULL, awaitNativeFrames, (void*)&_native_frames_ready) != 0) {
+        awaitSymbols();
+        __atomic_store_n(&_native_frames_ready, true, __ATOMIC_RELEASE);
+    } else {
+        pthread_detach(symbols_thread);
+    }
 
     enableEngines();
 
-    switchLibraryTrap(_cstack == CSTACK_DWARF);
+    // the allocation hooks have to follow the libraries loaded later
+    switchLibraryTrap(_cstack == CSTACK_DWARF || (_event_mask & EM_NATIVEMEM));
 
+    u32 context_capacity = Contexts::setCapacity(args._context_attributes.size());
+    if (args._context_attributes.size() > context_capacity) {
+        Log::warn("Only %u context attributes can be recorded, ignoring the rest", context_capacity);
+        args._context_attributes.resize(context_capacity);
+    }
     JfrMetadata::initialize(args._context_attributes);
     _num_context_attributes = args._context_attributes.size();
-    error = _jfr.start(args, reset);
+    _output = args._output;
+    _total_counter = args._total;
+    // the collapsed output needs no recording, so no event is serialized at all
+    error = _output == OUTPUT_JFR ? _jfr.start(args, reset) : Error::OK;
     if (error) {
         disableEngines();
         switchLibraryTrap(false);
         return error;
     }
 
+    SignalLatency::enable(args._signal_latency || args._self_overhead, args._signal_latency);
+    // the ticks are calibrated once the recording has started
+    QueueTimeFilter::configure(args._queue_time_min, args._queue_time_sample);
+    error = SpanAggregator::instance()->start(args);
+    if (error) {
+        Log::warn("%s", error.message());
+        error = Error::OK; // recoverable
+    }
+    _hot_stacks.start(args);
+    if (args._vm_timeline > 0) {
+        error = VMTimeline::start(args);
+        if (error) {
+            Log::warn("%s", error.message());
+            error = Error::OK; // recoverable
+        }
+    }
     int activated = 0;
     if (_event_mask & EM_CPU) {
         error = _cpu_engine->start(args);
@@ -1093,9 +1594,33 @@ Error Profiler::start(Arguments& args, bool reset) {
             activated |= EM_ALLOC;
         }
     }
+    if (_event_mask & EM_NATIVEMEM) {
+        error = malloc_tracer.start(args);
+        if (error) {
+            Log::warn("%s", error.message());
+            error = Error::OK; // recoverable
+        } else {
+            activated |= EM_NATIVEMEM;
+        }
+    }
+    if (_event_mask & EM_LOCK) {
+        error = lock_tracer.start(args);
+        if (error) {
+            Log::warn("%s", error.message());
+            error = Error::OK; // recoverable
+        } else {
+            activated |= EM_LOCK;
+        }
+    }
 
     if (activated) {
+        OverheadGovernor::enable((activated & EM_CPU) ? _cpu_engine : NULL, args._cpu_budget / 100);
+        MemoryGovernor::enable(args._memory_budget, (activated & EM_CPU) ? _cpu_engine : NULL,
+                               (activated & EM_WALL) ? _wall_engine : NULL);
         switchThreadEvents(JVMTI_ENABLE);
+        // the threads started from now on are deferred by onThreadStart
+        deferExistingThreadNames();
+        VirtualThreads::enable(args._virtual_threads);
 
         _state = RUNNING;
         _start_time = time(NULL);
@@ -1105,13 +1630,50 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
     // no engine was activated; perform cleanup
     disableEngines();
+    VMTimeline::stop();
     switchLibraryTrap(false);
 
     lockAll();
     _jfr.stop();
     unlockAll();
 
-    return Error("Neither CPU, wallclock nor allocation profiling could be started");
+    return Error("Neither CPU, wallclock, allocation, native memory nor lock profiling could be started");
+}
+
+Error Profiler::startReplay(Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state > IDLE) {
+        return Error("Profiler already started");
+    }
+
+    _omit_stacktraces = false;
+    _unsampled = UNSAMPLED_KEEP;
+    _call_trace_storage.enableFrameTrie(args._frame_trie);
+    _call_trace_storage.configureArenas(args._prefault, args._arena_huge_pages);
+    _event_mask = EM_CPU;
+    _cpu_engine = &noop_engine;
+    _wall_engine = &noop_engine;
+    _total_samples = 0;
+    memset(_failures, 0, sizeof(_failures));
+    _call_trace_storage.clear();
+    Counters::reset();
+    SampleLoss::reset();
+
+    u32 context_capacity = Contexts::setCapacity(args._context_attributes.size());
+    if (args._context_attributes.size() > context_capacity) {
+        args._context_attributes.resize(context_capacity);
+    }
+    JfrMetadata::initialize(args._context_attributes);
+    _num_context_attributes = args._context_attributes.size();
+    Error error = _jfr.start(args, true);
+    if (error) {
+        return error;
+    }
+
+    _state = RUNNING;
+    _start_time = time(NULL);
+    _epoch++;
+    return Error::OK;
 }
 
 Error Profiler::stop() {
@@ -1121,19 +1683,32 @@ Error Profiler::stop() {
     }
 
     disableEngines();
+    OverheadGovernor::disable();
+    MemoryGovernor::disable();
 
+    if (_event_mask & EM_LOCK) lock_tracer.stop();
+    if (_event_mask & EM_NATIVEMEM) malloc_tracer.stop();
     if (_event_mask & EM_ALLOC) _alloc_engine->stop();
     if (_event_mask & EM_WALL) _wall_engine->stop();
     if (_event_mask & EM_CPU) _cpu_engine->stop();
+    // the aggregated allocations of the last chunk
+    AllocHistogram::instance()->flush();
+    AllocHistogram::instance()->stop();
+    SpanAggregator::instance()->flush();
+    SpanAggregator::instance()->stop();
+    _hot_stacks.stop();
+    _stack_tails.stop();
+    VMTimeline::stop();
 
     switchLibraryTrap(false);
     switchThreadEvents(JVMTI_DISABLE);
-    updateJavaThreadNames();
-    updateNativeThreadNames();
+    VirtualThreads::enable(false);
+    resolveThreadNames();
+    releaseDeferredThreadNames();
 
     // writing these out before stopping the JFR recording allows to report the correct counts in the recording
-    Counters::set(THREAD_IDS_COUNT, _thread_ids.size());
-    Counters::set(THREAD_NAMES_COUNT, _thread_names.size());
+    Counters::set(THREAD_IDS_COUNT, _thread_table.idCount());
+    Counters::set(THREAD_NAMES_COUNT, _thread_table.nameCount());
 
     // Acquire all spinlocks to avoid race with remaining signals
     lockAll();
@@ -1164,6 +1739,12 @@ Error Profiler::check(Arguments& args) {
         _alloc_engine = selectAllocEngine(args);
         error = _alloc_engine->check(args);
     }
+    if (!error && args._nativemem >= 0) {
+        error = malloc_tracer.check(args);
+    }
+    if (!error && args._lock >= 0) {
+        error = lock_tracer.check(args);
+    }
 
     return error;
 }
@@ -1171,12 +1752,14 @@ Error Profiler::check(Arguments& args) {
 Error Profiler::flushJfr() {
     MutexLocker ml(_state_lock);
     if (_state != RUNNING) {
+        // a recording still around would otherwise never request the rotation again
+        _jfr.cancelRotation();
         return Error("Profiler is not active");
     }
 
-    updateJavaThreadNames();
-    updateNativeThreadNames();
+    resolveThreadNames();
 
+    _jfr.holdWriters(false);
     lockAll();
     _jfr.flush();
     unlockAll();
@@ -1185,64 +1768,118 @@ Error Profiler::flushJfr() {
 }
 
 Error Profiler::dump(const char* path, const int length) {
+    return dump(path, length, -1);
+}
+
+Error Profiler::dump(int fd) {
+    return dump(NULL, 0, fd);
+}
+
+Error Profiler::dumpToMemory(void** data, size_t* size) {
+    // the chunk is exported to an anonymous memory file, so no filesystem is involved
+    int fd = OS::createMemoryFile("ddprof-dump");
+    if (fd < 0) {
+        return Error("In-memory dump is not supported");
+    }
+    Error err = dump(fd);
+    if (!err) {
+        *size = OS::fileSize(fd);
+        void* addr = *size > 0 ? mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (addr == MAP_FAILED) {
+            err = Error("Unable to map the in-memory dump");
+        } else {
+            *data = addr;
+        }
+    }
+    // the mapping keeps the memory file alive
+    close(fd);
+    return err;
+}
+
+void Profiler::releaseDump(void* data, size_t size) {
+    munmap(data, size);
+}
+
+Error Profiler::hotStacks(int limit, int breakdown, u64 window_millis, std::vector<std::string>& lines) {
+    // not under the state lock, which a dump holds all along; the storage and the rings outlive the profiler
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    }
+    // the dump clears the class map only once the query is done with the class names
+    _class_map_lock.lockShared();
+    Error error = _hot_stacks.query(&_call_trace_storage, &_class_map, limit, breakdown, window_millis, lines);
+    _class_map_lock.unlockShared();
+    return error;
+}
+
+Error Profiler::dump(const char* path, const int length, int fd) {
     MutexLocker ml(_state_lock);
     if (_state != IDLE && _state != RUNNING) {
         return Error("Profiler has not started");
     }
 
     if (_state == RUNNING) {
+        DurationTimer timer(DUMP_DURATION_LT_1US);
         std::set<int> thread_ids;
         // flush the liveness tracker instance and note all the threads referenced by the live objects
         LivenessTracker::instance()->flush(thread_ids);
+        AllocHistogram::instance()->flush();
+        SpanAggregator::instance()->flush();
+        if (_event_mask & EM_NATIVEMEM) {
+            MallocTracer::flush(thread_ids);
+        }
 
-        updateJavaThreadNames();
-        updateNativeThreadNames();
+        resolveThreadNames();
+        // the messages held back within the current window are reported with this chunk
+        flushLogSummaries();
 
         Counters::set(CODECACHE_NATIVE_COUNT, _native_libs.count());
         Counters::set(CODECACHE_NATIVE_SIZE_BYTES, _native_libs.memoryUsage());
         Counters::set(CODECACHE_RUNTIME_STUBS_SIZE_BYTES, _native_libs.memoryUsage());
         
+        // Only the swap is done under the locks: the samplers move on to fresh recording buffers and
+        // to the standby calltrace storage at the same point, so the retired chunk is complete.
+        if (_output != OUTPUT_COLLAPSED) {
+            _jfr.holdWriters(true);
+        }
         lockAll();
-        Error err = _jfr.dump(path, length);
-        
-        // Reset calltrace storage
+        Error err = Error::OK;
+        std::vector<CallTraceSample> samples;
+        if (_output == OUTPUT_COLLAPSED) {
+            _call_trace_storage.collectSamples(samples);
+        } else {
+            _jfr.retireChunks(!_omit_stacktraces);
+        }
         if (!_omit_stacktraces) {
-            _call_trace_storage.clear();
+            _call_trace_storage.rotate();
         }
         unlockAll();
-        // Reset classmap
-        _class_map_lock.lock();
-        _class_map.clear();
-        _class_map_lock.unlock();
+        // the dumped generation is recycled only below, so its traces stay valid without the locks
+        if (_output == OUTPUT_COLLAPSED) {
+            err = writeCollapsed(path, fd, samples);
+            _call_trace_storage.releaseTraces();
+        } else {
+            err = fd >= 0 ? _jfr.dump(fd) : _jfr.dump(path, length);
+        }
+        if (!_omit_stacktraces) {
+            _call_trace_storage.recycle();
+        }
+        // The class ids outlive the chunk, unless there are too many of them, mostly unloaded generated classes
+        if (_class_map.size() > MAX_CLASS_MAP_SIZE) {
+            resetClassMap();
+        }
 
-        // // Reset thread names and IDs
-        MutexLocker ml(_thread_names_lock);
+        // Reset thread names and IDs
         if (thread_ids.empty()) {
             // take the fast path
-            _thread_names.clear();
-            _thread_ids.clear();
+            _thread_table.clear();
         } else {
-            // we need to honor the thread referenced from th liveness tracker
-            std::map<int, std::string>::iterator name_itr = _thread_names.begin();
-            while (name_itr != _thread_names.end()) {
-                if (thread_ids.find(name_itr->first) != thread_ids.end()) {
-                    name_itr = _thread_names.erase(name_itr);
-                } else {
-                    ++name_itr;
-                }
-            }
-            std::map<int, jlong>::iterator id_itr = _thread_ids.begin();
-            while (id_itr != _thread_ids.end()) {
-                if (thread_ids.find(name_itr->first) != thread_ids.end()) {
-                    id_itr = _thread_ids.erase(id_itr);
-                } else {
-                    ++id_itr;
-                }
-            }
+            // we need to honor the threads referenced from the liveness tracker
+            _thread_table.retain(thread_ids);
         }
 
-        Counters::set(THREAD_IDS_COUNT, _thread_ids.size());
-        Counters::set(THREAD_NAMES_COUNT, _thread_names.size());
+        Counters::set(THREAD_IDS_COUNT, _thread_table.idCount());
+        Counters::set(THREAD_NAMES_COUNT, _thread_table.nameCount());
 
         return err;
     }
@@ -1250,7 +1887,23 @@ Error Profiler::dump(const char* path, const int length) {
     return Error::OK;
 }
 
+Error Profiler::writeCollapsed(const char* path, int fd, std::vector<CallTraceSample>& samples) {
+    int out = fd;
+    if (out < 0) {
+        out = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (out == -1) {
+            return Error("Could not open the collapsed stacks output file");
+        }
+    }
+    Error err = _collapsed_writer.write(out, samples, _total_counter);
+    if (out != fd) {
+        close(out);
+    }
+    return err;
+}
+
 void Profiler::lockAll() {
+    DurationTimer timer(LOCK_ALL_WAIT_LT_1US);
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
 }
 
@@ -1306,6 +1959,7 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             out << "  " << EVENT_ALLOC << std::endl;
             out << "  " << EVENT_WALL << std::endl;
             out << "  " << EVENT_ITIMER << std::endl;
+            out << "  " << EVENT_CTIMER << std::endl;
 
             out << "Java method calls:\n";
             out << "  ClassName.methodName\n";
@@ -1325,6 +1979,31 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             out << PROFILER_VERSION;
             out.flush();
             break;
+        case ACTION_RECONFIGURE: {
+            Error error = reconfigure(args);
+            if (error) {
+                return error;
+            }
+            out << "Profiling reconfigured\n";
+            break;
+        }
+        case ACTION_SUBSCRIBE: {
+            Error error = subscribe(args);
+            if (error) {
+                return error;
+            }
+            out << "Recording subscribed\n";
+            break;
+        }
+        case ACTION_UNSUBSCRIBE: {
+            const char* file = args.file();
+            Error error = file != NULL ? unsubscribe(file) : Error("unsubscribe needs the file of the recording");
+            if (error) {
+                return error;
+            }
+            out << "Recording unsubscribed\n";
+            break;
+        }
         default:
             break;
     }
@@ -1346,6 +2025,138 @@ Error Profiler::restart(Arguments& args) {
     return Error::OK;
 }
 
+Error Profiler::reconfigure(Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    }
+    if (args._tuned == 0) {
+        return Error("Nothing to reconfigure");
+    }
+
+    // Everything which can fail is checked or done first, so that the change is applied entirely or not at all
+    if (args.isTuned(TUNE_CPU_INTERVAL) && (!(_event_mask & EM_CPU) || args._cpu <= 0)) {
+        return Error("cpu can only be changed to a positive interval while CPU profiling is active");
+    }
+    if (args.isTuned(TUNE_WALL_INTERVAL) && (!(_event_mask & EM_WALL) || args._wall <= 0)) {
+        return Error("wall can only be changed to a positive interval while wall clock profiling is active");
+    }
+    if (args.isTuned(TUNE_WALL_THREADS) && _wall_engine != &wall_engine) {
+        return Error("walltpt can only be changed while the wall clock engine is active");
+    }
+    if (args.isTuned(TUNE_ALLOC_INTERVAL) &&
+        (_alloc_engine != ObjectSampler::instance() || ObjectSampler::instance()->interval() <= 0 || args._memory <= 0)) {
+        return Error("memory can only be changed to a positive interval while allocation sampling is active");
+    }
+
+    CallTraceBuffer* buffers[CONCURRENCY_LEVEL] = {NULL};
+    bool resize_buffers = args.isTuned(TUNE_STACK_DEPTH) && args._jstackdepth != _max_stack_depth;
+    if (resize_buffers) {
+        size_t buffer_size = (args._jstackdepth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            buffers[i] = (CallTraceBuffer*)malloc(buffer_size);
+            if (buffers[i] == NULL) {
+                for (int j = 0; j < i; j++) {
+                    free(buffers[j]);
+                }
+                return Error("Not enough memory to allocate stack trace buffers (try smaller jstackdepth)");
+            }
+            OS::bindToNode(buffers[i], buffer_size, lockNode(i));
+        }
+    }
+
+    // the governors run on the JFR writer thread, which is held off until the change is recorded
+    _jfr.lockWriter();
+    long cpu_interval = args.isTuned(TUNE_CPU_INTERVAL) ? args._cpu : 0;
+    if (cpu_interval > 0 && !_cpu_engine->setInterval(cpu_interval)) {
+        _jfr.unlockWriter();
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            free(buffers[i]);
+        }
+        return Error("The interval of the CPU engine can not be changed while it is running");
+    }
+    long wall_interval = args.isTuned(TUNE_WALL_INTERVAL) ? args._wall : 0;
+    OverheadGovernor::rebase(cpu_interval);
+    long governed_cpu_interval = cpu_interval;
+    MemoryGovernor::rebase(&governed_cpu_interval, &wall_interval);
+    if (governed_cpu_interval != cpu_interval) {
+        _cpu_engine->setInterval(governed_cpu_interval);
+    }
+    if (wall_interval > 0) {
+        _wall_engine->setInterval(wall_interval);
+    }
+    if (args.isTuned(TUNE_WALL_THREADS)) {
+        wall_engine.setThreadsPerTick(args._wall_threads_per_tick);
+    }
+    if (args.isTuned(TUNE_ALLOC_INTERVAL)) {
+        ObjectSampler::instance()->setInterval(args._memory);
+    }
+    if (args.isTuned(TUNE_STACK_DEPTH)) {
+        if (resize_buffers) {
+            // the samplers use the buffer of the lock they hold
+            lockAll();
+            for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+                free(_calltrace_buffer[i]);
+                _calltrace_buffer[i] = buffers[i];
+            }
+            _max_stack_depth = args._jstackdepth;
+            unlockAll();
+        }
+        ObjectSampler::instance()->setMaxStackDepth(args._jstackdepth);
+    }
+    _jfr.recordReconfiguration(args, _cpu_engine->interval());
+    _jfr.unlockWriter();
+    return Error::OK;
+}
+
+// The stride of a subscriber taking the samples of an engine at the requested interval; never below one sample
+static u32 sampleStride(long requested, long interval) {
+    return requested > interval && interval > 0 ? (u32)(requested / interval) : 1;
+}
+
+Error Profiler::subscribe(Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING || !_jfr.active()) {
+        return Error("Profiler is not recording");
+    }
+    const char* file = args.file();
+    if (file == NULL || file[0] == 0) {
+        return Error("subscribe needs a file to record to");
+    }
+    int event_mask = (args._cpu >= 0 ? EM_CPU : 0) |
+                     (args._wall >= 0 ? EM_WALL : 0) |
+                     (args._memory >= 0 ? EM_ALLOC : 0) |
+                     (args._nativemem >= 0 ? EM_NATIVEMEM : 0) |
+                     (args._lock >= 0 ? EM_LOCK : 0);
+    if (event_mask == 0) {
+        event_mask = _event_mask;
+    } else if ((event_mask & ~_event_mask) != 0) {
+        return Error("A subscribed recording can only take the events being profiled");
+    }
+
+    Subscription* subscription = new Subscription();
+    subscription->path = file;
+    subscription->event_mask = event_mask;
+    subscription->cpu_stride = sampleStride(args._cpu, _cpu_engine->interval());
+    subscription->wall_stride = sampleStride(args._wall, _wall_engine->interval());
+    subscription->alloc_stride = sampleStride(args._memory, ObjectSampler::instance()->interval());
+    subscription->end_time = args._duration > 0 ? OS::micros() + (u64)args._duration * 1000000 : 0;
+    return _jfr.subscribe(args, subscription);
+}
+
+Error Profiler::unsubscribe(const char* path) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    }
+    resolveThreadNames();
+    // the last chunk is written with the samplers held off, as it is done for a dump
+    lockAll();
+    Error error = _jfr.unsubscribe(path);
+    unlockAll();
+    return error;
+}
+
 void Profiler::shutdown(Arguments& args) {
     MutexLocker ml(_state_lock);
 
@@ -1364,9 +2175,20 @@ void Profiler::shutdown(Arguments& args) {
 int Profiler::lookupClass(const char* key, size_t length) {
     if (_class_map_lock.tryLockShared()) {
         int ret = _class_map.lookup(key, length);
+        // the event writer marks the class as referenced by its chunk
+        _class_marks.reserve(ret);
         _class_map_lock.unlockShared();
         return ret;
     }
     // unable to lookup the class
     return -1;
 }
+
+void Profiler::resetClassMap() {
+    _class_map_lock.lock();
+    _class_map.clear();
+    _class_marks.clear();
+    // the classes written by the earlier chunks of a file have new ids now
+    __atomic_fetch_add(&_class_map_epoch, 1, __ATOMIC_RELEASE);
+    _class_map_lock.unlock();
+}
@@ -22,18 +22,27 @@
 #include <time.h>
 #include "arch.h"
 #include "arguments.h"
+#include "boundedDictionary.h"
 #include "callTraceStorage.h"
+#include "chunkWriter.h"
 #include "codeCache.h"
+#include "collapsedWriter.h"
+#include "hotStacks.h"
 #include "dictionary.h"
 #include "engine.h"
 #include "event.h"
 #include "flightRecorder.h"
 #include "log.h"
+#include "logLimiter.h"
 #include "mutex.h"
+#include "sampleLoss.h"
 #include "spinLock.h"
+#include "stackTails.h"
 #include "threadFilter.h"
+#include "threadTable.h"
 #include "trap.h"
 #include "vmEntry.h"
+#include "vmTimeline.h"
 #include "objectSampler.h"
 #include "thread.h"
 
@@ -51,13 +60,23 @@ const int RESERVED_FRAMES   = 4;
 enum EventMask {
     EM_CPU     = 1 << 0,
     EM_WALL    = 1 << 1,
-    EM_ALLOC   = 1 << 2
+    EM_ALLOC   = 1 << 2,
+    EM_NATIVEMEM = 1 << 3,
+    EM_LOCK    = 1 << 4
 };
 
 struct CallTraceBuffer {
     ASGCT_CallFrame _asgct_frames[1];
 };
 
+// Receives the top frames of a recorded trace, for samples which are to be recorded again later
+struct TraceCopy {
+    ASGCT_CallFrame* frames;
+    int capacity;
+    int num_frames;
+    bool truncated;
+};
+
 // controls access to AGCT
 class AsyncSampleMutex {
 private:
@@ -112,16 +131,25 @@ class Profiler {
     NotifyClassUnloadedFunc _notify_class_unloaded_func;
     // --
 
-    Mutex _thread_names_lock;
-    // TODO: single map?
-    std::map<int, std::string> _thread_names;
-    std::map<int, jlong> _thread_ids;
+    ThreadTable _thread_table;
+    LogLimiter _log_limiter;
+    // Class ids stay stable across chunks: the map is only started over once it outgrows MAX_CLASS_MAP_SIZE,
+    // which bumps its epoch, and the marks tell the classes referenced by the current chunk
     Dictionary _class_map;
-    Dictionary _string_label_map;
+    DictionaryMarks _class_marks;
+    volatile u32 _class_map_epoch;
+    BoundedDictionary _string_label_map;
     Dictionary _context_value_map;
     ThreadFilter _thread_filter;
     CallTraceStorage _call_trace_storage;
     FlightRecorder _jfr;
+    ChunkWriter _chunk_writer;
+    // Without a JFR recording, the dumps write the stacks of the samples only, see Arguments::_output
+    CollapsedWriter _collapsed_writer;
+    HotStacks _hot_stacks;
+    StackTails _stack_tails;
+    Output _output;
+    bool _total_counter;
     Engine* _cpu_engine;
     Engine* _wall_engine = NULL;
     Engine* _alloc_engine;
@@ -139,9 +167,18 @@ class Profiler {
     SpinLock _class_map_lock;
     SpinLock _locks[CONCURRENCY_LEVEL];
     CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    // With several NUMA nodes, each one owns a contiguous range of the lock slots, see getLockIndex()
+    int _numa_nodes;
     int _max_stack_depth;
     int _safe_mode;
     CStack _cstack;
+    bool _deferred_symbols;
+    // Compiled frames are recorded as their PC, see CallTraceStorage::enableScopeFrames()
+    bool _scope_frames;
+    // Java stacks are walked by StackWalker::walkVM() first, by AsyncGetCallTrace where it gives up
+    bool _vm_stacks;
+    // Native stacks are walked only once the symbols of the libraries known at start are published
+    volatile bool _native_frames_ready;
 
     volatile jvmtiEventMode _thread_events_state;
 
@@ -152,6 +189,7 @@ class Profiler {
     const void* _call_stub_end;
     u32 _num_context_attributes;
     bool _omit_stacktraces;
+    UnsampledPolicy _unsampled;
 
     // dlopen() hook support
     void** _dlopen_entry;
@@ -169,17 +207,59 @@ class Profiler {
 
     const char* asgctError(int code);
     u32 getLockIndex(int tid);
+    int tryLock(int tid);
+    void recordLog(int lock_index, const LogSummary& summary);
+    void recordLogs(LogLevel level, const char* message, size_t len, const LogSummary* summaries, int summary_count);
     bool isAddressInCode(uintptr_t addr);
     int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, StackContext* java_ctx, bool *truncated);
-    int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated);
+    int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated, jint event_type);
+    int appendStackTail(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, jint event_type, int lock_index);
+    static LossEngine lossEngine(jint event_type) {
+        switch (event_type) {
+            case BCI_CPU:
+                return LOSS_CPU;
+            case BCI_WALL:
+                return LOSS_WALL;
+            case BCI_ALLOC:
+            case BCI_ALLOC_OUTSIDE_TLAB:
+            case BCI_ALLOC_SUMMARY:
+                return LOSS_ALLOC;
+            case BCI_LIVENESS:
+            case BCI_LIVENESS_SUMMARY:
+                return LOSS_LIVENESS;
+            case BCI_NATIVE_MALLOC:
+            case BCI_NATIVE_LIVE:
+                return LOSS_NATIVEMEM;
+            default:
+                return LOSS_OTHER;
+        }
+    }
+
+    u32 putTrace(int num_frames, ASGCT_CallFrame* frames, bool truncated, u64 counter, jint event_type) {
+        u32 call_trace_id = _call_trace_storage.put(num_frames, frames, truncated, counter);
+        if (call_trace_id == OVERFLOW_TRACE_ID) {
+            SampleLoss::record(lossEngine(event_type), LOSS_STORAGE_OVERFLOW);
+        }
+        return call_trace_id;
+    }
+    // Called with the lock of the stripe held
+    void recordEvent(int lock_index, int tid, u32 call_trace_id, jint event_type, Event* event, u64 counter) {
+        _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+        if (_hot_stacks.enabled()) {
+            _hot_stacks.record(lock_index, tid, call_trace_id, _call_trace_storage.generation(),
+                               lossEngine(event_type), counter);
+        }
+    }
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     int getJavaTraceInternal(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int max_depth);
     int convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int num_frames);
-    void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod);
     void setThreadInfo(int tid, const char* name, jlong java_thread_id);
     void updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
-    void updateJavaThreadNames();
-    void updateNativeThreadNames();
+    void deferThreadName(JNIEnv* jni, int tid, jthread thread);
+    void deferExistingThreadNames();
+    void releaseDeferredThreadNames();
+    // Names the threads which have events in the current chunk
+    void resolveThreadNames();
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectCpuEngine(Arguments& args);
     Engine* selectWallEngine(Arguments& args);
@@ -188,6 +268,8 @@ class Profiler {
 
     void lockAll();
     void unlockAll();
+    Error dump(const char* path, const int length, int fd);
+    Error writeCollapsed(const char* path, int fd, std::vector<CallTraceSample>& samples);
 
     static Profiler* const _instance;
 
@@ -196,6 +278,7 @@ class Profiler {
         _state(NEW),
         _class_unload_hook_trap(2),
         _notify_class_unloaded_func(NULL),
+        _log_limiter(),
         _call_trace_storage(),
         _thread_filter(),
         _jfr(),
@@ -213,16 +296,26 @@ class Profiler {
         _dlopen_entry(NULL),
         _num_context_attributes(0),
         _class_map(1),
+        _class_marks(),
+        _class_map_epoch(0),
         _string_label_map(2),
         _context_value_map(3),
+        _output(OUTPUT_JFR),
+        _total_counter(false),
         _cpu_engine(),
         _alloc_engine(),
         _event_mask(0),
         _stop_time(),
         _total_samples(0),
         _failures(),
+        _numa_nodes(1),
         _cstack(CSTACK_NO),
-        _omit_stacktraces(false)
+        _deferred_symbols(false),
+        _scope_frames(false),
+        _vm_stacks(false),
+        _native_frames_ready(false),
+        _omit_stacktraces(false),
+        _unsampled(UNSAMPLED_KEEP)
         {
 
         for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
@@ -234,6 +327,11 @@ class Profiler {
         return _instance;
     }
 
+    // The NUMA node whose CPUs use the lock slot and its buffers, or -1 if the slots are not split among nodes
+    int lockNode(int lock_index) {
+        return _numa_nodes > 1 ? ((lock_index + 1) * _numa_nodes - 1) / CONCURRENCY_LEVEL : -1;
+    }
+
     u64 total_samples() { return _total_samples; }
     int max_stack_depth() { return _max_stack_depth; }
     time_t uptime()     { return time(NULL) - _start_time; }
@@ -241,17 +339,25 @@ class Profiler {
     Engine* wallEngine() { return _wall_engine; }
 
     Dictionary* classMap() { return &_class_map; }
-    Dictionary* stringLabelMap() { return &_string_label_map; }
+    DictionaryMarks* classMarks() { return &_class_marks; }
+    u32 classMapEpoch() { return __atomic_load_n(&_class_map_epoch, __ATOMIC_ACQUIRE); }
+    BoundedDictionary* stringLabelMap() { return &_string_label_map; }
     Dictionary* contextValueMap() { return &_context_value_map; }
     u32 numContextAttributes() { return _num_context_attributes; }
     ThreadFilter* threadFilter() { return &_thread_filter; }
+    ChunkWriter* chunkWriter() { return &_chunk_writer; }
 
     int lookupClass(const char* key, size_t length);
-    void collectCallTraces(std::map<u32, CallTrace*>& traces) {
+    void resetClassMap();
+    void collectCallTraces(std::map<u32, CallTrace*>& traces, bool retired = false) {
         if (!_omit_stacktraces) {
-            _call_trace_storage.collectTraces(traces);
+            _call_trace_storage.collectTraces(traces, retired);
         }
     }
+    // the traces collected above are expanded for the dump only; they are not kept until the next one
+    void releaseCallTraces() {
+        _call_trace_storage.releaseTraces();
+    }
 
     Error run(Arguments& args);
     Error runInternal(Arguments& args, std::ostream& out);
@@ -259,32 +365,71 @@ class Profiler {
     void shutdown(Arguments& args);
     Error check(Arguments& args);
     Error start(Arguments& args, bool reset);
+    // Starts a recording without any engine or JVM callback; the samples are recorded through
+    // recordExternalSample. Used by the capture replay in src/bench, against a mocked JVMTI
+    Error startReplay(Arguments& args);
     Error stop();
+    // Applies the tunable options of the arguments to the running engines, without a new recording
+    Error reconfigure(Arguments& args);
+    // Records the samples to another JFR file as well, see the subscribe option
+    Error subscribe(Arguments& args);
+    Error unsubscribe(const char* path);
     Error flushJfr();
     Error dump(const char* path, const int length);
+    Error dump(int fd);
+    Error dumpToMemory(void** data, size_t* size);
+    void releaseDump(void* data, size_t size);
+    // The hottest stacks since the last dump, or of the last window_millis, see HotStacks::query()
+    Error hotStacks(int limit, int breakdown, u64 window_millis, std::vector<std::string>& lines);
     void switchThreadEvents(jvmtiEventMode mode);
     int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames);
-    void recordSample(void* ucontext, u64 counter, int tid, jint event_type, Event* event);
-    void recordExternalSample(u64 counter, int tid, jvmtiFrameInfo *jvmti_frames, jint num_jvmti_frames, bool truncated, jint event_type, Event* event);
-    void recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, bool truncated, jint event_type, Event* event);
+    void recordKernelBacklog(int lock_index, int tid, u64 counter);
+    void aggregateSpanSample(int tid, jint event_type, Event* event, u64 counter);
+    u32 recordSample(void* ucontext, u64 counter, int tid, jint event_type, Event* event, u32* trace_generation = NULL, TraceCopy* copy = NULL);
+    bool recordCachedSample(u64 counter, int tid, u32 call_trace_id, u32 trace_generation, jint event_type, Event* event);
+    // Stores the trace without recording an event for it; the id can be passed to recordCachedSample later
+    bool storeExternalTrace(u64 counter, int tid, jvmtiFrameInfo *jvmti_frames, jint num_jvmti_frames, bool truncated, jint event_type,
+                            u32* call_trace_id, u32* trace_generation);
+    // Returns the id of the stored trace, 0 if the sample was dropped
+    u32 recordExternalSample(u64 counter, int tid, jvmtiFrameInfo *jvmti_frames, jint num_jvmti_frames, bool truncated, jint event_type, Event* event, u32* trace_generation = NULL);
+    // Likewise; the id can be passed to recordCachedSample for as long as the storage stays at *trace_generation
+    u32 recordExternalSample(u64 counter, int tid, int num_frames, ASGCT_CallFrame* frames, bool truncated, jint event_type, Event* event,
+                             u32* trace_generation = NULL);
     void recordWallClockEpoch(int tid, WallClockEpochEvent* event);
     void recordTraceRoot(int tid, TraceRootEvent* event);
     void recordQueueTime(int tid, QueueTimeEvent* event);
+    void recordVMActivity(int tid, VMActivityEvent* event);
+    void recordSpanSummaries(int tid, SpanSummaryEvent* events, int count);
+    int recordBatch(int tid, BatchedEvent* events, int count);
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
+    // Records the counts of the log messages held back so far
+    void flushLogSummaries();
     void writeDatadogProfilerSetting(int tid, int length, const char* name, const char* value, const char* unit);
     void writeHeapUsage(long value, bool live);
     int eventMask() const {
         return _event_mask;
     }
 
+    // Returns once the new libraries are known; their symbols are loaded in background
     void updateSymbols(bool kernel_symbols);
+    void awaitSymbols();
+    // Blocks until the library containing the address, if it is being parsed, is published
+    void awaitSymbols(const void* address);
     const void* resolveSymbol(const char* name);
     const char* getLibraryName(const char* native_symbol);
     CodeCache* findJvmLibrary(const char* lib_name);
     CodeCache* findLibraryByName(const char* lib_name);
     CodeCache* findLibraryByAddress(const void* address);
+    u32 nativeLibsVersion() {
+        return _native_libs.version();
+    }
+    bool isCallStub(const void* pc) {
+        return pc >= _call_stub_begin && pc < _call_stub_end;
+    }
     const char* findNativeMethod(const void* address);
+    // Symbol of a BCI_NATIVE_PC frame
+    const char* resolveNativePC(jmethodID method_id);
 
     static void trapHandlerEntry(int signo, siginfo_t* siginfo, void* ucontext);
     void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
@@ -300,6 +445,14 @@ class Profiler {
                                            jint map_length, const jvmtiAddrLocationMap* map,
                                            const void* compile_info) {
         instance()->addJavaMethod(code_addr, code_size, method);
+        if (VMTimeline::running()) {
+            VMTimeline::recordCompilation(jvmti, method, code_size);
+        }
+    }
+
+    static void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti) {
+        LivenessTracker::GarbageCollectionFinish(jvmti);
+        VMTimeline::GarbageCollectionFinish(jvmti);
     }
 
     static void JNICALL DynamicCodeGenerated(jvmtiEnv* jvmti, const char* name,
@@ -316,6 +469,8 @@ class Profiler {
     }
 
     friend class Recording;
+    friend class MallocTracer;
+    friend class MemoryGovernor;
 };
 
 #endif // _PROFILER_H
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "queueTimeFilter.h"
+#include "tsc.h"
+
+u64 QueueTimeFilter::_min_ticks = 0;
+u32 QueueTimeFilter::_sample_rate = 0;
+
+void QueueTimeFilter::configure(long min_nanos, int sample_rate) {
+    _min_ticks = min_nanos > 0 ? (u64)((double)min_nanos * TSC::frequency() / 1e9) : 0;
+    _sample_rate = sample_rate > 0 ? sample_rate : 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _QUEUETIMEFILTER_H
+#define _QUEUETIMEFILTER_H
+
+#include "arch.h"
+#include "thread.h"
+
+// Decides which queue times are recorded before any of their strings is resolved.
+// The ones lasting at least the minimum duration always are; of the shorter ones, one in
+// 'sample rate' is kept with a weight of the sample rate and the others are dropped.
+class QueueTimeFilter {
+  private:
+    static u64 _min_ticks;
+    static u32 _sample_rate;
+
+  public:
+    // The ticks have to be calibrated already
+    static void configure(long min_nanos, int sample_rate);
+
+    // Returns the weight the queue time is to be recorded with, 0 if it is to be dropped
+    static inline u32 weight(u64 start_ticks, u64 end_ticks) {
+        if (end_ticks - start_ticks >= _min_ticks) {
+            return 1;
+        }
+        if (_sample_rate == 0) {
+            return 0;
+        }
+        ProfiledThread* current = ProfiledThread::current();
+        if (current == NULL) {
+            return 0;
+        }
+        return current->nextRandom() % _sample_rate == 0 ? _sample_rate : 0;
+    }
+};
+
+#endif // _QUEUETIMEFILTER_H
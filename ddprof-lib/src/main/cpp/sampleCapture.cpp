@@ -0,0 +1,129 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "sampleCapture.h"
+#include "log.h"
+#include "profiler.h"
+#include "vmStructs.h"
+
+const u64 NO_VALUE = (u64)-1;
+
+static std::string toString(const char* value) {
+    return value != NULL ? std::string(value) : std::string();
+}
+
+static void captureMethod(CapturedMethod& captured, u64 id, jmethodID method) {
+    jvmtiEnv* jvmti = VM::jvmti();
+    jclass method_class;
+    char* class_name = NULL;
+    char* method_name = NULL;
+    char* method_sig = NULL;
+    jint line_number_table_size = 0;
+    jvmtiLineNumberEntry* line_number_table = NULL;
+
+    // a method of an unloaded class is captured without names, which makes it fail the jmethodID check on replay
+    if (VMMethod::check_jmethodID(method) && jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
+        jvmti->GetClassSignature(method_class, &class_name, NULL) == 0 &&
+        jvmti->GetMethodName(method, &method_name, &method_sig, NULL) == 0) {
+        jvmti->GetLineNumberTable(method, &line_number_table_size, &line_number_table);
+    }
+
+    captured.id = id;
+    captured.class_signature = toString(class_name);
+    captured.name = toString(method_name);
+    captured.signature = toString(method_sig);
+    for (jint i = 0; i < line_number_table_size; i++) {
+        captured.line_numbers.push_back(std::make_pair(line_number_table[i].start_location, line_number_table[i].line_number));
+    }
+
+    jvmti->Deallocate((unsigned char*)class_name);
+    jvmti->Deallocate((unsigned char*)method_name);
+    jvmti->Deallocate((unsigned char*)method_sig);
+    jvmti->Deallocate((unsigned char*)line_number_table);
+}
+
+void SampleCapture::capture(const char* path, std::map<u32, CallTrace*>& traces,
+                            const std::vector<std::string>& attributes, Dictionary* context_values) {
+    Profiler* profiler = Profiler::instance();
+    std::map<jmethodID, u64> methods;
+    std::map<std::string, u64> names;
+    CaptureSnapshot snapshot;
+    snapshot.attributes = attributes;
+
+    // the frames are encoded first, which numbers the methods and names they refer to
+    snapshot.traces.resize(traces.size());
+    size_t index = 0;
+    for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+        CallTrace* trace = it->second;
+        CapturedTrace& captured = snapshot.traces[index++];
+        int num_frames = trace->num_frames > 0 ? trace->num_frames : 0;
+        captured.id = it->first;
+        captured.truncated = trace->truncated;
+        captured.frames.resize(num_frames);
+        for (int i = 0; i < num_frames; i++) {
+            jint bci = trace->frames[i].bci;
+            jmethodID method = trace->frames[i].method_id;
+            const char* name = NULL;
+            bool is_name = true;
+            if (bci == BCI_NATIVE_PC) {
+                // the replay has no libraries to resolve the PC from, so the frame is captured resolved
+                bci = BCI_NATIVE_FRAME;
+                name = profiler->resolveNativePC(method);
+            } else if (bci == BCI_NATIVE_FRAME || bci == BCI_ERROR) {
+                name = (const char*)method;
+            } else {
+                is_name = false;
+            }
+
+            u64 value = NO_VALUE;
+            if (is_name && name != NULL) {
+                value = names.insert(std::make_pair(std::string(name), (u64)names.size())).first->second;
+            } else if (!is_name && method != NULL) {
+                value = methods.insert(std::make_pair(method, (u64)methods.size())).first->second;
+            }
+            captured.frames[i].bci = bci;
+            captured.frames[i].value = value;
+        }
+    }
+
+    JNIEnv* jni = VM::jni();
+    bool local_frame = jni->PushLocalFrame(64) == 0;
+    snapshot.methods.resize(methods.size());
+    index = 0;
+    for (std::map<jmethodID, u64>::const_iterator it = methods.begin(); it != methods.end(); ++it) {
+        captureMethod(snapshot.methods[index++], it->second, it->first);
+    }
+    if (local_frame) {
+        jni->PopLocalFrame(NULL);
+    }
+
+    snapshot.names.resize(names.size());
+    for (std::map<std::string, u64>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        snapshot.names[it->second] = it->first;
+    }
+
+    std::map<unsigned int, const char*> values;
+    context_values->collect(values);
+    for (std::map<unsigned int, const char*>::const_iterator it = values.begin(); it != values.end(); ++it) {
+        snapshot.context_values[it->first] = toString(it->second);
+    }
+
+    if (!write(path, snapshot)) {
+        Log::warn("Unable to write the capture file %s: %s", path, strerror(errno));
+    }
+}
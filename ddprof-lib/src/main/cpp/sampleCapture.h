@@ -0,0 +1,86 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SAMPLECAPTURE_H
+#define _SAMPLECAPTURE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "dictionary.h"
+#include "vmEntry.h"
+
+const char CAPTURE_MAGIC[8] = {'D', 'D', 'C', 'A', 'P', 'T', 'R', '1'};
+const u32 CAPTURE_SNAPSHOT_TAG = 0x50414e53; // "SNAP"
+
+// A captured Java method: what the constant pool writer gets from JVMTI for its jmethodID
+struct CapturedMethod {
+    u64 id;
+    std::string class_signature;
+    std::string name;
+    std::string signature;
+    std::vector<std::pair<jlong, jint> > line_numbers;
+};
+
+struct CapturedFrame {
+    jint bci;
+    // the captured method id for Java frames, an index into the names otherwise; (u64)-1 for a NULL method
+    u64 value;
+};
+
+struct CapturedTrace {
+    u32 id;
+    bool truncated;
+    std::vector<CapturedFrame> frames;
+};
+
+// Everything the constant pool of a chunk is made of, as of one dump
+struct CaptureSnapshot {
+    std::vector<std::string> attributes;
+    std::vector<CapturedMethod> methods;
+    std::vector<std::string> names;
+    std::vector<CapturedTrace> traces;
+    std::map<u32, std::string> context_values;
+};
+
+// Appends the call traces of every dump to a file, along with the metadata of their methods as returned
+// by JVMTI, so that the dump path can be replayed and profiled without a JVM (see src/bench).
+// The file is a CAPTURE_MAGIC header followed by one snapshot per dump; all the numbers are native endian:
+//   u32 CAPTURE_SNAPSHOT_TAG
+//   u32 n, n * string                              - context attribute names
+//   u32 n, n * (u64 id, string class signature, string name, string signature,
+//               u32 m, m * (i64 start location, i32 line number))   - Java methods
+//   u32 n, n * string                              - native frame names and error messages
+//   u32 n, n * (u32 id, u8 truncated, u32 m, m * (i32 bci, u64 value))   - call traces, see CapturedFrame
+//   u32 n, n * (u32 id, string)                    - context values
+// where a string is a u32 length followed by as many bytes.
+class SampleCapture {
+  public:
+    // Called with all the sampling locks held, before the chunk is written
+    static void capture(const char* path, std::map<u32, CallTrace*>& traces,
+                        const std::vector<std::string>& attributes, Dictionary* context_values);
+
+    // Appends a snapshot to a capture file, starting the file if it is empty; false with errno set on failure
+    static bool write(const char* path, const CaptureSnapshot& snapshot);
+
+    // Reads back all the snapshots of a capture file; false if it is not one, is truncated,
+    // or has a frame referring to a method or a name missing from its snapshot
+    static bool read(const char* path, std::vector<CaptureSnapshot>& snapshots);
+};
+
+#endif // _SAMPLECAPTURE_H
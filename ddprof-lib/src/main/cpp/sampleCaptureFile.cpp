@@ -0,0 +1,265 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sampleCapture.h"
+
+static void put32(std::string& out, u32 value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void put64(std::string& out, u64 value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void putString(std::string& out, const std::string& value) {
+    put32(out, value.size());
+    out.append(value);
+}
+
+static bool writeFully(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t bytes = write(fd, data, size);
+        if (bytes <= 0) {
+            return false;
+        }
+        data += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+bool SampleCapture::write(const char* path, const CaptureSnapshot& snapshot) {
+    std::string out;
+    put32(out, CAPTURE_SNAPSHOT_TAG);
+    put32(out, snapshot.attributes.size());
+    for (size_t i = 0; i < snapshot.attributes.size(); i++) {
+        putString(out, snapshot.attributes[i]);
+    }
+
+    put32(out, snapshot.methods.size());
+    for (size_t i = 0; i < snapshot.methods.size(); i++) {
+        const CapturedMethod& method = snapshot.methods[i];
+        put64(out, method.id);
+        putString(out, method.class_signature);
+        putString(out, method.name);
+        putString(out, method.signature);
+        put32(out, method.line_numbers.size());
+        for (size_t j = 0; j < method.line_numbers.size(); j++) {
+            put64(out, method.line_numbers[j].first);
+            put32(out, method.line_numbers[j].second);
+        }
+    }
+
+    put32(out, snapshot.names.size());
+    for (size_t i = 0; i < snapshot.names.size(); i++) {
+        putString(out, snapshot.names[i]);
+    }
+
+    put32(out, snapshot.traces.size());
+    for (size_t i = 0; i < snapshot.traces.size(); i++) {
+        const CapturedTrace& trace = snapshot.traces[i];
+        put32(out, trace.id);
+        out.push_back(trace.truncated ? 1 : 0);
+        put32(out, trace.frames.size());
+        for (size_t j = 0; j < trace.frames.size(); j++) {
+            put32(out, trace.frames[j].bci);
+            put64(out, trace.frames[j].value);
+        }
+    }
+
+    put32(out, snapshot.context_values.size());
+    for (std::map<u32, std::string>::const_iterator it = snapshot.context_values.begin(); it != snapshot.context_values.end(); ++it) {
+        put32(out, it->first);
+        putString(out, it->second);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+        ok = writeFully(fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    }
+    ok = ok && writeFully(fd, out.data(), out.size());
+    close(fd);
+    return ok;
+}
+
+class CaptureReader {
+  private:
+    const char* _data;
+    size_t _size;
+    size_t _offset;
+    bool _ok;
+
+    bool has(size_t size) {
+        _ok = _ok && _size - _offset >= size;
+        return _ok;
+    }
+
+  public:
+    CaptureReader(const std::string& data, size_t offset) :
+        _data(data.data()), _size(data.size()), _offset(offset), _ok(true) {}
+
+    bool ok() { return _ok; }
+    bool atEnd() { return _offset == _size; }
+
+    u32 get32() {
+        u32 value = 0;
+        if (has(sizeof(value))) {
+            memcpy(&value, _data + _offset, sizeof(value));
+            _offset += sizeof(value);
+        }
+        return value;
+    }
+
+    u64 get64() {
+        u64 value = 0;
+        if (has(sizeof(value))) {
+            memcpy(&value, _data + _offset, sizeof(value));
+            _offset += sizeof(value);
+        }
+        return value;
+    }
+
+    u8 get8() {
+        return has(1) ? (u8)_data[_offset++] : 0;
+    }
+
+    std::string getString() {
+        u32 length = get32();
+        if (!has(length)) {
+            return std::string();
+        }
+        _offset += length;
+        return std::string(_data + _offset - length, length);
+    }
+
+    // An element count which cannot exceed what is left to read; guards the reservations
+    u32 getCount(size_t min_element_size) {
+        u32 count = get32();
+        if (_ok && (size_t)count * min_element_size > _size - _offset) {
+            _ok = false;
+        }
+        return _ok ? count : 0;
+    }
+};
+
+// The method ids number the methods from 0 and every frame refers to a method or a name of its own snapshot
+static bool isConsistent(const CaptureSnapshot& snapshot) {
+    std::vector<bool> ids(snapshot.methods.size());
+    for (size_t i = 0; i < snapshot.methods.size(); i++) {
+        u64 id = snapshot.methods[i].id;
+        if (id >= ids.size() || ids[id]) {
+            return false;
+        }
+        ids[id] = true;
+    }
+    for (size_t i = 0; i < snapshot.traces.size(); i++) {
+        const std::vector<CapturedFrame>& frames = snapshot.traces[i].frames;
+        for (size_t j = 0; j < frames.size(); j++) {
+            u64 value = frames[j].value;
+            bool is_name = frames[j].bci == BCI_NATIVE_FRAME || frames[j].bci == BCI_ERROR;
+            if (value != (u64)-1 && value >= (is_name ? snapshot.names.size() : snapshot.methods.size())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool SampleCapture::read(const char* path, std::vector<CaptureSnapshot>& snapshots) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    std::string data;
+    char buf[65536];
+    ssize_t bytes;
+    while ((bytes = ::read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, bytes);
+    }
+    close(fd);
+    if (bytes < 0 || data.size() < sizeof(CAPTURE_MAGIC) || memcmp(data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        return false;
+    }
+
+    CaptureReader in(data, sizeof(CAPTURE_MAGIC));
+    while (in.ok() && !in.atEnd()) {
+        if (in.get32() != CAPTURE_SNAPSHOT_TAG) {
+            return false;
+        }
+        snapshots.push_back(CaptureSnapshot());
+        CaptureSnapshot& snapshot = snapshots.back();
+
+        u32 count = in.getCount(4);
+        for (u32 i = 0; i < count; i++) {
+            snapshot.attributes.push_back(in.getString());
+        }
+
+        count = in.getCount(24);
+        snapshot.methods.resize(count);
+        for (u32 i = 0; i < count; i++) {
+            CapturedMethod& method = snapshot.methods[i];
+            method.id = in.get64();
+            method.class_signature = in.getString();
+            method.name = in.getString();
+            method.signature = in.getString();
+            u32 lines = in.getCount(12);
+            for (u32 j = 0; j < lines; j++) {
+                jlong start_location = in.get64();
+                jint line_number = in.get32();
+                method.line_numbers.push_back(std::make_pair(start_location, line_number));
+            }
+        }
+
+        count = in.getCount(4);
+        for (u32 i = 0; i < count; i++) {
+            snapshot.names.push_back(in.getString());
+        }
+
+        count = in.getCount(9);
+        snapshot.traces.resize(count);
+        for (u32 i = 0; i < count; i++) {
+            CapturedTrace& trace = snapshot.traces[i];
+            trace.id = in.get32();
+            trace.truncated = in.get8() != 0;
+            u32 frames = in.getCount(12);
+            trace.frames.resize(frames);
+            for (u32 j = 0; j < frames; j++) {
+                trace.frames[j].bci = in.get32();
+                trace.frames[j].value = in.get64();
+            }
+        }
+
+        count = in.getCount(8);
+        for (u32 i = 0; i < count; i++) {
+            u32 id = in.get32();
+            snapshot.context_values[id] = in.getString();
+        }
+
+        if (in.ok() && !isConsistent(snapshot)) {
+            return false;
+        }
+    }
+    return in.ok();
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "sampleLoss.h"
+
+SampleLoss::Slot SampleLoss::_slots[LOSS_ENGINES];
+
+static const CounterId LOSS_COUNTER[LOSS_REASONS] = {
+    SAMPLES_SKIPPED,
+    SAMPLES_STORAGE_OVERFLOW,
+    SAMPLES_UNWIND_BUSY,
+    SAMPLES_UNWIND_FAILED,
+    WALL_SIGNALS_FAILED,
+    LIVENESS_TABLE_OVERFLOW
+};
+
+void SampleLoss::record(LossEngine engine, LossReason reason, u64 count) {
+    atomicInc(_slots[engine].lost[reason], count);
+    Counters::increment(LOSS_COUNTER[reason], count);
+}
+
+bool SampleLoss::drain(LossEngine engine, u64* lost) {
+    bool any = false;
+    for (int i = 0; i < LOSS_REASONS; i++) {
+        lost[i] = __atomic_exchange_n(&_slots[engine].lost[i], 0, __ATOMIC_ACQ_REL);
+        any |= lost[i] != 0;
+    }
+    return any;
+}
+
+void SampleLoss::reset() {
+    memset((void*)_slots, 0, sizeof(_slots));
+}
+
+const char* SampleLoss::engineName(LossEngine engine) {
+    switch (engine) {
+        case LOSS_CPU:       return "cpu";
+        case LOSS_WALL:      return "wall";
+        case LOSS_ALLOC:     return "alloc";
+        case LOSS_LIVENESS:  return "liveness";
+        case LOSS_NATIVEMEM: return "nativemem";
+        default:             return "other";
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SAMPLELOSS_H
+#define _SAMPLELOSS_H
+
+#include "arch.h"
+#include "counters.h"
+
+enum LossEngine {
+    LOSS_CPU,
+    LOSS_WALL,
+    LOSS_ALLOC,
+    LOSS_LIVENESS,
+    LOSS_NATIVEMEM,
+    LOSS_OTHER,
+    LOSS_ENGINES
+};
+
+enum LossReason {
+    LOSS_LOCK_CONTENTION,   // all the sample locks were taken; the sample is dropped
+    LOSS_STORAGE_OVERFLOW,  // the call trace storage is full; the sample is kept with a "storage_overflow" stack
+    LOSS_UNWIND_BUSY,       // the thread was already unwinding its Java stack; the sample has no Java frames
+    LOSS_UNWIND_FAILED,     // AsyncGetCallTrace failed; the sample has an error frame instead of its Java frames
+    LOSS_SIGNAL_FAILED,     // the wall clock signal could not be sent to a live thread
+    LOSS_TABLE_OVERFLOW,    // the liveness tracking table is full; the object is not tracked
+    LOSS_REASONS
+};
+
+// Counts the samples lost or degraded on the way to the recording, per engine and reason.
+// Every loss is also added to the Counters block; the counts since the previous chunk are
+// written with every chunk. Recording is async signal safe and lock-free.
+class SampleLoss {
+  private:
+    struct Slot {
+        volatile u64 lost[LOSS_REASONS];
+    };
+
+    static Slot _slots[LOSS_ENGINES];
+
+  public:
+    static void record(LossEngine engine, LossReason reason, u64 count = 1);
+
+    // Moves the counts of the engine since the previous drain to lost; false if there were none
+    static bool drain(LossEngine engine, u64* lost);
+
+    static void reset();
+
+    static const char* engineName(LossEngine engine);
+};
+
+#endif // _SAMPLELOSS_H
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string>
+#include "counters.h"
+#include "shmRing.h"
+
+
+// the collectors map the header by these offsets
+static_assert(offsetof(ShmRingHeader, write_pos) == 64, "write_pos must start the second cache line");
+static_assert(offsetof(ShmRingHeader, read_pos) == 128, "read_pos must start the third cache line");
+
+static const size_t MIN_CAPACITY = 1024 * 1024;
+
+ShmRing::ShmRing(const char* name, size_t capacity) : _header(NULL), _data(NULL), _mapped_size(0) {
+    size_t data_size = MIN_CAPACITY;
+    while (data_size * 2 <= capacity) {
+        data_size *= 2;
+    }
+    std::string path = std::string("/dev/shm/") + name;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return;
+    }
+    size_t mapped_size = sizeof(ShmRingHeader) + data_size;
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, mapped_size) == 0) {
+        map = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(path.c_str());
+        errno = saved_errno;
+        return;
+    }
+
+    _header = (ShmRingHeader*)map;
+    _data = (char*)map + sizeof(ShmRingHeader);
+    _mapped_size = mapped_size;
+    // the file was truncated, so everything else starts out zeroed
+    _header->version = SHM_RING_VERSION;
+    _header->header_size = sizeof(ShmRingHeader);
+    _header->capacity = data_size;
+    _header->producer_pid = getpid();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(_header->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+}
+
+ShmRing::~ShmRing() {
+    if (_header != NULL) {
+        munmap(_header, _mapped_size);
+    }
+}
+
+void ShmRing::drop(size_t size) {
+    __atomic_add_fetch(&_header->dropped_records, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_header->dropped_bytes, size, __ATOMIC_RELAXED);
+    Counters::increment(SHM_RING_CHUNKS_DROPPED);
+}
+
+bool ShmRing::publish(u32 type, int fd, off_t offset, size_t size) {
+    u64 capacity = _header->capacity;
+    u64 record_size = (sizeof(ShmRecordHeader) + size + 7) & ~(u64)7;
+    u64 write_pos = _header->write_pos;
+    u64 free_space = capacity - (write_pos - __atomic_load_n(&_header->read_pos, __ATOMIC_ACQUIRE));
+    u64 start = write_pos & (capacity - 1);
+    u64 tail_space = capacity - start;
+    u64 needed = record_size + (tail_space < record_size ? tail_space : 0);
+    if (size > 0xffffffffULL || needed > free_space) {
+        drop(size);
+        return false;
+    }
+
+    if (tail_space < record_size) {
+        // the positions are 8 byte aligned, there is always room for the padding record header
+        ShmRecordHeader* padding = (ShmRecordHeader*)(_data + start);
+        padding->size = (u32)(tail_space - sizeof(ShmRecordHeader));
+        padding->type = SHM_RECORD_PADDING;
+        write_pos += tail_space;
+        start = 0;
+    }
+
+    char* payload = _data + start + sizeof(ShmRecordHeader);
+    for (size_t copied = 0; copied < size; ) {
+        ssize_t bytes = pread(fd, payload + copied, size - copied, offset + copied);
+        if (bytes <= 0) {
+            // nothing is published, the padding record is written over by the next record
+            drop(size);
+            return false;
+        }
+        copied += bytes;
+    }
+    ShmRecordHeader* record = (ShmRecordHeader*)(_data + start);
+    record->size = (u32)size;
+    record->type = type;
+    __atomic_store_n(&_header->write_pos, write_pos + record_size, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SHMRING_H
+#define _SHMRING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "arch.h"
+
+const char SHM_RING_MAGIC[8] = {'D', 'D', 'S', 'H', 'M', 'R', 'N', 'G'};
+const u32 SHM_RING_VERSION = 1;
+
+enum ShmRecordType {
+    SHM_RECORD_PADDING = 0,    // fills the end of the data area, skip to its start
+    SHM_RECORD_JFR_CHUNK = 1,  // a complete, self-contained JFR chunk
+};
+
+// The file starts with this header, the data area of 'capacity' bytes follows at 'header_size'.
+// Both positions are ever increasing byte counts, taken modulo the capacity to address the data area:
+// the producer (the profiled JVM) owns write_pos, the consumer (the collector) owns read_pos, and the ring
+// holds write_pos - read_pos bytes. Each side only reads the position of the other with acquire semantics
+// and publishes its own with a release store once it is done with the bytes in between.
+//
+// Every record is 8 byte aligned: a ShmRecordHeader followed by 'size' payload bytes, padded to 8.
+// A record never wraps around the end of the data area, a SHM_RECORD_PADDING record takes the rest of it
+// instead. The producer never waits: a record which does not fit in the free space is dropped, and
+// counted in dropped_records, so the occupancy of the ring is the backpressure signal to the consumer.
+// The magic is written last, once the header is valid. The file is left in place when the recording ends,
+// the consumer removes it once drained.
+struct ShmRingHeader {
+    char magic[8];
+    u32 version;
+    u32 header_size;
+    u64 capacity;             // a power of 2
+    u32 producer_pid;
+    u32 reserved;
+    volatile u64 dropped_records;
+    volatile u64 dropped_bytes;
+    char padding0[16];
+    volatile u64 write_pos;   // at offset 64
+    char padding1[56];
+    volatile u64 read_pos;    // at offset 128
+    char padding2[56];
+};
+
+struct ShmRecordHeader {
+    u32 size;
+    u32 type;
+};
+
+// Single-producer side of the ring, only used by the thread finishing the chunks
+class ShmRing {
+  private:
+    ShmRingHeader* _header;
+    char* _data;
+    size_t _mapped_size;
+
+    void drop(size_t size);
+
+  public:
+    // Creates /dev/shm/<name>, replacing any previous file, with the largest power of 2 not above capacity
+    ShmRing(const char* name, size_t capacity);
+    ~ShmRing();
+
+    bool valid() const {
+        return _header != NULL;
+    }
+
+    // Copies size bytes at offset of fd into a new record, unless the free space is too small
+    bool publish(u32 type, int fd, off_t offset, size_t size);
+};
+
+#endif // _SHMRING_H
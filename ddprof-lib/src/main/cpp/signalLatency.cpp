@@ -0,0 +1,100 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "signalLatency.h"
+
+volatile bool SignalLatency::_enabled = false;
+volatile bool SignalLatency::_reporting = false;
+SignalLatency::Slot SignalLatency::_slots[SIGNAL_ENGINES];
+
+static const CounterId HANDLER_HISTOGRAM[SIGNAL_ENGINES] = {
+    ITIMER_HANDLER_LT_1US,
+    PERF_HANDLER_LT_1US,
+    CTIMER_HANDLER_LT_1US,
+    WALL_HANDLER_LT_1US
+};
+
+void SignalLatency::enable(bool enabled, bool reporting) {
+    memset((void*)_slots, 0, sizeof(_slots));
+    _reporting = enabled && reporting;
+    _enabled = enabled;
+}
+
+void SignalLatency::updateMax(volatile u64& max, u64 value) {
+    u64 current = max;
+    while (value > current) {
+        u64 witness = __sync_val_compare_and_swap(&max, current, value);
+        if (witness == current) {
+            break;
+        }
+        current = witness;
+    }
+}
+
+void SignalLatency::exit(SignalEngine engine, u64 entry_ticks) {
+    if (entry_ticks == 0) {
+        return;
+    }
+    u64 nanos = toNanos(TSC::ticks() - entry_ticks);
+    Slot& slot = _slots[engine];
+    atomicInc(slot.samples);
+    atomicInc(slot.handler_nanos, nanos);
+    atomicInc(slot.total_handler_nanos, nanos);
+    updateMax(slot.max_handler_nanos, nanos);
+    Counters::increment(HANDLER_HISTOGRAM[engine], 1, bucket(nanos));
+}
+
+void SignalLatency::delivered(SignalEngine engine, u32 send_stamp, u64 entry_ticks) {
+    if (entry_ticks == 0 || send_stamp == 0) {
+        return;
+    }
+    // the stamp wraps around every few seconds, far longer than any delivery takes
+    u64 nanos = toNanos((u32)((u32)entry_ticks - send_stamp));
+    Slot& slot = _slots[engine];
+    atomicInc(slot.delivered);
+    atomicInc(slot.delivery_nanos, nanos);
+    updateMax(slot.max_delivery_nanos, nanos);
+    if (engine == SIGNAL_ENGINE_WALL) {
+        Counters::increment(WALL_DELIVERY_LT_1US, 1, bucket(nanos));
+    }
+}
+
+bool SignalLatency::drain(SignalEngine engine, SignalLatencySummary* summary) {
+    Slot& slot = _slots[engine];
+    summary->samples = __sync_fetch_and_and(&slot.samples, 0);
+    summary->handler_nanos = __sync_fetch_and_and(&slot.handler_nanos, 0);
+    summary->max_handler_nanos = __sync_fetch_and_and(&slot.max_handler_nanos, 0);
+    summary->delivered = __sync_fetch_and_and(&slot.delivered, 0);
+    summary->delivery_nanos = __sync_fetch_and_and(&slot.delivery_nanos, 0);
+    summary->max_delivery_nanos = __sync_fetch_and_and(&slot.max_delivery_nanos, 0);
+    return summary->samples > 0 || summary->delivered > 0;
+}
+
+const char* SignalLatency::engineName(SignalEngine engine) {
+    switch (engine) {
+        case SIGNAL_ENGINE_ITIMER:
+            return "itimer";
+        case SIGNAL_ENGINE_PERF:
+            return "perf";
+        case SIGNAL_ENGINE_CTIMER:
+            return "ctimer";
+        case SIGNAL_ENGINE_WALL:
+            return "wall";
+        default:
+            return "unknown";
+    }
+}
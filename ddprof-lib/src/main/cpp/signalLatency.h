@@ -0,0 +1,115 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SIGNALLATENCY_H
+#define _SIGNALLATENCY_H
+
+#include "arch.h"
+#include "counters.h"
+#include "tsc.h"
+
+enum SignalEngine {
+    SIGNAL_ENGINE_ITIMER,
+    SIGNAL_ENGINE_PERF,
+    SIGNAL_ENGINE_CTIMER,
+    SIGNAL_ENGINE_WALL,
+    SIGNAL_ENGINES
+};
+
+// Buckets of the latency histograms, powers of 4 from below 1us up to 4ms and above
+const int LATENCY_BUCKETS = 8;
+
+struct SignalLatencySummary {
+    u64 samples;
+    u64 handler_nanos;
+    u64 max_handler_nanos;
+    u64 delivered;
+    u64 delivery_nanos;
+    u64 max_delivery_nanos;
+};
+
+// Times the profiling signals: from handler entry to exit for every engine, and from sending
+// to handler entry where the profiler sends the signal itself. Every sample lands in a histogram
+// in the Counters block and in a summary drained periodically into a JFR event.
+// Recording is async signal safe and lock-free.
+class SignalLatency {
+  private:
+    struct Slot {
+        volatile u64 samples;
+        volatile u64 handler_nanos;
+        volatile u64 max_handler_nanos;
+        volatile u64 delivered;
+        volatile u64 delivery_nanos;
+        volatile u64 max_delivery_nanos;
+        // not drained, for the profiler overhead event
+        volatile u64 total_handler_nanos;
+    };
+
+    static volatile bool _enabled;
+    static volatile bool _reporting;
+    static Slot _slots[SIGNAL_ENGINES];
+
+    static u64 toNanos(u64 ticks) {
+        return (u64)((double)ticks * 1e9 / TSC::frequency());
+    }
+
+    static int bucket(u64 nanos) {
+        u64 micros = nanos / 1000;
+        if (micros == 0) {
+            return 0;
+        }
+        int index = (63 - __builtin_clzll(micros)) / 2 + 1;
+        return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+    }
+
+    static void updateMax(volatile u64& max, u64 value);
+
+  public:
+    // Timing may be enabled for the overhead totals alone, without the periodic summaries
+    static void enable(bool enabled, bool reporting);
+
+    static bool enabled() {
+        return _enabled;
+    }
+
+    static bool reporting() {
+        return _reporting;
+    }
+
+    // The handler time of the engine since timing was enabled
+    static u64 handlerNanos(SignalEngine engine) {
+        return _slots[engine].total_handler_nanos;
+    }
+
+    // The handler entry timestamp, 0 when disabled
+    static u64 enter() {
+        return _enabled ? TSC::ticks() : 0;
+    }
+
+    // The low 32 bits of the current timestamp, to be sent along with a signal; never 0
+    static u32 sendStamp() {
+        u32 stamp = (u32)TSC::ticks();
+        return stamp != 0 ? stamp : 1;
+    }
+
+    static void exit(SignalEngine engine, u64 entry_ticks);
+    static void delivered(SignalEngine engine, u32 send_stamp, u64 entry_ticks);
+    static bool drain(SignalEngine engine, SignalLatencySummary* summary);
+
+    static const char* engineName(SignalEngine engine);
+};
+
+#endif // _SIGNALLATENCY_H
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "spanAggregator.h"
+#include "context.h"
+#include "counters.h"
+#include "os.h"
+#include "profiler.h"
+
+SpanAggregator* const SpanAggregator::_instance = new SpanAggregator();
+
+static inline u64 mix(u64 value) {
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+static inline u32 homeSlot(u64 root_span_id) {
+    return (u32)mix(root_span_id);
+}
+
+static inline u64 keyHash(u64 span_id, u64 root_span_id) {
+    // odd, so that it is neither a free nor a retiring slot
+    return mix(span_id ^ mix(root_span_id)) | 1;
+}
+
+Error SpanAggregator::start(Arguments& args) {
+    _enabled = false;
+    if (!args._span_summary) {
+        return Error::OK;
+    }
+    if (_entries == NULL &&
+        (_entries = (SpanAggregateEntry*)calloc(TABLE_SIZE, sizeof(SpanAggregateEntry))) == NULL) {
+        return Error("Could not allocate the span aggregation table");
+    }
+    // the sums of the previous session have been written out when it stopped
+    memset(_entries, 0, TABLE_SIZE * sizeof(SpanAggregateEntry));
+    _enabled = true;
+    return Error::OK;
+}
+
+void SpanAggregator::stop() {
+    _enabled = false;
+}
+
+bool SpanAggregator::record(int tid, bool wall, u64 samples, u64 nanos) {
+    Context ctx = Contexts::get(tid);
+    if (ctx.spanId == 0 && ctx.rootSpanId == 0) {
+        return false;
+    }
+
+    u64 hash = keyHash(ctx.spanId, ctx.rootSpanId);
+    u32 slot = homeSlot(ctx.rootSpanId);
+    for (int probe = 0; probe < MAX_PROBES; probe++, slot++) {
+        SpanAggregateEntry* entry = &_entries[slot % TABLE_SIZE];
+        u64 entry_hash = loadAcquire(entry->hash);
+        if (entry_hash == 0) {
+            if (!__sync_bool_compare_and_swap(&entry->hash, 0, hash)) {
+                entry_hash = loadAcquire(entry->hash);
+            } else {
+                entry->span_id = ctx.spanId;
+                entry->root_span_id = ctx.rootSpanId;
+                __atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+                entry_hash = hash;
+            }
+        }
+        if (entry_hash != hash) {
+            continue;
+        }
+        atomicInc(entry->writers);
+        // the slot may have been retired and claimed by another span since; a span whose slot is not ready
+        // yet takes another one instead of waiting, so that a nested signal can never spin on its own thread
+        if (loadAcquire(entry->hash) != hash || loadAcquire(entry->ready) == 0 ||
+            entry->span_id != ctx.spanId || entry->root_span_id != ctx.rootSpanId) {
+            atomicInc(entry->writers, -1);
+            continue;
+        }
+        if (wall) {
+            atomicInc(entry->wall_samples, samples);
+            atomicInc(entry->wall_time, nanos);
+        } else {
+            atomicInc(entry->cpu_samples, samples);
+            atomicInc(entry->cpu_time, nanos);
+        }
+        atomicInc(entry->writers, -1);
+        return true;
+    }
+
+    Counters::increment(SPAN_AGGREGATE_OVERFLOWS);
+    return false;
+}
+
+// Takes the sums out of the entry and frees its slot; fails if the entry has changed meanwhile
+// or if a sampler does not leave it in time, in which case it is reported later
+bool SpanAggregator::retire(SpanAggregateEntry* entry, u64 hash, u64 root_span_id, SpanSummaryEvent* event) {
+    if (!__sync_bool_compare_and_swap(&entry->hash, hash, RETIRING)) {
+        return false;
+    }
+    if (root_span_id != 0 && entry->root_span_id != root_span_id) {
+        __atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+        return false;
+    }
+    for (int spins = 0; loadAcquire(entry->writers) != 0; spins++) {
+        if (spins == MAX_RETIRE_SPINS) {
+            __atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+            return false;
+        }
+        spinPause();
+    }
+
+    event->_span_id = entry->span_id;
+    event->_root_span_id = entry->root_span_id;
+    event->_cpu_samples = entry->cpu_samples;
+    event->_cpu_time = entry->cpu_time;
+    event->_wall_samples = entry->wall_samples;
+    event->_wall_time = entry->wall_time;
+
+    entry->ready = 0;
+    entry->cpu_samples = 0;
+    entry->cpu_time = 0;
+    entry->wall_samples = 0;
+    entry->wall_time = 0;
+    __atomic_store_n(&entry->hash, 0, __ATOMIC_RELEASE);
+    return true;
+}
+
+int SpanAggregator::drain(u64 root_span_id, SpanSummaryEvent* events) {
+    if (!_enabled || root_span_id == 0) {
+        return 0;
+    }
+
+    int count = 0;
+    u32 slot = homeSlot(root_span_id);
+    for (int probe = 0; probe < MAX_PROBES; probe++, slot++) {
+        SpanAggregateEntry* entry = &_entries[slot % TABLE_SIZE];
+        u64 entry_hash = loadAcquire(entry->hash);
+        if ((entry_hash & 1) == 0 || loadAcquire(entry->ready) == 0 || entry->root_span_id != root_span_id) {
+            continue;
+        }
+        if (retire(entry, entry_hash, root_span_id, &events[count])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void SpanAggregator::flush() {
+    if (!_enabled) {
+        return;
+    }
+
+    const int batch_size = 64;
+    SpanSummaryEvent events[batch_size];
+    int count = 0;
+    int tid = OS::threadId();
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        SpanAggregateEntry* entry = &_entries[i];
+        u64 entry_hash = loadAcquire(entry->hash);
+        if ((entry_hash & 1) == 0 || loadAcquire(entry->ready) == 0) {
+            continue;
+        }
+        if (retire(entry, entry_hash, 0, &events[count]) && ++count == batch_size) {
+            Profiler::instance()->recordSpanSummaries(tid, events, count);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        Profiler::instance()->recordSpanSummaries(tid, events, count);
+    }
+}
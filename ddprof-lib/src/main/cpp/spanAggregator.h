@@ -0,0 +1,88 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SPANAGGREGATOR_H
+#define _SPANAGGREGATOR_H
+
+#include "arch.h"
+#include "arguments.h"
+#include "event.h"
+
+// The sums of the CPU and wall samples of one (rootSpanId, spanId) pair; the key is written once
+// by the thread which claims the slot, the sums are updated atomically by all the threads of the span
+typedef struct SpanAggregateEntry {
+    // 0 while the slot is free, RETIRING while the sums are being written out
+    volatile u64 hash;
+    // set once the key below has been published
+    volatile int ready;
+    // the samplers currently adding to the sums
+    volatile int writers;
+    u64 span_id;
+    u64 root_span_id;
+    volatile u64 cpu_samples;
+    volatile u64 cpu_time;
+    volatile u64 wall_samples;
+    volatile u64 wall_time;
+} SpanAggregateEntry;
+
+// Sums the CPU and wall samples per span in native memory and writes them out as one summary event
+// per span when its local root span ends or when the chunk is dumped. The spans of one local root
+// are kept within a probe window starting from a slot picked by the root span id alone, so that
+// the end of a root span only has to scan that window.
+// A span may be reported by several summary events, e.g. when it has samples after its root span ended;
+// the consumers are expected to add them up.
+class SpanAggregator {
+  public:
+    const static int MAX_PROBES = 32;
+
+  private:
+    const static int TABLE_SIZE = 8192;
+    const static int MAX_RETIRE_SPINS = 1024;
+    const static u64 RETIRING = 2;
+
+    static SpanAggregator* const _instance;
+
+    SpanAggregateEntry* _entries;
+    bool _enabled;
+
+    bool retire(SpanAggregateEntry* entry, u64 hash, u64 root_span_id, SpanSummaryEvent* event);
+
+  public:
+    static SpanAggregator* instance() {
+        return _instance;
+    }
+
+    SpanAggregator() : _entries(NULL), _enabled(false) {
+    }
+
+    bool enabled() {
+        return _enabled;
+    }
+
+    Error start(Arguments& args);
+    void stop();
+
+    // Adds a sample to the span currently set on the thread; false if it could not be aggregated
+    bool record(int tid, bool wall, u64 samples, u64 nanos);
+
+    // Moves the sums of the spans of the given local root into the events; returns the number of events
+    int drain(u64 root_span_id, SpanSummaryEvent* events);
+
+    // Writes out the sums of all the spans
+    void flush();
+};
+
+#endif // _SPANAGGREGATOR_H
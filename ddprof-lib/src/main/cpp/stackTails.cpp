@@ -0,0 +1,162 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "stackTails.h"
+
+
+static const size_t TAIL_CHUNK = 1024 * 1024;
+// a capture gives up on a crowded table rather than scanning all of it from a signal handler
+static const u32 MAX_PROBES = 32;
+
+StackTails::StackTails() : _table(NULL), _standby_table(NULL), _allocator(TAIL_CHUNK), _standby_allocator(TAIL_CHUNK),
+                           _active_allocator(&_allocator), _buffer_frames(0), _tail_depth(0), _enabled(false) {
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        _buffers[i] = NULL;
+    }
+}
+
+StackTails::~StackTails() {
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        free(_buffers[i]);
+    }
+    free(_table);
+    free(_standby_table);
+}
+
+Error StackTails::start(Arguments& args, int max_stack_depth) {
+    _enabled = false;
+    _tail_depth = args._jstacktail;
+    if (_tail_depth <= 0) {
+        return Error::OK;
+    }
+    if (_table == NULL && (_table = (Entry*)calloc(CAPACITY, sizeof(Entry))) == NULL) {
+        return Error("Not enough memory to allocate the stack tail table");
+    }
+    if (_standby_table == NULL && (_standby_table = (Entry*)calloc(CAPACITY, sizeof(Entry))) == NULL) {
+        return Error("Not enough memory to allocate the stack tail table");
+    }
+    int frames = max_stack_depth + _tail_depth;
+    if (frames > _buffer_frames) {
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            free(_buffers[i]);
+            _buffers[i] = (ASGCT_CallFrame*)malloc(frames * sizeof(ASGCT_CallFrame));
+            if (_buffers[i] == NULL) {
+                _buffer_frames = 0;
+                return Error("Not enough memory to allocate stack tail buffers (try smaller jstacktail)");
+            }
+        }
+        _buffer_frames = frames;
+    }
+    _enabled = true;
+    return Error::OK;
+}
+
+void StackTails::stop() {
+    _enabled = false;
+}
+
+void StackTails::clear() {
+    if (_table != NULL) {
+        memset(_table, 0, CAPACITY * sizeof(Entry));
+    }
+    if (_standby_table != NULL) {
+        memset(_standby_table, 0, CAPACITY * sizeof(Entry));
+    }
+    _allocator.clear();
+    _standby_allocator.clear();
+}
+
+void StackTails::rotate() {
+    Entry* retired_table = _table;
+    _table = _standby_table;
+    _standby_table = retired_table;
+    _active_allocator = _active_allocator == &_allocator ? &_standby_allocator : &_allocator;
+}
+
+void StackTails::recycle() {
+    // the samplers never see the retired generation, so it can be cleaned up while they run
+    if (_standby_table != NULL) {
+        memset(_standby_table, 0, CAPACITY * sizeof(Entry));
+    }
+    if (_active_allocator == &_allocator) {
+        _standby_allocator.clear();
+    } else {
+        _allocator.clear();
+    }
+}
+
+u64 StackTails::calcHash(int num_frames, ASGCT_CallFrame* frames, bool truncated) {
+    // FNV-1a over the frames; the tails are few and only hashed on captures
+    u64 h = truncated ? 0xcbf29ce484222325ULL : 0x84222325cbf29ce4ULL;
+    for (int i = 0; i < num_frames; i++) {
+        h = (h ^ (u64)frames[i].method_id) * 0x100000001b3ULL;
+        h = (h ^ (u64)(u32)frames[i].bci) * 0x100000001b3ULL;
+    }
+    return h != 0 ? h : 1;
+}
+
+u64 StackTails::store(int num_frames, ASGCT_CallFrame* frames, bool truncated) {
+    u64 hash = calcHash(num_frames, frames, truncated);
+    u32 slot = (u32)(hash ^ (hash >> 32)) & (CAPACITY - 1);
+    for (u32 step = 0; step < MAX_PROBES; step++) {
+        u64 key = __atomic_load_n(&_table[slot].hash, __ATOMIC_ACQUIRE);
+        if (key == hash) {
+            return hash;
+        }
+        if (key == 0) {
+            const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+            CallTrace* tail = (CallTrace*)_active_allocator->alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+            if (tail == NULL) {
+                return 0;
+            }
+            tail->truncated = truncated;
+            tail->num_frames = num_frames;
+            memcpy(tail->frames, frames, num_frames * sizeof(ASGCT_CallFrame));
+            if (__sync_bool_compare_and_swap(&_table[slot].hash, 0, hash)) {
+                __atomic_store_n(&_table[slot].tail, tail, __ATOMIC_RELEASE);
+                return hash;
+            }
+            // another sampler took the slot, possibly for the same tail; the copy is only reclaimed with its generation
+            if (__atomic_load_n(&_table[slot].hash, __ATOMIC_ACQUIRE) == hash) {
+                return hash;
+            }
+        }
+        slot = (slot + 1) & (CAPACITY - 1);
+    }
+    return 0;
+}
+
+CallTrace* StackTails::find(u64 hash, bool retired) {
+    Entry* table = retired ? _standby_table : _table;
+    if (table == NULL) {
+        return NULL;
+    }
+    u32 slot = (u32)(hash ^ (hash >> 32)) & (CAPACITY - 1);
+    for (u32 step = 0; step < MAX_PROBES; step++) {
+        u64 key = __atomic_load_n(&table[slot].hash, __ATOMIC_ACQUIRE);
+        if (key == hash) {
+            // NULL while the tail is still being published
+            return __atomic_load_n(&table[slot].tail, __ATOMIC_ACQUIRE);
+        }
+        if (key == 0) {
+            return NULL;
+        }
+        slot = (slot + 1) & (CAPACITY - 1);
+    }
+    return NULL;
+}
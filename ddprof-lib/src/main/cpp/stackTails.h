@@ -0,0 +1,91 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STACKTAILS_H
+#define _STACKTAILS_H
+
+#include "arch.h"
+#include "arguments.h"
+#include "callTraceStorage.h"
+#include "flightRecorder.h"
+#include "linearAllocator.h"
+#include "vmEntry.h"
+
+// Restores the outermost frames of the Java stacks deeper than jstackdepth without walking them on every sample.
+// Every TAIL_CAPTURE_INTERVAL truncated samples of a thread, the stack is walked again jstacktail frames deeper
+// and what lies beyond jstackdepth is kept once per distinct tail, under its hash. Until the next capture,
+// the truncated samples of the thread end with a BCI_STACK_TAIL frame carrying that hash, which the call trace
+// storage replaces with the tail frames when the traces are collected. The stitched stacks are thus exact
+// only as long as the outer part of the stack does not change between two captures.
+// The tails come in two generations which rotate and are recycled along with those of the call trace storage,
+// so a tail lives as long as the traces referring to it and the table does not fill up over a long run.
+class StackTails {
+  public:
+    static const u32 CAPACITY = 4096;
+    static const u32 TAIL_CAPTURE_INTERVAL = 64;
+
+  private:
+    struct Entry {
+        volatile u64 hash;
+        CallTrace* volatile tail;
+    };
+
+    // CAPACITY entries each, allocated by the first start with the jstacktail option like the walk buffers;
+    // the samplers only see the active generation
+    Entry* _table;
+    Entry* _standby_table;
+    LinearAllocator _allocator;
+    LinearAllocator _standby_allocator;
+    LinearAllocator* _active_allocator;
+    ASGCT_CallFrame* _buffers[CONCURRENCY_LEVEL];
+    int _buffer_frames;
+    int _tail_depth;
+    volatile bool _enabled;
+
+    static u64 calcHash(int num_frames, ASGCT_CallFrame* frames, bool truncated);
+
+  public:
+    StackTails();
+    ~StackTails();
+
+    bool enabled() {
+        return _enabled;
+    }
+
+    // Sizes the walk buffers for stacks of max_stack_depth plus the tail depth; called while nothing is sampled
+    Error start(Arguments& args, int max_stack_depth);
+    void stop();
+    // Forgets all the tails, along with the traces referencing them; called while nothing is sampled
+    void clear();
+    // Retires the active generation along with that of the call trace storage; called with all the sample locks held
+    void rotate();
+    // Forgets the retired tails once the traces referencing them are written
+    void recycle();
+
+    // The walk buffer of a lock slot, only used by the holder of its lock
+    ASGCT_CallFrame* buffer(int lock_index, int* capacity) {
+        *capacity = _buffer_frames;
+        return _buffers[lock_index];
+    }
+
+    // Called from signal handlers; returns the hash to stitch the tail by, 0 if it could not be stored
+    u64 store(int num_frames, ASGCT_CallFrame* frames, bool truncated);
+
+    // NULL if there is no such tail in the active generation, or in the retired one
+    CallTrace* find(u64 hash, bool retired = false);
+};
+
+#endif // _STACKTAILS_H
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <pthread.h>
+#include "stackTraceWriter.h"
+#include "buffers.h"
+#include "callTraceStorage.h"
+#include "flightRecorder.h"
+#include "os.h"
+
+u64 StackTraceWriter::write(Buffer* buf, const std::vector<std::pair<u32, CallTrace*> >& traces,
+                            const std::vector<MethodInfo*>& methods, int workers) {
+    if (workers > MAX_CPOOL_WORKERS) {
+        workers = MAX_CPOOL_WORKERS;
+    }
+    if (workers <= 1) {
+        writeRange(buf, traces.data(), traces.size(), methods.data(), NULL);
+        return 0;
+    }
+
+    std::vector<size_t> frame_offsets;
+    frame_offsets.reserve(traces.size() + 1);
+    size_t frames = 0;
+    for (size_t i = 0; i < traces.size(); i++) {
+        frame_offsets.push_back(frames);
+        frames += traces[i].second->num_frames;
+    }
+    frame_offsets.push_back(frames);
+
+    // Ranges of about the same number of frames; this thread encodes the first one right into
+    // the chunk while the workers encode the rest, which are then written in order
+    StackTraceRange ranges[MAX_CPOOL_WORKERS];
+    pthread_t threads[MAX_CPOOL_WORKERS];
+    bool started[MAX_CPOOL_WORKERS] = {false};
+    size_t begin = 0;
+    for (int i = 0; i < workers; i++) {
+        size_t end = traces.size();
+        if (i < workers - 1) {
+            size_t frames_end = frames / workers * (i + 1);
+            end = std::lower_bound(frame_offsets.begin() + begin, frame_offsets.end() - 1, frames_end) - frame_offsets.begin();
+        }
+        StackTraceRange& range = ranges[i];
+        range.writer = this;
+        range.traces = traces.data() + begin;
+        range.methods = methods.data() + frame_offsets[begin];
+        range.count = end - begin;
+        range.cputime = 0;
+        if (i > 0) {
+            started[i] = pthread_create(&threads[i], NULL, worker, &range) == 0;
+        }
+        begin = end;
+    }
+
+    writeRange(buf, ranges[0].traces, ranges[0].count, ranges[0].methods, NULL);
+    flush(buf);
+    u64 cputime = 0;
+    for (int i = 1; i < workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            worker(&ranges[i]);
+        }
+        flush(ranges[i].out.data(), ranges[i].out.size());
+        cputime += ranges[i].cputime;
+    }
+    return cputime;
+}
+
+void* StackTraceWriter::worker(void* arg) {
+    StackTraceRange* range = (StackTraceRange*)arg;
+    u64 start = OS::cputime();
+    RecordingBuffer* buf = new RecordingBuffer();
+    range->writer->writeRange(buf, range->traces, range->count, range->methods, &range->out);
+    range->out.append(buf->data(), buf->offset());
+    delete buf;
+    range->cputime = OS::cputime() - start;
+    return NULL;
+}
+
+void StackTraceWriter::writeRange(Buffer* buf, const std::pair<u32, CallTrace*>* traces, size_t count,
+                                  MethodInfo* const* methods, std::string* spill) {
+    for (size_t t = 0; t < count; t++) {
+        CallTrace* trace = traces[t].second;
+        buf->putVar64(traces[t].first);
+        if (trace->num_frames > 0) {
+            MethodInfo* mi = methods[trace->num_frames - 1];
+            if (mi->_type < FRAME_NATIVE) {
+                buf->put8(mi->_is_entry ? 0 : 1);
+            } else {
+                buf->put8(trace->truncated);
+            }
+        }
+        buf->putVar64(trace->num_frames);
+        for (int i = 0; i < trace->num_frames; i++) {
+            MethodInfo* mi = methods[i];
+            jint bci = trace->frames[i].bci;
+            // method, line number, bytecode index and frame type; the frame type fits in a single byte
+            u64 fields[4];
+            fields[0] = mi->_key;
+            if (mi->_type < FRAME_NATIVE) {
+                FrameTypeId type = FrameType::decode(bci);
+                bci = (bci & 0x10000) ? 0 : (bci & 0xffff);
+                // the line number cache of a method is not shared between threads
+                fields[1] = (u32)mi->getLineNumber(bci, spill == NULL);
+                fields[3] = type;
+            } else {
+                fields[1] = 0;
+                fields[3] = mi->_type;
+            }
+            fields[2] = (u32)bci;
+            buf->putVar64Array(fields, 4);
+            if (buf->offset() >= JFR_EVENT_FLUSH_THRESHOLD) {
+                if (spill != NULL) {
+                    spill->append(buf->data(), buf->offset());
+                    buf->reset();
+                } else {
+                    flush(buf);
+                }
+            }
+        }
+        methods += trace->num_frames;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STACKTRACEWRITER_H
+#define _STACKTRACEWRITER_H
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "arch.h"
+
+class Buffer;
+class MethodInfo;
+class StackTraceWriter;
+struct CallTrace;
+
+// A contiguous range of the stack trace pool, encoded by a constant pool worker into its own buffer
+struct StackTraceRange {
+    StackTraceWriter* writer;
+    const std::pair<u32, CallTrace*>* traces;
+    // the resolved methods of all the frames of the traces, in order
+    MethodInfo* const* methods;
+    size_t count;
+    // the encoded traces, written to the file after the ranges before this one
+    std::string out;
+    u64 cputime;
+};
+
+// Encodes the entries of the stack trace pool. The methods of the frames are resolved up front,
+// so that a large pool can be split across constant pool workers; the output does not depend
+// on the number of workers.
+class StackTraceWriter {
+  private:
+    static void* worker(void* range);
+
+    void writeRange(Buffer* buf, const std::pair<u32, CallTrace*>* traces, size_t count,
+                    MethodInfo* const* methods, std::string* spill);
+
+  protected:
+    // writes the content of the buffer to the file and resets the buffer
+    virtual void flush(Buffer* buf) = 0;
+    virtual void flush(const char* data, size_t size) = 0;
+
+  public:
+    virtual ~StackTraceWriter() {}
+
+    // Writes the traces in order, methods holding the resolved methods of all their frames.
+    // Returns the CPU time spent by the workers other than the calling thread.
+    u64 write(Buffer* buf, const std::vector<std::pair<u32, CallTrace*> >& traces,
+              const std::vector<MethodInfo*>& methods, int workers);
+};
+
+#endif // _STACKTRACEWRITER_H
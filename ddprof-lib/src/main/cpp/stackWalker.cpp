@@ -20,12 +20,58 @@
 #include "profiler.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
 const intptr_t MIN_VALID_PC = 0x1000;
 const intptr_t MAX_WALK_SIZE = 0x100000;
 const intptr_t MAX_FRAME_SIZE = 0x40000;
+const int UNWIND_HINT_SLOTS = 4096;
+
+// Direct-mapped cache of the FrameDesc of hot PCs, shared by all threads. Each slot is a tiny
+// seqlock: a writer which cannot claim the slot skips the update, and a reader which sees it
+// change falls back to the full lookup. A hint is valid for one version of the library set.
+struct UnwindHint {
+    volatile u32 seq;
+    u32 version;
+    const void* pc;
+    FrameDesc* f;
+};
+
+static UnwindHint _unwind_hints[UNWIND_HINT_SLOTS];
+
+static inline UnwindHint* unwindHintSlot(const void* pc) {
+    return &_unwind_hints[((uintptr_t)pc * 0x9e3779b97f4a7c15ULL) >> 32 & (UNWIND_HINT_SLOTS - 1)];
+}
+
+static FrameDesc* findUnwindHint(const void* pc, u32 version) {
+    UnwindHint* hint = unwindHintSlot(pc);
+    u32 seq = __atomic_load_n(&hint->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return NULL;
+    }
+    const void* hint_pc = __atomic_load_n(&hint->pc, __ATOMIC_RELAXED);
+    FrameDesc* f = __atomic_load_n(&hint->f, __ATOMIC_RELAXED);
+    u32 hint_version = __atomic_load_n(&hint->version, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hint->seq, __ATOMIC_RELAXED) != seq || hint_pc != pc || hint_version != version) {
+        return NULL;
+    }
+    return f;
+}
+
+static void storeUnwindHint(const void* pc, FrameDesc* f, u32 version) {
+    UnwindHint* hint = unwindHintSlot(pc);
+    u32 seq = __atomic_load_n(&hint->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&hint->seq, seq, seq + 1)) {
+        return;
+    }
+    __atomic_store_n(&hint->pc, pc, __ATOMIC_RELAXED);
+    __atomic_store_n(&hint->f, f, __ATOMIC_RELAXED);
+    __atomic_store_n(&hint->version, version, __ATOMIC_RELAXED);
+    __atomic_store_n(&hint->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
 
 int StackWalker::walkFP(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx, bool *truncated) {
@@ -107,6 +153,7 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
 
     int depth = 0;
     Profiler* profiler = Profiler::instance();
+    u32 libs_version = profiler->nativeLibsVersion();
 
     *truncated = false;
 
@@ -124,10 +171,18 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
         callchain[depth++] = pc;
         prev_sp = sp;
 
-        FrameDesc* f;
-        CodeCache* cc = profiler->findLibraryByAddress(pc);
-        if (cc == NULL || (f = cc->findFrameDesc(pc)) == NULL) {
-            f = &FrameDesc::default_frame;
+        FrameDesc* f = findUnwindHint(pc, libs_version);
+        if (f == NULL) {
+            CodeCache* cc = profiler->findLibraryByAddress(pc);
+            if (cc != NULL && (f = cc->findFrameDesc(pc)) != NULL) {
+                storeUnwindHint(pc, f, libs_version);
+            } else {
+                // Library records are parsed on first demand; until then, unwind the frame by FP
+                if (cc != NULL && cc->requestDwarf()) {
+                    Symbols::wakeDwarfParser();
+                }
+                f = &FrameDesc::default_frame;
+            }
         }
 
         u8 cfa_reg = (u8)f->cfa;
@@ -172,3 +227,158 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
 
     return depth;
 }
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+// Slots of an interpreter frame relative to its FP, see frame_x86.hpp and frame_aarch64.hpp
+const int INTERPRETER_FRAME_SENDER_SP = -1;
+const int INTERPRETER_FRAME_METHOD = -3;
+const int MAX_WALK_SCOPES = 64;
+
+static inline int interpreterFrameBcp() {
+    // JDK 9 keeps the mirror of the method holder right below the method
+    return VM::java_version() >= 9 ? -8 : -7;
+}
+
+// The last of the fixed slots; below it is the expression stack
+static inline int interpreterFrameInitialSp() {
+    return interpreterFrameBcp() - 1;
+}
+
+int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated) {
+    VMThread* vm_thread = VMThread::current();
+    if (vm_thread == NULL || ucontext == NULL) {
+        return -1;
+    }
+
+    StackFrame frame(ucontext);
+    const void* pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    if (java_ctx->sp != 0) {
+        pc = java_ctx->pc;
+        sp = java_ctx->sp;
+        fp = java_ctx->fp;
+    } else {
+        pc = (const void*)frame.pc();
+        sp = frame.sp();
+        fp = frame.fp();
+    }
+    // Only the frame the signal interrupted may not be set up yet
+    bool top = pc == (const void*)frame.pc();
+
+    if (!CodeHeap::contains(pc)) {
+        // The thread is in the VM or in native code: start from the last Java frame it left
+        sp = vm_thread->lastJavaSP();
+        if (sp == 0) {
+            return -1;
+        }
+        pc = (const void*)vm_thread->lastJavaPC();
+        if (pc == NULL) {
+            pc = stripPointer(SafeAccess::load((void**)sp - 1));
+        }
+        fp = vm_thread->lastJavaFP();
+        top = false;
+    }
+
+    uintptr_t bottom = (uintptr_t)&sp + MAX_WALK_SIZE;
+    Profiler* profiler = Profiler::instance();
+    int depth = 0;
+
+    // Walk until the entry frame of the last Java call from native code
+    while (!profiler->isCallStub(pc)) {
+        if (depth == max_depth) {
+            *truncated = true;
+            break;
+        }
+
+        NMethod* nmethod = CodeHeap::findNMethod(pc);
+        if (nmethod == NULL) {
+            return -1;
+        }
+
+        uintptr_t prev_sp = sp;
+        if (nmethod->isNMethod()) {
+            if (!nmethod->isAlive() || (top && !nmethod->isFrameComplete(pc))) {
+                return -1;
+            }
+            ASGCT_CallFrame scopes[MAX_WALK_SCOPES];
+            int num_scopes = nmethod->decodeScopes(pc, scopes, MAX_WALK_SCOPES);
+            if (num_scopes == 0) {
+                // Native method wrappers have no scopes
+                const char* name = nmethod->name();
+                VMMethod* method = nmethod->method();
+                jmethodID method_id = method != NULL ? method->id() : NULL;
+                if (name == NULL || strcmp(name, "native nmethod") != 0 || method_id == NULL) {
+                    return -1;
+                }
+                scopes[0].bci = FrameType::encode(FRAME_JIT_COMPILED, 0);
+                scopes[0].method_id = method_id;
+                num_scopes = 1;
+            }
+            int count = num_scopes < max_depth - depth ? num_scopes : max_depth - depth;
+            memcpy(frames + depth, scopes, count * sizeof(ASGCT_CallFrame));
+            depth += count;
+            if (count < num_scopes) {
+                *truncated = true;
+                break;
+            }
+
+            int frame_size = nmethod->frameSize();
+            if (frame_size <= 0) {
+                return -1;
+            }
+            // The frame size includes the return address, with the saved FP right below it
+            sp += frame_size * sizeof(uintptr_t);
+            pc = stripPointer(SafeAccess::load((void**)sp - 1));
+            fp = (uintptr_t)SafeAccess::load((void**)sp - 2);
+        } else if (nmethod->isInterpreter()) {
+            if (fp < sp || fp >= sp + MAX_FRAME_SIZE || fp >= bottom || (fp & (sizeof(uintptr_t) - 1)) != 0) {
+                return -1;
+            }
+            // Until the method entry has pushed all the fixed slots, the frame is not set up
+            if (top && sp > fp + interpreterFrameInitialSp() * sizeof(uintptr_t)) {
+                return -1;
+            }
+            VMMethod* method = (VMMethod*)SafeAccess::load((void**)fp + INTERPRETER_FRAME_METHOD);
+            jmethodID method_id = method != NULL ? method->validatedId() : NULL;
+            if (method_id == NULL) {
+                return -1;
+            }
+            int bci = method->bci(SafeAccess::load((void**)fp + interpreterFrameBcp()));
+            if (bci < 0 && top) {
+                // the slots of a frame that is still being set up, or of a stale one
+                return -1;
+            }
+            frames[depth].bci = FrameType::encode(FRAME_INTERPRETED, bci < 0 ? 0 : bci);
+            frames[depth].method_id = method_id;
+            depth++;
+
+            sp = (uintptr_t)SafeAccess::load((void**)fp + INTERPRETER_FRAME_SENDER_SP);
+            pc = stripPointer(SafeAccess::load((void**)fp + FRAME_PC_SLOT));
+            fp = (uintptr_t)SafeAccess::load((void**)fp);
+        } else {
+            // A stub, an adapter or a blob of the deoptimization: left to AsyncGetCallTrace
+            return -1;
+        }
+
+        // The next frame must be above on the current stack
+        if (sp <= prev_sp || sp >= prev_sp + MAX_FRAME_SIZE || sp >= bottom) {
+            return -1;
+        }
+        if (pc < (const void*)MIN_VALID_PC || pc > (const void*)-MIN_VALID_PC) {
+            return -1;
+        }
+        top = false;
+    }
+
+    return depth > 0 ? depth : -1;
+}
+
+#else
+
+int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated) {
+    return -1;
+}
+
+#endif
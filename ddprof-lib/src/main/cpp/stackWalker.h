@@ -18,6 +18,7 @@
 #define _STACKWALKER_H
 
 #include <stdint.h>
+#include "vmEntry.h"
 
 
 struct StackContext {
@@ -36,6 +37,12 @@ class StackWalker {
   public:
     static int walkFP(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx, bool *truncated);
     static int walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx, bool *truncated);
+
+    // Walks the Java frames of the current thread, from java_ctx if the native walk found them or else from
+    // the signal context or the last Java frame, by reading the interpreter frames and the code blobs directly.
+    // The frames get their types and the inlined ones are decoded from the scopes. Returns -1 for the stacks
+    // it can not walk, e.g. from a stub or through an unknown code blob, so that AsyncGetCallTrace does.
+    static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx, bool *truncated);
 };
 
 #endif // _STACKWALKER_H
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "symbolCache.h"
+#include "codeCache.h"
+#include "dwarf.h"
+#include "log.h"
+
+
+const char* volatile SymbolCache::_dir = NULL;
+
+void SymbolCache::setDirectory(const char* dir) {
+    const char* current = _dir;
+    if (dir == NULL || (current != NULL && strcmp(current, dir) == 0)) {
+        return;
+    }
+    // The previous path is not freed: a symbol worker may still be using it
+    __atomic_store_n(&_dir, strdup(dir), __ATOMIC_RELEASE);
+}
+
+bool SymbolCache::path(char* buf, const char* build_id, SymbolCacheKind kind) {
+    const char* dir = __atomic_load_n(&_dir, __ATOMIC_ACQUIRE);
+    if (dir == NULL || build_id == NULL) {
+        return false;
+    }
+    const char* suffix = kind == SYMBOL_CACHE_SYMBOLS ? "sym" : "dwarf";
+    return (unsigned)snprintf(buf, PATH_MAX, "%s/%s.%s", dir, build_id, suffix) < PATH_MAX;
+}
+
+const char* SymbolCache::map(const char* build_id, SymbolCacheKind kind, u32 entry_size, size_t* size) {
+    char file_name[PATH_MAX];
+    if (!path(file_name, build_id, kind)) {
+        return NULL;
+    }
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SymbolCacheHeader)) {
+        addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    const SymbolCacheHeader* header = (const SymbolCacheHeader*)addr;
+    size_t expected = sizeof(SymbolCacheHeader) + (size_t)header->count * header->entry_size + header->strings_size;
+    if (header->magic != SYMBOL_CACHE_MAGIC || header->version != SYMBOL_CACHE_VERSION || header->kind != kind
+        || header->entry_size != entry_size || expected != (size_t)st.st_size) {
+        Log::debug("Ignoring stale symbol cache file %s", file_name);
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return (const char*)addr;
+}
+
+void SymbolCache::store(const char* build_id, SymbolCacheHeader* header, const void* entries, const char* strings) {
+    char file_name[PATH_MAX];
+    char tmp_name[PATH_MAX];
+    if (!path(file_name, build_id, (SymbolCacheKind)header->kind)
+        || (unsigned)snprintf(tmp_name, PATH_MAX, "%s.%d", file_name, (int)getpid()) >= PATH_MAX) {
+        return;
+    }
+
+    int fd = open(tmp_name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        return;
+    }
+
+    struct {
+        const void* data;
+        size_t size;
+    } parts[] = {
+        {header, sizeof(SymbolCacheHeader)},
+        {entries, (size_t)header->count * header->entry_size},
+        {strings, header->strings_size}
+    };
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < sizeof(parts) / sizeof(parts[0]); i++) {
+        const char* data = (const char*)parts[i].data;
+        size_t size = parts[i].size;
+        while (size > 0) {
+            ssize_t bytes = write(fd, data, size);
+            if (bytes <= 0) {
+                ok = false;
+                break;
+            }
+            data += bytes;
+            size -= bytes;
+        }
+    }
+    close(fd);
+
+    // Another process may have won the race; rename() replaces its file with an identical one
+    if (!ok || rename(tmp_name, file_name) != 0) {
+        unlink(tmp_name);
+    }
+}
+
+bool SymbolCache::loadSymbols(CodeCache* cc, const char* base, const char* build_id) {
+    size_t size;
+    const char* addr = map(build_id, SYMBOL_CACHE_SYMBOLS, sizeof(SymbolCacheEntry), &size);
+    if (addr == NULL) {
+        return false;
+    }
+
+    const SymbolCacheHeader* header = (const SymbolCacheHeader*)addr;
+    const SymbolCacheEntry* entries = (const SymbolCacheEntry*)(addr + sizeof(SymbolCacheHeader));
+    const char* strings = (const char*)(entries + header->count);
+
+    bool valid = header->strings_size > 0 && strings[header->strings_size - 1] == 0;
+    for (u32 i = 0; valid && i < header->count; i++) {
+        valid = entries[i].name < header->strings_size;
+    }
+    if (valid) {
+        cc->reserve((int)header->count);
+        for (u32 i = 0; i < header->count; i++) {
+            cc->add(base + entries[i].offset, entries[i].length, strings + entries[i].name);
+        }
+    }
+
+    munmap((void*)addr, size);
+    return valid;
+}
+
+void SymbolCache::storeSymbols(CodeCache* cc, const char* base, const char* build_id, int first) {
+    int count = cc->count() - first;
+    if (count <= 0 || !enabled()) {
+        return;
+    }
+
+    size_t strings_size = 0;
+    for (int i = first; i < cc->count(); i++) {
+        strings_size += strlen(cc->blob(i)->_name) + 1;
+    }
+    if (strings_size > 0xffffffffU) {
+        return;
+    }
+
+    SymbolCacheEntry* entries = (SymbolCacheEntry*)malloc(count * sizeof(SymbolCacheEntry));
+    char* strings = (char*)malloc(strings_size);
+    if (entries != NULL && strings != NULL) {
+        size_t offset = 0;
+        for (int i = 0; i < count; i++) {
+            CodeBlob* blob = cc->blob(first + i);
+            entries[i].offset = (const char*)blob->_start - base;
+            entries[i].length = (const char*)blob->_end - (const char*)blob->_start;
+            entries[i].name = offset;
+            size_t len = strlen(blob->_name) + 1;
+            memcpy(strings + offset, blob->_name, len);
+            offset += len;
+        }
+
+        SymbolCacheHeader header = {SYMBOL_CACHE_MAGIC, SYMBOL_CACHE_VERSION, SYMBOL_CACHE_SYMBOLS,
+                                    sizeof(SymbolCacheEntry), (u32)count, strings_size};
+        store(build_id, &header, entries, strings);
+    }
+    free(strings);
+    free(entries);
+}
+
+bool SymbolCache::loadDwarf(CodeCache* cc, const char* build_id) {
+    size_t size;
+    const char* addr = map(build_id, SYMBOL_CACHE_DWARF, sizeof(FrameDesc), &size);
+    if (addr == NULL) {
+        return false;
+    }
+
+    const SymbolCacheHeader* header = (const SymbolCacheHeader*)addr;
+    const FrameDesc* entries = (const FrameDesc*)(addr + sizeof(SymbolCacheHeader));
+
+    // the table is searched by location and sizes the page index by its last one, so it must be
+    // sorted and within the library; the file of another build with the same id would not be
+    bool valid = header->count > 0 && header->count <= INT_MAX;
+    size_t text_size = (const char*)cc->maxAddress() - cc->textBase();
+    for (u32 i = 0; valid && i < header->count; i++) {
+        valid = entries[i].loc <= text_size && (i == 0 || entries[i - 1].loc <= entries[i].loc);
+    }
+    FrameDesc* table = NULL;
+    if (valid) {
+        size_t table_size = (size_t)header->count * sizeof(FrameDesc);
+        // setDwarfTable() takes ownership of a malloc'ed table
+        table = (FrameDesc*)malloc(table_size);
+        if (table != NULL) {
+            memcpy(table, entries, table_size);
+            cc->setDwarfTable(table, (int)header->count);
+        }
+    }
+
+    munmap((void*)addr, size);
+    return table != NULL;
+}
+
+void SymbolCache::storeDwarf(const char* build_id, const FrameDesc* table, int count) {
+    if (count <= 0 || !enabled()) {
+        return;
+    }
+    SymbolCacheHeader header = {SYMBOL_CACHE_MAGIC, SYMBOL_CACHE_VERSION, SYMBOL_CACHE_DWARF,
+                                sizeof(FrameDesc), (u32)count, 0};
+    store(build_id, &header, table, NULL);
+}
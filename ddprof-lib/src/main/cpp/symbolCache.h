@@ -0,0 +1,79 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYMBOLCACHE_H
+#define _SYMBOLCACHE_H
+
+#include "arch.h"
+
+class CodeCache;
+struct FrameDesc;
+
+const u32 SYMBOL_CACHE_MAGIC = 0x43534444;  // "DDSC"
+const u16 SYMBOL_CACHE_VERSION = 1;
+// Hex digits of the longest ELF build-id the cache accepts, and its terminator
+const int MAX_BUILD_ID_LENGTH = 129;
+
+enum SymbolCacheKind {
+    SYMBOL_CACHE_SYMBOLS = 1,
+    SYMBOL_CACHE_DWARF = 2
+};
+
+struct SymbolCacheHeader {
+    u32 magic;
+    u16 version;
+    u16 kind;
+    u32 entry_size;
+    u32 count;
+    u64 strings_size;
+};
+
+// Symbol relative to the image base, name is an offset into the string block
+struct SymbolCacheEntry {
+    u64 offset;
+    u32 length;
+    u32 name;
+};
+
+// Directory of symbol tables and DWARF records keyed by ELF build-id, shared by all profiled
+// processes on the host. A file holds a header, the fixed-size entries and, for symbols, the
+// string block; it is mapped read-only and copied into the CodeCache, so a library is parsed
+// only by the first process that loads it. Files are written aside and renamed into place.
+class SymbolCache {
+  private:
+    static const char* volatile _dir;
+
+    static bool path(char* buf, const char* build_id, SymbolCacheKind kind);
+    static const char* map(const char* build_id, SymbolCacheKind kind, u32 entry_size, size_t* size);
+    static void store(const char* build_id, SymbolCacheHeader* header, const void* entries, const char* strings);
+
+  public:
+    static void setDirectory(const char* dir);
+
+    static bool enabled() {
+        return _dir != NULL;
+    }
+
+    // Symbols added to the CodeCache since the index first
+    static bool loadSymbols(CodeCache* cc, const char* base, const char* build_id);
+    static void storeSymbols(CodeCache* cc, const char* base, const char* build_id, int first);
+
+    // Fills the DWARF table of the CodeCache with setDwarfTable()
+    static bool loadDwarf(CodeCache* cc, const char* build_id);
+    static void storeDwarf(const char* build_id, const FrameDesc* table, int count);
+};
+
+#endif // _SYMBOLCACHE_H
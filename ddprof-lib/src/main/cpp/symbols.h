@@ -28,11 +28,23 @@ class Symbols {
 
   public:
     static void parseKernelSymbols(CodeCache* cc);
+    static void loadKernelSymbols(CodeCacheArray* array);
     static void parseLibraries(CodeCacheArray* array, bool kernel_symbols);
+    // Blocks until every library found by parseLibraries() is published
+    static void awaitLibraries();
+    // Blocks until the library containing the address is published, if it is still being parsed
+    static void awaitLibrary(const void* address);
 
+    // Whether kallsyms exposes addresses; the symbols themselves are loaded on requestKernelSymbols()
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
     }
+
+    // Async signal safe; called when a kernel frame has been sampled
+    static void requestKernelSymbols();
+
+    // Async signal safe; lets the background thread parse the DWARF records of requested libraries
+    static void wakeDwarfParser();
 };
 
 #endif // _SYMBOLS_H
@@ -16,7 +16,13 @@
 
 #ifdef __linux__
 
+#include <algorithm>
+#include <deque>
 #include <set>
+#include <vector>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,7 +37,9 @@
 #include "symbols.h"
 #include "dwarf.h"
 #include "log.h"
+#include "os.h"
 #include "safeAccess.h"
+#include "symbolCache.h"
 
 
 class SymbolDesc {
@@ -118,14 +126,19 @@ typedef Elf32_Dyn  ElfDyn;
 
 #if defined(__x86_64__)
 #  define R_GLOB_DAT R_X86_64_GLOB_DAT
+#  define R_JUMP_SLOT R_X86_64_JUMP_SLOT
 #elif defined(__i386__)
 #  define R_GLOB_DAT R_386_GLOB_DAT
+#  define R_JUMP_SLOT R_386_JMP_SLOT
 #elif defined(__arm__) || defined(__thumb__)
 #  define R_GLOB_DAT R_ARM_GLOB_DAT
+#  define R_JUMP_SLOT R_ARM_JUMP_SLOT
 #elif defined(__aarch64__)
 #  define R_GLOB_DAT R_AARCH64_GLOB_DAT
+#  define R_JUMP_SLOT R_AARCH64_JUMP_SLOT
 #elif defined(__PPC64__)
 #  define R_GLOB_DAT R_PPC64_GLOB_DAT
+#  define R_JUMP_SLOT R_PPC64_JMP_SLOT
 #else
 #  error "Compiling on unsupported arch"
 #endif
@@ -181,11 +194,14 @@ class ElfParser {
     void calcVirtualLoadAddress();
     void parseDynamicSection();
     void parseDwarfInfo();
+    const char* findBuildId(int* length);
+    bool formatBuildId(char* buf);
     void loadSymbols(bool use_debug);
     bool loadSymbolsUsingBuildId();
     bool loadSymbolsUsingDebugLink();
     void loadSymbolTable(ElfSection* symtab);
     void addRelocationSymbols(ElfSection* reltab, const char* plt);
+    void addImports(const char* rel, size_t relsz, size_t relent, const char* symtab, size_t syment, const char* strtab);
 
   public:
     static void parseProgramHeaders(CodeCache* cc, const char* base, const char* end);
@@ -290,6 +306,10 @@ void ElfParser::parseDynamicSection() {
         size_t relsz = 0;
         size_t relent = 0;
         size_t relcount = 0;
+        char* jmprel = NULL;
+        char* symtab = NULL;
+        char* strtab = NULL;
+        size_t syment = 0;
 
         const char* dyn_start = at(dynamic);
         const char* dyn_end = dyn_start + dynamic->p_memsz;
@@ -317,6 +337,27 @@ void ElfParser::parseDynamicSection() {
                 case DT_RELCOUNT:
                     relcount = dyn->d_un.d_val;
                     break;
+                case DT_JMPREL:
+                    jmprel = (char*)DYN_PTR(dyn->d_un.d_ptr);
+                    break;
+                case DT_SYMTAB:
+                    symtab = (char*)DYN_PTR(dyn->d_un.d_ptr);
+                    break;
+                case DT_STRTAB:
+                    strtab = (char*)DYN_PTR(dyn->d_un.d_ptr);
+                    break;
+                case DT_SYMENT:
+                    syment = dyn->d_un.d_val;
+                    break;
+            }
+        }
+
+        if (relent != 0 && symtab != NULL && strtab != NULL && syment != 0) {
+            if (jmprel != NULL && pltrelsz != 0) {
+                addImports(jmprel, pltrelsz, relent, symtab, syment, strtab);
+            }
+            if (rel != NULL && relsz != 0) {
+                addImports(rel + relcount * relent, relsz - relcount * relent, relent, symtab, syment, strtab);
             }
         }
 
@@ -350,17 +391,44 @@ void ElfParser::parseDynamicSection() {
     }
 }
 
+// The slots are found by the symbol of the relocation, so that they are known even before lazy binding resolves them
+void ElfParser::addImports(const char* rel, size_t relsz, size_t relent, const char* symtab, size_t syment, const char* strtab) {
+    for (size_t offs = 0; offs + relent <= relsz; offs += relent) {
+        ElfRelocation* r = (ElfRelocation*)(rel + offs);
+        int type = ELF_R_TYPE(r->r_info);
+        if ((type != R_JUMP_SLOT && type != R_GLOB_DAT) || ELF_R_SYM(r->r_info) == 0) {
+            continue;
+        }
+        ElfSymbol* sym = (ElfSymbol*)(symtab + ELF_R_SYM(r->r_info) * syment);
+        if (sym->st_name != 0 && sym->st_shndx == SHN_UNDEF) {
+            _cc->addImport((void**)(_base + r->r_offset), strtab + sym->st_name,
+                           type == R_JUMP_SLOT ? IMPORT_PLT : IMPORT_DATA);
+        }
+    }
+}
+
 void ElfParser::parseDwarfInfo() {
     if (!DWARF_SUPPORTED) return;
 
     ElfProgramHeader* eh_frame_hdr = findProgramHeader(PT_GNU_EH_FRAME);
     if (eh_frame_hdr != NULL) {
-        DwarfParser dwarf(_cc->name(), _base, at(eh_frame_hdr));
-        _cc->setDwarfTable(dwarf.table(), dwarf.count());
+        // Parsed by the DWARF parser thread when a stack walk first needs it
+        _cc->setDwarfSource(at(eh_frame_hdr));
     }
 }
 
 void ElfParser::loadSymbols(bool use_debug) {
+    // Only the library itself, not its debuginfo file, is looked up in the symbol cache
+    char build_id[MAX_BUILD_ID_LENGTH];
+    bool cached = use_debug && SymbolCache::enabled() && formatBuildId(build_id);
+    if (cached) {
+        _cc->setBuildId(build_id);
+        if (SymbolCache::loadSymbols(_cc, _base, build_id)) {
+            return;
+        }
+    }
+    int first = _cc->count();
+
     // Look for debug symbols in the original .so
     ElfSection* section = findSection(SHT_SYMTAB, ".symtab");
     if (section != NULL) {
@@ -393,22 +461,46 @@ loaded:
             addRelocationSymbols(reltab, _base + plt->sh_addr + PLT_HEADER_SIZE);
         }
     }
+
+    if (cached) {
+        SymbolCache::storeSymbols(_cc, _base, build_id, first);
+    }
 }
 
-// Load symbols from /usr/lib/debug/.build-id/ab/cdef1234.debug, where abcdef1234 is Build ID
-bool ElfParser::loadSymbolsUsingBuildId() {
+const char* ElfParser::findBuildId(int* length) {
     ElfSection* section = findSection(SHT_NOTE, ".note.gnu.build-id");
     if (section == NULL || section->sh_size <= 16) {
-        return false;
+        return NULL;
     }
 
     ElfNote* note = (ElfNote*)at(section);
     if (note->n_namesz != 4 || note->n_descsz < 2 || note->n_descsz > 64) {
+        return NULL;
+    }
+
+    *length = note->n_descsz;
+    return (const char*)note + sizeof(*note) + 4;
+}
+
+bool ElfParser::formatBuildId(char* buf) {
+    int build_id_len;
+    const char* build_id = findBuildId(&build_id_len);
+    if (build_id == NULL) {
         return false;
     }
+    for (int i = 0; i < build_id_len; i++) {
+        buf += sprintf(buf, "%02hhx", (unsigned char) build_id[i]);
+    }
+    return true;
+}
 
-    const char* build_id = (const char*)note + sizeof(*note) + 4;
-    int build_id_len = note->n_descsz;
+// Load symbols from /usr/lib/debug/.build-id/ab/cdef1234.debug, where abcdef1234 is Build ID
+bool ElfParser::loadSymbolsUsingBuildId() {
+    int build_id_len;
+    const char* build_id = findBuildId(&build_id_len);
+    if (build_id == NULL) {
+        return false;
+    }
 
     char path[PATH_MAX];
     char* p = path + sprintf(path, "/usr/lib/debug/.build-id/%02hhx/", (unsigned char) build_id[0]);
@@ -467,6 +559,7 @@ void ElfParser::loadSymbolTable(ElfSection* symtab) {
 
     const char* symbols = at(symtab);
     const char* symbols_end = symbols + symtab->sh_size;
+    _cc->reserve((int)(symtab->sh_size / symtab->sh_entsize));
     for (; symbols < symbols_end; symbols += symtab->sh_entsize) {
         ElfSymbol* sym = (ElfSymbol*)symbols;
         if (sym->st_name != 0 && sym->st_value != 0) {
@@ -487,6 +580,7 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 
     const char* relocations = at(reltab);
     const char* relocations_end = relocations + reltab->sh_size;
+    _cc->reserve((int)(reltab->sh_size / reltab->sh_entsize));
     for (; relocations < relocations_end; relocations += reltab->sh_entsize) {
         ElfRelocation* r = (ElfRelocation*)relocations;
         ElfSymbol* sym = (ElfSymbol*)(symbols + ELF_R_SYM(r->r_info) * symtab->sh_entsize);
@@ -511,59 +605,299 @@ bool Symbols::_have_kernel_symbols = false;
 static std::set<const void*> _parsed_libraries;
 static std::set<u64> _parsed_inodes;
 
-void Symbols::parseKernelSymbols(CodeCache* cc) {
-    int fd = open("/proc/kallsyms", O_RDONLY);
+// DWARF records and kernel symbols are parsed on demand by one background thread
+static CodeCacheArray* _dwarf_libraries = NULL;
+static sem_t _parser_requests;
+static bool _parser_started = false;
+
+enum KernelSymbolsState {
+    KERNEL_SYMBOLS_NONE,
+    KERNEL_SYMBOLS_PENDING,
+    KERNEL_SYMBOLS_REQUESTED,
+    KERNEL_SYMBOLS_LOADED
+};
+
+static volatile int _kernel_symbols_state = KERNEL_SYMBOLS_NONE;
+
+
+static void parseRequestedDwarf(CodeCache* cc) {
+    if (SymbolCache::loadDwarf(cc, cc->buildId())) {
+        return;
+    }
+
+    // Keep the library loaded while its eh_frame is being read. The main executable
+    // and the dynamic linker cannot be loaded by name, but they are never unloaded either
+    Dl_info info;
+    void* handle = dlopen(cc->name(), RTLD_LAZY | RTLD_NOLOAD);
+    if (handle == NULL && dladdr(cc->dwarfSource(), &info) == 0) {
+        // The library has been unloaded since the request
+        cc->setDwarfTable(NULL, 0);
+        return;
+    }
+
+    DwarfParser dwarf(cc->name(), cc->textBase(), cc->dwarfSource());
+    SymbolCache::storeDwarf(cc->buildId(), dwarf.table(), dwarf.count());
+    cc->setDwarfTable(dwarf.table(), dwarf.count());
+
+    if (handle != NULL) {
+        dlclose(handle);
+    }
+}
+
+static void* backgroundParserLoop(void* unused) {
+    while (true) {
+        if (sem_wait(&_parser_requests) != 0) {
+            continue;
+        }
+        if (_kernel_symbols_state == KERNEL_SYMBOLS_REQUESTED) {
+            Symbols::loadKernelSymbols(_dwarf_libraries);
+        }
+        CodeCacheArray* array = _dwarf_libraries;
+        int count = array->count();
+        for (int i = 0; i < count; i++) {
+            CodeCache* cc = (*array)[i];
+            if (cc != NULL && cc->dwarfRequested()) {
+                parseRequestedDwarf(cc);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void startBackgroundParser(CodeCacheArray* array) {
+    if (_parser_started) {
+        return;
+    }
+    _dwarf_libraries = array;
+    if (sem_init(&_parser_requests, 0, 0) != 0) {
+        Log::warn("Unable to create symbol parser semaphore: %s", strerror(errno));
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, backgroundParserLoop, NULL) != 0) {
+        Log::warn("Unable to start symbol parser thread");
+        sem_destroy(&_parser_requests);
+        return;
+    }
+    pthread_detach(thread);
+    __atomic_store_n(&_parser_started, true, __ATOMIC_RELEASE);
+}
+
+void Symbols::wakeDwarfParser() {
+    if (__atomic_load_n(&_parser_started, __ATOMIC_ACQUIRE)) {
+        sem_post(&_parser_requests);
+    }
+}
+
+void Symbols::requestKernelSymbols() {
+    if (_kernel_symbols_state == KERNEL_SYMBOLS_PENDING &&
+        __sync_bool_compare_and_swap(&_kernel_symbols_state, KERNEL_SYMBOLS_PENDING, KERNEL_SYMBOLS_REQUESTED)) {
+        wakeDwarfParser();
+    }
+}
+
+// Symbol tables are read from the library files by a small pool of workers,
+// each library is published into its reserved CodeCacheArray slot when done
+const int MAX_SYMBOL_WORKERS = 4;
+
+struct SymbolTask {
+    CodeCacheArray* array;
+    int slot;
+    CodeCache* cc;
+    const char* base;
+};
+
+static WaitableMutex _symbol_lock;
+static std::deque<SymbolTask> _symbol_tasks;
+// the libraries being parsed by the workers right now
+static std::vector<CodeCache*> _symbol_tasks_running;
+static int _symbol_workers = 0;
+
+static void runSymbolTask(const SymbolTask& task) {
+    ElfParser::parseFile(task.cc, task.base, task.cc->name(), true);
+    task.cc->sort();
+    task.array->publish(task.slot, task.cc);
+}
+
+static void* symbolWorkerLoop(void* unused) {
+    MutexLocker ml(_symbol_lock);
+    while (true) {
+        if (_symbol_tasks.empty()) {
+            _symbol_lock.waitUntil(OS::micros() + 1000000);
+            continue;
+        }
+        SymbolTask task = _symbol_tasks.front();
+        _symbol_tasks.pop_front();
+        _symbol_tasks_running.push_back(task.cc);
 
+        _symbol_lock.unlock();
+        runSymbolTask(task);
+        _symbol_lock.lock();
+
+        _symbol_tasks_running.erase(std::find(_symbol_tasks_running.begin(), _symbol_tasks_running.end(), task.cc));
+        _symbol_lock.notifyAll();
+    }
+    return NULL;
+}
+
+static void submitSymbolTask(const SymbolTask& task) {
+    MutexLocker ml(_symbol_lock);
+    if (_symbol_workers < MAX_SYMBOL_WORKERS && _symbol_workers < sysconf(_SC_NPROCESSORS_ONLN)
+        && (int)_symbol_tasks.size() >= _symbol_workers - (int)_symbol_tasks_running.size()) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, symbolWorkerLoop, NULL) == 0) {
+            pthread_detach(thread);
+            _symbol_workers++;
+        }
+    }
+    if (_symbol_workers == 0) {
+        // No worker could be started, load the symbols right away
+        runSymbolTask(task);
+        return;
+    }
+    _symbol_tasks.push_back(task);
+    _symbol_lock.notifyAll();
+}
+
+void Symbols::awaitLibraries() {
+    MutexLocker ml(_symbol_lock);
+    while (!_symbol_tasks.empty() || !_symbol_tasks_running.empty()) {
+        _symbol_lock.waitUntil(OS::micros() + 1000000);
+    }
+}
+
+static bool isLibraryPending(const void* address) {
+    for (std::deque<SymbolTask>::const_iterator it = _symbol_tasks.begin(); it != _symbol_tasks.end(); ++it) {
+        if (it->cc->contains(address)) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < _symbol_tasks_running.size(); i++) {
+        if (_symbol_tasks_running[i]->contains(address)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Symbols::awaitLibrary(const void* address) {
+    MutexLocker ml(_symbol_lock);
+    while (isLibraryPending(address)) {
+        _symbol_lock.waitUntil(OS::micros() + 1000000);
+    }
+}
+
+// Symbols like __LOAD_PHYSICAL_ADDR come first with an absolute value outside of the kernel text
+static bool isKernelTextSymbol(SymbolDesc& symbol) {
+    char type = symbol.type();
+    return (type == 'T' || type == 't' || type == 'W' || type == 'w') && symbol.addr() != NULL &&
+        strncmp(symbol.name(), "__LOAD_PHYSICAL_ADDR", 20) != 0 && strncmp(symbol.name(), "phys_startup", 12) != 0;
+}
+
+// Calls the visitor with every line of /proc/kallsyms, NUL-terminated, until it returns false.
+// The file is read in large blocks and split with memchr instead of a stdio read per line
+template <typename Visitor>
+static bool readKallsyms(Visitor visitor, size_t limit) {
+    int fd = open("/proc/kallsyms", O_RDONLY);
     if (fd == -1) {
         Log::warn("open(\"/proc/kallsyms\"): %s", strerror(errno));
-        return;
+        return false;
     }
 
-    FILE* f = fdopen(fd, "r");
-    if (f == NULL) {
-        Log::warn("fdopen(): %s", strerror(errno));
+    const size_t block_size = 1 << 20;
+    char* buf = (char*)malloc(block_size + 1);
+    if (buf == NULL) {
         close(fd);
-        return;
+        return false;
+    }
+
+    size_t total = 0;
+    size_t pending = 0;
+    bool more = true;
+    ssize_t bytes;
+    while (more && total < limit && (bytes = read(fd, buf + pending, block_size - pending)) > 0) {
+        total += bytes;
+        char* line = buf;
+        char* end = buf + pending + bytes;
+        char* eol;
+        while (more && (eol = (char*)memchr(line, '\n', end - line)) != NULL) {
+            *eol = 0;
+            more = visitor(line, eol - line);
+            line = eol + 1;
+        }
+        pending = end - line;
+        if (pending == block_size) {
+            // a single line does not fit the block; give up on it
+            pending = 0;
+        }
+        memmove(buf, line, pending);
+    }
+
+    free(buf);
+    close(fd);
+    return true;
+}
+
+struct KernelSymbolProbe {
+    bool* found;
+
+    bool operator()(char* line, size_t len) {
+        SymbolDesc symbol(line);
+        *found = isKernelTextSymbol(symbol);
+        return !*found;
     }
+};
 
-    char str[256];
-    while (fgets(str, sizeof(str) - 8, f) != NULL) {
-        size_t len = strlen(str) - 1; // trim the '\n'
+struct KernelSymbolLoader {
+    CodeCache* cc;
+
+    bool operator()(char* line, size_t len) {
+        char str[256];
+        if (len > sizeof(str) - 8) {
+            len = sizeof(str) - 8;
+        }
+        memcpy(str, line, len);
         strcpy(str + len, "_[k]");
 
         SymbolDesc symbol(str);
-        char type = symbol.type();
-        if (type == 'T' || type == 't' || type == 'W' || type == 'w') {
-            const char* addr = symbol.addr();
-            if (addr != NULL) {
-                if (!_have_kernel_symbols) {
-                    if (strncmp(symbol.name(), "__LOAD_PHYSICAL_ADDR", 20) == 0 ||
-                        strncmp(symbol.name(), "phys_startup", 12) == 0) {
-                        continue;
-                    }
-                    _have_kernel_symbols = true;
-                }
-                cc->add(addr, 0, symbol.name());
-            }
+        if (isKernelTextSymbol(symbol)) {
+            cc->add(symbol.addr(), 0, symbol.name());
         }
+        return true;
     }
+};
 
-    fclose(f);
+void Symbols::parseKernelSymbols(CodeCache* cc) {
+    KernelSymbolLoader loader = {cc};
+    readKallsyms(loader, (size_t)-1);
 }
 
-void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
+void Symbols::loadKernelSymbols(CodeCacheArray* array) {
+    CodeCache* cc = new CodeCache("[kernel]");
+    parseKernelSymbols(cc);
+    cc->sort();
+
+    // Slots are handed out under the parse lock
     MutexLocker ml(_parse_lock);
+    array->add(cc);
+    __atomic_store_n(&_kernel_symbols_state, KERNEL_SYMBOLS_LOADED, __ATOMIC_RELEASE);
+}
 
-    if (kernel_symbols && !haveKernelSymbols()) {
-        CodeCache* cc = new CodeCache("[kernel]");
-        parseKernelSymbols(cc);
+// Only the head of kallsyms is read: restricted kernels report all addresses as zero
+static bool probeKernelSymbols() {
+    bool found = false;
+    KernelSymbolProbe probe = {&found};
+    readKallsyms(probe, 1 << 20);
+    return found;
+}
 
-        if (haveKernelSymbols()) {
-            cc->sort();
-            array->add(cc);
-        } else {
-            delete cc;
-        }
+void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
+    MutexLocker ml(_parse_lock);
+    startBackgroundParser(array);
+
+    if (kernel_symbols && _kernel_symbols_state == KERNEL_SYMBOLS_NONE && (_have_kernel_symbols = probeKernelSymbols())) {
+        // Loaded by the background thread once the first kernel frame is sampled
+        __atomic_store_n(&_kernel_symbols_state, KERNEL_SYMBOLS_PENDING, __ATOMIC_RELEASE);
     }
 
     FILE* f = fopen("/proc/self/maps", "r");
@@ -609,6 +943,7 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
 
         const char* map_end = map.end();
         CodeCache* cc = new CodeCache(map.file(), count, map_start, map_end);
+        const char* symbols_base = NULL;
 
         // Do not try to parse pseudofiles like anon_inode:name, /memfd:name
         if (strchr(map.file(), ':') == NULL) {
@@ -619,11 +954,11 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
                     if (inode == last_inode) {
                         // If last_inode is set, image_base is known to be valid and readable
                         ElfParser::parseProgramHeaders(cc, image_base, map_end);
-                        ElfParser::parseFile(cc, image_base, map.file(), true);
+                        symbols_base = image_base;
                     } else if ((unsigned long)map_start > map_offs) {
                         // Unlikely case when image_base has not been found.
                         // Be careful: executable file is not always ELF, e.g. classes.jsa
-                        ElfParser::parseFile(cc, map_start - map_offs, map.file(), true);
+                        symbols_base = map_start - map_offs;
                     }
                 }
             } else if (strcmp(map.file(), "[vdso]") == 0) {
@@ -631,6 +966,13 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
             }
         }
 
+        if (symbols_base != NULL) {
+            // The image in memory has been read above, the file is parsed by a worker
+            SymbolTask task = {array, array->reserve(), cc, symbols_base};
+            submitSymbolTask(task);
+            continue;
+        }
+
         cc->sort();
         array->add(cc);
     }
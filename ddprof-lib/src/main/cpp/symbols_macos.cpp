@@ -118,6 +118,23 @@ static std::set<const void*> _parsed_libraries;
 void Symbols::parseKernelSymbols(CodeCache* cc) {
 }
 
+void Symbols::requestKernelSymbols() {
+}
+
+void Symbols::loadKernelSymbols(CodeCacheArray* array) {
+}
+
+void Symbols::awaitLibraries() {
+    // Libraries are parsed synchronously on macOS
+}
+
+void Symbols::awaitLibrary(const void* address) {
+}
+
+void Symbols::wakeDwarfParser() {
+    // DWARF unwinding is not supported on macOS
+}
+
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
     MutexLocker ml(_parse_lock);
     uint32_t images = _dyld_image_count();
@@ -187,6 +187,42 @@ ProfiledThread* ProfiledThread::current() {
     return key != 0 ? (ProfiledThread*) pthread_getspecific(key) : NULL;
 }
 
+ProfiledThread* ProfiledThread::attachCurrent() {
+    ProfiledThread* current = ProfiledThread::current();
+    if (current == NULL) {
+        initCurrentThread();
+        current = ProfiledThread::current();
+    }
+    return current;
+}
+
+jvmtiFrameInfo* ProfiledThread::captureStackTrace(jvmtiEnv* jvmti, jthread thread, int max_depth, jint* frames_size) {
+    // a JVMTI callback runs in the thread's own context, so it is safe to attach it here
+    ProfiledThread* current = attachCurrent();
+    if (current == NULL) {
+        return NULL;
+    }
+    // start with the depth this thread needed so far and grow only when the stack fills the buffer
+    int depth = current->frameBufferSize();
+    if (depth < MIN_STACK_DEPTH) {
+        depth = MIN_STACK_DEPTH;
+    }
+    if (depth > max_depth) {
+        depth = max_depth;
+    }
+    while (true) {
+        jvmtiFrameInfo* frames = current->frameBuffer(depth);
+        if (frames == NULL ||
+            jvmti->GetStackTrace(thread, 0, depth, frames, frames_size) != JVMTI_ERROR_NONE || *frames_size <= 0) {
+            return NULL;
+        }
+        if (*frames_size < depth || depth >= max_depth) {
+            return frames;
+        }
+        depth = depth * 2 < max_depth ? depth * 2 : max_depth;
+    }
+}
+
 void ProfiledThread::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (signo == SIGUSR1) {
         initCurrentThreadWithBuffer();
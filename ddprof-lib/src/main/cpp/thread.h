@@ -9,6 +9,13 @@
 #include "os.h"
 #include <jvmti.h>
 
+// A thread is considered not to have run since its last wall sample if it consumed less CPU time than this;
+// the remainder of the signal handler and the signal delivery itself fit well below
+const u64 WALL_IDLE_CPU_NANOS = 20000;
+
+// The depth the JVMTI stack traces of a thread start with at least
+const int MIN_STACK_DEPTH = 64;
+
 class ProfiledThread {
   private:
     static pthread_key_t _tls_key;
@@ -30,7 +37,24 @@ class ProfiledThread {
     u64 _wall_epoch;
     u64 _skipped_samples;
     u64 _context_key;
+    // the trace of the last wall sample and the thread CPU time right after it was taken
+    u32 _wall_trace_id;
+    u32 _wall_trace_generation;
+    u64 _wall_cpu_time;
+    // bytes left until the next native allocation sample and the state of its random intervals
+    u64 _malloc_countdown;
+    u64 _random_seed;
+    // nanoseconds of lock contention left until the next lock sample, and when the pending monitor enter started
+    u64 _lock_countdown;
+    u64 _monitor_enter_ticks;
+    bool _in_malloc_hook;
     bool _unwinding_java;
+    // the hash of the stack tail last captured beyond jstackdepth and the truncated samples since
+    u64 _stack_tail;
+    u32 _truncated_samples;
+    // reused by the JVMTI stack traces of the allocation and lock samplers; grows with the deepest stack seen on this thread
+    jvmtiFrameInfo* _frame_buffer;
+    int _frame_buffer_size;
 
     ProfiledThread(int buffer_pos, int tid) :
         _buffer_pos(buffer_pos),
@@ -39,7 +63,23 @@ class ProfiledThread {
         _wall_epoch(0),
         _skipped_samples(0),
         _context_key(0),
-        _unwinding_java(false){};
+        _wall_trace_id(0),
+        _wall_trace_generation(0),
+        _wall_cpu_time(0),
+        _malloc_countdown(0),
+        _random_seed(0),
+        _lock_countdown(0),
+        _monitor_enter_ticks(0),
+        _in_malloc_hook(false),
+        _unwinding_java(false),
+        _stack_tail(0),
+        _truncated_samples(0),
+        _frame_buffer(NULL),
+        _frame_buffer_size(0){};
+
+    ~ProfiledThread() {
+        free(_frame_buffer);
+    }
 
     void releaseFromBuffer();
   public:
@@ -57,6 +97,11 @@ class ProfiledThread {
     
     static ProfiledThread* current();
     static int currentTid();
+    // Attaches the current thread first if needed; only where initCurrentThread is safe, e.g. JVMTI callbacks
+    static ProfiledThread* attachCurrent();
+
+    // The stack of 'thread' from JVMTI in the reusable frame buffer of the current thread, NULL if it cannot be taken
+    static jvmtiFrameInfo* captureStackTrace(jvmtiEnv* jvmti, jthread thread, int max_depth, jint* frames_size);
     bool is_unwinding_Java() {
         return _unwinding_java;
     }
@@ -73,6 +118,83 @@ class ProfiledThread {
     }
     bool noteWallSample(u64 context_key, u64* skipped_samples);
 
+    // Returns the trace of the previous wall sample if the thread has barely run since, 0 otherwise
+    inline u32 idleWallTrace(u64 cpu_time, u32* generation) {
+        if (_wall_trace_id != 0 && cpu_time - _wall_cpu_time < WALL_IDLE_CPU_NANOS) {
+            *generation = _wall_trace_generation;
+            return _wall_trace_id;
+        }
+        return 0;
+    }
+
+    inline void noteWallTrace(u32 call_trace_id, u32 generation, u64 cpu_time) {
+        _wall_trace_id = call_trace_id;
+        _wall_trace_generation = generation;
+        _wall_cpu_time = cpu_time;
+    }
+
+    // 0 until the first interval has been drawn
+    inline u64& mallocCountdown() {
+        return _malloc_countdown;
+    }
+
+    // 0 until the first interval has been drawn
+    inline u64& lockCountdown() {
+        return _lock_countdown;
+    }
+
+    inline u64& monitorEnterTicks() {
+        return _monitor_enter_ticks;
+    }
+
+    // xorshift64, seeded by the thread id; not to be used from signal handlers
+    inline u64 nextRandom() {
+        u64 x = _random_seed != 0 ? _random_seed : ((u64)_tid + 1) * 0x9E3779B97F4A7C15ULL;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return _random_seed = x;
+    }
+
+    // Whether the stack tail is due for a capture, counting one more truncated sample
+    inline bool noteTruncatedSample(u32 capture_interval) {
+        return _truncated_samples++ % capture_interval == 0;
+    }
+
+    inline u64& stackTail() {
+        return _stack_tail;
+    }
+
+    // Native allocations made by the profiler while it records a sample are not sampled
+    inline bool enterMallocHook() {
+        if (_in_malloc_hook) {
+            return false;
+        }
+        _in_malloc_hook = true;
+        return true;
+    }
+
+    inline void exitMallocHook() {
+        _in_malloc_hook = false;
+    }
+
+    // Returns a buffer for at least 'size' frames, NULL if it cannot be grown
+    inline jvmtiFrameInfo* frameBuffer(int size) {
+        if (size > _frame_buffer_size) {
+            jvmtiFrameInfo* buffer = (jvmtiFrameInfo*)realloc(_frame_buffer, size * sizeof(jvmtiFrameInfo));
+            if (buffer == NULL) {
+                return NULL;
+            }
+            _frame_buffer = buffer;
+            _frame_buffer_size = size;
+        }
+        return _frame_buffer;
+    }
+
+    inline int frameBufferSize() {
+        return _frame_buffer_size;
+    }
+
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
 };
 
@@ -33,6 +33,8 @@ ThreadFilter::ThreadFilter() {
     memset(_bitmap, 0, capacity);
     _bitmap[0] = (u64*)OS::safeAlloc(BITMAP_SIZE);
     trackPage();
+    _summary = (u64*)OS::safeAlloc(_max_bitmaps * SUMMARY_WORDS * sizeof(u64));
+    memset(_summary, 0, _max_bitmaps * SUMMARY_WORDS * sizeof(u64));
     _enabled = false;
     _size = 0;
 }
@@ -43,6 +45,7 @@ ThreadFilter::~ThreadFilter() {
             OS::safeFree(_bitmap[i], BITMAP_SIZE);
         }
     }
+    OS::safeFree(_summary, _max_bitmaps * SUMMARY_WORDS * sizeof(u64));
 }
 
 void ThreadFilter::init(const char* filter) {
@@ -79,6 +82,7 @@ void ThreadFilter::clear() {
             memset(_bitmap[i], 0, BITMAP_SIZE);
         }
     }
+    memset(_summary, 0, _max_bitmaps * SUMMARY_WORDS * sizeof(u64));
     _size = 0;
 }
 
@@ -104,6 +108,11 @@ void ThreadFilter::add(int thread_id) {
     if (!(__sync_fetch_and_or(&word(b, thread_id), bit) & bit)) {
         atomicInc(_size);
     }
+    // Published after the word, so collect() never misses a settled add
+    u64 summary_bit = 1ULL << (((u32)thread_id >> 6) & 0x3f);
+    if (!(summaryWord(thread_id) & summary_bit)) {
+        __sync_fetch_and_or(&summaryWord(thread_id), summary_bit);
+    }
 }
 
 void ThreadFilter::remove(int thread_id) {
@@ -113,9 +122,19 @@ void ThreadFilter::remove(int thread_id) {
     }
 
     u64 bit = 1ULL << (thread_id & 0x3f);
-    if (__sync_fetch_and_and(&word(b, thread_id), ~bit) & bit) {
+    u64 prev = __sync_fetch_and_and(&word(b, thread_id), ~bit);
+    if (prev & bit) {
         atomicInc(_size, -1);
     }
+    if (prev == bit) {
+        // The word became empty. Clear its summary bit, then re-check the word:
+        // a concurrent add() may have set a bit in between and relies on the summary
+        u64 summary_bit = 1ULL << (((u32)thread_id >> 6) & 0x3f);
+        __sync_fetch_and_and(&summaryWord(thread_id), ~summary_bit);
+        if (word(b, thread_id) != 0) {
+            __sync_fetch_and_or(&summaryWord(thread_id), summary_bit);
+        }
+    }
 }
 
 void ThreadFilter::collect(std::vector<int>& v) {
@@ -123,11 +142,17 @@ void ThreadFilter::collect(std::vector<int>& v) {
         u64* b = _bitmap[i];
         if (b != NULL) {
             int start_id = i * BITMAP_CAPACITY;
-            for (int j = 0; j < BITMAP_SIZE / sizeof(u64); j++) {
-                u64 word = b[j];
-                while (word != 0) {
-                    v.push_back(start_id + j * 64 + __builtin_ctzl(word));
-                    word &= (word - 1);
+            u64* summary = _summary + i * SUMMARY_WORDS;
+            for (int k = 0; k < SUMMARY_WORDS; k++) {
+                u64 nonempty = summary[k];
+                while (nonempty != 0) {
+                    int j = k * 64 + __builtin_ctzl(nonempty);
+                    u64 word = b[j];
+                    while (word != 0) {
+                        v.push_back(start_id + j * 64 + __builtin_ctzl(word));
+                        word &= (word - 1);
+                    }
+                    nonempty &= (nonempty - 1);
                 }
             }
         }
@@ -24,6 +24,8 @@
 const u32 BITMAP_SIZE = 65536;
 // How many thread IDs one bitmap can hold
 const u32 BITMAP_CAPACITY = BITMAP_SIZE * 8;
+// One summary bit per bitmap word: set whenever the word may be non-zero
+const u32 SUMMARY_WORDS = BITMAP_SIZE / sizeof(u64) / 64;
 
 // ThreadFilter query operations must be lock-free and signal-safe;
 // update operations are mostly lock-free, except rare bitmap allocations
@@ -33,6 +35,8 @@ class ThreadFilter {
     u32 _max_thread_id;
     u32 _max_bitmaps;
     u64** _bitmap;
+    // Per-bitmap summary, lets collect() skip empty words without reading them
+    u64* _summary;
     bool _enabled;
     volatile int _size;
 
@@ -47,6 +51,11 @@ class ThreadFilter {
         return bitmap[((u32)thread_id % BITMAP_CAPACITY) >> 6];
     }
 
+    u64& summaryWord(int thread_id) {
+        u32 word_index = (u32)thread_id >> 6;
+        return _summary[word_index >> 6];
+    }
+
   public:
     ThreadFilter();
     ThreadFilter(ThreadFilter& threadFilter) = delete;
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unordered_set>
+#include "threadRegistry.h"
+
+
+void ThreadRegistry::addLocked(int tid) {
+    if (_index.find(tid) == _index.end()) {
+        _index[tid] = _tids.size();
+        _tids.push_back(tid);
+    }
+}
+
+void ThreadRegistry::removeAt(size_t position) {
+    // move the last tid into the vacated slot to keep the array dense
+    if (position + 1 < _tids.size()) {
+        int last = _tids.back();
+        _tids[position] = last;
+        _index[last] = position;
+    }
+    _tids.pop_back();
+}
+
+void ThreadRegistry::add(int tid) {
+    _lock.lock();
+    addLocked(tid);
+    _lock.unlock();
+}
+
+void ThreadRegistry::remove(int tid) {
+    _lock.lock();
+    std::unordered_map<int, size_t>::iterator it = _index.find(tid);
+    if (it != _index.end()) {
+        size_t position = it->second;
+        _index.erase(it);
+        removeAt(position);
+    }
+    _lock.unlock();
+}
+
+void ThreadRegistry::clear() {
+    _lock.lock();
+    _tids.clear();
+    _index.clear();
+    _lock.unlock();
+}
+
+void ThreadRegistry::reconcile(const std::vector<int>& live) {
+    std::unordered_set<int> live_set(live.begin(), live.end());
+    _lock.lock();
+    for (size_t i = _tids.size(); i-- > 0; ) {
+        int tid = _tids[i];
+        if (live_set.find(tid) == live_set.end()) {
+            _index.erase(tid);
+            removeAt(i);
+        }
+    }
+    for (size_t i = 0; i < live.size(); i++) {
+        addLocked(live[i]);
+    }
+    _lock.unlock();
+}
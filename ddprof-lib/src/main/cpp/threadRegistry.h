@@ -0,0 +1,61 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADREGISTRY_H
+#define _THREADREGISTRY_H
+
+#include <unordered_map>
+#include <vector>
+#include "spinLock.h"
+
+// Dense array of live thread ids with O(1) add and remove, fed by the thread start/end callbacks.
+// Readers iterate the array directly while holding the shared lock.
+class ThreadRegistry {
+  private:
+    SpinLock _lock;
+    std::vector<int> _tids;
+    // position of every registered tid in _tids
+    std::unordered_map<int, size_t> _index;
+
+    void addLocked(int tid);
+    void removeAt(size_t position);
+
+  public:
+    ThreadRegistry() : _lock(), _tids(), _index() {
+    }
+
+    void add(int tid);
+    void remove(int tid);
+    void clear();
+
+    // Replaces the registered threads with the given ones, picking up threads which were never reported
+    void reconcile(const std::vector<int>& live);
+
+    void lockShared() {
+        _lock.lockShared();
+    }
+
+    void unlockShared() {
+        _lock.unlockShared();
+    }
+
+    // must be called with the shared lock held
+    const std::vector<int>& tids() const {
+        return _tids;
+    }
+};
+
+#endif // _THREADREGISTRY_H
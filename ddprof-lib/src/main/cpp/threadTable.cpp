@@ -0,0 +1,170 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "threadTable.h"
+#include "os.h"
+
+
+ThreadTable::ThreadTable() : _lock(), _names(), _name_count(0), _id_count(0), _deferred_lock(), _deferred() {
+    int max_tid = OS::getMaxThreadId(128 * 1024);
+    _max_pages = (max_tid + THREAD_TABLE_PAGE_SIZE - 1) / THREAD_TABLE_PAGE_SIZE;
+    _pages = (Entry**)calloc(_max_pages, sizeof(Entry*));
+}
+
+ThreadTable::~ThreadTable() {
+    for (int i = 0; i < _max_pages; i++) {
+        free(_pages[i]);
+    }
+    free(_pages);
+}
+
+ThreadTable::Entry* ThreadTable::entry(int tid, bool create) {
+    int page_index = tid >> THREAD_TABLE_PAGE_SHIFT;
+    // pid_max may have been raised after the table was created
+    if (tid < 0 || page_index >= _max_pages) {
+        return NULL;
+    }
+    Entry* page = __atomic_load_n(&_pages[page_index], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        // pages are only created under the lock
+        page = (Entry*)calloc(THREAD_TABLE_PAGE_SIZE, sizeof(Entry));
+        __atomic_store_n(&_pages[page_index], page, __ATOMIC_RELEASE);
+    }
+    return &page[tid & THREAD_TABLE_PAGE_MASK];
+}
+
+void ThreadTable::set(int tid, const char* name, jlong java_thread_id) {
+    MutexLocker ml(_lock);
+    Entry* e = entry(tid, true);
+    if (e == NULL) {
+        return;
+    }
+    if (e->name == NULL) {
+        _name_count++;
+    }
+    if (e->java_thread_id == 0 && java_thread_id != 0) {
+        _id_count++;
+    }
+    e->java_thread_id = java_thread_id;
+    __atomic_store_n(&e->name, _names.insert(name).first->c_str(), __ATOMIC_RELEASE);
+}
+
+void ThreadTable::setNames(const int* tids, int count, const char* names, size_t name_len) {
+    MutexLocker ml(_lock);
+    for (int i = 0; i < count; i++) {
+        const char* name = names + i * name_len;
+        Entry* e = name[0] != 0 ? entry(tids[i], true) : NULL;
+        if (e == NULL || e->name != NULL) {
+            // a Java thread reported meanwhile keeps its Java name
+            continue;
+        }
+        _name_count++;
+        __atomic_store_n(&e->name, _names.insert(name).first->c_str(), __ATOMIC_RELEASE);
+    }
+}
+
+const char* ThreadTable::name(int tid, jlong* java_thread_id) {
+    Entry* e = entry(tid, false);
+    if (e == NULL) {
+        return NULL;
+    }
+    const char* name = __atomic_load_n(&e->name, __ATOMIC_ACQUIRE);
+    if (name != NULL) {
+        *java_thread_id = e->java_thread_id;
+    }
+    return name;
+}
+
+void ThreadTable::clearPages() {
+    for (int i = 0; i < _max_pages; i++) {
+        if (_pages[i] != NULL) {
+            memset(_pages[i], 0, THREAD_TABLE_PAGE_SIZE * sizeof(Entry));
+        }
+    }
+}
+
+void ThreadTable::clear() {
+    MutexLocker ml(_lock);
+    clearPages();
+    _names.clear();
+    _name_count = 0;
+    _id_count = 0;
+}
+
+void ThreadTable::retain(const std::set<int>& tids) {
+    MutexLocker ml(_lock);
+    std::unordered_set<std::string> names;
+    std::vector<Entry> retained;
+    retained.reserve(tids.size());
+    for (std::set<int>::const_iterator it = tids.begin(); it != tids.end(); ++it) {
+        Entry* e = entry(*it, false);
+        Entry copy = {NULL, 0};
+        if (e != NULL && e->name != NULL) {
+            copy.name = names.insert(e->name).first->c_str();
+            copy.java_thread_id = e->java_thread_id;
+        }
+        retained.push_back(copy);
+    }
+
+    clearPages();
+    _names.swap(names);
+    _name_count = 0;
+    _id_count = 0;
+
+    int i = 0;
+    for (std::set<int>::const_iterator it = tids.begin(); it != tids.end(); ++it, ++i) {
+        if (retained[i].name != NULL) {
+            *entry(*it, false) = retained[i];
+            _name_count++;
+            if (retained[i].java_thread_id != 0) {
+                _id_count++;
+            }
+        }
+    }
+}
+
+jobject ThreadTable::defer(int tid, jobject thread) {
+    MutexLocker ml(_deferred_lock);
+    jobject& slot = _deferred[tid];
+    jobject previous = slot;
+    slot = thread;
+    return previous;
+}
+
+jobject ThreadTable::undefer(int tid) {
+    MutexLocker ml(_deferred_lock);
+    std::unordered_map<int, jobject>::iterator it = _deferred.find(tid);
+    if (it == _deferred.end()) {
+        return NULL;
+    }
+    jobject thread = it->second;
+    _deferred.erase(it);
+    return thread;
+}
+
+void ThreadTable::undeferAll(std::vector<jobject>& threads) {
+    MutexLocker ml(_deferred_lock);
+    for (std::unordered_map<int, jobject>::const_iterator it = _deferred.begin(); it != _deferred.end(); ++it) {
+        threads.push_back(it->second);
+    }
+    _deferred.clear();
+}
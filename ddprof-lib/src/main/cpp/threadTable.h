@@ -0,0 +1,106 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADTABLE_H
+#define _THREADTABLE_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <jni.h>
+#include "arch.h"
+#include "mutex.h"
+
+const int THREAD_TABLE_PAGE_SIZE = 1024;
+const int THREAD_TABLE_PAGE_MASK = THREAD_TABLE_PAGE_SIZE - 1;
+const int THREAD_TABLE_PAGE_SHIFT = __builtin_popcount(THREAD_TABLE_PAGE_MASK);
+
+// Thread names and Java thread ids indexed by native tid, paged like the Contexts storage.
+// Names are interned; lookups are lock-free, updates are serialized by a short lock.
+class ThreadTable {
+  private:
+    struct Entry {
+        const char* name;
+        jlong java_thread_id;
+    };
+
+    Mutex _lock;
+    int _max_pages;
+    Entry** _pages;
+    std::unordered_set<std::string> _names;
+    volatile int _name_count;
+    volatile int _id_count;
+
+    // Weak references to the Java threads started while profiling, keyed by tid; their names are
+    // only resolved once they show up in a chunk
+    Mutex _deferred_lock;
+    std::unordered_map<int, jobject> _deferred;
+
+    Entry* entry(int tid, bool create);
+    void clearPages();
+
+  public:
+    ThreadTable();
+    ~ThreadTable();
+
+    void set(int tid, const char* name, jlong java_thread_id);
+    // Publishes the names of native threads, name_len bytes each, under a single lock; empty names are skipped
+    void setNames(const int* tids, int count, const char* names, size_t name_len);
+
+    // Returns the name of the thread or NULL if unknown; must not race with clear or retain
+    const char* name(int tid, jlong* java_thread_id);
+
+    bool contains(int tid) {
+        Entry* e = entry(tid, false);
+        return e != NULL && __atomic_load_n(&e->name, __ATOMIC_ACQUIRE) != NULL;
+    }
+
+    int nameCount() const {
+        return _name_count;
+    }
+
+    int idCount() const {
+        return _id_count;
+    }
+
+    void clear();
+    // Forgets all the threads except for the given ones
+    void retain(const std::set<int>& tids);
+
+    // The references returned by defer, undefer and undeferAll are left for the caller to delete:
+    // defer returns the one it replaces, if the tid has been reused
+    jobject defer(int tid, jobject thread);
+    jobject undefer(int tid);
+    void undeferAll(std::vector<jobject>& threads);
+
+    // deferred() must be called between these two, which keep the references from being deleted
+    void lockDeferred() {
+        _deferred_lock.lock();
+    }
+
+    void unlockDeferred() {
+        _deferred_lock.unlock();
+    }
+
+    jobject deferred(int tid) {
+        std::unordered_map<int, jobject>::const_iterator it = _deferred.find(tid);
+        return it != _deferred.end() ? it->second : NULL;
+    }
+};
+
+#endif // _THREADTABLE_H
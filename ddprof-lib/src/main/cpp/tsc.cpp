@@ -15,7 +15,9 @@
  */
 
 #include <jvmti.h>
+#include <time.h>
 #include "jniHelper.h"
+#include "log.h"
 #include "tsc.h"
 #include "vmEntry.h"
 
@@ -25,6 +27,13 @@ bool TSC::_enabled = false;
 u64 TSC::_offset = 0;
 u64 TSC::_frequency = 1000000000;
 
+#ifdef __linux__
+// OS::nanotime() is CLOCK_MONOTONIC, which is what HotSpot uses for System.nanoTime()
+TSCPage TSC::_page = {TICKS_MONOTONIC_NANOS, 1000000000};
+#else
+TSCPage TSC::_page = {TICKS_NATIVE, 1000000000};
+#endif
+
 
 void TSC::initialize() {
     JNIEnv* env = VM::jni();
@@ -41,15 +50,73 @@ void TSC::initialize() {
         if (jniExceptionCheck(env, true)) {
             frequency = 0;
         }
-        if (frequency > 1000000000) {
+        if (frequency > 1000000000 && counter_frequency() == 0) {
             // Default 1GHz frequency might mean that rdtsc is not available
             u64 jvm_ticks = env->CallStaticLongMethod(cls, counterTime);
             _offset = rdtsc() - jvm_ticks;
             _frequency = frequency;
             _enabled = true;
+            _page.frequency = frequency;
+            __atomic_store_n(&_page.source, (u64)TICKS_NATIVE, __ATOMIC_RELEASE);
         }
     }
 
     env->ExceptionClear();
+    if (!_enabled) {
+        initializeCounter();
+    }
     _initialized = true;
 }
+
+// Reads the counter along with the monotonic clock at the same point in time: a read that the thread
+// got preempted in between is retried
+u64 TSC::readCounter(u64* nanos) {
+    u64 ticks = 0;
+    u64 best = (u64)-1;
+    for (int attempt = 0; attempt < COUNTER_READ_ATTEMPTS; attempt++) {
+        u64 before = OS::nanotime();
+        u64 value = rdtsc();
+        u64 after = OS::nanotime();
+        if (after - before < best) {
+            best = after - before;
+            ticks = value;
+            *nanos = before + (after - before) / 2;
+        }
+    }
+    return ticks;
+}
+
+// Enables the architectural counter, whose frequency is known without the JVM; JFR on such platforms
+// counts nanoseconds, so the ticks are not aligned to the JVM ones and Java has to take them natively
+bool TSC::initializeCounter() {
+    u64 frequency = counter_frequency();
+    if (frequency < 1000000) {
+        return false;
+    }
+
+    // The counter must run at the reported frequency, which early firmware sometimes got wrong,
+    // and must never go backwards
+    struct timespec interval = {0, COUNTER_CALIBRATION_MILLIS * 1000 * 1000};
+    u64 start_nanos;
+    u64 start_ticks = readCounter(&start_nanos);
+    nanosleep(&interval, NULL);
+    u64 end_nanos;
+    u64 end_ticks = readCounter(&end_nanos);
+    u64 nanos = end_nanos - start_nanos;
+    if (end_ticks <= start_ticks || end_nanos <= start_nanos) {
+        return false;
+    }
+    u64 ticks = end_ticks - start_ticks;
+    double measured = (double)ticks * 1e9 / nanos;
+    if (measured < frequency * 0.99 || measured > frequency * 1.01) {
+        Log::debug("Counter frequency %llu does not match the measured %.0f", frequency, measured);
+        return false;
+    }
+
+    _offset = 0;
+    _frequency = frequency;
+    _enabled = true;
+    _page.frequency = frequency;
+    __atomic_store_n(&_page.source, (u64)TICKS_NATIVE, __ATOMIC_RELEASE);
+    return true;
+}
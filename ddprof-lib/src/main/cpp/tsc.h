@@ -30,6 +30,9 @@ static inline u64 rdtsc() {
     return ((u64)hi << 32) | lo;
 }
 
+// The TSC frequency is known only to the JVM
+#define counter_frequency() 0
+
 #elif defined(__i386__)
 
 #define TSC_SUPPORTED true
@@ -40,20 +43,63 @@ static inline u64 rdtsc() {
     return result;
 }
 
+#define counter_frequency() 0
+
+#elif defined(__aarch64__)
+
+#define TSC_SUPPORTED true
+
+// The virtual count of the generic timer, readable from user space on Linux.
+// Without the isb, the read may be speculated ahead of the preceding instructions.
+static inline u64 rdtsc() {
+    u64 value;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r" (value) : : "memory");
+    return value;
+}
+
+static inline u64 counter_frequency() {
+    u64 value;
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (value));
+    return value;
+}
+
 #else
 
 #define TSC_SUPPORTED false
 #define rdtsc() 0
+#define counter_frequency() 0
 
 #endif
 
 
+// How Java can obtain ticks, must be kept in sync with JavaProfiler.java
+enum TicksSource {
+    // only the native library can read the ticks
+    TICKS_NATIVE = 0,
+    // ticks are CLOCK_MONOTONIC nanoseconds, the same as System.nanoTime()
+    TICKS_MONOTONIC_NANOS = 1
+};
+
+// Published to Java as a direct buffer so that ticks can be taken without a native call
+struct TSCPage {
+    volatile u64 source;
+    volatile u64 frequency;
+};
+
+// How long the architectural counter is checked against the monotonic clock
+const int COUNTER_CALIBRATION_MILLIS = 20;
+const int COUNTER_READ_ATTEMPTS = 5;
+
 class TSC {
   private:
     static bool _initialized;
     static bool _enabled;
     static u64 _offset;
     static u64 _frequency;
+    static TSCPage _page;
+
+    static u64 readCounter(u64* nanos);
+    static bool initializeCounter();
 
   public:
     static void initialize();
@@ -74,6 +120,10 @@ class TSC {
         return _frequency;
     }
 
+    static TSCPage* page() {
+        return &_page;
+    }
+
     static u64 ticks_to_millis(u64 ticks) {
         return TSC_SUPPORTED ? 1000 * ticks / _frequency : ticks / 1000 / 1000;
     }
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "virtualThreads.h"
+#include "counters.h"
+#include "os.h"
+#include "profiler.h"
+#include "threadFilter.h"
+#include "vmEntry.h"
+
+bool VirtualThreads::_available = false;
+bool VirtualThreads::_enabled = false;
+jint VirtualThreads::_mount_event = -1;
+jint VirtualThreads::_unmount_event = -1;
+
+// can_support_virtual_threads is declared right after can_generate_sampled_object_alloc_events,
+// the last capability known to the JDK 11 headers the agent is built with; its bit is located from that one
+static bool virtualThreadCapability(u32* word, u32* mask) {
+    jvmtiCapabilities probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.can_generate_sampled_object_alloc_events = 1;
+    const u32* words = (const u32*)&probe;
+    for (u32 i = 0; i < sizeof(probe) / sizeof(u32); i++) {
+        if (words[i] != 0) {
+            int bit = __builtin_ctz(words[i]) + 1;
+            *word = i + bit / 32;
+            *mask = 1U << (bit % 32);
+            return *word < sizeof(probe) / sizeof(u32);
+        }
+    }
+    return false;
+}
+
+void VirtualThreads::addCapability(const jvmtiCapabilities* potential, jvmtiCapabilities* capabilities) {
+    u32 word;
+    u32 mask;
+    if (VM::java_version() < 21 || !virtualThreadCapability(&word, &mask)) {
+        return;
+    }
+    if (((const u32*)potential)[word] & mask) {
+        ((u32*)capabilities)[word] |= mask;
+    }
+}
+
+void VirtualThreads::initialize(jvmtiEnv* jvmti) {
+    jint count;
+    jvmtiExtensionEventInfo* events;
+    if (VM::java_version() < 21 || jvmti->GetExtensionEvents(&count, &events) != 0) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(events[i].id, "com.sun.hotspot.events.VirtualThreadMount") == 0) {
+            _mount_event = events[i].extension_event_index;
+        } else if (strcmp(events[i].id, "com.sun.hotspot.events.VirtualThreadUnmount") == 0) {
+            _unmount_event = events[i].extension_event_index;
+        }
+    }
+    jvmti->Deallocate((unsigned char*)events);
+
+    jvmtiCapabilities capabilities;
+    u32 word;
+    u32 mask;
+    _available = _mount_event >= 0 && _unmount_event >= 0 && virtualThreadCapability(&word, &mask) &&
+                 jvmti->GetCapabilities(&capabilities) == 0 && (((u32*)&capabilities)[word] & mask) != 0;
+}
+
+void VirtualThreads::enable(bool enabled) {
+    enabled = enabled && _available;
+    if (_enabled == enabled) {
+        return;
+    }
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetExtensionEventCallback(_mount_event, enabled ? (jvmtiExtensionEvent)VirtualThreadMount : NULL);
+    jvmti->SetExtensionEventCallback(_unmount_event, enabled ? (jvmtiExtensionEvent)VirtualThreadUnmount : NULL);
+    _enabled = enabled;
+}
+
+void JNICALL VirtualThreads::VirtualThreadMount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread) {
+    void* data = NULL;
+    if (jvmti->GetThreadLocalStorage(vthread, &data) != 0 || data == NULL) {
+        return;
+    }
+    jvmti->SetThreadLocalStorage(vthread, NULL);
+
+    VirtualThreadState* state = (VirtualThreadState*)data;
+    int tid = OS::threadId();
+    Contexts::set(tid, state->context);
+    if (state->filtered) {
+        Profiler::instance()->threadFilter()->add(tid);
+    }
+    free(state);
+}
+
+void JNICALL VirtualThreads::VirtualThreadUnmount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread) {
+    int tid = OS::threadId();
+    // the carrier is the only writer of its slot, so the copy can not be torn
+    Context context = Contexts::get(tid);
+    ThreadFilter* filter = Profiler::instance()->threadFilter();
+    bool filtered = filter->enabled() && filter->accept(tid);
+    if (!filtered && Contexts::isEmpty(context)) {
+        return;
+    }
+
+    // a state is left over if the previous mount happened while the events were disabled
+    void* data = NULL;
+    jvmti->GetThreadLocalStorage(vthread, &data);
+    VirtualThreadState* state = data != NULL ? (VirtualThreadState*)data
+                                             : (VirtualThreadState*)malloc(sizeof(VirtualThreadState));
+    if (state == NULL) {
+        return;
+    }
+    state->context = context;
+    state->filtered = filtered;
+    if (state != data && jvmti->SetThreadLocalStorage(vthread, state) != 0) {
+        free(state);
+        return;
+    }
+    Counters::increment(VIRTUAL_THREAD_UNMOUNT_SAVES);
+    Contexts::set(tid, Contexts::empty());
+    if (filtered) {
+        filter->remove(tid);
+    }
+}
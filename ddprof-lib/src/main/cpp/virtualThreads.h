@@ -0,0 +1,58 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VIRTUALTHREADS_H
+#define _VIRTUALTHREADS_H
+
+#include <jvmti.h>
+#include "arch.h"
+#include "context.h"
+
+// What a virtual thread leaves in the context slot and the thread filter of its carrier
+typedef struct VirtualThreadState {
+    Context context;
+    bool filtered;
+} VirtualThreadState;
+
+// The context slots, the thread filter and the wall clock sampler stay keyed by the OS thread ids
+// of the carriers. When a virtual thread unmounts, its context and filter state are moved from the
+// carrier into the JVMTI thread local storage of the virtual thread, and moved back into whichever
+// carrier it mounts next, so that the samples of a carrier are attributed to the virtual thread it runs.
+// Nothing is kept for the virtual threads which unmount without any context.
+class VirtualThreads {
+  private:
+    static bool _available;
+    static bool _enabled;
+    static jint _mount_event;
+    static jint _unmount_event;
+
+    static void JNICALL VirtualThreadMount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread);
+    static void JNICALL VirtualThreadUnmount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread);
+
+  public:
+    // Requests can_support_virtual_threads (JDK 21+) if the JVM has it
+    static void addCapability(const jvmtiCapabilities* potential, jvmtiCapabilities* capabilities);
+    // Looks up the mount and unmount extension events once the capabilities have been added
+    static void initialize(jvmtiEnv* jvmti);
+
+    static bool available() {
+        return _available;
+    }
+
+    static void enable(bool enabled);
+};
+
+#endif // _VIRTUALTHREADS_H
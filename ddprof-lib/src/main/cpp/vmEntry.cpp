@@ -24,9 +24,12 @@
 #include "context.h"
 #include "j9Ext.h"
 #include "j9ObjectSampler.h"
+#include "lockTracer.h"
 #include "os.h"
 #include "profiler.h"
 #include "log.h"
+#include "symbolCache.h"
+#include "virtualThreads.h"
 #include "vmStructs.h"
 #include "jniHelper.h"
 
@@ -130,6 +133,12 @@ bool VM::init(JavaVM* vm, bool attach) {
 
     Profiler* profiler = Profiler::instance();
     profiler->updateSymbols(false);
+    if (_hotspot && _asyncGetCallTrace != NULL) {
+        // VMStructs only need libjvm, the other libraries are awaited by the profiler when it starts
+        profiler->awaitSymbols((const void*)_asyncGetCallTrace);
+    } else {
+        profiler->awaitSymbols();
+    }
 
     _openj9 = !_hotspot && J9Ext::initialize(_jvmti, profiler->resolveSymbol("j9thread_self*"));
 
@@ -256,8 +265,10 @@ bool VM::init(JavaVM* vm, bool attach) {
     capabilities.can_generate_compiled_method_load_events = 1;
     capabilities.can_generate_monitor_events = 1;
     capabilities.can_tag_objects = 1;
-    
+    VirtualThreads::addCapability(&potential_capabilities, &capabilities);
+
     _jvmti->AddCapabilities(&capabilities);
+    VirtualThreads::initialize(_jvmti);
 
     jvmtiEventCallbacks callbacks = {0};
     callbacks.VMInit = VMInit;
@@ -270,8 +281,11 @@ bool VM::init(JavaVM* vm, bool attach) {
     callbacks.ThreadEnd = Profiler::ThreadEnd;
     // callbacks.VMObjectAlloc = J9ObjectSampler::VMObjectAlloc;
     callbacks.SampledObjectAlloc = ObjectSampler::SampledObjectAlloc;
-    callbacks.GarbageCollectionFinish = LivenessTracker::GarbageCollectionFinish;
+    callbacks.GarbageCollectionStart = VMTimeline::GarbageCollectionStart;
+    callbacks.GarbageCollectionFinish = Profiler::GarbageCollectionFinish;
     callbacks.NativeMethodBind = VMStructs::NativeMethodBind;
+    callbacks.MonitorContendedEnter = LockTracer::MonitorContendedEnter;
+    callbacks.MonitorContendedEntered = LockTracer::MonitorContendedEntered;
     _jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
 
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
@@ -446,6 +460,7 @@ Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     Error error = _agent_args.parse(options);
 
     Log::open(_agent_args);
+    SymbolCache::setDirectory(_agent_args._symbol_cache);
 
     if (error) {
         Log::error("%s", error.message());
@@ -466,6 +481,7 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
     Error error = args.parse(options);
 
     Log::open(args);
+    SymbolCache::setDirectory(args._symbol_cache);
 
     if (error) {
         Log::error("%s", error.message());
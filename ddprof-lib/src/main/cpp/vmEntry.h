@@ -42,8 +42,20 @@ enum ASGCT_CallFrameType {
     BCI_PARK                = -16,  // class name of the park() blocker
     BCI_THREAD_ID           = -17,  // method_id designates a thread
     BCI_ERROR               = -18,  // method_id is an error string
+    BCI_NATIVE_PC           = -19,  // unresolved native PC tagged with its library index
+    BCI_NATIVE_MALLOC       = -20,  // sampled native allocation
+    BCI_NATIVE_LIVE         = -21,  // sampled native allocation which has not been freed yet
+    BCI_ALLOC_SUMMARY       = -22,  // aggregated allocation samples of one call trace and class
+    BCI_LIVENESS_SUMMARY    = -23,  // aggregated live objects of one call trace, class and age
+    BCI_STACK_TAIL          = -24,  // method_id is the hash of the stack tail to stitch, see StackTails
+    BCI_COMPILED_PC         = -25,  // method_id is the nmethod and PC the Java frames below were sampled at
 };
 
+// A BCI_COMPILED_PC frame keeps the entry of the nmethod in the low bits of method_id and the offset of the PC
+// from the start of its code above; the call trace hash leaves the offset out, so that the samples
+// of one nmethod share their trace rather than make one per PC
+const int COMPILED_PC_SHIFT = 48;
+
 // See hotspot/src/share/vm/prims/forte.cpp
 enum ASGCT_Failure {
     ticks_no_Java_frame         =  0,
@@ -123,6 +135,13 @@ class VM {
 
     static void restartProfiler();
 
+    // Installs the given environments without inspecting the JVM; for the capture replay in src/bench only
+    static void initReplay(JavaVM* vm, jvmtiEnv* jvmti) {
+        _vm = vm;
+        _jvmti = jvmti;
+        _hotspot = true;
+    }
+
     static jvmtiEnv* jvmti() {
         return _jvmti;
     }
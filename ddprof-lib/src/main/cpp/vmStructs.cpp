@@ -30,6 +30,8 @@ CodeCache VMStructs::_unsafe_to_walk("unwalkable code");
 
 bool VMStructs::_has_class_names = false;
 bool VMStructs::_has_method_structs = false;
+bool VMStructs::_has_scope_data = false;
+bool VMStructs::_has_frame_structs = false;
 bool VMStructs::_has_class_loader_data = false;
 bool VMStructs::_has_native_thread_id = false;
 bool VMStructs::_has_perm_gen = false;
@@ -49,6 +51,7 @@ int VMStructs::_osthread_id_offset = -1;
 int VMStructs::_osthread_state_offset = -1;
 int VMStructs::_anchor_sp_offset = -1;
 int VMStructs::_anchor_pc_offset = -1;
+int VMStructs::_anchor_fp_offset = -1;
 int VMStructs::_frame_size_offset = -1;
 int VMStructs::_frame_complete_offset = -1;
 int VMStructs::_nmethod_name_offset = -1;
@@ -56,10 +59,21 @@ int VMStructs::_nmethod_method_offset = -1;
 int VMStructs::_nmethod_entry_offset = -1;
 int VMStructs::_nmethod_state_offset = -1;
 int VMStructs::_nmethod_level_offset = -1;
+int VMStructs::_nmethod_metadata_offset = -1;
+int VMStructs::_nmethod_scopes_data_offset = -1;
+int VMStructs::_nmethod_scopes_data_begin_offset = -1;
+int VMStructs::_nmethod_scopes_pcs_offset = -1;
+int VMStructs::_nmethod_dependencies_offset = -1;
+int VMStructs::_code_offset = -1;
+int VMStructs::_code_begin_offset = -1;
+int VMStructs::_pc_desc_size = -1;
+int VMStructs::_pc_desc_pc_offset = -1;
+int VMStructs::_pc_desc_scope_offset = -1;
 int VMStructs::_method_constmethod_offset = -1;
 int VMStructs::_method_code_offset = -1;
 int VMStructs::_constmethod_constants_offset = -1;
 int VMStructs::_constmethod_idnum_offset = -1;
+int VMStructs::_constmethod_size = -1;
 int VMStructs::_pool_holder_offset = -1;
 int VMStructs::_array_data_offset = -1;
 int VMStructs::_code_heap_memory_offset = -1;
@@ -99,6 +113,13 @@ VMStructs::FindFlagFunc VMStructs::_find_flag_func = NULL;
 VMStructs::IsValidMethodFunc VMStructs::_is_valid_method_func = NULL;
 
 void** VMStructs::_collected_heap_addr = NULL;
+volatile int* VMStructs::_safepoint_state_addr = NULL;
+
+// Whether the type string of a struct entry is a plain int
+static bool isIntField(uintptr_t type_string_addr) {
+    const char* type_string = *(const char**)type_string_addr;
+    return type_string != NULL && strcmp(type_string, "int") == 0;
+}
 
 uintptr_t VMStructs::readSymbol(const char* symbol_name) {
     const void* symbol = _libjvm->findSymbol(symbol_name);
@@ -135,6 +156,7 @@ void VMStructs::initOffsets() {
     uintptr_t field_offset = readSymbol("gHotSpotVMStructEntryFieldNameOffset");
     uintptr_t offset_offset = readSymbol("gHotSpotVMStructEntryOffsetOffset");
     uintptr_t address_offset = readSymbol("gHotSpotVMStructEntryAddressOffset");
+    uintptr_t type_string_offset = readSymbol("gHotSpotVMStructEntryTypeStringOffset");
 
     if (entry == 0 || stride == 0) {
         return;
@@ -170,6 +192,19 @@ void VMStructs::initOffsets() {
                 _nmethod_state_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_comp_level") == 0) {
                 _nmethod_level_offset = *(int*)(entry + offset_offset);
+            } else if (isIntField(entry + type_string_offset)) {
+                // the scope data layout is only known for the int offsets of JDK 8 to 22
+                if (strcmp(field, "_metadata_offset") == 0) {
+                    _nmethod_metadata_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_scopes_data_offset") == 0) {
+                    _nmethod_scopes_data_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_scopes_pcs_offset") == 0) {
+                    _nmethod_scopes_pcs_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_dependencies_offset") == 0) {
+                    _nmethod_dependencies_offset = *(int*)(entry + offset_offset);
+                }
+            } else if (strcmp(field, "_scopes_data_begin") == 0) {
+                _nmethod_scopes_data_begin_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "Method") == 0) {
             if (strcmp(field, "_constMethod") == 0) {
@@ -222,6 +257,8 @@ void VMStructs::initOffsets() {
                 _anchor_sp_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_last_Java_pc") == 0) {
                 _anchor_pc_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_last_Java_fp") == 0) {
+                _anchor_fp_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "CodeBlob") == 0) {
             if (strcmp(field, "_frame_size") == 0) {
@@ -230,6 +267,16 @@ void VMStructs::initOffsets() {
                 _frame_complete_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_name") == 0) {
                 _nmethod_name_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_begin") == 0) {
+                _code_begin_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_offset") == 0 && isIntField(entry + type_string_offset)) {
+                _code_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "PcDesc") == 0) {
+            if (strcmp(field, "_pc_offset") == 0) {
+                _pc_desc_pc_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_scope_decode_offset") == 0) {
+                _pc_desc_scope_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "CodeCache") == 0) {
             if (strcmp(field, "_heap") == 0) {
@@ -279,6 +326,10 @@ void VMStructs::initOffsets() {
             if (strcmp(field, "_collectedHeap") == 0) {
                 _collected_heap_addr = *(void***)(entry + address_offset);
             }
+        } else if (strcmp(type, "SafepointSynchronize") == 0) {
+            if (strcmp(field, "_state") == 0) {
+                _safepoint_state_addr = *(volatile int**)(entry + address_offset);
+            }
         }
     }
 
@@ -299,7 +350,10 @@ void VMStructs::initOffsets() {
 
         if (strcmp(type, "JVMFlag") == 0 || strcmp(type, "Flag") == 0) {
             _flag_size = *(int*)(entry + size_offset);
-            break;
+        } else if (strcmp(type, "PcDesc") == 0) {
+            _pc_desc_size = *(int*)(entry + size_offset);
+        } else if (strcmp(type, "ConstMethod") == 0) {
+            _constmethod_size = *(int*)(entry + size_offset);
         }
     }
 }
@@ -324,6 +378,18 @@ void VMStructs::resolveOffsets() {
             && _constmethod_idnum_offset >= 0
             && _pool_holder_offset >= 0;
 
+    // The layout of the scope data is only known from JDK 8 to 22; JDK 23 moved it around
+    _has_scope_data = _has_method_structs
+            && VM::isHotspot() && VM::java_version() >= 8 && VM::java_version() <= 22
+            && _nmethod_metadata_offset >= 0
+            && (_nmethod_scopes_data_begin_offset >= 0 || _nmethod_scopes_data_offset >= 0)
+            && _nmethod_scopes_pcs_offset >= 0
+            && _nmethod_dependencies_offset >= 0
+            && (_code_begin_offset >= 0 || _code_offset >= 0)
+            && _pc_desc_size > 0
+            && _pc_desc_pc_offset >= 0
+            && _pc_desc_scope_offset >= 0;
+
     _has_class_loader_data = _class_loader_data_offset >= 0
         && _class_loader_data_next_offset == sizeof(uintptr_t) * 8 + 8
         && _methods_offset >= 0
@@ -353,6 +419,20 @@ void VMStructs::resolveOffsets() {
         _code_heap_segment_shift < 0 || _code_heap_segment_shift > 16) {
         memset(_code_heap, 0, sizeof(_code_heap));
     }
+
+    // The compiled frames are unwound by their size and decoded from their scopes; the layout of the
+    // interpreter frames is only known on x86_64 and aarch64
+#if defined(__x86_64__) || defined(__aarch64__)
+    _has_frame_structs = _has_scope_data
+            && _code_heap[0] != NULL
+            && _frame_size_offset >= 0
+            && _frame_complete_offset >= 0
+            && _nmethod_name_offset >= 0
+            && _thread_anchor_offset >= 0
+            && _anchor_sp_offset >= 0
+            && _anchor_pc_offset >= 0
+            && _constmethod_size > 0;
+#endif
 }
 
 void VMStructs::initUnsafeFunctions() {
@@ -524,6 +604,41 @@ jmethodID VMMethod::id() {
     return NULL;
 }
 
+jmethodID VMMethod::validatedId() {
+    const char* const_method = (const char*) SafeAccess::load((void**) at(_method_constmethod_offset));
+    if (const_method == NULL) {
+        return NULL;
+    }
+    const char* cpool = (const char*) SafeAccess::load((void**) (const_method + _constmethod_constants_offset));
+    if (cpool == NULL) {
+        return NULL;
+    }
+    const char* holder = (const char*) SafeAccess::load((void**) (cpool + _pool_holder_offset));
+    if (holder == NULL) {
+        return NULL;
+    }
+    jmethodID* ids = (jmethodID*) SafeAccess::load((void**) (holder + _jmethod_ids_offset));
+    if (ids == NULL) {
+        return NULL;
+    }
+    size_t num = (size_t) SafeAccess::load((void**) (const_method + _constmethod_idnum_offset)) & 0xffff;
+    if (num >= (size_t) SafeAccess::load((void**) ids)) {
+        return NULL;
+    }
+    jmethodID id = (jmethodID) SafeAccess::load((void**) &ids[num + 1]);
+    return id != NULL && SafeAccess::load((void**) id) == this ? id : NULL;
+}
+
+int VMMethod::bci(const void* bcp) {
+    const char* const_method = (const char*) SafeAccess::load((void**) at(_method_constmethod_offset));
+    if (const_method == NULL) {
+        return -1;
+    }
+    // the bytecodes follow the ConstMethod; a method has no more than 64K of them
+    intptr_t bci = (const char*) bcp - (const_method + _constmethod_size);
+    return bci >= 0 && bci < 65536 ? (int) bci : -1;
+}
+
 /**
  * jmethodIDs are unreliable, even if the profiler has created strong global JNI references to the classes
  * containing methods with those jmethodIDs. This is affecting particularly hard the 'record-on-shutdown' feature
@@ -592,6 +707,132 @@ bool VMMethod::check_jmethodID_J9(jmethodID id) {
     return id != NULL && *((void**)id) != NULL;
 }
 
+void NMethod::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames) {
+    if (isNMethod() && isAlive()) {
+        VMMethod* vm_method = method();
+        if (vm_method == NULL) {
+            return;
+        }
+
+        jmethodID current_method_id = vm_method->id();
+        if (current_method_id == NULL) {
+            return;
+        }
+
+        // Mark current_method as COMPILED and frames above current_method as INLINED
+        for (int i = 0; i < num_frames; i++) {
+            if (frames[i].method_id == NULL || frames[i].bci <= BCI_NATIVE_FRAME) {
+                break;
+            }
+            if (frames[i].method_id == current_method_id) {
+                int comp_level = level();
+                frames[i].bci = FrameType::encode(comp_level >= 1 && comp_level <= 3 ? FRAME_C1_COMPILED : FRAME_JIT_COMPILED, frames[i].bci);
+                for (int j = 0; j < i; j++) {
+                    frames[j].bci = FrameType::encode(FRAME_INLINED, frames[j].bci);
+                }
+                break;
+            }
+        }
+    } else if (isInterpreter()) {
+        // Mark the first Java frame as INTERPRETED
+        for (int i = 0; i < num_frames; i++) {
+            if (frames[i].bci > BCI_NATIVE_FRAME) {
+                frames[i].bci = FrameType::encode(FRAME_INTERPRETED, frames[i].bci);
+                break;
+            }
+        }
+    }
+}
+
+// CompressedReadStream of the debug info: UNSIGNED5 ints, whose bytes are offset by one since JDK 20 (JDK-8292758)
+static u32 readScopeInt(const unsigned char*& stream, u32 excess) {
+    const u32 L = 192;
+    const int LG_H = 6;
+    u32 b = *stream++;
+    u32 sum = b - excess;
+    if (sum < L) {
+        return sum;
+    }
+    for (int i = 1, shift = LG_H; ; i++, shift += LG_H) {
+        b = *stream++;
+        sum += (b - excess) << shift;
+        if (b < excess + L || i == 4) {
+            return sum;
+        }
+    }
+}
+
+int NMethod::decodeScopes(const void* pc, ASGCT_CallFrame* frames, int max_frames) {
+    if (!_has_scope_data || !isNMethod() || !isAlive() || method() == NULL) {
+        return 0;
+    }
+    const char* code_begin = codeBegin();
+    const unsigned char* scopes_data = _nmethod_scopes_data_begin_offset >= 0
+            ? *(const unsigned char**) at(_nmethod_scopes_data_begin_offset)
+            : (const unsigned char*) at(*(int*) at(_nmethod_scopes_data_offset));
+    const char* pcs = at(*(int*) at(_nmethod_scopes_pcs_offset));
+    const char* pcs_end = at(*(int*) at(_nmethod_dependencies_offset));
+    void** metadata = (void**) at(*(int*) at(_nmethod_metadata_offset));
+    // the metadata, the scope data and the PcDescs follow each other in the nmethod
+    if ((const char*)metadata > (const char*)scopes_data || (const char*)scopes_data > pcs || pcs >= pcs_end) {
+        return 0;
+    }
+    int metadata_count = (int)(((const char*)scopes_data - (const char*)metadata) / sizeof(void*));
+    int pc_desc_count = (int)((pcs_end - pcs) / _pc_desc_size);
+    int pc_offset = (int)((const char*)pc - code_begin);
+
+    // The PcDescs are sorted by PC; as for the approximate lookups of HotSpot, pc belongs to the first one at or after it
+    int low = 0;
+    int high = pc_desc_count - 1;
+    while (low < high) {
+        int mid = (low + high) >> 1;
+        if (*(int*)(pcs + mid * _pc_desc_size + _pc_desc_pc_offset) < pc_offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    const char* pc_desc = pcs + low * _pc_desc_size;
+    if (*(int*)(pc_desc + _pc_desc_pc_offset) < pc_offset) {
+        return 0;
+    }
+
+    u32 excess = VM::java_version() >= 20 ? 1 : 0;
+    int decode_offset = *(int*)(pc_desc + _pc_desc_scope_offset);
+    int depth = 0;
+    // DebugInformationRecorder::serialized_null ends the chain of the senders
+    while (decode_offset > 0) {
+        if (depth >= max_frames || scopes_data + decode_offset >= (const unsigned char*)pcs) {
+            return 0;
+        }
+        const unsigned char* stream = scopes_data + decode_offset;
+        int sender_offset = (int)readScopeInt(stream, excess);
+        int method_index = (int)readScopeInt(stream, excess);
+        // stored as bci - InvocationEntryBci
+        int bci = (int)readScopeInt(stream, excess) - 1;
+        if (method_index <= 0 || method_index > metadata_count) {
+            return 0;
+        }
+        jmethodID method_id = ((VMMethod*)metadata[method_index - 1])->id();
+        if (method_id == NULL) {
+            return 0;
+        }
+        frames[depth].bci = FrameType::encode(FRAME_INLINED, bci < 0 ? 0 : bci);
+        frames[depth].method_id = method_id;
+        depth++;
+        decode_offset = sender_offset;
+    }
+
+    // the outermost scope is the method of this nmethod, otherwise the data was not read right
+    if (depth == 0 || frames[depth - 1].method_id != method()->id()) {
+        return 0;
+    }
+    int comp_level = level();
+    int bci = frames[depth - 1].bci & 0xffffff;
+    frames[depth - 1].bci = FrameType::encode(comp_level >= 1 && comp_level <= 3 ? FRAME_C1_COMPILED : FRAME_JIT_COMPILED, bci);
+    return depth;
+}
+
 NMethod* CodeHeap::findNMethod(char* heap, const void* pc) {
     unsigned char* heap_start = *(unsigned char**)(heap + _code_heap_memory_offset + _vs_low_offset);
     unsigned char* segmap = *(unsigned char**)(heap + _code_heap_segmap_offset + _vs_low_offset);
@@ -36,6 +36,8 @@ class VMStructs {
 
     static bool _has_class_names;
     static bool _has_method_structs;
+    static bool _has_scope_data;
+    static bool _has_frame_structs;
     static bool _has_class_loader_data;
     static bool _has_native_thread_id;
     static bool _has_perm_gen;
@@ -55,6 +57,7 @@ class VMStructs {
     static int _osthread_state_offset;
     static int _anchor_sp_offset;
     static int _anchor_pc_offset;
+    static int _anchor_fp_offset;
     static int _frame_size_offset;
     static int _frame_complete_offset;
     static int _nmethod_name_offset;
@@ -62,10 +65,21 @@ class VMStructs {
     static int _nmethod_entry_offset;
     static int _nmethod_state_offset;
     static int _nmethod_level_offset;
+    static int _nmethod_metadata_offset;
+    static int _nmethod_scopes_data_offset;
+    static int _nmethod_scopes_data_begin_offset;
+    static int _nmethod_scopes_pcs_offset;
+    static int _nmethod_dependencies_offset;
+    static int _code_offset;
+    static int _code_begin_offset;
+    static int _pc_desc_size;
+    static int _pc_desc_pc_offset;
+    static int _pc_desc_scope_offset;
     static int _method_constmethod_offset;
     static int _method_code_offset;
     static int _constmethod_constants_offset;
     static int _constmethod_idnum_offset;
+    static int _constmethod_size;
     static int _pool_holder_offset;
     static int _array_data_offset;
     static int _code_heap_memory_offset;
@@ -78,6 +92,7 @@ class VMStructs {
     static int _flag_name_offset;
     static int _flag_addr_offset;
     static void** _collected_heap_addr;
+    static volatile int* _safepoint_state_addr;
     static const char* _flags_addr;
     static int _flag_count;
     static int _flag_size;
@@ -141,6 +156,12 @@ class VMStructs {
         return _libjvm;
     }
 
+    // SafepointSynchronize::_state: 0 when not at a safepoint, 1 while synchronizing, 2 at the safepoint;
+    // -1 if the VM does not export it
+    static int safepointState() {
+        return _safepoint_state_addr != NULL ? *_safepoint_state_addr : -1;
+    }
+
     static bool hasClassNames() {
         return _has_class_names;
     }
@@ -149,6 +170,15 @@ class VMStructs {
         return _has_method_structs;
     }
 
+    static bool hasScopeData() {
+        return _has_scope_data;
+    }
+
+    // Whether the Java frames can be walked without AsyncGetCallTrace, see StackWalker::walkVM()
+    static bool hasFrameStructs() {
+        return _has_frame_structs;
+    }
+
     static bool hasClassLoaderData() {
         return _has_class_loader_data;
     }
@@ -314,6 +344,10 @@ class VMThread : VMStructs {
     uintptr_t& lastJavaPC() {
         return *(uintptr_t*) (at(_thread_anchor_offset) + _anchor_pc_offset);
     }
+
+    uintptr_t lastJavaFP() {
+        return _anchor_fp_offset >= 0 ? *(uintptr_t*) (at(_thread_anchor_offset) + _anchor_fp_offset) : 0;
+    }
 };
 
 class VMMethod : VMStructs {
@@ -327,6 +361,13 @@ class VMMethod : VMStructs {
 
     jmethodID id();
 
+    // As id(), for a Method* read from a stack frame which may not be one: every load is guarded,
+    // and the jmethodID found must point back to this method. NULL if it does not.
+    jmethodID validatedId();
+
+    // The bytecode index of bcp in this method, or -1 if bcp is not within its bytecodes
+    int bci(const void* bcp);
+
     static bool check_jmethodID(jmethodID id);
 
     NMethod* code() {
@@ -362,6 +403,16 @@ class NMethod : VMStructs {
         return n != NULL && strcmp(n, "Interpreter") == 0;
     }
 
+    const char* codeBegin() {
+        return _code_begin_offset >= 0 ? *(const char**) at(_code_begin_offset) : at(*(int*) at(_code_offset));
+    }
+
+    // Whether the frame of this code blob is set up at pc, i.e. pc is past its prologue
+    bool isFrameComplete(const void* pc) {
+        int offset = frameCompleteOffset();
+        return offset >= 0 && (const char*)pc >= codeBegin() + offset;
+    }
+
     VMMethod* method() {
         return *(VMMethod**) at(_nmethod_method_offset);
     }
@@ -381,6 +432,15 @@ class NMethod : VMStructs {
     int level() {
         return _nmethod_level_offset >= 0 ? *(int*) at(_nmethod_level_offset) : 0;
     }
+
+    // Marks the frames of a stack walk which starts in this code blob: the frame of its method as compiled,
+    // the frames above it as inlined, or the first Java frame as interpreted
+    void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames);
+
+    // Decodes the scope descriptors of pc: the frames inlined there, from the leaf to the method of this
+    // nmethod, with their bytecode indexes and frame types. Returns 0 if the scope data of this JVM is not
+    // known, if pc has no scope, or if there are more than max_frames of them.
+    int decodeScopes(const void* pc, ASGCT_CallFrame* frames, int max_frames);
 };
 
 class CodeHeap : VMStructs {
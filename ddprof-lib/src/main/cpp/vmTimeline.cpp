@@ -0,0 +1,140 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <string>
+#include "vmTimeline.h"
+#include "event.h"
+#include "jfrMetadata.h"
+#include "os.h"
+#include "profiler.h"
+#include "thread.h"
+#include "tsc.h"
+#include "vmEntry.h"
+#include "vmStructs.h"
+
+volatile bool VMTimeline::_running = false;
+long VMTimeline::_interval = 0;
+bool VMTimeline::_poll_safepoints = false;
+bool VMTimeline::_enabled_compile_events = false;
+pthread_t VMTimeline::_thread;
+volatile u64 VMTimeline::_gc_start = 0;
+
+Error VMTimeline::start(Arguments& args) {
+    if (_running) {
+        return Error::OK;
+    }
+    _interval = args._vm_timeline > 0 ? args._vm_timeline : DEFAULT_VM_TIMELINE_INTERVAL;
+    _gc_start = 0;
+    _running = true;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+    // the events are left off at VM startup whenever the code heap can be walked instead (JDK-8173361),
+    // which is fixed from JDK 10 on
+    _enabled_compile_events = VM::java_version() >= 10 && CodeHeap::available();
+    if (_enabled_compile_events) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
+    }
+
+    _poll_safepoints = VMStructs::safepointState() >= 0;
+    if (_poll_safepoints && pthread_create(&_thread, NULL, threadEntry, NULL) != 0) {
+        _poll_safepoints = false;
+        return Error("Unable to create the safepoint polling thread");
+    }
+    return Error::OK;
+}
+
+void VMTimeline::stop() {
+    if (!_running) {
+        return;
+    }
+    _running = false;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
+    // the liveness tracker keeps GarbageCollectionFinish enabled for itself
+    if (_enabled_compile_events) {
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
+    }
+
+    if (_poll_safepoints) {
+        pthread_kill(_thread, WAKEUP_SIGNAL);
+        pthread_join(_thread, NULL);
+    }
+}
+
+void VMTimeline::pollLoop() {
+    int tid = OS::threadId();
+    u64 safepoint_start = 0;
+    while (_running) {
+        // synchronizing counts as well, the Java threads are being stopped already
+        int state = VMStructs::safepointState();
+        if (state > 0 && safepoint_start == 0) {
+            safepoint_start = TSC::ticks();
+        } else if (state == 0 && safepoint_start != 0) {
+            VMActivityEvent event = {T_SAFEPOINT, safepoint_start, TSC::ticks(), NULL, 0};
+            Profiler::instance()->recordVMActivity(tid, &event);
+            safepoint_start = 0;
+        }
+        OS::sleep(_interval);
+    }
+}
+
+void VMTimeline::recordCompilation(jvmtiEnv* jvmti, jmethodID method, jint code_size) {
+    u64 now = TSC::ticks();
+    jclass method_class;
+    char* class_signature = NULL;
+    char* method_name = NULL;
+    if (jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
+        jvmti->GetClassSignature(method_class, &class_signature, NULL) == 0 &&
+        jvmti->GetMethodName(method, &method_name, NULL, NULL) == 0) {
+        // Ljava/lang/String; -> java.lang.String.hashCode
+        std::string name(class_signature[0] == 'L' ? class_signature + 1 : class_signature);
+        if (!name.empty() && name[name.size() - 1] == ';') {
+            name.resize(name.size() - 1);
+        }
+        for (size_t i = 0; i < name.size(); i++) {
+            if (name[i] == '/') {
+                name[i] = '.';
+            }
+        }
+        name.append(".").append(method_name);
+
+        VMActivityEvent event = {T_COMPILATION, now, now, name.c_str(), (u32)code_size};
+        Profiler::instance()->recordVMActivity(ProfiledThread::currentTid(), &event);
+    }
+    jvmti->Deallocate((unsigned char*)method_name);
+    jvmti->Deallocate((unsigned char*)class_signature);
+}
+
+void JNICALL VMTimeline::GarbageCollectionStart(jvmtiEnv* jvmti) {
+    if (_running) {
+        _gc_start = TSC::ticks();
+    }
+}
+
+void JNICALL VMTimeline::GarbageCollectionFinish(jvmtiEnv* jvmti) {
+    u64 gc_start = _gc_start;
+    if (!_running || gc_start == 0) {
+        return;
+    }
+    _gc_start = 0;
+    // called in the VM thread, with the Java threads stopped
+    VMActivityEvent event = {T_GC_PAUSE, gc_start, TSC::ticks(), NULL, 0};
+    Profiler::instance()->recordVMActivity(ProfiledThread::currentTid(), &event);
+}
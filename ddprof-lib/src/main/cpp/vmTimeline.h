@@ -0,0 +1,62 @@
+/*
+ * Copyright 2023 Datadog, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VMTIMELINE_H
+#define _VMTIMELINE_H
+
+#include <jvmti.h>
+#include <pthread.h>
+#include "arch.h"
+#include "arguments.h"
+
+// Records when the VM was busy with something the CPU and wall samples are blind to, so that their
+// ticks_safepoint, ticks_GC_active and ticks_deopt failures can be matched with what caused them:
+//  - the safepoints, from SafepointSynchronize::_state polled by a thread every 'vmtimeline' interval;
+//    the edges are as precise as the interval and the safepoints shorter than it may be missed
+//  - the GC pauses, from the JVMTI GarbageCollectionStart and GarbageCollectionFinish events
+//  - the compiled methods being installed, from CompiledMethodLoad; JVMTI reports no compilation start,
+//    so these are instants
+class VMTimeline {
+  private:
+    static volatile bool _running;
+    static long _interval;
+    static bool _poll_safepoints;
+    static bool _enabled_compile_events;
+    static pthread_t _thread;
+    static volatile u64 _gc_start;
+
+    static void* threadEntry(void* unused) {
+        pollLoop();
+        return NULL;
+    }
+
+    static void pollLoop();
+
+  public:
+    static bool running() {
+        return _running;
+    }
+
+    static Error start(Arguments& args);
+    static void stop();
+
+    static void recordCompilation(jvmtiEnv* jvmti, jmethodID method, jint code_size);
+
+    static void JNICALL GarbageCollectionStart(jvmtiEnv* jvmti);
+    static void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti);
+};
+
+#endif // _VMTIMELINE_H
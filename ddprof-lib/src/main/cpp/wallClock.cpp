@@ -14,14 +14,17 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <math.h>
 #include <random>
 #include "debugSupport.h"
 #include "wallClock.h"
 #include "profiler.h"
+#include "sampleLoss.h"
 #include "stackFrame.h"
 #include "context.h"
 #include "log.h"
+#include "signalLatency.h"
 #include "thread.h"
 #include "tsc.h"
 #include "vmStructs.h"
@@ -52,7 +55,16 @@ bool WallClock::inSyscall(void *ucontext) {
 void WallClock::sharedSignalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     WallClock *engine = (WallClock*)Profiler::instance()->wallEngine();
     if (signo == SIGVTALRM) {
+        u64 start = engine->_budget > 0 || SignalLatency::enabled() ? TSC::ticks() : 0;
+        if (siginfo->si_code == SI_QUEUE) {
+            // the sender puts its timestamp into the upper half of the value
+            SignalLatency::delivered(SIGNAL_ENGINE_WALL, (u32)((u64)(uintptr_t)siginfo->si_value.sival_ptr >> 32), start);
+        }
         engine->signalHandler(signo, siginfo, ucontext, engine->_interval);
+        if (engine->_budget > 0) {
+            atomicInc(engine->_handler_ticks, TSC::ticks() - start);
+        }
+        SignalLatency::exit(SIGNAL_ENGINE_WALL, start);
     }
 }
 
@@ -60,7 +72,7 @@ void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext, u64
     ProfiledThread* current = ProfiledThread::current();
     int tid = current != NULL ? current->tid() : OS::threadId();
     Shims::instance().setSighandlerTid(tid);
-    Context& ctx = Contexts::get(tid);
+    Context ctx = Contexts::get(tid);
     u64 skipped = 0;
     if (current != NULL) {
         if (_collapsing && !current->noteWallSample(ctx.spanId, &skipped)) {
@@ -90,10 +102,39 @@ void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext, u64
     event._thread_state = state;
     event._execution_mode = mode;
     event._weight = skipped + 1;
-    Profiler::instance()->recordSample(ucontext, last_sample, tid, BCI_WALL, &event);
+    u32 weight = siginfo->si_code == SI_QUEUE ? (u32)(uintptr_t)siginfo->si_value.sival_ptr : 1;
+    if (weight > 1) {
+        // the inverse of the relative probability this thread was picked with
+        event._weight *= weight;
+    }
+    if (_reuse_idle_stacks && current != NULL) {
+        recordIdleAwareSample(current, ucontext, last_sample, tid, &event);
+    } else {
+        Profiler::instance()->recordSample(ucontext, last_sample, tid, BCI_WALL, &event);
+    }
     Shims::instance().setSighandlerTid(-1);
 }
 
+void WallClock::recordIdleAwareSample(ProfiledThread* current, void* ucontext, u64 last_sample, int tid, ExecutionEvent* event) {
+    Profiler* profiler = Profiler::instance();
+    // a running thread may have moved on from the stack it just blocked in with very little CPU time
+    if (event->_thread_state == ThreadState::RUNNABLE) {
+        profiler->recordSample(ucontext, last_sample, tid, BCI_WALL, event);
+        current->noteWallTrace(0, 0, 0);
+        return;
+    }
+
+    u32 generation = 0;
+    u32 call_trace_id = current->idleWallTrace(OS::cputime(), &generation);
+    if (call_trace_id != 0 && profiler->recordCachedSample(last_sample, tid, call_trace_id, generation, BCI_WALL, event)) {
+        Counters::increment(WALL_STACKS_REUSED);
+    } else {
+        call_trace_id = profiler->recordSample(ucontext, last_sample, tid, BCI_WALL, event, &generation);
+    }
+    // measured after the sample, so that the cost of this handler does not count as the thread running
+    current->noteWallTrace(call_trace_id, generation, OS::cputime());
+}
+
 Error WallClock::start(Arguments &args) {
     int interval = args._event != NULL ? args._interval : args._wall;
     if (interval < 0) {
@@ -102,30 +143,254 @@ Error WallClock::start(Arguments &args) {
     _interval = interval ? interval : DEFAULT_WALL_INTERVAL;
 
     _collapsing = args._wall_collapsing;
+    _reuse_idle_stacks = args._wall_reuse_idle;
+    // the weight of a sample can only be passed along with the signal on Linux
+    _context_priority = OS::isLinux() ? args._wall_context_priority : 1;
+    // likewise the send timestamp, and only where the value is wide enough to hold it next to the weight
+    _timed_delivery = OS::isLinux() && sizeof(uintptr_t) >= sizeof(u64) && args._signal_latency;
 
     _reservoir_size =
             args._wall_threads_per_tick ?
             args._wall_threads_per_tick :
             DEFAULT_WALL_THREADS_PER_TICK;
+    _shards = args._wall_shards;
+    // sharding already spreads the signal delivery over several threads
+    _senders = _shards > 1 ? 1 : args._wall_senders;
+    for (int i = 0; i < MAX_WALL_SHARDS; i++) {
+        _threads[i].clear();
+        _shard_tids[i] = -1;
+        _shard_cpu[i] = 0;
+    }
+
+    _configured_interval = _interval;
+    _configured_reservoir_size = _reservoir_size;
+    _pending_interval = _interval;
+    _pending_reservoir_size = _reservoir_size;
+    _sampling_changed = false;
+    _budget = args._wall_budget;
+    _handler_ticks = 0;
+    _sampling_rate = (double)_reservoir_size * 1e9 / _interval;
+    _budget_controller = PidController(
+        _budget / 1000, // the budget in microseconds of signal handler time per second
+        0.5, // correct half of the measured deviation right away
+        0.05, // a weak integral term removes the steady-state error
+        0, // handler time is noisy, the derivative term would only amplify it
+        WALL_BUDGET_CHECK_PERIOD_SECS,
+        15,
+        // with too few threads to spend the budget on the rate saturates; the integral must not wind up meanwhile
+        (double)_budget / 1000 * WALL_BUDGET_CHECK_PERIOD_SECS
+    );
 
     OS::installSignalHandler(SIGVTALRM, sharedSignalHandler);
 
     _running = true;
+    _next_shard = 0;
+    _signals_sent = 0;
 
-    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
-        return Error("Unable to create timer thread");
+    for (int i = 0; i < _shards; i++) {
+        if (pthread_create(&_shard_threads[i], NULL, threadEntry, this) != 0) {
+            // the tids of a missing shard would never be sampled
+            _shards = i;
+            stop();
+            return Error("Unable to create timer thread");
+        }
     }
 
     return Error::OK;
 }
 
+u64 WallClock::samplerCpuTime() {
+    u64 total = 0;
+    for (int i = 0; i < _shards; i++) {
+        total += _shard_cpu[i];
+    }
+    for (int i = 1; i < _senders; i++) {
+        total += _sender_cpu[i];
+    }
+    return total;
+}
+
 void WallClock::stop() {
     _running = false;
-    pthread_kill(_thread, WAKEUP_SIGNAL);
-    pthread_join(_thread, NULL);
+    for (int i = 0; i < _shards; i++) {
+        pthread_kill(_shard_threads[i], WAKEUP_SIGNAL);
+    }
+    for (int i = 0; i < _shards; i++) {
+        pthread_join(_shard_threads[i], NULL);
+    }
+}
+
+void WallClock::reconcileThreads(std::vector<int>& tids) {
+    std::vector<int> shard_tids[MAX_WALL_SHARDS];
+    ThreadList* thread_list = OS::listThreads();
+    int tid = thread_list->next();
+    while (tid != -1) {
+        if (!isSampler(tid)) {
+            shard_tids[shardOf(tid)].push_back(tid);
+        }
+        tid = thread_list->next();
+    }
+    delete thread_list;
+    for (int i = 0; i < _shards; i++) {
+        _threads[i].reconcile(shard_tids[i]);
+    }
+}
+
+bool WallClock::isSampler(int tid) {
+    for (int i = 0; i < _shards; i++) {
+        if (_shard_tids[i] == tid) {
+            return true;
+        }
+    }
+    for (int i = 1; i < _senders; i++) {
+        if (_sender_tids[i] == tid) {
+            return true;
+        }
+    }
+    return false;
 }
 
-void WallClock::timerLoop() {
+void WallClock::sendSignals(const int* tids, int count, SignalStats* stats) {
+    stats->failures = 0;
+    stats->exited = 0;
+    stats->denied = 0;
+    for (int i = 0; i < count; i++) {
+        // a negative entry is a thread without a span, picked with a lower probability
+        int tid = tids[i] >= 0 ? tids[i] : -tids[i];
+        u32 weight = tids[i] >= 0 ? 1 : _context_priority;
+        bool sent;
+        if (_timed_delivery) {
+            sent = OS::sendSignalToThread(tid, SIGVTALRM, ((u64)SignalLatency::sendStamp() << 32) | weight);
+        } else {
+            sent = weight > 1 ? OS::sendSignalToThread(tid, SIGVTALRM, weight) : OS::sendSignalToThread(tid, SIGVTALRM);
+        }
+        if (!sent) {
+            stats->failures++;
+            if (errno != 0) {
+                switch (errno) {
+                    case ESRCH:
+                        stats->exited++;
+                        break;
+                    case EPERM:
+                        stats->denied++;
+                        break;
+                    default:
+                        Log::debug("unexpected error %s", strerror(errno));
+                }
+            }
+        }
+    }
+}
+
+void WallClock::sendSlice(int index) {
+    int from = (long)_batch_size * index / _senders;
+    int to = (long)_batch_size * (index + 1) / _senders;
+    sendSignals(_batch + from, to - from, &_batch_stats[index]);
+}
+
+void WallClock::startSenders() {
+    _next_sender = 0;
+    // no batch is in flight, the new senders wait for the first one
+    _batch_generation = 0;
+    _senders_running = true;
+    for (int i = 1; i < _senders; i++) {
+        _sender_tids[i] = -1;
+        _sender_cpu[i] = 0;
+        if (pthread_create(&_sender_threads[i], NULL, senderEntry, this) != 0) {
+            Log::warn("Unable to create wall clock sender thread");
+            _senders = i;
+            break;
+        }
+    }
+}
+
+void WallClock::stopSenders() {
+    _batch_lock.lock();
+    _senders_running = false;
+    _batch_lock.notifyAll();
+    _batch_lock.unlock();
+    for (int i = 1; i < _senders; i++) {
+        pthread_join(_sender_threads[i], NULL);
+    }
+}
+
+void WallClock::senderLoop() {
+    int index = __sync_add_and_fetch(&_next_sender, 1);
+    int self = OS::threadId();
+    _sender_tids[index] = self;
+    Profiler::instance()->threadFilter()->remove(self);
+
+    u64 generation = 0;
+    while (true) {
+        _batch_lock.lock();
+        while (_senders_running && _batch_generation == generation) {
+            _batch_lock.waitUntil(OS::micros() + 1000000);
+        }
+        generation = _batch_generation;
+        bool running = _senders_running;
+        _batch_lock.unlock();
+        if (!running) {
+            break;
+        }
+        sendSlice(index);
+        _sender_cpu[index] = OS::cputime();
+        __sync_fetch_and_sub(&_batch_pending, 1);
+    }
+}
+
+void WallClock::sendBatch(const std::vector<int>& reservoir, SignalStats* stats) {
+    if (_senders == 1) {
+        sendSignals(reservoir.data(), reservoir.size(), stats);
+        return;
+    }
+
+    _batch_lock.lock();
+    _batch = reservoir.data();
+    _batch_size = reservoir.size();
+    _batch_pending = _senders - 1;
+    _batch_generation++;
+    _batch_lock.notifyAll();
+    _batch_lock.unlock();
+
+    sendSlice(0);
+    // the slices are short, so the other senders are awaited by yielding instead of blocking
+    while (__atomic_load_n(&_batch_pending, __ATOMIC_ACQUIRE) > 0) {
+        sched_yield();
+    }
+
+    *stats = _batch_stats[0];
+    for (int i = 1; i < _senders; i++) {
+        stats->failures += _batch_stats[i].failures;
+        stats->exited += _batch_stats[i].exited;
+        stats->denied += _batch_stats[i].denied;
+    }
+}
+
+void WallClock::updateSampling(u64 handler_micros, u64 signals, double time_coefficient) {
+    if (signals == 0 || handler_micros == 0) {
+        return;
+    }
+    double signal = _budget_controller.compute(handler_micros, time_coefficient);
+    // the controller works in handler time; the average cost of a signal turns it into a sampling rate
+    double cost = (double)handler_micros / signals;
+    _sampling_rate += signal / cost;
+
+    double max_rate = (double)_configured_reservoir_size * 1e9 / _configured_interval;
+    double min_rate = 1e9 / ((double)_configured_interval * WALL_MAX_INTERVAL_STRETCH);
+    _sampling_rate = _sampling_rate > max_rate ? max_rate : _sampling_rate < min_rate ? min_rate : _sampling_rate;
+
+    // fewer threads per tick are preferred to a longer interval, which would coarsen every sampled thread
+    int reservoir_size = (int)(_sampling_rate * _configured_interval / 1e9);
+    if (reservoir_size >= 1) {
+        _reservoir_size = reservoir_size;
+        _interval = _configured_interval;
+    } else {
+        _reservoir_size = 1;
+        _interval = (long)(1e9 / _sampling_rate);
+    }
+}
+
+void WallClock::timerLoop(int shard) {
     if (!_enabled) {
         return;
     }
@@ -134,67 +399,118 @@ void WallClock::timerLoop() {
     std::vector<int> reservoir;
     reservoir.reserve(_reservoir_size);
     int self = OS::threadId();
+    _shard_tids[shard] = self;
     ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
     thread_filter->remove(self);
 
     std::mt19937 generator(std::random_device{}());
     std::uniform_real_distribution<double> uniform(1e-16, 1.0);
-    std::uniform_int_distribution<int> random_index(0, _reservoir_size - 1);
+    std::uniform_int_distribution<int> random_index;
+    std::uniform_int_distribution<int> thinning(0, _context_priority - 1);
+    std::vector<int> biased;
 
     u64 startTime = TSC::ticks();
     WallClockEpochEvent epoch(startTime);
+    epoch._shard = shard;
+    u64 reconcileTime = 0;
+    if (shard == 0) {
+        startSenders();
+    }
 
+    u64 scheduled = OS::nanotime();
+    u64 budget_check_time = scheduled;
+    u64 tick = 0;
     while (_running) {
-        if (thread_filter->enabled()) {
+        u64 tick_start = OS::nanotime();
+        _shard_cpu[shard] = OS::cputime();
+        if (shard == 0 && __atomic_exchange_n(&_sampling_changed, false, __ATOMIC_ACQ_REL)) {
+            // a reconfiguration becomes the new baseline of the budget controller too
+            _interval = _configured_interval = _pending_interval;
+            _reservoir_size = _configured_reservoir_size = _pending_reservoir_size;
+            _sampling_rate = (double)_reservoir_size * 1e9 / _interval;
+        }
+        if (shard == 0 && _budget > 0 && tick_start - budget_check_time >= (u64)WALL_BUDGET_CHECK_PERIOD_SECS * 1000000000) {
+            u64 handler_ticks = __sync_fetch_and_and(&_handler_ticks, 0);
+            u64 handler_micros = (u64)((double)handler_ticks * 1000000 / TSC::frequency());
+            double time_coefficient = (double)WALL_BUDGET_CHECK_PERIOD_SECS * 1000000000 / (tick_start - budget_check_time);
+            updateSampling(handler_micros, __sync_fetch_and_and(&_signals_sent, 0), time_coefficient);
+            budget_check_time = tick_start;
+        }
+        // the shards split the reservoir; the remainder rotates among them so that the total stays exact
+        int reservoir_size = (_reservoir_size + (int)((shard + tick++) % _shards)) / _shards;
+        if (reservoir_size > 0) {
+            random_index.param(std::uniform_int_distribution<int>::param_type(0, reservoir_size - 1));
+        }
+
+        bool filtered = thread_filter->enabled();
+        if (filtered) {
             thread_filter->collect(tids);
+            if (_shards > 1) {
+                tids.erase(std::remove_if(tids.begin(), tids.end(), [this, shard](int tid) { return shardOf(tid) != shard; }), tids.end());
+            }
         } else {
-            ThreadList* thread_list = OS::listThreads();
-            int tid = thread_list->next();
-            while (tid != -1) {
-                if (tid != self) {
-                    tids.push_back(tid);
-                }
-                tid = thread_list->next();
+            // the registry misses threads started before the profiler or without JVMTI callbacks
+            u64 now = TSC::ticks();
+            if (shard == 0 && (reconcileTime == 0 || TSC::ticks_to_millis(now - reconcileTime) >= WALL_RECONCILE_INTERVAL_MILLIS)) {
+                reconcileThreads(tids);
+                reconcileTime = now;
             }
-            delete thread_list;
-        }
-        for (int i = 0; i < _reservoir_size && i < tids.size(); i++) {
-            reservoir.push_back(tids[i]);
-        }
-        double weight = exp(log(uniform(generator)) / _reservoir_size);
-        int target = _reservoir_size + (int) (log(uniform(generator)) / log(1 - weight));
-        while (target < tids.size()) {
-            reservoir[random_index(generator)] = tids[target];
-            weight *= exp(log(uniform(generator)) / _reservoir_size);
-            target += (int) (log(uniform(generator)) / log(1 - weight));
-        }
-
-        int num_failures = 0;
-        int threads_already_exited = 0;
-        int permission_denied = 0;
-        for (int tid : reservoir) {
-            if (!OS::sendSignalToThread(tid, SIGVTALRM)) {
-                num_failures++;
-                if (errno != 0) {
-                    switch (errno) {
-                        case ESRCH:
-                            threads_already_exited++;
-                            break;
-                        case EPERM:
-                            permission_denied++;
-                            break;
-                        default:
-                            Log::debug("unexpected error %s", strerror(errno));
-                    }
+            _threads[shard].lockShared();
+        }
+        // the reservoir draws from the registry array directly, without copying it
+        const std::vector<int>* pool = filtered ? &tids : &_threads[shard].tids();
+        int num_candidates = pool->size();
+        if (_context_priority > 1) {
+            // keep every thread with an active span and 1 in _context_priority of the others,
+            // the latter are stored negated so that their sample carries the weight
+            biased.clear();
+            for (int tid : *pool) {
+                if (Contexts::get(tid).spanId != 0) {
+                    biased.push_back(tid);
+                } else if (thinning(generator) == 0) {
+                    biased.push_back(-tid);
                 }
             }
+            pool = &biased;
+        }
+        const std::vector<int>& candidates = *pool;
+        int pool_size = candidates.size();
+        for (int i = 0; i < reservoir_size && i < pool_size; i++) {
+            reservoir.push_back(candidates[i]);
+        }
+        if (reservoir_size > 0) {
+            double weight = exp(log(uniform(generator)) / reservoir_size);
+            int target = reservoir_size + (int) (log(uniform(generator)) / log(1 - weight));
+            while (target < pool_size) {
+                reservoir[random_index(generator)] = candidates[target];
+                weight *= exp(log(uniform(generator)) / reservoir_size);
+                target += (int) (log(uniform(generator)) / log(1 - weight));
+            }
+        }
+        if (!filtered) {
+            _threads[shard].unlockShared();
         }
 
-        epoch.updateNumSamplableThreads(tids.size());
-        epoch.updateNumFailedSamples(num_failures);
-        epoch.updateNumSuccessfulSamples(reservoir.size() - num_failures);
-        epoch.updateNumExitedThreads(threads_already_exited);
-        epoch.updateNumPermissionDenied(permission_denied);
+        SignalStats stats;
+        u64 signal_start = OS::nanotime();
+        sendBatch(reservoir, &stats);
+        u64 signal_end = OS::nanotime();
+
+        epoch.updateNumSamplableThreads(num_candidates);
+        epoch.updateNumFailedSamples(stats.failures);
+        epoch.updateNumSuccessfulSamples(reservoir.size() - stats.failures);
+        epoch.updateNumExitedThreads(stats.exited);
+        epoch.updateNumPermissionDenied(stats.denied);
+        if (stats.failures > stats.exited) {
+            // a thread which has exited in the meantime has nothing left to sample
+            SampleLoss::record(LOSS_WALL, LOSS_SIGNAL_FAILED, stats.failures - stats.exited);
+        }
+        // the epoch is that of the shard, like its sample counts; the shards together sample _reservoir_size threads
+        epoch.updateSamplingConfig(reservoir_size, _interval);
+        if (_budget > 0) {
+            atomicInc(_signals_sent, reservoir.size() - stats.failures);
+        }
+        epoch.updateTickTiming(tick_start > scheduled ? tick_start - scheduled : 0, signal_end - signal_start);
         u64 endTime = TSC::ticks();
         u64 duration = TSC::ticks_to_millis(endTime - startTime);
         if (epoch.hasChanged() || duration >= 1000) {
@@ -208,6 +524,18 @@ void WallClock::timerLoop() {
 
         reservoir.clear();
         tids.clear();
-        OS::sleep(_interval);
+
+        // sleep until the next tick is due, so that the time spent signalling does not stretch the interval
+        scheduled += _interval;
+        u64 now = OS::nanotime();
+        if (scheduled > now) {
+            OS::sleep(scheduled - now);
+        } else if (now - scheduled > (u64)_interval) {
+            // more than a tick behind; resume the schedule from now instead of firing a burst of ticks
+            scheduled = now;
+        }
+    }
+    if (shard == 0) {
+        stopSenders();
     }
 }
@@ -21,13 +21,39 @@
 #include <signal.h>
 #include <pthread.h>
 #include "engine.h"
+#include "mutex.h"
 #include "os.h"
+#include "pidController.h"
+#include "threadRegistry.h"
 #include "threadState.h"
 
+class ExecutionEvent;
+class ProfiledThread;
+
+// How often the thread registry is reconciled with the OS thread list
+const u64 WALL_RECONCILE_INTERVAL_MILLIS = 1000;
+// How often the adaptive sampler compares the signal handler time with the budget
+const int WALL_BUDGET_CHECK_PERIOD_SECS = 1;
+// The adaptive sampler never stretches the interval beyond this multiple of the configured one
+const int WALL_MAX_INTERVAL_STRETCH = 8;
+
 class WallClock : public Engine {
   private:
+    struct SignalStats {
+        int failures;
+        int exited;
+        int denied;
+    };
+
     static volatile bool _enabled;
     bool _collapsing;
+    // threads which have not run since their last wall sample reuse its trace instead of being walked again
+    bool _reuse_idle_stacks;
+    // Threads with an active span are this many times more likely to be sampled than other threads;
+    // the samples of the latter carry the ratio as their weight, which keeps aggregates unbiased
+    int _context_priority;
+    // signals carry the time they were sent at, so that the handler can measure the delivery latency
+    bool _timed_delivery;
     long _interval;
 
     // Maximum number of threads sampled in one iteration. This limit serves as a throttle
@@ -36,28 +62,112 @@ class WallClock : public Engine {
     // to avoid contention on a spin lock inside Profiler::recordSample().
     int _reservoir_size;
 
+    // With a budget, the signal handler time per second is held near it by scaling the reservoir size
+    // down from the configured one first, then stretching the interval
+    long _configured_interval;
+    int _configured_reservoir_size;
+    long _budget;
+    volatile u64 _handler_ticks;
+    double _sampling_rate;
+    PidController _budget_controller;
+    // set by setInterval() and setThreadsPerTick(), applied by shard 0 at the start of its next tick
+    long _pending_interval;
+    int _pending_reservoir_size;
+    volatile bool _sampling_changed;
+
     volatile bool _running;
-    pthread_t _thread;
 
-    void timerLoop();
+    // Every sampler thread owns the shard of tids which hash to its index, with a reservoir of its own.
+    // Shard 0 also reconciles the registries and runs the budget controller.
+    int _shards;
+    int _next_shard;
+    pthread_t _shard_threads[MAX_WALL_SHARDS];
+    volatile int _shard_tids[MAX_WALL_SHARDS];
+    // published by every sampler thread on each tick
+    volatile u64 _shard_cpu[MAX_WALL_SHARDS];
+    volatile u64 _signals_sent;
+
+    // Threads reported by the thread start/end callbacks; occasionally reconciled with the OS thread list
+    ThreadRegistry _threads[MAX_WALL_SHARDS];
+
+    // With several senders the reservoir of a tick is split into slices signalled in parallel;
+    // slice 0 is always signalled by the timer thread itself
+    int _senders;
+    int _next_sender;
+    pthread_t _sender_threads[MAX_WALL_SENDERS];
+    volatile int _sender_tids[MAX_WALL_SENDERS];
+    volatile u64 _sender_cpu[MAX_WALL_SENDERS];
+    WaitableMutex _batch_lock;
+    const int* _batch;
+    int _batch_size;
+    volatile u64 _batch_generation;
+    volatile int _batch_pending;
+    volatile bool _senders_running;
+    SignalStats _batch_stats[MAX_WALL_SENDERS];
+
+    void timerLoop(int shard);
+    void updateSampling(u64 handler_micros, u64 signals, double time_coefficient);
+    void reconcileThreads(std::vector<int>& tids);
+    bool isSampler(int tid);
+
+    int shardOf(int tid) const {
+        return ((u32)tid * 2654435761U >> 16) % _shards;
+    }
+
+    void startSenders();
+    void stopSenders();
+    void senderLoop();
+    void sendBatch(const std::vector<int>& reservoir, SignalStats* stats);
+    void sendSlice(int index);
+    void sendSignals(const int* tids, int count, SignalStats* stats);
 
     static void* threadEntry(void* wall_clock) {
-        ((WallClock*)wall_clock)->timerLoop();
+        WallClock* engine = (WallClock*)wall_clock;
+        engine->timerLoop(__sync_fetch_and_add(&engine->_next_shard, 1));
         return NULL;
     }
 
-    static bool inSyscall(void* ucontext);
+    static void* senderEntry(void* wall_clock) {
+        ((WallClock*)wall_clock)->senderLoop();
+        return NULL;
+    }
 
     static void sharedSignalHandler(int signo, siginfo_t* siginfo, void* ucontext);
     void signalHandler(int signo, siginfo_t* siginfo, void* ucontext, u64 last_sample);
+    void recordIdleAwareSample(ProfiledThread* current, void* ucontext, u64 last_sample, int tid, ExecutionEvent* event);
 
   public:
+    // Tells whether the signal interrupted a thread in a syscall, or right after one returned with EINTR
+    static bool inSyscall(void* ucontext);
+
     WallClock() :
         _collapsing(false),
+        _reuse_idle_stacks(false),
+        _context_priority(1),
+        _timed_delivery(false),
         _interval(LONG_MAX),
         _reservoir_size(0),
+        _configured_interval(LONG_MAX),
+        _configured_reservoir_size(0),
+        _budget(0),
+        _handler_ticks(0),
+        _sampling_rate(0),
+        _budget_controller(0, 0, 0, 0, WALL_BUDGET_CHECK_PERIOD_SECS, 15),
+        _pending_interval(LONG_MAX),
+        _pending_reservoir_size(0),
+        _sampling_changed(false),
         _running(false),
-        _thread(0) {}
+        _shards(1),
+        _next_shard(0),
+        _signals_sent(0),
+        _senders(1),
+        _next_sender(0),
+        _batch_lock(),
+        _batch(NULL),
+        _batch_size(0),
+        _batch_generation(0),
+        _batch_pending(0),
+        _senders_running(false) {}
 
     const char* units() {
         return "ns";
@@ -71,9 +181,32 @@ class WallClock : public Engine {
         return _interval;
     }
 
+    bool setInterval(long interval) {
+        _pending_interval = interval;
+        __atomic_store_n(&_sampling_changed, true, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // the number of threads sampled per tick, likewise applied on the next tick
+    void setThreadsPerTick(int threads) {
+        _pending_reservoir_size = threads;
+        __atomic_store_n(&_sampling_changed, true, __ATOMIC_RELEASE);
+    }
+
     Error start(Arguments& args);
     void stop();
 
+    u64 samplerCpuTime();
+
+    int registerThread(int tid) {
+        _threads[shardOf(tid)].add(tid);
+        return 0;
+    }
+
+    void unregisterThread(int tid) {
+        _threads[shardOf(tid)].remove(tid);
+    }
+
     inline void enableEvents(bool enabled) {
         _enabled = enabled;
     }
@@ -8,7 +8,6 @@ import java.util.concurrent.ConcurrentHashMap;
 
 public class ContextSetter {
 
-    private static final int TAGS_STORAGE_LIMIT = 10;
     private final List<String> attributes;
     private final JavaProfiler profiler;
 
@@ -18,7 +17,8 @@ public class ContextSetter {
         this.profiler = profiler;
         Set<String> unique = new HashSet<>(attributes);
         this.attributes = new ArrayList<>(unique.size());
-        for (int i = 0; i < Math.min(attributes.size(), TAGS_STORAGE_LIMIT); i++) {
+        int limit = Math.min(attributes.size(), profiler.contextCapacity());
+        for (int i = 0; i < limit; i++) {
             String attribute = attributes.get(i);
             if (unique.remove(attribute)) {
                 this.attributes.add(attribute);
@@ -80,6 +80,13 @@ public class ContextSetter {
         return false;
     }
 
+    /**
+     * Marks the span set on the current thread as kept or dropped by the tracer
+     */
+    public void setSampled(boolean sampled) {
+        profiler.setSampled(sampled);
+    }
+
     public boolean clearContextValue(String attribute) {
         return clearContextValue(offsetOf(attribute));
     }
@@ -0,0 +1,130 @@
+package com.datadoghq.profiler;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Collects trace root, queue time and setting events so that many of them are recorded with a single
+ * native call. Strings are passed as constants registered once with {@link #register(String)}, so no
+ * string conversion happens per event. A batch is not thread-safe: fill and flush it from one thread
+ * at a time, e.g. keep one per thread.
+ */
+public final class EventBatch {
+    // must be kept in sync with BATCH_RECORD_SIZE and BatchedEventType in the native library
+    static final int RECORD_SIZE = 56;
+    private static final int TRACE_ROOT = 1;
+    private static final int QUEUE_TIME = 2;
+    private static final int SETTING = 3;
+
+    private final JavaProfiler profiler;
+    private final ByteBuffer buffer;
+    private final int capacity;
+    private int count;
+
+    EventBatch(JavaProfiler profiler, int capacity) {
+        this.profiler = profiler;
+        this.capacity = capacity;
+        this.buffer = ByteBuffer.allocateDirect(capacity * RECORD_SIZE).order(ByteOrder.LITTLE_ENDIAN);
+    }
+
+    /**
+     * Registers a string to be used in the events of any batch
+     * @param value the string
+     * @return the constant to pass instead of the string, or -1 if no more constants can be registered
+     */
+    public int register(String value) {
+        return profiler.registerConstant(value);
+    }
+
+    /**
+     * The id of the current thread, to be passed as the origin of a queue time event
+     */
+    public int currentThreadId() {
+        return profiler.tid();
+    }
+
+    /**
+     * Adds the completion of a trace root on the current thread
+     * @return false if the batch is full and must be flushed first
+     */
+    public boolean addTraceRoot(long rootSpanId, int endpoint, int sizeLimit) {
+        int offset = next(TRACE_ROOT);
+        if (offset < 0) {
+            return false;
+        }
+        buffer.putLong(offset + 8, rootSpanId);
+        buffer.putInt(offset + 16, endpoint);
+        buffer.putInt(offset + 20, sizeLimit);
+        return true;
+    }
+
+    /**
+     * Adds the end of queueing of a task picked up by the current thread
+     * @param spanId the span the task runs in
+     * @param rootSpanId the local root span the task runs in
+     * @param task the registered class name of the task
+     * @param scheduler the registered class name of the thread-pool or executor scheduling the task
+     * @param originThreadId the {@link #currentThreadId()} of the thread the task was submitted on
+     * @return false if the batch is full and must be flushed first
+     */
+    public boolean addQueueTime(long startTicks, long endTicks, long spanId, long rootSpanId,
+                                int task, int scheduler, int originThreadId) {
+        int offset = next(QUEUE_TIME);
+        if (offset < 0) {
+            return false;
+        }
+        buffer.putLong(offset + 8, startTicks);
+        buffer.putLong(offset + 16, endTicks);
+        buffer.putLong(offset + 24, spanId);
+        buffer.putLong(offset + 32, rootSpanId);
+        buffer.putInt(offset + 40, task);
+        buffer.putInt(offset + 44, scheduler);
+        buffer.putInt(offset + 48, originThreadId);
+        return true;
+    }
+
+    /**
+     * Adds a datadog.ProfilerSetting event, all values being registered constants
+     * @return false if the batch is full and must be flushed first
+     */
+    public boolean addSetting(int name, int value, int unit) {
+        int offset = next(SETTING);
+        if (offset < 0) {
+            return false;
+        }
+        buffer.putInt(offset + 8, name);
+        buffer.putInt(offset + 12, value);
+        buffer.putInt(offset + 16, unit);
+        return true;
+    }
+
+    /**
+     * Records the events added so far and empties the batch
+     * @return the number of events recorded
+     */
+    public int flush() {
+        if (count == 0) {
+            return 0;
+        }
+        int recorded = profiler.recordBatch(buffer, count);
+        count = 0;
+        return recorded;
+    }
+
+    /**
+     * The number of events waiting to be flushed
+     */
+    public int size() {
+        return count;
+    }
+
+    private int next(int type) {
+        if (count == capacity) {
+            return -1;
+        }
+        int offset = count++ * RECORD_SIZE;
+        buffer.putInt(offset, type);
+        buffer.putInt(offset + 4, profiler.tid());
+        return offset;
+    }
+}
@@ -18,8 +18,12 @@ package com.datadoghq.profiler;
 
 import sun.misc.Unsafe;
 
+import java.io.FileDescriptor;
 import java.io.IOException;
 import java.io.InputStream;
+import java.lang.invoke.MethodHandle;
+import java.lang.invoke.MethodHandles;
+import java.lang.invoke.MethodType;
 import java.lang.reflect.Field;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
@@ -30,6 +34,10 @@ import java.nio.file.StandardCopyOption;
 import java.util.Arrays;
 import java.util.HashMap;
 import java.util.Map;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.Future;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.TimeoutException;
 
 /**
  * Java API for in-process profiling. Serves as a wrapper around
@@ -55,24 +63,56 @@ public final class JavaProfiler {
         UNSAFE = unsafe;
     }
 
-    static final class TSCFrequencyHolder {
+    // VarHandle fences are only reachable reflectively at this source level
+    private static final MethodHandle STORE_STORE_FENCE;
+    static {
+        MethodHandle fence = null;
+        if (UNSAFE == null) {
+            try {
+                fence = MethodHandles.lookup().findStatic(Class.forName("java.lang.invoke.VarHandle"),
+                        "storeStoreFence", MethodType.methodType(void.class));
+            } catch (Exception ignore) { }
+        }
+        STORE_STORE_FENCE = fence;
+    }
+
+    // Thread.isVirtual() exists since JDK 21
+    private static final MethodHandle IS_VIRTUAL;
+    static {
+        MethodHandle isVirtual = null;
+        try {
+            isVirtual = MethodHandles.lookup().findVirtual(Thread.class, "isVirtual",
+                    MethodType.methodType(boolean.class));
+        } catch (Exception ignore) { }
+        IS_VIRTUAL = isVirtual;
+    }
+
+    static final class TSCPageHolder {
+        // must be kept in sync with TSCPage and TicksSource in tsc.h
+        static final int SOURCE_OFFSET = 0;
+        static final int FREQUENCY_OFFSET = 8;
+        static final long TICKS_MONOTONIC_NANOS = 1;
         /**
-         * TSC frequency required to convert ticks into seconds
+         * Tells whether ticks can be taken in Java, and the current frequency
          */
-        static final long FREQUENCY = tscFrequency0();
+        static final ByteBuffer PAGE = tscPage0().order(ByteOrder.nativeOrder());
     }
     private static JavaProfiler instance;
-    private static final int CONTEXT_SIZE = 64;
     // must be kept in sync with PAGE_SIZE in context.h
     private static final int PAGE_SIZE = 1024;
     private static final int SPAN_OFFSET = 0;
     private static final int ROOT_SPAN_OFFSET = 8;
-    private static final int CHECKSUM_OFFSET = 16;
+    private static final int VERSION_OFFSET = 16;
     private static final int DYNAMIC_TAGS_OFFSET = 24;
-    private static final ThreadLocal<Integer> TID = ThreadLocal.withInitial(JavaProfiler::getTid0);
+    // the top bit of the version, see DD_CONTEXT_UNSAMPLED in context.h
+    private static final long UNSAMPLED = 1L << 63;
+    // a virtual thread moves between carriers, so it gets -1 and the tid of its current carrier is taken every time
+    private static final ThreadLocal<Integer> TID = ThreadLocal.withInitial(JavaProfiler::initialTid);
 
     private ByteBuffer[] contextStorage;
     private long[] contextBaseOffsets;
+    // the slot size is fixed by the native side once the first page has been handed out
+    private int contextSlotSize;
 
     private JavaProfiler() {
     }
@@ -216,6 +256,39 @@ public final class JavaProfiler {
         return recordTrace0(rootSpanId, endpoint, sizeLimit);
     }
 
+    /**
+     * Creates a batch to record many trace root, queue time and setting events with one native call
+     * @param capacity the number of events the batch can hold before it must be flushed
+     */
+    public EventBatch newEventBatch(int capacity) {
+        if (capacity <= 0) {
+            throw new IllegalArgumentException("capacity must be positive");
+        }
+        return new EventBatch(this, capacity);
+    }
+
+    int recordBatch(ByteBuffer batch, int count) {
+        return recordBatch0(batch, count);
+    }
+
+    int tid() {
+        int tid = TID.get();
+        return tid >= 0 ? tid : getTid0();
+    }
+
+    private static int initialTid() {
+        return isVirtual(Thread.currentThread()) ? -1 : getTid0();
+    }
+
+    private static boolean isVirtual(Thread thread) {
+        if (IS_VIRTUAL != null) {
+            try {
+                return (boolean) IS_VIRTUAL.invokeExact(thread);
+            } catch (Throwable ignore) { }
+        }
+        return false;
+    }
+
     /**
      * Add the given thread to the set of profiled threads.
      * 'filter' option must be enabled to use this method.
@@ -241,38 +314,121 @@ public final class JavaProfiler {
      * @param rootSpanId Root Span identifier that should be stored for current thread
      */
     public void setContext(long spanId, long rootSpanId) {
-        int tid = TID.get();
+        setContext(spanId, rootSpanId, true);
+    }
+
+    /**
+     * Passing context identifier to a profiler, along with the sampling decision of the tracer.
+     * With the 'unsampled' option, the CPU and wall samples taken while the span is not sampled
+     * are recorded without their stack traces, or not at all.
+     *
+     * @param spanId Span identifier that should be stored for current thread
+     * @param rootSpanId Root Span identifier that should be stored for current thread
+     * @param sampled whether the tracer keeps the trace of the span
+     */
+    public void setContext(long spanId, long rootSpanId, boolean sampled) {
+        int tid = tid();
         if (UNSAFE != null) {
-            setContextJDK8(tid, spanId, rootSpanId);
+            setContextJDK8(tid, spanId, rootSpanId, sampled);
         } else {
-            setContextByteBuffer(tid, spanId, rootSpanId);
+            setContextByteBuffer(tid, spanId, rootSpanId, sampled);
         }
     }
 
-    private void setContextJDK8(int tid, long spanId, long rootSpanId) {
+    private void setContextJDK8(int tid, long spanId, long rootSpanId, boolean sampled) {
         if (contextBaseOffsets == null) {
             return;
         }
-        long pageOffset = getPageUnsafe(tid);
-        int index = (tid % PAGE_SIZE) * CONTEXT_SIZE;
-        long base = pageOffset + index;
+        long base = getPageUnsafe(tid) + (long) (tid % PAGE_SIZE) * slotSizeUnsafe();
+        long version = beginUpdateUnsafe(base);
         UNSAFE.putLong(base + SPAN_OFFSET, spanId);
         UNSAFE.putLong(base + ROOT_SPAN_OFFSET, rootSpanId);
-        UNSAFE.putLong(base + CHECKSUM_OFFSET, spanId ^ rootSpanId);
+        endUpdateUnsafe(base, withSampled(version, sampled));
     }
 
-    private void setContextByteBuffer(int tid, long spanId, long rootSpanId) {
+    private void setContextByteBuffer(int tid, long spanId, long rootSpanId, boolean sampled) {
         if (contextStorage == null) {
             return;
         }
         ByteBuffer page = getPage(tid);
-        int index = (tid % PAGE_SIZE) * CONTEXT_SIZE;
+        int index = (tid % PAGE_SIZE) * slotSize(page);
+        long version = beginUpdate(page, index);
         page.putLong(index + SPAN_OFFSET, spanId);
         page.putLong(index + ROOT_SPAN_OFFSET, rootSpanId);
-        page.putLong(index + CHECKSUM_OFFSET, spanId ^ rootSpanId);
+        endUpdate(page, index, withSampled(version, sampled));
+    }
+
+    /**
+     * Changes the sampling decision of the span set on the current thread, see {@link #setContext(long, long, boolean)}
+     */
+    void setSampled(boolean sampled) {
+        int tid = tid();
+        if (UNSAFE != null) {
+            if (contextBaseOffsets == null) {
+                return;
+            }
+            long base = getPageUnsafe(tid) + (long) (tid % PAGE_SIZE) * slotSizeUnsafe();
+            endUpdateUnsafe(base, withSampled(beginUpdateUnsafe(base), sampled));
+        } else {
+            if (contextStorage == null) {
+                return;
+            }
+            ByteBuffer page = getPage(tid);
+            int index = (tid % PAGE_SIZE) * slotSize(page);
+            endUpdate(page, index, withSampled(beginUpdate(page, index), sampled));
+        }
     }
 
+    private static long withSampled(long version, boolean sampled) {
+        return sampled ? version & ~UNSAMPLED : version | UNSAMPLED;
+    }
 
+    /*
+     * Each slot is published with a seqlock: the version is odd while the owning thread is
+     * rewriting the slot, so a sampler interrupting the update discards what it read.
+     */
+    private static long beginUpdateUnsafe(long base) {
+        long version = UNSAFE.getLong(base + VERSION_OFFSET) | 1;
+        UNSAFE.putLong(base + VERSION_OFFSET, version);
+        UNSAFE.storeFence();
+        return version;
+    }
+
+    private static void endUpdateUnsafe(long base, long version) {
+        UNSAFE.putOrderedLong(base + VERSION_OFFSET, version + 1);
+    }
+
+    private static long beginUpdate(ByteBuffer page, int index) {
+        long version = page.getLong(index + VERSION_OFFSET) | 1;
+        page.putLong(index + VERSION_OFFSET, version);
+        storeStoreFence();
+        return version;
+    }
+
+    private static void endUpdate(ByteBuffer page, int index, long version) {
+        storeStoreFence();
+        page.putLong(index + VERSION_OFFSET, version + 1);
+    }
+
+    private static void storeStoreFence() {
+        if (STORE_STORE_FENCE != null) {
+            try {
+                STORE_STORE_FENCE.invokeExact();
+            } catch (Throwable ignore) { }
+        }
+    }
+
+    private static int slotSize(ByteBuffer page) {
+        return page.capacity() / PAGE_SIZE;
+    }
+
+    private int slotSizeUnsafe() {
+        int size = contextSlotSize;
+        if (size == 0) {
+            contextSlotSize = size = getContextSlotSize0();
+        }
+        return size;
+    }
 
     private ByteBuffer getPage(int tid) {
         int pageIndex = tid / PAGE_SIZE;
@@ -306,7 +462,7 @@ public final class JavaProfiler {
      * @param value the encoding of the value. Must have been encoded via @see JavaProfiler#registerConstant
      */
     public void setContextValue(int offset, int value) {
-        int tid = TID.get();
+        int tid = tid();
         if (UNSAFE != null) {
             setContextJDK8(tid, offset, value);
         } else {
@@ -318,8 +474,10 @@ public final class JavaProfiler {
         if (contextBaseOffsets == null) {
             return;
         }
-        long pageOffset = getPageUnsafe(tid);
-        UNSAFE.putInt(pageOffset + addressOf(tid, offset), value);
+        long base = getPageUnsafe(tid) + (long) (tid % PAGE_SIZE) * slotSizeUnsafe();
+        long version = beginUpdateUnsafe(base);
+        UNSAFE.putInt(base + tagOffset(offset), value);
+        endUpdateUnsafe(base, version);
     }
 
     public void setContextByteBuffer(int tid, int offset, int value) {
@@ -327,11 +485,14 @@ public final class JavaProfiler {
             return;
         }
         ByteBuffer page = getPage(tid);
-        page.putInt(addressOf(tid, offset), value);
+        int index = (tid % PAGE_SIZE) * slotSize(page);
+        long version = beginUpdate(page, index);
+        page.putInt(index + tagOffset(offset), value);
+        endUpdate(page, index, version);
     }
 
     void copyTags(int[] snapshot) {
-        int tid = TID.get();
+        int tid = tid();
         if (UNSAFE != null) {
             copyTagsJDK8(tid, snapshot);
         } else {
@@ -343,8 +504,7 @@ public final class JavaProfiler {
         if (contextBaseOffsets == null) {
             return;
         }
-        long pageOffset = getPageUnsafe(tid);
-        long address = pageOffset + addressOf(tid, 0);
+        long address = getPageUnsafe(tid) + (long) (tid % PAGE_SIZE) * slotSizeUnsafe() + tagOffset(0);
         for (int i = 0; i < snapshot.length; i++) {
             snapshot[i] = UNSAFE.getInt(address);
             address += Integer.BYTES;
@@ -356,14 +516,14 @@ public final class JavaProfiler {
             return;
         }
         ByteBuffer page = getPage(tid);
-        int address = addressOf(tid, 0);
+        int address = (tid % PAGE_SIZE) * slotSize(page) + tagOffset(0);
         for (int i = 0; i < snapshot.length; i++) {
             snapshot[i] = page.getInt(address + i * Integer.BYTES);
         }
     }
 
-    private static int addressOf(int tid, int offset) {
-        return ((tid % PAGE_SIZE) * CONTEXT_SIZE + DYNAMIC_TAGS_OFFSET)
+    private static int tagOffset(int offset) {
+        return DYNAMIC_TAGS_OFFSET
                 // TODO - we want to limit cardinality and a great way to enforce that is with the size of these
                 //  fields to a smaller type, say, u16. This would also allow us to pack more data into each thread's
                 //  slot. However, the current implementation of the dictionary trades monotonicity and minimality for
@@ -380,6 +540,13 @@ public final class JavaProfiler {
         return registerConstant0(key);
     }
 
+    /**
+     * The number of context attributes each thread can store, fixed when the profiler starts
+     */
+    int contextCapacity() {
+        return getContextCapacity0();
+    }
+
     /**
      * Dumps the JFR recording at the provided path
      * @param recording the path to the recording
@@ -389,6 +556,87 @@ public final class JavaProfiler {
         dump0(recording.toAbsolutePath().toString());
     }
 
+    /**
+     * Streams the JFR recording to the provided file descriptor.
+     * The descriptor may refer to a file, a socket or a pipe; the chunk data is transferred in the kernel
+     * without being copied through the Java heap. The descriptor is not closed.
+     * @param target the file descriptor to write the recording to
+     * @throws NullPointerException if target is null
+     * @throws IllegalStateException if the recording can not be dumped
+     */
+    public void dump(FileDescriptor target) {
+        if (!target.valid()) {
+            throw new IllegalStateException("Invalid file descriptor");
+        }
+        dumpFd0(target);
+    }
+
+    /**
+     * Seals the current JFR chunk into native memory without touching the filesystem.
+     * The returned buffer is read-only and must be given back with {@link #release(ByteBuffer)}
+     * once it has been consumed; it must not be accessed after being released.
+     * @return a read-only direct buffer holding the recording
+     * @throws IllegalStateException if the recording can not be dumped or in-memory dumps are not supported
+     */
+    public ByteBuffer dumpToMemory() {
+        return dumpMemory0().asReadOnlyBuffer();
+    }
+
+    /**
+     * Frees the native memory of a buffer returned by {@link #dumpToMemory()}
+     * @param recording the buffer to release
+     * @throws IllegalArgumentException if the buffer was not returned by {@link #dumpToMemory()}
+     */
+    public void release(ByteBuffer recording) {
+        if (!recording.isDirect()) {
+            throw new IllegalArgumentException("Not an in-memory recording");
+        }
+        releaseDump0(recording);
+    }
+
+    /**
+     * Dumps the JFR recording at the provided path on the native chunk writer thread.
+     * Dumps requested this way are performed in the order they were requested.
+     * @param recording the path to the recording
+     * @return a future completed once the recording has been written
+     * @throws NullPointerException if recording is null
+     * @throws IllegalStateException if the chunk writer can not be started
+     */
+    public Future<Void> dumpAsync(Path recording) {
+        return new DumpFuture(dumpAsync0(recording.toAbsolutePath().toString()));
+    }
+
+    /**
+     * How the hot stacks are keyed, see {@link #getHotStacks(int, HotStacksBreakdown, long)}
+     */
+    public enum HotStacksBreakdown {
+        /** one entry per stack */
+        NONE,
+        /** per stack and sampling engine, e.g. cpu or wall */
+        ENGINE,
+        /** per stack and thread id */
+        THREAD,
+        /** per stack and local root span id */
+        CONTEXT
+    }
+
+    /**
+     * Returns the hottest stacks of the running profiler without waiting for the next dump.
+     * Every entry is made of the breakdown key, the number of samples, their total value (time, bytes, etc.)
+     * and the frames from the root to the leaf separated by ';', all separated by tabs; the entries are sorted
+     * by decreasing total value. Neither the samplers nor the next dump are affected by the query.
+     * @param limit the maximum number of entries
+     * @param breakdown how the samples of a stack are split up; anything but NONE requires the 'hotstacks' option
+     * @param windowMillis only the samples taken in the last windowMillis are counted, which requires the 'hotstacks'
+     *                     option; 0 counts all the samples since the last dump, as far back as the recent samples go
+     *                     with a breakdown
+     * @return the hottest stacks
+     * @throws IllegalStateException if the profiler is not active or the query is not supported by its options
+     */
+    public String[] getHotStacks(int limit, HotStacksBreakdown breakdown, long windowMillis) {
+        return getHotStacks0(limit, breakdown.ordinal(), windowMillis);
+    }
+
     /**
      * Records a datadog.ProfilerSetting event with no unit
      * @param name the name
@@ -413,11 +661,14 @@ public final class JavaProfiler {
      * Scales the ticks to milliseconds and applies a threshold
      */
     public boolean isThresholdExceeded(long thresholdMillis, long startTicks, long endTicks) {
-        return endTicks - startTicks > thresholdMillis * TSCFrequencyHolder.FREQUENCY / 1000;
+        // the frequency changes once TSC is calibrated when the first recording starts
+        long frequency = TSCPageHolder.PAGE.getLong(TSCPageHolder.FREQUENCY_OFFSET);
+        return endTicks - startTicks > thresholdMillis * frequency / 1000;
     }
 
     /**
-     * Records when queueing ended
+     * Records when queueing ended; the queue times shorter than the 'qtmin' profiler option
+     * are dropped natively, or sampled with 'qtsample', before their class names are resolved
      * @param task the name of the enqueue task
      * @param scheduler the name of the thread-pool or executor scheduling the task
      * @param origin the thread the task was submitted on
@@ -432,6 +683,10 @@ public final class JavaProfiler {
      * @return ticks
      */
     public long getCurrentTicks() {
+        if (TSCPageHolder.PAGE.getLong(TSCPageHolder.SOURCE_OFFSET) == TSCPageHolder.TICKS_MONOTONIC_NANOS) {
+            // no native call needed while ticks are plain monotonic nanoseconds
+            return System.nanoTime();
+        }
         return currentTicks0();
     }
 
@@ -442,11 +697,11 @@ public final class JavaProfiler {
      */
     public Map<String, Long> getDebugCounters() {
         Map<String, Long> counters = new HashMap<>();
-        ByteBuffer buffer = getDebugCounters0().order(ByteOrder.LITTLE_ENDIAN);
-        if (buffer.hasRemaining()) {
+        long[] values = getDebugCounters0();
+        if (values.length > 0) {
             String[] names = describeDebugCounters0();
-            for (int i = 0; i < names.length && i * 128 < buffer.capacity(); i++) {
-                counters.put(names[i], buffer.getLong(i * 128));
+            for (int i = 0; i < names.length && i < values.length; i++) {
+                counters.put(names[i], values[i]);
             }
         }
         return counters;
@@ -504,6 +759,65 @@ public final class JavaProfiler {
         return true;
     }
 
+    private static final class DumpFuture implements Future<Void> {
+        private final long id;
+        private boolean done;
+        private IllegalStateException failure;
+
+        DumpFuture(long id) {
+            this.id = id;
+        }
+
+        @Override
+        public boolean cancel(boolean mayInterruptIfRunning) {
+            return false;
+        }
+
+        @Override
+        public boolean isCancelled() {
+            return false;
+        }
+
+        @Override
+        public boolean isDone() {
+            try {
+                return await(0);
+            } catch (ExecutionException e) {
+                return true;
+            }
+        }
+
+        @Override
+        public Void get() throws ExecutionException {
+            await(-1);
+            return null;
+        }
+
+        @Override
+        public Void get(long timeout, TimeUnit unit) throws ExecutionException, TimeoutException {
+            if (!await(unit.toMillis(timeout))) {
+                throw new TimeoutException();
+            }
+            return null;
+        }
+
+        private synchronized boolean await(long timeoutMillis) throws ExecutionException {
+            if (!done) {
+                try {
+                    done = awaitDump0(id, timeoutMillis);
+                } catch (IllegalStateException e) {
+                    // the native side reports the error only once
+                    done = true;
+                    failure = e;
+                }
+            }
+            if (failure != null) {
+                throw new ExecutionException(failure);
+            }
+            return done;
+        }
+    }
+
     private native void stop0() throws IllegalStateException;
     private native String execute0(String command) throws IllegalArgumentException, IllegalStateException, IOException;
     private native void filterThread0(boolean enable);
@@ -516,14 +830,30 @@ public final class JavaProfiler {
     // ByteBuffer is simpler and fit for purpose on modern JDKs
     private static native long getContextPageOffset0(int tid);
     private static native int getMaxContextPages0();
+    private static native int getContextSlotSize0();
+    private static native int getContextCapacity0();
 
     private static native boolean recordTrace0(long rootSpanId, String endpoint, int sizeLimit);
 
+    private static native int recordBatch0(ByteBuffer batch, int count);
+
     private static native int registerConstant0(String value);
 
     private static native void dump0(String recordingFilePath);
 
-    private static native ByteBuffer getDebugCounters0();
+    private static native void dumpFd0(FileDescriptor target);
+
+    private static native ByteBuffer dumpMemory0();
+
+    private static native void releaseDump0(ByteBuffer recording);
+
+    private static native long dumpAsync0(String recordingFilePath);
+
+    private static native String[] getHotStacks0(int limit, int breakdown, long windowMillis);
+
+    private static native boolean awaitDump0(long id, long timeoutMillis);
+
+    private static native long[] getDebugCounters0();
 
     private static native String[] describeDebugCounters0();
 
@@ -533,5 +863,5 @@ public final class JavaProfiler {
 
     private static native long currentTicks0();
 
-    private static native long tscFrequency0();
+    private static native ByteBuffer tscPage0();
 }
@@ -1,12 +1,34 @@
     #include <gtest/gtest.h>
 
+    #include "boundedDictionary.h"
     #include "buffers.h"
+    #include "callTraceStorage.h"
+    #include "codeCache.h"
     #include "context.h"
     #include "counters.h"
+    #include "dictionary.h"
+    #include "flightRecorder.h"
+    #include "gzipWriter.h"
+    #include "linearAllocator.h"
+    #include "logLimiter.h"
+    #include "lz4Writer.h"
+    #include "mappedFile.h"
+    #include "methodIndex.h"
     #include "mutex.h"
     #include "os.h"
+    #include "pidController.h"
+    #include "sampleCapture.h"
+    #include "sampleLoss.h"
+    #include "stackTails.h"
+    #include "stackTraceWriter.h"
     #include "threadFilter.h"
+    #include "threadRegistry.h"
+    #include <algorithm>
+    #include <climits>
+    #include <thread>
     #include <vector>
+    #include <stdio.h>
+    #include <unistd.h>
 
     ssize_t callback(char* ptr, int len) {
         fprintf(stderr, "here\n");
@@ -21,6 +43,51 @@
         buf.putVar64(val);
     }
 
+    // the byte-wise JFR varint encoding, capped at 9 bytes where the last byte carries 8 bits
+    static int referenceVar64(u64 v, unsigned char* out) {
+        int len = 0;
+        while (v > 0x7f && len < 8) {
+            out[len++] = (unsigned char)(v | 0x80);
+            v >>= 7;
+        }
+        out[len++] = (unsigned char)v;
+        return len;
+    }
+
+    TEST(Buffer, varint_matches_reference) {
+        u64 values[] = {0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 2097150, 0x1fffff, 0x200000, 0xffffffffULL,
+                        0xffffffffffffffULL, 0x100000000000000ULL, 0x7fffffffffffffffULL, 0x8000000000000000ULL,
+                        0xffffffffffffffffULL};
+        RecordingBuffer buf;
+        unsigned char expected[16];
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            for (int shift = 0; shift < 64; shift++) {
+                u64 v = values[i] >> shift;
+                buf.reset();
+                buf.putVar64(v);
+                int len = referenceVar64(v, expected);
+                ASSERT_EQ(len, buf.offset());
+                ASSERT_EQ(0, memcmp(expected, buf.data(), len));
+
+                buf.reset();
+                buf.putVar32((u32)v);
+                len = referenceVar64((u32)v, expected);
+                ASSERT_EQ(len, buf.offset());
+                ASSERT_EQ(0, memcmp(expected, buf.data(), len));
+            }
+        }
+
+        u64 fields[] = {0x12345, 0, 0xffffffffULL, 3};
+        buf.reset();
+        buf.putVar64Array(fields, 4);
+        int len = 0;
+        for (int i = 0; i < 4; i++) {
+            len += referenceVar64(fields[i], expected + len);
+        }
+        ASSERT_EQ(len, buf.offset());
+        ASSERT_EQ(0, memcmp(expected, buf.data(), len));
+    }
+
     TEST(Buffer, skip_flush) {
         RecordingBuffer buf;
 
@@ -85,17 +152,238 @@
         EXPECT_FALSE(OS::getMaxThreadId() < 0);
     }
 
+    TEST(OS, threadNames_batch) {
+        pthread_setname_np(pthread_self(), "batch-names");
+        int tids[2] = {OS::threadId(), -1};
+        char names[2 * 64];
+        EXPECT_EQ(1, OS::threadNames(tids, 2, names, 64));
+        EXPECT_STREQ("batch-names", names);
+        EXPECT_STREQ("", names + 64);
+    }
+
+    TEST(OS, numa_topology_sanity) {
+        int nodes = OS::numaNodes();
+        ASSERT_GE(nodes, 1);
+        EXPECT_LT(OS::cpuNode(OS::currentCpu()), nodes);
+        EXPECT_EQ(0, OS::cpuNode(-1));
+
+        // binding is best effort and must leave the memory usable
+        std::vector<char> buffer(4 * OS::page_size);
+        OS::bindToNode(buffer.data(), buffer.size(), OS::cpuNode(OS::currentCpu()));
+        memset(buffer.data(), 1, buffer.size());
+        EXPECT_EQ(1, buffer[buffer.size() - 1]);
+    }
+
+    TEST(OS, huge_page_mappings) {
+        OS::setHugePages(true, false);
+        size_t size = 3 * OS::HUGE_PAGE_SIZE / 2;
+        char* table = (char*)OS::safeAllocHuge(size);
+        ASSERT_TRUE(table != NULL);
+        // huge pages or not, the mapping is aligned and covers the rounded size
+        EXPECT_EQ(0, (uintptr_t)table & (OS::HUGE_PAGE_SIZE - 1));
+        table[0] = 1;
+        table[2 * OS::HUGE_PAGE_SIZE - 1] = 1;
+        OS::safeFreeHuge(table, size);
+
+        // small sizes are mapped as they are
+        char* small = (char*)OS::safeAllocHuge(OS::page_size);
+        ASSERT_TRUE(small != NULL);
+        small[OS::page_size - 1] = 1;
+        OS::safeFreeHuge(small, OS::page_size);
+        OS::setHugePages(false, false);
+    }
+
+    TEST(Counters, shards_are_folded) {
+        Counters::set(PERF_DRAINED_SAMPLES, 0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; t++) {
+            threads.emplace_back([]() {
+                for (int i = 0; i < 10000; i++) {
+                    Counters::increment(PERF_DRAINED_SAMPLES);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        EXPECT_EQ(80000, Counters::getCounter(PERF_DRAINED_SAMPLES));
+
+        // a gauge overrides whatever the shards have accumulated
+        Counters::set(PERF_DRAINED_SAMPLES, 5);
+        EXPECT_EQ(5, Counters::getCounter(PERF_DRAINED_SAMPLES));
+        std::vector<long long> values = Counters::values();
+        ASSERT_EQ(Counters::describeCounters().size(), values.size());
+        EXPECT_EQ(5, values[PERF_DRAINED_SAMPLES]);
+    }
+
+    TEST(Counters, duration_histogram) {
+        EXPECT_EQ(0, Counters::durationBucket(999));
+        EXPECT_EQ(1, Counters::durationBucket(1000));
+        EXPECT_EQ(2, Counters::durationBucket(4999));
+        EXPECT_EQ(10, Counters::durationBucket(1500000));
+        EXPECT_EQ(DURATION_BUCKETS - 1, Counters::durationBucket(5000000000ULL));
+
+        Counters::recordDuration(DUMP_DURATION_LT_1US, 1500000);
+        Counters::recordDuration(DUMP_DURATION_LT_1US, 1700000);
+        EXPECT_EQ(2, Counters::getCounter(DUMP_DURATION_LT_2MS));
+        EXPECT_EQ(3200000, Counters::getCounter(DUMP_DURATION_TOTAL_NS));
+    }
+
+    TEST(SampleLoss, drain_per_engine) {
+        SampleLoss::reset();
+        SampleLoss::record(LOSS_CPU, LOSS_LOCK_CONTENTION);
+        SampleLoss::record(LOSS_CPU, LOSS_STORAGE_OVERFLOW, 3);
+        SampleLoss::record(LOSS_ALLOC, LOSS_LOCK_CONTENTION);
+
+        u64 lost[LOSS_REASONS];
+        EXPECT_TRUE(SampleLoss::drain(LOSS_CPU, lost));
+        EXPECT_EQ(1, lost[LOSS_LOCK_CONTENTION]);
+        EXPECT_EQ(3, lost[LOSS_STORAGE_OVERFLOW]);
+        EXPECT_EQ(0, lost[LOSS_SIGNAL_FAILED]);
+        // drained until the next loss
+        EXPECT_FALSE(SampleLoss::drain(LOSS_CPU, lost));
+        EXPECT_TRUE(SampleLoss::drain(LOSS_ALLOC, lost));
+        EXPECT_EQ(1, lost[LOSS_LOCK_CONTENTION]);
+        EXPECT_FALSE(SampleLoss::drain(LOSS_WALL, lost));
+    }
+
+    TEST(LogLimiter, dedup_and_rate_limit) {
+        LogLimiter limiter;
+        LogSummary summaries[MAX_LOG_SUMMARIES];
+        int count;
+        u64 now = LOG_LIMIT_WINDOW_NANOS;
+        EXPECT_TRUE(limiter.admit(LOG_WARN, "perf_event_open failed", 22, now, summaries, &count));
+        EXPECT_FALSE(limiter.admit(LOG_WARN, "perf_event_open failed", 22, now, summaries, &count));
+        EXPECT_FALSE(limiter.admit(LOG_WARN, "perf_event_open failed", 22, now, summaries, &count));
+        EXPECT_EQ(0, count);
+        for (int i = 1; i < LOG_RATE_LIMIT; i++) {
+            char message[32];
+            int len = snprintf(message, sizeof(message), "message %d", i);
+            EXPECT_TRUE(limiter.admit(LOG_WARN, message, len, now, summaries, &count));
+        }
+        EXPECT_FALSE(limiter.admit(LOG_WARN, "over the limit", 14, now, summaries, &count));
+
+        // the next window starts with what was held back by the last one
+        EXPECT_TRUE(limiter.admit(LOG_WARN, "perf_event_open failed", 22, now + LOG_LIMIT_WINDOW_NANOS, summaries, &count));
+        ASSERT_EQ(1, count);
+        EXPECT_EQ(1, summaries[0].count);
+        EXPECT_EQ(0, summaries[0].message[0]);
+    }
+
+    TEST(LogLimiter, summary_of_repeats) {
+        LogLimiter limiter;
+        LogSummary summaries[MAX_LOG_SUMMARIES];
+        int count;
+        u64 now = LOG_LIMIT_WINDOW_NANOS;
+        EXPECT_TRUE(limiter.admit(LOG_WARN, "repeated", 8, now, summaries, &count));
+        EXPECT_FALSE(limiter.admit(LOG_WARN, "repeated", 8, now, summaries, &count));
+        EXPECT_FALSE(limiter.admit(LOG_WARN, "repeated", 8, now + 1, summaries, &count));
+        // the same text at another level is another message
+        EXPECT_TRUE(limiter.admit(LOG_INFO, "repeated", 8, now + 2, summaries, &count));
+
+        EXPECT_TRUE(limiter.admit(LOG_WARN, "repeated", 8, now + LOG_LIMIT_WINDOW_NANOS, summaries, &count));
+        ASSERT_EQ(1, count);
+        EXPECT_EQ(LOG_WARN, summaries[0].level);
+        EXPECT_EQ(2, summaries[0].count);
+        EXPECT_STREQ("repeated", summaries[0].message);
+    }
+
+    TEST(LogLimiter, flush_ends_the_window) {
+        LogLimiter limiter;
+        LogSummary summaries[MAX_LOG_SUMMARIES];
+        int count;
+        u64 now = LOG_LIMIT_WINDOW_NANOS;
+        EXPECT_TRUE(limiter.admit(LOG_WARN, "repeated", 8, now, summaries, &count));
+        EXPECT_FALSE(limiter.admit(LOG_WARN, "repeated", 8, now, summaries, &count));
+
+        // a dump reports the repeats within the window, which then starts over
+        ASSERT_EQ(1, limiter.flush(now + 1, summaries));
+        EXPECT_EQ(1, summaries[0].count);
+        EXPECT_STREQ("repeated", summaries[0].message);
+        EXPECT_EQ(0, limiter.flush(now + 2, summaries));
+        EXPECT_TRUE(limiter.admit(LOG_WARN, "repeated", 8, now + 3, summaries, &count));
+        EXPECT_EQ(0, count);
+    }
+
     TEST(Context, maxtid_sanity) {
         int maxTid = OS::getMaxThreadId();
 
-        Context& ctx1 = Contexts::get(0);
-        Context& ctx2 = Contexts::get(maxTid - 1);
+        Context ctx1 = Contexts::get(0);
+        Context ctx2 = Contexts::get(maxTid - 1);
 
         if (maxTid >= DD_CONTEXT_PAGE_SIZE) {
-            Context& ctx3 = Contexts::get(DD_CONTEXT_PAGE_SIZE);
+            Context ctx3 = Contexts::get(DD_CONTEXT_PAGE_SIZE);
         }
     }
 
+    TEST(Context, seqlock) {
+        int tid = 7;
+        ContextPage page = Contexts::getPage(tid);
+        ASSERT_TRUE(page.storage != NULL);
+        Context* slot = (Context*)(page.storage + tid * Contexts::slotSize());
+
+        // an update in progress must never be observed
+        slot->version = 1;
+        slot->spanId = 42;
+        slot->rootSpanId = 43;
+        slot->tags[0].value = 5;
+        Context torn = Contexts::get(tid);
+        EXPECT_EQ(0, torn.spanId);
+        EXPECT_EQ(0, torn.tags[0].value);
+
+        slot->version = 2;
+        Context published = Contexts::get(tid);
+        EXPECT_EQ(42, published.spanId);
+        EXPECT_EQ(43, published.rootSpanId);
+        EXPECT_EQ(5, published.tags[0].value);
+
+        // capacity is pinned once pages have been handed out
+        EXPECT_EQ(Contexts::capacity(), Contexts::setCapacity(DD_MAX_TAGS_CAPACITY));
+        EXPECT_EQ(0, Contexts::slotSize() % DD_CONTEXT_SLOT_ALIGNMENT);
+    }
+
+    TEST(Context, set) {
+        int tid = 9;
+        Context context = {};
+        context.spanId = 11;
+        context.rootSpanId = 12;
+        context.tags[1].value = 3;
+        Contexts::set(tid, context);
+        Context stored = Contexts::get(tid);
+        EXPECT_EQ(11, stored.spanId);
+        EXPECT_EQ(12, stored.rootSpanId);
+        EXPECT_EQ(3, stored.tags[1].value);
+        EXPECT_EQ(0, stored.version & 1);
+        EXPECT_FALSE(Contexts::isEmpty(stored));
+
+        Contexts::set(tid, Contexts::empty());
+        EXPECT_TRUE(Contexts::isEmpty(Contexts::get(tid)));
+    }
+
+    TEST(Context, unsampled_flag) {
+        int tid = 10;
+        Context context = {};
+        context.spanId = 21;
+        context.version = DD_CONTEXT_UNSAMPLED;
+        Contexts::set(tid, context);
+        Context stored = Contexts::get(tid);
+        EXPECT_EQ(21, stored.spanId);
+        EXPECT_TRUE(stored.isUnsampled());
+
+        // the flag is not part of the seqlock counter
+        ContextPage page = Contexts::getPage(tid);
+        Context* slot = (Context*)(page.storage + tid * Contexts::slotSize());
+        EXPECT_EQ(0, slot->version & 1);
+        slot->version |= 1;
+        EXPECT_FALSE(Contexts::get(tid).isUnsampled());
+        slot->version += 1;
+        EXPECT_TRUE(Contexts::get(tid).isUnsampled());
+
+        context.version = 0;
+        Contexts::set(tid, context);
+        EXPECT_FALSE(Contexts::get(tid).isUnsampled());
+    }
+
     TEST(Context, maxpages) {
         // floored at 128 to mitigate unusual pid_max settings
         int minMaxPages = 128;
@@ -113,6 +401,129 @@
         EXPECT_EQ(2048, Contexts::getMaxPages(2097152));
     }
 
+    TEST(Dictionary, ids_are_stable_across_segments) {
+        Dictionary dict;
+        char key[32];
+        std::vector<unsigned int> ids;
+        // enough keys to spill over several segments
+        for (int i = 0; i < 5000; i++) {
+            snprintf(key, sizeof(key), "java/lang/Class%d", i);
+            ids.push_back(dict.lookup(key));
+        }
+        for (int i = 0; i < 5000; i++) {
+            snprintf(key, sizeof(key), "java/lang/Class%d", i);
+            EXPECT_EQ(ids[i], dict.lookup(key));
+        }
+        std::map<unsigned int, const char*> collected;
+        dict.collect(collected);
+        EXPECT_EQ(5000u, collected.size());
+        EXPECT_STREQ("java/lang/Class42", collected[ids[42]]);
+
+        // a prefix is a different key
+        EXPECT_NE(dict.lookup("java/lang/Class4", 15), dict.lookup("java/lang/Class4"));
+
+        dict.clear();
+        collected.clear();
+        dict.collect(collected);
+        EXPECT_TRUE(collected.empty());
+    }
+
+    TEST(Dictionary, bounded_lookup) {
+        Dictionary dict;
+        unsigned int a = dict.bounded_lookup("a", 1, 1);
+        EXPECT_EQ(a, dict.bounded_lookup("a", 1, 1));
+        EXPECT_EQ((unsigned int)INT_MAX, dict.bounded_lookup("b", 1, 1));
+    }
+
+    TEST(DictionaryMarks, collects_one_generation) {
+        Dictionary dict;
+        DictionaryMarks marks;
+        unsigned int a = dict.lookup("java/lang/String");
+        unsigned int b = dict.lookup("java/util/HashMap");
+        marks.reserve(a);
+        marks.reserve(b);
+        marks.mark(a);
+        marks.mark(b);
+        // an id without room for its mark is not collected
+        marks.mark(1u << 30);
+        std::map<unsigned int, const char*> collected;
+        marks.collect(&dict, collected);
+        EXPECT_EQ(2u, collected.size());
+        EXPECT_STREQ("java/util/HashMap", collected[b]);
+
+        // the marks of the previous generation are gone, the ids are not
+        marks.mark(b);
+        collected.clear();
+        marks.collect(&dict, collected);
+        EXPECT_EQ(1u, collected.size());
+        EXPECT_EQ(b, dict.lookup("java/util/HashMap"));
+
+        collected.clear();
+        marks.collect(&dict, collected);
+        EXPECT_TRUE(collected.empty());
+    }
+
+    TEST(DictionaryMarks, collects_marks_made_after_advance) {
+        Dictionary dict;
+        DictionaryMarks marks;
+        unsigned int a = dict.lookup("java/lang/String");
+        unsigned int b = dict.lookup("java/util/HashMap");
+        marks.reserve(a);
+        marks.reserve(b);
+        marks.mark(a);
+        u8 retired = marks.advance();
+        // marked again while the retired generation is still to be collected
+        marks.mark(a);
+        marks.mark(b);
+        std::map<unsigned int, const char*> collected;
+        marks.collect(&dict, collected, retired);
+        EXPECT_EQ(2u, collected.size());
+
+        // the next generation is collected as well, with the ids marked in it
+        collected.clear();
+        marks.collect(&dict, collected);
+        EXPECT_EQ(2u, collected.size());
+        EXPECT_STREQ("java/lang/String", collected[a]);
+
+        collected.clear();
+        marks.collect(&dict, collected);
+        EXPECT_TRUE(collected.empty());
+    }
+
+    TEST(BoundedDictionary, admits_popular_keys) {
+        BoundedDictionary dict(0);
+        char key[32];
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "/users/%d", i);
+            EXPECT_NE((unsigned int)INT_MAX, dict.lookup(key, strlen(key), 100));
+        }
+        unsigned int first = dict.lookup("/users/0", 8, 100);
+
+        // a key seen once does not displace the resident ones
+        EXPECT_EQ((unsigned int)INT_MAX, dict.lookup("/once", 5, 100));
+
+        // a key that keeps coming back is eventually admitted under a fresh id
+        unsigned int hot = INT_MAX;
+        for (int i = 0; i < 10 && hot == INT_MAX; i++) {
+            hot = dict.lookup("/hot", 4, 100);
+        }
+        EXPECT_NE((unsigned int)INT_MAX, hot);
+        EXPECT_GT(hot, 100u);
+
+        // the evicted key is still reported for the chunks that may reference it
+        std::map<unsigned int, const char*> collected;
+        dict.collect(collected);
+        EXPECT_EQ(101u, collected.size());
+        EXPECT_STREQ("/hot", collected[hot]);
+        EXPECT_STREQ("/users/0", collected[first]);
+        collected.clear();
+        dict.collect(collected);
+        EXPECT_EQ(101u, collected.size());
+        collected.clear();
+        dict.collect(collected);
+        EXPECT_EQ(100u, collected.size());
+    }
+
     TEST(ThreadFilter, testThreadFilter) {
         int maxTid = OS::getMaxThreadId();
         ThreadFilter filter;
@@ -141,6 +552,626 @@
         EXPECT_EQ(0, filter.size());
     }
 
+    TEST(ThreadFilter, collect_skips_emptied_words) {
+        ThreadFilter filter;
+        filter.init("");
+        // dense word, sparse words and a word emptied and refilled
+        for (int tid = 64; tid < 128; tid++) {
+            filter.add(tid);
+        }
+        filter.add(5000);
+        filter.add(70000);
+        filter.remove(5000);
+        filter.add(5001);
+        for (int tid = 64; tid < 127; tid++) {
+            filter.remove(tid);
+        }
+        std::vector<int> tids;
+        filter.collect(tids);
+        ASSERT_EQ(3, tids.size());
+        EXPECT_EQ(127, tids[0]);
+        EXPECT_EQ(5001, tids[1]);
+        EXPECT_EQ(70000, tids[2]);
+        EXPECT_EQ(3, filter.size());
+        filter.clear();
+        tids.clear();
+        filter.collect(tids);
+        EXPECT_EQ(0, tids.size());
+    }
+
+    TEST(ThreadRegistry, add_remove_reconcile) {
+        ThreadRegistry registry;
+        for (int tid = 1; tid <= 5; tid++) {
+            registry.add(tid);
+        }
+        registry.add(3);
+        registry.remove(1);
+        registry.remove(5);
+        registry.remove(42);
+
+        registry.lockShared();
+        std::vector<int> tids(registry.tids());
+        registry.unlockShared();
+        std::sort(tids.begin(), tids.end());
+        EXPECT_EQ(std::vector<int>({2, 3, 4}), tids);
+
+        registry.reconcile(std::vector<int>({4, 6, 7}));
+        registry.remove(6);
+        registry.lockShared();
+        tids = registry.tids();
+        registry.unlockShared();
+        std::sort(tids.begin(), tids.end());
+        EXPECT_EQ(std::vector<int>({4, 7}), tids);
+    }
+
+    TEST(LinearAllocator, retains_chunks_across_clears) {
+        const size_t chunk_size = 64 * 1024;
+        Counters::set(LINEAR_ALLOCATOR_CHUNKS, 0);
+        {
+            LinearAllocator allocator(chunk_size);
+            allocator.configure(true, false);
+            for (int i = 0; i < 20; i++) {
+                ASSERT_NE(nullptr, allocator.alloc(chunk_size / 4));
+            }
+            long long mapped = Counters::getCounter(LINEAR_ALLOCATOR_CHUNKS);
+            ASSERT_GT(mapped, 5);
+
+            allocator.clear();
+            EXPECT_EQ(mapped, Counters::getCounter(LINEAR_ALLOCATOR_CHUNKS));
+            // the next generation reuses the retained chunks instead of mapping new ones
+            for (int i = 0; i < 20; i++) {
+                char* p = (char*)allocator.alloc(chunk_size / 4);
+                ASSERT_NE(nullptr, p);
+                memset(p, 0x5a, chunk_size / 4);
+            }
+            EXPECT_EQ(mapped, Counters::getCounter(LINEAR_ALLOCATOR_CHUNKS));
+            allocator.clear();
+
+            // only sustained lower usage gives the memory back
+            for (int generation = 1; generation < ARENA_RELEASE_GENERATIONS; generation++) {
+                ASSERT_NE(nullptr, allocator.alloc(chunk_size / 4));
+                allocator.clear();
+                EXPECT_EQ(mapped, Counters::getCounter(LINEAR_ALLOCATOR_CHUNKS));
+            }
+            ASSERT_NE(nullptr, allocator.alloc(chunk_size / 4));
+            allocator.clear();
+            EXPECT_EQ(1, Counters::getCounter(LINEAR_ALLOCATOR_CHUNKS));
+        }
+        EXPECT_EQ(0, Counters::getCounter(LINEAR_ALLOCATOR_CHUNKS));
+    }
+
+    TEST(CallTraceStorage, frame_trie_tells_colliding_frames_apart) {
+        CallTraceStorage storage;
+        storage.enableFrameTrie(true);
+        // the key of a trie node keeps only the low 16 bits of the bci
+        ASGCT_CallFrame low[2] = {{0x10, (jmethodID)0x1000}, {0, (jmethodID)0x2000}};
+        ASGCT_CallFrame high[2] = {{0x10010, (jmethodID)0x1000}, {0, (jmethodID)0x2000}};
+        u32 low_id = storage.put(2, low, false, 1);
+        u32 high_id = storage.put(2, high, false, 1);
+        ASSERT_NE(0u, low_id);
+        ASSERT_NE(0u, high_id);
+        ASSERT_NE(low_id, high_id);
+
+        std::map<u32, CallTrace*> traces;
+        storage.collectTraces(traces);
+        ASSERT_EQ(2u, traces.size());
+        ASSERT_EQ(2, traces[low_id]->num_frames);
+        EXPECT_EQ(0x10, traces[low_id]->frames[0].bci);
+        ASSERT_EQ(2, traces[high_id]->num_frames);
+        EXPECT_EQ(0x10010, traces[high_id]->frames[0].bci);
+        EXPECT_EQ((jmethodID)0x2000, traces[high_id]->frames[1].method_id);
+    }
+
+    TEST(MethodIndex, overflows_to_the_escape) {
+        // a capacity of 16 hands out 12 indices
+        MethodIndex* index = MethodIndex::allocate(16);
+        ASSERT_NE(nullptr, index);
+        for (u64 method = 1; method <= 12; method++) {
+            EXPECT_EQ(method - 1, index->lookup(method * 0x1000));
+            EXPECT_EQ(method * 0x1000, index->method(method - 1));
+        }
+
+        // the full index still finds the methods it holds, but takes no more
+        EXPECT_EQ(PACKED_ESCAPE, index->lookup(13 * 0x1000));
+        EXPECT_EQ(PACKED_ESCAPE, index->lookup(13 * 0x1000));
+        EXPECT_EQ(PACKED_ESCAPE, index->lookup(14 * 0x1000));
+        for (u64 method = 1; method <= 12; method++) {
+            EXPECT_EQ(method - 1, index->lookup(method * 0x1000));
+        }
+        index->destroy();
+    }
+
+    TEST(MethodIndex, concurrent_inserts) {
+        // 4096 slots hand out 3072 indices, fewer than the 4000 methods looked up
+        const int methods = 4000;
+        const int threads = 4;
+        MethodIndex* index = MethodIndex::allocate(4096);
+        ASSERT_NE(nullptr, index);
+        std::vector<std::vector<u32> > results(threads, std::vector<u32>(methods));
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                // every thread goes through the same methods in a different order
+                static const int strides[threads] = {1, 3, 7, 11};
+                for (int i = 0; i < methods; i++) {
+                    int m = (i * strides[t] + t * 997) % methods;
+                    results[t][m] = index->lookup((u64)(m + 1) << 4);
+                }
+            });
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+
+        std::vector<bool> taken(3072, false);
+        int indexed = 0;
+        for (int m = 0; m < methods; m++) {
+            u64 method = (u64)(m + 1) << 4;
+            u32 found = index->lookup(method);
+            if (found == PACKED_ESCAPE) {
+                // a method that lost the race for the last index is never packed
+                for (int t = 0; t < threads; t++) {
+                    EXPECT_EQ(PACKED_ESCAPE, results[t][m]);
+                }
+                continue;
+            }
+            ASSERT_LT(found, 3072u);
+            EXPECT_FALSE(taken[found]);
+            taken[found] = true;
+            EXPECT_EQ(method, index->method(found));
+            indexed++;
+            for (int t = 0; t < threads; t++) {
+                // the escape while another thread was publishing the index
+                EXPECT_TRUE(results[t][m] == found || results[t][m] == PACKED_ESCAPE);
+            }
+        }
+        EXPECT_LE(indexed, 3072);
+        EXPECT_GT(indexed, 3000);
+        index->destroy();
+    }
+
+    TEST(StackTails, generations_follow_the_storage) {
+        Arguments args;
+        args._jstacktail = 8;
+        StackTails tails;
+        ASSERT_FALSE(tails.start(args, 16));
+        CallTraceStorage storage;
+        storage.enableStackTails(&tails);
+
+        ASGCT_CallFrame tail[2] = {{1, (jmethodID)0x3000}, {2, (jmethodID)0x4000}};
+        u64 hash = tails.store(2, tail, false);
+        ASSERT_NE(0u, hash);
+        ASGCT_CallFrame frames[2] = {{0, (jmethodID)0x1000}, {BCI_STACK_TAIL, (jmethodID)hash}};
+        u32 id = storage.put(2, frames, true, 1);
+        ASSERT_NE(0u, id);
+
+        // the dumped generation keeps its tails until it is recycled
+        storage.rotate();
+        EXPECT_EQ(NULL, tails.find(hash));
+        std::map<u32, CallTrace*> traces;
+        storage.collectTraces(traces, true);
+        ASSERT_EQ(3, traces[id]->num_frames);
+        EXPECT_EQ((jmethodID)0x4000, traces[id]->frames[2].method_id);
+        EXPECT_FALSE(traces[id]->truncated);
+        storage.recycle();
+        EXPECT_EQ(NULL, tails.find(hash, true));
+
+        // a tail stored again lands in the active generation, which the next clear forgets
+        EXPECT_EQ(hash, tails.store(2, tail, false));
+        EXPECT_NE(nullptr, tails.find(hash));
+        storage.clear();
+        EXPECT_EQ(NULL, tails.find(hash));
+    }
+
+    TEST(CallTraceStorage, compiled_pc_offset_is_not_hashed) {
+        CallTraceStorage storage;
+        // the same nmethod entry sampled at two different offsets into its code
+        ASGCT_CallFrame first[2] = {{BCI_COMPILED_PC, (jmethodID)(0x7f0000001000ULL | 0x10ULL << COMPILED_PC_SHIFT)}, {3, (jmethodID)0x2000}};
+        ASGCT_CallFrame second[2] = {{BCI_COMPILED_PC, (jmethodID)(0x7f0000001000ULL | 0x80ULL << COMPILED_PC_SHIFT)}, {3, (jmethodID)0x2000}};
+        ASGCT_CallFrame other[2] = {{BCI_COMPILED_PC, (jmethodID)(0x7f0000002000ULL | 0x10ULL << COMPILED_PC_SHIFT)}, {3, (jmethodID)0x2000}};
+        u32 first_id = storage.put(2, first, false, 1);
+        ASSERT_NE(0u, first_id);
+        EXPECT_EQ(first_id, storage.put(2, second, false, 1));
+        EXPECT_NE(first_id, storage.put(2, other, false, 1));
+    }
+
+    // Collects the stack trace pool instead of writing it to a chunk
+    class CollectingStackTraceWriter : public StackTraceWriter {
+      protected:
+        void flush(Buffer* buf) {
+            out.append(buf->data(), buf->offset());
+            buf->reset();
+        }
+
+        void flush(const char* data, size_t size) {
+            out.append(data, size);
+        }
+
+      public:
+        std::string out;
+    };
+
+    TEST(StackTraceWriter, parallel_output_equals_serial) {
+        std::vector<MethodInfo> infos(64);
+        for (size_t i = 0; i < infos.size(); i++) {
+            infos[i]._key = i + 1;
+            infos[i]._type = i % 4 == 0 ? FRAME_NATIVE : FRAME_INTERPRETED;
+            infos[i]._is_entry = i % 8 == 1;
+        }
+
+        // traces of varying depth, enough for the workers to spill their buffers more than once
+        std::vector<std::pair<u32, CallTrace*> > traces;
+        std::vector<MethodInfo*> methods;
+        for (u32 t = 0; t < 20000; t++) {
+            int depth = 1 + t % 37;
+            CallTrace* trace = (CallTrace*)malloc(sizeof(CallTrace) + depth * sizeof(ASGCT_CallFrame));
+            trace->truncated = t % 5 == 0;
+            trace->num_frames = depth;
+            for (int i = 0; i < depth; i++) {
+                trace->frames[i].bci = FrameType::encode(FRAME_JIT_COMPILED, (t + i) % 200);
+                trace->frames[i].method_id = NULL;
+                methods.push_back(&infos[(t * 7 + i) % infos.size()]);
+            }
+            traces.push_back(std::make_pair(t + 1, trace));
+        }
+
+        CollectingStackTraceWriter serial;
+        RecordingBuffer* buf = new RecordingBuffer();
+        serial.write(buf, traces, methods, 1);
+        serial.out.append(buf->data(), buf->offset());
+        for (int workers = 2; workers <= MAX_CPOOL_WORKERS; workers++) {
+            CollectingStackTraceWriter parallel;
+            buf->reset();
+            parallel.write(buf, traces, methods, workers);
+            parallel.out.append(buf->data(), buf->offset());
+            EXPECT_GT(parallel.out.size(), (size_t)JFR_EVENT_FLUSH_THRESHOLD * workers);
+            EXPECT_TRUE(parallel.out == serial.out) << workers << " workers";
+        }
+        delete buf;
+        for (size_t i = 0; i < traces.size(); i++) {
+            free(traces[i].second);
+        }
+    }
+
+    TEST(CodeCache, interned_names) {
+        char text[256];
+        CodeCache cc("libtest.so", 3);
+        cc.reserve(4);
+        cc.add(text, 16, "foo");
+        cc.add(text + 16, 16, "bar\tbaz");
+        cc.add(text + 32, 16, "foo");
+        cc.add(text + 48, 16, "bar?baz");
+        std::string long_name(NAME_CHUNK_SIZE, 'x');
+        cc.add(text + 64, 16, long_name.c_str());
+        cc.sort();
+
+        // the duplicates, also after the non-printable characters are replaced, share one name
+        EXPECT_EQ(cc.binarySearch(text), cc.binarySearch(text + 32));
+        EXPECT_EQ(cc.binarySearch(text + 16), cc.binarySearch(text + 48));
+        EXPECT_STREQ("bar?baz", cc.binarySearch(text + 16));
+        EXPECT_EQ(long_name, cc.binarySearch(text + 64));
+        EXPECT_EQ(3, NativeFunc::libIndex(cc.binarySearch(text)));
+        EXPECT_STREQ("libtest.so", cc.binarySearch(text + 128));
+
+        cc.mark([](const char* name) { return strcmp(name, "foo") == 0; });
+        CodeCache copy(cc);
+        cc.add(text + 80, 16, "foo");
+        EXPECT_TRUE(NativeFunc::isMarked(copy.binarySearch(text + 32)));
+        EXPECT_FALSE(NativeFunc::isMarked(copy.binarySearch(text + 16)));
+        EXPECT_NE(cc.binarySearch(text), copy.binarySearch(text));
+        EXPECT_STREQ("foo", copy.binarySearch(text));
+        EXPECT_EQ(6, cc.count());
+        EXPECT_EQ(5, copy.count());
+    }
+
+    TEST(MappedFile, ring_keeps_newest_chunks_in_order) {
+        FILE* tmp = tmpfile();
+        ASSERT_TRUE(tmp != NULL);
+        int fd = fileno(tmp);
+        MappedFile file(fd, 64);
+        ASSERT_TRUE(file.valid());
+
+        // five chunks of 20 bytes each do not fit into 64 bytes; only the last three can survive
+        char chunk[20];
+        for (char c = 'a'; c <= 'e'; c++) {
+            memset(chunk, c, sizeof(chunk));
+            ASSERT_EQ(10, file.write(chunk, 10));
+            ASSERT_EQ(10, file.write(chunk, 10));
+            file.finishChunk();
+        }
+        ASSERT_EQ(3, file.chunkCount());
+        for (int i = 0; i < 3; i++) {
+            EXPECT_EQ(20, file.chunkSize(i));
+        }
+        // a chunk larger than the whole ring is dropped, leaving nothing to list
+        char big[80] = {0};
+        EXPECT_EQ(-1, file.write(big, sizeof(big)));
+        EXPECT_FALSE(file.finishChunk());
+        EXPECT_EQ(3, file.chunkCount());
+
+        file.close();
+        ASSERT_EQ(60, lseek(fd, 0, SEEK_END));
+        char content[61] = {0};
+        ASSERT_EQ(60, pread(fd, content, 60, 0));
+        EXPECT_EQ(std::string(20, 'c') + std::string(20, 'd') + std::string(20, 'e'), std::string(content));
+        fclose(tmp);
+    }
+
+    TEST(MappedFile, append_leaves_the_ring_to_write) {
+        FILE* tmp = tmpfile();
+        ASSERT_TRUE(tmp != NULL);
+        int fd = fileno(tmp);
+        MappedFile file(fd, 64);
+        ASSERT_TRUE(file.valid());
+
+        char data[30];
+        memset(data, 'a', sizeof(data));
+        ASSERT_EQ(30, file.append(data, 30));
+        file.finishChunk();
+        memset(data, 'b', sizeof(data));
+        ASSERT_EQ(20, file.append(data, 20));
+        file.finishChunk();
+        memset(data, 'c', sizeof(data));
+        ASSERT_EQ(10, file.append(data, 10));
+        // the open chunk would have to wrap around
+        EXPECT_EQ(-1, file.append(data, 10));
+        ASSERT_EQ(5, file.write(data, 5));
+        ASSERT_EQ(1, file.chunkCount());
+        EXPECT_EQ(30, file.chunkStart(0));
+
+        // up to the oldest chunk, which only write() discards
+        EXPECT_EQ(15, file.append(data, 15));
+        EXPECT_EQ(-1, file.append(data, 1));
+        EXPECT_EQ(1, file.chunkCount());
+        ASSERT_EQ(1, file.write(data, 1));
+        EXPECT_EQ(0, file.chunkCount());
+        EXPECT_EQ(31, file.chunkOffset());
+        fclose(tmp);
+    }
+
+    TEST(GzipWriter, member_layout) {
+        FILE* tmp = tmpfile();
+        ASSERT_TRUE(tmp != NULL);
+        int fd = fileno(tmp);
+        std::string data;
+        for (int i = 0; i < 1000; i++) {
+            data += "123456789";
+        }
+        ASSERT_TRUE(GzipWriter(fd).write((const u8*)data.data(), data.size()));
+
+        off_t size = lseek(fd, 0, SEEK_END);
+        // the repeated digits are mostly back references
+        ASSERT_GT(size, 18);
+        ASSERT_LT(size, 1000);
+        u8 content[1000];
+        ASSERT_EQ(size, pread(fd, content, size, 0));
+        EXPECT_EQ(0x1f, content[0]);
+        EXPECT_EQ(0x8b, content[1]);
+        EXPECT_EQ(8, content[2]);
+        // fixed Huffman codes in the final block
+        EXPECT_EQ(3, content[10] & 7);
+        u32 isize = content[size - 4] | content[size - 3] << 8 | content[size - 2] << 16 | (u32)content[size - 1] << 24;
+        EXPECT_EQ(data.size(), isize);
+
+        // the check value of CRC-32 is the one of "123456789"
+        ASSERT_EQ(0, ftruncate(fd, 0));
+        ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+        ASSERT_TRUE(GzipWriter(fd).write((const u8*)"123456789", 9));
+        size = lseek(fd, 0, SEEK_END);
+        ASSERT_EQ(size, pread(fd, content, size, 0));
+        u32 crc = content[size - 8] | content[size - 7] << 8 | content[size - 6] << 16 | (u32)content[size - 5] << 24;
+        EXPECT_EQ(0xcbf43926, crc);
+        fclose(tmp);
+    }
+
+    // Decodes one LZ4 block into out, returning false on a malformed sequence
+    static bool decodeLz4Block(const u8* src, size_t size, std::vector<u8>& out) {
+        size_t ip = 0;
+        while (ip < size) {
+            u8 token = src[ip++];
+            size_t literals = token >> 4;
+            if (literals == 15) {
+                for (u8 b = 255; b == 255 && ip < size; literals += b) {
+                    b = src[ip++];
+                }
+            }
+            if (ip + literals > size) {
+                return false;
+            }
+            out.insert(out.end(), src + ip, src + ip + literals);
+            ip += literals;
+            if (ip == size) {
+                return true;
+            }
+            size_t distance = src[ip] | src[ip + 1] << 8;
+            ip += 2;
+            size_t match = (token & 15) + 4;
+            if ((token & 15) == 15) {
+                for (u8 b = 255; b == 255 && ip < size; match += b) {
+                    b = src[ip++];
+                }
+            }
+            if (distance == 0 || distance > out.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < match; i++) {
+                out.push_back(out[out.size() - distance]);
+            }
+        }
+        return false;
+    }
+
+    TEST(Lz4Writer, frame_layout) {
+        FILE* tmp = tmpfile();
+        ASSERT_TRUE(tmp != NULL);
+        int src_fd = fileno(tmp);
+        FILE* tmp_dst = tmpfile();
+        ASSERT_TRUE(tmp_dst != NULL);
+        int dst_fd = fileno(tmp_dst);
+
+        // a compressible window, an incompressible one and a short compressible tail
+        const size_t window = 64 * 1024;
+        std::vector<u8> data;
+        for (size_t i = 0; i < window; i++) {
+            data.push_back("123456789"[i % 9]);
+        }
+        u32 seed = 12345;
+        for (size_t i = 0; i < window; i++) {
+            seed = seed * 1103515245 + 12345;
+            data.push_back((u8)(seed >> 24));
+        }
+        for (size_t i = 0; i < 1000; i++) {
+            data.push_back("abc"[i % 3]);
+        }
+        ASSERT_EQ((ssize_t)data.size(), pwrite(src_fd, data.data(), data.size(), 0));
+        ASSERT_TRUE(Lz4Writer(dst_fd).compress(src_fd, 0, data.size()));
+
+        off_t size = lseek(dst_fd, 0, SEEK_END);
+        std::vector<u8> frame(size);
+        ASSERT_EQ(size, pread(dst_fd, frame.data(), size, 0));
+        ASSERT_GT(size, 7 + 4);
+        // magic, FLG with independent blocks, BD with 64 KiB blocks and the descriptor checksum byte
+        EXPECT_EQ(0x04, frame[0]);
+        EXPECT_EQ(0x22, frame[1]);
+        EXPECT_EQ(0x4d, frame[2]);
+        EXPECT_EQ(0x18, frame[3]);
+        EXPECT_EQ(0x60, frame[4]);
+        EXPECT_EQ(0x40, frame[5]);
+        EXPECT_EQ(0x82, frame[6]);
+
+        std::vector<u8> decoded;
+        std::vector<u32> block_headers;
+        size_t pos = 7;
+        while (true) {
+            ASSERT_LE(pos + 4, (size_t)size);
+            u32 header = frame[pos] | frame[pos + 1] << 8 | frame[pos + 2] << 16 | (u32)frame[pos + 3] << 24;
+            pos += 4;
+            if (header == 0) {
+                break;
+            }
+            block_headers.push_back(header);
+            size_t block = header & 0x7fffffff;
+            ASSERT_LE(pos + block, (size_t)size);
+            if (header & 0x80000000) {
+                decoded.insert(decoded.end(), frame.begin() + pos, frame.begin() + pos + block);
+            } else {
+                size_t before = decoded.size();
+                ASSERT_TRUE(decodeLz4Block(frame.data() + pos, block, decoded));
+                // no block decodes to more than the window
+                ASSERT_LE(decoded.size() - before, window);
+            }
+            pos += block;
+        }
+        // the end mark closes the frame
+        EXPECT_EQ((size_t)size, pos);
+
+        ASSERT_EQ(3u, block_headers.size());
+        EXPECT_EQ(0u, block_headers[0] & 0x80000000);
+        EXPECT_LT(block_headers[0], window / 10);
+        // the random window is stored as it is
+        EXPECT_EQ(window | 0x80000000, block_headers[1]);
+        EXPECT_EQ(0u, block_headers[2] & 0x80000000);
+        EXPECT_TRUE(decoded == data);
+        fclose(tmp_dst);
+        fclose(tmp);
+    }
+
+    TEST(PidController, integral_does_not_wind_up) {
+        // only the integral term, a target of 100 per one second window
+        PidController bounded(100, 0, 1, 0, 1, 15, 500);
+        PidController unbounded(100, 0, 1, 0, 1, 15);
+        for (int i = 0; i < 100; i++) {
+            // the output saturates, nothing comes in
+            bounded.compute(0, 1);
+            unbounded.compute(0, 1);
+        }
+        // on target, the signal is the integral term alone
+        EXPECT_DOUBLE_EQ(500, bounded.compute(100, 1));
+        EXPECT_DOUBLE_EQ(10000, unbounded.compute(100, 1));
+        // the bound holds the other way round too
+        for (int i = 0; i < 100; i++) {
+            bounded.compute(200, 1);
+        }
+        EXPECT_DOUBLE_EQ(-500, bounded.compute(100, 1));
+    }
+
+    TEST(SampleCapture, round_trip) {
+        char path[] = "/tmp/ddprof-capture-XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_NE(-1, fd);
+        close(fd);
+
+        CaptureSnapshot snapshot;
+        snapshot.attributes.push_back("tag1");
+        snapshot.methods.resize(2);
+        snapshot.methods[0].id = 1;
+        snapshot.methods[0].class_signature = "LFoo;";
+        snapshot.methods[0].name = "bar";
+        snapshot.methods[0].signature = "()V";
+        snapshot.methods[0].line_numbers.push_back(std::make_pair((jlong)0, (jint)42));
+        // an unloaded method is captured without names
+        snapshot.methods[1].id = 0;
+        snapshot.names.push_back("libc.so`write");
+        snapshot.traces.resize(1);
+        snapshot.traces[0].id = 7;
+        snapshot.traces[0].truncated = true;
+        CapturedFrame frames[] = {{BCI_NATIVE_FRAME, 0}, {3, 1}, {0, 0}, {0, (u64)-1}};
+        snapshot.traces[0].frames.assign(frames, frames + 4);
+        snapshot.context_values[5] = "value";
+        // two snapshots append to the same file
+        ASSERT_TRUE(SampleCapture::write(path, snapshot));
+        ASSERT_TRUE(SampleCapture::write(path, snapshot));
+
+        std::vector<CaptureSnapshot> snapshots;
+        ASSERT_TRUE(SampleCapture::read(path, snapshots));
+        ASSERT_EQ(2, snapshots.size());
+        for (size_t i = 0; i < snapshots.size(); i++) {
+            const CaptureSnapshot& read = snapshots[i];
+            EXPECT_EQ(snapshot.attributes, read.attributes);
+            ASSERT_EQ(2, read.methods.size());
+            EXPECT_EQ(1, read.methods[0].id);
+            EXPECT_EQ("LFoo;", read.methods[0].class_signature);
+            EXPECT_EQ("bar", read.methods[0].name);
+            EXPECT_EQ("()V", read.methods[0].signature);
+            EXPECT_EQ(snapshot.methods[0].line_numbers, read.methods[0].line_numbers);
+            EXPECT_EQ(0, read.methods[1].id);
+            EXPECT_TRUE(read.methods[1].name.empty());
+            EXPECT_EQ(snapshot.names, read.names);
+            ASSERT_EQ(1, read.traces.size());
+            EXPECT_EQ(7, read.traces[0].id);
+            EXPECT_TRUE(read.traces[0].truncated);
+            ASSERT_EQ(4, read.traces[0].frames.size());
+            for (int j = 0; j < 4; j++) {
+                EXPECT_EQ(frames[j].bci, read.traces[0].frames[j].bci);
+                EXPECT_EQ(frames[j].value, read.traces[0].frames[j].value);
+            }
+            EXPECT_EQ(snapshot.context_values, read.context_values);
+        }
+
+        // a truncated file is rejected
+        struct stat st;
+        ASSERT_EQ(0, stat(path, &st));
+        ASSERT_EQ(0, truncate(path, st.st_size - 1));
+        snapshots.clear();
+        EXPECT_FALSE(SampleCapture::read(path, snapshots));
+
+        // so is a frame referring to a method the snapshot does not hold
+        unlink(path);
+        snapshot.traces[0].frames[1].value = 2;
+        ASSERT_TRUE(SampleCapture::write(path, snapshot));
+        snapshots.clear();
+        EXPECT_FALSE(SampleCapture::read(path, snapshots));
+
+        // or a method id beyond the methods
+        unlink(path);
+        snapshot.traces[0].frames[1].value = 1;
+        snapshot.methods[0].id = 2;
+        ASSERT_TRUE(SampleCapture::write(path, snapshot));
+        snapshots.clear();
+        EXPECT_FALSE(SampleCapture::read(path, snapshots));
+        unlink(path);
+    }
+
     int main(int argc, char **argv) {
       ::testing::InitGoogleTest(&argc, argv);
       return RUN_ALL_TESTS();
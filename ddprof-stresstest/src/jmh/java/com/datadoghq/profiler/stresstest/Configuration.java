@@ -8,6 +8,8 @@ import org.openjdk.jmh.annotations.State;
 public class Configuration {
 
     public static final String BASE_COMMAND = "cpu=100us,wall=100us";
+    // runs the benchmark without the profiler, as the baseline of the overhead measurements
+    public static final String NO_PROFILER = "none";
 
     @Param({BASE_COMMAND})
     public String command;
@@ -0,0 +1,89 @@
+package com.datadoghq.profiler.stresstest;
+
+import org.openjdk.jmh.annotations.Mode;
+import org.openjdk.jmh.results.RunResult;
+import org.openjdk.jmh.runner.Runner;
+import org.openjdk.jmh.runner.options.CommandLineOptions;
+import org.openjdk.jmh.runner.options.Options;
+import org.openjdk.jmh.runner.options.OptionsBuilder;
+import org.openjdk.jmh.runner.options.TimeValue;
+import org.openjdk.jmh.util.Statistics;
+
+import java.util.ArrayList;
+import java.util.Collection;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Runs the engine overhead matrix and compares every profiler configuration to the run without the profiler
+ * at the same thread count. Exits with 1 if any configuration loses more throughput than
+ * {@code -Dddprof.overhead.throughput} percent (default: 10) or adds more than {@code -Dddprof.overhead.p99}
+ * percent (default: 50) to the p99 latency of a request.
+ */
+public class OverheadMain {
+
+    public static final String OVERHEAD_PACKAGE = "com.datadoghq.profiler.stresstest.overhead.";
+
+    public static void main(String... args) throws Exception {
+        CommandLineOptions commandLineOptions = new CommandLineOptions(args);
+        Options options = new OptionsBuilder()
+                .parent(commandLineOptions)
+                .include(OVERHEAD_PACKAGE + "*")
+                .addProfiler(WhiteboxProfiler.class)
+                .forks(commandLineOptions.getForkCount().orElse(1))
+                .warmupIterations(commandLineOptions.getWarmupIterations().orElse(1))
+                .measurementIterations(commandLineOptions.getMeasurementIterations().orElse(3))
+                .measurementTime(commandLineOptions.getMeasurementTime().orElse(TimeValue.seconds(5)))
+                .timeUnit(commandLineOptions.getTimeUnit().orElse(TimeUnit.MICROSECONDS))
+                .mode(Mode.SampleTime)
+                .build();
+        Collection<RunResult> results = new Runner(options).run();
+
+        double maxThroughputLoss = Double.parseDouble(System.getProperty("ddprof.overhead.throughput", "10"));
+        double maxP99Increase = Double.parseDouble(System.getProperty("ddprof.overhead.p99", "50"));
+        System.exit(report(results, maxThroughputLoss, maxP99Increase) ? 0 : 1);
+    }
+
+    private static boolean report(Collection<RunResult> results, double maxThroughputLoss, double maxP99Increase) {
+        Map<String, Statistics> baselines = new HashMap<>();
+        List<RunResult> profiled = new ArrayList<>();
+        for (RunResult result : results) {
+            if (Configuration.NO_PROFILER.equals(result.getParams().getParam("command"))) {
+                baselines.put(key(result), result.getPrimaryResult().getStatistics());
+            } else {
+                profiled.add(result);
+            }
+        }
+
+        boolean passed = true;
+        System.out.println(String.format("%-48s %8s %16s %14s %12s",
+                "command", "threads", "throughput loss", "p99 delta", "p99 delta"));
+        for (RunResult result : profiled) {
+            String command = result.getParams().getParam("command");
+            String threads = result.getParams().getParam("threads");
+            Statistics baseline = baselines.get(key(result));
+            if (baseline == null) {
+                System.out.println(String.format("%-48s %8s   no baseline", command, threads));
+                passed = false;
+                continue;
+            }
+            Statistics statistics = result.getPrimaryResult().getStatistics();
+            // the requests take longer on average by as much as the throughput drops
+            double throughputLoss = (1 - baseline.getMean() / statistics.getMean()) * 100;
+            double p99Delta = statistics.getPercentile(99) - baseline.getPercentile(99);
+            double p99Increase = p99Delta / baseline.getPercentile(99) * 100;
+            boolean failed = throughputLoss > maxThroughputLoss || p99Increase > maxP99Increase;
+            System.out.println(String.format("%-48s %8s %15.2f%% %11.2f %s %11.2f%%%s",
+                    command, threads, throughputLoss, p99Delta, result.getPrimaryResult().getScoreUnit(),
+                    p99Increase, failed ? "   FAILED" : ""));
+            passed &= !failed;
+        }
+        return passed;
+    }
+
+    private static String key(RunResult result) {
+        return result.getParams().getBenchmark() + "#" + result.getParams().getParam("threads");
+    }
+}
@@ -29,6 +29,9 @@ public class WhiteboxProfiler implements InternalProfiler {
 
     @Override
     public void beforeIteration(BenchmarkParams benchmarkParams, IterationParams iterationParams) {
+        if (isBaseline(benchmarkParams)) {
+            return;
+        }
         try {
             jfr = Files.createTempFile(benchmarkParams.getBenchmark() + System.currentTimeMillis(), ".jfr");
             String command = "start," + benchmarkParams.getParam("command")
@@ -41,6 +44,9 @@ public class WhiteboxProfiler implements InternalProfiler {
 
     @Override
     public Collection<? extends Result> afterIteration(BenchmarkParams benchmarkParams, IterationParams iterationParams, IterationResult result) {
+        if (isBaseline(benchmarkParams)) {
+            return Collections.emptyList();
+        }
         // TODO unit encoded in counter name for now, so results are effectively dimensionless
         try {
             JavaProfiler.getInstance().stop();
@@ -57,4 +63,8 @@ public class WhiteboxProfiler implements InternalProfiler {
             return Collections.emptyList();
         }
     }
+
+    private static boolean isBaseline(BenchmarkParams benchmarkParams) {
+        return Configuration.NO_PROFILER.equals(benchmarkParams.getParam("command"));
+    }
 }
@@ -0,0 +1,86 @@
+package com.datadoghq.profiler.stresstest.overhead;
+
+import com.datadoghq.profiler.stresstest.Configuration;
+import org.openjdk.jmh.annotations.Benchmark;
+import org.openjdk.jmh.annotations.Level;
+import org.openjdk.jmh.annotations.Param;
+import org.openjdk.jmh.annotations.Scope;
+import org.openjdk.jmh.annotations.Setup;
+import org.openjdk.jmh.annotations.State;
+import org.openjdk.jmh.annotations.TearDown;
+
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+import java.util.concurrent.ThreadLocalRandom;
+
+/**
+ * One operation is a request fanned out to all the worker threads, each of which burns some CPU and allocates.
+ * The same requests are run without the profiler and with every engine configuration, so that
+ * {@link com.datadoghq.profiler.stresstest.OverheadMain} can compare the latter to the former.
+ */
+public class EngineOverhead {
+
+    @State(Scope.Benchmark)
+    public static class BenchmarkState {
+
+        @Param({
+                Configuration.NO_PROFILER,
+                // perf_events where available, the thread CPU timers otherwise
+                "cpu=10ms",
+                "event=itimer,interval=10ms",
+                "wall=10ms,walltpt=1",
+                "wall=10ms,walltpt=16",
+                "wall=10ms,walltpt=64",
+                "memory=262144:a",
+                "memory=262144:l",
+                "cpu=10ms,wall=10ms,lightweight=yes"
+        })
+        public String command;
+
+        @Param({"1", "4", "16"})
+        public int threads;
+
+        ExecutorService workers;
+        List<Callable<Long>> tasks;
+
+        @Setup(Level.Trial)
+        public void setup() {
+            workers = Executors.newFixedThreadPool(threads);
+            tasks = new ArrayList<>(threads);
+            for (int i = 0; i < threads; i++) {
+                tasks.add(EngineOverhead::work);
+            }
+        }
+
+        @TearDown(Level.Trial)
+        public void tearDown() {
+            workers.shutdownNow();
+        }
+    }
+
+    @Benchmark
+    public long request(BenchmarkState state) throws InterruptedException, ExecutionException {
+        long result = 0;
+        for (Future<Long> future : state.workers.invokeAll(state.tasks)) {
+            result ^= future.get();
+        }
+        return result;
+    }
+
+    private static long work() {
+        long hash = ThreadLocalRandom.current().nextLong();
+        for (int i = 0; i < 16; i++) {
+            byte[] chunk = new byte[1024];
+            ThreadLocalRandom.current().nextBytes(chunk);
+            for (byte b : chunk) {
+                hash = (hash ^ b) * 0x100000001B3L;
+            }
+        }
+        return hash;
+    }
+}
@@ -287,4 +287,24 @@ public abstract class AbstractProfilerTest {
     }
     assertTrue(unmatched.isEmpty(), "couldn't find datadog.ExecutionSample with " + unmatched);
   }
+
+  protected long[] countStackTracesByThread(String eventType, String pattern, String threadName) {
+    return countStackTracesByThread(jfrDump, eventType, pattern, threadName);
+  }
+
+  // The numbers of the events with the pattern in their stack trace taken on the named thread and on the others
+  protected long[] countStackTracesByThread(Path recording, String eventType, String pattern, String threadName) {
+    long[] counts = new long[2];
+    for (IItemIterable samples : verifyEvents(recording, eventType)) {
+      IMemberAccessor<String, IItem> stackTraceAccessor = JdkAttributes.STACK_TRACE_STRING.getAccessor(samples.getType());
+      IMemberAccessor<String, IItem> threadNameAccessor = JdkAttributes.EVENT_THREAD_NAME.getAccessor(samples.getType());
+      for (IItem item : samples) {
+        String stackTrace = stackTraceAccessor.getMember(item);
+        if (stackTrace != null && stackTrace.contains(pattern)) {
+          counts[threadName.equals(threadNameAccessor.getMember(item)) ? 0 : 1]++;
+        }
+      }
+    }
+    return counts;
+  }
 }
\ No newline at end of file
@@ -4,7 +4,8 @@ import static org.junit.jupiter.api.Assertions.assertTrue;
 
 public class MoreAssertions {
 
-    public static final int DICTIONARY_PAGE_SIZE = (128 * (3 * 8 + 8) + 4);
+    // the first segment of a dictionary: header plus 256 slots
+    public static final int DICTIONARY_PAGE_SIZE = (16 + 256 * 16);
 
     public static void assertBoundedBy(long value, long maximum, String error) {
         if (value >= maximum) {
@@ -0,0 +1,56 @@
+package com.datadoghq.profiler.alloc;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.Aggregators;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.NUMBER;
+
+public class AllocationHistogramTest extends AbstractProfilerTest {
+  private static final IAttribute<IQuantity> SAMPLES = attr("samples", "samples", "", NUMBER);
+
+  @RetryingTest(5)
+  public void shouldAggregateObjectAllocationSamples() throws InterruptedException {
+    Assumptions.assumeFalse(Platform.isJ9() || Platform.isZing());
+    Assumptions.assumeTrue(Platform.isJavaVersionAtLeast(11));
+
+    AllocationProfilerTest.AllocatingTarget target1 = new AllocationProfilerTest.AllocatingTarget();
+    AllocationProfilerTest.AllocatingTarget target2 = new AllocationProfilerTest.AllocatingTarget();
+    runTests(target1, target2);
+    IItemCollection summaries = verifyEvents("datadog.ObjectAllocationSummary");
+    assertAllocations(summaries, int[].class, target1, target2);
+    assertAllocations(summaries, Integer[].class, target1, target2);
+
+    // a couple of call sites only, so the samples must have been folded into a handful of events
+    long samples = summaries.getAggregate(Aggregators.sum(SAMPLES)).longValue();
+    long events = summaries.getAggregate(Aggregators.count()).longValue();
+    assertTrue(events < samples, String.format("expected fewer summaries (%d) than samples (%d)", events, samples));
+  }
+
+  private static void assertAllocations(IItemCollection summaries, Class<?> clazz, AllocationProfilerTest.AllocatingTarget... targets) {
+    long allocated = 0;
+    for (AllocationProfilerTest.AllocatingTarget target : targets) {
+      allocated += target.getAllocated(clazz);
+    }
+    IItemCollection summariesByType = summaries.apply(allocatedTypeFilter(clazz.getCanonicalName()));
+    assertTrue(summariesByType.hasItems());
+    // the summary size is already scaled by the sample weights
+    long recorded = summariesByType.getAggregate(Aggregators.sum(SIZE)).longValue();
+    double error = Math.abs(recorded - allocated) / (double)allocated;
+    assertTrue(error <= 0.50,
+        String.format("aggregated allocations should be within 50pct tolerance of allocated memory (recorded %d, allocated %d :: %4.2f)",
+            recorded, allocated, error * 100));
+  }
+
+  @Override
+  protected String getProfilerCommand() {
+    return "memory=" + (256 * 1024) + ":h";
+  }
+}
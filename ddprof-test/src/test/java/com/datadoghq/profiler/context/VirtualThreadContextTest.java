@@ -0,0 +1,87 @@
+package com.datadoghq.profiler.context;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+import org.openjdk.jmc.flightrecorder.jdk.JdkAttributes;
+
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class VirtualThreadContextTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @RetryingTest(3)
+    public void contextFollowsVirtualThreads() throws Exception {
+        Assumptions.assumeTrue(Platform.isJavaVersionAtLeast(21) && !Platform.isJ9() && !Platform.isMac());
+        // the executor only exists since JDK 21
+        ExecutorService executor = (ExecutorService) Executors.class.getMethod("newVirtualThreadPerTaskExecutor").invoke(null);
+        List<Future<?>> futures = new ArrayList<>();
+        for (int i = 1; i <= 64; i++) {
+            long id = i;
+            futures.add(executor.submit(() -> {
+                profiler.setContext(id, id);
+                for (int round = 0; round < 5; round++) {
+                    // parking unmounts the virtual thread, which may resume on another carrier
+                    try {
+                        Thread.sleep(5);
+                    } catch (InterruptedException e) {
+                        return;
+                    }
+                    burnWithContext();
+                }
+                profiler.clearContext();
+            }));
+        }
+        for (Future<?> future : futures) {
+            future.get();
+        }
+        executor.shutdown();
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        int sampled = 0;
+        for (IItemIterable samples : events) {
+            IMemberAccessor<String, IItem> frameAccessor = JdkAttributes.STACK_TRACE_STRING.getAccessor(samples.getType());
+            IMemberAccessor<IQuantity, IItem> spanIdAccessor = SPAN_ID.getAccessor(samples.getType());
+            IMemberAccessor<IQuantity, IItem> rootSpanIdAccessor = LOCAL_ROOT_SPAN_ID.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                String stackTrace = frameAccessor.getMember(sample);
+                if (!stackTrace.contains("burnWithContext")) {
+                    continue;
+                }
+                long spanId = spanIdAccessor.getMember(sample).longValue();
+                assertTrue(spanId > 0 && spanId <= 64, "unexpected span " + spanId);
+                assertEquals(spanId, rootSpanIdAccessor.getMember(sample).longValue());
+                sampled++;
+            }
+        }
+        assertTrue(sampled > 0);
+    }
+
+    private static void burnWithContext() {
+        long blackhole = sink;
+        for (int i = 0; i < 1_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms";
+    }
+}
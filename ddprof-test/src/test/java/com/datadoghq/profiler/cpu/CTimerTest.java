@@ -0,0 +1,50 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.concurrent.ExecutionException;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+
+public class CTimerTest extends AbstractProfilerTest {
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @RetryingTest(5)
+    public void test() throws ExecutionException, InterruptedException {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        for (int i = 0, id = 1; i < 100; i++, id += 3) {
+            profiledCode.method1(id);
+        }
+        stopProfiler();
+        IItemCollection config = verifyEvents("datadog.DatadogProfilerConfig");
+        for (IItemIterable items : config) {
+            IMemberAccessor<String, IItem> cpuEngineAccessor = CPU_ENGINE.getAccessor(items.getType());
+            for (IItem item : items) {
+                assertEquals("CTimer", cpuEngineAccessor.getMember(item));
+            }
+        }
+        verifyStackTraces("datadog.ExecutionSample", "method1Impl");
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms,event=ctimer";
+    }
+}
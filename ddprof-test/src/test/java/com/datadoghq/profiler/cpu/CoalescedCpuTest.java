@@ -0,0 +1,38 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.Aggregators;
+import org.openjdk.jmc.common.item.IItemCollection;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class CoalescedCpuTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testIdenticalSamplesAreFolded() {
+        // on mac the usage of itimer to drive the sampling provides very unreliable outputs
+        Assumptions.assumeTrue(!Platform.isJ9() && !Platform.isMac());
+        long blackhole = sink;
+        for (int i = 0; i < 500_000_000; i++) {
+            blackhole = blackhole * 31 + i;
+        }
+        sink = blackhole;
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        long count = events.getAggregate(Aggregators.count()).longValue();
+        long weight = events.getAggregate(Aggregators.sum(WEIGHT)).longValue();
+        // the loop keeps hitting the same few traces, whose consecutive samples are written as one event
+        assertTrue(weight > count, "weight " + weight + " of " + count + " samples");
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        // COALESCE_SAMPLES
+        return "cpu=1ms,jfr=0x80";
+    }
+}
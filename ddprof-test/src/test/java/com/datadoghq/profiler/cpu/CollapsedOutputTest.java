@@ -0,0 +1,62 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.util.List;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertFalse;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class CollapsedOutputTest extends AbstractProfilerTest {
+    private static volatile long sink;
+    private boolean stopped;
+
+    @Test
+    public void testFoldedStacks() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        burn();
+        Path collapsed = Files.createTempFile(Paths.get("/tmp"), getClass().getName(), ".txt");
+        try {
+            dump(collapsed);
+            List<String> lines = Files.readAllLines(collapsed);
+            assertFalse(lines.isEmpty());
+            for (String line : lines) {
+                assertTrue(line.matches("\\S.* [1-9][0-9]*"), line);
+            }
+            // the root frame comes first, the sampled method last
+            assertTrue(lines.stream().anyMatch(line -> line.contains("CollapsedOutputTest.testFoldedStacks;")
+                    && line.contains("CollapsedOutputTest.burn")), lines.toString());
+        } finally {
+            Files.deleteIfExists(collapsed);
+        }
+    }
+
+    @Override
+    protected void stopProfiler() {
+        // there is no JFR recording, and so no configuration event to check
+        if (!stopped) {
+            profiler.stop();
+            stopped = true;
+        }
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 50_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,collapsed";
+    }
+}
@@ -0,0 +1,60 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.JavaProfiler.HotStacksBreakdown;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.util.Arrays;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertFalse;
+import static org.junit.jupiter.api.Assertions.assertThrows;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class HotStacksTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testHotStacksWithoutDump() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        burn();
+
+        String[] top = profiler.getHotStacks(5, HotStacksBreakdown.NONE, 0);
+        assertFalse(top.length == 0);
+        assertTrue(top.length <= 5);
+        long previous = Long.MAX_VALUE;
+        for (String entry : top) {
+            String[] fields = entry.split("\t", -1);
+            assertTrue(fields.length == 4, entry);
+            assertTrue(fields[0].isEmpty(), entry);
+            long counter = Long.parseLong(fields[2]);
+            assertTrue(counter <= previous, Arrays.toString(top));
+            previous = counter;
+        }
+        assertTrue(Arrays.stream(top).anyMatch(entry -> entry.contains("HotStacksTest.burn")), Arrays.toString(top));
+
+        String[] byEngine = profiler.getHotStacks(5, HotStacksBreakdown.ENGINE, 60_000);
+        assertTrue(Arrays.stream(byEngine).anyMatch(entry -> entry.startsWith("cpu\t")
+                && entry.contains("HotStacksTest.burn")), Arrays.toString(byEngine));
+        assertThrows(IllegalStateException.class, () -> profiler.getHotStacks(0, HotStacksBreakdown.NONE, 0));
+
+        // the queries have not taken anything away from the recording
+        stopProfiler();
+        verifyEvents("datadog.ExecutionSample");
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 50_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,hotstacks";
+    }
+}
@@ -0,0 +1,65 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import java.util.HashMap;
+import java.util.Map;
+
+import static org.junit.jupiter.api.Assertions.assertNotNull;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class LightweightAggregationTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testSamplesAreSummedPerContext() {
+        // on mac the usage of itimer to drive the sampling provides very unreliable outputs
+        Assumptions.assumeTrue(!Platform.isJ9() && !Platform.isMac());
+        profiler.setContext(42, 42);
+        burn();
+        profiler.setContext(43, 43);
+        burn();
+        profiler.clearContext();
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        // the number of events and the summed weight per span
+        Map<Long, long[]> spans = new HashMap<>();
+        for (IItemIterable samples : events) {
+            IMemberAccessor<IQuantity, IItem> spanIdAccessor = SPAN_ID.getAccessor(samples.getType());
+            IMemberAccessor<IQuantity, IItem> weightAccessor = WEIGHT.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                long[] sums = spans.computeIfAbsent(spanIdAccessor.getMember(sample).longValue(), k -> new long[2]);
+                sums[0]++;
+                sums[1] += weightAccessor.getMember(sample).longValue();
+            }
+        }
+        for (long spanId : new long[] {42, 43}) {
+            long[] sums = spans.get(spanId);
+            assertNotNull(sums, "no samples of span " + spanId + " in " + spans.keySet());
+            // the samples of a span share one event per chunk, thread state and execution mode
+            assertTrue(sums[1] > sums[0], "weight " + sums[1] + " of " + sums[0] + " samples of span " + spanId);
+        }
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 250_000_000; i++) {
+            blackhole = blackhole * 31 + i;
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,lightweight=yes";
+    }
+}
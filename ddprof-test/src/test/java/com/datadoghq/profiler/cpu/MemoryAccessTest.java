@@ -0,0 +1,74 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.item.ItemFilters;
+import org.openjdk.jmc.common.unit.IQuantity;
+import org.openjdk.jmc.flightrecorder.JfrLoaderToolkit;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+
+import static org.junit.jupiter.api.Assertions.assertNotEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.ADDRESS;
+import static org.openjdk.jmc.common.unit.UnitLookup.NUMBER;
+
+public class MemoryAccessTest extends AbstractProfilerTest {
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @RetryingTest(5)
+    public void test() throws Exception {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        for (int i = 0, id = 1; i < 100; i++, id += 3) {
+            profiledCode.method1(id);
+        }
+        Path recording = Files.createTempFile("memaccess-", ".jfr");
+        try {
+            dump(recording);
+            IItemCollection events = JfrLoaderToolkit.loadEvents(Files.newInputStream(recording))
+                    .apply(ItemFilters.type("datadog.MemoryAccessSample"));
+            // PEBS needs an Intel PMU, which virtual machines rarely expose
+            Assumptions.assumeTrue(events.hasItems());
+            long latency = 0;
+            for (IItemIterable samples : events) {
+                IMemberAccessor<IQuantity, IItem> latencyAccessor = attr("latency", "", "", NUMBER).getAccessor(samples.getType());
+                IMemberAccessor<IQuantity, IItem> addressAccessor = attr("address", "", "", ADDRESS).getAccessor(samples.getType());
+                for (IItem sample : samples) {
+                    latency += latencyAccessor.getMember(sample).longValue();
+                    // every sampled load carries the address it read from
+                    assertNotEquals(0, addressAccessor.getMember(sample).longValue());
+                }
+            }
+            assertTrue(latency > 0);
+            // the loads are attributed to the code doing them
+            verifyStackTraces(recording, "datadog.MemoryAccessSample", "burnCycles");
+        } finally {
+            Files.deleteIfExists(recording);
+        }
+        stopProfiler();
+        verifyEvents("datadog.ExecutionSample");
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,memaccess";
+    }
+}
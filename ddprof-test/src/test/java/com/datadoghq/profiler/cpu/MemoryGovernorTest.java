@@ -0,0 +1,57 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.TimeUnit;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.NUMBER;
+
+public class MemoryGovernorTest extends AbstractProfilerTest {
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @Test
+    public void testDegradedOverBudget() throws ExecutionException, InterruptedException {
+        // the governor takes one step per second
+        long deadline = System.nanoTime() + TimeUnit.SECONDS.toNanos(6);
+        for (int id = 1; System.nanoTime() < deadline; id += 3) {
+            profiledCode.method1(id);
+        }
+        stopProfiler();
+        IItemCollection events = verifyEvents("datadog.MemoryGovernorAction");
+        IAttribute<IQuantity> levelAttr = attr("level", "", "", NUMBER);
+        long level = 0;
+        for (IItemIterable actions : events) {
+            IMemberAccessor<IQuantity, IItem> levelAccessor = levelAttr.getAccessor(actions.getType());
+            for (IItem action : actions) {
+                level = Math.max(level, levelAccessor.getMember(action).longValue());
+            }
+        }
+        // any profiling needs more than the budget
+        assertTrue(level >= 2, "level: " + level);
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,membudget=1k";
+    }
+}
@@ -0,0 +1,60 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.TimeUnit;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.PLAIN_TEXT;
+
+public class OverheadGovernorTest extends AbstractProfilerTest {
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @Test
+    public void testIntervalStretched() throws ExecutionException, InterruptedException {
+        // the governor decides only once its whole window of samples has been collected
+        long deadline = System.nanoTime() + TimeUnit.SECONDS.toNanos(8);
+        for (int id = 1; System.nanoTime() < deadline; id += 3) {
+            profiledCode.method1(id);
+        }
+        stopProfiler();
+        IItemCollection events = verifyEvents("datadog.ProfilerSetting");
+        IAttribute<String> nameAttr = attr("name", "", "", PLAIN_TEXT);
+        IAttribute<String> valueAttr = attr("value", "", "", PLAIN_TEXT);
+        long stretched = 0;
+        for (IItemIterable settings : events) {
+            IMemberAccessor<String, IItem> nameAccessor = nameAttr.getAccessor(settings.getType());
+            IMemberAccessor<String, IItem> valueAccessor = valueAttr.getAccessor(settings.getType());
+            for (IItem setting : settings) {
+                if ("cpuInterval".equals(nameAccessor.getMember(setting))) {
+                    stretched = Math.max(stretched, Long.parseLong(valueAccessor.getMember(setting)));
+                }
+            }
+        }
+        // any sampling is more expensive than the budget
+        assertTrue(stretched > TimeUnit.MILLISECONDS.toNanos(1), "interval: " + stretched);
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,cpubudget=0.00001";
+    }
+}
@@ -0,0 +1,49 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+
+import java.util.concurrent.ExecutionException;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class PerCpuPerfTest extends AbstractProfilerTest {
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @RetryingTest(5)
+    public void test() throws ExecutionException, InterruptedException {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        for (int i = 0, id = 1; i < 100; i++, id += 3) {
+            profiledCode.method1(id);
+        }
+        stopProfiler();
+        // without the privileges for CPU events the engine falls back to per-thread events,
+        // either way the samples must be attributed to the threads running the profiled code
+        verifyStackTraces("datadog.ExecutionSample", "method1Impl");
+        String testThread = Thread.currentThread().getName();
+        long[] method2 = countStackTracesByThread("datadog.ExecutionSample", "method2Impl", testThread);
+        assertTrue(method2[0] > 0, "method2Impl was not sampled on " + testThread);
+        assertEquals(0, method2[1], "method2Impl was sampled on another thread");
+        // method3Impl runs on the executor thread only
+        long[] method3 = countStackTracesByThread("datadog.ExecutionSample", "method3Impl", testThread);
+        assertEquals(0, method3[0], "method3Impl was sampled on " + testThread);
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms,perfcpu";
+    }
+}
@@ -0,0 +1,48 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+
+import java.util.concurrent.ExecutionException;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class PerfDrainTest extends AbstractProfilerTest {
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @RetryingTest(5)
+    public void test() throws ExecutionException, InterruptedException {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        for (int i = 0, id = 1; i < 100; i++, id += 3) {
+            profiledCode.method1(id);
+        }
+        stopProfiler();
+        // draining the backlog must not change which record the signal's own sample gets its stack from
+        verifyStackTraces("datadog.ExecutionSample", "method1Impl");
+        // nor the thread a drained record is attributed to
+        String testThread = Thread.currentThread().getName();
+        long[] method2 = countStackTracesByThread("datadog.ExecutionSample", "method2Impl", testThread);
+        assertTrue(method2[0] > 0, "method2Impl was not sampled on " + testThread);
+        assertEquals(0, method2[1], "method2Impl was sampled on another thread");
+        long[] method3 = countStackTracesByThread("datadog.ExecutionSample", "method3Impl", testThread);
+        assertEquals(0, method3[0], "method3Impl was sampled on " + testThread);
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,perfpages=8,perfdrain";
+    }
+}
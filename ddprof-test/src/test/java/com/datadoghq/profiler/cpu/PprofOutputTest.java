@@ -0,0 +1,66 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.util.concurrent.ThreadLocalRandom;
+import java.util.zip.GZIPInputStream;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class PprofOutputTest extends AbstractProfilerTest {
+    private static volatile long sink;
+    private final Path pprof = Paths.get("/tmp", getClass().getName() + "-" + System.nanoTime() + ".pb.gz");
+
+    @Test
+    public void testChunksAreAlsoWrittenAsPprof() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        try {
+            burn();
+            stopProfiler();
+            // the JFR recording is still there
+            verifyEvents("datadog.ExecutionSample");
+
+            String profile = decompress(pprof);
+            assertTrue(profile.contains("cpu-samples"));
+            assertTrue(profile.contains("nanoseconds"));
+            assertTrue(profile.contains("PprofOutputTest.burn"));
+        } finally {
+            Files.deleteIfExists(pprof);
+        }
+    }
+
+    private static String decompress(Path path) throws IOException {
+        try (InputStream in = new GZIPInputStream(Files.newInputStream(path))) {
+            ByteArrayOutputStream out = new ByteArrayOutputStream();
+            byte[] buffer = new byte[8192];
+            for (int read; (read = in.read(buffer)) > 0; ) {
+                out.write(buffer, 0, read);
+            }
+            // the string table is plain UTF-8 within the protobuf message
+            return new String(out.toByteArray(), StandardCharsets.ISO_8859_1);
+        }
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 50_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,pprof=" + pprof;
+    }
+}
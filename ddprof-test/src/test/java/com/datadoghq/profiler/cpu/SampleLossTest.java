@@ -0,0 +1,114 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.ArrayList;
+import java.util.HashSet;
+import java.util.List;
+import java.util.Set;
+import java.util.concurrent.atomic.AtomicBoolean;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.NUMBER;
+import static org.openjdk.jmc.common.unit.UnitLookup.PLAIN_TEXT;
+
+public class SampleLossTest extends AbstractProfilerTest {
+    private static final IAttribute<String> ENGINE = attr("engine", "", "", PLAIN_TEXT);
+    private static final IAttribute<IQuantity> LOCK_CONTENTION = attr("lockContention", "", "", NUMBER);
+
+    private static volatile long sink;
+
+    @Test
+    public void testEveryEngineReports() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        registerCurrentThreadForWallClockProfiling();
+        try (ProfiledCode profiledCode = new ProfiledCode(profiler)) {
+            for (int i = 0, id = 1; i < 100; i++, id += 3) {
+                profiledCode.method1(id);
+            }
+        }
+        stopProfiler();
+
+        Set<String> engines = new HashSet<>();
+        for (IItemIterable losses : verifyEvents("datadog.SampleLoss")) {
+            IMemberAccessor<String, IItem> engineAccessor = ENGINE.getAccessor(losses.getType());
+            for (IItem loss : losses) {
+                engines.add(engineAccessor.getMember(loss));
+            }
+        }
+        assertTrue(engines.contains("cpu"), engines.toString());
+        assertTrue(engines.contains("wall"), engines.toString());
+    }
+
+    @RetryingTest(3)
+    public void testLockContentionIsCounted() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        // a dump holds all the sample locks, so the samples taken meanwhile are lost to lock contention
+        List<Thread> threads = new ArrayList<>();
+        AtomicBoolean done = new AtomicBoolean();
+        for (int i = 0; i < 4; i++) {
+            Thread thread = new Thread(() -> {
+                registerCurrentThreadForWallClockProfiling();
+                long value = 0;
+                while (!done.get()) {
+                    value = value * 31 + System.nanoTime();
+                }
+                sink = value;
+            });
+            thread.setDaemon(true);
+            thread.start();
+            threads.add(thread);
+        }
+        long lockContention = 0;
+        try {
+            for (int i = 0; i < 20; i++) {
+                Path recording = Files.createTempFile("sample-loss-", ".jfr");
+                try {
+                    dump(recording);
+                    lockContention += sumLockContention(verifyEvents(recording, "datadog.SampleLoss"));
+                } finally {
+                    Files.deleteIfExists(recording);
+                }
+            }
+        } finally {
+            done.set(true);
+            for (Thread thread : threads) {
+                thread.join();
+            }
+        }
+        stopProfiler();
+        lockContention += sumLockContention(verifyEvents("datadog.SampleLoss"));
+        assertTrue(lockContention > 0, "no sample was lost to lock contention");
+    }
+
+    private static long sumLockContention(IItemCollection events) {
+        long sum = 0;
+        for (IItemIterable losses : events) {
+            IMemberAccessor<IQuantity, IItem> lockContentionAccessor = LOCK_CONTENTION.getAccessor(losses.getType());
+            for (IItem loss : losses) {
+                long lockContention = lockContentionAccessor.getMember(loss).longValue();
+                assertTrue(lockContention >= 0);
+                sum += lockContention;
+            }
+        }
+        return sum;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,wall=1ms";
+    }
+}
@@ -0,0 +1,71 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCFrame;
+import org.openjdk.jmc.common.IMCStackTrace;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class ScopeFramesTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testCompiledFrames() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        for (int i = 0; i < 20; i++) {
+            burn();
+        }
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        int burning = 0;
+        int compiled = 0;
+        for (IItemIterable samples : events) {
+            IMemberAccessor<IMCStackTrace, IItem> stackTraceAccessor = STACK_TRACE.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                IMCStackTrace stackTrace = stackTraceAccessor.getMember(sample);
+                if (stackTrace == null) {
+                    continue;
+                }
+                boolean inBurn = false;
+                for (IMCFrame frame : stackTrace.getFrames()) {
+                    // the recorded PCs never make it to the recording as frames of their own
+                    assertTrue(frame.getMethod() != null && frame.getMethod().getMethodName() != null);
+                    if ("burn".equals(frame.getMethod().getMethodName())) {
+                        inBurn = true;
+                        if (frame.getType() == IMCFrame.Type.JIT_COMPILED || frame.getType() == IMCFrame.Type.INLINED) {
+                            compiled++;
+                        }
+                    }
+                }
+                if (inBurn) {
+                    burning++;
+                }
+            }
+        }
+        assertTrue(burning > 0);
+        assertTrue(compiled > 0, compiled + " of " + burning + " samples have burn() compiled");
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 10_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,scopeframes";
+    }
+}
@@ -0,0 +1,76 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.Aggregators;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import java.util.Set;
+import java.util.concurrent.ExecutionException;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.NUMBER;
+
+public class SpanSummaryTest extends AbstractProfilerTest {
+    private static final IAttribute<IQuantity> CPU_SAMPLES = attr("cpuSamples", "cpuSamples", "", NUMBER);
+
+    private ProfiledCode profiledCode;
+
+    @Override
+    protected void before() {
+        profiledCode = new ProfiledCode(profiler);
+    }
+
+    @RetryingTest(5)
+    public void shouldSummarizeSamplesPerSpan() throws ExecutionException, InterruptedException {
+        Assumptions.assumeTrue(!Platform.isJ9() && !Platform.isMac());
+        for (int i = 0, id = 1; i < 100; i++, id += 3) {
+            profiledCode.method1(id);
+        }
+        stopProfiler();
+
+        Set<Long> spanIds = profiledCode.allSampledSpanIds();
+        IItemCollection summaries = verifyEvents("datadog.SpanSummary");
+        for (IItemIterable items : summaries) {
+            IMemberAccessor<IQuantity, IItem> spanIdAccessor = SPAN_ID.getAccessor(items.getType());
+            IMemberAccessor<IQuantity, IItem> rootSpanIdAccessor = LOCAL_ROOT_SPAN_ID.getAccessor(items.getType());
+            for (IItem item : items) {
+                long spanId = spanIdAccessor.getMember(item).longValue();
+                long rootSpanId = rootSpanIdAccessor.getMember(item).longValue();
+                assertTrue(spanIds.contains(spanId), "unknown span " + spanId);
+                assertTrue(spanId - rootSpanId >= 0 && spanId - rootSpanId <= 2, spanId + " is not a span of " + rootSpanId);
+            }
+        }
+
+        // the summaries also count the samples whose stack could not be recorded
+        long summarized = summaries.getAggregate(Aggregators.sum(CPU_SAMPLES)).longValue();
+        long sampled = 0;
+        for (IItemIterable samples : verifyEvents("datadog.ExecutionSample")) {
+            IMemberAccessor<IQuantity, IItem> spanIdAccessor = SPAN_ID.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                if (spanIdAccessor.getMember(sample).longValue() != 0) {
+                    sampled++;
+                }
+            }
+        }
+        assertTrue(summarized >= sampled, String.format("summarized %d samples, recorded %d", summarized, sampled));
+    }
+
+    @Override
+    protected void after() throws Exception {
+        profiledCode.close();
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms,spansummary";
+    }
+}
@@ -0,0 +1,69 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCFrame;
+import org.openjdk.jmc.common.IMCStackTrace;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class StackTailTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testStitchedTails() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        for (int i = 0; i < 10; i++) {
+            recurse(200);
+        }
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        int deep = 0;
+        int stitched = 0;
+        for (IItemIterable samples : events) {
+            IMemberAccessor<IMCStackTrace, IItem> stackTraceAccessor = STACK_TRACE.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                IMCStackTrace stackTrace = stackTraceAccessor.getMember(sample);
+                if (stackTrace == null || stackTrace.getFrames().size() < 32) {
+                    continue;
+                }
+                deep++;
+                // the test method lies 200 frames below the sampled one, far beyond jstackdepth
+                for (IMCFrame frame : stackTrace.getFrames()) {
+                    if ("testStitchedTails".equals(frame.getMethod().getMethodName())) {
+                        stitched++;
+                        break;
+                    }
+                }
+            }
+        }
+        assertTrue(deep > 0);
+        assertTrue(stitched > 0, stitched + " of " + deep + " deep samples have their tail");
+    }
+
+    private static void recurse(int depth) {
+        if (depth > 0) {
+            recurse(depth - 1);
+            return;
+        }
+        long blackhole = sink;
+        for (int i = 0; i < 10_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,jstackdepth=32,jstacktail=256";
+    }
+}
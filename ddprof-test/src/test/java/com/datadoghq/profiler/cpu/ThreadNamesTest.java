@@ -0,0 +1,75 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCThread;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.flightrecorder.JfrAttributes;
+
+import java.util.ArrayList;
+import java.util.HashSet;
+import java.util.List;
+import java.util.Set;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class ThreadNamesTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testNamesOfStartedThreads() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        // the names of threads started while profiling are resolved only when the chunk is dumped,
+        // or when the threads end before that
+        List<Thread> shortLived = new ArrayList<>();
+        for (int i = 0; i < 8; i++) {
+            shortLived.add(new Thread(ThreadNamesTest::burn, "short-lived-" + i));
+        }
+        for (Thread thread : shortLived) {
+            thread.start();
+        }
+        for (Thread thread : shortLived) {
+            thread.join();
+        }
+        Thread running = new Thread(() -> {
+            while (!Thread.currentThread().isInterrupted()) {
+                burn();
+            }
+        }, "still-running");
+        running.start();
+        Thread.sleep(500);
+        stopProfiler();
+        running.interrupt();
+        running.join();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        Set<String> names = new HashSet<>();
+        for (IItemIterable samples : events) {
+            IMemberAccessor<IMCThread, IItem> threadAccessor = JfrAttributes.EVENT_THREAD.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                names.add(threadAccessor.getMember(sample).getThreadName());
+            }
+        }
+        assertTrue(names.stream().anyMatch(name -> name.startsWith("short-lived-")), names.toString());
+        assertTrue(names.contains("still-running"), names.toString());
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 5_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms";
+    }
+}
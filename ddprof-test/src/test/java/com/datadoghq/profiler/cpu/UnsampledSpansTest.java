@@ -0,0 +1,57 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import java.util.HashSet;
+import java.util.Set;
+
+import static org.junit.jupiter.api.Assertions.assertFalse;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class UnsampledSpansTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testUnsampledSpansAreDropped() {
+        // on mac the usage of itimer to drive the sampling provides very unreliable outputs
+        Assumptions.assumeTrue(!Platform.isJ9() && !Platform.isMac());
+        profiler.setContext(42, 42, false);
+        burn();
+        profiler.setContext(43, 43, true);
+        burn();
+        profiler.clearContext();
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        Set<Long> spanIds = new HashSet<>();
+        for (IItemIterable samples : events) {
+            IMemberAccessor<IQuantity, IItem> spanIdAccessor = SPAN_ID.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                spanIds.add(spanIdAccessor.getMember(sample).longValue());
+            }
+        }
+        assertFalse(spanIds.contains(42L), spanIds.toString());
+        assertTrue(spanIds.contains(43L), spanIds.toString());
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 200_000_000; i++) {
+            blackhole = blackhole * 31 + i;
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,unsampled=drop";
+    }
+}
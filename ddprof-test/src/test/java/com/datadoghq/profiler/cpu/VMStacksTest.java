@@ -0,0 +1,79 @@
+package com.datadoghq.profiler.cpu;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCFrame;
+import org.openjdk.jmc.common.IMCStackTrace;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.Map;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class VMStacksTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testJavaFrames() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        for (int i = 0; i < 20; i++) {
+            burn();
+        }
+        Map<String, Long> debugCounters = profiler.getDebugCounters();
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ExecutionSample");
+        int sampled = 0;
+        int burning = 0;
+        int complete = 0;
+        for (IItemIterable samples : events) {
+            IMemberAccessor<IMCStackTrace, IItem> stackTraceAccessor = STACK_TRACE.getAccessor(samples.getType());
+            for (IItem sample : samples) {
+                sampled++;
+                IMCStackTrace stackTrace = stackTraceAccessor.getMember(sample);
+                if (stackTrace == null) {
+                    continue;
+                }
+                boolean inBurn = false;
+                boolean inTest = false;
+                for (IMCFrame frame : stackTrace.getFrames()) {
+                    assertTrue(frame.getMethod() != null && frame.getMethod().getMethodName() != null);
+                    String name = frame.getMethod().getMethodName();
+                    inBurn |= "burn".equals(name);
+                    // burn() is called from the test method, whether it was walked natively or by AGCT
+                    inTest |= inBurn && "testJavaFrames".equals(name);
+                }
+                if (inBurn) {
+                    burning++;
+                    if (inTest) {
+                        complete++;
+                    }
+                }
+            }
+        }
+        assertTrue(burning > 0);
+        assertTrue(complete > burning / 2, complete + " of " + burning + " samples reach the test method");
+        // most stacks are walked through VMStructs rather than by AsyncGetCallTrace
+        long fallbacks = debugCounters.get("vm_walk_fallbacks");
+        assertTrue(fallbacks < sampled / 2, fallbacks + " fallbacks for " + sampled + " samples, " + debugCounters);
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 10_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,vmstacks";
+    }
+}
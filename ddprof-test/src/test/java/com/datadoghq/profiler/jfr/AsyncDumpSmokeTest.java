@@ -0,0 +1,54 @@
+package com.datadoghq.profiler.jfr;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.junit.jupiter.api.Timeout;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.concurrent.Future;
+import java.util.concurrent.TimeUnit;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class AsyncDumpSmokeTest extends AbstractProfilerTest {
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,cstack=fp";
+    }
+
+    @Test
+    @Timeout(value = 60)
+    public void test() throws Exception {
+        Assumptions.assumeTrue(Platform.isJavaVersionAtLeast(11));
+        Assumptions.assumeFalse(Platform.isJ9());
+
+        for (int j = 0; j < 5; j++) {
+            Path recording = Files.createTempFile("async-dump-", ".jfr");
+            try {
+                for (int i = 0; i < 50; i++) {
+                    burn();
+                }
+                Future<Void> done = profiler.dumpAsync(recording);
+                done.get(30, TimeUnit.SECONDS);
+                assertTrue(done.isDone());
+                verifyStackTraces(recording, "datadog.ExecutionSample", "burn");
+            } finally {
+                Files.deleteIfExists(recording);
+            }
+        }
+        stopProfiler();
+    }
+
+    private static volatile int value;
+
+    private static void burn() {
+        for (int i = 0; i < 1000000; ++i) {
+            ++value;
+        }
+    }
+}
@@ -0,0 +1,44 @@
+package com.datadoghq.profiler.jfr;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.util.Map;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class ChunkRotationTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testChunksSealedWithoutDump() throws Exception {
+        Assumptions.assumeFalse(Platform.isJ9());
+        long deadline = System.currentTimeMillis() + 5000;
+        while (System.currentTimeMillis() < deadline) {
+            burn();
+        }
+        Map<String, Long> debugCounters = profiler.getDebugCounters();
+        assertTrue(debugCounters.get("chunk_rotations") > 0, debugCounters.toString());
+        stopProfiler();
+
+        // the sealed chunks are part of the dumped recording
+        verifyStackTraces("datadog.ExecutionSample", "burn");
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 1_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,chunktime=1s";
+    }
+}
@@ -0,0 +1,64 @@
+package com.datadoghq.profiler.jfr;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.junit.jupiter.api.Timeout;
+
+import java.nio.ByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.StandardOpenOption;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class MemoryDumpSmokeTest extends AbstractProfilerTest {
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,cstack=fp";
+    }
+
+    @Test
+    @Timeout(value = 60)
+    public void test() throws Exception {
+        Assumptions.assumeTrue(Platform.isJavaVersionAtLeast(11));
+        Assumptions.assumeTrue(Platform.isLinux());
+        Assumptions.assumeFalse(Platform.isJ9());
+
+        for (int j = 0; j < 5; j++) {
+            for (int i = 0; i < 50; i++) {
+                burn();
+            }
+            ByteBuffer buffer = profiler.dumpToMemory();
+            Path recording = Files.createTempFile("memory-dump-", ".jfr");
+            try {
+                assertTrue(buffer.isReadOnly());
+                // every chunk starts with the 'FLR\0' magic
+                assertEquals(0x464c5200, buffer.getInt(0));
+                try (FileChannel channel = FileChannel.open(recording, StandardOpenOption.WRITE)) {
+                    while (buffer.hasRemaining()) {
+                        channel.write(buffer);
+                    }
+                }
+                verifyStackTraces(recording, "datadog.ExecutionSample", "burn");
+            } finally {
+                profiler.release(buffer);
+                Files.deleteIfExists(recording);
+            }
+        }
+        stopProfiler();
+    }
+
+    private static volatile int value;
+
+    private static void burn() {
+        for (int i = 0; i < 1000000; ++i) {
+            ++value;
+        }
+    }
+}
@@ -0,0 +1,82 @@
+package com.datadoghq.profiler.jfr;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class ShmRingTest extends AbstractProfilerTest {
+    private static final String RING_NAME = "ddprof-shmring-test-" + System.nanoTime();
+    private static volatile long sink;
+
+    @Test
+    public void testChunksArePublished() throws Exception {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        burn();
+        // the recording ends with its last chunk, which is published like the ones before
+        stopProfiler();
+
+        Path ring = Paths.get("/dev/shm", RING_NAME);
+        try (FileChannel channel = FileChannel.open(ring, StandardOpenOption.READ)) {
+            MappedByteBuffer buffer = channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size());
+            buffer.order(ByteOrder.nativeOrder());
+            byte[] magic = new byte[8];
+            buffer.get(magic);
+            assertEquals("DDSHMRNG", new String(magic, StandardCharsets.US_ASCII));
+            assertEquals(1, buffer.getInt(8));
+            int headerSize = buffer.getInt(12);
+            long capacity = buffer.getLong(16);
+            long writePos = buffer.getLong(64);
+            assertEquals(0, buffer.getLong(128));
+            assertTrue(writePos > 0 && writePos <= capacity, "write_pos=" + writePos);
+
+            int chunks = 0;
+            for (long pos = 0; pos < writePos; ) {
+                int offset = (int) (headerSize + pos);
+                int size = buffer.getInt(offset);
+                int type = buffer.getInt(offset + 4);
+                if (type == 1) {
+                    ByteBuffer chunk = buffer.duplicate();
+                    chunk.position(offset + 8);
+                    byte[] chunkMagic = new byte[4];
+                    chunk.get(chunkMagic);
+                    assertEquals("FLR\0", new String(chunkMagic, StandardCharsets.US_ASCII));
+                    chunks++;
+                } else {
+                    assertEquals(0, type);
+                }
+                pos += (8 + size + 7) & ~7L;
+            }
+            assertTrue(chunks > 0);
+        } finally {
+            Files.deleteIfExists(ring);
+        }
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 20_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,shmring=" + RING_NAME;
+    }
+}
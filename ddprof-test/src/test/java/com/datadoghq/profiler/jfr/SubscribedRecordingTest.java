@@ -0,0 +1,51 @@
+package com.datadoghq.profiler.jfr;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertThrows;
+
+public class SubscribedRecordingTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testSamplesFanOut() throws Exception {
+        Assumptions.assumeFalse(Platform.isJ9());
+        Path diagnostic = Files.createTempFile("subscribed-", ".jfr");
+        try {
+            profiler.execute("subscribe,file=" + diagnostic + ",cpu=4ms");
+            // the same file can not take two recordings
+            assertThrows(IllegalStateException.class, () -> profiler.execute("subscribe,file=" + diagnostic));
+            for (int i = 0; i < 20; i++) {
+                burn();
+            }
+            profiler.execute("unsubscribe,file=" + diagnostic);
+            verifyStackTraces(diagnostic, "datadog.ExecutionSample", "burn");
+        } finally {
+            Files.deleteIfExists(diagnostic);
+        }
+        stopProfiler();
+        // the continuous recording carries on with all of its samples
+        verifyStackTraces("datadog.ExecutionSample", "burn");
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 5_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms";
+    }
+}
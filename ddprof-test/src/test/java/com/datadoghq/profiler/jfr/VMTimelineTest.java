@@ -0,0 +1,42 @@
+package com.datadoghq.profiler.jfr;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+
+import java.util.concurrent.ThreadLocalRandom;
+
+public class VMTimelineTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testVMActivity() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        for (int i = 0; i < 5; i++) {
+            // a full collection is a stop-the-world pause in a safepoint
+            System.gc();
+            burn();
+        }
+        stopProfiler();
+
+        verifyEvents("datadog.GCPause");
+        verifyEvents("datadog.Safepoint");
+        if (Platform.isJavaVersionAtLeast(11)) {
+            verifyEvents("datadog.Compilation");
+        }
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 5_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms,vmtimeline=100us";
+    }
+}
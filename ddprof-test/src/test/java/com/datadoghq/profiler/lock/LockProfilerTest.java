@@ -0,0 +1,113 @@
+package com.datadoghq.profiler.lock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCStackTrace;
+import org.openjdk.jmc.common.IMCType;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.HashSet;
+import java.util.Set;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.locks.ReentrantLock;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.CLASS;
+
+public class LockProfilerTest extends AbstractProfilerTest {
+    private static final IAttribute<IMCType> MONITOR_CLASS = attr("monitorClass", "", "", CLASS);
+    private static final IAttribute<IMCType> PARKED_CLASS = attr("parkedClass", "", "", CLASS);
+
+    private static final class Monitor {
+    }
+
+    private final Monitor monitor = new Monitor();
+    private final ReentrantLock lock = new ReentrantLock();
+
+    @Test
+    public void testContendedLocks() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        contend(() -> {
+            synchronized (monitor) {
+                sleep();
+            }
+        });
+        contend(() -> {
+            lock.lock();
+            try {
+                sleep();
+            } finally {
+                lock.unlock();
+            }
+        });
+        stopProfiler();
+
+        IItemCollection monitorEvents = verifyEvents("datadog.JavaMonitorEnter");
+        assertTrue(classes(monitorEvents, MONITOR_CLASS).contains(Monitor.class.getName()));
+        IItemCollection parkEvents = verifyEvents("datadog.ThreadPark");
+        assertTrue(classes(parkEvents, PARKED_CLASS).stream()
+                .anyMatch(name -> name.startsWith(ReentrantLock.class.getName())));
+        for (IItemIterable events : parkEvents) {
+            IMemberAccessor<IMCStackTrace, IItem> stackTraceAccessor = STACK_TRACE.getAccessor(events.getType());
+            for (IItem event : events) {
+                assertTrue(stackTraceAccessor.getMember(event) != null);
+            }
+        }
+    }
+
+    private static Set<String> classes(IItemCollection events, IAttribute<IMCType> attribute) {
+        Set<String> names = new HashSet<>();
+        for (IItemIterable items : events) {
+            IMemberAccessor<IMCType, IItem> accessor = attribute.getAccessor(items.getType());
+            for (IItem item : items) {
+                IMCType type = accessor.getMember(item);
+                if (type != null) {
+                    names.add(type.getFullName());
+                }
+            }
+        }
+        return names;
+    }
+
+    private static void contend(Runnable task) throws InterruptedException {
+        CountDownLatch start = new CountDownLatch(1);
+        Thread[] threads = new Thread[4];
+        for (int i = 0; i < threads.length; i++) {
+            threads[i] = new Thread(() -> {
+                try {
+                    start.await();
+                } catch (InterruptedException e) {
+                    return;
+                }
+                for (int j = 0; j < 20; j++) {
+                    task.run();
+                }
+            });
+            threads[i].start();
+        }
+        start.countDown();
+        for (Thread thread : threads) {
+            thread.join();
+        }
+    }
+
+    private static void sleep() {
+        try {
+            Thread.sleep(2);
+        } catch (InterruptedException e) {
+            Thread.currentThread().interrupt();
+        }
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "lock=0";
+    }
+}
@@ -0,0 +1,23 @@
+package com.datadoghq.profiler.memleak;
+
+import com.datadoghq.profiler.Platform;
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.junit.jupiter.api.Assumptions;
+
+public class LiveSetSummaryTest extends AbstractProfilerTest {
+    @Override
+    protected String getProfilerCommand() {
+        return "memory=524288:L,cstack=fp";
+    }
+
+    @RetryingTest(5)
+    public void shouldGetLiveSetSummaries() throws InterruptedException {
+        Assumptions.assumeFalse(System.getProperty("java.version").contains("1.8") || Platform.isJ9() || Platform.isZing());
+        MemleakProfilerTest.MemLeakTarget target1 = new MemleakProfilerTest.MemLeakTarget();
+        MemleakProfilerTest.MemLeakTarget target2 = new MemleakProfilerTest.MemLeakTarget();
+        runTests(target1, target2);
+        verifyEvents("datadog.HeapLiveObjectSummary");
+        verifyEvents("datadog.HeapUsage");
+    }
+}
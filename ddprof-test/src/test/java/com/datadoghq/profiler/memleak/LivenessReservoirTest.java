@@ -0,0 +1,67 @@
+package com.datadoghq.profiler.memleak;
+
+import com.datadoghq.profiler.Platform;
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.flightrecorder.jdk.JdkAttributes;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class LivenessReservoirTest extends AbstractProfilerTest {
+    @Override
+    protected String getProfilerCommand() {
+        // a small interval makes the live objects overflow the largest tracking table
+        return "memory=256:L,cstack=fp";
+    }
+
+    @RetryingTest(3)
+    public void shouldKeepTheReservoirWhileTheTableHoldsEntries() throws Exception {
+        Assumptions.assumeFalse(System.getProperty("java.version").contains("1.8") || Platform.isJ9() || Platform.isZing());
+        byte[][] retained = new byte[1_500_000][];
+        for (int i = 0; i < retained.length; i++) {
+            retained[i] = new byte[48];
+        }
+        // the compaction makes room again, but the surviving entries still stand for a reservoir
+        for (int i = 0; i < retained.length; i += 2) {
+            retained[i] = null;
+        }
+        System.gc();
+
+        double[] rates = new double[3];
+        for (int i = 0; i < rates.length; i++) {
+            Path recording = Files.createTempFile("liveness-", ".jfr");
+            try {
+                dump(recording);
+                rates[i] = retentionRate(verifyEvents(recording, "jdk.ActiveSetting"));
+            } finally {
+                Files.deleteIfExists(recording);
+            }
+        }
+        assertTrue(retained[retained.length - 1] != null);
+        Assumptions.assumeTrue(rates[0] < 1 || rates[1] < 1, "the tracking table did not overflow");
+        assertTrue(rates[2] < 1, "the reservoir was reset while the table held entries: " + rates[2]);
+    }
+
+    // the highest rate reported by any chunk of the recording, 1 when none is reported
+    private static double retentionRate(IItemCollection activeSettings) {
+        double rate = -1;
+        for (IItemIterable activeSetting : activeSettings) {
+            IMemberAccessor<String, IItem> nameAccessor = JdkAttributes.REC_SETTING_NAME.getAccessor(activeSetting.getType());
+            IMemberAccessor<String, IItem> valueAccessor = JdkAttributes.REC_SETTING_VALUE.getAccessor(activeSetting.getType());
+            for (IItem item : activeSetting) {
+                if ("retention rate".equals(nameAccessor.getMember(item))) {
+                    rate = Math.max(rate, Double.parseDouble(valueAccessor.getMember(item)));
+                }
+            }
+        }
+        return rate < 0 ? 1 : rate;
+    }
+}
@@ -20,7 +20,7 @@ import org.junit.jupiter.api.Assumptions;
 public class MemleakProfilerTest extends AbstractProfilerTest {
     @Override
     protected String getProfilerCommand() {
-        return "memory=524288:L,cstack=fp";
+        return "memory=524288:Lo,cstack=fp";
     }
 
     @RetryingTest(5)
@@ -0,0 +1,13 @@
+package com.datadoghq.profiler.nativelibs;
+
+import com.datadoghq.profiler.Platform;
+
+/**
+ * Same native library workload with the native frames recorded as PCs and symbolized when the chunk is written
+ */
+public class DeferredSymbolsTest extends NativeLibrariesTest {
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=1ms,deferredsym,cstack=" + (Platform.isMac() ? "fp" : "dwarf");
+    }
+}
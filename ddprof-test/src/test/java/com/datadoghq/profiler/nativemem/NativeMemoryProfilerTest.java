@@ -0,0 +1,85 @@
+package com.datadoghq.profiler.nativemem;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junitpioneer.jupiter.RetryingTest;
+import org.openjdk.jmc.common.item.Aggregators;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.ArrayList;
+import java.util.HashSet;
+import java.util.List;
+import java.util.Set;
+import java.util.zip.Deflater;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.ADDRESS;
+
+public class NativeMemoryProfilerTest extends AbstractProfilerTest {
+    private static final IAttribute<IQuantity> ADDRESS_ATTR = attr("address", "", "", ADDRESS);
+
+    @Override
+    protected String getProfilerCommand() {
+        return "nativemem=64k,cstack=fp";
+    }
+
+    @RetryingTest(5)
+    public void shouldSampleNativeAllocations() throws Exception {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        // every Deflater allocates its zlib state with malloc from libzip or libz
+        List<Deflater> live = new ArrayList<>();
+        byte[] input = new byte[64 * 1024];
+        byte[] output = new byte[64 * 1024];
+        for (int i = 0; i < 2000; i++) {
+            Deflater deflater = new Deflater();
+            deflater.setInput(input);
+            deflater.finish();
+            deflater.deflate(output);
+            if (i % 10 == 0) {
+                live.add(deflater);
+            } else {
+                deflater.end();
+            }
+        }
+        Path recording = Files.createTempFile("nativemem-", ".jfr");
+        try {
+            dump(recording);
+            IItemCollection allocations = verifyEvents(recording, "datadog.NativeAllocationSample");
+            assertTrue(allocations.getAggregate(Aggregators.sum(SIZE)).longValue() > 0);
+            Set<String> sampled = addressesAndSizes(allocations);
+            Set<String> tracked = addressesAndSizes(verifyEvents(recording, "datadog.NativeLiveObject"));
+            // a live block is tracked with the size it was sampled with
+            for (String block : tracked) {
+                assertTrue(sampled.contains(block), block + " was not sampled");
+            }
+        } finally {
+            Files.deleteIfExists(recording);
+            for (Deflater deflater : live) {
+                deflater.end();
+            }
+        }
+    }
+
+    private static Set<String> addressesAndSizes(IItemCollection events) {
+        Set<String> blocks = new HashSet<>();
+        for (IItemIterable items : events) {
+            IMemberAccessor<IQuantity, IItem> addressAccessor = ADDRESS_ATTR.getAccessor(items.getType());
+            IMemberAccessor<IQuantity, IItem> sizeAccessor = SIZE.getAccessor(items.getType());
+            for (IItem item : items) {
+                long size = sizeAccessor.getMember(item).longValue();
+                assertTrue(size > 0);
+                blocks.add(Long.toHexString(addressAccessor.getMember(item).longValue()) + ":" + size);
+            }
+        }
+        return blocks;
+    }
+}
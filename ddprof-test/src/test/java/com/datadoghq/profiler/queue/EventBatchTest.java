@@ -0,0 +1,95 @@
+package com.datadoghq.profiler.queue;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.EventBatch;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCType;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.HashSet;
+import java.util.Set;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertFalse;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.CLASS;
+import static org.openjdk.jmc.common.unit.UnitLookup.PLAIN_TEXT;
+
+public class EventBatchTest extends AbstractProfilerTest {
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms";
+    }
+
+    @Test
+    public void testBatchedEvents() {
+        EventBatch batch = profiler.newEventBatch(100);
+        int endpoint = batch.register("GET /batched");
+        int task = batch.register(EventBatchTest.class.getName());
+        int scheduler = batch.register(Thread.class.getName());
+        int name = batch.register("batched");
+        int value = batch.register("yes");
+        int unit = batch.register("");
+
+        for (int i = 0; i < 50; i++) {
+            assertTrue(batch.addTraceRoot(i, endpoint, 100));
+        }
+        long now = profiler.getCurrentTicks();
+        for (int i = 0; i < 49; i++) {
+            assertTrue(batch.addQueueTime(now - 1000, now, 3, 4, task, scheduler, batch.currentThreadId()));
+        }
+        assertTrue(batch.addSetting(name, value, unit));
+        assertFalse(batch.addSetting(name, value, unit));
+        // an event meeting a busy recording buffer is dropped, so only the recorded ones are checked
+        int recorded = batch.flush();
+        assertTrue(recorded > 0 && recorded <= 100, "recorded " + recorded);
+        assertEquals(0, batch.size());
+        stopProfiler();
+
+        IAttribute<String> endpointAttr = attr("endpoint", "endpoint", "endpoint", PLAIN_TEXT);
+        Set<Long> rootSpans = new HashSet<>();
+        int endpoints = 0;
+        for (IItemIterable it : verifyEvents("datadog.Endpoint")) {
+            IMemberAccessor<String, IItem> endpointAccessor = endpointAttr.getAccessor(it.getType());
+            for (IItem item : it) {
+                assertEquals("GET /batched", endpointAccessor.getMember(item));
+                rootSpans.add(LOCAL_ROOT_SPAN_ID.getAccessor(it.getType()).getMember(item).longValue());
+                endpoints++;
+            }
+        }
+        assertEquals(endpoints, rootSpans.size());
+        assertTrue(endpoints <= 50);
+
+        IAttribute<IMCType> taskAttr = attr("task", "", "", CLASS);
+        IAttribute<IMCType> schedulerAttr = attr("scheduler", "", "", CLASS);
+        int queueTimes = 0;
+        for (IItemIterable it : verifyEvents("datadog.QueueTime")) {
+            for (IItem item : it) {
+                assertEquals(EventBatchTest.class.getName(), taskAttr.getAccessor(it.getType()).getMember(item).getTypeName());
+                assertEquals(Thread.class.getName(), schedulerAttr.getAccessor(it.getType()).getMember(item).getTypeName());
+                assertEquals(3, SPAN_ID.getAccessor(it.getType()).getMember(item).longValue());
+                assertEquals(4, LOCAL_ROOT_SPAN_ID.getAccessor(it.getType()).getMember(item).longValue());
+                queueTimes++;
+            }
+        }
+        assertTrue(queueTimes <= 49);
+
+        IAttribute<String> nameAttr = attr("name", "", "", PLAIN_TEXT);
+        IAttribute<String> valueAttr = attr("value", "", "", PLAIN_TEXT);
+        int settings = 0;
+        for (IItemIterable it : verifyEvents("datadog.ProfilerSetting")) {
+            for (IItem item : it) {
+                if ("batched".equals(nameAttr.getAccessor(it.getType()).getMember(item))) {
+                    assertEquals("yes", valueAttr.getAccessor(it.getType()).getMember(item));
+                    settings++;
+                }
+            }
+        }
+        assertEquals(recorded, endpoints + queueTimes + settings);
+    }
+}
@@ -0,0 +1,58 @@
+package com.datadoghq.profiler.queue;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.IMCType;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.unit.IQuantity;
+import org.openjdk.jmc.common.unit.IRange;
+import org.openjdk.jmc.flightrecorder.JfrAttributes;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.CLASS;
+import static org.openjdk.jmc.common.unit.UnitLookup.EPOCH_MS;
+
+public class QueueTimeFilterTest extends AbstractProfilerTest {
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms,qtmin=5ms";
+    }
+
+    private static final class ShortTask {
+    }
+
+    private static final class LongTask {
+    }
+
+    @Test
+    public void testShortQueueTimesAreDropped() throws Exception {
+        Thread origin = Thread.currentThread();
+        for (int i = 0; i < 1000; i++) {
+            long start = profiler.getCurrentTicks();
+            profiler.recordQueueTime(start, profiler.getCurrentTicks(), ShortTask.class, getClass(), origin);
+        }
+        long start = profiler.getCurrentTicks();
+        Thread.sleep(10);
+        profiler.recordQueueTime(start, profiler.getCurrentTicks(), LongTask.class, getClass(), origin);
+        stopProfiler();
+
+        IAttribute<IMCType> taskAttr = attr("task", "", "", CLASS);
+        IItemCollection events = verifyEvents("datadog.QueueTime");
+        int count = 0;
+        for (IItemIterable it : events) {
+            for (IItem item : it) {
+                assertEquals(LongTask.class.getName(), taskAttr.getAccessor(it.getType()).getMember(item).getTypeName());
+                IRange<IQuantity> lifetime = JfrAttributes.LIFETIME.getAccessor(it.getType()).getMember(item);
+                assertTrue(lifetime.getEnd().longValueIn(EPOCH_MS) - lifetime.getStart().longValueIn(EPOCH_MS) >= 5);
+                assertEquals(1, WEIGHT.getAccessor(it.getType()).getMember(item).longValue());
+                count++;
+            }
+        }
+        assertEquals(1, count);
+    }
+}
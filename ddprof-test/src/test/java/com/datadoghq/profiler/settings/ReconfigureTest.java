@@ -0,0 +1,69 @@
+package com.datadoghq.profiler.settings;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+
+import java.util.HashSet;
+import java.util.Set;
+import java.util.concurrent.ThreadLocalRandom;
+
+import static org.junit.jupiter.api.Assertions.assertThrows;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.PLAIN_TEXT;
+
+public class ReconfigureTest extends AbstractProfilerTest {
+    private static volatile long sink;
+
+    @Test
+    public void testReconfigureRunningEngines() throws Exception {
+        Assumptions.assumeTrue(!Platform.isJ9());
+        registerCurrentThreadForWallClockProfiling();
+        burn();
+        profiler.execute("reconfigure,cpu=5ms,walltpt=32,jstackdepth=64");
+        burn();
+        // the allocation sampler has not been started
+        assertThrows(IllegalStateException.class, () -> profiler.execute("reconfigure,memory=1024"));
+        // back to the interval of the start command, which the chunk config is checked against
+        profiler.execute("reconfigure,cpu=10ms");
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ProfilerSetting");
+        IAttribute<String> nameAttr = attr("name", "", "", PLAIN_TEXT);
+        IAttribute<String> valueAttr = attr("value", "", "", PLAIN_TEXT);
+        Set<String> settings = new HashSet<>();
+        for (IItemIterable items : events) {
+            IMemberAccessor<String, IItem> nameAccessor = nameAttr.getAccessor(items.getType());
+            IMemberAccessor<String, IItem> valueAccessor = valueAttr.getAccessor(items.getType());
+            for (IItem setting : items) {
+                settings.add(nameAccessor.getMember(setting) + "=" + valueAccessor.getMember(setting));
+            }
+        }
+        assertTrue(settings.contains("cpuInterval=5000000"), settings.toString());
+        assertTrue(settings.contains("wallThreadsPerTick=32"), settings.toString());
+        assertTrue(settings.contains("jstackdepth=64"), settings.toString());
+        assertTrue(settings.contains("cpuInterval=10000000"), settings.toString());
+        // the samples keep flowing into the same recording
+        verifyEvents("datadog.ExecutionSample");
+    }
+
+    private static void burn() {
+        long blackhole = sink;
+        for (int i = 0; i < 20_000_000; i++) {
+            blackhole ^= ThreadLocalRandom.current().nextLong();
+        }
+        sink = blackhole;
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "cpu=10ms,wall=10ms";
+    }
+}
@@ -0,0 +1,25 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.Aggregators;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class BudgetedSleepTest extends AbstractProfilerTest {
+
+    @Test
+    public void testSleep() throws InterruptedException {
+        registerCurrentThreadForWallClockProfiling();
+        Thread.sleep(3000);
+        stopProfiler();
+        // the budget may lower the sampling rate, but never below one thread per tick
+        assertTrue(verifyEvents("datadog.MethodSample").getAggregate(Aggregators.count()).longValue() > 0);
+        verifyEvents("datadog.WallClockSamplingEpoch");
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wall=10ms,wallbudget=100us";
+    }
+}
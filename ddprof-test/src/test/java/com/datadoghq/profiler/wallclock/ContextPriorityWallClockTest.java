@@ -0,0 +1,44 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import static org.junit.jupiter.api.Assertions.assertEquals;
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class ContextPriorityWallClockTest extends AbstractProfilerTest {
+
+    @Test
+    public void testIdleThreadWeight() throws InterruptedException {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9() && !Platform.isZing());
+        registerCurrentThreadForWallClockProfiling();
+        Thread.sleep(2000);
+        stopProfiler();
+        IItemCollection events = verifyEvents("datadog.MethodSample");
+        long samples = 0;
+        for (IItemIterable wallclockSamples : events) {
+            IMemberAccessor<IQuantity, IItem> spanIdAccessor = SPAN_ID.getAccessor(wallclockSamples.getType());
+            IMemberAccessor<IQuantity, IItem> weightAccessor = WEIGHT.getAccessor(wallclockSamples.getType());
+            for (IItem sample : wallclockSamples) {
+                if (spanIdAccessor.getMember(sample).longValue() == 0) {
+                    // a thread without a span is picked with a quarter of the probability and carries the inverse as weight
+                    assertEquals(0, weightAccessor.getMember(sample).longValue() % 4);
+                    samples++;
+                }
+            }
+        }
+        assertTrue(samples > 0);
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wall=10ms,wallpriority=4";
+    }
+}
@@ -0,0 +1,32 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.Aggregators;
+
+import java.util.Map;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class IdleStackReuseTest extends AbstractProfilerTest {
+
+    @Test
+    public void testSleep() throws InterruptedException {
+        Assumptions.assumeFalse(Platform.isJ9());
+        registerCurrentThreadForWallClockProfiling();
+        Thread.sleep(1000);
+        Map<String, Long> debugCounters = profiler.getDebugCounters();
+        stopProfiler();
+        // the sleeping thread keeps its stack, so after the first walk the trace is reused
+        assertTrue(debugCounters.getOrDefault("wall_stacks_reused", 0L) > 0);
+        verifyStackTraces("datadog.MethodSample", "testSleep");
+        assertTrue(verifyEvents("datadog.MethodSample").getAggregate(Aggregators.count()).longValue() > 90);
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wall=10ms,wallidle";
+    }
+}
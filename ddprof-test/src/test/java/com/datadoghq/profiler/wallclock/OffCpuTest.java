@@ -0,0 +1,51 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.Aggregators;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.ItemFilters;
+import org.openjdk.jmc.common.unit.UnitLookup;
+import org.openjdk.jmc.flightrecorder.JfrAttributes;
+import org.openjdk.jmc.flightrecorder.JfrLoaderToolkit;
+
+import java.nio.file.Files;
+import java.nio.file.Path;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class OffCpuTest extends AbstractProfilerTest {
+
+    @Test
+    public void testSleepIsMeasured() throws Exception {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        for (int i = 0; i < 10; i++) {
+            idle();
+        }
+        Path recording = Files.createTempFile("off-cpu-", ".jfr");
+        try {
+            dump(recording);
+            // the context switch events need perf_events access and Linux 5.13+, the engine is not started otherwise
+            Assumptions.assumeTrue(JfrLoaderToolkit.loadEvents(Files.newInputStream(recording))
+                    .apply(ItemFilters.type("datadog.OffCpuSample")).hasItems());
+            IItemCollection samples = verifyEvents(recording, "datadog.OffCpuSample");
+            // the episodes are measured, not sampled: the sleeps alone add up to a second
+            long offCpuMillis = samples.getAggregate(Aggregators.sum(JfrAttributes.DURATION)).longValueIn(UnitLookup.MILLISECOND);
+            assertTrue(offCpuMillis >= 900, "off-CPU time " + offCpuMillis + "ms");
+            verifyStackTraces(recording, "datadog.OffCpuSample", "idle");
+        } finally {
+            Files.deleteIfExists(recording);
+        }
+    }
+
+    private static void idle() throws InterruptedException {
+        Thread.sleep(100);
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wallswitch=1ms";
+    }
+}
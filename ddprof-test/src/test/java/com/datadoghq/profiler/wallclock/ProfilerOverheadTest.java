@@ -0,0 +1,39 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.Aggregators;
+import org.openjdk.jmc.common.item.IAttribute;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.unit.IQuantity;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+import static org.openjdk.jmc.common.unit.UnitLookup.MEMORY;
+import static org.openjdk.jmc.common.unit.UnitLookup.TIMESPAN;
+
+public class ProfilerOverheadTest extends AbstractProfilerTest {
+    private static final IAttribute<IQuantity> WALL_HANDLER_TIME = attr("wallHandlerTime", "", "", TIMESPAN);
+    private static final IAttribute<IQuantity> SAMPLER_CPU_TIME = attr("samplerCpuTime", "", "", TIMESPAN);
+    private static final IAttribute<IQuantity> NATIVE_MEMORY = attr("nativeMemory", "", "", MEMORY);
+
+    @Test
+    public void testOverheadIsReported() throws InterruptedException {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        registerCurrentThreadForWallClockProfiling();
+        Thread.sleep(2000);
+        stopProfiler();
+
+        IItemCollection events = verifyEvents("datadog.ProfilerOverhead");
+        assertTrue(events.getAggregate(Aggregators.sum(WALL_HANDLER_TIME)).longValue() > 0);
+        assertTrue(events.getAggregate(Aggregators.sum(SAMPLER_CPU_TIME)).longValue() > 0);
+        assertTrue(events.getAggregate(Aggregators.max(NATIVE_MEMORY)).longValue() > 0);
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wall=10ms,selfoverhead";
+    }
+}
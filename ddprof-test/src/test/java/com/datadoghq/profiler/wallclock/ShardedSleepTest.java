@@ -0,0 +1,24 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.Aggregators;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+
+public class ShardedSleepTest extends AbstractProfilerTest {
+
+    @Test
+    public void testSleep() throws InterruptedException {
+        registerCurrentThreadForWallClockProfiling();
+        Thread.sleep(1000);
+        stopProfiler();
+        assertTrue(verifyEvents("datadog.MethodSample").getAggregate(Aggregators.count()).longValue() > 90);
+        verifyEvents("datadog.WallClockSamplingEpoch");
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wall=10ms,wallshards=4,walltpt=16";
+    }
+}
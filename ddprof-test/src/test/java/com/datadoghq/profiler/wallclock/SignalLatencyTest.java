@@ -0,0 +1,55 @@
+package com.datadoghq.profiler.wallclock;
+
+import com.datadoghq.profiler.AbstractProfilerTest;
+import com.datadoghq.profiler.Platform;
+import org.junit.jupiter.api.Assumptions;
+import org.junit.jupiter.api.Test;
+import org.openjdk.jmc.common.item.IItem;
+import org.openjdk.jmc.common.item.IItemCollection;
+import org.openjdk.jmc.common.item.IItemIterable;
+import org.openjdk.jmc.common.item.IMemberAccessor;
+import org.openjdk.jmc.common.unit.IQuantity;
+import org.openjdk.jmc.common.unit.UnitLookup;
+
+import java.util.Map;
+
+import static org.junit.jupiter.api.Assertions.assertTrue;
+import static org.openjdk.jmc.common.item.Attribute.attr;
+
+public class SignalLatencyTest extends AbstractProfilerTest {
+
+    @Test
+    public void testWallLatency() throws InterruptedException {
+        Assumptions.assumeTrue(Platform.isLinux() && !Platform.isJ9());
+        registerCurrentThreadForWallClockProfiling();
+        Thread.sleep(2000);
+        Map<String, Long> debugCounters = profiler.getDebugCounters();
+        stopProfiler();
+        long handled = 0;
+        long delivered = 0;
+        for (Map.Entry<String, Long> counter : debugCounters.entrySet()) {
+            if (counter.getKey().startsWith("wall_handler_")) {
+                handled += counter.getValue();
+            } else if (counter.getKey().startsWith("wall_delivery_")) {
+                delivered += counter.getValue();
+            }
+        }
+        assertTrue(handled > 0);
+        assertTrue(delivered > 0);
+
+        IItemCollection events = verifyEvents("datadog.SignalLatency");
+        long samples = 0;
+        for (IItemIterable summaries : events) {
+            IMemberAccessor<IQuantity, IItem> samplesAccessor = attr("samples", "", "", UnitLookup.NUMBER).getAccessor(summaries.getType());
+            for (IItem summary : summaries) {
+                samples += samplesAccessor.getMember(summary).longValue();
+            }
+        }
+        assertTrue(samples > 0);
+    }
+
+    @Override
+    protected String getProfilerCommand() {
+        return "wall=10ms,siglatency";
+    }
+}